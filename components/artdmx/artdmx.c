@@ -0,0 +1,714 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#include "espnow_transponder.h"
+#include "artdmx.h"
+#include "artdmx_delta.h"
+
+static const char *TAG = "artdmx";
+
+// Fragments up to this many sequence numbers behind the current frame are
+// treated as late arrivals and dropped. Anything further behind is assumed to
+// be from a sender that restarted.
+#define ARTDMX_STALE_WINDOW 32
+
+// Frames held for synchronized presentation, by default. This needs to
+// cover the presentation delay, plus one frame.
+#define ARTDMX_SYNC_DEPTH 4
+
+// Time a frame is held without a commit, by default
+#define ARTDMX_SYNC_TIMEOUT_US 100000
+
+//! Last transmitted frame for one universe, used as the base for deltas
+typedef struct {
+    bool valid;                         //!< True once a frame has been sent
+    uint8_t sequence;                   //!< Sequence number of the last frame
+    uint16_t length;                    //!< Length of the last frame
+    uint16_t frames_since_keyframe;     //!< Deltas sent since the last full frame
+    uint8_t data[ARTDMX_UNIVERSE_SIZE]; //!< Last frame data
+} universe_history_t;
+
+//! Reassembly state for one universe
+typedef struct {
+    bool assembling;                    //!< True if a frame is partially received
+    bool started;                       //!< True once any fragment has been received
+    bool base_valid;                    //!< True if data holds the complete frame 'sequence'
+    uint8_t sequence;                   //!< Sequence number of the current (or last) frame
+    uint8_t fragment_count;             //!< Number of fragments in the frame being assembled
+    uint16_t received;                  //!< Bitmask of fragments received so far
+    uint16_t length;                    //!< Frame length, from the most recent final fragment
+    bool timestamped;                   //!< True if the frame carried a timestamp
+    uint32_t sent_us;                   //!< Sender timestamp of the frame
+    uint8_t data[ARTDMX_UNIVERSE_SIZE]; //!< Frame data. Slots from missing fragments keep their previous value.
+} universe_assembly_t;
+
+static artdmx_sender_config_t sender_config;
+static artdmx_sender_stats_t sender_stats;
+static universe_history_t *histories = NULL;
+static artdmx_timestamp_t frame_trailer; //!< Timestamp trailer of the frame being sent
+
+// Fragments are handed to the transponder in batches of up to this many
+#define ARTDMX_BATCH_SIZE 32
+
+//! Fragments waiting to be sent. Each is a copy of its header, plus the
+//! caller's data and the frame trailer, which are sent without copying.
+typedef struct {
+    uint8_t headers[ARTDMX_BATCH_SIZE][sizeof(artdmx_packet_t)];
+    espnow_transponder_iovec_t parts[ARTDMX_BATCH_SIZE][3];
+    espnow_transponder_message_t messages[ARTDMX_BATCH_SIZE];
+    uint16_t count;
+} fragment_batch_t;
+
+static fragment_batch_t batch;
+
+static artdmx_receiver_config_t receiver_config;
+static artdmx_receiver_stats_t receiver_stats;
+static universe_assembly_t *assemblies = NULL;
+
+// Synchronized presentation. The receiving task adds frames and commits, and
+// the sync task presents them; the lock keeps them apart.
+static frame_sync_t frame_sync;
+static SemaphoreHandle_t sync_lock = NULL;
+static TaskHandle_t sync_task_hdl = NULL;
+
+//! Wakes the sync task when a frame is due, which a tick is too coarse for
+static esp_timer_handle_t sync_timer = NULL;
+
+esp_err_t artdmx_sender_init(const artdmx_sender_config_t *config) {
+    if(config == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    histories = calloc(config->universe_count, sizeof(universe_history_t));
+    if(histories == NULL) {
+        ESP_LOGE(TAG, "Could not allocate memory for %i universes", config->universe_count);
+        return ESP_ERR_NO_MEM;
+    }
+
+    sender_config = *config;
+    memset(&sender_stats, 0, sizeof(sender_stats));
+
+    return ESP_OK;
+}
+
+//! \brief Length of the trailer added to every packet
+static inline uint16_t trailer_length()
+{
+    return sender_config.timestamps ? sizeof(artdmx_timestamp_t) : 0;
+}
+
+//! \brief Describe a packet as parts for the transponder, adding the timestamp trailer if enabled
+//!
+//! \param parts Parts to fill in, room for 3
+//! \param header Packet header, or a whole packet
+//! \param header_length Length of the header
+//! \param data Data following the header, or NULL
+//! \param data_length Length of the data
+//! \return Number of parts
+static uint8_t packet_parts(espnow_transponder_iovec_t *parts, uint8_t *header, uint16_t header_length,
+                            const uint8_t *data, uint16_t data_length)
+{
+    uint8_t count = 0;
+    parts[count++] = (espnow_transponder_iovec_t){ .data = header, .length = header_length };
+
+    if(data_length > 0)
+        parts[count++] = (espnow_transponder_iovec_t){ .data = data, .length = data_length };
+
+    if(sender_config.timestamps) {
+        ((artdmx_packet_t *)header)->type |= ARTDMX_FLAG_TIMESTAMP;
+        parts[count++] = (espnow_transponder_iovec_t){ .data = &frame_trailer, .length = sizeof(frame_trailer) };
+    }
+
+    return count;
+}
+
+//! \brief Hand the batched fragments to the transponder
+//!
+//! \return ESP_OK if all of them were sent
+static esp_err_t batch_flush()
+{
+    if(batch.count == 0)
+        return ESP_OK;
+
+    const esp_err_t ret = espnow_transponder_send_batch(batch.messages, batch.count);
+
+    for(uint16_t index = 0; index < batch.count; index++) {
+        if(batch.messages[index].result != ESP_OK)
+            continue;
+
+        for(uint8_t part = 0; part < batch.messages[index].part_count; part++)
+            sender_stats.bytes += batch.parts[index][part].length;
+    }
+
+    batch.count = 0;
+    return ret;
+}
+
+//! \brief Add a fragment to the batch, sending the batch if it is full
+//!
+//! \param header Fragment header, copied
+//! \param data Fragment data, which must stay valid until the batch is flushed
+//! \param data_length Length of the data
+//! \return ESP_OK, or the error of a fragment sent because the batch was full
+static esp_err_t batch_add(const artdmx_packet_t *header, const uint8_t *data, uint16_t data_length)
+{
+    const uint16_t index = batch.count++;
+    memcpy(batch.headers[index], header, sizeof(artdmx_packet_t));
+    batch.messages[index].parts = batch.parts[index];
+    batch.messages[index].part_count = packet_parts(batch.parts[index], batch.headers[index], sizeof(artdmx_packet_t),
+                                                    data, data_length);
+
+    if(batch.count < ARTDMX_BATCH_SIZE)
+        return ESP_OK;
+
+    return batch_flush();
+}
+
+//! \brief Send a frame as a delta against the last transmitted frame
+//!
+//! \return ESP_OK if the delta was sent, ESP_ERR_NOT_SUPPORTED if a full frame should be sent instead
+static esp_err_t send_delta(universe_history_t *history, uint16_t universe, uint8_t sequence,
+                            const uint8_t *data, uint16_t data_length)
+{
+    if(!history->valid
+        || history->length != data_length
+        || history->frames_since_keyframe + 1 >= sender_config.keyframe_interval)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    const uint16_t max_runs_length = espnow_transponder_max_packet_size() - sizeof(artdmx_delta_packet_t)
+        - trailer_length();
+    uint8_t packet_buffer[sizeof(artdmx_delta_packet_t) + max_runs_length];
+    artdmx_delta_packet_t *header = (artdmx_delta_packet_t *)packet_buffer;
+
+    const int runs_length = artdmx_delta_encode(history->data, data, data_length, header->runs, max_runs_length);
+    if(runs_length < 0)
+        return ESP_ERR_NOT_SUPPORTED;
+
+    header->universe = universe;
+    header->sequence = sequence;
+    header->type = ARTDMX_TYPE_DELTA;
+    header->base_sequence = history->sequence;
+    header->length = data_length;
+
+    const uint16_t packet_length = sizeof(artdmx_delta_packet_t) + runs_length;
+    espnow_transponder_iovec_t parts[3];
+    const esp_err_t ret = espnow_transponder_sendv(parts, packet_parts(parts, packet_buffer, packet_length, NULL, 0));
+
+    // Even if the send failed, receivers can't have this frame, so the base
+    // for the next delta doesn't change.
+    if(ret == ESP_OK) {
+        memcpy(history->data, data, data_length);
+        history->sequence = sequence;
+        history->frames_since_keyframe++;
+
+        sender_stats.deltas++;
+        sender_stats.bytes += packet_length + trailer_length();
+    }
+
+    return ret;
+}
+
+//! \brief Send a full frame, split into a fixed number of fragments
+//!
+//! The fragments are added to the batch, and point into the caller's data.
+static esp_err_t send_fragments(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length,
+                                uint8_t fragment_count)
+{
+    const uint16_t fragment_length = (data_length + fragment_count - 1)/fragment_count;
+
+    artdmx_packet_t header = {
+        .universe = universe,
+        .sequence = sequence,
+        .type = ARTDMX_TYPE_DATA,
+        .fragment_count = fragment_count,
+    };
+
+    esp_err_t ret = ESP_OK;
+
+    for(uint8_t fragment = 0; fragment < fragment_count; fragment++) {
+        const uint16_t offset = fragment*fragment_length;
+        const uint16_t length = (data_length - offset) < fragment_length ? (data_length - offset) : fragment_length;
+
+        header.fragment = fragment;
+        header.offset = offset;
+
+        const esp_err_t fragment_ret = batch_add(&header, data + offset, length);
+        if(fragment_ret != ESP_OK)
+            ret = fragment_ret;
+    }
+
+    return ret;
+}
+
+//! \brief Send a full frame as a single packet, if it compresses enough
+//!
+//! \return ESP_ERR_INVALID_SIZE if it didn't fit
+static esp_err_t send_compressed(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    artdmx_packet_t header = {
+        .universe = universe,
+        .sequence = sequence,
+        .type = ARTDMX_TYPE_DATA,
+        .fragment = 0,
+        .fragment_count = 1,
+        .offset = 0,
+    };
+
+    espnow_transponder_iovec_t parts[3];
+    const esp_err_t ret = espnow_transponder_sendv(parts, packet_parts(parts, (uint8_t *)&header, sizeof(header),
+                                                                       data, data_length));
+    if(ret == ESP_OK)
+        sender_stats.bytes += sizeof(header) + data_length + trailer_length();
+
+    return ret;
+}
+
+//! \brief Send a full frame, in as few fragments as possible
+static esp_err_t send_keyframe(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    sender_stats.keyframes++;
+
+    const uint16_t max_fragment_length = espnow_transponder_max_packet_size() - sizeof(artdmx_packet_t)
+        - trailer_length();
+    if(data_length <= max_fragment_length)
+        return send_fragments(universe, sequence, data, data_length, 1);
+
+    // If it might compress into a single packet, try that first. Whether it
+    // fits is only known once it's sent, so it can't wait in the batch.
+    if(sizeof(artdmx_packet_t) + data_length + trailer_length() <= espnow_transponder_max_compressed_size()) {
+        const esp_err_t ret = send_compressed(universe, sequence, data, data_length);
+        if(ret != ESP_ERR_INVALID_SIZE)
+            return ret;
+    }
+
+    const uint8_t fragment_count = (data_length + max_fragment_length - 1)/max_fragment_length;
+    return send_fragments(universe, sequence, data, data_length, fragment_count);
+}
+
+//! \brief Send a universe, adding any fragments to the batch
+static esp_err_t send_universe(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    if(data_length > ARTDMX_UNIVERSE_SIZE) {
+        ESP_LOGE(TAG, "Universe too big, size:%i max:%i", data_length, ARTDMX_UNIVERSE_SIZE);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if(histories == NULL || sender_config.keyframe_interval == 0 || universe >= sender_config.universe_count)
+        return send_keyframe(universe, sequence, data, data_length);
+
+    universe_history_t *history = &histories[universe];
+
+    const esp_err_t ret = send_delta(history, universe, sequence, data, data_length);
+    if(ret != ESP_ERR_NOT_SUPPORTED)
+        return ret;
+
+    // Remember the frame even if some fragments failed to send. Receivers
+    // that missed them will drop deltas until the next keyframe.
+    memcpy(history->data, data, data_length);
+    history->valid = true;
+    history->sequence = sequence;
+    history->length = data_length;
+    history->frames_since_keyframe = 0;
+
+    return send_keyframe(universe, sequence, data, data_length);
+}
+
+esp_err_t artdmx_send(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length) {
+    // Every fragment of the frame carries the same timestamp
+    frame_trailer.sent_us = (uint32_t)esp_timer_get_time();
+
+    const esp_err_t ret = send_universe(universe, sequence, data, data_length);
+    const esp_err_t flush_ret = batch_flush();
+
+    return ret != ESP_OK ? ret : flush_ret;
+}
+
+esp_err_t artdmx_send_sync(uint8_t sequence, uint32_t delay_us) {
+    const uint32_t now_us = (uint32_t)esp_timer_get_time();
+    const artdmx_sync_packet_t packet = {
+        .universe = ARTDMX_SYNC_UNIVERSE,
+        .sequence = sequence,
+        .type = ARTDMX_TYPE_SYNC,
+        .sent_us = now_us,
+        .present_us = now_us + delay_us,
+    };
+
+    // Commits skip ahead of queued universes, so that the sender clock they
+    // carry isn't thrown off by how long they waited
+    const espnow_transponder_iovec_t part = { .data = &packet, .length = sizeof(packet) };
+    return espnow_transponder_sendv_class(&part, 1, ESPNOW_TRANSPONDER_CLASS_SYNC);
+}
+
+esp_err_t artdmx_send_frame(uint16_t first_universe, uint16_t universe_count, uint8_t sequence,
+                            const uint8_t *data, uint16_t universe_size) {
+    frame_trailer.sent_us = (uint32_t)esp_timer_get_time();
+
+    esp_err_t ret = ESP_OK;
+    for(uint16_t universe = 0; universe < universe_count; universe++) {
+        const esp_err_t universe_ret = send_universe(first_universe + universe, sequence,
+                                                     data + universe*universe_size, universe_size);
+        if(universe_ret != ESP_OK)
+            ret = universe_ret;
+    }
+
+    const esp_err_t flush_ret = batch_flush();
+    if(flush_ret != ESP_OK)
+        ret = flush_ret;
+
+    // Commit the frame even if some of it failed to send; receivers present
+    // what they got
+    if(sender_config.sync_delay_us > 0) {
+        const esp_err_t sync_ret = artdmx_send_sync(sequence, sender_config.sync_delay_us);
+        if(sync_ret != ESP_OK)
+            ret = sync_ret;
+    }
+
+    return ret;
+}
+
+void artdmx_sender_get_statistics(artdmx_sender_stats_t *stats) {
+    memcpy(stats, &sender_stats, sizeof(artdmx_sender_stats_t));
+}
+
+//! \brief Pass a universe of a synchronized frame to the callback, as it is presented
+static void sync_present(void *context, uint16_t universe, uint8_t sequence, const uint8_t *data,
+                         uint16_t data_length)
+{
+    receiver_config.callback(universe, sequence, data, data_length);
+}
+
+//! \brief Sync timer callback, wakes the sync task when a frame is due
+static void sync_timer_cb(void *arg)
+{
+    xTaskNotifyGive(sync_task_hdl);
+}
+
+//! \brief Presents held frames when they are due
+static void sync_task(void *pvParameter)
+{
+    while(true) {
+        xSemaphoreTake(sync_lock, portMAX_DELAY);
+        int64_t now_us = esp_timer_get_time();
+        const int64_t next_us = frame_sync_poll(&frame_sync, now_us);
+
+        // Measure latency on the sender's clock too
+        if(receiver_config.telemetry != NULL && frame_sync.clock.valid)
+            telemetry_set_clock_offset(receiver_config.telemetry,
+                                       (int32_t)(clock_sync_remote(&frame_sync.clock, now_us) - now_us));
+        xSemaphoreGive(sync_lock);
+
+        // New frames and commits wake the task too, as they can move the next one up
+        if(next_us == INT64_MAX) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        now_us = esp_timer_get_time();
+        if(next_us <= now_us)
+            continue;
+
+        esp_timer_stop(sync_timer);
+        esp_timer_start_once(sync_timer, next_us - now_us);
+        ulTaskNotifyTake(pdTRUE, (next_us - now_us)/1000/portTICK_PERIOD_MS + 1);
+    }
+}
+
+//! \brief Set up synchronized presentation
+static esp_err_t sync_init(const artdmx_receiver_config_t *config)
+{
+    const uint8_t depth = config->sync_depth > 0 ? config->sync_depth : ARTDMX_SYNC_DEPTH;
+    const uint32_t timeout_us = config->sync_timeout_us > 0 ? config->sync_timeout_us : ARTDMX_SYNC_TIMEOUT_US;
+
+    if(!frame_sync_init(&frame_sync, config->universe_count, depth, timeout_us, sync_present, NULL)) {
+        ESP_LOGE(TAG, "Could not allocate memory to hold %i frames", depth);
+        return ESP_ERR_NO_MEM;
+    }
+
+    sync_lock = xSemaphoreCreateMutex();
+    if(sync_lock == NULL) {
+        ESP_LOGE(TAG, "Create sync lock fail");
+        return ESP_FAIL;
+    }
+
+    const esp_timer_create_args_t sync_timer_args = {
+        .callback = sync_timer_cb,
+        .name = "artdmx_sync",
+    };
+    if(esp_timer_create(&sync_timer_args, &sync_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Create sync timer fail");
+        return ESP_FAIL;
+    }
+
+    // Above the transponder task, so that presenting isn't held up by receiving
+    if(xTaskCreate(sync_task, "artdmx_sync", 2048, NULL, 5, &sync_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create sync task fail");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t artdmx_receiver_init(const artdmx_receiver_config_t *config) {
+    if(config == NULL || config->callback == NULL)
+        return ESP_ERR_INVALID_ARG;
+
+    assemblies = calloc(config->universe_count, sizeof(universe_assembly_t));
+    if(assemblies == NULL) {
+        ESP_LOGE(TAG, "Could not allocate memory for %i universes", config->universe_count);
+        return ESP_ERR_NO_MEM;
+    }
+
+    receiver_config = *config;
+    memset(&receiver_stats, 0, sizeof(receiver_stats));
+
+    if(config->sync)
+        return sync_init(config);
+
+    return ESP_OK;
+}
+
+//! \brief Record a frame, then pass it to the callback, or hold it until it is presented
+static void emit_frame(uint16_t universe, const universe_assembly_t *assembly, uint16_t length)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    if(receiver_config.telemetry != NULL)
+        telemetry_record(receiver_config.telemetry, universe, assembly->sequence,
+                         assembly->timestamped, assembly->sent_us, now_us);
+
+    if(!receiver_config.sync) {
+        receiver_config.callback(universe, assembly->sequence, assembly->data, length);
+        return;
+    }
+
+    xSemaphoreTake(sync_lock, portMAX_DELAY);
+    frame_sync_add(&frame_sync, universe, assembly->sequence, assembly->data, length, now_us);
+    xSemaphoreGive(sync_lock);
+    xTaskNotifyGive(sync_task_hdl);
+}
+
+//! \brief Handle a sync packet, which commits a frame
+static void receive_sync(const uint8_t *data, uint16_t data_length)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    if(data_length != sizeof(artdmx_sync_packet_t)) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    receiver_stats.sync_packets++;
+    if(!receiver_config.sync)
+        return;
+
+    artdmx_sync_packet_t packet;
+    memcpy(&packet, data, sizeof(packet));
+
+    xSemaphoreTake(sync_lock, portMAX_DELAY);
+    frame_sync_commit(&frame_sync, packet.sequence, packet.sent_us, packet.present_us, now_us);
+    xSemaphoreGive(sync_lock);
+    xTaskNotifyGive(sync_task_hdl);
+}
+
+//! \brief Finish the frame that is being assembled
+//!
+//! \param universe Universe number
+//! \param assembly Reassembly state for the universe
+static void assembly_finish(uint16_t universe, universe_assembly_t *assembly)
+{
+    const bool complete = (assembly->received == (1u << assembly->fragment_count) - 1);
+
+    assembly->assembling = false;
+    assembly->base_valid = complete;
+
+    if(complete) {
+        receiver_stats.frames++;
+    }
+    else if(receiver_config.partial_policy == ARTDMX_PARTIAL_PATCH) {
+        receiver_stats.partial_patched++;
+    }
+    else {
+        receiver_stats.partial_dropped++;
+        return;
+    }
+
+    // If the final fragment never arrived, the length is unknown; assume the
+    // previous frame's length still applies.
+    const uint16_t length = assembly->length > 0 ? assembly->length : ARTDMX_UNIVERSE_SIZE;
+
+    emit_frame(universe, assembly, length);
+}
+
+//! \brief Apply a delta packet to the last complete frame
+//!
+//! \param assembly Reassembly state for the universe
+//! \param data Packet, without the trailer
+//! \param data_length Length of the packet
+//! \param timestamp Packet trailer, or NULL if it had none
+static void receive_delta(universe_assembly_t *assembly, const uint8_t *data, uint16_t data_length,
+                          const artdmx_timestamp_t *timestamp)
+{
+    if(data_length < sizeof(artdmx_delta_packet_t)) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    const artdmx_delta_packet_t *packet = (const artdmx_delta_packet_t *)data;
+
+    if(!assembly->base_valid
+        || assembly->sequence != packet->base_sequence
+        || assembly->length != packet->length) {
+        receiver_stats.delta_base_mismatch++;
+        return;
+    }
+
+    if(!artdmx_delta_apply(assembly->data, assembly->length, packet->runs, data_length - sizeof(artdmx_delta_packet_t))) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    assembly->sequence = packet->sequence;
+    assembly->timestamped = (timestamp != NULL);
+    assembly->sent_us = timestamp != NULL ? timestamp->sent_us : 0;
+    receiver_stats.deltas++;
+
+    emit_frame(packet->universe, assembly, assembly->length);
+}
+
+//! \brief Add a fragment to the frame being assembled
+//!
+//! \param assembly Reassembly state for the universe
+//! \param data Packet, without the trailer
+//! \param data_length Length of the packet
+//! \param timestamp Packet trailer, or NULL if it had none
+static void receive_fragment(universe_assembly_t *assembly, const uint8_t *data, uint16_t data_length,
+                             const artdmx_timestamp_t *timestamp)
+{
+    if(data_length < sizeof(artdmx_packet_t)) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    const artdmx_packet_t *packet = (const artdmx_packet_t *)data;
+    const uint16_t length = data_length - sizeof(artdmx_packet_t);
+
+    if(packet->fragment_count == 0
+        || packet->fragment_count > ARTDMX_MAX_FRAGMENTS
+        || packet->fragment >= packet->fragment_count
+        || packet->offset + length > ARTDMX_UNIVERSE_SIZE) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    if(!assembly->assembling) {
+        assembly->assembling = true;
+        assembly->sequence = packet->sequence;
+        assembly->fragment_count = packet->fragment_count;
+        assembly->received = 0;
+        assembly->timestamped = (timestamp != NULL);
+        assembly->sent_us = timestamp != NULL ? timestamp->sent_us : 0;
+    }
+
+    if(packet->fragment_count != assembly->fragment_count) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    memcpy(assembly->data + packet->offset, packet->data, length);
+    assembly->received |= (1u << packet->fragment);
+    if(packet->fragment == packet->fragment_count - 1)
+        assembly->length = packet->offset + length;
+
+    receiver_stats.fragments++;
+
+    if(assembly->received == (1u << assembly->fragment_count) - 1)
+        assembly_finish(packet->universe, assembly);
+}
+
+void artdmx_receive(const uint8_t *data, uint16_t data_length) {
+    if(assemblies == NULL)
+        return;
+
+    // The universe, sequence and type fields are common to all packet types
+    if(data_length < offsetof(artdmx_packet_t, fragment)) {
+        receiver_stats.bad_fragments++;
+        return;
+    }
+
+    const artdmx_packet_t *packet = (const artdmx_packet_t *)data;
+
+    // Sync packets aren't for any one universe
+    if((packet->type & ARTDMX_TYPE_MASK) == ARTDMX_TYPE_SYNC) {
+        receive_sync(data, data_length);
+        return;
+    }
+
+    // Strip the timestamp trailer, so the rest of the packet parses as usual
+    artdmx_timestamp_t trailer;
+    const artdmx_timestamp_t *timestamp = NULL;
+    if(packet->type & ARTDMX_FLAG_TIMESTAMP) {
+        if(data_length < offsetof(artdmx_packet_t, fragment) + sizeof(trailer)) {
+            receiver_stats.bad_fragments++;
+            return;
+        }
+
+        data_length -= sizeof(trailer);
+        memcpy(&trailer, data + data_length, sizeof(trailer));
+        timestamp = &trailer;
+    }
+
+    if(packet->universe >= receiver_config.universe_count) {
+        receiver_stats.ignored_universe++;
+        return;
+    }
+
+    universe_assembly_t *assembly = &assemblies[packet->universe];
+
+    if(assembly->started) {
+        // Sequence numbers wrap, so compare them by their signed difference
+        const int8_t age = assembly->sequence - packet->sequence;
+        const bool same_frame = assembly->assembling && age == 0;
+
+        if(!same_frame && age >= 0 && age < ARTDMX_STALE_WINDOW) {
+            receiver_stats.stale_fragments++;
+            return;
+        }
+
+        // A newer frame has started; deal with the unfinished one first
+        if(assembly->assembling && !same_frame)
+            assembly_finish(packet->universe, assembly);
+    }
+
+    assembly->started = true;
+
+    switch(packet->type & ARTDMX_TYPE_MASK) {
+        case ARTDMX_TYPE_DATA:
+            receive_fragment(assembly, data, data_length, timestamp);
+            break;
+        case ARTDMX_TYPE_DELTA:
+            receive_delta(assembly, data, data_length, timestamp);
+            break;
+        default:
+            receiver_stats.bad_fragments++;
+            break;
+    }
+}
+
+void artdmx_receiver_get_statistics(artdmx_receiver_stats_t *stats) {
+    memcpy(stats, &receiver_stats, sizeof(artdmx_receiver_stats_t));
+}
+
+void artdmx_receiver_get_sync_report(frame_sync_report_t *report) {
+    memset(report, 0, sizeof(*report));
+    if(sync_lock == NULL)
+        return;
+
+    xSemaphoreTake(sync_lock, portMAX_DELAY);
+    frame_sync_report(&frame_sync, report);
+    xSemaphoreGive(sync_lock);
+}
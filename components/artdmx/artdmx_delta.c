@@ -0,0 +1,73 @@
+#include <string.h>
+
+#include "artdmx_delta.h"
+
+int artdmx_delta_encode(const uint8_t *previous, const uint8_t *current, uint16_t length,
+                        uint8_t *out, uint16_t out_max) {
+    uint16_t out_length = 0;
+    uint16_t i = 0;
+
+    while(i < length) {
+        if(current[i] == previous[i]) {
+            i++;
+            continue;
+        }
+
+        // Extend the run over changed slots, and over unchanged gaps that are
+        // shorter than a run header.
+        const uint16_t start = i;
+        uint16_t end = ++i;
+        while(i < length && (i - start) < UINT8_MAX) {
+            if(current[i] != previous[i])
+                end = ++i;
+            else if((i - end) < ARTDMX_DELTA_RUN_HEADER)
+                i++;
+            else
+                break;
+        }
+
+        const uint16_t run = end - start;
+        if(out_length + ARTDMX_DELTA_RUN_HEADER + run > out_max)
+            return -1;
+
+        out[out_length++] = start & 0xFF;
+        out[out_length++] = start >> 8;
+        out[out_length++] = run;
+        memcpy(out + out_length, current + start, run);
+        out_length += run;
+
+        i = end;
+    }
+
+    return out_length;
+}
+
+bool artdmx_delta_apply(uint8_t *frame, uint16_t length, const uint8_t *runs, uint16_t runs_length) {
+    uint16_t position = 0;
+
+    while(position < runs_length) {
+        if(runs_length - position < ARTDMX_DELTA_RUN_HEADER)
+            return false;
+
+        const uint16_t offset = runs[position] | (runs[position + 1] << 8);
+        const uint8_t run = runs[position + 2];
+
+        if(run == 0
+            || offset + run > length
+            || position + ARTDMX_DELTA_RUN_HEADER + run > runs_length)
+            return false;
+
+        position += ARTDMX_DELTA_RUN_HEADER + run;
+    }
+
+    position = 0;
+    while(position < runs_length) {
+        const uint16_t offset = runs[position] | (runs[position + 1] << 8);
+        const uint8_t run = runs[position + 2];
+
+        memcpy(frame + offset, runs + position + ARTDMX_DELTA_RUN_HEADER, run);
+        position += ARTDMX_DELTA_RUN_HEADER + run;
+    }
+
+    return true;
+}
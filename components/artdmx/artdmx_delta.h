@@ -0,0 +1,40 @@
+#pragma once
+
+//! Sparse delta coding for DMX frames
+//!
+//! A delta is a list of runs, each of which replaces a span of slots in the
+//! base frame:
+//!   run[0-1]: slot offset (little endian)
+//!   run[2]: run length, 1-255
+//!   run[3-n]: new slot values
+//! Short unchanged gaps between changed slots are folded into the
+//! surrounding run, since that is cheaper than starting a new run.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! Size of the header at the start of each run
+#define ARTDMX_DELTA_RUN_HEADER 3
+
+//! \brief Encode the difference between two frames
+//!
+//! \param previous Frame the receiver already has
+//! \param current Frame to encode
+//! \param length Length of both frames
+//! \param out Buffer to write the runs to
+//! \param out_max Size of the output buffer
+//! \return Number of bytes written, or -1 if the delta does not fit
+int artdmx_delta_encode(const uint8_t *previous, const uint8_t *current, uint16_t length,
+                        uint8_t *out, uint16_t out_max);
+
+//! \brief Apply an encoded delta to a frame
+//!
+//! The runs are validated before anything is written, so a malformed delta
+//! leaves the frame untouched.
+//!
+//! \param frame Frame to update
+//! \param length Length of the frame
+//! \param runs Encoded runs
+//! \param runs_length Length of the encoded runs
+//! \return true if the delta was valid and applied
+bool artdmx_delta_apply(uint8_t *frame, uint16_t length, const uint8_t *runs, uint16_t runs_length);
@@ -0,0 +1,97 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "frame_store.h"
+
+// Set in 'middle' when it holds a frame that the reader hasn't picked up
+#define FRAME_STORE_FRESH   0x4
+
+#define FRAME_STORE_INDEX   0x3
+
+esp_err_t frame_store_init(frame_store_t *store, uint16_t universe_count) {
+    store->universes = calloc(universe_count, sizeof(frame_store_universe_t));
+    if(store->universes == NULL)
+        return ESP_ERR_NO_MEM;
+
+    store->universe_count = universe_count;
+
+    for(int universe = 0; universe < universe_count; universe++) {
+        frame_store_universe_t *buffer = &store->universes[universe];
+        buffer->write = 0;
+        atomic_init(&buffer->middle, 1);
+        buffer->read = 2;
+        atomic_init(&buffer->published, 0);
+        atomic_init(&buffer->consumed, 0);
+        atomic_init(&buffer->superseded, 0);
+    }
+
+    return ESP_OK;
+}
+
+frame_store_frame_t *frame_store_write_begin(frame_store_t *store, uint16_t universe) {
+    if(universe >= store->universe_count)
+        return NULL;
+
+    frame_store_universe_t *buffer = &store->universes[universe];
+    return &buffer->slots[buffer->write];
+}
+
+void frame_store_write_commit(frame_store_t *store, uint16_t universe) {
+    frame_store_universe_t *buffer = &store->universes[universe];
+
+    // Release makes the frame contents visible before the reader can take the slot
+    const unsigned int previous = atomic_exchange_explicit(&buffer->middle, buffer->write | FRAME_STORE_FRESH,
+                                                           memory_order_acq_rel);
+    buffer->write = previous & FRAME_STORE_INDEX;
+
+    atomic_fetch_add_explicit(&buffer->published, 1, memory_order_relaxed);
+    if(previous & FRAME_STORE_FRESH)
+        atomic_fetch_add_explicit(&buffer->superseded, 1, memory_order_relaxed);
+}
+
+void frame_store_publish(frame_store_t *store, uint16_t universe, uint8_t sequence,
+                         const uint8_t *data, uint16_t data_length, int64_t now_us) {
+    frame_store_frame_t *frame = frame_store_write_begin(store, universe);
+    if(frame == NULL)
+        return;
+
+    if(data_length > ARTDMX_UNIVERSE_SIZE)
+        data_length = ARTDMX_UNIVERSE_SIZE;
+
+    frame->sequence = sequence;
+    frame->length = data_length;
+    frame->published_us = now_us;
+    memcpy(frame->data, data, data_length);
+
+    frame_store_write_commit(store, universe);
+}
+
+bool frame_store_read(frame_store_t *store, uint16_t universe, const frame_store_frame_t **frame) {
+    if(universe >= store->universe_count) {
+        *frame = NULL;
+        return false;
+    }
+
+    frame_store_universe_t *buffer = &store->universes[universe];
+    bool fresh = false;
+
+    if(atomic_load_explicit(&buffer->middle, memory_order_relaxed) & FRAME_STORE_FRESH) {
+        // Acquire pairs with the writer's release, so the frame is complete
+        const unsigned int previous = atomic_exchange_explicit(&buffer->middle, buffer->read,
+                                                               memory_order_acq_rel);
+        buffer->read = previous & FRAME_STORE_INDEX;
+        atomic_fetch_add_explicit(&buffer->consumed, 1, memory_order_relaxed);
+        fresh = true;
+    }
+
+    *frame = &buffer->slots[buffer->read];
+    return fresh;
+}
+
+void frame_store_get_statistics(frame_store_t *store, uint16_t universe, frame_store_stats_t *stats) {
+    const frame_store_universe_t *buffer = &store->universes[universe];
+
+    stats->published = atomic_load(&buffer->published);
+    stats->consumed = atomic_load(&buffer->consumed);
+    stats->superseded = atomic_load(&buffer->superseded);
+}
@@ -0,0 +1,231 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "artdmx.h"
+#include "frame_sync.h"
+
+// Universes up to this many sequence numbers behind the last presented frame
+// are late arrivals, and dropped. Anything further behind is assumed to be
+// from a sender that restarted.
+#define FRAME_SYNC_STALE_WINDOW     32
+
+bool frame_sync_init(frame_sync_t *sync, uint16_t universe_count, uint8_t depth, uint32_t timeout_us,
+                     frame_sync_present_cb_t callback, void *context)
+{
+    memset(sync, 0, sizeof(*sync));
+
+    sync->frames = calloc(depth, sizeof(frame_sync_frame_t));
+    sync->lengths = calloc(depth*universe_count, sizeof(uint16_t));
+    sync->data = malloc(depth*universe_count*ARTDMX_UNIVERSE_SIZE);
+    if(sync->frames == NULL || sync->lengths == NULL || sync->data == NULL || depth == 0) {
+        frame_sync_free(sync);
+        return false;
+    }
+
+    sync->universe_count = universe_count;
+    sync->depth = depth;
+    sync->timeout_us = timeout_us;
+    sync->hold_us = -1;
+    sync->callback = callback;
+    sync->context = context;
+    clock_sync_init(&sync->clock);
+
+    return true;
+}
+
+void frame_sync_free(frame_sync_t *sync)
+{
+    free(sync->frames);
+    free(sync->lengths);
+    free(sync->data);
+    sync->frames = NULL;
+    sync->lengths = NULL;
+    sync->data = NULL;
+}
+
+//! \brief Check if one sequence number comes before another, allowing for wrapping
+static inline bool sequence_before(uint8_t sequence, uint8_t other)
+{
+    return (int8_t)(sequence - other) < 0;
+}
+
+//! \brief Find the slot holding a frame
+//!
+//! \return Slot index, or -1 if the frame isn't held
+static int frame_find(const frame_sync_t *sync, uint8_t sequence)
+{
+    for(int index = 0; index < sync->depth; index++)
+        if(sync->frames[index].used && sync->frames[index].sequence == sequence)
+            return index;
+
+    return -1;
+}
+
+//! \brief Free a slot
+static void frame_release(frame_sync_t *sync, int index)
+{
+    sync->frames[index].used = false;
+    memset(&sync->lengths[index*sync->universe_count], 0, sync->universe_count*sizeof(uint16_t));
+}
+
+//! \brief Get the local time a held frame is due
+static inline int64_t frame_due(const frame_sync_t *sync, const frame_sync_frame_t *frame)
+{
+    if(frame->committed)
+        return frame->present_us;
+
+    const int64_t hold_us = sync->hold_us >= 0 && sync->hold_us < sync->timeout_us ? sync->hold_us : sync->timeout_us;
+    return frame->received_us + hold_us;
+}
+
+//! \brief Hand every universe of a frame to the callback, and free its slot
+static void frame_present(frame_sync_t *sync, int index)
+{
+    const frame_sync_frame_t *frame = &sync->frames[index];
+
+    for(int other = 0; other < sync->depth; other++) {
+        if(sync->frames[other].used && sequence_before(sync->frames[other].sequence, frame->sequence)) {
+            frame_release(sync, other);
+            sync->stats.skipped++;
+        }
+    }
+
+    const uint16_t *lengths = &sync->lengths[index*sync->universe_count];
+    const uint8_t *data = &sync->data[index*sync->universe_count*ARTDMX_UNIVERSE_SIZE];
+    for(uint16_t universe = 0; universe < sync->universe_count; universe++)
+        if(lengths[universe] > 0)
+            sync->callback(sync->context, universe, frame->sequence, data + universe*ARTDMX_UNIVERSE_SIZE,
+                           lengths[universe]);
+
+    sync->presented_valid = true;
+    sync->presented = frame->sequence;
+    frame_release(sync, index);
+}
+
+//! \brief Find the slot holding a frame, or start holding it
+//!
+//! \return Slot index, or -1 if the frame is too old to be held
+static int frame_hold(frame_sync_t *sync, uint8_t sequence, int64_t now_us)
+{
+    if(sync->presented_valid && (uint8_t)(sync->presented - sequence) < FRAME_SYNC_STALE_WINDOW)
+        return -1;
+
+    int index = frame_find(sync, sequence);
+    if(index >= 0)
+        return index;
+
+    // Take a free slot, or make one by presenting the oldest frame
+    int oldest = -1;
+    for(int slot = 0; slot < sync->depth && index < 0; slot++) {
+        if(!sync->frames[slot].used)
+            index = slot;
+        else if(oldest < 0 || sequence_before(sync->frames[slot].sequence, sync->frames[oldest].sequence))
+            oldest = slot;
+    }
+
+    if(index < 0) {
+        if(sequence_before(sequence, sync->frames[oldest].sequence))
+            return -1;
+
+        frame_present(sync, oldest);
+        sync->stats.overruns++;
+        index = oldest;
+    }
+
+    frame_sync_frame_t *frame = &sync->frames[index];
+    frame->used = true;
+    frame->committed = false;
+    frame->sequence = sequence;
+    frame->received_us = now_us;
+
+    return index;
+}
+
+void frame_sync_add(frame_sync_t *sync, uint16_t universe, uint8_t sequence, const uint8_t *data,
+                    uint16_t data_length, int64_t now_us)
+{
+    if(universe >= sync->universe_count || data_length == 0)
+        return;
+
+    if(data_length > ARTDMX_UNIVERSE_SIZE)
+        data_length = ARTDMX_UNIVERSE_SIZE;
+
+    const int index = frame_hold(sync, sequence, now_us);
+    if(index < 0) {
+        sync->stats.stale++;
+        return;
+    }
+
+    sync->lengths[index*sync->universe_count + universe] = data_length;
+    memcpy(&sync->data[(index*sync->universe_count + universe)*ARTDMX_UNIVERSE_SIZE], data, data_length);
+}
+
+void frame_sync_commit(frame_sync_t *sync, uint8_t sequence, uint32_t sent_us, uint32_t present_us,
+                       int64_t now_us)
+{
+    clock_sync_sample(&sync->clock, now_us, sent_us);
+
+    const bool held = frame_find(sync, sequence) >= 0;
+    const int index = frame_hold(sync, sequence, now_us);
+    if(index < 0) {
+        sync->stats.stale_commits++;
+        return;
+    }
+
+    frame_sync_frame_t *frame = &sync->frames[index];
+    if(frame->committed)
+        return;
+
+    frame->committed = true;
+    frame->present_us = clock_sync_local(&sync->clock, clock_sync_unwrap(&sync->clock, now_us, present_us));
+
+    // Frames whose commit is lost are held as long as this one
+    if(held)
+        sync->hold_us = frame->present_us > frame->received_us ? frame->present_us - frame->received_us : 0;
+
+    if(frame->present_us < now_us)
+        sync->stats.late_commits++;
+}
+
+int64_t frame_sync_poll(frame_sync_t *sync, int64_t now_us)
+{
+    // Only the newest frame that is due matters; it drops the older ones
+    int newest = -1;
+    for(int index = 0; index < sync->depth; index++) {
+        const frame_sync_frame_t *frame = &sync->frames[index];
+        if(frame->used && frame_due(sync, frame) <= now_us
+            && (newest < 0 || sequence_before(sync->frames[newest].sequence, frame->sequence)))
+            newest = index;
+    }
+
+    if(newest >= 0) {
+        const frame_sync_frame_t *frame = &sync->frames[newest];
+        const int64_t lateness_us = now_us - frame_due(sync, frame);
+        telemetry_histogram_add(&sync->lateness,
+                                lateness_us < TELEMETRY_HISTOGRAM_LIMIT ? lateness_us : TELEMETRY_HISTOGRAM_LIMIT);
+
+        if(frame->committed)
+            sync->stats.committed++;
+        else
+            sync->stats.timed_out++;
+
+        frame_present(sync, newest);
+    }
+
+    int64_t next_us = INT64_MAX;
+    for(int index = 0; index < sync->depth; index++)
+        if(sync->frames[index].used && frame_due(sync, &sync->frames[index]) < next_us)
+            next_us = frame_due(sync, &sync->frames[index]);
+
+    return next_us;
+}
+
+void frame_sync_report(frame_sync_t *sync, frame_sync_report_t *report)
+{
+    report->stats = sync->stats;
+    telemetry_histogram_drain(&sync->lateness, &report->lateness_us);
+    report->clock_valid = sync->clock.valid;
+    report->clock_error_us = sync->clock.error_us;
+    report->clock_skew = sync->clock.skew;
+    report->clock_resets = sync->clock.resets;
+}
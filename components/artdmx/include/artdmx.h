@@ -0,0 +1,242 @@
+#pragma once
+
+//! Send and receive DMX universes over the ESP-NOW transponder
+//!
+//! ESP-NOW packets have a maximum length of 250 bytes, which is a little
+//! less than half of a full DMX512 universe. To send a full universe, it is
+//! split into several fragments, each of which carries its slot offset and
+//! the number of fragments in the frame. The receiver reassembles the
+//! fragments for each universe, and emits a frame once all fragments with
+//! the same sequence number have arrived.
+//!
+//! If the sender is configured with a keyframe interval, frames that differ
+//! only slightly from the previous one are sent as a single delta packet
+//! instead, which lists just the changed slots. Full frames (keyframes) are
+//! still sent periodically, so that receivers that joined late or lost a
+//! packet can resynchronize. A receiver only applies a delta if it holds the
+//! exact frame that the delta was computed against.
+//!
+//! The sender can also stamp every packet with the time the frame was sent,
+//! as a 32-bit trailer, so that receivers can measure latency and jitter
+//! with a telemetry_t.
+//!
+//! For synchronized output, the sender follows each frame with a sync
+//! packet that commits it, and says when to present it. Receivers with sync
+//! enabled hold the universes of each frame until then, and present them
+//! all together, see frame_sync.h. Every universe of a frame has to be sent
+//! with the same sequence number.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "telemetry.h"
+#include "frame_sync.h"
+
+//! Number of slots in a full DMX universe
+#define ARTDMX_UNIVERSE_SIZE 512
+
+//! Maximum number of fragments a universe can be split into
+#define ARTDMX_MAX_FRAGMENTS 16
+
+//! Universe field of sync packets. This is the last transponder key, so
+//! receivers that subscribe to their universes need to subscribe to it too.
+#define ARTDMX_SYNC_UNIVERSE 511
+
+//! ARTDMX packet types
+typedef enum {
+    ARTDMX_TYPE_DATA = 0,               //!< Full frame (or a fragment of one), artdmx_packet_t
+    ARTDMX_TYPE_DELTA = 1,              //!< Changes since a previous frame, artdmx_delta_packet_t
+    ARTDMX_TYPE_SYNC = 2,               //!< Frame commit, artdmx_sync_packet_t
+} artdmx_type_t;
+
+//! Set in the type field if the packet ends with an artdmx_timestamp_t
+#define ARTDMX_FLAG_TIMESTAMP 0x80
+
+//! Bits of the type field that hold the artdmx_type_t
+#define ARTDMX_TYPE_MASK 0x7F
+
+//! Packet trailer, present if ARTDMX_FLAG_TIMESTAMP is set
+typedef struct {
+    uint32_t sent_us;                   //!< Low 32 bits of the sender's clock when the frame was sent
+} __attribute__((packed)) artdmx_timestamp_t;
+
+//! Data structure for an ARTDMX packet
+typedef struct {
+    uint16_t universe;                  //!< DMX universe for this data
+    uint8_t sequence;                   //!< Sequence number
+    uint8_t type;                       //!< Packet type, ARTDMX_TYPE_DATA
+    uint8_t fragment;                   //!< Index of this fragment in the frame
+    uint8_t fragment_count;             //!< Number of fragments in the frame
+    uint16_t offset;                    //!< Slot offset of the first byte of data
+    uint8_t data[];                     //!< DMX data
+} __attribute__((packed)) artdmx_packet_t;
+
+//! Data structure for an ARTDMX delta packet
+//!
+//! The first three fields are shared with artdmx_packet_t.
+typedef struct {
+    uint16_t universe;                  //!< DMX universe for this data
+    uint8_t sequence;                   //!< Sequence number of the resulting frame
+    uint8_t type;                       //!< Packet type, ARTDMX_TYPE_DELTA
+    uint8_t base_sequence;              //!< Sequence number of the frame this applies to
+    uint16_t length;                    //!< Frame length
+    uint8_t runs[];                     //!< Changed slots, as (offset, length, data) runs
+} __attribute__((packed)) artdmx_delta_packet_t;
+
+//! Data structure for an ARTDMX sync packet
+//!
+//! The first three fields are shared with artdmx_packet_t. It never has a
+//! timestamp trailer.
+typedef struct {
+    uint16_t universe;                  //!< ARTDMX_SYNC_UNIVERSE
+    uint8_t sequence;                   //!< Sequence number of the frame to present
+    uint8_t type;                       //!< Packet type, ARTDMX_TYPE_SYNC
+    uint32_t sent_us;                   //!< Low 32 bits of the sender's clock when the packet was sent
+    uint32_t present_us;                //!< Low 32 bits of the sender's clock at which to present the frame
+} __attribute__((packed)) artdmx_sync_packet_t;
+
+//! ARTDMX sender configuration
+typedef struct {
+    uint16_t universe_count;            //!< Universes [0, universe_count) can be delta coded
+    uint16_t keyframe_interval;         //!< Send a full frame at least this often. 0 disables delta coding.
+    bool timestamps;                    //!< Add the send time to every packet
+    uint32_t sync_delay_us;             //!< If non-zero, commit every frame sent with artdmx_send_frame(),
+                                        //!< to be presented this long after it was sent
+} artdmx_sender_config_t;
+
+//! ARTDMX sender statistics
+typedef struct {
+    uint64_t keyframes;                 //!< Full frames sent
+    uint64_t deltas;                    //!< Delta frames sent
+    uint64_t bytes;                     //!< Payload bytes handed to the transponder
+} artdmx_sender_stats_t;
+
+//! What to do with a frame that was still missing fragments when fragments
+//! for a newer frame started to arrive
+typedef enum {
+    ARTDMX_PARTIAL_HOLD,                //!< Drop it, so the output holds the last complete frame
+    ARTDMX_PARTIAL_PATCH,               //!< Emit it, with the missing slots taken from earlier frames
+} artdmx_partial_policy_t;
+
+//! Frame callback function prototype
+//!
+//! \param universe DMX universe
+//! \param sequence Sequence number of the frame
+//! \param data Pointer to the DMX data. Only valid until the callback returns.
+//! \param data_length Length of the DMX data
+typedef void (*artdmx_frame_callback_t)(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length);
+
+//! ARTDMX receiver configuration
+typedef struct {
+    uint16_t universe_count;            //!< Universes [0, universe_count) are received, others are ignored
+    artdmx_partial_policy_t partial_policy; //!< Handling of incomplete frames
+    artdmx_frame_callback_t callback;   //!< Called once per reassembled frame
+    telemetry_t *telemetry;             //!< Records every frame before it is passed to the callback, or NULL
+    bool sync;                          //!< Hold frames until the sender's commit says to present them
+    uint8_t sync_depth;                 //!< With sync, frames that can be held at once, or 0 for the default
+    uint32_t sync_timeout_us;           //!< With sync, longest a frame is held without a commit, or 0 for
+                                        //!< the default
+} artdmx_receiver_config_t;
+
+//! ARTDMX receiver statistics
+typedef struct {
+    uint64_t fragments;                 //!< Fragments accepted
+    uint64_t frames;                    //!< Complete frames emitted
+    uint64_t deltas;                    //!< Delta frames applied and emitted
+    uint64_t delta_base_mismatch;       //!< Deltas dropped because the base frame wasn't held
+    uint64_t partial_dropped;           //!< Incomplete frames dropped (ARTDMX_PARTIAL_HOLD)
+    uint64_t partial_patched;           //!< Incomplete frames emitted (ARTDMX_PARTIAL_PATCH)
+    uint64_t stale_fragments;           //!< Fragments from a frame older than the one being assembled
+    uint64_t bad_fragments;             //!< Fragments with an invalid header
+    uint64_t ignored_universe;          //!< Packets for universes outside of universe_count
+    uint64_t sync_packets;              //!< Sync packets received
+} artdmx_receiver_stats_t;
+
+//! \brief Initialize the ARTDMX sender
+//!
+//! This is only needed for delta coding and timestamps. Without it, every
+//! frame is sent in full, without a timestamp.
+//!
+//! \param config Sender configuration
+//! \return ESP_OK if successful
+esp_err_t artdmx_sender_init(const artdmx_sender_config_t *config);
+
+//! \brief Broadcast data to the specified universe
+//!
+//! The data is sent as a delta if possible. Otherwise, if the transponder
+//! can compress it into a single packet it is sent whole, and if not it is
+//! split into as few fragments as possible, of roughly equal size.
+//!
+//! \param universe Art-Net universe to send to
+//! \param sequence Sequence number
+//! \param data Pointer to the data
+//! \param data_length Length of the data, up to ARTDMX_UNIVERSE_SIZE
+//! \return ESP_OK if all fragments were sent
+esp_err_t artdmx_send(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length);
+
+//! \brief Broadcast a frame of several consecutive universes
+//!
+//! Each universe is sent as artdmx_send() would, but the packets of the
+//! whole frame are handed to the transponder in batches, and fragments are
+//! sent straight from the caller's buffer.
+//!
+//! \param first_universe Art-Net universe of the first universe in the buffer
+//! \param universe_count Number of universes
+//! \param sequence Sequence number
+//! \param data Pointer to the data of all universes, one after another
+//! \param universe_size Length of each universe, up to ARTDMX_UNIVERSE_SIZE
+//! \return ESP_OK if all packets were sent
+esp_err_t artdmx_send_frame(uint16_t first_universe, uint16_t universe_count, uint8_t sequence,
+                            const uint8_t *data, uint16_t universe_size);
+
+//! \brief Commit a frame, so that receivers present it together
+//!
+//! artdmx_send_frame() does this itself if sync_delay_us is set. Call it
+//! after sending every universe of a frame with artdmx_send() otherwise.
+//!
+//! The commit is sent in the sync traffic class, so when pacing it goes out
+//! ahead of universes that are still queued. Receivers keep it until the
+//! frame arrives.
+//!
+//! \param sequence Sequence number of the frame
+//! \param delay_us Time from now until the frame should be presented. This has to cover the
+//!                 time the frame takes to be sent, including any pacing.
+//! \return ESP_OK if the sync packet was sent
+esp_err_t artdmx_send_sync(uint8_t sequence, uint32_t delay_us);
+
+//! \brief Initialize the ARTDMX receiver
+//!
+//! With sync, frames are passed to the callback from a task of their own,
+//! at their presentation time. A frame that has to make room for a newer
+//! one is passed on from the receiving task.
+//!
+//! \param config Receiver configuration
+//! \return ESP_OK if successful
+esp_err_t artdmx_receiver_init(const artdmx_receiver_config_t *config);
+
+//! \brief Handle a packet received from the transponder
+//!
+//! This has the same signature as espnow_transponder_rx_callback_t, and can
+//! be registered with it directly.
+//!
+//! \param data Received packet data pointer
+//! \param data_length Length of the data packet
+void artdmx_receive(const uint8_t *data, uint16_t data_length);
+
+//! \brief Get sender statistics
+//!
+//! \param stats Pointer to copy statistics to
+void artdmx_sender_get_statistics(artdmx_sender_stats_t *stats);
+
+//! \brief Get receiver statistics
+//!
+//! \param stats Pointer to copy statistics to
+void artdmx_receiver_get_statistics(artdmx_receiver_stats_t *stats);
+
+//! \brief Get the frame presentation report, with sync enabled
+//!
+//! The lateness histogram is cleared as it is read.
+//!
+//! \param report Set to the report, all zero without sync
+void artdmx_receiver_get_sync_report(frame_sync_report_t *report);
@@ -0,0 +1,106 @@
+#pragma once
+
+//! Latest-value frame store for DMX receivers
+//!
+//! Holds the newest frame of each universe in a lock-free triple buffer, so
+//! that the output side never waits for the receive side and never sees
+//! old data queued up behind new data. The writer always fills its own
+//! slot, then swaps it with the shared middle slot. The reader swaps the
+//! middle slot for its own slot when a newer frame has been published, and
+//! otherwise keeps reading the frame it has.
+//!
+//! If the writer publishes twice before the reader looks, the first frame
+//! is never seen, and is counted as superseded. Output latency is therefore
+//! bounded to one frame, no matter how bursty the arrival is.
+//!
+//! Each universe supports one writer task and one reader task.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <esp_err.h>
+
+#include "artdmx.h"
+
+//! One frame in the store
+typedef struct {
+    uint8_t sequence;                   //!< Sequence number of the frame
+    uint16_t length;                    //!< Frame length
+    int64_t published_us;               //!< Time the frame was published
+    uint8_t data[ARTDMX_UNIVERSE_SIZE]; //!< Frame data
+} frame_store_frame_t;
+
+//! Counters for one universe
+typedef struct {
+    uint32_t published;                 //!< Frames published by the writer
+    uint32_t consumed;                  //!< Frames picked up by the reader
+    uint32_t superseded;                //!< Frames replaced before the reader picked them up
+} frame_store_stats_t;
+
+//! Triple buffer for one universe
+typedef struct {
+    frame_store_frame_t slots[3];
+    atomic_uint middle;                 //!< Index of the shared slot, with FRAME_STORE_FRESH if unread
+    uint8_t write;                      //!< Index of the writer's slot
+    uint8_t read;                       //!< Index of the reader's slot
+    atomic_uint published;
+    atomic_uint consumed;
+    atomic_uint superseded;
+} frame_store_universe_t;
+
+//! Frame store for a range of universes
+typedef struct {
+    uint16_t universe_count;
+    frame_store_universe_t *universes;
+} frame_store_t;
+
+//! \brief Initialize a frame store
+//!
+//! \param store Store to initialize
+//! \param universe_count Universes [0, universe_count) are stored
+//! \return ESP_OK, or ESP_ERR_NO_MEM
+esp_err_t frame_store_init(frame_store_t *store, uint16_t universe_count);
+
+//! \brief Get the writer's slot for a universe, to fill in place
+//!
+//! \param store Frame store
+//! \param universe Universe to write
+//! \return Frame to fill, or NULL if the universe isn't stored
+frame_store_frame_t *frame_store_write_begin(frame_store_t *store, uint16_t universe);
+
+//! \brief Publish the frame filled in after frame_store_write_begin()
+//!
+//! \param store Frame store
+//! \param universe Universe that was written
+void frame_store_write_commit(frame_store_t *store, uint16_t universe);
+
+//! \brief Copy a frame into the store, and publish it
+//!
+//! This has the shape of an artdmx_frame_callback_t, plus the store and time.
+//!
+//! \param store Frame store
+//! \param universe Universe of the frame
+//! \param sequence Sequence number of the frame
+//! \param data Frame data
+//! \param data_length Frame length
+//! \param now_us Current time, in microseconds
+void frame_store_publish(frame_store_t *store, uint16_t universe, uint8_t sequence,
+                         const uint8_t *data, uint16_t data_length, int64_t now_us);
+
+//! \brief Get the freshest complete frame of a universe
+//!
+//! Never blocks. The frame stays valid, and unchanged, until the next call
+//! for the same universe.
+//!
+//! \param store Frame store
+//! \param universe Universe to read
+//! \param frame Set to the reader's frame. Its length is 0 if nothing was published yet.
+//! \return True if the frame is newer than the one returned by the previous call
+bool frame_store_read(frame_store_t *store, uint16_t universe, const frame_store_frame_t **frame);
+
+//! \brief Get the counters for a universe
+//!
+//! \param store Frame store
+//! \param universe Universe
+//! \param stats Pointer to copy the counters to
+void frame_store_get_statistics(frame_store_t *store, uint16_t universe, frame_store_stats_t *stats);
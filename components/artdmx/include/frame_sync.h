@@ -0,0 +1,144 @@
+#pragma once
+
+//! Synchronized frame presentation for DMX receivers
+//!
+//! Without it, a receiver hands each universe on the moment it arrives, so
+//! across a large rig, fixtures update up to a frame apart, and fast chases
+//! tear. With it, the universes of a frame are held until the sender's
+//! commit for the frame says when to present it, and are then all handed
+//! on in one pass at that time.
+//!
+//! The commit carries the sender's clock, which is followed with a
+//! clock_sync_t, and the presentation time on that clock. Every receiver
+//! gets the broadcast commit at the same moment, so the time it spent in
+//! the sender's queue shifts all receivers' estimates alike, and doesn't
+//! affect how closely they present together.
+//!
+//! If a frame's commit is lost, the frame is presented once it has been
+//! held as long as the last committed frame was, so that receivers still
+//! present it close together, or for the timeout if no frame has been
+//! committed yet. A frame that is presented drops any older frames that are
+//! still held, so the output never goes backwards.
+//!
+//! This contains no RTOS calls, and is not thread safe; the caller supplies
+//! the time and any locking.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "clock_sync.h"
+#include "telemetry.h"
+
+//! \brief Called for each universe of a frame, when the frame is presented
+//!
+//! \param context Context pointer given to frame_sync_init()
+//! \param universe Universe
+//! \param sequence Sequence number of the frame
+//! \param data Frame data, only valid during the call
+//! \param data_length Length of the frame data
+typedef void (*frame_sync_present_cb_t)(void *context, uint16_t universe, uint8_t sequence,
+                                        const uint8_t *data, uint16_t data_length);
+
+//! A frame being held
+typedef struct {
+    bool used;                          //!< True if this slot holds a frame
+    bool committed;                     //!< True once the commit for the frame arrived
+    uint8_t sequence;                   //!< Sequence number of the frame
+    int64_t present_us;                 //!< Local time to present the frame, once committed
+    int64_t received_us;                //!< Local time the first universe, or the commit, arrived
+} frame_sync_frame_t;
+
+//! Counters, since initialization
+typedef struct {
+    uint32_t committed;                 //!< Frames presented at their commit time
+    uint32_t timed_out;                 //!< Frames presented because their commit didn't arrive
+    uint32_t late_commits;              //!< Commits that arrived after their presentation time
+    uint32_t stale_commits;             //!< Commits for frames that were already presented
+    uint32_t skipped;                   //!< Frames dropped because a newer one was presented first
+    uint32_t overruns;                  //!< Frames presented early to make room for a newer one
+    uint32_t stale;                     //!< Universes dropped because their frame was already presented
+} frame_sync_stats_t;
+
+//! Presentation report
+typedef struct {
+    frame_sync_stats_t stats;
+    telemetry_summary_t lateness_us;    //!< Presentation time minus scheduled time, since the last report
+    bool clock_valid;                   //!< True once a commit has been received
+    int32_t clock_error_us;             //!< How far the last commit was from the sender clock estimate
+    float clock_skew;                   //!< Sender clock rate relative to this one, minus one
+    uint32_t clock_resets;              //!< Times the sender clock estimate was thrown away
+} frame_sync_report_t;
+
+typedef struct {
+    uint16_t universe_count;
+    uint8_t depth;                      //!< Frames that can be held at once
+    uint32_t timeout_us;                //!< Time a frame is held for without a commit
+    int64_t hold_us;                    //!< Time the last committed frame was held for, or -1
+    frame_sync_present_cb_t callback;
+    void *context;
+    frame_sync_frame_t *frames;         //!< Held frames, depth of them
+    uint16_t *lengths;                  //!< Length of each universe of each held frame, 0 if missing
+    uint8_t *data;                      //!< Data of each universe of each held frame
+    bool presented_valid;               //!< True once a frame has been presented
+    uint8_t presented;                  //!< Sequence number of the last frame presented
+    clock_sync_t clock;                 //!< Estimate of the sender's clock
+    frame_sync_stats_t stats;
+    telemetry_histogram_t lateness;
+} frame_sync_t;
+
+//! \brief Initialize frame synchronization
+//!
+//! \param sync Synchronization state to initialize
+//! \param universe_count Universes [0, universe_count) are held
+//! \param depth Frames that can be held at once, enough to cover the presentation delay
+//! \param timeout_us Longest time a frame is held for if its commit doesn't arrive
+//! \param callback Called for each universe of a frame as it is presented
+//! \param context Passed to the callback
+//! \return True if successful
+bool frame_sync_init(frame_sync_t *sync, uint16_t universe_count, uint8_t depth, uint32_t timeout_us,
+                     frame_sync_present_cb_t callback, void *context);
+
+//! \brief Free the memory used by frame synchronization
+void frame_sync_free(frame_sync_t *sync);
+
+//! \brief Hold a universe of a frame until the frame is presented
+//!
+//! If every slot is taken by other frames, the oldest is presented early
+//! to make room.
+//!
+//! \param sync Synchronization state
+//! \param universe Universe
+//! \param sequence Sequence number of the frame
+//! \param data Frame data
+//! \param data_length Length of the frame data, up to ARTDMX_UNIVERSE_SIZE
+//! \param now_us Local time
+void frame_sync_add(frame_sync_t *sync, uint16_t universe, uint8_t sequence, const uint8_t *data,
+                    uint16_t data_length, int64_t now_us);
+
+//! \brief Handle a commit from the sender
+//!
+//! A commit can arrive before the frame it is for, which is then held
+//! when it arrives.
+//!
+//! \param sync Synchronization state
+//! \param sequence Sequence number of the frame to present
+//! \param sent_us Sender clock when the commit was sent
+//! \param present_us Sender clock at which to present the frame
+//! \param now_us Local time the commit arrived
+void frame_sync_commit(frame_sync_t *sync, uint8_t sequence, uint32_t sent_us, uint32_t present_us,
+                       int64_t now_us);
+
+//! \brief Present every frame that is due
+//!
+//! \param sync Synchronization state
+//! \param now_us Local time
+//! \return Local time the next frame is due, or INT64_MAX if none is held
+int64_t frame_sync_poll(frame_sync_t *sync, int64_t now_us);
+
+//! \brief Get the presentation report
+//!
+//! The lateness histogram is cleared as it is read.
+//!
+//! \param sync Synchronization state
+//! \param report Set to the report
+void frame_sync_report(frame_sync_t *sync, frame_sync_report_t *report);
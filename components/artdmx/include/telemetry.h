@@ -0,0 +1,141 @@
+#pragma once
+
+//! Receiver latency, jitter and loss telemetry
+//!
+//! Records every frame a receiver emits, and keeps per-universe histograms
+//! of:
+//!
+//! * Latency: the time the frame was emitted, minus the sender's timestamp.
+//!   This is only meaningful if the sender and receiver clocks agree, either
+//!   because they are synchronized (see telemetry_set_clock_offset()) or
+//!   because both ends share a clock, as in a loopback test or simulation.
+//! * Jitter: the change in transit time between consecutive timestamped
+//!   frames, |(R_i - R_i-1) - (S_i - S_i-1)|, as defined in RFC 3550. This
+//!   doesn't depend on the clocks agreeing.
+//! * Inter-arrival time between frames.
+//! * Length of each gap in the sequence numbers.
+//!
+//! Lost frames are counted exactly, from the length of each gap, and taken
+//! back off if the frame turns up later. Frames that arrive after a newer
+//! one are counted as reordered.
+//!
+//! Histograms are log-linear: each power of two is split into four
+//! buckets, so values below 8 are exact and larger ones are reported to
+//! within 25%. Values of TELEMETRY_HISTOGRAM_LIMIT and up land in the last
+//! bucket.
+//!
+//! Recording only uses relaxed atomic adds, so it is safe to call from the
+//! receive path while another task reports. Each universe supports one
+//! recording task and one reporting task. This contains no RTOS calls, so it
+//! can also be used with the simulated transport on Linux.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+//! Number of buckets in a histogram: one for each value below 4, four for
+//! each power of two from 4 up to the limit, and one for the limit and up
+#define TELEMETRY_HISTOGRAM_BUCKETS 85
+
+//! Values from this up are not told apart, about 4 seconds for times in microseconds
+#define TELEMETRY_HISTOGRAM_LIMIT (1u << 22)
+
+//! Histogram of non-negative values
+typedef struct {
+    atomic_uint counts[TELEMETRY_HISTOGRAM_BUCKETS];
+    atomic_uint max;                    //!< Largest value recorded
+} telemetry_histogram_t;
+
+//! Summary of a histogram over one reporting interval
+typedef struct {
+    uint32_t count;                     //!< Values recorded
+    uint32_t p50;                       //!< Median
+    uint32_t p99;                       //!< 99th percentile
+    uint32_t p999;                      //!< 99.9th percentile
+    uint32_t max;                       //!< Largest value
+} telemetry_summary_t;
+
+//! Report for one universe
+typedef struct {
+    uint32_t frames;                    //!< Frames recorded, since initialization
+    uint32_t lost;                      //!< Frames missing from the sequence, since initialization
+    uint32_t reordered;                 //!< Frames that arrived after a newer one, since initialization
+    uint32_t duplicates;                //!< Frames with the same sequence number as the previous one
+    telemetry_summary_t latency_us;     //!< One-way latency, since the last report
+    telemetry_summary_t jitter_us;      //!< Transit time variation, since the last report
+    telemetry_summary_t interarrival_us; //!< Time between frames, since the last report
+    telemetry_summary_t gap;            //!< Lengths of sequence gaps, since the last report
+} telemetry_report_t;
+
+//! Telemetry state for one universe
+typedef struct {
+    // Only touched by the recording task
+    bool started;                       //!< True once a frame has been recorded
+    bool timestamped;                   //!< True if the last frame had a timestamp
+    uint8_t expected_sequence;          //!< Sequence number of the next frame
+    uint32_t last_arrival_us;           //!< Arrival time of the last frame
+    uint32_t last_timestamp_us;         //!< Sender timestamp of the last frame
+
+    atomic_uint frames;
+    atomic_uint lost;
+    atomic_uint reordered;
+    atomic_uint duplicates;
+    telemetry_histogram_t latency;
+    telemetry_histogram_t jitter;
+    telemetry_histogram_t interarrival;
+    telemetry_histogram_t gap;
+} telemetry_universe_t;
+
+//! Telemetry for a range of universes
+typedef struct {
+    uint16_t universe_count;
+    atomic_int clock_offset_us;         //!< Added to the local clock to get the sender's clock
+    telemetry_universe_t *universes;
+} telemetry_t;
+
+//! \brief Initialize telemetry
+//!
+//! \param telemetry Telemetry to initialize
+//! \param universe_count Universes [0, universe_count) are recorded
+//! \return True if successful
+bool telemetry_init(telemetry_t *telemetry, uint16_t universe_count);
+
+//! \brief Free the memory used by telemetry
+void telemetry_free(telemetry_t *telemetry);
+
+//! \brief Set the offset between the local clock and the senders' clock
+//!
+//! \param telemetry Telemetry
+//! \param offset_us Sender clock minus local clock, in microseconds
+void telemetry_set_clock_offset(telemetry_t *telemetry, int32_t offset_us);
+
+//! \brief Record a frame
+//!
+//! \param telemetry Telemetry
+//! \param universe Universe of the frame
+//! \param sequence Sequence number of the frame
+//! \param timestamped True if the frame carried a sender timestamp
+//! \param timestamp_us Sender timestamp, the low 32 bits of its clock in microseconds
+//! \param now_us Current time, in microseconds
+void telemetry_record(telemetry_t *telemetry, uint16_t universe, uint8_t sequence,
+                      bool timestamped, uint32_t timestamp_us, int64_t now_us);
+
+//! \brief Get the report for a universe
+//!
+//! The histograms are cleared as they are read, so that every value is
+//! reported in exactly one interval. Only one task should call this.
+//!
+//! \param telemetry Telemetry
+//! \param universe Universe to report
+//! \param report Set to the report
+//! \return True if the universe is recorded
+bool telemetry_report(telemetry_t *telemetry, uint16_t universe, telemetry_report_t *report);
+
+//! \brief Add a value to a histogram
+void telemetry_histogram_add(telemetry_histogram_t *histogram, uint32_t value);
+
+//! \brief Summarize a histogram and clear it
+//!
+//! \param histogram Histogram to read
+//! \param summary Set to the percentiles of the values recorded since the last call
+void telemetry_histogram_drain(telemetry_histogram_t *histogram, telemetry_summary_t *summary);
@@ -0,0 +1,182 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "telemetry.h"
+
+// Frames up to this many sequence numbers behind the expected one are late
+// arrivals. Anything further behind is a sender that restarted.
+#define TELEMETRY_REORDER_WINDOW 32
+
+//! \brief Find the bucket for a value
+static int histogram_bucket(uint32_t value)
+{
+    if(value >= TELEMETRY_HISTOGRAM_LIMIT)
+        return TELEMETRY_HISTOGRAM_BUCKETS - 1;
+    if(value < 4)
+        return value;
+
+    // Four buckets per power of two, picked by the two bits below the top one
+    const int top = 31 - __builtin_clz(value);
+    const int sub = (value >> (top - 2)) & 0x3;
+    return (top - 1)*4 + sub;
+}
+
+//! \brief Largest value that falls in a bucket
+static uint32_t histogram_bucket_max(int bucket)
+{
+    if(bucket < 4)
+        return bucket;
+
+    const int top = bucket/4 + 1;
+    const uint32_t lowest = (uint32_t)(4 + bucket%4) << (top - 2);
+    return lowest + (1u << (top - 2)) - 1;
+}
+
+void telemetry_histogram_add(telemetry_histogram_t *histogram, uint32_t value) {
+    atomic_fetch_add_explicit(&histogram->counts[histogram_bucket(value)], 1, memory_order_relaxed);
+
+    uint32_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while(value > max
+        && !atomic_compare_exchange_weak_explicit(&histogram->max, &max, value,
+                                                  memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+//! \brief Find the value below which a fraction of the counts lie
+//!
+//! \param counts Bucket counts
+//! \param total Sum of the counts
+//! \param max Largest value recorded
+//! \param permille Fraction, in thousandths
+static uint32_t histogram_percentile(const uint32_t *counts, uint32_t total, uint32_t max, uint32_t permille)
+{
+    if(total == 0)
+        return 0;
+
+    const uint32_t target = ((uint64_t)total*permille + 999)/1000;
+    uint32_t seen = 0;
+
+    for(int bucket = 0; bucket < TELEMETRY_HISTOGRAM_BUCKETS; bucket++) {
+        seen += counts[bucket];
+        if(seen >= target) {
+            // Report the top of the bucket, but never more than was seen
+            const uint32_t value = histogram_bucket_max(bucket);
+            return (bucket == TELEMETRY_HISTOGRAM_BUCKETS - 1 || value > max) ? max : value;
+        }
+    }
+
+    return max;
+}
+
+void telemetry_histogram_drain(telemetry_histogram_t *histogram, telemetry_summary_t *summary) {
+    uint32_t counts[TELEMETRY_HISTOGRAM_BUCKETS];
+    uint32_t total = 0;
+
+    for(int bucket = 0; bucket < TELEMETRY_HISTOGRAM_BUCKETS; bucket++) {
+        counts[bucket] = atomic_exchange_explicit(&histogram->counts[bucket], 0, memory_order_relaxed);
+        total += counts[bucket];
+    }
+
+    const uint32_t max = atomic_exchange_explicit(&histogram->max, 0, memory_order_relaxed);
+
+    summary->count = total;
+    summary->p50 = histogram_percentile(counts, total, max, 500);
+    summary->p99 = histogram_percentile(counts, total, max, 990);
+    summary->p999 = histogram_percentile(counts, total, max, 999);
+    summary->max = max;
+}
+
+bool telemetry_init(telemetry_t *telemetry, uint16_t universe_count) {
+    telemetry->universes = calloc(universe_count, sizeof(telemetry_universe_t));
+    if(telemetry->universes == NULL)
+        return false;
+
+    telemetry->universe_count = universe_count;
+    atomic_init(&telemetry->clock_offset_us, 0);
+
+    return true;
+}
+
+void telemetry_free(telemetry_t *telemetry) {
+    free(telemetry->universes);
+    telemetry->universes = NULL;
+    telemetry->universe_count = 0;
+}
+
+void telemetry_set_clock_offset(telemetry_t *telemetry, int32_t offset_us) {
+    atomic_store_explicit(&telemetry->clock_offset_us, offset_us, memory_order_relaxed);
+}
+
+void telemetry_record(telemetry_t *telemetry, uint16_t universe, uint8_t sequence,
+                      bool timestamped, uint32_t timestamp_us, int64_t now_us) {
+    if(universe >= telemetry->universe_count)
+        return;
+
+    telemetry_universe_t *state = &telemetry->universes[universe];
+    const uint32_t arrival_us = (uint32_t)now_us;
+
+    atomic_fetch_add_explicit(&state->frames, 1, memory_order_relaxed);
+
+    if(state->started) {
+        // Sequence numbers wrap, so compare them by their signed difference
+        const int8_t difference = sequence - state->expected_sequence;
+
+        if(difference == -1) {
+            atomic_fetch_add_explicit(&state->duplicates, 1, memory_order_relaxed);
+            return;
+        }
+
+        // A late frame was counted as lost when its gap was seen. It doesn't
+        // say anything about the current timing, so leave that alone.
+        if(difference < 0 && difference > -TELEMETRY_REORDER_WINDOW) {
+            atomic_fetch_add_explicit(&state->reordered, 1, memory_order_relaxed);
+            if(atomic_load_explicit(&state->lost, memory_order_relaxed) > 0)
+                atomic_fetch_sub_explicit(&state->lost, 1, memory_order_relaxed);
+            return;
+        }
+
+        if(difference > 0) {
+            atomic_fetch_add_explicit(&state->lost, difference, memory_order_relaxed);
+            telemetry_histogram_add(&state->gap, difference);
+        }
+
+        telemetry_histogram_add(&state->interarrival, arrival_us - state->last_arrival_us);
+    }
+
+    if(timestamped) {
+        const int32_t offset_us = atomic_load_explicit(&telemetry->clock_offset_us, memory_order_relaxed);
+        const int32_t latency_us = (int32_t)(arrival_us + offset_us - timestamp_us);
+        telemetry_histogram_add(&state->latency, latency_us > 0 ? latency_us : 0);
+
+        if(state->started && state->timestamped) {
+            const int32_t transit_change = (int32_t)((arrival_us - state->last_arrival_us)
+                                                     - (timestamp_us - state->last_timestamp_us));
+            telemetry_histogram_add(&state->jitter, transit_change < 0 ? -transit_change : transit_change);
+        }
+    }
+
+    state->started = true;
+    state->timestamped = timestamped;
+    state->expected_sequence = sequence + 1;
+    state->last_arrival_us = arrival_us;
+    state->last_timestamp_us = timestamp_us;
+}
+
+bool telemetry_report(telemetry_t *telemetry, uint16_t universe, telemetry_report_t *report) {
+    if(universe >= telemetry->universe_count)
+        return false;
+
+    telemetry_universe_t *state = &telemetry->universes[universe];
+
+    report->frames = atomic_load_explicit(&state->frames, memory_order_relaxed);
+    report->lost = atomic_load_explicit(&state->lost, memory_order_relaxed);
+    report->reordered = atomic_load_explicit(&state->reordered, memory_order_relaxed);
+    report->duplicates = atomic_load_explicit(&state->duplicates, memory_order_relaxed);
+
+    telemetry_histogram_drain(&state->latency, &report->latency_us);
+    telemetry_histogram_drain(&state->jitter, &report->jitter_us);
+    telemetry_histogram_drain(&state->interarrival, &report->interarrival_us);
+    telemetry_histogram_drain(&state->gap, &report->gap);
+
+    return true;
+}
@@ -0,0 +1,52 @@
+#include <string.h>
+
+#include "artnet.h"
+
+// Fixed packet header: ID, OpCode, ProtVer
+#define ARTNET_ID           "Art-Net"
+#define ARTNET_HEADER_SIZE  12
+
+// ArtDmx header: Sequence, Physical, SubUni, Net, Length
+#define ARTNET_DMX_HEADER_SIZE  18
+
+// ArtSync adds Aux1 and Aux2 to the header
+#define ARTNET_SYNC_SIZE    14
+
+// Maximum ArtDmx data length, one full universe
+#define ARTNET_DMX_MAX_LENGTH   512
+
+artnet_message_type_t artnet_parse(const uint8_t *packet, uint16_t length, artnet_message_t *message) {
+    // The ID includes its terminating null
+    if(length < ARTNET_HEADER_SIZE || memcmp(packet, ARTNET_ID, sizeof(ARTNET_ID)) != 0)
+        return ARTNET_MESSAGE_INVALID;
+
+    // The OpCode is little endian, everything else is big endian
+    const uint16_t opcode = packet[8] | (packet[9] << 8);
+    const uint16_t version = (packet[10] << 8) | packet[11];
+    if(version < ARTNET_PROTOCOL_VERSION)
+        return ARTNET_MESSAGE_INVALID;
+
+    switch(opcode) {
+    case ARTNET_OP_DMX:
+    {
+        if(length < ARTNET_DMX_HEADER_SIZE)
+            return ARTNET_MESSAGE_INVALID;
+
+        const uint16_t data_length = (packet[16] << 8) | packet[17];
+        if(data_length == 0 || data_length > ARTNET_DMX_MAX_LENGTH
+            || data_length > length - ARTNET_DMX_HEADER_SIZE)
+            return ARTNET_MESSAGE_INVALID;
+
+        message->sequence = packet[12];
+        message->physical = packet[13];
+        message->port_address = ((packet[15] & 0x7F) << 8) | packet[14];
+        message->data = packet + ARTNET_DMX_HEADER_SIZE;
+        message->data_length = data_length;
+        return ARTNET_MESSAGE_DMX;
+    }
+    case ARTNET_OP_SYNC:
+        return length < ARTNET_SYNC_SIZE ? ARTNET_MESSAGE_INVALID : ARTNET_MESSAGE_SYNC;
+    default:
+        return ARTNET_MESSAGE_OTHER;
+    }
+}
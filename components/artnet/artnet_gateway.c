@@ -0,0 +1,479 @@
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <lwip/sockets.h>
+
+#include "espnow_transponder.h"
+#include "artdmx.h"
+#include "artnet.h"
+#include "e131.h"
+#include "dmx_merge.h"
+#include "artnet_gateway.h"
+
+static const char *TAG = "artnet";
+
+// Large enough for an ArtDmx packet carrying a full universe. Longer
+// packets are truncated, which is fine for the types that are ignored.
+#define ARTNET_GATEWAY_RECV_BUFFER  576
+
+// Maximum time the gateway task waits for a packet before checking timeouts
+#define ARTNET_GATEWAY_POLL_MS      100
+
+// Period over which the rate counters are measured
+#define ARTNET_GATEWAY_RATE_WINDOW_US   1000000
+
+//! Forwarding state for one route
+typedef struct {
+    artnet_gateway_route_t route;
+    uint8_t sequence;                   //!< Next ARTDMX sequence number
+    bool sent;                          //!< True once a frame has been forwarded
+    uint16_t last_length;               //!< Length of the last forwarded frame
+    int64_t last_sent_us;               //!< Time the last frame was forwarded
+    bool pending;                       //!< True if the merged frame is waiting for an ArtSync
+    int64_t pending_us;                 //!< Time the waiting frame was received
+    uint64_t window_ingest;             //!< ingest_frames at the start of the rate window
+    uint64_t window_egress;             //!< egress_frames at the start of the rate window
+    uint32_t window_latency_max_us;     //!< Longest latency in the current rate window
+    artnet_gateway_route_stats_t stats;
+    dmx_merge_t merge;                  //!< Sources feeding this route
+    uint8_t last[ARTDMX_UNIVERSE_SIZE]; //!< Last forwarded frame
+} route_state_t;
+
+static artnet_gateway_config_t gateway_config;
+static artnet_gateway_stats_t gateway_stats;
+static route_state_t *routes = NULL;
+
+//! True once an ArtSync has been received, until they time out
+static bool sync_mode = false;
+
+//! Time of the last ArtSync
+static int64_t last_sync_us = 0;
+
+//! Route of the last frame received in immediate mode, used to find frame boundaries
+static int previous_route = -1;
+
+//! Start of the current rate window
+static int64_t window_start_us = 0;
+
+static TaskHandle_t artnet_gateway_task_hdl = NULL;
+
+//! UDP socket bound to the Art-Net port
+static int artnet_socket = -1;
+
+//! UDP socket bound to the E1.31 port, or -1 if E1.31 isn't used
+static int sacn_socket = -1;
+
+static uint8_t receive_buffer[ARTNET_GATEWAY_RECV_BUFFER];
+
+esp_err_t artnet_gateway_init(const artnet_gateway_config_t *config) {
+    if(config == NULL || config->routes == NULL
+        || config->route_count == 0 || config->route_count > ARTNET_GATEWAY_MAX_ROUTES)
+        return ESP_ERR_INVALID_ARG;
+
+    routes = calloc(config->route_count, sizeof(route_state_t));
+    if(routes == NULL) {
+        ESP_LOGE(TAG, "Could not allocate memory for %i routes", config->route_count);
+        return ESP_ERR_NO_MEM;
+    }
+
+    for(int index = 0; index < config->route_count; index++) {
+        routes[index].route = config->routes[index];
+        dmx_merge_init(&routes[index].merge, config->merge_mode, DMX_MERGE_TIMEOUT_US);
+    }
+
+    gateway_config = *config;
+    gateway_config.routes = NULL;
+    memset(&gateway_stats, 0, sizeof(gateway_stats));
+
+    return ESP_OK;
+}
+
+//! \brief Find the route for an Art-Net universe
+//!
+//! \return Route index, or -1 if the universe isn't routed
+static int route_find(uint16_t port_address)
+{
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        if(routes[index].route.port_address == port_address)
+            return index;
+    }
+
+    return -1;
+}
+
+//! \brief Find the route for an E1.31 universe
+//!
+//! \return Route index, or -1 if the universe isn't routed
+static int route_find_sacn(uint16_t universe)
+{
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        if(routes[index].route.sacn_universe != 0 && routes[index].route.sacn_universe == universe)
+            return index;
+    }
+
+    return -1;
+}
+
+//! \brief Send a frame to the route's ESP-NOW universe
+//!
+//! \param state Route to send to
+//! \param data Frame data
+//! \param data_length Length of the frame data
+//! \param received_us Time the frame was received
+//! \param now_us Current time
+static void route_forward(route_state_t *state, const uint8_t *data, uint16_t data_length,
+                          int64_t received_us, int64_t now_us)
+{
+    // Consoles resend unchanged universes continuously; only keep enough of
+    // them to act as a keep-alive.
+    if(state->sent
+        && data_length == state->last_length
+        && now_us - state->last_sent_us < gateway_config.refresh_us
+        && memcmp(data, state->last, data_length) == 0) {
+        state->stats.coalesced++;
+        return;
+    }
+
+    if(artdmx_send(state->route.universe, state->sequence, data, data_length) != ESP_OK) {
+        state->stats.send_fail++;
+        return;
+    }
+
+    state->sequence++;
+    state->sent = true;
+    state->last_length = data_length;
+    state->last_sent_us = now_us;
+    if(data != state->last)
+        memcpy(state->last, data, data_length);
+
+    state->stats.egress_frames++;
+
+    const uint32_t latency_us = now_us - received_us;
+    if(latency_us > state->window_latency_max_us)
+        state->window_latency_max_us = latency_us;
+}
+
+//! \brief Forward every frame that is waiting for an ArtSync
+static void sync_flush(int64_t now_us)
+{
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        route_state_t *state = &routes[index];
+        if(!state->pending)
+            continue;
+
+        state->pending = false;
+
+        uint16_t length;
+        const uint8_t *data = dmx_merge_output(&state->merge, &length);
+        if(length > 0)
+            route_forward(state, data, length, state->pending_us, now_us);
+    }
+
+    espnow_transponder_frame_end();
+}
+
+//! \brief Forward a route's merged frame, or hold it for an ArtSync
+//!
+//! \param index Route index
+//! \param received_us Time the frame that changed the output was received
+//! \param now_us Current time
+static void route_output(int index, int64_t received_us, int64_t now_us)
+{
+    route_state_t *state = &routes[index];
+
+    if(sync_mode) {
+        if(state->pending)
+            state->stats.coalesced++;
+
+        state->pending = true;
+        state->pending_us = received_us;
+        return;
+    }
+
+    // With every source gone, receivers hold the last frame
+    uint16_t length;
+    const uint8_t *data = dmx_merge_output(&state->merge, &length);
+    if(length == 0)
+        return;
+
+    // Without ArtSync, assume a new frame starts when the console wraps
+    // around to a universe it already sent.
+    if(index <= previous_route)
+        espnow_transponder_frame_end();
+    previous_route = index;
+
+    route_forward(state, data, length, received_us, now_us);
+}
+
+//! \brief Merge a frame from one source into a route
+static void route_merge(int index, uint32_t source_id, uint8_t priority, uint8_t sequence,
+                        const uint8_t *data, uint16_t data_length, int64_t now_us)
+{
+    route_state_t *state = &routes[index];
+    state->stats.ingest_frames++;
+
+    switch(dmx_merge_update(&state->merge, source_id, priority, sequence, data, data_length, now_us)) {
+    case DMX_MERGE_CHANGED:
+        route_output(index, now_us, now_us);
+        break;
+    case DMX_MERGE_OUTRANKED:
+        state->stats.outranked++;
+        break;
+    case DMX_MERGE_OUT_OF_ORDER:
+        state->stats.out_of_order++;
+        break;
+    case DMX_MERGE_FULL:
+        state->stats.too_many_sources++;
+        break;
+    }
+
+    state->stats.sources = dmx_merge_source_count(&state->merge);
+}
+
+void artnet_gateway_handle(const uint8_t *packet, uint16_t length, uint32_t source_address, int64_t now_us) {
+    artnet_message_t message;
+
+    gateway_stats.packets++;
+
+    switch(artnet_parse(packet, length, &message)) {
+    case ARTNET_MESSAGE_DMX:
+    {
+        const int index = route_find(message.port_address);
+        if(index < 0) {
+            gateway_stats.unrouted++;
+            break;
+        }
+
+        route_merge(index, source_address, gateway_config.artnet_priority, message.sequence,
+                    message.data, message.data_length, now_us);
+        break;
+    }
+    case ARTNET_MESSAGE_SYNC:
+        gateway_stats.syncs++;
+        sync_mode = true;
+        last_sync_us = now_us;
+        sync_flush(now_us);
+        break;
+    case ARTNET_MESSAGE_OTHER:
+        gateway_stats.ignored++;
+        break;
+    default:
+        gateway_stats.invalid++;
+        break;
+    }
+}
+
+void artnet_gateway_handle_sacn(const uint8_t *packet, uint16_t length, int64_t now_us) {
+    e131_message_t message;
+
+    gateway_stats.packets++;
+
+    switch(e131_parse(packet, length, &message)) {
+    case E131_MESSAGE_DMX:
+    {
+        // Preview data is meant for visualisers, not fixtures
+        if(message.options & E131_OPTION_PREVIEW) {
+            gateway_stats.ignored++;
+            break;
+        }
+
+        const int index = route_find_sacn(message.universe);
+        if(index < 0) {
+            gateway_stats.unrouted++;
+            break;
+        }
+
+        const uint32_t source_id = e131_source_id(message.cid);
+        if(message.options & E131_OPTION_TERMINATED) {
+            if(dmx_merge_remove(&routes[index].merge, source_id))
+                route_output(index, now_us, now_us);
+
+            routes[index].stats.sources = dmx_merge_source_count(&routes[index].merge);
+            break;
+        }
+
+        route_merge(index, source_id, message.priority, message.sequence,
+                    message.data, message.data_length, now_us);
+        break;
+    }
+    case E131_MESSAGE_OTHER:
+        gateway_stats.ignored++;
+        break;
+    default:
+        gateway_stats.invalid++;
+        break;
+    }
+}
+
+void artnet_gateway_poll(int64_t now_us) {
+    if(sync_mode && now_us - last_sync_us > ARTNET_GATEWAY_SYNC_TIMEOUT_US) {
+        ESP_LOGI(TAG, "ArtSync timed out, forwarding frames immediately");
+
+        gateway_stats.sync_timeouts++;
+        sync_mode = false;
+        previous_route = -1;
+        sync_flush(now_us);
+    }
+
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        route_state_t *state = &routes[index];
+        if(dmx_merge_expire(&state->merge, now_us)) {
+            ESP_LOGI(TAG, "Source timed out, universe:%i", state->route.universe);
+
+            state->stats.sources = dmx_merge_source_count(&state->merge);
+            route_output(index, now_us, now_us);
+        }
+    }
+
+    const int64_t elapsed_us = now_us - window_start_us;
+    if(elapsed_us < ARTNET_GATEWAY_RATE_WINDOW_US)
+        return;
+
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        route_state_t *state = &routes[index];
+
+        state->stats.ingest_rate = (state->stats.ingest_frames - state->window_ingest)*1000000.0f/elapsed_us;
+        state->stats.egress_rate = (state->stats.egress_frames - state->window_egress)*1000000.0f/elapsed_us;
+        state->stats.latency_max_us = state->window_latency_max_us;
+
+        state->window_ingest = state->stats.ingest_frames;
+        state->window_egress = state->stats.egress_frames;
+        state->window_latency_max_us = 0;
+    }
+
+    window_start_us = now_us;
+}
+
+//! \brief Receive Art-Net and E1.31 packets, and forward them
+static void artnet_gateway_task(void *pvParameter)
+{
+    while(true) {
+        fd_set sockets;
+        FD_ZERO(&sockets);
+        FD_SET(artnet_socket, &sockets);
+        if(sacn_socket >= 0)
+            FD_SET(sacn_socket, &sockets);
+
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = ARTNET_GATEWAY_POLL_MS*1000,
+        };
+        const int max_socket = artnet_socket > sacn_socket ? artnet_socket : sacn_socket;
+        const int ready = select(max_socket + 1, &sockets, NULL, NULL, &timeout);
+
+        // A timeout still needs to run the poll
+        if(ready > 0 && FD_ISSET(artnet_socket, &sockets)) {
+            struct sockaddr_in source;
+            socklen_t source_length = sizeof(source);
+            const int length = recvfrom(artnet_socket, receive_buffer, sizeof(receive_buffer), 0,
+                                        (struct sockaddr *)&source, &source_length);
+            if(length > 0)
+                artnet_gateway_handle(receive_buffer, length, ntohl(source.sin_addr.s_addr), esp_timer_get_time());
+        }
+
+        if(ready > 0 && sacn_socket >= 0 && FD_ISSET(sacn_socket, &sockets)) {
+            const int length = recv(sacn_socket, receive_buffer, sizeof(receive_buffer), 0);
+            if(length > 0)
+                artnet_gateway_handle_sacn(receive_buffer, length, esp_timer_get_time());
+        }
+
+        artnet_gateway_poll(esp_timer_get_time());
+    }
+
+    artnet_gateway_task_hdl = NULL;
+    vTaskDelete(NULL);
+}
+
+//! \brief Create a UDP socket listening on a port
+//!
+//! \return Socket, or -1 on failure
+static int udp_listen(uint16_t port)
+{
+    const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0) {
+        ESP_LOGE(TAG, "Create socket fail, errno:%i", errno);
+        return -1;
+    }
+
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    if(bind(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        ESP_LOGE(TAG, "Bind to port %i fail, errno:%i", port, errno);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+//! \brief Open the E1.31 socket, and join the multicast group of each routed universe
+static esp_err_t sacn_listen()
+{
+    sacn_socket = udp_listen(E131_PORT);
+    if(sacn_socket < 0)
+        return ESP_FAIL;
+
+    for(int index = 0; index < gateway_config.route_count; index++) {
+        const uint16_t universe = routes[index].route.sacn_universe;
+        if(universe == 0)
+            continue;
+
+        struct ip_mreq group = {
+            .imr_multiaddr.s_addr = htonl(e131_multicast_address(universe)),
+            .imr_interface.s_addr = htonl(INADDR_ANY),
+        };
+        if(setsockopt(sacn_socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) < 0)
+            ESP_LOGW(TAG, "Join multicast group for universe %i fail, errno:%i", universe, errno);
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t artnet_gateway_start() {
+    if(routes == NULL || artnet_gateway_task_hdl != NULL)
+        return ESP_ERR_INVALID_STATE;
+
+    artnet_socket = udp_listen(ARTNET_PORT);
+    if(artnet_socket < 0)
+        return ESP_FAIL;
+
+    if(gateway_config.sacn && sacn_listen() != ESP_OK) {
+        close(artnet_socket);
+        artnet_socket = -1;
+        return ESP_FAIL;
+    }
+
+    window_start_us = esp_timer_get_time();
+
+    if(xTaskCreate(artnet_gateway_task, "artnet_task", 3072, NULL, 5, &artnet_gateway_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create task fail");
+        close(artnet_socket);
+        artnet_socket = -1;
+        if(sacn_socket >= 0) {
+            close(sacn_socket);
+            sacn_socket = -1;
+        }
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+void artnet_gateway_get_statistics(artnet_gateway_stats_t *stats) {
+    memcpy(stats, &gateway_stats, sizeof(artnet_gateway_stats_t));
+}
+
+esp_err_t artnet_gateway_get_route_statistics(uint8_t route, artnet_gateway_route_stats_t *stats) {
+    if(routes == NULL || route >= gateway_config.route_count)
+        return ESP_ERR_INVALID_ARG;
+
+    memcpy(stats, &routes[route].stats, sizeof(artnet_gateway_route_stats_t));
+    return ESP_OK;
+}
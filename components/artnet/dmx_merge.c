@@ -0,0 +1,264 @@
+#include <string.h>
+
+#include "dmx_merge.h"
+
+#define DMX_MERGE_WORDS (DMX_MERGE_SLOTS/4)
+
+// E1.31 treats a sequence number up to this far behind the last one as out
+// of order. Anything further behind is a source that restarted.
+#define DMX_MERGE_SEQUENCE_WINDOW 20
+
+//! \brief Per-slot maximum of four slots packed into a word
+static inline uint32_t max_u8x4(uint32_t a, uint32_t b)
+{
+    // Compare the even and odd slots separately in 16-bit lanes, so that a
+    // borrow never crosses into the next slot. Bit 8 of a lane is left set
+    // where a >= b.
+    const uint32_t a_even = a & 0x00FF00FF;
+    const uint32_t b_even = b & 0x00FF00FF;
+    const uint32_t a_odd = (a >> 8) & 0x00FF00FF;
+    const uint32_t b_odd = (b >> 8) & 0x00FF00FF;
+
+    const uint32_t ge_even = (((a_even | 0x01000100) - b_even) >> 8) & 0x00010001;
+    const uint32_t ge_odd = (((a_odd | 0x01000100) - b_odd) >> 8) & 0x00010001;
+
+    const uint32_t mask = (ge_even*0xFF) | ((ge_odd*0xFF) << 8);
+    return (a & mask) | (b & ~mask);
+}
+
+//! \brief Mask of the slots that differ between two words
+static inline uint32_t changed_u8x4(uint32_t a, uint32_t b)
+{
+    // Fold the bits of each slot down into its lowest bit
+    uint32_t x = a ^ b;
+    x |= x >> 4;
+    x |= x >> 2;
+    x |= x >> 1;
+
+    return (x & 0x01010101)*0xFF;
+}
+
+//! \brief Read a word of an unaligned, possibly short, frame
+static inline uint32_t frame_word(const uint8_t *data, uint16_t length, int word)
+{
+    uint32_t value = 0;
+    const int offset = word*4;
+
+    if(offset + 4 <= length)
+        memcpy(&value, data + offset, 4);
+    else if(offset < length)
+        memcpy(&value, data + offset, length - offset);
+
+    return value;
+}
+
+void dmx_merge_init(dmx_merge_t *merge, dmx_merge_mode_t mode, uint32_t timeout_us) {
+    memset(merge, 0, sizeof(*merge));
+    merge->mode = mode;
+    merge->timeout_us = timeout_us;
+}
+
+//! \brief Find the highest priority of the active sources
+//!
+//! \return True if any source is active
+static bool top_priority(const dmx_merge_t *merge, uint8_t *priority)
+{
+    bool found = false;
+
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        const dmx_merge_source_t *source = &merge->sources[index];
+        if(source->active && (!found || source->priority > *priority)) {
+            *priority = source->priority;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+//! \brief Recompute the output from scratch, after the set of sources changed
+static void merge_rebuild(dmx_merge_t *merge)
+{
+    uint8_t priority = 0;
+    if(!top_priority(merge, &priority)) {
+        merge->length = 0;
+        return;
+    }
+
+    const bool priority_changed = priority != merge->priority;
+    merge->priority = priority;
+    merge->length = 0;
+
+    const dmx_merge_source_t *latest = NULL;
+    bool first = true;
+
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        const dmx_merge_source_t *source = &merge->sources[index];
+        if(!source->active || source->priority != priority)
+            continue;
+
+        if(source->length > merge->length)
+            merge->length = source->length;
+        if(latest == NULL || source->last_us > latest->last_us)
+            latest = source;
+
+        if(merge->mode != DMX_MERGE_HTP)
+            continue;
+
+        if(first) {
+            memcpy(merge->output, source->data, sizeof(merge->output));
+            first = false;
+            continue;
+        }
+
+        for(int word = 0; word < DMX_MERGE_WORDS; word++)
+            merge->output[word] = max_u8x4(merge->output[word], source->data[word]);
+    }
+
+    // LTP holds its slots when a source leaves, unless control passes to a
+    // different priority level
+    if(merge->mode == DMX_MERGE_LTP && priority_changed)
+        memcpy(merge->output, latest->data, sizeof(merge->output));
+}
+
+static dmx_merge_source_t *source_find(dmx_merge_t *merge, uint32_t id)
+{
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        if(merge->sources[index].active && merge->sources[index].id == id)
+            return &merge->sources[index];
+    }
+
+    return NULL;
+}
+
+static dmx_merge_source_t *source_add(dmx_merge_t *merge, uint32_t id)
+{
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        dmx_merge_source_t *source = &merge->sources[index];
+        if(source->active)
+            continue;
+
+        memset(source, 0, sizeof(*source));
+        source->active = true;
+        source->id = id;
+        return source;
+    }
+
+    return NULL;
+}
+
+dmx_merge_result_t dmx_merge_update(dmx_merge_t *merge, uint32_t id, uint8_t priority, uint8_t sequence,
+                                    const uint8_t *data, uint16_t length, int64_t now_us) {
+    if(length > DMX_MERGE_SLOTS)
+        length = DMX_MERGE_SLOTS;
+
+    bool joined = false;
+    dmx_merge_source_t *source = source_find(merge, id);
+    if(source == NULL) {
+        source = source_add(merge, id);
+        if(source == NULL)
+            return DMX_MERGE_FULL;
+
+        joined = true;
+    }
+    else if(sequence != 0 && source->sequence != 0) {
+        const int8_t difference = sequence - source->sequence;
+        if(difference <= 0 && difference > -DMX_MERGE_SEQUENCE_WINDOW)
+            return DMX_MERGE_OUT_OF_ORDER;
+    }
+
+    const bool priority_changed = source->priority != priority;
+    source->priority = priority;
+    source->sequence = sequence;
+    source->length = length;
+    source->last_us = now_us;
+
+    // A source joining, or changing priority, can change which sources take part
+    if(joined || priority_changed || priority > merge->priority) {
+        for(int word = 0; word < DMX_MERGE_WORDS; word++)
+            source->data[word] = frame_word(data, length, word);
+
+        merge_rebuild(merge);
+        if(priority < merge->priority)
+            return DMX_MERGE_OUTRANKED;
+
+        // For LTP, a joining source has the latest value of every slot
+        if(merge->mode == DMX_MERGE_LTP)
+            memcpy(merge->output, source->data, sizeof(merge->output));
+
+        return DMX_MERGE_CHANGED;
+    }
+
+    if(priority < merge->priority) {
+        for(int word = 0; word < DMX_MERGE_WORDS; word++)
+            source->data[word] = frame_word(data, length, word);
+
+        return DMX_MERGE_OUTRANKED;
+    }
+
+    if(length > merge->length)
+        merge->length = length;
+
+    if(merge->mode == DMX_MERGE_LTP) {
+        // Take over the slots this source changed
+        for(int word = 0; word < DMX_MERGE_WORDS; word++) {
+            const uint32_t value = frame_word(data, length, word);
+            const uint32_t mask = changed_u8x4(value, source->data[word]);
+
+            merge->output[word] = (merge->output[word] & ~mask) | (value & mask);
+            source->data[word] = value;
+        }
+
+        return DMX_MERGE_CHANGED;
+    }
+
+    for(int word = 0; word < DMX_MERGE_WORDS; word++)
+        source->data[word] = frame_word(data, length, word);
+
+    merge_rebuild(merge);
+    return DMX_MERGE_CHANGED;
+}
+
+bool dmx_merge_remove(dmx_merge_t *merge, uint32_t id) {
+    dmx_merge_source_t *source = source_find(merge, id);
+    if(source == NULL)
+        return false;
+
+    source->active = false;
+    merge_rebuild(merge);
+    return true;
+}
+
+bool dmx_merge_expire(dmx_merge_t *merge, int64_t now_us) {
+    bool expired = false;
+
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        dmx_merge_source_t *source = &merge->sources[index];
+        if(source->active && now_us - source->last_us > merge->timeout_us) {
+            source->active = false;
+            merge->timeouts++;
+            expired = true;
+        }
+    }
+
+    if(expired)
+        merge_rebuild(merge);
+
+    return expired;
+}
+
+const uint8_t *dmx_merge_output(const dmx_merge_t *merge, uint16_t *length) {
+    *length = merge->length;
+    return (const uint8_t *)merge->output;
+}
+
+uint8_t dmx_merge_source_count(const dmx_merge_t *merge) {
+    uint8_t count = 0;
+
+    for(int index = 0; index < DMX_MERGE_MAX_SOURCES; index++) {
+        if(merge->sources[index].active)
+            count++;
+    }
+
+    return count;
+}
@@ -0,0 +1,103 @@
+#include <string.h>
+
+#include "e131.h"
+
+// Root layer
+#define E131_PREAMBLE_SIZE          0x0010
+#define E131_ROOT_VECTOR_DATA       0x00000004
+#define E131_CID_OFFSET             22
+
+// Framing layer
+#define E131_FRAMING_VECTOR_DATA    0x00000002
+#define E131_PRIORITY_OFFSET        108
+#define E131_SEQUENCE_OFFSET        111
+#define E131_OPTIONS_OFFSET         112
+#define E131_UNIVERSE_OFFSET        113
+
+// DMP layer
+#define E131_DMP_VECTOR_SET_PROPERTY    0x02
+#define E131_DMP_ADDRESS_TYPE       0xA1
+#define E131_DMP_COUNT_OFFSET       123
+#define E131_START_CODE_OFFSET      125
+
+// Header length of a data packet, up to the first DMX slot
+#define E131_DATA_HEADER_SIZE       126
+
+// Maximum DMX data length, one full universe
+#define E131_DMX_MAX_LENGTH         512
+
+static const uint8_t acn_packet_identifier[12] = { 'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+
+static inline uint16_t read_u16(const uint8_t *data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+static inline uint32_t read_u32(const uint8_t *data)
+{
+    return ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+//! \brief Check that a PDU's length field covers the rest of the packet
+static bool pdu_length_valid(const uint8_t *packet, uint16_t length, uint16_t offset)
+{
+    // The top four bits are flags, which are always 0x7
+    const uint16_t flags_length = read_u16(packet + offset);
+    return (flags_length >> 12) == 0x7 && (flags_length & 0x0FFF) == length - offset;
+}
+
+e131_message_type_t e131_parse(const uint8_t *packet, uint16_t length, e131_message_t *message) {
+    // Root layer, common to all E1.31 packets
+    if(length < E131_CID_OFFSET + 16
+        || read_u16(packet) != E131_PREAMBLE_SIZE
+        || read_u16(packet + 2) != 0
+        || memcmp(packet + 4, acn_packet_identifier, sizeof(acn_packet_identifier)) != 0
+        || !pdu_length_valid(packet, length, 16))
+        return E131_MESSAGE_INVALID;
+
+    // Synchronization and discovery use the extended root vector
+    if(read_u32(packet + 18) != E131_ROOT_VECTOR_DATA)
+        return E131_MESSAGE_OTHER;
+
+    if(length < E131_DATA_HEADER_SIZE
+        || !pdu_length_valid(packet, length, 38)
+        || read_u32(packet + 40) != E131_FRAMING_VECTOR_DATA
+        || !pdu_length_valid(packet, length, 115)
+        || packet[117] != E131_DMP_VECTOR_SET_PROPERTY
+        || packet[118] != E131_DMP_ADDRESS_TYPE)
+        return E131_MESSAGE_INVALID;
+
+    // The property count includes the start code
+    const uint16_t count = read_u16(packet + E131_DMP_COUNT_OFFSET);
+    if(count == 0 || count - 1 > E131_DMX_MAX_LENGTH || count - 1 != length - E131_DATA_HEADER_SIZE)
+        return E131_MESSAGE_INVALID;
+
+    // Alternate start codes aren't DMX levels
+    if(packet[E131_START_CODE_OFFSET] != 0x00)
+        return E131_MESSAGE_OTHER;
+
+    message->cid = packet + E131_CID_OFFSET;
+    message->priority = packet[E131_PRIORITY_OFFSET];
+    message->sequence = packet[E131_SEQUENCE_OFFSET];
+    message->options = packet[E131_OPTIONS_OFFSET];
+    message->universe = read_u16(packet + E131_UNIVERSE_OFFSET);
+    message->data = packet + E131_DATA_HEADER_SIZE;
+    message->data_length = count - 1;
+    return E131_MESSAGE_DMX;
+}
+
+uint32_t e131_multicast_address(uint16_t universe) {
+    // 239.255.<universe high byte>.<universe low byte>
+    return (239u << 24) | (255u << 16) | universe;
+}
+
+uint32_t e131_source_id(const uint8_t *cid) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for(int index = 0; index < 16; index++) {
+        hash ^= cid[index];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+//! Art-Net protocol parsing
+//!
+//! Decodes the Art-Net messages that the gateway needs: ArtDmx, which
+//! carries the data for one universe, and ArtSync, which tells nodes to
+//! output the data they have buffered. Parsing doesn't copy; the decoded
+//! message points into the received packet.
+//!
+//! See: https://art-net.org.uk/resources/art-net-specification/
+
+#include <stdint.h>
+
+//! UDP port used by Art-Net
+#define ARTNET_PORT 6454
+
+//! Lowest protocol version that is accepted
+#define ARTNET_PROTOCOL_VERSION 14
+
+#define ARTNET_OP_DMX   0x5000          //!< OpDmx, ArtDmx packet
+#define ARTNET_OP_SYNC  0x5200          //!< OpSync, ArtSync packet
+
+//! Decoded message types
+typedef enum {
+    ARTNET_MESSAGE_INVALID,             //!< Not an Art-Net packet, or malformed
+    ARTNET_MESSAGE_OTHER,               //!< Valid Art-Net packet that isn't handled
+    ARTNET_MESSAGE_DMX,                 //!< ArtDmx
+    ARTNET_MESSAGE_SYNC,                //!< ArtSync
+} artnet_message_type_t;
+
+//! Decoded Art-Net message
+typedef struct {
+    uint16_t port_address;              //!< 15-bit Port-Address (Net, Sub-Net and Universe)
+    uint8_t sequence;                   //!< ArtDmx sequence number, 0 if not used
+    uint8_t physical;                   //!< Physical input port the data came from
+    const uint8_t *data;                //!< DMX data, pointing into the packet
+    uint16_t data_length;               //!< Length of the DMX data
+} artnet_message_t;
+
+//! \brief Decode an Art-Net packet
+//!
+//! \param packet Pointer to the UDP payload
+//! \param length Length of the UDP payload
+//! \param message Filled in for ARTNET_MESSAGE_DMX. Only valid as long as the packet is.
+//! \return Type of the message
+artnet_message_type_t artnet_parse(const uint8_t *packet, uint16_t length, artnet_message_t *message);
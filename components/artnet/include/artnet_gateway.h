@@ -0,0 +1,140 @@
+#pragma once
+
+//! Art-Net and E1.31 to ESP-NOW gateway
+//!
+//! Listens for ArtDmx packets from lighting consoles, and optionally for
+//! E1.31 (sACN) data packets, and forwards the routed universes over the
+//! transponder using ARTDMX. Each route maps one Art-Net Port-Address, and
+//! optionally one E1.31 universe, to one ESP-NOW universe.
+//!
+//! Several sources can feed the same route, for example a main and a backup
+//! console. Their frames are combined by a dmx_merge, using E1.31 priority
+//! (Art-Net sources get a fixed priority) and either HTP or LTP between
+//! sources of the same priority. A source that stops sending is dropped
+//! after DMX_MERGE_TIMEOUT_US.
+//!
+//! The merged frame is forwarded as soon as it changes, unless it has to
+//! be held for an ArtSync. A frame that is identical to the last one
+//! forwarded for its route is dropped, as long as the route was refreshed
+//! recently enough.
+//!
+//! Once an ArtSync is received, the gateway switches to synchronous mode:
+//! merged frames are held, and all of them are forwarded together when the
+//! next ArtSync arrives. If no ArtSync is seen for
+//! ARTNET_GATEWAY_SYNC_TIMEOUT_US, it goes back to forwarding frames as
+//! they arrive, as the Art-Net specification requires. E1.31
+//! synchronization packets are not supported.
+//!
+//! The network interface that the packets arrive on must be brought up by
+//! the application.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "dmx_merge.h"
+
+//! Maximum number of routes
+#define ARTNET_GATEWAY_MAX_ROUTES 32
+
+//! Return to immediate mode if no ArtSync is received for this long
+#define ARTNET_GATEWAY_SYNC_TIMEOUT_US 4000000
+
+//! Map an Art-Net universe, and optionally an E1.31 universe, onto one ESP-NOW universe
+typedef struct {
+    uint16_t port_address;              //!< Art-Net 15-bit Port-Address
+    uint16_t sacn_universe;             //!< E1.31 universe, or 0 for none
+    uint16_t universe;                  //!< ARTDMX universe to send it to
+} artnet_gateway_route_t;
+
+//! Gateway configuration
+typedef struct {
+    const artnet_gateway_route_t *routes;   //!< Routing table, copied by artnet_gateway_init()
+    uint8_t route_count;                //!< Number of routes, up to ARTNET_GATEWAY_MAX_ROUTES
+    uint32_t refresh_us;                //!< Forward duplicate frames at least this often
+    dmx_merge_mode_t merge_mode;        //!< Merge between sources of the same priority
+    uint8_t artnet_priority;            //!< Merge priority of Art-Net sources, E131_DEFAULT_PRIORITY to match sACN
+    bool sacn;                          //!< Also listen for E1.31
+} artnet_gateway_config_t;
+
+//! Gateway statistics
+typedef struct {
+    uint64_t packets;                   //!< UDP packets received
+    uint64_t invalid;                   //!< Packets that weren't valid Art-Net or E1.31
+    uint64_t ignored;                   //!< Packets of types that aren't handled, and E1.31 preview data
+    uint64_t unrouted;                  //!< Frames for universes without a route
+    uint64_t syncs;                     //!< ArtSync packets received
+    uint64_t sync_timeouts;             //!< Times synchronous mode ended for lack of ArtSync
+} artnet_gateway_stats_t;
+
+//! Per route statistics
+typedef struct {
+    uint64_t ingest_frames;             //!< Frames received, from all sources
+    uint64_t egress_frames;             //!< Merged frames forwarded
+    uint64_t coalesced;                 //!< Frames dropped as duplicates, or replaced before an ArtSync
+    uint64_t send_fail;                 //!< Frames that could not be forwarded
+    uint64_t outranked;                 //!< Frames ignored because a higher priority source is active
+    uint64_t out_of_order;              //!< Frames older than the last one from the same source
+    uint64_t too_many_sources;          //!< Frames from sources that didn't fit in the merge
+    uint8_t sources;                    //!< Sources currently feeding the route
+    float ingest_rate;                  //!< Frames received per second, over the last second
+    float egress_rate;                  //!< Frames forwarded per second, over the last second
+    uint32_t latency_max_us;            //!< Longest time from reception to forwarding, over the last second
+} artnet_gateway_route_stats_t;
+
+//! \brief Initialize the gateway
+//!
+//! \param config Gateway configuration
+//! \return ESP_OK if successful
+esp_err_t artnet_gateway_init(const artnet_gateway_config_t *config);
+
+//! \brief Start listening for Art-Net on UDP port ARTNET_PORT
+//!
+//! If E1.31 is enabled, this also listens on E131_PORT, and joins the
+//! multicast group of every routed E1.31 universe. Creates a task that
+//! receives packets, and passes them to artnet_gateway_handle() or
+//! artnet_gateway_handle_sacn().
+//!
+//! \return ESP_OK if successful
+esp_err_t artnet_gateway_start();
+
+//! \brief Handle a received Art-Net packet
+//!
+//! This is called by the gateway task. It is exposed so that packets can
+//! be injected from another source. It must only be called from one task.
+//!
+//! \param packet Pointer to the UDP payload
+//! \param length Length of the UDP payload
+//! \param source_address IPv4 address of the sender, identifies the source for merging
+//! \param now_us Time the packet was received, in microseconds
+void artnet_gateway_handle(const uint8_t *packet, uint16_t length, uint32_t source_address, int64_t now_us);
+
+//! \brief Handle a received E1.31 packet
+//!
+//! Like artnet_gateway_handle(), this must only be called from the gateway task.
+//!
+//! \param packet Pointer to the UDP payload
+//! \param length Length of the UDP payload
+//! \param now_us Time the packet was received, in microseconds
+void artnet_gateway_handle_sacn(const uint8_t *packet, uint16_t length, int64_t now_us);
+
+//! \brief Handle timeouts, and update the rate counters
+//!
+//! This is called by the gateway task. It must be called from the same task
+//! as artnet_gateway_handle(). Sources that have stopped sending are dropped
+//! from the merge here.
+//!
+//! \param now_us Current time, in microseconds
+void artnet_gateway_poll(int64_t now_us);
+
+//! \brief Get gateway statistics
+//!
+//! \param stats Pointer to copy the statistics to
+void artnet_gateway_get_statistics(artnet_gateway_stats_t *stats);
+
+//! \brief Get statistics for one route
+//!
+//! \param route Index of the route in the routing table
+//! \param stats Pointer to copy the statistics to
+//! \return ESP_OK, or ESP_ERR_INVALID_ARG if the route doesn't exist
+esp_err_t artnet_gateway_get_route_statistics(uint8_t route, artnet_gateway_route_stats_t *stats);
@@ -0,0 +1,109 @@
+#pragma once
+
+//! Multi-source DMX merge
+//!
+//! Combines the frames that several sources send for one universe into a
+//! single output frame. Only the sources with the highest priority take
+//! part; lower priority sources are tracked, and take over if the higher
+//! ones go away. Between sources of equal priority, the output is either:
+//!
+//! * HTP (highest takes precedence): each slot is the highest value that any
+//!   source sends for it.
+//! * LTP (latest takes precedence): each slot takes the value from whichever
+//!   source changed it most recently. Slots keep their value when a source
+//!   stops.
+//!
+//! A source that hasn't sent a frame within the timeout is dropped. Both
+//! merges work a 32-bit word (four slots) at a time.
+//!
+//! This contains no RTOS calls; the caller supplies the time.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! Maximum number of slots in a frame
+#define DMX_MERGE_SLOTS 512
+
+//! Maximum number of sources tracked per universe
+#define DMX_MERGE_MAX_SOURCES 4
+
+//! Source loss timeout recommended by E1.31
+#define DMX_MERGE_TIMEOUT_US 2500000
+
+//! Merge modes
+typedef enum {
+    DMX_MERGE_HTP,                      //!< Highest takes precedence
+    DMX_MERGE_LTP,                      //!< Latest takes precedence
+} dmx_merge_mode_t;
+
+//! Result of offering a frame to the merge
+typedef enum {
+    DMX_MERGE_CHANGED,                  //!< The frame took part, the output may have changed
+    DMX_MERGE_OUTRANKED,                //!< The source is tracked, but a higher priority source is active
+    DMX_MERGE_OUT_OF_ORDER,             //!< The frame was older than the last one from its source
+    DMX_MERGE_FULL,                     //!< No room to track another source
+} dmx_merge_result_t;
+
+//! One source of a universe
+typedef struct {
+    bool active;                        //!< True if the slot is in use
+    uint32_t id;                        //!< Source identifier
+    uint8_t priority;                   //!< Priority of the last frame
+    uint8_t sequence;                   //!< Sequence number of the last frame
+    uint16_t length;                    //!< Slots in the last frame
+    int64_t last_us;                    //!< Time of the last frame
+    uint32_t data[DMX_MERGE_SLOTS/4];   //!< Last frame, zero padded
+} dmx_merge_source_t;
+
+//! Merge state for one universe
+typedef struct {
+    dmx_merge_mode_t mode;
+    uint32_t timeout_us;
+    uint8_t priority;                   //!< Priority of the sources taking part
+    uint16_t length;                    //!< Slots in the output frame
+    dmx_merge_source_t sources[DMX_MERGE_MAX_SOURCES];
+    uint32_t output[DMX_MERGE_SLOTS/4]; //!< Merged frame
+    uint32_t timeouts;                  //!< Sources dropped for lack of frames
+} dmx_merge_t;
+
+//! \brief Initialize the merge for a universe
+//!
+//! \param merge Merge to initialize
+//! \param mode Merge mode between sources of equal priority
+//! \param timeout_us Drop sources that haven't sent a frame for this long
+void dmx_merge_init(dmx_merge_t *merge, dmx_merge_mode_t mode, uint32_t timeout_us);
+
+//! \brief Offer a frame from a source
+//!
+//! \param merge Merge state
+//! \param id Source identifier, for example a hash of the E1.31 CID
+//! \param priority Source priority, higher wins
+//! \param sequence Frame sequence number, or 0 if the source doesn't use them
+//! \param data Frame data
+//! \param length Frame length, up to DMX_MERGE_SLOTS
+//! \param now_us Current time, in microseconds
+//! \return Whether the frame was merged
+dmx_merge_result_t dmx_merge_update(dmx_merge_t *merge, uint32_t id, uint8_t priority, uint8_t sequence,
+                                    const uint8_t *data, uint16_t length, int64_t now_us);
+
+//! \brief Stop tracking a source, for example when it terminates its stream
+//!
+//! \return True if the output may have changed
+bool dmx_merge_remove(dmx_merge_t *merge, uint32_t id);
+
+//! \brief Drop sources that have timed out
+//!
+//! \param merge Merge state
+//! \param now_us Current time, in microseconds
+//! \return True if the output may have changed
+bool dmx_merge_expire(dmx_merge_t *merge, int64_t now_us);
+
+//! \brief Get the merged frame
+//!
+//! \param merge Merge state
+//! \param length Set to the frame length, 0 if no source has sent a frame
+//! \return Pointer to the merged frame
+const uint8_t *dmx_merge_output(const dmx_merge_t *merge, uint16_t *length);
+
+//! \brief Count the sources being tracked
+uint8_t dmx_merge_source_count(const dmx_merge_t *merge);
@@ -0,0 +1,61 @@
+#pragma once
+
+//! E1.31 (Streaming ACN, sACN) protocol parsing
+//!
+//! Decodes E1.31 data packets. Like artnet_parse(), parsing doesn't copy;
+//! the decoded message points into the received packet. Synchronization
+//! and discovery packets are recognized, but not decoded.
+//!
+//! See: ANSI E1.31-2018
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! UDP port used by E1.31
+#define E131_PORT 5568
+
+//! Default source priority
+#define E131_DEFAULT_PRIORITY 100
+
+//! Framing layer option: the data is for visualisers only, not for output
+#define E131_OPTION_PREVIEW     0x80
+//! Framing layer option: the source is stopping this universe
+#define E131_OPTION_TERMINATED  0x40
+
+//! Decoded message types
+typedef enum {
+    E131_MESSAGE_INVALID,               //!< Not an E1.31 packet, or malformed
+    E131_MESSAGE_OTHER,                 //!< Valid packet that isn't handled
+    E131_MESSAGE_DMX,                   //!< Data packet with DMX (null start code) data
+} e131_message_type_t;
+
+//! Decoded E1.31 data packet
+typedef struct {
+    const uint8_t *cid;                 //!< 16-byte component identifier of the source
+    uint16_t universe;                  //!< Universe number, 1-63999
+    uint8_t priority;                   //!< Source priority, 0-200
+    uint8_t sequence;                   //!< Sequence number
+    uint8_t options;                    //!< E131_OPTION_ flags
+    const uint8_t *data;                //!< DMX data, without the start code
+    uint16_t data_length;               //!< Length of the DMX data
+} e131_message_t;
+
+//! \brief Decode an E1.31 packet
+//!
+//! \param packet Pointer to the UDP payload
+//! \param length Length of the UDP payload
+//! \param message Filled in for E131_MESSAGE_DMX. Only valid as long as the packet is.
+//! \return Type of the message
+e131_message_type_t e131_parse(const uint8_t *packet, uint16_t length, e131_message_t *message);
+
+//! \brief Multicast group address that a universe is sent to
+//!
+//! \param universe Universe number
+//! \return IPv4 address, in host byte order
+uint32_t e131_multicast_address(uint16_t universe);
+
+//! \brief Turn a component identifier into a source identifier for dmx_merge
+//!
+//! \param cid 16-byte component identifier
+//! \return 32-bit hash of the identifier
+uint32_t e131_source_id(const uint8_t *cid);
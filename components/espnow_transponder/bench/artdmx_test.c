@@ -0,0 +1,429 @@
+//! ARTDMX reassembly test
+//!
+//! Sends full 512 slot universes with the ARTDMX sender, through a stand-in
+//! for the transponder that frames each packet with the transponder's own
+//! framing (compressing it if that helps), loses some of them, and hands
+//! the rest to the ARTDMX receiver, as the transponder would. Every frame
+//! the receiver emits is checked:
+//!
+//! * With the hold policy, and with deltas, it has to match the frame that
+//!   was sent with its sequence number, slot for slot.
+//! * With the patch policy, each slot has to match either that frame, or
+//!   the frame emitted before it for the universe.
+//!
+//! The cases are: no loss; random loss with each policy; burst loss; late
+//! fragments, where some fragments of each frame only arrive after the
+//! next frame has started; and deltas with random loss. For each, this
+//! reports the frames sent and emitted, and what the receiver did with the
+//! incomplete ones. Without loss every frame has to be emitted.
+//!
+//! It then measures the throughput of the sender and the receiver, in
+//! universes and fragments per second, without loss.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/artdmx_test [--frames N] [--loss P] [--seed N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_now.h"
+
+#include "framing.h"
+#include "artdmx.h"
+
+#define TEST_UNIVERSES              8
+
+//! Slots that change from one frame to the next, in each universe
+#define TEST_CHANGES                6
+
+//! Packets of a frame that can be held back
+#define TEST_MAX_PACKETS            (TEST_UNIVERSES*ARTDMX_MAX_FRAGMENTS)
+
+//! Frames run for the throughput measurement
+#define TEST_SPEED_FRAMES           20000
+
+typedef enum {
+    LOSS_NONE,
+    LOSS_RANDOM,
+    LOSS_BURST,                         //!< Gilbert-Elliott: bursts of 50% loss, with the given loss overall
+    LOSS_LATE,                          //!< Packets delivered after the next frame's, with the given probability
+} loss_model_t;
+
+typedef struct {
+    const char *name;
+    loss_model_t loss_model;
+    artdmx_partial_policy_t policy;
+    uint16_t keyframe_interval;
+} test_case_t;
+
+typedef struct {
+    uint64_t emitted;
+    uint64_t mismatched;                //!< Emitted frames that failed the check
+    uint64_t packets;
+    uint64_t lost;
+} test_result_t;
+
+//! A framed packet, on its way to the receiver
+typedef struct {
+    uint16_t length;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} test_packet_t;
+
+static test_packet_t air[TEST_MAX_PACKETS];
+static uint16_t air_count;
+static test_packet_t late[TEST_MAX_PACKETS];
+static uint16_t late_count;
+
+static const test_case_t *current_case;
+static float loss;
+static bool burst;
+static uint32_t rng = 1;
+static uint32_t current_frame;
+static test_result_t result;
+static uint8_t last_emitted[TEST_UNIVERSES][ARTDMX_UNIVERSE_SIZE];
+static bool deliver_packets = true;     //!< False while measuring the sender alone
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static float random_float()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return (rng >> 8)/16777216.0f;
+}
+
+//! \brief Fill in the slots of a universe for a frame
+//!
+//! A fixed, incompressible background, with a few slots that move every
+//! frame, as in a chase.
+static void frame_data(uint16_t universe, uint32_t frame, uint8_t *slots)
+{
+    for(int slot = 0; slot < ARTDMX_UNIVERSE_SIZE; slot++)
+        slots[slot] = (slot*7 + universe*31 + (slot*slot >> 3)) & 0xFF;
+
+    for(int change = 0; change < TEST_CHANGES; change++)
+        slots[(frame*5 + change*37 + universe) % ARTDMX_UNIVERSE_SIZE] = (frame + change)*13;
+}
+
+//! \brief Whether a packet is lost, by the current loss model
+static bool packet_lost()
+{
+    switch(current_case->loss_model) {
+    case LOSS_RANDOM:
+        return random_float() < loss;
+
+    case LOSS_BURST:
+        // Bursts of 50% loss, that start and end so that the loss overall is as given
+        if(random_float() < (burst ? 0.1f : 0.1f*2*loss/(1 - 2*loss)))
+            burst = !burst;
+        return burst && random_float() < 0.5f;
+
+    default:
+        return false;
+    }
+}
+
+//! \brief Check and unframe a packet, as the transponder task does
+//!
+//! \return Payload length
+static uint16_t unframe(const test_packet_t *packet, uint8_t *payload)
+{
+    if(framing_check(packet->data, packet->length) != FRAMING_OK) {
+        fprintf(stderr, "Packet failed its check\n");
+        exit(1);
+    }
+
+    const espnow_transponder_packet_t *header = (const espnow_transponder_packet_t *)packet->data;
+    if(!(header->flags & ESPNOW_TRANSPONDER_FLAG_COMPRESSED)) {
+        memcpy(payload, header->data, header->data_length);
+        return header->data_length;
+    }
+
+    const int length = framing_decompress(header->data, header->data_length, payload,
+                                          ESPNOW_TRANSPONDER_MAX_DATA_LENGTH);
+    if(length < 0) {
+        fprintf(stderr, "Packet failed to decompress\n");
+        exit(1);
+    }
+    return length;
+}
+
+//! \brief Hand a packet to the receiver
+static void receive(const test_packet_t *packet)
+{
+    uint8_t payload[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+    const uint16_t length = unframe(packet, payload);
+    artdmx_receive(payload, length);
+}
+
+//! \brief Deliver the packets of a frame
+//!
+//! With late loss, the packets held back from the frame before are
+//! delivered after this frame's, and some of this frame's are held back.
+static void air_flush()
+{
+    test_packet_t held[TEST_MAX_PACKETS];
+    uint16_t held_count = 0;
+
+    for(uint16_t index = 0; index < air_count; index++) {
+        result.packets++;
+        if(current_case->loss_model == LOSS_LATE && random_float() < loss) {
+            held[held_count++] = air[index];
+            result.lost++;
+            continue;
+        }
+        if(packet_lost()) {
+            result.lost++;
+            continue;
+        }
+        receive(&air[index]);
+    }
+    air_count = 0;
+
+    for(uint16_t index = 0; index < late_count; index++)
+        receive(&late[index]);
+    memcpy(late, held, held_count*sizeof(test_packet_t));
+    late_count = held_count;
+}
+
+// Stand-in for the transponder's send functions
+
+int espnow_transponder_max_packet_size() {
+    return ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t);
+}
+
+int espnow_transponder_max_compressed_size() {
+    return ESPNOW_TRANSPONDER_MAX_DATA_LENGTH;
+}
+
+esp_err_t espnow_transponder_sendv_class(const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                                         espnow_transponder_class_t traffic_class) {
+    test_packet_t *packet = &air[air_count];
+    const int length = framing_build(packet->data, espnow_transponder_max_packet_size(), parts, part_count, true,
+                                     traffic_class, NULL, NULL, NULL);
+    if(length < 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    if(deliver_packets) {
+        packet->length = length;
+        air_count++;
+    }
+    return ESP_OK;
+}
+
+esp_err_t espnow_transponder_sendv(const espnow_transponder_iovec_t *parts, uint8_t part_count) {
+    return espnow_transponder_sendv_class(parts, part_count, ESPNOW_TRANSPONDER_CLASS_REALTIME);
+}
+
+esp_err_t espnow_transponder_send_batch(espnow_transponder_message_t *messages, uint16_t message_count) {
+    esp_err_t ret = ESP_OK;
+    for(uint16_t index = 0; index < message_count; index++) {
+        messages[index].result = espnow_transponder_sendv(messages[index].parts, messages[index].part_count);
+        if(messages[index].result != ESP_OK)
+            ret = messages[index].result;
+    }
+    return ret;
+}
+
+//! \brief Check a frame emitted by the receiver
+static void frame_callback(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    result.emitted++;
+    if(!deliver_packets || universe >= TEST_UNIVERSES)
+        return;
+
+    // The most recent frame sent with this sequence number
+    const uint32_t frame = current_frame - (uint8_t)(current_frame - sequence);
+    uint8_t expected[ARTDMX_UNIVERSE_SIZE];
+    frame_data(universe, frame, expected);
+
+    bool match = data_length == ARTDMX_UNIVERSE_SIZE;
+    for(int slot = 0; match && slot < ARTDMX_UNIVERSE_SIZE; slot++) {
+        if(current_case->policy == ARTDMX_PARTIAL_PATCH)
+            match = data[slot] == expected[slot] || data[slot] == last_emitted[universe][slot];
+        else
+            match = data[slot] == expected[slot];
+    }
+
+    if(!match)
+        result.mismatched++;
+    memcpy(last_emitted[universe], data, ARTDMX_UNIVERSE_SIZE);
+}
+
+//! \brief Run a test case
+//!
+//! \return False if it failed
+static bool run_case(const test_case_t *test_case, uint32_t frames, float case_loss)
+{
+    current_case = test_case;
+    loss = test_case->loss_model == LOSS_NONE ? 0 : case_loss;
+    burst = false;
+    memset(&result, 0, sizeof(result));
+    memset(last_emitted, 0, sizeof(last_emitted));
+
+    const artdmx_sender_config_t sender_config = {
+        .universe_count = TEST_UNIVERSES,
+        .keyframe_interval = test_case->keyframe_interval,
+    };
+    const artdmx_receiver_config_t receiver_config = {
+        .universe_count = TEST_UNIVERSES,
+        .partial_policy = test_case->policy,
+        .callback = frame_callback,
+    };
+    if(artdmx_sender_init(&sender_config) != ESP_OK || artdmx_receiver_init(&receiver_config) != ESP_OK) {
+        fprintf(stderr, "Could not set up the sender and receiver\n");
+        exit(1);
+    }
+
+    static uint8_t data[TEST_UNIVERSES*ARTDMX_UNIVERSE_SIZE];
+    for(current_frame = 0; current_frame < frames; current_frame++) {
+        for(uint16_t universe = 0; universe < TEST_UNIVERSES; universe++)
+            frame_data(universe, current_frame, data + universe*ARTDMX_UNIVERSE_SIZE);
+
+        if(artdmx_send_frame(0, TEST_UNIVERSES, current_frame, data, ARTDMX_UNIVERSE_SIZE) != ESP_OK) {
+            fprintf(stderr, "Could not send frame %u\n", current_frame);
+            exit(1);
+        }
+        air_flush();
+    }
+    current_frame--;
+    late_count = 0;
+
+    artdmx_receiver_stats_t stats;
+    artdmx_receiver_get_statistics(&stats);
+    const uint64_t sent = (uint64_t)frames*TEST_UNIVERSES;
+
+    printf("%-12s %6.3f %8llu %8llu %8llu %8llu %8llu %8llu %8llu %8llu\n", test_case->name,
+           result.packets > 0 ? (double)result.lost/result.packets : 0, (unsigned long long)sent,
+           (unsigned long long)result.emitted, (unsigned long long)result.mismatched,
+           (unsigned long long)stats.deltas, (unsigned long long)stats.partial_dropped,
+           (unsigned long long)stats.partial_patched, (unsigned long long)stats.stale_fragments,
+           (unsigned long long)stats.delta_base_mismatch);
+
+    bool pass = true;
+    if(result.mismatched > 0) {
+        printf("FAIL: %llu emitted frames didn't match what was sent\n", (unsigned long long)result.mismatched);
+        pass = false;
+    }
+    if(test_case->loss_model == LOSS_NONE && result.emitted != sent) {
+        printf("FAIL: %llu frames were sent without loss, but %llu were emitted\n", (unsigned long long)sent,
+               (unsigned long long)result.emitted);
+        pass = false;
+    }
+    if(stats.bad_fragments > 0) {
+        printf("FAIL: %llu fragments were rejected as bad\n", (unsigned long long)stats.bad_fragments);
+        pass = false;
+    }
+    return pass;
+}
+
+//! \brief Measure the sender and receiver without loss
+static void measure_speed()
+{
+    static const test_case_t speed_case = { "speed", LOSS_NONE, ARTDMX_PARTIAL_HOLD, 0 };
+    current_case = &speed_case;
+
+    const artdmx_sender_config_t sender_config = { .universe_count = TEST_UNIVERSES };
+    const artdmx_receiver_config_t receiver_config = {
+        .universe_count = TEST_UNIVERSES,
+        .callback = frame_callback,
+    };
+    artdmx_sender_init(&sender_config);
+    artdmx_receiver_init(&receiver_config);
+
+    static uint8_t data[TEST_UNIVERSES*ARTDMX_UNIVERSE_SIZE];
+    for(uint16_t universe = 0; universe < TEST_UNIVERSES; universe++)
+        frame_data(universe, 0, data + universe*ARTDMX_UNIVERSE_SIZE);
+
+    // Sender alone, framing included
+    deliver_packets = false;
+    int64_t start_ns = time_ns();
+    for(uint32_t frame = 0; frame < TEST_SPEED_FRAMES; frame++)
+        artdmx_send_frame(0, TEST_UNIVERSES, frame, data, ARTDMX_UNIVERSE_SIZE);
+    const double send_ns = (double)(time_ns() - start_ns)/TEST_SPEED_FRAMES/TEST_UNIVERSES;
+    deliver_packets = true;
+
+    // Receiver alone, on one frame's payloads received over and over with new sequence numbers
+    static uint8_t payloads[TEST_MAX_PACKETS][ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+    static uint16_t payload_lengths[TEST_MAX_PACKETS];
+    artdmx_send_frame(0, TEST_UNIVERSES, 0, data, ARTDMX_UNIVERSE_SIZE);
+    const uint16_t packet_count = air_count;
+    for(uint16_t index = 0; index < packet_count; index++)
+        payload_lengths[index] = unframe(&air[index], payloads[index]);
+    air_count = 0;
+
+    memset(&result, 0, sizeof(result));
+    deliver_packets = false;
+    start_ns = time_ns();
+    for(uint32_t frame = 1; frame <= TEST_SPEED_FRAMES; frame++) {
+        for(uint16_t index = 0; index < packet_count; index++) {
+            ((artdmx_packet_t *)payloads[index])->sequence = frame;
+            artdmx_receive(payloads[index], payload_lengths[index]);
+        }
+    }
+    const double receive_ns = (double)(time_ns() - start_ns)/TEST_SPEED_FRAMES/TEST_UNIVERSES;
+    deliver_packets = true;
+
+    const double fragments = (double)packet_count/TEST_UNIVERSES;
+    printf("\n%-9s %12s %14s %12s\n", "path", "ns/universe", "universes/s", "fragments/s");
+    printf("%-9s %12.1f %14.0f %12.0f\n", "send", send_ns, 1e9/send_ns, 1e9/send_ns*fragments);
+    printf("%-9s %12.1f %14.0f %12.0f\n", "receive", receive_ns, 1e9/receive_ns, 1e9/receive_ns*fragments);
+    printf("%.1f fragments per universe, %llu frames emitted\n", fragments, (unsigned long long)result.emitted);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = 2000;
+    float case_loss = 0.05f;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc)
+            frames = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--loss") == 0 && arg + 1 < argc)
+            case_loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+            rng = strtoul(argv[++arg], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--frames N] [--loss P] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(frames == 0 || case_loss < 0 || case_loss >= 0.5f || rng == 0) {
+        fprintf(stderr, "The loss must be below 0.5, and the seed non-zero\n");
+        return 2;
+    }
+
+    static const test_case_t cases[] = {
+        { "clean", LOSS_NONE, ARTDMX_PARTIAL_HOLD, 0 },
+        { "loss_hold", LOSS_RANDOM, ARTDMX_PARTIAL_HOLD, 0 },
+        { "loss_patch", LOSS_RANDOM, ARTDMX_PARTIAL_PATCH, 0 },
+        { "burst_hold", LOSS_BURST, ARTDMX_PARTIAL_HOLD, 0 },
+        { "late_hold", LOSS_LATE, ARTDMX_PARTIAL_HOLD, 0 },
+        { "late_patch", LOSS_LATE, ARTDMX_PARTIAL_PATCH, 0 },
+        { "delta_loss", LOSS_RANDOM, ARTDMX_PARTIAL_HOLD, 10 },
+    };
+
+    printf("%-12s %6s %8s %8s %8s %8s %8s %8s %8s %8s\n", "case", "loss", "sent", "emitted", "bad", "deltas",
+           "dropped", "patched", "stale", "no base");
+
+    bool pass = true;
+    for(size_t index = 0; index < sizeof(cases)/sizeof(cases[0]); index++)
+        pass &= run_case(&cases[index], frames, case_loss);
+
+    measure_speed();
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
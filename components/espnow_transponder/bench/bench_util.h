@@ -0,0 +1,45 @@
+#pragma once
+
+//! Helpers shared by the host tests and benchmarks
+//!
+//! Each program includes this from one file, and gets its own pass flag and
+//! random number state. The random numbers start from the same seed every
+//! run, so that a failure can be repeated.
+//!
+//! This is plain C, and is not built into the firmware.
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+//! Cleared by check() when a check fails
+static bool pass = true;
+
+//! State of random_next()
+static uint32_t rng = 0x2545F491;
+
+//! \brief Get a monotonic time, in nanoseconds
+static inline int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief xorshift32 random number generator
+static inline uint32_t random_next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+//! \brief Note the result of a check, and print what failed
+static inline void check(bool ok, const char *what)
+{
+    if(!ok)
+        printf("FAIL: %s\n", what);
+    pass &= ok;
+}
@@ -0,0 +1,340 @@
+//! Traffic class latency check
+//!
+//! Models one of the transponder's queues and the task that serves it, in
+//! simulated time: packets of each traffic class arrive on a fixed schedule,
+//! and the server takes a fixed time for each one. The packets are built
+//! and checked with the transponder's framing, and the server reads their
+//! class from the header, as the WiFi task does.
+//!
+//! Two cases are run:
+//!
+//! * receive: DMX arrives faster than the transponder task can dispatch it,
+//!   along with bulk data, frame commits and control messages.
+//! * transmit: every frame queues a burst of DMX that takes nearly the
+//!   whole frame to send, and a commit and control messages are queued
+//!   behind it.
+//!
+//! Each case is run with the single FIFO queue the transponder used to have,
+//! and with a queue per class served by the class scheduler, using the
+//! default weights and queue sizes. For each class, this reports how many
+//! packets were served and dropped, and how long they were queued.
+//!
+//! With classes, a control message only ever waits for the packet being
+//! served to finish, so this fails if one waits longer than a service time,
+//! or if a control message or commit is dropped. In the receive case it also
+//! checks that realtime and bulk, which are both saturated, share the
+//! server in proportion to their weights.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/class_bench [--seconds N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+#include "event_ring.h"
+#include "traffic_class.h"
+
+//! Payload length of the simulated packets
+#define SIM_PAYLOAD_LENGTH          200
+
+//! Most sources in a case
+#define SIM_MAX_SOURCES             4
+
+//! Allowed error in the realtime to bulk share
+#define SIM_SHARE_TOLERANCE         0.1
+
+//! Packets of one class, arriving on a fixed schedule
+typedef struct {
+    espnow_transponder_class_t traffic_class;
+    uint32_t interval_us;               //!< Time between arrivals
+    uint32_t offset_us;                 //!< Time of the first arrival
+    uint16_t burst;                     //!< Packets that arrive together
+} sim_source_t;
+
+typedef struct {
+    const char *name;
+    uint32_t service_us;                //!< Time the server takes for each packet
+    espnow_transponder_overflow_policy_t policy;
+    uint16_t fifo_size;                 //!< Queue size without classes
+    uint16_t queue_sizes[ESPNOW_TRANSPONDER_CLASS_COUNT]; //!< Queue sizes with classes
+    bool check_share;                   //!< Realtime and bulk are both saturated
+    sim_source_t sources[SIM_MAX_SOURCES];
+} sim_case_t;
+
+//! A queued packet
+typedef struct {
+    int64_t queued_us;
+    uint8_t traffic_class;
+} sim_event_t;
+
+typedef struct {
+    uint64_t arrived;
+    uint64_t served;
+    uint64_t dropped;
+    uint32_t *latencies_us;             //!< Time each served packet was queued
+} sim_class_result_t;
+
+static const char *class_names[ESPNOW_TRANSPONDER_CLASS_COUNT] = {
+    [ESPNOW_TRANSPONDER_CLASS_REALTIME] = "realtime",
+    [ESPNOW_TRANSPONDER_CLASS_BULK] = "bulk",
+    [ESPNOW_TRANSPONDER_CLASS_SYNC] = "sync",
+    [ESPNOW_TRANSPONDER_CLASS_CONTROL] = "control",
+};
+
+// The transponder's defaults, see espnow_transponder.c
+static const uint8_t default_weights[ESPNOW_TRANSPONDER_CLASS_COUNT] = {
+    [ESPNOW_TRANSPONDER_CLASS_REALTIME] = 4,
+    [ESPNOW_TRANSPONDER_CLASS_BULK] = 1,
+};
+
+static const sim_case_t cases[] = {
+    {
+        .name = "receive",
+        .service_us = 250,
+        .policy = ESPNOW_TRANSPONDER_DROP_OLDEST,
+        .fifo_size = 32,
+        .queue_sizes = { 32, 16, 8, 8 },
+        .check_share = true,
+        .sources = {
+            { ESPNOW_TRANSPONDER_CLASS_REALTIME, 200, 0, 1 },
+            { ESPNOW_TRANSPONDER_CLASS_BULK, 500, 50, 1 },
+            { ESPNOW_TRANSPONDER_CLASS_SYNC, 25000, 7, 1 },
+            { ESPNOW_TRANSPONDER_CLASS_CONTROL, 9973, 3, 1 },
+        },
+    },
+    {
+        .name = "transmit",
+        .service_us = 600,
+        .policy = ESPNOW_TRANSPONDER_DROP_NEWEST,
+        .fifo_size = 64,
+        .queue_sizes = { 64, 16, 8, 8 },
+        .check_share = false,
+        .sources = {
+            { ESPNOW_TRANSPONDER_CLASS_REALTIME, 25000, 0, 40 },
+            { ESPNOW_TRANSPONDER_CLASS_BULK, 20000, 100, 2 },
+            { ESPNOW_TRANSPONDER_CLASS_SYNC, 25000, 1, 1 },
+            { ESPNOW_TRANSPONDER_CLASS_CONTROL, 9973, 5, 1 },
+        },
+    },
+};
+
+static int compare_uint32(const void *a, const void *b)
+{
+    const uint32_t left = *(const uint32_t *)a;
+    const uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+//! \brief Receive a packet as the WiFi task would, and queue it
+//!
+//! \param rings Queues, one for each class, or one shared by all of them
+//! \param classes True if there is a queue for each class
+//! \param packet Packet
+//! \param length Length of the packet
+//! \param now_us Current time
+//! \param results Per-class results, for the drop counts
+//! \return False if the packet failed its checks
+static bool receive(event_ring_t *rings, bool classes, const uint8_t *packet, int length, int64_t now_us,
+                    sim_class_result_t *results)
+{
+    if(framing_check(packet, length) != FRAMING_OK)
+        return false;
+
+    const sim_event_t event = {
+        .queued_us = now_us,
+        .traffic_class = ESPNOW_TRANSPONDER_PACKET_CLASS(((const espnow_transponder_packet_t *)packet)->flags),
+    };
+    results[event.traffic_class].arrived++;
+
+    sim_event_t dropped;
+    if(event_ring_push(&rings[classes ? event.traffic_class : 0], &event, &dropped) != EVENT_RING_PUSHED)
+        results[dropped.traffic_class].dropped++;
+
+    return true;
+}
+
+//! \brief Run one case
+//!
+//! \param sim Case to run
+//! \param classes Use a queue for each class, rather than one for all of them
+//! \param seconds Simulated time
+//! \param results Set to the per-class results. The latencies are allocated, and freed by the caller.
+//! \return False if the simulation couldn't be set up
+static bool run(const sim_case_t *sim, bool classes, uint32_t seconds, sim_class_result_t *results)
+{
+    event_ring_t rings[ESPNOW_TRANSPONDER_CLASS_COUNT];
+    const int ring_count = classes ? ESPNOW_TRANSPONDER_CLASS_COUNT : 1;
+    for(int ring = 0; ring < ring_count; ring++)
+        if(event_ring_init(&rings[ring], sizeof(sim_event_t), classes ? sim->queue_sizes[ring] : sim->fifo_size,
+                           sim->policy) != ESP_OK)
+            return false;
+
+    // Without classes, everything is served in arrival order
+    static const uint8_t fifo_weights[ESPNOW_TRANSPONDER_CLASS_COUNT] = { 0 };
+    traffic_class_scheduler_t scheduler;
+    traffic_class_init(&scheduler, classes ? default_weights : fifo_weights);
+
+    const int64_t end_us = (int64_t)seconds*1000000;
+    int64_t next_us[SIM_MAX_SOURCES];
+    memset(results, 0, sizeof(sim_class_result_t)*ESPNOW_TRANSPONDER_CLASS_COUNT);
+    for(int source = 0; source < SIM_MAX_SOURCES; source++) {
+        const sim_source_t *schedule = &sim->sources[source];
+        next_us[source] = schedule->offset_us;
+
+        const uint64_t arrivals = (end_us/schedule->interval_us + 1)*schedule->burst;
+        results[schedule->traffic_class].latencies_us = malloc(sizeof(uint32_t)*arrivals);
+        if(results[schedule->traffic_class].latencies_us == NULL)
+            return false;
+    }
+
+    uint8_t payload[SIM_PAYLOAD_LENGTH] = { 0 };
+    const espnow_transponder_iovec_t part = { payload, sizeof(payload) };
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    int64_t now_us = 0;
+    int64_t busy_until_us = 0;
+
+    while(now_us < end_us) {
+        for(int source = 0; source < SIM_MAX_SOURCES; source++) {
+            const sim_source_t *schedule = &sim->sources[source];
+            for(; next_us[source] <= now_us; next_us[source] += schedule->interval_us) {
+                for(uint16_t index = 0; index < schedule->burst; index++) {
+                    const int length = framing_build(packet, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t),
+                                                     &part, 1, false, schedule->traffic_class, NULL, NULL, NULL);
+                    if(length < 0 || !receive(rings, classes, packet, length, now_us, results)) {
+                        fprintf(stderr, "Packet of class %s failed its checks\n", class_names[schedule->traffic_class]);
+                        return false;
+                    }
+                }
+            }
+        }
+
+        if(busy_until_us <= now_us) {
+            uint32_t ready = 0;
+            for(int ring = 0; ring < ring_count; ring++)
+                if(event_ring_depth(&rings[ring]) > 0)
+                    ready |= 1u << ring;
+
+            sim_event_t event;
+            const int ring = traffic_class_select(&scheduler, ready);
+            if(ring >= 0 && event_ring_pop(&rings[ring], &event)) {
+                traffic_class_served(&scheduler, ring, ready);
+
+                sim_class_result_t *result = &results[event.traffic_class];
+                result->latencies_us[result->served++] = now_us - event.queued_us;
+                busy_until_us = now_us + sim->service_us;
+            }
+        }
+
+        // On to the next arrival, or the end of the packet being served
+        int64_t next_event_us = end_us;
+        for(int source = 0; source < SIM_MAX_SOURCES; source++)
+            if(next_us[source] < next_event_us)
+                next_event_us = next_us[source];
+        if(busy_until_us > now_us && busy_until_us < next_event_us)
+            next_event_us = busy_until_us;
+
+        now_us = next_event_us;
+    }
+
+    for(int ring = 0; ring < ring_count; ring++)
+        free(rings[ring].storage);
+
+    return true;
+}
+
+//! \brief Print the results of a run
+//!
+//! \param results Per-class results, the latencies are sorted
+//! \param label Queueing that was used
+static void report(sim_class_result_t *results, const char *label)
+{
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++) {
+        sim_class_result_t *result = &results[traffic_class];
+        qsort(result->latencies_us, result->served, sizeof(uint32_t), compare_uint32);
+
+        const uint64_t served = result->served;
+        printf("%8s %9s %9llu %9llu %9llu %9u %9u %9u\n", label, class_names[traffic_class],
+               (unsigned long long)result->arrived, (unsigned long long)served, (unsigned long long)result->dropped,
+               served ? result->latencies_us[served/2] : 0, served ? result->latencies_us[served*99/100] : 0,
+               served ? result->latencies_us[served - 1] : 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seconds = 10;
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            seconds = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--seconds N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if(seconds == 0) {
+        fprintf(stderr, "Need at least one second\n");
+        return 2;
+    }
+
+    bool pass = true;
+
+    for(int index = 0; index < sizeof(cases)/sizeof(cases[0]); index++) {
+        const sim_case_t *sim = &cases[index];
+        sim_class_result_t fifo[ESPNOW_TRANSPONDER_CLASS_COUNT];
+        sim_class_result_t classes[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+        if(!run(sim, false, seconds, fifo) || !run(sim, true, seconds, classes))
+            return 1;
+
+        printf("%s, %u us per packet, %u s\n", sim->name, sim->service_us, seconds);
+        printf("%8s %9s %9s %9s %9s %9s %9s %9s\n", "queues", "class", "arrived", "served", "dropped",
+               "p50_us", "p99_us", "max_us");
+        report(fifo, "fifo");
+        report(classes, "classes");
+
+        const sim_class_result_t *control = &classes[ESPNOW_TRANSPONDER_CLASS_CONTROL];
+        const sim_class_result_t *sync = &classes[ESPNOW_TRANSPONDER_CLASS_SYNC];
+        const uint32_t control_max_us = control->served ? control->latencies_us[control->served - 1] : 0;
+
+        if(control->served == 0 || control_max_us > sim->service_us) {
+            printf("FAIL: control waited up to %u us, more than the %u us service time\n", control_max_us,
+                   sim->service_us);
+            pass = false;
+        }
+        if(control->dropped > 0 || sync->dropped > 0) {
+            printf("FAIL: %llu control messages and %llu commits were dropped\n",
+                   (unsigned long long)control->dropped, (unsigned long long)sync->dropped);
+            pass = false;
+        }
+
+        if(sim->check_share) {
+            const double expected = (double)default_weights[ESPNOW_TRANSPONDER_CLASS_REALTIME]
+                /default_weights[ESPNOW_TRANSPONDER_CLASS_BULK];
+            const uint64_t bulk = classes[ESPNOW_TRANSPONDER_CLASS_BULK].served;
+            const double share = bulk ? (double)classes[ESPNOW_TRANSPONDER_CLASS_REALTIME].served/bulk : 0;
+            printf("realtime:bulk share %.2f, weights %.2f\n", share, expected);
+
+            if(share < expected*(1 - SIM_SHARE_TOLERANCE) || share > expected*(1 + SIM_SHARE_TOLERANCE)) {
+                printf("FAIL: realtime and bulk didn't share in proportion to their weights\n");
+                pass = false;
+            }
+        }
+        printf("\n");
+
+        for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++) {
+            free(fifo[traffic_class].latencies_us);
+            free(classes[traffic_class].latencies_us);
+        }
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,222 @@
+//! CRC16 cross-check and benchmark
+//!
+//! Checks the table driven CRC in crc16.c against a bitwise reference,
+//! written the way the ESP32 ROM computes crc16_le(): invert the CRC, shift
+//! each bit through the reflected polynomial 0x8408, and invert it again.
+//! The standard check string "123456789" gives 0x2189 before the final
+//! inversion (the CRC-16/KERMIT check value), so 0xde76 from
+//! crc16_update(CRC16_INIT, ...). The checks are:
+//!
+//! * the check string
+//! * random data of every length up to a few packets, at every alignment,
+//!   and from random starting CRCs, which covers the four byte steps of the
+//!   table and the bytes left over after them
+//! * data split at every point and added in two parts, which is how packets
+//!   are checked with their CRC field left out
+//! * crc16_update_zeros() against adding a buffer of zeros, before and
+//!   after other data
+//! * crc16_update_copy() against crc16_update(), and that it copies the data
+//!
+//! It then times the reference, crc16_update(), crc16_update_copy() and
+//! crc16_update_zeros() on packet sized buffers, and reports the time per
+//! packet and the throughput.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/crc16_test [--bytes N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc16.h"
+
+//! Longest data checked against the reference, a few packets' worth
+#define TEST_MAX_LENGTH             1024
+
+//! CRC-16/KERMIT check value, the ROM CRC of "123456789" before the final inversion
+#define TEST_CHECK_VALUE            0x2189
+
+static const uint32_t bench_lengths[] = { 16, 64, 250, 1024 };
+
+static uint32_t rng = 0x2545F491;
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief xorshift32 random number generator
+static uint32_t random_next()
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+//! \brief Bitwise CRC, as crc16_le() in the ESP32 ROM
+static uint16_t reference_crc16_le(uint16_t crc, const uint8_t *data, uint32_t length)
+{
+    crc = ~crc;
+    for(uint32_t index = 0; index < length; index++) {
+        crc ^= data[index];
+        for(int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+    }
+    return ~crc;
+}
+
+static bool check(bool ok, const char *what, uint32_t length, uint32_t offset)
+{
+    if(!ok)
+        printf("FAIL: %s, length %u, offset %u\n", what, length, offset);
+    return ok;
+}
+
+static bool run_checks()
+{
+    bool pass = true;
+    uint8_t data[TEST_MAX_LENGTH + 4];
+    uint8_t copy[TEST_MAX_LENGTH + 4];
+    static const uint8_t zeros[TEST_MAX_LENGTH];
+
+    const uint8_t check_string[] = "123456789";
+    const uint16_t check_crc = crc16_update(CRC16_INIT, check_string, 9);
+    printf("check value %04x, %04x before the final inversion\n", check_crc, (uint16_t)~check_crc);
+    pass &= check(check_crc == (uint16_t)~TEST_CHECK_VALUE, "check string", 9, 0);
+    pass &= check(reference_crc16_le(CRC16_INIT, check_string, 9) == check_crc, "reference check string", 9, 0);
+    pass &= check(crc16_update(CRC16_INIT, check_string, 0) == CRC16_INIT, "empty data", 0, 0);
+
+    for(uint32_t index = 0; index < sizeof(data); index++)
+        data[index] = random_next();
+
+    for(uint32_t length = 0; length <= TEST_MAX_LENGTH; length++) {
+        for(uint32_t offset = 0; offset < 4; offset++) {
+            const uint16_t start = offset == 0 ? CRC16_INIT : random_next();
+            const uint16_t expected = reference_crc16_le(start, data + offset, length);
+            pass &= check(crc16_update(start, data + offset, length) == expected, "update", length, offset);
+
+            memset(copy, 0, sizeof(copy));
+            pass &= check(crc16_update_copy(start, copy + offset, data + offset, length) == expected, "copy",
+                          length, offset);
+            pass &= check(memcmp(copy + offset, data + offset, length) == 0, "copied data", length, offset);
+            pass &= check(copy[offset + length] == 0, "copy past the end", length, offset);
+
+            const uint16_t zero_crc = reference_crc16_le(start, zeros, length);
+            pass &= check(crc16_update_zeros(start, length) == zero_crc, "zeros", length, offset);
+        }
+    }
+
+    // Split points, as when a packet is checked without its CRC field
+    for(uint32_t length = 0; length <= 260; length++) {
+        const uint16_t whole = crc16_update(CRC16_INIT, data, length);
+        for(uint32_t split = 0; split <= length; split++) {
+            const uint16_t first = crc16_update(CRC16_INIT, data, split);
+            pass &= check(crc16_update(first, data + split, length - split) == whole, "split", length, split);
+        }
+    }
+
+    // Zeros in the middle of the data, as a CRC field that is treated as zero
+    for(uint32_t length = 0; length <= 260; length++) {
+        for(uint32_t zero_length = 0; zero_length <= 8; zero_length++) {
+            memcpy(copy, data, length);
+            memset(copy + length, 0, zero_length);
+            memcpy(copy + length + zero_length, data, 16);
+
+            uint16_t crc = crc16_update(CRC16_INIT, data, length);
+            crc = crc16_update_zeros(crc, zero_length);
+            crc = crc16_update(crc, data, 16);
+            pass &= check(crc == reference_crc16_le(CRC16_INIT, copy, length + zero_length + 16), "zero fill",
+                          length, zero_length);
+        }
+    }
+
+    return pass;
+}
+
+typedef enum {
+    BENCH_REFERENCE,
+    BENCH_UPDATE,
+    BENCH_COPY,
+    BENCH_ZEROS,
+    BENCH_COUNT,
+} bench_t;
+
+static const char *bench_names[BENCH_COUNT] = { "reference", "update", "copy", "zeros" };
+
+static void run_bench(uint64_t total_bytes)
+{
+    uint8_t *data = malloc(TEST_MAX_LENGTH);
+    uint8_t *copy = malloc(TEST_MAX_LENGTH);
+    if(data == NULL || copy == NULL)
+        exit(1);
+    for(uint32_t index = 0; index < TEST_MAX_LENGTH; index++)
+        data[index] = random_next();
+
+    printf("%-10s %8s %12s %10s\n", "function", "bytes", "ns/packet", "MB/s");
+
+    uint16_t checksum = 0;
+    for(size_t size = 0; size < sizeof(bench_lengths)/sizeof(bench_lengths[0]); size++) {
+        const uint32_t length = bench_lengths[size];
+        for(bench_t bench = 0; bench < BENCH_COUNT; bench++) {
+            // The bitwise reference is a lot slower, so it gets less data
+            const uint64_t packets = total_bytes/length/(bench == BENCH_REFERENCE ? 8 : 1) + 1;
+
+            const int64_t start_ns = time_ns();
+            for(uint64_t packet = 0; packet < packets; packet++) {
+                switch(bench) {
+                case BENCH_REFERENCE:
+                    checksum += reference_crc16_le(checksum, data, length);
+                    break;
+                case BENCH_UPDATE:
+                    checksum += crc16_update(checksum, data, length);
+                    break;
+                case BENCH_COPY:
+                    checksum += crc16_update_copy(checksum, copy, data, length);
+                    break;
+                case BENCH_ZEROS:
+                    checksum += crc16_update_zeros(checksum, length);
+                    break;
+                default:
+                    break;
+                }
+            }
+            const double ns_per_packet = (double)(time_ns() - start_ns)/packets;
+
+            printf("%-10s %8u %12.1f %10.1f\n", bench_names[bench], length, ns_per_packet,
+                   length/ns_per_packet*1e3);
+        }
+    }
+    printf("checksum %04x\n", checksum);
+
+    free(data);
+    free(copy);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t total_bytes = 256*1024*1024;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--bytes") == 0 && arg + 1 < argc)
+            total_bytes = strtoull(argv[++arg], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--bytes N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const bool pass = run_checks();
+    run_bench(total_bytes);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,376 @@
+//! ARTDMX delta coding benchmark
+//!
+//! Sends a few seconds of synthetic cues, or the frames of a recording made
+//! by the recorder, with the ARTDMX sender: once with every frame sent in
+//! full, and once with delta coding and a keyframe every second. The
+//! packets are framed (and compressed where that helps) as the transponder
+//! would, and this reports the bytes and packets on air per universe for
+//! each, and the saving.
+//!
+//! It also times artdmx_delta_encode() and artdmx_delta_apply() on every
+//! frame of each cue, against the frame before it, and checks that each
+//! delta rebuilds the frame. The cues are:
+//!
+//! * fixtures: moving lights, 12 channels each, holding a look while a few
+//!   of them move and fade, as in a typical cue
+//! * chase: blocks of pixels moving slowly along the strip
+//! * noise: pixels with slowly changing random brightness
+//! * fade: a whole pixel strip fading, so every pixel changes together
+//! * rainbow: a rainbow moving fast along a pixel strip, so every slot
+//!   changes every frame
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/delta_bench [--universes N] [--seconds N] [--recording FILE]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "esp_now.h"
+
+#include "framing.h"
+#include "artdmx.h"
+#include "artdmx_delta.h"
+#include "pattern.h"
+#include "recording.h"
+
+#define BENCH_FRAMERATE             44
+#define BENCH_MAX_UNIVERSES         64
+
+//! Channels of each moving light in the fixtures cue
+#define BENCH_FIXTURE_CHANNELS      12
+
+typedef struct {
+    const char *name;
+    uint16_t universes;
+    uint32_t frames;
+    uint8_t *data;                      //!< Every universe of every frame, ARTDMX_UNIVERSE_SIZE each
+} cue_t;
+
+//! Bytes and packets handed to the air by the stand-in transponder
+static uint64_t air_bytes;
+static uint64_t air_packets;
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+// Stand-in for the transponder's send functions, which frames each packet
+// and counts it
+
+int espnow_transponder_max_packet_size() {
+    return ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t);
+}
+
+int espnow_transponder_max_compressed_size() {
+    return ESPNOW_TRANSPONDER_MAX_DATA_LENGTH;
+}
+
+esp_err_t espnow_transponder_sendv_class(const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                                         espnow_transponder_class_t traffic_class) {
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    const int length = framing_build(packet, espnow_transponder_max_packet_size(), parts, part_count, true,
+                                     traffic_class, NULL, NULL, NULL);
+    if(length < 0)
+        return ESP_ERR_INVALID_SIZE;
+
+    air_bytes += length;
+    air_packets++;
+    return ESP_OK;
+}
+
+esp_err_t espnow_transponder_sendv(const espnow_transponder_iovec_t *parts, uint8_t part_count) {
+    return espnow_transponder_sendv_class(parts, part_count, ESPNOW_TRANSPONDER_CLASS_REALTIME);
+}
+
+esp_err_t espnow_transponder_send_batch(espnow_transponder_message_t *messages, uint16_t message_count) {
+    esp_err_t ret = ESP_OK;
+    for(uint16_t index = 0; index < message_count; index++) {
+        messages[index].result = espnow_transponder_sendv(messages[index].parts, messages[index].part_count);
+        if(messages[index].result != ESP_OK)
+            ret = messages[index].result;
+    }
+    return ret;
+}
+
+static uint8_t *cue_frame(const cue_t *cue, uint32_t frame)
+{
+    return cue->data + (size_t)frame*cue->universes*ARTDMX_UNIVERSE_SIZE;
+}
+
+//! \brief Build the fixtures cue
+//!
+//! Each fixture has a dimmer, pan and tilt (16 bit each), color, gobo and
+//! the rest. Most hold still; every frame a few fixtures are moving, and
+//! one is fading.
+static void render_fixtures(const cue_t *cue)
+{
+    const int fixtures = ARTDMX_UNIVERSE_SIZE/BENCH_FIXTURE_CHANNELS;
+
+    for(uint32_t frame = 0; frame < cue->frames; frame++) {
+        for(uint16_t universe = 0; universe < cue->universes; universe++) {
+            uint8_t *slots = cue_frame(cue, frame) + universe*ARTDMX_UNIVERSE_SIZE;
+            memset(slots, 0, ARTDMX_UNIVERSE_SIZE);
+
+            for(int fixture = 0; fixture < fixtures; fixture++) {
+                uint8_t *channels = slots + fixture*BENCH_FIXTURE_CHANNELS;
+                const uint32_t id = universe*fixtures + fixture;
+
+                // Look: a fixed color and position per fixture
+                channels[0] = 200;
+                channels[1] = id*37;
+                channels[3] = id*53;
+                channels[5] = 40 + id % 5*40;
+                channels[6] = id % 3*60;
+                channels[7] = 255;
+
+                // Every two seconds a different group of four fixtures moves
+                if(id % 8 == (frame/(2*BENCH_FRAMERATE)) % 8 && id % 3 == 0) {
+                    const uint32_t t = frame % (2*BENCH_FRAMERATE);
+                    const uint32_t pan = id*37*256 + t*300;
+                    const uint32_t tilt = id*53*256 + t*150;
+                    channels[1] = pan >> 8;
+                    channels[2] = pan;
+                    channels[3] = tilt >> 8;
+                    channels[4] = tilt;
+                }
+
+                // And one fixture in each universe fades
+                if(fixture == (frame/BENCH_FRAMERATE) % fixtures)
+                    channels[0] = 200 - frame % BENCH_FRAMERATE*4;
+            }
+        }
+    }
+}
+
+//! \brief Build a pixel cue with the pattern generator
+static void render_pattern(const cue_t *cue, const pattern_t *pattern)
+{
+    for(uint32_t frame = 0; frame < cue->frames; frame++)
+        pattern_render(pattern, frame, cue_frame(cue, frame), cue->universes, ARTDMX_UNIVERSE_SIZE);
+}
+
+//! \brief Write a recording into a cue, one frame for every frame of universe 0
+//!
+//! \return False if it isn't a recording that can be read
+static bool load_recording(cue_t *cue, const char *path, uint32_t max_frames)
+{
+    const int file = open(path, O_RDONLY);
+    struct stat file_stat;
+    if(file < 0 || fstat(file, &file_stat) != 0)
+        return false;
+
+    const uint8_t *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(mapped == MAP_FAILED)
+        return false;
+
+    recording_reader_t reader;
+    if(!recording_reader_init(&reader, mapped, file_stat.st_size))
+        return false;
+
+    cue->name = "recording";
+    cue->universes = reader.universe_count < BENCH_MAX_UNIVERSES ? reader.universe_count : BENCH_MAX_UNIVERSES;
+    cue->frames = 0;
+    cue->data = calloc((size_t)max_frames*cue->universes, ARTDMX_UNIVERSE_SIZE);
+    if(cue->data == NULL)
+        return false;
+
+    // Each frame of the cue holds the latest data of every universe, and a
+    // new one starts whenever universe 0 comes round again
+    uint8_t *current = calloc(cue->universes, ARTDMX_UNIVERSE_SIZE);
+    bool started = false;
+    recording_frame_t frame;
+    while(cue->frames < max_frames && current != NULL && recording_reader_next(&reader, &frame) == 1) {
+        if(frame.universe >= cue->universes)
+            continue;
+
+        if(frame.universe == 0 && started) {
+            memcpy(cue_frame(cue, cue->frames++), current, (size_t)cue->universes*ARTDMX_UNIVERSE_SIZE);
+            if(cue->frames == max_frames)
+                break;
+        }
+        memcpy(current + frame.universe*ARTDMX_UNIVERSE_SIZE, frame.data, frame.length);
+        started = true;
+    }
+
+    free(current);
+    recording_reader_free(&reader);
+    munmap((void *)mapped, file_stat.st_size);
+    return cue->frames > 1;
+}
+
+//! \brief Send a cue, and count what went on air
+static void send_cue(const cue_t *cue, uint16_t keyframe_interval, double *bytes, double *packets)
+{
+    const artdmx_sender_config_t config = {
+        .universe_count = cue->universes,
+        .keyframe_interval = keyframe_interval,
+    };
+    if(artdmx_sender_init(&config) != ESP_OK) {
+        fprintf(stderr, "Could not set up the sender\n");
+        exit(1);
+    }
+
+    air_bytes = 0;
+    air_packets = 0;
+    for(uint32_t frame = 0; frame < cue->frames; frame++)
+        artdmx_send_frame(0, cue->universes, frame, cue_frame(cue, frame), ARTDMX_UNIVERSE_SIZE);
+
+    const double universe_frames = (double)cue->frames*cue->universes;
+    *bytes = air_bytes/universe_frames;
+    *packets = air_packets/universe_frames;
+}
+
+//! \brief Time encoding and applying a delta for every frame of a cue
+//!
+//! \return False if a delta didn't rebuild its frame
+static bool time_codec(const cue_t *cue, double *encode_ns, double *apply_ns)
+{
+    const uint16_t max_runs = ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t) - sizeof(artdmx_delta_packet_t);
+    const uint32_t deltas = (cue->frames - 1)*cue->universes;
+    uint8_t *runs = malloc((size_t)deltas*max_runs);
+    int *runs_lengths = malloc(deltas*sizeof(int));
+    uint8_t frame[ARTDMX_UNIVERSE_SIZE];
+    bool pass = runs != NULL && runs_lengths != NULL;
+
+    int64_t start_ns = time_ns();
+    for(uint32_t index = 0; pass && index < deltas; index++) {
+        const uint8_t *current = cue->data + ((size_t)index + cue->universes)*ARTDMX_UNIVERSE_SIZE;
+        runs_lengths[index] = artdmx_delta_encode(current - (size_t)cue->universes*ARTDMX_UNIVERSE_SIZE, current,
+                                                  ARTDMX_UNIVERSE_SIZE, runs + (size_t)index*max_runs, max_runs);
+    }
+    *encode_ns = (double)(time_ns() - start_ns)/deltas;
+
+    uint32_t applied = 0;
+    start_ns = time_ns();
+    for(uint32_t index = 0; pass && index < deltas; index++) {
+        if(runs_lengths[index] < 0)
+            continue;
+
+        const uint8_t *previous = cue->data + (size_t)index*ARTDMX_UNIVERSE_SIZE;
+        memcpy(frame, previous, ARTDMX_UNIVERSE_SIZE);
+        pass = artdmx_delta_apply(frame, ARTDMX_UNIVERSE_SIZE, runs + (size_t)index*max_runs, runs_lengths[index])
+            && memcmp(frame, previous + (size_t)cue->universes*ARTDMX_UNIVERSE_SIZE, ARTDMX_UNIVERSE_SIZE) == 0;
+        applied++;
+    }
+    // Only deltas that fit are applied; time those alone
+    *apply_ns = applied > 0 ? (double)(time_ns() - start_ns)/applied : 0;
+
+    free(runs);
+    free(runs_lengths);
+    return pass;
+}
+
+static bool run_cue(const cue_t *cue)
+{
+    double full_bytes;
+    double full_packets;
+    double delta_bytes;
+    double delta_packets;
+    send_cue(cue, 0, &full_bytes, &full_packets);
+    send_cue(cue, BENCH_FRAMERATE, &delta_bytes, &delta_packets);
+
+    artdmx_sender_stats_t stats;
+    artdmx_sender_get_statistics(&stats);
+
+    double encode_ns;
+    double apply_ns;
+    const bool pass = time_codec(cue, &encode_ns, &apply_ns);
+
+    printf("%-10s %8.1f %8.2f %8.1f %8.2f %7.1fx %7.1f%% %9.1f %9.1f\n", cue->name, full_bytes, full_packets,
+           delta_bytes, delta_packets, full_bytes/delta_bytes,
+           100.0*stats.deltas/(stats.deltas + stats.keyframes), encode_ns, apply_ns);
+
+    if(!pass)
+        printf("FAIL: a delta of the %s cue didn't rebuild its frame\n", cue->name);
+    return pass;
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t universes = 20;
+    uint32_t seconds = 10;
+    const char *recording_path = NULL;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--recording") == 0 && arg + 1 < argc)
+            recording_path = argv[++arg];
+        else {
+            fprintf(stderr, "Usage: %s [--universes N] [--seconds N] [--recording FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(universes == 0 || universes > BENCH_MAX_UNIVERSES || seconds == 0) {
+        fprintf(stderr, "The universes must be between 1 and %i\n", BENCH_MAX_UNIVERSES);
+        return 2;
+    }
+
+    pattern_init();
+
+    const uint32_t frames = seconds*BENCH_FRAMERATE;
+    cue_t cue = {
+        .universes = universes,
+        .frames = frames,
+        .data = malloc((size_t)frames*universes*ARTDMX_UNIVERSE_SIZE),
+    };
+    if(cue.data == NULL)
+        return 1;
+
+    printf("%-10s %8s %8s %8s %8s %8s %8s %9s %9s\n", "cue", "full B", "packets", "delta B", "packets", "saving",
+           "deltas", "enc ns", "apply ns");
+
+    bool pass = true;
+    if(recording_path != NULL) {
+        cue_t recording;
+        if(!load_recording(&recording, recording_path, frames)) {
+            fprintf(stderr, "Could not read %s\n", recording_path);
+            return 1;
+        }
+        pass &= run_cue(&recording);
+        free(recording.data);
+    }
+
+    cue.name = "fixtures";
+    render_fixtures(&cue);
+    pass &= run_cue(&cue);
+
+    static const struct {
+        const char *name;
+        pattern_t pattern;
+    } pixel_cues[] = {
+        { "chase", { .effect = PATTERN_CHASE, .color = { 255, 80, 0 }, .brightness = 255, .speed = 64,
+                     .scale = 24, .width = 8 } },
+        { "noise", { .effect = PATTERN_NOISE, .color = { 0, 120, 255 }, .brightness = 255, .speed = 200,
+                     .scale = 4000 } },
+        { "fade", { .effect = PATTERN_FADE, .color = { 255, 255, 255 }, .brightness = 255, .gamma = true,
+                    .speed = 400, .scale = 0 } },
+        { "rainbow", { .effect = PATTERN_RAINBOW, .brightness = 255, .speed = 2000, .scale = 600 } },
+    };
+    for(size_t index = 0; index < sizeof(pixel_cues)/sizeof(pixel_cues[0]); index++) {
+        cue.name = pixel_cues[index].name;
+        render_pattern(&cue, &pixel_cues[index].pattern);
+        pass &= run_cue(&cue);
+    }
+
+    free(cue.data);
+    printf("Bytes and packets are on air, per universe per frame\n");
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
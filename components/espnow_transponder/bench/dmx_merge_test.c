@@ -0,0 +1,434 @@
+//! DMX merge tests and benchmark
+//!
+//! Checks dmx_merge.c, which the Art-Net gateway uses to combine the
+//! sources of a universe:
+//!
+//! * the word at a time HTP maximum, against a per-slot maximum, for every
+//!   pair of slot values
+//! * HTP and LTP between sources of the same priority, including short
+//!   frames and a source leaving
+//! * priority: a higher priority source takes over the whole output, lower
+//!   ones are tracked while outranked, and take over with their latest frame
+//!   once it times out
+//! * the source timeout, and the source limit
+//! * sequence numbers: late and repeated frames are dropped, a jump back of
+//!   more than the E1.31 window is a restart, and 0 turns the check off
+//! * random frames from several sources, with random priorities, sequence
+//!   numbers, lengths and timeouts, against a simple per-slot HTP model
+//!
+//! It then times dmx_merge_update() with one to DMX_MERGE_MAX_SOURCES
+//! sources sending full, changing frames, for HTP and LTP, and reports the
+//! time per update, and how many universes one core could merge at 44
+//! frames per second from that many sources.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/dmx_merge_test [--updates N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dmx_merge.h"
+#include "bench_util.h"
+
+//! Frame rate the capacity is reported for
+#define BENCH_FPS                   44
+
+//! Source ids used by the random test, more than can be tracked at once
+#define TEST_SOURCE_IDS             6
+
+//! \brief Check the merged output against a frame
+static void check_output(const dmx_merge_t *merge, const uint8_t *expected, uint16_t length, const char *what)
+{
+    uint16_t output_length;
+    const uint8_t *output = dmx_merge_output(merge, &output_length);
+    check(output_length == length && memcmp(output, expected, length) == 0, what);
+}
+
+static void random_frame(uint8_t *frame, uint16_t length)
+{
+    for(int slot = 0; slot < length; slot++)
+        frame[slot] = random_next();
+}
+
+//! \brief HTP of every pair of slot values, which covers the packed maximum
+static void test_htp_values()
+{
+    dmx_merge_t merge;
+    uint8_t a[DMX_MERGE_SLOTS];
+    uint8_t b[DMX_MERGE_SLOTS];
+    uint8_t expected[DMX_MERGE_SLOTS];
+
+    // Each pair of frames holds 512 of the 65536 pairs, in every slot position
+    for(int pair = 0; pair < 65536; pair += DMX_MERGE_SLOTS) {
+        dmx_merge_init(&merge, DMX_MERGE_HTP, DMX_MERGE_TIMEOUT_US);
+        for(int slot = 0; slot < DMX_MERGE_SLOTS; slot++) {
+            const int value = pair + slot*127 % DMX_MERGE_SLOTS;
+            a[slot] = value >> 8;
+            b[slot] = value;
+            expected[slot] = a[slot] > b[slot] ? a[slot] : b[slot];
+        }
+
+        dmx_merge_update(&merge, 1, 100, 0, a, sizeof(a), 0);
+        dmx_merge_update(&merge, 2, 100, 0, b, sizeof(b), 0);
+        check_output(&merge, expected, sizeof(expected), "htp of every slot value pair");
+    }
+}
+
+static void test_htp()
+{
+    dmx_merge_t merge;
+    uint8_t a[DMX_MERGE_SLOTS];
+    uint8_t b[DMX_MERGE_SLOTS];
+    uint8_t expected[DMX_MERGE_SLOTS];
+
+    dmx_merge_init(&merge, DMX_MERGE_HTP, DMX_MERGE_TIMEOUT_US);
+    random_frame(a, sizeof(a));
+    check(dmx_merge_update(&merge, 1, 100, 0, a, 511, 0) == DMX_MERGE_CHANGED, "htp first source merged");
+    check_output(&merge, a, 511, "htp single source");
+
+    // A shorter frame from a second source is zero padded
+    random_frame(b, sizeof(b));
+    check(dmx_merge_update(&merge, 2, 100, 0, b, 3, 0) == DMX_MERGE_CHANGED, "htp second source merged");
+    memcpy(expected, a, 511);
+    for(int slot = 0; slot < 3; slot++)
+        expected[slot] = a[slot] > b[slot] ? a[slot] : b[slot];
+    check_output(&merge, expected, 511, "htp short second source");
+    check(dmx_merge_source_count(&merge) == 2, "htp source count");
+
+    // A source that lowers a slot lowers the output, down to the other's value
+    memset(a, 0, sizeof(a));
+    dmx_merge_update(&merge, 1, 100, 0, a, 511, 1);
+    memset(expected, 0, sizeof(expected));
+    memcpy(expected, b, 3);
+    check_output(&merge, expected, 511, "htp source lowering its slots");
+
+    check(dmx_merge_remove(&merge, 1), "htp remove");
+    check_output(&merge, b, 3, "htp after remove");
+    check(!dmx_merge_remove(&merge, 1), "htp remove twice");
+}
+
+static void test_ltp()
+{
+    dmx_merge_t merge;
+    uint8_t a[DMX_MERGE_SLOTS];
+    uint8_t b[DMX_MERGE_SLOTS];
+    uint8_t expected[DMX_MERGE_SLOTS];
+
+    dmx_merge_init(&merge, DMX_MERGE_LTP, DMX_MERGE_TIMEOUT_US);
+    memset(a, 10, sizeof(a));
+    memset(b, 20, sizeof(b));
+
+    dmx_merge_update(&merge, 1, 100, 0, a, sizeof(a), 0);
+    check_output(&merge, a, sizeof(a), "ltp first source");
+
+    // A joining source has the latest value of every slot
+    dmx_merge_update(&merge, 2, 100, 0, b, sizeof(b), 1);
+    check_output(&merge, b, sizeof(b), "ltp joining source");
+
+    // Only the slots a source changes move over to it
+    a[10] = 99;
+    a[300] = 0;
+    dmx_merge_update(&merge, 1, 100, 0, a, sizeof(a), 2);
+    memcpy(expected, b, sizeof(expected));
+    expected[10] = 99;
+    expected[300] = 0;
+    check_output(&merge, expected, sizeof(expected), "ltp changed slots");
+
+    b[11] = 77;
+    dmx_merge_update(&merge, 2, 100, 0, b, sizeof(b), 3);
+    expected[11] = 77;
+    check_output(&merge, expected, sizeof(expected), "ltp other source's changed slots");
+
+    // Resending the same frame changes nothing
+    dmx_merge_update(&merge, 2, 100, 0, b, sizeof(b), 4);
+    check_output(&merge, expected, sizeof(expected), "ltp unchanged frame");
+
+    // Slots hold their values when a source leaves
+    dmx_merge_remove(&merge, 1);
+    check_output(&merge, expected, sizeof(expected), "ltp hold after remove");
+
+    // Control passing to a higher priority, and back, takes the latest frame at that priority
+    uint8_t c[DMX_MERGE_SLOTS];
+    memset(c, 50, sizeof(c));
+    check(dmx_merge_update(&merge, 3, 150, 0, c, sizeof(c), 5) == DMX_MERGE_CHANGED, "ltp higher priority");
+    check_output(&merge, c, sizeof(c), "ltp higher priority output");
+    check(dmx_merge_update(&merge, 2, 100, 0, b, sizeof(b), 6) == DMX_MERGE_OUTRANKED, "ltp outranked");
+    dmx_merge_remove(&merge, 3);
+    check_output(&merge, b, sizeof(b), "ltp back to lower priority");
+}
+
+static void test_priority()
+{
+    dmx_merge_t merge;
+    uint8_t low[DMX_MERGE_SLOTS];
+    uint8_t high[DMX_MERGE_SLOTS];
+    const uint32_t timeout_us = 1000;
+
+    dmx_merge_init(&merge, DMX_MERGE_HTP, timeout_us);
+    memset(low, 200, sizeof(low));
+    memset(high, 1, sizeof(high));
+
+    dmx_merge_update(&merge, 1, 100, 0, low, sizeof(low), 0);
+    check(dmx_merge_update(&merge, 2, 150, 0, high, sizeof(high), 0) == DMX_MERGE_CHANGED, "priority takes over");
+    check_output(&merge, high, sizeof(high), "higher priority isn't merged with lower");
+
+    // The low source keeps sending, and is tracked
+    low[0] = 201;
+    check(dmx_merge_update(&merge, 1, 100, 0, low, sizeof(low), 600) == DMX_MERGE_OUTRANKED, "lower outranked");
+    check_output(&merge, high, sizeof(high), "outranked frame doesn't change the output");
+
+    // The high source stops, and the low one takes over with its latest frame
+    check(!dmx_merge_expire(&merge, timeout_us), "no expiry at the timeout");
+    check(dmx_merge_expire(&merge, timeout_us + 1), "expiry after the timeout");
+    check(merge.timeouts == 1 && dmx_merge_source_count(&merge) == 1, "one source timed out");
+    check_output(&merge, low, sizeof(low), "lower priority takes over");
+
+    // A source can change its own priority
+    check(dmx_merge_update(&merge, 1, 50, 0, low, sizeof(low), 1100) == DMX_MERGE_CHANGED, "priority change");
+    check(merge.priority == 50, "priority follows the source");
+
+    // Everything gone
+    check(dmx_merge_expire(&merge, 1100 + timeout_us + 1), "last source timed out");
+    uint16_t length;
+    dmx_merge_output(&merge, &length);
+    check(length == 0, "no output without sources");
+
+    // A lower priority source after everything left takes over at once
+    check(dmx_merge_update(&merge, 3, 10, 0, low, 8, 5000) == DMX_MERGE_CHANGED, "low source after all left");
+    check_output(&merge, low, 8, "low source output");
+}
+
+static void test_sources()
+{
+    dmx_merge_t merge;
+    uint8_t frame[DMX_MERGE_SLOTS] = { 0 };
+
+    dmx_merge_init(&merge, DMX_MERGE_HTP, DMX_MERGE_TIMEOUT_US);
+    for(int id = 0; id < DMX_MERGE_MAX_SOURCES; id++)
+        check(dmx_merge_update(&merge, id, 100, 0, frame, sizeof(frame), 0) == DMX_MERGE_CHANGED, "source fits");
+    check(dmx_merge_update(&merge, DMX_MERGE_MAX_SOURCES, 100, 0, frame, sizeof(frame), 0) == DMX_MERGE_FULL,
+          "source limit");
+
+    dmx_merge_remove(&merge, 0);
+    check(dmx_merge_update(&merge, DMX_MERGE_MAX_SOURCES, 100, 0, frame, sizeof(frame), 0) == DMX_MERGE_CHANGED,
+          "source fits after one left");
+}
+
+static void test_sequence()
+{
+    dmx_merge_t merge;
+    uint8_t frame[DMX_MERGE_SLOTS];
+    uint8_t expected[DMX_MERGE_SLOTS];
+
+    dmx_merge_init(&merge, DMX_MERGE_HTP, DMX_MERGE_TIMEOUT_US);
+    memset(frame, 5, sizeof(frame));
+    dmx_merge_update(&merge, 1, 100, 100, frame, sizeof(frame), 0);
+    memcpy(expected, frame, sizeof(expected));
+
+    memset(frame, 6, sizeof(frame));
+    check(dmx_merge_update(&merge, 1, 100, 100, frame, sizeof(frame), 1) == DMX_MERGE_OUT_OF_ORDER, "repeated sequence");
+    check(dmx_merge_update(&merge, 1, 100, 99, frame, sizeof(frame), 2) == DMX_MERGE_OUT_OF_ORDER, "late frame");
+    check(dmx_merge_update(&merge, 1, 100, 81, frame, sizeof(frame), 3) == DMX_MERGE_OUT_OF_ORDER, "late in window");
+    check_output(&merge, expected, sizeof(expected), "dropped frames don't change the output");
+
+    // Further back than the window is a source that restarted
+    check(dmx_merge_update(&merge, 1, 100, 80, frame, sizeof(frame), 4) == DMX_MERGE_CHANGED, "restart");
+    check_output(&merge, frame, sizeof(frame), "restarted source output");
+
+    check(dmx_merge_update(&merge, 1, 100, 81, frame, sizeof(frame), 5) == DMX_MERGE_CHANGED, "next frame");
+
+    // Wrapping around
+    dmx_merge_update(&merge, 1, 100, 255, frame, sizeof(frame), 6);
+    check(dmx_merge_update(&merge, 1, 100, 1, frame, sizeof(frame), 7) == DMX_MERGE_CHANGED, "wrap");
+    check(dmx_merge_update(&merge, 1, 100, 255, frame, sizeof(frame), 8) == DMX_MERGE_OUT_OF_ORDER, "late across wrap");
+
+    // Sequence 0 is a source that doesn't number its frames
+    check(dmx_merge_update(&merge, 1, 100, 0, frame, sizeof(frame), 9) == DMX_MERGE_CHANGED, "unnumbered frame");
+    check(dmx_merge_update(&merge, 1, 100, 0, frame, sizeof(frame), 10) == DMX_MERGE_CHANGED, "unnumbered again");
+    check(dmx_merge_update(&merge, 1, 100, 0, frame, sizeof(frame), 11) == DMX_MERGE_CHANGED, "and again");
+}
+
+//! Source in the HTP model
+typedef struct {
+    bool active;
+    uint8_t priority;
+    uint8_t sequence;
+    uint16_t length;
+    int64_t last_us;
+    uint8_t data[DMX_MERGE_SLOTS];
+} model_source_t;
+
+//! \brief Random updates from several sources, against a per-slot HTP model
+static void test_random()
+{
+    const uint32_t timeout_us = 10000;
+    dmx_merge_t merge;
+    model_source_t model[TEST_SOURCE_IDS] = { 0 };
+    uint8_t sequences[TEST_SOURCE_IDS] = { 0 };
+    uint8_t frame[DMX_MERGE_SLOTS];
+    uint8_t expected[DMX_MERGE_SLOTS];
+    bool ok = true;
+
+    dmx_merge_init(&merge, DMX_MERGE_HTP, timeout_us);
+
+    int64_t now_us = 0;
+    for(int step = 0; step < 200000 && ok; step++) {
+        now_us += random_next() % 1000;
+        const int id = random_next() % TEST_SOURCE_IDS;
+
+        if(random_next() % 16 == 0) {
+            const bool expired = dmx_merge_expire(&merge, now_us);
+            bool model_expired = false;
+            for(int index = 0; index < TEST_SOURCE_IDS; index++) {
+                if(model[index].active && now_us - model[index].last_us > timeout_us) {
+                    model[index].active = false;
+                    model_expired = true;
+                }
+            }
+            ok &= expired == model_expired;
+        }
+        else {
+            // Mostly in order, sometimes late, sometimes unnumbered
+            const uint32_t kind = random_next() % 8;
+            if(kind == 0)
+                sequences[id] -= 1 + random_next() % 4;
+            const uint8_t sequence = kind == 1 ? 0 : ++sequences[id] == 0 ? ++sequences[id] : sequences[id];
+            const uint8_t priority = 100 + 50*(random_next() % 4 == 0);
+            const uint16_t length = random_next() % 8 == 0 ? 1 + random_next() % DMX_MERGE_SLOTS : DMX_MERGE_SLOTS;
+
+            // Few distinct values, so that ties and equal slots are common
+            for(int slot = 0; slot < length; slot++)
+                frame[slot] = random_next() % 4*85;
+
+            int active = 0;
+            for(int index = 0; index < TEST_SOURCE_IDS; index++)
+                active += model[index].active;
+
+            model_source_t *source = &model[id];
+            dmx_merge_result_t model_result = DMX_MERGE_CHANGED;
+            if(!source->active && active == DMX_MERGE_MAX_SOURCES)
+                model_result = DMX_MERGE_FULL;
+            else if(source->active && sequence != 0 && source->sequence != 0
+                && (int8_t)(sequence - source->sequence) <= 0 && (int8_t)(sequence - source->sequence) > -20)
+                model_result = DMX_MERGE_OUT_OF_ORDER;
+
+            if(model_result == DMX_MERGE_CHANGED) {
+                if(!source->active)
+                    memset(source, 0, sizeof(*source));
+                source->active = true;
+                source->priority = priority;
+                source->sequence = sequence;
+                source->length = length;
+                source->last_us = now_us;
+                memset(source->data, 0, sizeof(source->data));
+                memcpy(source->data, frame, length);
+
+                for(int index = 0; index < TEST_SOURCE_IDS; index++)
+                    if(model[index].active && model[index].priority > priority)
+                        model_result = DMX_MERGE_OUTRANKED;
+            }
+
+            const dmx_merge_result_t result = dmx_merge_update(&merge, id, priority, sequence, frame, length, now_us);
+            ok &= result == model_result;
+            if(!ok)
+                printf("step %i: source %i result %i, expected %i\n", step, id, result, model_result);
+        }
+
+        // Per-slot maximum over the active sources at the top priority
+        int top = -1;
+        for(int index = 0; index < TEST_SOURCE_IDS; index++)
+            if(model[index].active && model[index].priority > top)
+                top = model[index].priority;
+
+        uint16_t length = 0;
+        memset(expected, 0, sizeof(expected));
+        for(int index = 0; index < TEST_SOURCE_IDS; index++) {
+            if(!model[index].active || model[index].priority != top)
+                continue;
+            if(model[index].length > length)
+                length = model[index].length;
+            for(int slot = 0; slot < DMX_MERGE_SLOTS; slot++)
+                if(model[index].data[slot] > expected[slot])
+                    expected[slot] = model[index].data[slot];
+        }
+
+        uint16_t output_length;
+        const uint8_t *output = dmx_merge_output(&merge, &output_length);
+        if(output_length != length || memcmp(output, expected, length) != 0) {
+            printf("step %i: output differs from the model\n", step);
+            ok = false;
+        }
+    }
+
+    check(ok, "random htp against the model");
+}
+
+static void run_bench(uint32_t updates)
+{
+    static dmx_merge_t merge;
+    uint8_t frames[DMX_MERGE_MAX_SOURCES][DMX_MERGE_SLOTS];
+
+    printf("%-5s %8s %12s %14s\n", "mode", "sources", "ns/update", "universes@44");
+
+    uint32_t checksum = 0;
+    for(int mode = DMX_MERGE_HTP; mode <= DMX_MERGE_LTP; mode++) {
+        for(int sources = 1; sources <= DMX_MERGE_MAX_SOURCES; sources++) {
+            dmx_merge_init(&merge, mode, DMX_MERGE_TIMEOUT_US);
+            for(int source = 0; source < sources; source++)
+                random_frame(frames[source], DMX_MERGE_SLOTS);
+
+            const int64_t start_ns = time_ns();
+            for(uint32_t update = 0; update < updates; update++) {
+                const int source = update % sources;
+
+                // Every slot changes, as in a fade
+                for(int word = 0; word < DMX_MERGE_SLOTS; word += 4)
+                    frames[source][word]++;
+
+                dmx_merge_update(&merge, source, 100, 0, frames[source], DMX_MERGE_SLOTS, update);
+            }
+            const double ns_per_update = (double)(time_ns() - start_ns)/updates;
+
+            uint16_t length;
+            checksum += dmx_merge_output(&merge, &length)[0];
+
+            // Each universe takes one update per source per frame
+            printf("%-5s %8i %12.1f %14.0f\n", mode == DMX_MERGE_HTP ? "htp" : "ltp", sources, ns_per_update,
+                   1e9/(ns_per_update*sources*BENCH_FPS));
+        }
+    }
+    printf("checksum %u\n", checksum);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t updates = 1000000;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--updates") == 0 && arg + 1 < argc)
+            updates = strtoul(argv[++arg], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--updates N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    test_htp_values();
+    test_htp();
+    test_ltp();
+    test_priority();
+    test_sources();
+    test_sequence();
+    test_random();
+
+    if(updates > 0)
+        run_bench(updates);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,423 @@
+//! FEC loss simulation
+//!
+//! Sends frames of packets over the simulated medium, with FEC groups of k
+//! data packets and m parity packets built as the transponder builds them,
+//! and runs the receiver's FEC decoder on what arrives. As in the
+//! transponder, a group is cut short at the end of each frame, and its
+//! parity is sent straight after its last data packet. The packets of a
+//! frame are spread evenly over the frame, as the pacer spreads them.
+//!
+//! Each FEC setting is run against random loss at a few rates, and against
+//! burst loss, using the medium's two state loss model. For each, this
+//! reports the fraction of data packets lost on the air, the fraction still
+//! missing after FEC, the airtime the parity adds, and how much later
+//! rebuilt packets arrive than those received directly: the average, and
+//! the worst. A rebuilt packet has to wait for enough of the rest of its
+//! group, so this grows with k.
+//!
+//! It fails if a rebuilt packet doesn't match what was sent, if FEC ever
+//! loses more than it would without it, if a rebuilt packet is also
+//! delivered when the original arrives late, or if the decoder takes a data
+//! packet too long to fit its unit.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/fec_sim [--packets N] [--fps N] [--seconds N] [--k N --m N]
+//!                         [--loss P] [--burst-loss P] [--burst-enter P] [--burst-exit P]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_wifi_internal.h"
+
+#include "framing.h"
+#include "fec.h"
+#include "sim_air.h"
+
+#define SIM_SENDER                  0
+#define SIM_RECEIVER                1
+
+//! Delay from the end of a transmission to its reception
+#define SIM_LATENCY_US              100
+
+//! Shortest payload sent, the rest are random lengths up to FEC_MAX_PAYLOAD
+#define SIM_MIN_PAYLOAD             64
+
+typedef struct {
+    uint8_t k;
+    uint8_t m;
+} fec_setting_t;
+
+typedef struct {
+    const char *name;
+    float loss;
+    float burst_loss;
+    float burst_enter;
+    float burst_exit;
+} loss_model_t;
+
+static const fec_setting_t default_settings[] = {
+    { 0, 0 }, { 4, 1 }, { 4, 2 }, { 8, 2 }, { 10, 2 }, { 10, 4 },
+};
+
+static const loss_model_t default_models[] = {
+    { "random 1%", 0.01f, 0, 0, 0 },
+    { "random 5%", 0.05f, 0, 0, 0 },
+    { "random 10%", 0.10f, 0, 0, 0 },
+    // Bursts of 4 packets on average, every 50 packets, lose half of them
+    { "burst", 0.01f, 0.5f, 0.02f, 0.25f },
+};
+
+typedef struct {
+    uint16_t packets;                   //!< Data packets per frame
+    uint16_t fps;
+    uint32_t seconds;
+} sim_options_t;
+
+typedef struct {
+    uint32_t sent;                      //!< Data packets sent
+    uint32_t direct;                    //!< Data packets received
+    uint32_t recovered;                 //!< Data packets rebuilt from parity
+    uint32_t parity;                    //!< Parity packets sent
+    uint32_t corrupt;                   //!< Rebuilt packets that don't match what was sent
+    uint32_t duplicates;                //!< Data packets delivered twice
+    int64_t direct_latency_us;          //!< Total latency of the data packets received
+    int64_t recovered_latency_us;       //!< Total latency of the rebuilt packets
+    int64_t recovered_worst_us;
+    int64_t sender_airtime_us;
+    int64_t data_airtime_us;            //!< Airtime of the data packets alone
+} sim_result_t;
+
+static sim_air_t air;
+static sim_options_t options;
+static fec_encoder_t encoder;
+static fec_decoder_t decoder;
+static sim_result_t result;
+static int64_t *sent_us;                //!< Time each data packet was sent
+static uint8_t *delivered;              //!< Set once each data packet is delivered
+
+//! \brief Fill in a data packet's payload, from its sequence number
+//!
+//! \return Payload length
+static uint16_t make_payload(uint32_t sequence, uint8_t *payload)
+{
+    const uint16_t length = SIM_MIN_PAYLOAD + sequence*2654435761u % (FEC_MAX_PAYLOAD - SIM_MIN_PAYLOAD + 1);
+    memcpy(payload, &sequence, sizeof(sequence));
+    for(uint16_t index = sizeof(sequence); index < length; index++)
+        payload[index] = sequence*31 + index;
+    return length;
+}
+
+//! \brief Take a data packet, received or rebuilt
+static void deliver(const uint8_t *payload, uint16_t length, bool rebuilt)
+{
+    uint32_t sequence;
+    memcpy(&sequence, payload, sizeof(sequence));
+
+    uint8_t expected[FEC_MAX_PAYLOAD];
+    if(sequence >= result.sent || make_payload(sequence, expected) != length
+        || memcmp(expected, payload, length) != 0) {
+        result.corrupt++;
+        return;
+    }
+
+    if(delivered[sequence]) {
+        result.duplicates++;
+        return;
+    }
+    delivered[sequence] = true;
+
+    const int64_t latency_us = air.now_us - sent_us[sequence];
+    if(rebuilt) {
+        result.recovered++;
+        result.recovered_latency_us += latency_us;
+        if(latency_us > result.recovered_worst_us)
+            result.recovered_worst_us = latency_us;
+    }
+    else {
+        result.direct++;
+        result.direct_latency_us += latency_us;
+    }
+}
+
+static void fec_recovered(uint8_t flags, const uint8_t *payload, uint16_t length)
+{
+    deliver(payload, length, true);
+}
+
+static void recv_cb(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    if(framing_check(data, length) != FRAMING_OK)
+        return;
+
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(!(packet->flags & ESPNOW_TRANSPONDER_FLAG_FEC)) {
+        deliver(packet->data, packet->data_length, false);
+        return;
+    }
+
+    const fec_header_t *header = (const fec_header_t *)packet->data;
+    const uint8_t *body = packet->data + sizeof(fec_header_t);
+    const uint16_t body_length = packet->data_length - sizeof(fec_header_t);
+    const uint8_t flags = packet->flags & ~ESPNOW_TRANSPONDER_FLAG_FEC;
+
+    // As in the transponder, a data packet that was already rebuilt is consumed by the decoder
+    if(fec_decoder_add(&decoder, header, flags, body, body_length, fec_recovered) && header->index < header->k)
+        deliver(body, body_length, false);
+}
+
+static void send(const uint8_t *packet, int length, bool parity)
+{
+    const int64_t airtime_us = sim_air_airtime(&air, SIM_SENDER, length);
+    result.sender_airtime_us += airtime_us;
+    if(!parity)
+        result.data_airtime_us += airtime_us;
+
+    sim_air_send(&air, SIM_SENDER, packet, length);
+}
+
+//! \brief Send the parity packets of the current group, and start the next one
+static void send_parity()
+{
+    for(uint8_t parity = 0; parity < fec_encoder_parity_count(&encoder); parity++) {
+        uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+        espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+        const uint16_t unit_length = fec_encoder_parity(&encoder, parity, (fec_header_t *)header->data,
+                                                        header->data + sizeof(fec_header_t));
+        send(packet, framing_seal(packet, ESPNOW_TRANSPONDER_FLAG_FEC, sizeof(fec_header_t) + unit_length), true);
+        result.parity++;
+    }
+
+    fec_encoder_next_group(&encoder);
+}
+
+static uint8_t oversized_rebuilt[FEC_MAX_PAYLOAD];
+static uint16_t oversized_rebuilt_length;
+static int oversized_rebuilt_count;
+
+static void oversized_recovered(uint8_t flags, const uint8_t *payload, uint16_t length)
+{
+    memcpy(oversized_rebuilt, payload, length);
+    oversized_rebuilt_length = length;
+    oversized_rebuilt_count++;
+}
+
+//! \brief Check that the decoder drops a data packet longer than FEC_MAX_PAYLOAD
+//!
+//! A full size frame with no relay header has room for a body two bytes
+//! longer than a data unit holds. The oversized packet claims the place of
+//! data packet 0 after packet 1 has arrived, so if it were stored it would
+//! run into packet 1's unit, and packet 0 could not be rebuilt from parity.
+//!
+//! \return true if it was dropped, and packet 0 was still rebuilt
+static bool oversized_check()
+{
+    fec_encoder_init(&encoder, 2, 1);
+    fec_decoder_init(&decoder);
+
+    uint8_t payloads[2][FEC_MAX_PAYLOAD];
+    const uint16_t lengths[2] = { make_payload(0, payloads[0]), make_payload(1, payloads[1]) };
+    fec_header_t headers[2];
+    for(int index = 0; index < 2; index++)
+        fec_encoder_add(&encoder, 0, payloads[index], lengths[index], &headers[index]);
+
+    fec_header_t parity_header;
+    uint8_t parity[FEC_UNIT_SIZE];
+    const uint16_t parity_length = fec_encoder_parity(&encoder, 0, &parity_header, parity);
+
+    const uint16_t oversized_length = ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t)
+        - sizeof(fec_header_t);
+    uint8_t oversized[ESP_NOW_MAX_DATA_LEN];
+    memset(oversized, 0x5a, sizeof(oversized));
+
+    oversized_rebuilt_count = 0;
+    fec_decoder_add(&decoder, &headers[1], 0, payloads[1], lengths[1], oversized_recovered);
+    const bool taken = fec_decoder_add(&decoder, &headers[0], 0, oversized, oversized_length,
+                                       oversized_recovered);
+    fec_decoder_add(&decoder, &parity_header, 0, parity, parity_length, oversized_recovered);
+
+    return !taken && oversized_rebuilt_count == 1 && oversized_rebuilt_length == lengths[0]
+        && memcmp(oversized_rebuilt, payloads[0], lengths[0]) == 0;
+}
+
+static bool run(const fec_setting_t *setting, const loss_model_t *model)
+{
+    const sim_air_config_t air_config = {
+        .node_count = 2,
+        .phy_rate = WIFI_PHY_RATE_MCS2_LGI,
+        .loss = model->loss,
+        .burst_loss = model->burst_loss,
+        .burst_enter = model->burst_enter,
+        .burst_exit = model->burst_exit,
+        .latency_us = SIM_LATENCY_US,
+        .queue_size = 1024,
+        .seed = 1,
+    };
+    if(!sim_air_init(&air, &air_config))
+        return false;
+    sim_air_attach(&air, SIM_RECEIVER, recv_cb, NULL, NULL);
+
+    const bool fec = setting->k > 0;
+    if(fec)
+        fec_encoder_init(&encoder, setting->k, setting->m);
+    fec_decoder_init(&decoder);
+    memset(&result, 0, sizeof(result));
+
+    const uint32_t frames = options.seconds*options.fps;
+    memset(delivered, 0, (size_t)frames*options.packets);
+
+    // Spread the packets of a frame, parity included, over 90% of it
+    const int64_t period_us = 1000000/options.fps;
+    const uint32_t frame_packets = options.packets
+        + (fec ? (options.packets + setting->k - 1)/setting->k*setting->m : 0);
+    const int64_t interval_us = period_us*9/10/frame_packets;
+
+    int64_t now_us = 0;
+    for(uint32_t frame = 0; frame < frames; frame++) {
+        now_us = frame*period_us;
+        for(uint16_t index = 0; index < options.packets; index++) {
+            sim_air_run_until(&air, now_us);
+
+            uint8_t payload[FEC_MAX_PAYLOAD];
+            const uint32_t sequence = result.sent++;
+            const espnow_transponder_iovec_t part = { payload, make_payload(sequence, payload) };
+
+            uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+            bool group_full = false;
+            const int length = framing_build(packet, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t),
+                                             &part, 1, false, ESPNOW_TRANSPONDER_CLASS_REALTIME, NULL,
+                                             fec ? &encoder : NULL, &group_full);
+            sent_us[sequence] = now_us;
+            send(packet, length, false);
+            now_us += interval_us;
+
+            // The end of the frame cuts the group short
+            if(fec && (group_full || index == options.packets - 1)) {
+                sim_air_run_until(&air, now_us);
+                now_us += interval_us*fec_encoder_parity_count(&encoder);
+                send_parity();
+            }
+        }
+    }
+    sim_air_run_until(&air, now_us + period_us);
+
+    sim_air_free(&air);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    options = (sim_options_t){
+        .packets = 60,
+        .fps = 44,
+        .seconds = 20,
+    };
+    fec_setting_t setting = { 0, 0 };
+    loss_model_t model = { "custom", -1, 0, 0, 0 };
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--packets") == 0 && arg + 1 < argc)
+            options.packets = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--k") == 0 && arg + 1 < argc)
+            setting.k = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--m") == 0 && arg + 1 < argc)
+            setting.m = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--loss") == 0 && arg + 1 < argc)
+            model.loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--burst-loss") == 0 && arg + 1 < argc)
+            model.burst_loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--burst-enter") == 0 && arg + 1 < argc)
+            model.burst_enter = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--burst-exit") == 0 && arg + 1 < argc)
+            model.burst_exit = atof(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--packets N] [--fps N] [--seconds N] [--k N --m N]\n"
+                    "          [--loss P] [--burst-loss P] [--burst-enter P] [--burst-exit P]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(options.packets == 0 || options.fps == 0 || options.seconds == 0 || setting.k > FEC_MAX_K
+        || setting.m > FEC_MAX_M || (setting.k > 0) != (setting.m > 0)) {
+        fprintf(stderr, "k must be up to %i and m up to %i, and both set or neither\n", FEC_MAX_K, FEC_MAX_M);
+        return 2;
+    }
+
+    // A setting or a loss model given on the command line replaces the defaults
+    const fec_setting_t *settings = default_settings;
+    size_t setting_count = sizeof(default_settings)/sizeof(default_settings[0]);
+    if(setting.k > 0) {
+        settings = &setting;
+        setting_count = 1;
+    }
+    const loss_model_t *models = default_models;
+    size_t model_count = sizeof(default_models)/sizeof(default_models[0]);
+    if(model.loss >= 0) {
+        models = &model;
+        model_count = 1;
+    }
+
+    const uint32_t packet_count = options.seconds*options.fps*options.packets;
+    sent_us = malloc(packet_count*sizeof(int64_t));
+    delivered = malloc(packet_count);
+    if(sent_us == NULL || delivered == NULL)
+        return 1;
+
+    fec_init();
+
+    printf("%-11s %5s %8s %8s %9s %10s %10s\n", "loss", "k+m", "raw", "after", "airtime", "added us",
+           "worst us");
+
+    bool pass = true;
+    if(!oversized_check()) {
+        printf("FAIL: a data packet longer than a unit holds was not dropped\n");
+        pass = false;
+    }
+
+    for(size_t model_index = 0; model_index < model_count; model_index++) {
+        double raw_loss = 0;
+        for(size_t setting_index = 0; setting_index < setting_count; setting_index++) {
+            const fec_setting_t *current = &settings[setting_index];
+            if(!run(current, &models[model_index])) {
+                fprintf(stderr, "Could not set up the medium\n");
+                return 1;
+            }
+
+            const double lost = 1 - (double)result.direct/result.sent;
+            const double after = 1 - (double)(result.direct + result.recovered)/result.sent;
+            const double direct_us = result.direct > 0 ? (double)result.direct_latency_us/result.direct : 0;
+            const double added_us = result.recovered > 0
+                ? (double)result.recovered_latency_us/result.recovered - direct_us : 0;
+
+            char k_m[16];
+            snprintf(k_m, sizeof(k_m), current->k > 0 ? "%u+%u" : "off", current->k, current->m);
+            printf("%-11s %5s %7.3f%% %7.3f%% %8.0f%% %10.0f %10lli\n", models[model_index].name, k_m, 100*lost,
+                   100*after, 100.0*result.sender_airtime_us/result.data_airtime_us, added_us,
+                   (long long)(result.recovered > 0 ? result.recovered_worst_us - (int64_t)direct_us : 0));
+
+            if(current->k == 0)
+                raw_loss = after;
+
+            if(result.corrupt > 0 || result.duplicates > 0) {
+                printf("FAIL: %u rebuilt packets corrupt, %u delivered twice\n", result.corrupt,
+                       result.duplicates);
+                pass = false;
+            }
+            if(after > lost || (setting_count > 1 && after > raw_loss)) {
+                printf("FAIL: more was lost with FEC than without\n");
+                pass = false;
+            }
+        }
+    }
+
+    free(sent_us);
+    free(delivered);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
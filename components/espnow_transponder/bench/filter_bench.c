@@ -0,0 +1,450 @@
+//! Receive filter benchmark on the simulated medium
+//!
+//! Sends frames of ARTDMX-like packets, one per universe, compressed and
+//! protected by FEC as the sender role sends them, from node 0 of a
+//! simulated medium to the real transponder on node 1. The packets are
+//! built up front and sent at a fixed rate, so that the time spent sending
+//! them is the same in each phase.
+//!
+//! The same frames are received twice: once with every universe wanted,
+//! and once subscribed to a few of them. For each, this reports the
+//! packets received on the air, the packets the receive callback dropped
+//! and the packets it copied and queued, the packets delivered, the lost
+//! packets FEC rebuilt and couldn't, and the process CPU time per packet
+//! on the air, which includes the medium and the sending. The receive
+//! callback is then timed on its own, called directly with the same
+//! packets in short bursts, yielding to the transponder task in between.
+//! Lost packets with unsubscribed keys can't be told apart from wanted ones,
+//! so they count as unrecoverable.
+//!
+//! With --relay, the packets carry a relay header and the transponder
+//! relays them, so they can only be filtered once they have been forwarded.
+//!
+//! It fails if a packet with an unsubscribed key is delivered, or if, with
+//! no loss, a wanted packet isn't delivered, an unwanted data packet is
+//! queued, a filtered packet is counted as unrecoverable, or a relayed
+//! packet isn't passed on to be relayed.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/filter_bench [--frames N] [--universes N] [--subscribe N] [--pps N]
+//!                              [--fec K M] [--loss P] [--seed N] [--relay]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+
+#include "espnow_transponder.h"
+#include "transport_sim.h"
+#include "framing.h"
+#include "fec.h"
+#include "sim_host.h"
+
+#define SIM_SENDER                  0
+#define SIM_RECEIVER                1
+
+//! Time allowed for the last packets to be received, after they are sent
+#define SIM_DRAIN_US                200000
+
+//! Universe data in each packet
+#define BENCH_DATA_LENGTH           200
+
+//! Packets passed straight to the receive callback at a time, less than the receive queue
+#define BENCH_BURST                 8
+
+//! Origin of the relayed packets, as if sent by another node
+#define BENCH_RELAY_ORIGIN          0x5a5a
+
+typedef struct {
+    uint32_t frames;
+    uint16_t universes;
+    uint16_t subscribe;
+    uint32_t pps;
+    uint8_t fec_k;
+    uint8_t fec_m;
+    float loss;
+    uint32_t seed;
+    bool relay;
+} bench_options_t;
+
+typedef struct {
+    uint16_t length;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} bench_packet_t;
+
+typedef struct {
+    uint64_t air;                       //!< Packets received on the air
+    espnow_transponder_stats_t stats;   //!< Transponder statistics
+    uint64_t wanted;                    //!< Packets delivered with a subscribed key
+    uint64_t unwanted;                  //!< Packets delivered with an unsubscribed key
+    double cpu_ns;                      //!< Process CPU time per packet on the air
+    double callback_ns;                 //!< Time spent in the receive callback per packet
+} bench_result_t;
+
+//! Keys delivered to the callback, counted from the transponder task
+static atomic_uint_fast64_t delivered[ESPNOW_TRANSPONDER_MAX_KEYS];
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief Get the CPU time used by the process, in nanoseconds
+static int64_t cpu_time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+static void receive_packet(const uint8_t *data, uint16_t data_length)
+{
+    if(data_length < ESPNOW_TRANSPONDER_KEY_LENGTH)
+        return;
+
+    const uint16_t key = data[0] | data[1] << 8;
+    if(key < ESPNOW_TRANSPONDER_MAX_KEYS)
+        atomic_fetch_add_explicit(&delivered[key], 1, memory_order_relaxed);
+}
+
+//! \brief Check if a universe is one of the subscribed ones, spread over all of them
+static bool subscribed(const bench_options_t *options, uint16_t universe)
+{
+    return universe*options->subscribe % options->universes < options->subscribe;
+}
+
+//! \brief Fill in the relay header for the next packet, as the sending node would
+//!
+//! Sequence numbers carry on from one build to the next, so that the relay
+//! doesn't take the second build as copies of the first.
+//!
+//! \return The header, or NULL if the packets aren't relayed
+static const espnow_transponder_relay_header_t *relay_header_next(const bench_options_t *options,
+                                                                  espnow_transponder_relay_header_t *header)
+{
+    static uint16_t sequence;
+
+    if(!options->relay)
+        return NULL;
+
+    header->origin = BENCH_RELAY_ORIGIN;
+    header->sequence = sequence++;
+    header->ttl = 1;
+    return header;
+}
+
+//! \brief Add the parity packets of the current group, and start the next one
+static uint32_t add_parity(const bench_options_t *options, fec_encoder_t *encoder, bench_packet_t *packets,
+                           uint32_t count)
+{
+    for(uint8_t parity = 0; parity < fec_encoder_parity_count(encoder); parity++) {
+        espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packets[count].data;
+        uint8_t flags = ESPNOW_TRANSPONDER_FLAG_FEC;
+        uint8_t *fec_header = header->data;
+
+        espnow_transponder_relay_header_t relay_header;
+        if(relay_header_next(options, &relay_header) != NULL) {
+            memcpy(fec_header, &relay_header, sizeof(relay_header));
+            fec_header += sizeof(relay_header);
+            flags |= ESPNOW_TRANSPONDER_FLAG_RELAY;
+        }
+
+        const uint16_t unit_length = fec_encoder_parity(encoder, parity, (fec_header_t *)fec_header,
+                                                        fec_header + sizeof(fec_header_t));
+        packets[count].length = framing_seal(packets[count].data, flags,
+                                             fec_header - header->data + sizeof(fec_header_t) + unit_length);
+        count++;
+    }
+    fec_encoder_next_group(encoder);
+
+    return count;
+}
+
+//! \brief Build every packet, cutting the FEC group short at the end of each frame
+//!
+//! \param options Options
+//! \param encoder FEC encoder, which carries on from the previous call so that groups aren't repeated
+//! \param packets Filled in with the packets
+//! \return Number of packets built
+static uint32_t build_packets(const bench_options_t *options, fec_encoder_t *encoder, bench_packet_t *packets)
+{
+    uint32_t count = 0;
+    for(uint32_t frame = 0; frame < options->frames; frame++) {
+        for(uint16_t universe = 0; universe < options->universes; universe++) {
+            // Key, sequence, then a slow color fade, which compresses
+            uint8_t payload[ESPNOW_TRANSPONDER_KEY_LENGTH + 1 + BENCH_DATA_LENGTH];
+            payload[0] = universe & 0xFF;
+            payload[1] = universe >> 8;
+            payload[2] = frame & 0xFF;
+            for(int slot = 0; slot < BENCH_DATA_LENGTH; slot++)
+                payload[3 + slot] = (frame + universe*16 + slot/3*(slot%3 + 1)) & 0xFF;
+
+            const espnow_transponder_iovec_t part = { payload, sizeof(payload) };
+            espnow_transponder_relay_header_t relay_header;
+            const int relay_length = options->relay ? sizeof(relay_header) : 0;
+            bool group_full = false;
+            packets[count].length = framing_build(packets[count].data, FEC_MAX_PAYLOAD - relay_length, &part, 1,
+                                                  true, ESPNOW_TRANSPONDER_CLASS_REALTIME,
+                                                  relay_header_next(options, &relay_header),
+                                                  options->fec_k > 0 ? encoder : NULL, &group_full);
+            count++;
+
+            if(group_full)
+                count = add_parity(options, encoder, packets, count);
+        }
+
+        if(options->fec_k > 0)
+            count = add_parity(options, encoder, packets, count);
+    }
+
+    return count;
+}
+
+//! \brief Time the receive callback on its own, passing it the packets directly
+//!
+//! \return Average time per packet, in nanoseconds
+static double time_callback(const bench_packet_t *packets, uint32_t count)
+{
+    int64_t total_ns = 0;
+    for(uint32_t index = 0; index < count; index++) {
+        if(index % BENCH_BURST == 0)
+            sched_yield();
+
+        sim_air_t *air = sim_host_lock();
+        const sim_air_node_t *node = &air->nodes[SIM_RECEIVER];
+        const int64_t start_ns = time_ns();
+        node->recv_cb(node->context, SIM_SENDER, packets[index].data, packets[index].length);
+        total_ns += time_ns() - start_ns;
+        sim_host_unlock();
+    }
+    sleep_until_us(time_us() + SIM_DRAIN_US);
+
+    return count > 0 ? (double)total_ns/count : 0;
+}
+
+//! \brief Send every packet, and total what the transponder did with them
+static void run_phase(const bench_options_t *options, const bench_packet_t *packets, uint32_t count,
+                      bench_result_t *result)
+{
+    for(int key = 0; key < ESPNOW_TRANSPONDER_MAX_KEYS; key++)
+        atomic_store(&delivered[key], 0);
+
+    espnow_transponder_stats_t before;
+    espnow_transponder_get_statistics(&before);
+    sim_air_t *air = sim_host_lock();
+    const uint64_t air_before = air->nodes[SIM_RECEIVER].stats.rx_packets;
+    sim_host_unlock();
+
+    const int64_t cpu_start_ns = cpu_time_ns();
+    const int64_t start_us = time_us();
+    for(uint32_t index = 0; index < count; index++) {
+        sleep_until_us(start_us + (int64_t)index*1000000/options->pps);
+
+        air = sim_host_lock();
+        sim_air_send(air, SIM_SENDER, packets[index].data, packets[index].length);
+        sim_host_unlock();
+    }
+    sleep_until_us(time_us() + SIM_DRAIN_US);
+    const int64_t cpu_ns = cpu_time_ns() - cpu_start_ns;
+
+    air = sim_host_lock();
+    result->air = air->nodes[SIM_RECEIVER].stats.rx_packets - air_before;
+    sim_host_unlock();
+
+    espnow_transponder_get_statistics(&result->stats);
+    result->stats.rx_count -= before.rx_count;
+    result->stats.rx_filtered -= before.rx_filtered;
+    result->stats.rx_fec_recovered -= before.rx_fec_recovered;
+    result->stats.rx_fec_unrecoverable -= before.rx_fec_unrecoverable;
+    result->stats.tx_relayed -= before.tx_relayed;
+    result->stats.tx_relay_dropped -= before.tx_relay_dropped;
+
+    result->wanted = 0;
+    result->unwanted = 0;
+    for(uint16_t universe = 0; universe < options->universes; universe++) {
+        if(subscribed(options, universe))
+            result->wanted += atomic_load(&delivered[universe]);
+        else
+            result->unwanted += atomic_load(&delivered[universe]);
+    }
+
+    result->cpu_ns = result->air > 0 ? (double)cpu_ns/result->air : 0;
+
+    // The packets have been counted, so sending them again doesn't matter
+    result->callback_ns = time_callback(packets, count);
+}
+
+static void print_result(const char *name, const bench_result_t *result)
+{
+    printf("%-12s %8llu %8llu %8llu %8llu %8llu %8llu %8llu %9.0f %8.0f\n", name,
+           (unsigned long long)result->air, (unsigned long long)result->stats.rx_filtered,
+           (unsigned long long)result->stats.rx_count, (unsigned long long)result->wanted,
+           (unsigned long long)result->unwanted, (unsigned long long)result->stats.rx_fec_recovered,
+           (unsigned long long)result->stats.rx_fec_unrecoverable, result->cpu_ns, result->callback_ns);
+}
+
+static bool check(bool ok, const char *what)
+{
+    if(!ok)
+        printf("check failed: %s\n", what);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options_t options = {
+        .frames = 400,
+        .universes = 24,
+        .subscribe = 2,
+        .pps = 2500,
+        .fec_k = 10,
+        .fec_m = 2,
+        .loss = 0,
+        .seed = 1,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc)
+            options.frames = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--subscribe") == 0 && arg + 1 < argc)
+            options.subscribe = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--pps") == 0 && arg + 1 < argc)
+            options.pps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fec") == 0 && arg + 2 < argc) {
+            options.fec_k = atoi(argv[++arg]);
+            options.fec_m = atoi(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--loss") == 0 && arg + 1 < argc)
+            options.loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+            options.seed = strtoul(argv[++arg], NULL, 0);
+        else if(strcmp(argv[arg], "--relay") == 0)
+            options.relay = true;
+        else
+            options.frames = 0, arg = argc;
+    }
+
+    if(options.frames == 0 || options.universes == 0 || options.universes > ESPNOW_TRANSPONDER_MAX_KEYS
+        || options.subscribe == 0 || options.subscribe > options.universes || options.pps == 0
+        || options.fec_k > FEC_MAX_K || options.fec_m > FEC_MAX_M || (options.fec_k > 0) != (options.fec_m > 0)
+        || options.seed == 0) {
+        fprintf(stderr, "Usage: %s [--frames N] [--universes N] [--subscribe N] [--pps N]\n"
+                        "       [--fec K M] [--loss P] [--seed N] [--relay]\n", argv[0]);
+        return 2;
+    }
+
+    // Each phase gets the same frames, in FEC groups of their own
+    static fec_encoder_t encoder;
+    fec_init();
+    fec_encoder_init(&encoder, options.fec_k, options.fec_m);
+
+    const uint32_t groups = options.fec_k > 0 ? (options.universes + options.fec_k - 1)/options.fec_k : 0;
+    const size_t max_count = (size_t)options.frames*(options.universes + groups*options.fec_m);
+    bench_packet_t *packets[2] = {
+        malloc(sizeof(bench_packet_t)*max_count),
+        malloc(sizeof(bench_packet_t)*max_count),
+    };
+    if(packets[0] == NULL || packets[1] == NULL)
+        return 1;
+    const uint32_t count = build_packets(&options, &encoder, packets[0]);
+    build_packets(&options, &encoder, packets[1]);
+
+    const sim_air_config_t air_config = {
+        .node_count = 2,
+        .phy_rate = espnow_transponder_config_default.phy_rate,
+        .loss = options.loss,
+        .burst_loss = 1,
+        .burst_exit = 1,
+        .latency_us = 100,
+        .queue_size = 1024,
+        .seed = options.seed,
+    };
+    if(!sim_host_start(&air_config, SIM_RECEIVER)) {
+        fprintf(stderr, "Could not start the simulated medium\n");
+        return 1;
+    }
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.transport = &espnow_transponder_transport_sim;
+    transponder_config.relay = options.relay;
+    transponder_config.relay_rate = 0;
+    if(espnow_transponder_init(&transponder_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the transponder\n");
+        return 1;
+    }
+    espnow_transponder_register_callback(receive_packet);
+
+    uint32_t subscribed_count = 0;
+    for(uint16_t universe = 0; universe < options.universes; universe++)
+        subscribed_count += subscribed(&options, universe);
+
+    printf("%u packets, %u frames of %u universes, %u subscribed, FEC %u+%u, %.1f%% loss\n",
+           count, options.frames, options.universes, subscribed_count, options.fec_k, options.fec_m,
+           100*options.loss);
+    printf("%-12s %8s %8s %8s %8s %8s %8s %8s %9s %8s\n", "phase", "air", "filtered", "queued", "wanted",
+           "unwanted", "rebuilt", "unrecov", "cpu ns", "cb ns");
+
+    // Every universe wanted: the unsubscribed ones are counted as unwanted
+    bench_result_t all;
+    espnow_transponder_subscribe_all();
+    run_phase(&options, packets[0], count, &all);
+    print_result("all", &all);
+
+    bench_result_t filtered;
+    for(uint16_t universe = 0; universe < options.universes; universe++)
+        if(subscribed(&options, universe))
+            espnow_transponder_subscribe(universe);
+    run_phase(&options, packets[1], count, &filtered);
+    print_result("subscribed", &filtered);
+
+    printf("%-22s %.2f\n", "queued ratio", all.stats.rx_count > 0 ? (double)filtered.stats.rx_count/all.stats.rx_count : 0);
+    printf("%-22s %.2f\n", "cpu ratio", all.cpu_ns > 0 ? filtered.cpu_ns/all.cpu_ns : 0);
+    printf("%-22s %.2f\n", "callback ratio", all.callback_ns > 0 ? filtered.callback_ns/all.callback_ns : 0);
+
+    const uint64_t wanted_sent = (uint64_t)options.frames*subscribed_count;
+    const uint64_t parity_sent = count - (uint64_t)options.frames*options.universes;
+    bool pass = check(filtered.unwanted == 0, "unsubscribed packets delivered");
+    if(options.loss == 0) {
+        pass &= check(all.wanted + all.unwanted == (uint64_t)options.frames*options.universes && all.stats.rx_filtered == 0,
+                      "every packet delivered with no subscriptions");
+        pass &= check(filtered.wanted == wanted_sent, "every subscribed packet delivered");
+        pass &= check(filtered.stats.rx_count == wanted_sent + parity_sent, "only subscribed data and parity queued");
+        pass &= check(filtered.stats.rx_fec_unrecoverable == 0, "filtered packets counted as unrecoverable");
+        // The relay queue can fill while the host is busy, which isn't what's checked here
+        if(options.relay)
+            pass &= check(filtered.stats.tx_relayed + filtered.stats.tx_relay_dropped == count,
+                          "every packet relayed, wanted or not");
+    }
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,446 @@
+//! Frame store tests and latency benchmark
+//!
+//! Checks frame_store.c, the receiver's latest-value triple buffer:
+//!
+//! * on one thread: an empty universe, publish and read, a frame replaced
+//!   before it is read, and reading again without a new frame
+//! * with a writer thread and a reader thread on every universe: the
+//!   writer fills frames in place, each with its frame number written
+//!   through the whole frame, and the reader checks every frame it gets,
+//!   new or not, for a torn or changing frame and for frame numbers going
+//!   backwards. Once the writer stops and the reader has taken the last
+//!   frame, every frame published must have been consumed or superseded.
+//!
+//! It then times publishing and reading a full universe on one thread, and
+//! measures the output latency with frames arriving in bursts faster than
+//! the output runs: the reader takes a frame at the output rate, and the
+//! age of each one is recorded. For comparison, the same arrival and output
+//! times are replayed through a FIFO, which is what queueing every frame
+//! would give. The store's output latency is bounded by the output period,
+//! while the FIFO's grows for as long as the arrival outpaces the output.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/frame_store_test [--seconds N] [--universes N] [--fps N] [--burst N MS]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "frame_store.h"
+#include "bench_util.h"
+
+//! Universes published and read one after another in the timing loop
+#define BENCH_UNIVERSES             16
+
+//! The torn frame writer gives up the CPU halfway through one frame in this many, so
+//! that the reader runs while a frame is half written, even with a single core
+#define TEST_YIELD_INTERVAL         16
+
+typedef struct {
+    double seconds;
+    uint16_t universes;
+    uint16_t fps;                       //!< Output frame rate of the latency reader
+    uint16_t burst;                     //!< Frames in each arrival burst
+    uint32_t burst_period_ms;           //!< Time between the starts of the arrival bursts
+} test_options_t;
+
+static frame_store_t store;
+
+//! Set once the writer has published its last frame
+static atomic_bool writer_done;
+
+//! Frames published per universe by the torn frame writer
+static uint32_t *writer_frames;
+
+//! Arrival times of the latency writer's frames, in microseconds
+static int64_t *arrival_us;
+static uint32_t arrival_count;
+static uint32_t arrival_max;
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    return time_ns()/1000;
+}
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+//! \brief Length of a test frame
+static uint16_t frame_length(uint32_t number)
+{
+    return ARTDMX_UNIVERSE_SIZE - number%5;
+}
+
+//! \brief Fill a frame with its number, written through the whole frame
+//!
+//! \param frame Frame to fill
+//! \param universe Universe of the frame
+//! \param number Frame number
+//! \param yield Give up the CPU halfway through
+static void fill_frame(frame_store_frame_t *frame, uint16_t universe, uint32_t number, bool yield)
+{
+    frame->sequence = number & 0xFF;
+    frame->length = frame_length(number);
+    frame->published_us = number;
+    for(int slot = 0; slot < frame->length; slot++) {
+        frame->data[slot] = (number*31 + universe*7 + slot) & 0xFF;
+        if(yield && slot == frame->length/2)
+            sched_yield();
+    }
+    memcpy(frame->data, &number, sizeof(number));
+}
+
+//! \brief Check that a frame is all from one fill, and get its number
+//!
+//! \return true if the frame is intact
+static bool frame_intact(const frame_store_frame_t *frame, uint16_t universe, uint32_t *number)
+{
+    memcpy(number, frame->data, sizeof(*number));
+    if(frame->sequence != (*number & 0xFF) || frame->length != frame_length(*number)
+        || frame->published_us != *number)
+        return false;
+
+    for(int slot = sizeof(*number); slot < frame->length; slot++)
+        if(frame->data[slot] != ((*number*31 + universe*7 + slot) & 0xFF))
+            return false;
+
+    return true;
+}
+
+static void test_single_thread()
+{
+    check(frame_store_init(&store, 2) == ESP_OK, "init");
+
+    const frame_store_frame_t *frame;
+    check(!frame_store_read(&store, 0, &frame) && frame->length == 0, "empty universe has no frame");
+    check(frame_store_write_begin(&store, 2) == NULL, "universe out of range has no slot");
+    check(!frame_store_read(&store, 2, &frame) && frame == NULL, "universe out of range reads nothing");
+
+    uint8_t data[ARTDMX_UNIVERSE_SIZE];
+    memset(data, 0x11, sizeof(data));
+    frame_store_publish(&store, 0, 1, data, sizeof(data), 100);
+    check(frame_store_read(&store, 0, &frame) && frame->sequence == 1 && frame->length == sizeof(data)
+          && frame->published_us == 100 && frame->data[0] == 0x11, "published frame is read");
+    check(!frame_store_read(&store, 0, &frame) && frame->sequence == 1, "frame is kept until the next one");
+    check(!frame_store_read(&store, 1, &frame) && frame->length == 0, "universes are separate");
+
+    memset(data, 0x22, sizeof(data));
+    frame_store_publish(&store, 0, 2, data, 10, 200);
+    memset(data, 0x33, sizeof(data));
+    frame_store_publish(&store, 0, 3, data, 20, 300);
+    check(frame_store_read(&store, 0, &frame) && frame->sequence == 3 && frame->length == 20
+          && frame->data[19] == 0x33, "newest frame replaces an unread one");
+
+    frame_store_stats_t stats;
+    frame_store_get_statistics(&store, 0, &stats);
+    check(stats.published == 3 && stats.consumed == 2 && stats.superseded == 1, "counters");
+
+    free(store.universes);
+}
+
+static void *torn_writer(void *context)
+{
+    const test_options_t *options = context;
+    const int64_t end_ns = time_ns() + (int64_t)(options->seconds*1e9);
+
+    uint32_t number = 0;
+    while(time_ns() < end_ns) {
+        number++;
+        for(uint16_t universe = 0; universe < options->universes; universe++) {
+            fill_frame(frame_store_write_begin(&store, universe), universe, number,
+                       number%TEST_YIELD_INTERVAL == 0);
+            frame_store_write_commit(&store, universe);
+            writer_frames[universe]++;
+        }
+    }
+
+    atomic_store(&writer_done, true);
+    return NULL;
+}
+
+static void test_torn_frames(const test_options_t *options)
+{
+    check(frame_store_init(&store, options->universes) == ESP_OK, "init");
+    writer_frames = calloc(options->universes, sizeof(uint32_t));
+    uint32_t *last = calloc(options->universes, sizeof(uint32_t));
+    uint32_t *fresh = calloc(options->universes, sizeof(uint32_t));
+    if(writer_frames == NULL || last == NULL || fresh == NULL) {
+        check(false, "allocate");
+        return;
+    }
+
+    atomic_store(&writer_done, false);
+    pthread_t writer;
+    pthread_create(&writer, NULL, torn_writer, (void *)options);
+
+    uint64_t reads = 0;
+    uint32_t torn = 0;
+    uint32_t backwards = 0;
+    uint32_t changed = 0;
+    bool done = false;
+    while(!done) {
+        // One more pass once the writer is done picks up the last frames
+        done = atomic_load(&writer_done);
+
+        for(uint16_t universe = 0; universe < options->universes; universe++) {
+            const frame_store_frame_t *frame;
+            const bool is_fresh = frame_store_read(&store, universe, &frame);
+            reads++;
+
+            if(frame->length == 0) {
+                changed += is_fresh;
+                continue;
+            }
+
+            uint32_t number;
+            if(!frame_intact(frame, universe, &number)) {
+                torn++;
+                continue;
+            }
+
+            if(is_fresh) {
+                backwards += number <= last[universe];
+                fresh[universe]++;
+                last[universe] = number;
+            }
+            else {
+                changed += number != last[universe];
+            }
+        }
+    }
+    pthread_join(writer, NULL);
+
+    uint64_t published = 0;
+    uint64_t consumed = 0;
+    uint64_t superseded = 0;
+    bool counted = true;
+    for(uint16_t universe = 0; universe < options->universes; universe++) {
+        frame_store_stats_t stats;
+        frame_store_get_statistics(&store, universe, &stats);
+        published += stats.published;
+        consumed += stats.consumed;
+        superseded += stats.superseded;
+
+        counted &= stats.published == writer_frames[universe] && stats.consumed == fresh[universe]
+            && stats.published == stats.consumed + stats.superseded && last[universe] == writer_frames[universe];
+    }
+
+    printf("%-22s %llu published, %llu consumed, %llu superseded, %llu reads\n", "torn frame test",
+           (unsigned long long)published, (unsigned long long)consumed, (unsigned long long)superseded,
+           (unsigned long long)reads);
+    check(torn == 0, "no torn frames");
+    check(backwards == 0, "frame numbers never go backwards");
+    check(changed == 0, "a frame doesn't change until the next read");
+    check(counted, "published == consumed + superseded, and the last frame is read");
+    check(consumed > options->universes, "the reader got frames while the writer was running");
+
+    free(writer_frames);
+    free(last);
+    free(fresh);
+    free(store.universes);
+}
+
+static void run_timing()
+{
+    if(frame_store_init(&store, BENCH_UNIVERSES) != ESP_OK) {
+        check(false, "init");
+        return;
+    }
+
+    uint8_t data[ARTDMX_UNIVERSE_SIZE];
+    memset(data, 0x55, sizeof(data));
+
+    const uint32_t rounds = 100000;
+    uint32_t checksum = 0;
+
+    int64_t start_ns = time_ns();
+    for(uint32_t round = 0; round < rounds; round++)
+        for(uint16_t universe = 0; universe < BENCH_UNIVERSES; universe++)
+            frame_store_publish(&store, universe, round, data, sizeof(data), round);
+    const double publish_ns = (double)(time_ns() - start_ns)/(rounds*BENCH_UNIVERSES);
+
+    start_ns = time_ns();
+    for(uint32_t round = 0; round < rounds; round++) {
+        for(uint16_t universe = 0; universe < BENCH_UNIVERSES; universe++) {
+            const frame_store_frame_t *frame;
+            frame_store_read(&store, universe, &frame);
+            checksum += frame->sequence;
+        }
+        // Every other round has a new frame to pick up
+        if(round%2 == 0)
+            for(uint16_t universe = 0; universe < BENCH_UNIVERSES; universe++)
+                frame_store_write_commit(&store, universe);
+    }
+    const double read_ns = (double)(time_ns() - start_ns)/(rounds*BENCH_UNIVERSES);
+
+    printf("%-22s %.0f ns per %u byte universe\n", "publish", publish_ns, ARTDMX_UNIVERSE_SIZE);
+    printf("%-22s %.0f ns per universe, half of them new (checksum %u)\n", "read", read_ns, checksum);
+
+    free(store.universes);
+}
+
+static void *latency_writer(void *context)
+{
+    const test_options_t *options = context;
+    const int64_t start_us = time_us();
+    const int64_t end_us = start_us + (int64_t)(options->seconds*1e6);
+
+    uint8_t data[ARTDMX_UNIVERSE_SIZE];
+    memset(data, 0xAA, sizeof(data));
+
+    for(uint32_t burst = 0; ; burst++) {
+        const int64_t burst_us = start_us + (int64_t)burst*options->burst_period_ms*1000;
+        if(burst_us >= end_us)
+            break;
+        sleep_until_us(burst_us);
+
+        for(uint16_t frame = 0; frame < options->burst && arrival_count < arrival_max; frame++) {
+            const int64_t now_us = time_us();
+            arrival_us[arrival_count++] = now_us;
+            frame_store_publish(&store, 0, arrival_count, data, sizeof(data), now_us);
+        }
+    }
+
+    atomic_store(&writer_done, true);
+    return NULL;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_ages(const char *name, int64_t *ages, uint32_t count)
+{
+    if(count == 0) {
+        printf("%-22s no frames\n", name);
+        return;
+    }
+
+    qsort(ages, count, sizeof(int64_t), compare_int64);
+    printf("%-22s %6u frames, age p50 %7.1f ms, p99 %7.1f ms, max %7.1f ms\n", name, count,
+           ages[count/2]/1e3, ages[count*99/100]/1e3, ages[count - 1]/1e3);
+}
+
+static void run_latency(const test_options_t *options)
+{
+    const int64_t period_us = 1000000/options->fps;
+    const uint32_t ticks = options->seconds*options->fps + 1;
+
+    arrival_count = 0;
+    arrival_max = (options->seconds*1000/options->burst_period_ms + 1)*options->burst;
+    arrival_us = malloc(sizeof(int64_t)*arrival_max);
+    int64_t *tick_us = malloc(sizeof(int64_t)*ticks);
+    int64_t *store_ages = malloc(sizeof(int64_t)*ticks);
+    int64_t *fifo_ages = malloc(sizeof(int64_t)*ticks);
+    if(frame_store_init(&store, 1) != ESP_OK || arrival_us == NULL || tick_us == NULL
+        || store_ages == NULL || fifo_ages == NULL) {
+        check(false, "allocate");
+        return;
+    }
+
+    atomic_store(&writer_done, false);
+    pthread_t writer;
+    pthread_create(&writer, NULL, latency_writer, (void *)options);
+
+    // Output at a fixed rate, taking the freshest frame each time
+    uint32_t tick_count = 0;
+    uint32_t store_count = 0;
+    const int64_t start_us = time_us();
+    while(tick_count < ticks && !atomic_load(&writer_done)) {
+        sleep_until_us(start_us + tick_count*period_us);
+
+        const frame_store_frame_t *frame;
+        const int64_t now_us = time_us();
+        tick_us[tick_count++] = now_us;
+        if(frame_store_read(&store, 0, &frame))
+            store_ages[store_count++] = now_us - frame->published_us;
+    }
+    pthread_join(writer, NULL);
+
+    // A FIFO hands out the oldest frame that has arrived at each output time
+    uint32_t fifo_count = 0;
+    uint32_t next = 0;
+    for(uint32_t tick = 0; tick < tick_count; tick++) {
+        if(next < arrival_count && arrival_us[next] <= tick_us[tick])
+            fifo_ages[fifo_count++] = tick_us[tick] - arrival_us[next++];
+    }
+
+    frame_store_stats_t stats;
+    frame_store_get_statistics(&store, 0, &stats);
+
+    printf("%-22s %u frames every %u ms, output at %u fps\n", "latency", options->burst, options->burst_period_ms,
+           options->fps);
+    print_ages("frame store", store_ages, store_count);
+    print_ages("fifo", fifo_ages, fifo_count);
+    printf("%-22s %u of %u published\n", "superseded", stats.superseded, stats.published);
+
+    // The frame read was published after the previous read, so its age is
+    // at most one period, plus however late this thread woke up
+    check(store_count > 0 && store_ages[store_count*99/100] <= 2*period_us, "frame store p99 age within two output periods");
+
+    free(arrival_us);
+    free(tick_us);
+    free(store_ages);
+    free(fifo_ages);
+    free(store.universes);
+}
+
+int main(int argc, char **argv)
+{
+    test_options_t options = {
+        .seconds = 2,
+        .universes = 4,
+        .fps = 44,
+        .burst = 4,
+        .burst_period_ms = 80,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--burst") == 0 && arg + 2 < argc) {
+            options.burst = atoi(argv[++arg]);
+            options.burst_period_ms = atoi(argv[++arg]);
+        }
+        else
+            options.universes = 0, arg = argc;
+    }
+
+    if(options.seconds <= 0 || options.universes == 0 || options.fps == 0 || options.burst == 0
+        || options.burst_period_ms == 0) {
+        fprintf(stderr, "Usage: %s [--seconds N] [--universes N] [--fps N] [--burst N MS]\n", argv[0]);
+        return 2;
+    }
+
+    test_single_thread();
+    test_torn_frames(&options);
+    run_timing();
+    run_latency(&options);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,432 @@
+//! Art-Net gateway on the simulated medium
+//!
+//! Runs the gateway role of the example on the host, with the real
+//! transponder: a console thread sends ArtDmx packets over loopback UDP at
+//! the frame rate, and a gateway thread receives them and passes them to
+//! artnet_gateway_handle() and artnet_gateway_poll(), as the gateway task
+//! does on the device. The transponder is node 0 of a simulated medium,
+//! driven in real time by sim_host.c, with pacing, compression and FEC as in
+//! the example, and node 1 listens to what it puts on the air.
+//!
+//! The console puts the frame number in the first four slots of every
+//! universe that changes, and notes when it sent it. The listener takes it
+//! from the first fragment of each universe, to measure the time from the
+//! console's send to the end of the transmission that carried it
+//! (ingest-to-air). Delta coding is off, so that every frame carries the
+//! frame number. The last --static universes never change, and are only
+//! forwarded as often as the refresh interval asks for, so their frames
+//! show up as coalesced. With --sync, an ArtSync follows every frame.
+//!
+//! It reports, for each route, the ingest and egress rates over the last
+//! second, the frames coalesced and failed, and the longest time from
+//! ingest to handing the frame to the transponder over the last second,
+//! then the median, 99th percentile and worst ingest-to-air latency. It
+//! fails if a frame of a changing universe didn't make it to the air, a
+//! send failed, a static universe wasn't coalesced, or the 99th
+//! percentile latency is over two frame periods.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/gateway_sim [--seconds N] [--universes N] [--static N] [--fps N] [--sync]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <lwip/sockets.h>
+
+#include "esp_timer.h"
+
+#include "espnow_transponder.h"
+#include "transport_sim.h"
+#include "packet.h"
+#include "framing.h"
+#include "fec.h"
+#include "artdmx.h"
+#include "artnet.h"
+#include "artnet_gateway.h"
+#include "e131.h"
+#include "sim_host.h"
+
+#define SIM_GATEWAY                 0
+#define SIM_LISTENER                1
+
+//! Frames that the console's send times are kept for
+#define SIM_HISTORY                 64
+
+//! Time allowed for the last frame to go out, after it is sent
+#define SIM_DRAIN_US                200000
+
+//! Resend unchanged universes at least this often, as in the example
+#define SIM_REFRESH_US              1000000
+
+//! Longest time the gateway thread waits for a packet, as the gateway task
+#define SIM_POLL_MS                 100
+
+typedef struct {
+    uint32_t seconds;
+    uint8_t universes;
+    uint8_t static_universes;           //!< Universes at the end that never change
+    uint16_t fps;
+    bool sync;
+} sim_options_t;
+
+static sim_options_t options = {
+    .seconds = 3,
+    .universes = 8,
+    .static_universes = 2,
+    .fps = 44,
+    .sync = false,
+};
+
+//! Loopback address and port the gateway listens on
+static struct sockaddr_in gateway_address;
+static int gateway_socket = -1;
+
+static atomic_bool running = true;
+
+//! Console send time of each universe of the last SIM_HISTORY frames
+static atomic_llong sent_us[SIM_HISTORY][ARTNET_GATEWAY_MAX_ROUTES];
+static atomic_uint sent_frame[SIM_HISTORY];
+
+//! Ingest-to-air latency of every frame of a changing universe, guarded by the sim_host lock
+static int64_t *latencies_us = NULL;
+static uint32_t latency_count = 0;
+static uint32_t latency_capacity = 0;
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+//! \brief Build an ArtDmx packet
+//!
+//! \return Packet length
+static uint16_t artdmx_build(uint8_t *packet, uint16_t port_address, uint8_t sequence, const uint8_t *data,
+                             uint16_t length)
+{
+    memcpy(packet, "Art-Net", 8);
+    packet[8] = ARTNET_OP_DMX & 0xFF;
+    packet[9] = ARTNET_OP_DMX >> 8;
+    packet[10] = 0;
+    packet[11] = ARTNET_PROTOCOL_VERSION;
+    packet[12] = sequence;
+    packet[13] = 0;
+    packet[14] = port_address & 0xFF;
+    packet[15] = port_address >> 8;
+    packet[16] = length >> 8;
+    packet[17] = length & 0xFF;
+    memcpy(packet + 18, data, length);
+    return 18 + length;
+}
+
+//! \brief Build an ArtSync packet
+//!
+//! \return Packet length
+static uint16_t artsync_build(uint8_t *packet)
+{
+    memcpy(packet, "Art-Net", 8);
+    packet[8] = ARTNET_OP_SYNC & 0xFF;
+    packet[9] = ARTNET_OP_SYNC >> 8;
+    packet[10] = 0;
+    packet[11] = ARTNET_PROTOCOL_VERSION;
+    packet[12] = 0;
+    packet[13] = 0;
+    return 14;
+}
+
+//! \brief Send every universe at the frame rate, as a console would
+static void *console(void *arg)
+{
+    const int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if(sock < 0) {
+        perror("socket");
+        exit(1);
+    }
+
+    uint8_t data[ARTDMX_UNIVERSE_SIZE];
+    uint8_t packet[18 + ARTDMX_UNIVERSE_SIZE];
+    const uint32_t frames = options.seconds*options.fps;
+    const int64_t period_us = 1000000/options.fps;
+    const int changing = options.universes - options.static_universes;
+
+    const int64_t start_us = time_us();
+    for(uint32_t frame = 0; frame < frames; frame++) {
+        atomic_store(&sent_frame[frame % SIM_HISTORY], frame);
+
+        for(int universe = 0; universe < options.universes; universe++) {
+            if(universe < changing) {
+                memset(data, frame, sizeof(data));
+                memcpy(data, &frame, sizeof(frame));
+            }
+            else {
+                memset(data, 0x40 + universe, sizeof(data));
+            }
+
+            const uint16_t length = artdmx_build(packet, universe, frame % 255 + 1, data, sizeof(data));
+            atomic_store(&sent_us[frame % SIM_HISTORY][universe], esp_timer_get_time());
+            sendto(sock, packet, length, 0, (struct sockaddr *)&gateway_address, sizeof(gateway_address));
+        }
+
+        if(options.sync) {
+            const uint16_t length = artsync_build(packet);
+            sendto(sock, packet, length, 0, (struct sockaddr *)&gateway_address, sizeof(gateway_address));
+        }
+
+        sleep_until_us(start_us + (frame + 1)*period_us);
+    }
+
+    close(sock);
+    return NULL;
+}
+
+//! \brief Receive Art-Net packets, and pass them to the gateway, as the gateway task does
+static void *gateway(void *arg)
+{
+    uint8_t buffer[576];
+
+    while(atomic_load(&running)) {
+        fd_set sockets;
+        FD_ZERO(&sockets);
+        FD_SET(gateway_socket, &sockets);
+
+        struct timeval timeout = {
+            .tv_sec = 0,
+            .tv_usec = SIM_POLL_MS*1000,
+        };
+        const int ready = select(gateway_socket + 1, &sockets, NULL, NULL, &timeout);
+
+        if(ready > 0) {
+            struct sockaddr_in source;
+            socklen_t source_length = sizeof(source);
+            const int length = recvfrom(gateway_socket, buffer, sizeof(buffer), 0, (struct sockaddr *)&source,
+                                        &source_length);
+            if(length > 0)
+                artnet_gateway_handle(buffer, length, ntohl(source.sin_addr.s_addr), esp_timer_get_time());
+        }
+
+        artnet_gateway_poll(esp_timer_get_time());
+    }
+
+    return NULL;
+}
+
+//! \brief Time the first fragment of each changing universe, as it comes off the air
+static void listener_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    if(framing_check(data, length) != FRAMING_OK)
+        return;
+
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL)
+        return;
+
+    const uint8_t *payload = packet->data;
+    uint16_t payload_length = packet->data_length;
+    if(packet->flags & ESPNOW_TRANSPONDER_FLAG_FEC) {
+        const fec_header_t *header = (const fec_header_t *)payload;
+        if(payload_length < sizeof(fec_header_t) || header->index >= header->k)
+            return;
+        payload += sizeof(fec_header_t);
+        payload_length -= sizeof(fec_header_t);
+    }
+
+    uint8_t decompressed[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+    if(packet->flags & ESPNOW_TRANSPONDER_FLAG_COMPRESSED) {
+        const int decompressed_length = framing_decompress(payload, payload_length, decompressed,
+                                                           sizeof(decompressed));
+        if(decompressed_length < 0)
+            return;
+        payload = decompressed;
+        payload_length = decompressed_length;
+    }
+
+    const artdmx_packet_t *artdmx = (const artdmx_packet_t *)payload;
+    if(payload_length < sizeof(artdmx_packet_t) + sizeof(uint32_t)
+        || (artdmx->type & ARTDMX_TYPE_MASK) != ARTDMX_TYPE_DATA || artdmx->offset != 0
+        || artdmx->universe >= options.universes - options.static_universes)
+        return;
+
+    uint32_t frame;
+    memcpy(&frame, artdmx->data, sizeof(frame));
+    if(atomic_load(&sent_frame[frame % SIM_HISTORY]) != frame || latency_count == latency_capacity)
+        return;
+
+    latencies_us[latency_count++] = now_us - atomic_load(&sent_us[frame % SIM_HISTORY][artdmx->universe]);
+}
+
+int main(int argc, char **argv)
+{
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--static") == 0 && arg + 1 < argc)
+            options.static_universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--sync") == 0)
+            options.sync = true;
+        else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--universes N] [--static N] [--fps N] [--sync]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if(options.universes == 0 || options.universes > ARTNET_GATEWAY_MAX_ROUTES
+        || options.static_universes >= options.universes || options.fps == 0) {
+        fprintf(stderr, "--universes must be 1 to %i, with fewer --static, and --fps non-zero\n",
+                ARTNET_GATEWAY_MAX_ROUTES);
+        return 2;
+    }
+
+    const uint32_t frames = options.seconds*options.fps;
+    const uint32_t changing = options.universes - options.static_universes;
+    latency_capacity = frames*changing;
+    latencies_us = malloc(latency_capacity*sizeof(int64_t));
+    if(latencies_us == NULL)
+        return 1;
+
+    // The gateway listens on an ephemeral loopback port, rather than ARTNET_PORT
+    gateway_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    gateway_address.sin_family = AF_INET;
+    gateway_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    gateway_address.sin_port = 0;
+    socklen_t address_length = sizeof(gateway_address);
+    if(gateway_socket < 0
+        || bind(gateway_socket, (struct sockaddr *)&gateway_address, sizeof(gateway_address)) < 0
+        || getsockname(gateway_socket, (struct sockaddr *)&gateway_address, &address_length) < 0) {
+        perror("gateway socket");
+        return 1;
+    }
+
+    const sim_air_config_t air_config = {
+        .node_count = 2,
+        .phy_rate = espnow_transponder_config_default.phy_rate,
+        .queue_size = 1024,
+        .seed = 1,
+    };
+    if(!sim_host_start(&air_config, SIM_GATEWAY)) {
+        fprintf(stderr, "Could not start the simulated medium\n");
+        return 1;
+    }
+    sim_air_t *air = sim_host_lock();
+    sim_air_attach(air, SIM_LISTENER, listener_recv, NULL, NULL);
+    sim_host_unlock();
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.transport = &espnow_transponder_transport_sim;
+    transponder_config.compression = true;
+    transponder_config.tx_framerate = options.fps;
+    transponder_config.fec_k = 10;
+    transponder_config.fec_m = 2;
+    if(espnow_transponder_init(&transponder_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the transponder\n");
+        return 1;
+    }
+
+    const artdmx_sender_config_t artdmx_config = {
+        .universe_count = options.universes,
+        .keyframe_interval = 0,
+        .timestamps = true,
+    };
+    artdmx_sender_init(&artdmx_config);
+
+    artnet_gateway_route_t routes[ARTNET_GATEWAY_MAX_ROUTES];
+    for(int universe = 0; universe < options.universes; universe++) {
+        routes[universe].port_address = universe;
+        routes[universe].sacn_universe = 0;
+        routes[universe].universe = universe;
+    }
+
+    const artnet_gateway_config_t gateway_config = {
+        .routes = routes,
+        .route_count = options.universes,
+        .refresh_us = SIM_REFRESH_US,
+        .merge_mode = DMX_MERGE_HTP,
+        .artnet_priority = E131_DEFAULT_PRIORITY,
+        .sacn = false,
+    };
+    if(artnet_gateway_init(&gateway_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the gateway\n");
+        return 1;
+    }
+
+    pthread_t gateway_thread;
+    pthread_t console_thread;
+    pthread_create(&gateway_thread, NULL, gateway, NULL);
+    pthread_create(&console_thread, NULL, console, NULL);
+    pthread_join(console_thread, NULL);
+
+    sleep_until_us(time_us() + SIM_DRAIN_US);
+    atomic_store(&running, false);
+    pthread_join(gateway_thread, NULL);
+
+    artnet_gateway_stats_t gateway_stats;
+    artnet_gateway_get_statistics(&gateway_stats);
+
+    printf("%-8s %10s %10s %10s %10s %10s %12s\n", "universe", "ingest", "in/s", "out/s", "coalesced", "fail",
+           "handoff max");
+
+    bool pass = true;
+    for(int route = 0; route < options.universes; route++) {
+        artnet_gateway_route_stats_t stats;
+        artnet_gateway_get_route_statistics(route, &stats);
+        printf("%-8i %10llu %10.1f %10.1f %10llu %10llu %10uus\n", route, (unsigned long long)stats.ingest_frames,
+               stats.ingest_rate, stats.egress_rate, (unsigned long long)stats.coalesced,
+               (unsigned long long)stats.send_fail, stats.latency_max_us);
+
+        pass &= stats.send_fail == 0;
+        // Static universes are only refreshed, once a second
+        if(route >= changing)
+            pass &= stats.egress_frames <= options.seconds + 2 && stats.coalesced > 0;
+    }
+
+    air = sim_host_lock();
+    const uint32_t count = latency_count;
+    qsort(latencies_us, count, sizeof(int64_t), compare_int64);
+    sim_host_unlock();
+
+    const int64_t period_us = 1000000/options.fps;
+    const int64_t p99_us = count > 0 ? latencies_us[count*99/100] : 0;
+    pass &= count == frames*changing && p99_us <= 2*period_us;
+
+    printf("packets %llu, syncs %llu, invalid %llu\n", (unsigned long long)gateway_stats.packets,
+           (unsigned long long)gateway_stats.syncs, (unsigned long long)gateway_stats.invalid);
+    printf("frames on air %u of %u\n", count, frames*changing);
+    if(count > 0)
+        printf("ingest-to-air median %lldus, p99 %lldus, worst %lldus, frame period %lldus\n",
+               (long long)latencies_us[count/2], (long long)p99_us, (long long)latencies_us[count - 1],
+               (long long)period_us);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
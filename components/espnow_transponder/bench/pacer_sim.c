@@ -0,0 +1,391 @@
+//! Transmit pacer simulation
+//!
+//! Runs the transponder's transmit scheduler against the simulated medium:
+//! a sender queues a frame of packets at the frame rate, followed by a frame
+//! end marker, and takes them off the queue as tx_pacer allows, with send
+//! completions coming back from the medium as each transmission ends. A
+//! receiver takes each packet off a queue of the transponder's size, and
+//! spends a fixed time on it, as the transponder task does, so a burst of
+//! packets that arrives faster than that fills its queue.
+//!
+//! The airtime of each packet comes from the PHY rate and the packet size,
+//! and other nodes can be added to load the channel. Each run is made with
+//! pacing, and with only the in-flight cap, to compare against.
+//!
+//! For each, this reports the airtime of a packet and the load on the
+//! channel, the frame rate the pacer measured, how long after being queued
+//! each frame was fully received (median, 99th percentile and worst), the
+//! most packets that were waiting at the receiver after the first frame,
+//! which the pacer doesn't know the size of yet, and the packets dropped
+//! for a full transmit or receive queue. When the frames fit on the air, it
+//! fails if pacing didn't keep the frame rate, finish every frame within a
+//! frame period and deliver every packet.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/pacer_sim [--fps N] [--packets N] [--size N] [--rate N] [--in-flight N]
+//!                           [--rx-cost US] [--others N] [--other-pps N] [--seconds N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "esp_wifi_internal.h"
+
+#include "tx_pacer.h"
+#include "sim_air.h"
+
+//! Transmit queue and pool sizes, as in the transponder. The queue has an
+//! entry for a frame end marker for each packet.
+#define SIM_TX_POOL_SIZE            64
+#define SIM_TX_QUEUE_SIZE           (2*SIM_TX_POOL_SIZE)
+
+//! Receive queue size, as in the transponder
+#define SIM_RX_QUEUE_SIZE           32
+
+//! Frame end marker in the transmit queue
+#define SIM_MARKER                  UINT32_MAX
+
+#define SIM_SENDER                  0
+#define SIM_RECEIVER                1
+
+//! Stop checking the frames if more than this fraction of the airtime is used
+#define SIM_MAX_LOAD                0.8
+
+typedef struct {
+    uint16_t fps;
+    uint16_t packets;                   //!< Packets per frame
+    uint16_t size;                      //!< Packet length
+    uint8_t phy_rate;
+    uint16_t in_flight;
+    uint32_t rx_cost_us;                //!< Time the receiver spends on each packet
+    uint8_t others;                     //!< Other nodes loading the channel
+    uint32_t other_pps;                 //!< Packets each of them sends a second
+    uint32_t seconds;
+} sim_options_t;
+
+typedef struct {
+    float fps;
+    double load;                        //!< Fraction of the time the medium was busy
+    int64_t latency_median_us;
+    int64_t latency_p99_us;
+    int64_t latency_worst_us;
+    uint32_t frames_incomplete;         //!< Frames with packets missing
+    uint32_t rx_depth_max;
+    uint32_t rx_dropped;
+    uint32_t tx_dropped;                //!< Packets dropped for a full transmit pool
+    uint32_t markers_dropped;           //!< Frame end markers that didn't fit in the transmit queue
+} sim_result_t;
+
+static sim_air_t air;
+static tx_pacer_t pacer;
+static sim_options_t options;
+
+// Sender's transmit queue, of packet numbers or markers
+static uint32_t tx_queue[SIM_TX_QUEUE_SIZE];
+static uint32_t tx_queue_head;
+static uint32_t tx_queue_count;
+static uint32_t tx_pool_used;
+
+// Receiver's queue, as the times it will finish with each packet
+static int64_t rx_done_us[SIM_RX_QUEUE_SIZE];
+static uint32_t rx_head;
+static uint32_t rx_count;
+
+static uint16_t *frame_received;        //!< Packets of each frame received
+static int64_t *frame_done_us;          //!< Time each frame was fully received
+static sim_result_t result;
+
+static void send_cb(void *context)
+{
+    if(context == &pacer)
+        tx_pacer_completed(&pacer);
+}
+
+static void recv_cb(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    if(source != SIM_SENDER)
+        return;
+
+    const int64_t now_us = air.now_us;
+    while(rx_count > 0 && rx_done_us[rx_head] <= now_us) {
+        rx_head = (rx_head + 1) % SIM_RX_QUEUE_SIZE;
+        rx_count--;
+    }
+    if(rx_count == SIM_RX_QUEUE_SIZE) {
+        result.rx_dropped++;
+        return;
+    }
+
+    const int64_t last_us = rx_count > 0 ? rx_done_us[(rx_head + rx_count - 1) % SIM_RX_QUEUE_SIZE] : now_us;
+    rx_done_us[(rx_head + rx_count) % SIM_RX_QUEUE_SIZE] = (last_us > now_us ? last_us : now_us) + options.rx_cost_us;
+    rx_count++;
+    if(rx_count > result.rx_depth_max)
+        result.rx_depth_max = rx_count;
+
+    uint32_t packet;
+    memcpy(&packet, data, sizeof(packet));
+    const uint32_t frame = packet/options.packets;
+    if(++frame_received[frame] == options.packets)
+        frame_done_us[frame] = now_us;
+}
+
+//! \brief Add a frame's packets and its frame end marker to the transmit queue
+static void queue_frame(uint32_t frame)
+{
+    for(uint16_t index = 0; index <= options.packets; index++) {
+        const bool marker = index == options.packets;
+        if(!marker && tx_pool_used == SIM_TX_POOL_SIZE) {
+            result.tx_dropped++;
+            continue;
+        }
+        if(tx_queue_count == SIM_TX_QUEUE_SIZE) {
+            result.markers_dropped += marker;
+            continue;
+        }
+
+        tx_queue[(tx_queue_head + tx_queue_count++) % SIM_TX_QUEUE_SIZE] =
+            marker ? SIM_MARKER : frame*options.packets + index;
+        tx_pool_used += !marker;
+    }
+}
+
+//! \brief Send what the pacer allows, as the transmit scheduler task does
+//!
+//! \return Time to check again, if nothing else happens first
+static int64_t schedule(int64_t now_us, bool paced)
+{
+    while(tx_queue_count > 0) {
+        const uint32_t packet = tx_queue[tx_queue_head];
+        if(packet == SIM_MARKER) {
+            tx_queue_head = (tx_queue_head + 1) % SIM_TX_QUEUE_SIZE;
+            tx_queue_count--;
+            tx_pacer_frame_end(&pacer, now_us);
+            continue;
+        }
+
+        const int64_t delay_us = paced ? tx_pacer_delay(&pacer, now_us, tx_queue_count)
+            : tx_pacer_flow_delay(&pacer, now_us);
+        if(delay_us > 0)
+            return now_us + delay_us;
+
+        uint8_t data[SIM_AIR_MAX_PACKET] = { 0 };
+        memcpy(data, &packet, sizeof(packet));
+        if(sim_air_send(&air, SIM_SENDER, data, options.size))
+            tx_pacer_sent(&pacer, now_us);
+
+        tx_queue_head = (tx_queue_head + 1) % SIM_TX_QUEUE_SIZE;
+        tx_queue_count--;
+        tx_pool_used--;
+    }
+
+    return INT64_MAX;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static bool run(bool paced)
+{
+    const sim_air_config_t air_config = {
+        .node_count = 2 + options.others,
+        .phy_rate = options.phy_rate,
+        .queue_size = 4096,
+        .seed = 1,
+    };
+    if(!sim_air_init(&air, &air_config))
+        return false;
+
+    sim_air_attach(&air, SIM_SENDER, NULL, send_cb, &pacer);
+    sim_air_attach(&air, SIM_RECEIVER, recv_cb, NULL, NULL);
+
+    tx_pacer_init(&pacer, options.fps, options.in_flight);
+    memset(&result, 0, sizeof(result));
+    tx_queue_head = tx_queue_count = tx_pool_used = 0;
+    rx_head = rx_count = 0;
+
+    const uint32_t frames = options.seconds*options.fps;
+    const int64_t period_us = 1000000/options.fps;
+    memset(frame_received, 0, frames*sizeof(uint16_t));
+
+    // The other nodes each send at a steady rate, starting at different times
+    const int64_t other_period_us = options.other_pps > 0 ? 1000000/options.other_pps : INT64_MAX;
+    int64_t next_other_us = options.others > 0 ? period_us/3 : INT64_MAX;
+    uint8_t next_other = 0;
+
+    uint32_t frame = 0;
+    int64_t now_us = 0;
+    int64_t wake_us = INT64_MAX;
+    const int64_t end_us = frames*period_us + period_us;
+    while(now_us < end_us) {
+        if(frame < frames && now_us >= frame*period_us) {
+            // The first frame isn't paced, as its size isn't known yet
+            if(frame == 1)
+                result.rx_depth_max = 0;
+            queue_frame(frame++);
+        }
+
+        if(now_us >= next_other_us) {
+            const uint8_t data[SIM_AIR_MAX_PACKET] = { 0 };
+            sim_air_send(&air, 2 + next_other, data, SIM_AIR_MAX_PACKET);
+            next_other = (next_other + 1) % options.others;
+            next_other_us += other_period_us/options.others;
+        }
+
+        // A send completion or a new frame wakes the scheduler early
+        if(now_us >= wake_us || tx_queue_count > 0)
+            wake_us = schedule(now_us, paced);
+
+        int64_t next_us = frame < frames ? frame*period_us : end_us;
+        if(wake_us < next_us)
+            next_us = wake_us;
+        if(next_other_us < next_us)
+            next_us = next_other_us;
+        const int64_t event_us = sim_air_next_event(&air);
+        if(event_us >= 0 && event_us < next_us)
+            next_us = event_us;
+
+        sim_air_run_until(&air, next_us);
+        now_us = next_us;
+    }
+
+    int64_t busy_us = 0;
+    for(uint8_t node = 0; node < air_config.node_count; node++)
+        busy_us += air.nodes[node].stats.airtime_us;
+    result.load = (double)busy_us/now_us;
+    result.fps = pacer.fps;
+
+    uint32_t complete = 0;
+    for(uint32_t index = 0; index < frames; index++) {
+        if(frame_received[index] == options.packets)
+            frame_done_us[complete++] = frame_done_us[index] - index*period_us;
+    }
+    result.frames_incomplete = frames - complete;
+    if(complete > 0) {
+        qsort(frame_done_us, complete, sizeof(int64_t), compare_int64);
+        result.latency_median_us = frame_done_us[complete/2];
+        result.latency_p99_us = frame_done_us[complete*99/100];
+        result.latency_worst_us = frame_done_us[complete - 1];
+    }
+
+    sim_air_free(&air);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    options = (sim_options_t){
+        .fps = 44,
+        .packets = 60,
+        .size = SIM_AIR_MAX_PACKET,
+        .phy_rate = WIFI_PHY_RATE_MCS2_LGI,
+        .in_flight = 4,
+        .rx_cost_us = 300,
+        .others = 0,
+        .other_pps = 1000,
+        .seconds = 10,
+    };
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--packets") == 0 && arg + 1 < argc)
+            options.packets = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--size") == 0 && arg + 1 < argc)
+            options.size = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--rate") == 0 && arg + 1 < argc)
+            options.phy_rate = strtol(argv[++arg], NULL, 0);
+        else if(strcmp(argv[arg], "--in-flight") == 0 && arg + 1 < argc)
+            options.in_flight = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--rx-cost") == 0 && arg + 1 < argc)
+            options.rx_cost_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--others") == 0 && arg + 1 < argc)
+            options.others = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--other-pps") == 0 && arg + 1 < argc)
+            options.other_pps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--fps N] [--packets N] [--size N] [--rate N] [--in-flight N]\n"
+                    "          [--rx-cost US] [--others N] [--other-pps N] [--seconds N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(options.fps == 0 || options.packets == 0 || options.size < sizeof(uint32_t)
+        || options.size > SIM_AIR_MAX_PACKET || options.in_flight == 0
+        || options.others > SIM_AIR_MAX_NODES - 2 || options.seconds == 0) {
+        fprintf(stderr, "Options out of range\n");
+        return 2;
+    }
+
+    const uint32_t frames = options.seconds*options.fps;
+    frame_received = malloc(frames*sizeof(uint16_t));
+    frame_done_us = malloc(frames*sizeof(int64_t));
+    if(frame_received == NULL || frame_done_us == NULL)
+        return 1;
+
+    // Airtime of one packet, from a medium with the same rate
+    const sim_air_config_t probe_config = { .node_count = 1, .phy_rate = options.phy_rate, .queue_size = 1, .seed = 1 };
+    sim_air_init(&air, &probe_config);
+    const int64_t airtime_us = sim_air_airtime(&air, SIM_SENDER, options.size);
+    const int64_t other_airtime_us = sim_air_airtime(&air, SIM_SENDER, SIM_AIR_MAX_PACKET);
+    sim_air_free(&air);
+
+    const int64_t period_us = 1000000/options.fps;
+    const double offered_load = ((double)options.packets*airtime_us*options.fps
+        + (double)options.others*options.other_pps*other_airtime_us)/1e6;
+    printf("%u packets of %u bytes a frame at %u fps, %lli us airtime each, %.0f%% of the channel\n",
+           options.packets, options.size, options.fps, (long long)airtime_us, 100*offered_load);
+
+    printf("%-8s %6s %6s %10s %10s %10s %10s %8s %8s %8s\n", "pacing", "fps", "load", "median us", "p99 us",
+           "worst us", "missing", "rx max", "rx drop", "tx drop");
+
+    bool pass = true;
+    for(int paced = 1; paced >= 0; paced--) {
+        if(!run(paced)) {
+            fprintf(stderr, "Could not set up the medium\n");
+            return 1;
+        }
+
+        printf("%-8s %6.1f %5.0f%% %10lli %10lli %10lli %10u %8u %8u %8u\n", paced ? "on" : "off", result.fps,
+               100*result.load, (long long)result.latency_median_us, (long long)result.latency_p99_us,
+               (long long)result.latency_worst_us, result.frames_incomplete, result.rx_depth_max, result.rx_dropped,
+               result.tx_dropped);
+
+        // Frame end markers always have room, as there can be no more of
+        // them than packets
+        if(result.markers_dropped > 0) {
+            printf("FAIL: %u frame end markers didn't fit in the transmit queue\n", result.markers_dropped);
+            pass = false;
+        }
+
+        if(!paced || offered_load > SIM_MAX_LOAD)
+            continue;
+        if(result.fps < options.fps*0.98f || result.fps > options.fps*1.02f) {
+            printf("FAIL: paced at %.1f fps, rather than %u\n", result.fps, options.fps);
+            pass = false;
+        }
+        if(result.frames_incomplete > 0 || result.rx_dropped > 0 || result.tx_dropped > 0) {
+            printf("FAIL: packets were dropped\n");
+            pass = false;
+        }
+        if(result.latency_p99_us > period_us) {
+            printf("FAIL: frames took longer than the frame period of %lli us\n", (long long)period_us);
+            pass = false;
+        }
+    }
+
+    if(offered_load > SIM_MAX_LOAD)
+        printf("The channel is overloaded, so the frames aren't checked\n");
+
+    free(frame_received);
+    free(frame_done_us);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
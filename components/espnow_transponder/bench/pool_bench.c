@@ -0,0 +1,339 @@
+//! Receive buffer pool versus malloc() benchmark
+//!
+//! Runs the receive path's buffer handling both ways: with the transponder's
+//! buffer pool, and with the malloc(), memcpy() and free() it replaced. Each
+//! packet gets a length between 16 and 250 bytes, as a mix of universes and
+//! fragments would.
+//!
+//! Two cases are run:
+//!
+//! * single: one thread allocates and fills a buffer for every packet, and
+//!   releases the one received a queue depth earlier, so that as many
+//!   buffers are held as when the transponder task is behind.
+//! * threaded: a producer thread stands in for the WiFi callback, and
+//!   allocates, fills and queues each packet on an event ring, dropping the
+//!   oldest packet if the ring is full. A consumer thread stands in for the
+//!   transponder task, and checks and releases each packet. This runs the
+//!   pool's lock with allocation and release on different threads, as on
+//!   the ESP32. The producer yields between packets, as packets come off
+//!   the air one at a time, so on a single core this case mostly measures
+//!   thread switches.
+//!
+//! For each case this reports the time per packet, and for the threaded
+//! case the producer's worst time for one packet, and how many packets were
+//! dropped for want of a buffer or ring space. It fails if a packet arrives
+//! with the wrong contents, if a packet goes missing, or if the pool doesn't
+//! get all of its slots back.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/pool_bench [--packets N] [--depth N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "esp_now.h"
+
+#include "buffer_pool.h"
+#include "event_ring.h"
+
+// Same sizes as the transponder uses
+#define BENCH_QUEUE_SIZE            32
+#define BENCH_POOL_SIZE             (BENCH_QUEUE_SIZE + 4)
+
+#define BENCH_MIN_LENGTH            16
+#define BENCH_MAX_DEPTH             BENCH_QUEUE_SIZE
+
+typedef enum {
+    ALLOCATOR_POOL,
+    ALLOCATOR_MALLOC,
+    ALLOCATOR_COUNT,
+} allocator_t;
+
+static const char *allocator_names[ALLOCATOR_COUNT] = { "pool", "malloc" };
+
+//! A queued packet, as the transponder's receive event
+typedef struct {
+    uint32_t sequence;
+    uint16_t length;
+    void *buffer;                       //!< espnow_transponder_buffer_t or malloc() block
+} bench_event_t;
+
+typedef struct {
+    double ns_per_packet;
+    double worst_ns;                    //!< Producer's longest time for one packet
+    uint64_t received;
+    uint64_t dropped;                   //!< Dropped from a full ring
+    uint64_t no_buffer;                 //!< Dropped because the pool was empty
+    uint64_t corrupt;                   //!< Received with the wrong contents
+} result_t;
+
+static buffer_pool_t pool;
+static event_ring_t ring;
+
+// Threaded case state
+static allocator_t thread_allocator;
+static uint64_t thread_packets;
+static atomic_bool producer_done;
+static result_t thread_result;
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief Length of a packet, spread over the range a transponder sees
+static uint16_t packet_length(uint32_t sequence)
+{
+    return BENCH_MIN_LENGTH + (sequence*97) % (ESP_NOW_MAX_DATA_LEN - BENCH_MIN_LENGTH + 1);
+}
+
+//! \brief Fill in a received packet, as the radio would
+static void fill_packet(uint8_t *packet, uint32_t sequence, uint16_t length)
+{
+    for(uint16_t index = 0; index < length; index++)
+        packet[index] = sequence + index;
+}
+
+//! \brief Check the contents of a packet
+static bool check_packet(const uint8_t *data, uint32_t sequence, uint16_t length)
+{
+    for(uint16_t index = 0; index < length; index++) {
+        if(data[index] != (uint8_t)(sequence + index))
+            return false;
+    }
+    return true;
+}
+
+//! \brief Copy a received packet into a buffer, as the WiFi callback does
+//!
+//! \return The buffer, or NULL if none was available
+static void *receive(allocator_t allocator, const uint8_t *packet, uint16_t length)
+{
+    if(allocator == ALLOCATOR_MALLOC) {
+        uint8_t *copy = malloc(length);
+        if(copy != NULL)
+            memcpy(copy, packet, length);
+        return copy;
+    }
+
+    espnow_transponder_buffer_t *buffer = buffer_pool_alloc(&pool);
+    if(buffer != NULL) {
+        memcpy(buffer->data, packet, length);
+        buffer->length = length;
+    }
+    return buffer;
+}
+
+static const uint8_t *buffer_data(allocator_t allocator, void *buffer)
+{
+    return allocator == ALLOCATOR_MALLOC ? buffer : espnow_transponder_buffer_data(buffer);
+}
+
+static void release(allocator_t allocator, void *buffer)
+{
+    if(allocator == ALLOCATOR_MALLOC)
+        free(buffer);
+    else
+        espnow_transponder_buffer_release(buffer);
+}
+
+//! \brief Allocate and release from one thread, holding depth buffers
+static void run_single(allocator_t allocator, uint64_t packets, uint32_t depth, result_t *result)
+{
+    bench_event_t held[BENCH_MAX_DEPTH] = { { 0 } };
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+
+    memset(result, 0, sizeof(*result));
+    const int64_t start_ns = time_ns();
+    for(uint64_t sequence = 0; sequence < packets; sequence++) {
+        bench_event_t *event = &held[sequence % depth];
+        if(event->buffer != NULL) {
+            if(!check_packet(buffer_data(allocator, event->buffer), event->sequence, event->length))
+                result->corrupt++;
+            release(allocator, event->buffer);
+            result->received++;
+        }
+
+        event->sequence = sequence;
+        event->length = packet_length(sequence);
+        fill_packet(packet, sequence, event->length);
+        event->buffer = receive(allocator, packet, event->length);
+        if(event->buffer == NULL)
+            result->no_buffer++;
+    }
+    result->ns_per_packet = (double)(time_ns() - start_ns)/packets;
+
+    for(uint32_t index = 0; index < depth; index++) {
+        if(held[index].buffer != NULL) {
+            release(allocator, held[index].buffer);
+            result->received++;
+        }
+    }
+}
+
+//! \brief The WiFi callback: allocate, fill and queue every packet
+static void *producer_task(void *arg)
+{
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    int64_t worst_ns = 0;
+
+    for(uint64_t sequence = 0; sequence < thread_packets; sequence++) {
+        const uint16_t length = packet_length(sequence);
+        fill_packet(packet, sequence, length);
+
+        const int64_t start_ns = time_ns();
+        bench_event_t event = {
+            .sequence = sequence,
+            .length = length,
+            .buffer = receive(thread_allocator, packet, length),
+        };
+        if(event.buffer == NULL) {
+            thread_result.no_buffer++;
+        }
+        else {
+            bench_event_t dropped;
+            if(event_ring_push(&ring, &event, &dropped) != EVENT_RING_PUSHED) {
+                release(thread_allocator, dropped.buffer);
+                thread_result.dropped++;
+            }
+        }
+        const int64_t elapsed_ns = time_ns() - start_ns;
+        if(elapsed_ns > worst_ns)
+            worst_ns = elapsed_ns;
+
+        // Packets come off the air one at a time, and the WiFi task lets
+        // the transponder task run in between
+        sched_yield();
+    }
+
+    thread_result.worst_ns = worst_ns;
+    atomic_store(&producer_done, true);
+    return NULL;
+}
+
+//! \brief The transponder task: check and release every packet
+static void *consumer_task(void *arg)
+{
+    bench_event_t event;
+
+    while(true) {
+        if(!event_ring_pop(&ring, &event)) {
+            if(atomic_load(&producer_done) && event_ring_depth(&ring) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        if(!check_packet(buffer_data(thread_allocator, event.buffer), event.sequence, event.length))
+            thread_result.corrupt++;
+        release(thread_allocator, event.buffer);
+        thread_result.received++;
+    }
+
+    return NULL;
+}
+
+//! \brief Allocate on a producer thread, and release on a consumer thread
+static bool run_threaded(allocator_t allocator, uint64_t packets, result_t *result)
+{
+    memset(&thread_result, 0, sizeof(thread_result));
+    thread_allocator = allocator;
+    thread_packets = packets;
+    atomic_store(&producer_done, false);
+
+    pthread_t producer;
+    pthread_t consumer;
+    const int64_t start_ns = time_ns();
+    if(pthread_create(&consumer, NULL, consumer_task, NULL) != 0)
+        return false;
+    if(pthread_create(&producer, NULL, producer_task, NULL) != 0)
+        return false;
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    *result = thread_result;
+    result->ns_per_packet = (double)(time_ns() - start_ns)/packets;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t packets = 1000000;
+    uint32_t depth = 16;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--packets") == 0 && arg + 1 < argc)
+            packets = strtoull(argv[++arg], NULL, 10);
+        else if(strcmp(argv[arg], "--depth") == 0 && arg + 1 < argc)
+            depth = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--packets N] [--depth N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(packets == 0 || depth == 0 || depth > BENCH_MAX_DEPTH) {
+        fprintf(stderr, "The depth must be between 1 and %i\n", BENCH_MAX_DEPTH);
+        return 2;
+    }
+
+    if(buffer_pool_init(&pool, ESP_NOW_MAX_DATA_LEN, BENCH_POOL_SIZE) != ESP_OK
+        || event_ring_init(&ring, sizeof(bench_event_t), BENCH_QUEUE_SIZE, ESPNOW_TRANSPONDER_DROP_OLDEST) != ESP_OK) {
+        fprintf(stderr, "Could not allocate memory for the receive path\n");
+        return 1;
+    }
+
+    bool pass = true;
+    printf("%-9s %-7s %10s %10s %10s %10s %10s\n", "case", "alloc", "ns/packet", "worst ns", "received",
+           "dropped", "no buffer");
+
+    for(allocator_t allocator = 0; allocator < ALLOCATOR_COUNT; allocator++) {
+        result_t result;
+        run_single(allocator, packets, depth, &result);
+        printf("%-9s %-7s %10.1f %10s %10llu %10s %10llu\n", "single", allocator_names[allocator],
+               result.ns_per_packet, "-", (unsigned long long)result.received, "-",
+               (unsigned long long)result.no_buffer);
+
+        if(result.corrupt > 0 || result.received + result.no_buffer != packets) {
+            printf("FAIL: %llu packets corrupt, %llu of %llu accounted for\n", (unsigned long long)result.corrupt,
+                   (unsigned long long)(result.received + result.no_buffer), (unsigned long long)packets);
+            pass = false;
+        }
+    }
+
+    for(allocator_t allocator = 0; allocator < ALLOCATOR_COUNT; allocator++) {
+        result_t result;
+        if(!run_threaded(allocator, packets, &result)) {
+            fprintf(stderr, "Could not start the threads\n");
+            return 1;
+        }
+        printf("%-9s %-7s %10.1f %10.0f %10llu %10llu %10llu\n", "threaded", allocator_names[allocator],
+               result.ns_per_packet, result.worst_ns, (unsigned long long)result.received,
+               (unsigned long long)result.dropped, (unsigned long long)result.no_buffer);
+
+        if(result.corrupt > 0 || result.received + result.dropped + result.no_buffer != packets) {
+            printf("FAIL: %llu packets corrupt, %llu of %llu accounted for\n", (unsigned long long)result.corrupt,
+                   (unsigned long long)(result.received + result.dropped + result.no_buffer),
+                   (unsigned long long)packets);
+            pass = false;
+        }
+    }
+
+    if(buffer_pool_free_count(&pool) != BENCH_POOL_SIZE) {
+        printf("FAIL: %u of %i pool slots were returned\n", buffer_pool_free_count(&pool), BENCH_POOL_SIZE);
+        pass = false;
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
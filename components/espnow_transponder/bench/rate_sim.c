@@ -0,0 +1,390 @@
+//! Closed loop rate control simulation
+//!
+//! Runs rate_control.c against the simulated medium with a link SNR, so
+//! that faster rates and lower TX power lose more packets. Node 0 sends a
+//! steady stream of packets to the other nodes, the receivers, and runs the
+//! sender side of rate control as the transponder does: once per control
+//! window it feeds its own send failures into the controller, ends the
+//! window, applies the new rate and power, and broadcasts a sender report.
+//! The receivers count the packets with a loss monitor and answer each
+//! report with a loss report. Reports are control packets on the same
+//! medium, so they are lost like any other.
+//!
+//! The link SNR changes in phases, by default 20 dB, 12 dB, then 26 dB. For
+//! each phase this reports the best rate, the fastest one whose loss at
+//! full power is within the budget, the settled rate, the one used for most
+//! of the second half of the phase, the
+//! windows it took to get within a step of the best rate, and over the
+//! second half of the phase, the actual loss of the worst receiver, the
+//! windows over the budget and the rate changes. With --verbose it prints
+//! every window.
+//!
+//! It fails if a phase settles more than a step below the best rate or
+//! above it, takes longer than SIM_STEP_WINDOWS a step to get within a step of it,
+//! or loses more than SIM_SETTLED_LOSS_MAX of the packets in the second
+//! half.
+//!
+//! Rate control only probes a faster rate while the loss is under a quarter
+//! of the budget, so with --loss at or over that the rate stays where it
+//! is, and the phases fail.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/rate_sim [--snr DB ...] [--seconds N] [--receivers N] [--pps N] [--size N]
+//!                          [--loss P] [--seed N] [--verbose]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+#include "rate_control.h"
+#include "sim_air.h"
+
+//! Control window, as in the transponder
+#define SIM_CONTROL_INTERVAL_US     500000
+
+// Rate control settings, as in the transponder
+#define SIM_LOSS_BUDGET             0.02f
+#define SIM_GOOD_WINDOWS            4
+#define SIM_HOLD_WINDOWS            4
+#define SIM_HOLD_MAX                240
+#define SIM_MIN_PACKETS             20
+#define SIM_SILENT_WINDOWS          2
+#define SIM_POWER_STEP              4
+#define SIM_POWER_RANGE             24
+
+//! Full TX power, the power the link SNR is given for
+#define SIM_POWER                   SIM_AIR_REFERENCE_POWER
+
+//! Starting rate, the transponder's default: WIFI_PHY_RATE_MCS2_LGI
+#define SIM_START_RATE              0x12
+
+//! Node that sends the stream and runs rate control
+#define SIM_SENDER                  0
+
+//! Most SNR phases
+#define SIM_PHASES_MAX              8
+
+//! Most windows a rate step may take while settling: the good windows
+//! before a probe, the probe's own window, and a window of slack for a
+//! report that got lost
+#define SIM_STEP_WINDOWS            (SIM_GOOD_WINDOWS + 2)
+
+//! Highest loss over the second half of a phase. A failed probe loses
+//! about half the packets for a window and a half, as the loss reports
+//! arrive a window late. Probes are held off for longer each time they
+//! fail, but a settled link still averages over the budget.
+#define SIM_SETTLED_LOSS_MAX        0.06
+
+typedef struct {
+    float snr_db[SIM_PHASES_MAX];
+    int phases;
+    uint32_t seconds;                   //!< Length of each phase
+    uint8_t receivers;
+    uint32_t pps;
+    uint16_t size;
+    float loss;                         //!< Random loss, on top of the loss from the signal
+    uint32_t seed;
+    bool verbose;
+} sim_options_t;
+
+typedef struct {
+    loss_monitor_t monitor;
+    uint32_t window_received;           //!< Data packets received in the current window
+} sim_receiver_t;
+
+static sim_air_t air;
+static sim_receiver_t receivers[SIM_AIR_MAX_NODES];
+static rate_control_t control;
+static uint32_t control_session;
+static uint32_t sent_packets;           //!< Data packets the sender has sent
+
+//! \brief Address of a node, for the loss monitor
+static void node_mac(uint8_t node, uint8_t *mac_addr)
+{
+    static const uint8_t base[6] = {0x02, 0, 0, 0, 0, 0};
+    memcpy(mac_addr, base, sizeof(base));
+    mac_addr[5] = node;
+}
+
+//! \brief Send a control message from a node
+static void send_control(uint8_t node, const void *message, uint8_t length)
+{
+    uint8_t packet[SIM_AIR_MAX_PACKET];
+    memcpy(((espnow_transponder_packet_t *)packet)->data, message, length);
+    sim_air_send(&air, node, packet, framing_seal(packet, ESPNOW_TRANSPONDER_FLAG_CONTROL, length));
+}
+
+//! \brief Packet received by a receiver: count data, and answer sender reports
+static void receiver_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    sim_receiver_t *receiver = context;
+    if(source != SIM_SENDER || framing_check(data, length) != FRAMING_OK)
+        return;
+
+    uint8_t mac_addr[6];
+    node_mac(source, mac_addr);
+
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(!(packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL)) {
+        loss_monitor_packet(&receiver->monitor, mac_addr);
+        receiver->window_received++;
+        return;
+    }
+
+    if(packet->data_length != sizeof(control_sender_report_t) || packet->data[0] != CONTROL_SENDER_REPORT)
+        return;
+
+    control_sender_report_t report;
+    control_loss_report_t reply;
+    memcpy(&report, packet->data, sizeof(report));
+    if(loss_monitor_sender_report(&receiver->monitor, mac_addr, &report, &reply))
+        send_control(receiver - receivers, &reply, sizeof(reply));
+}
+
+//! \brief Packet received by the sender: take loss reports
+static void sender_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    if(framing_check(data, length) != FRAMING_OK)
+        return;
+
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(!(packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL) || packet->data_length != sizeof(control_loss_report_t)
+        || packet->data[0] != CONTROL_LOSS_REPORT)
+        return;
+
+    control_loss_report_t report;
+    memcpy(&report, packet->data, sizeof(report));
+    if(report.session == control_session)
+        rate_control_loss_report(&control, report.expected, report.received);
+}
+
+//! \brief Index of the fastest rate whose loss at full power is within the budget
+static int best_rate()
+{
+    int best = 0;
+    for(int index = 0; index < RATE_CONTROL_RATES; index++)
+        if(sim_air_signal_loss(&air, rate_control_rates[index], SIM_POWER) <= SIM_LOSS_BUDGET)
+            best = index;
+
+    return best;
+}
+
+static bool run(const sim_options_t *options)
+{
+    const sim_air_config_t air_config = {
+        .node_count = options->receivers + 1,
+        .phy_rate = SIM_START_RATE,
+        .snr_db = options->snr_db[0],
+        .loss = options->loss,
+        .burst_loss = 1,
+        .burst_exit = 1,
+        .latency_us = 100,
+        .queue_size = 4096,
+        .seed = options->seed,
+    };
+    if(!sim_air_init(&air, &air_config)) {
+        fprintf(stderr, "Could not create the medium\n");
+        return false;
+    }
+
+    sim_air_attach(&air, SIM_SENDER, sender_recv, NULL, NULL);
+    for(uint8_t node = 1; node <= options->receivers; node++) {
+        loss_monitor_init(&receivers[node].monitor);
+        receivers[node].window_received = 0;
+        sim_air_attach(&air, node, receiver_recv, NULL, &receivers[node]);
+        sim_air_set_phy(&air, node, SIM_START_RATE, SIM_POWER);
+    }
+
+    const rate_control_config_t control_config = {
+        .loss_budget = SIM_LOSS_BUDGET,
+        .loss_low = SIM_LOSS_BUDGET/4,
+        .good_windows = SIM_GOOD_WINDOWS,
+        .hold_windows = SIM_HOLD_WINDOWS,
+        .hold_windows_max = SIM_HOLD_MAX,
+        .min_packets = SIM_MIN_PACKETS,
+        .silent_windows = SIM_SILENT_WINDOWS,
+        .power_min = SIM_POWER - SIM_POWER_RANGE,
+        .power_max = SIM_POWER,
+        .power_step = SIM_POWER_STEP,
+    };
+    rate_control_init(&control, &control_config, SIM_START_RATE, SIM_POWER);
+    sim_air_set_phy(&air, SIM_SENDER, SIM_START_RATE, SIM_POWER);
+    control_session = 0x5EED0000 | options->seed;
+    sent_packets = 0;
+
+    const uint32_t phase_windows = (uint64_t)options->seconds*1000000/SIM_CONTROL_INTERVAL_US;
+    const int64_t packet_interval_us = 1000000/options->pps;
+
+    uint8_t data_packet[SIM_AIR_MAX_PACKET];
+    memset(data_packet, 0x55, sizeof(data_packet));
+    const int data_length = framing_seal(data_packet, 0, options->size);
+
+    printf("%u receivers, %u packets/s of %u bytes, %.1f%% random loss, %u s phases, budget %.1f%%\n",
+           options->receivers, options->pps, options->size, 100*options->loss, options->seconds,
+           100*SIM_LOSS_BUDGET);
+    printf("%-8s %6s %8s %9s %10s %10s %8s %8s\n", "snr", "best", "settled", "windows", "loss", "over", "changes",
+           "power");
+
+    bool ok = true;
+    int64_t now_us = 0;
+    int64_t next_packet_us = 0;
+    uint32_t failures = 0;
+    uint32_t window_start_packets = 0;
+
+    for(int phase = 0; phase < options->phases; phase++) {
+        air.config.snr_db = options->snr_db[phase];
+        const int best = best_rate();
+        const int start = control.rate_index;
+
+        int reached = -1;
+        uint32_t second_half_sent = 0;
+        uint32_t second_half_lost = 0;
+        uint32_t over = 0;
+        uint32_t half_changes = 0;
+        uint32_t rate_windows[RATE_CONTROL_RATES] = {0};
+
+        for(uint32_t window = 0; window < phase_windows; window++) {
+            const int64_t window_end_us = now_us + SIM_CONTROL_INTERVAL_US;
+
+            for(; next_packet_us < window_end_us; next_packet_us += packet_interval_us) {
+                sim_air_run_until(&air, next_packet_us);
+                if(sim_air_send(&air, SIM_SENDER, data_packet, data_length))
+                    sent_packets++;
+                else
+                    failures++;
+            }
+            sim_air_run_until(&air, window_end_us);
+            now_us = window_end_us;
+
+            // Worst receiver's actual loss in the window
+            const uint32_t window_sent = sent_packets - window_start_packets;
+            uint32_t worst = 0;
+            for(uint8_t node = 1; node <= options->receivers; node++) {
+                const uint32_t received = receivers[node].window_received;
+                const uint32_t lost = received < window_sent ? window_sent - received : 0;
+                if(lost > worst)
+                    worst = lost;
+                receivers[node].window_received = 0;
+            }
+            window_start_packets = sent_packets;
+
+            if(window >= phase_windows/2) {
+                second_half_sent += window_sent;
+                second_half_lost += worst;
+                over += window_sent > 0 && (float)worst/window_sent > SIM_LOSS_BUDGET;
+                rate_windows[control.rate_index]++;
+            }
+
+            // As control_poll() does: the window's send results, the update, then the report
+            rate_control_send_result(&control, window_sent + failures, failures);
+            failures = 0;
+            if(rate_control_update(&control))
+                sim_air_set_phy(&air, SIM_SENDER, rate_control_phy_rate(&control), control.power);
+
+            const control_sender_report_t report = {
+                .type = CONTROL_SENDER_REPORT,
+                .session = control_session,
+                .packets = sent_packets,
+            };
+            send_control(SIM_SENDER, &report, sizeof(report));
+
+            if(reached < 0 && abs(control.rate_index - best) <= 1)
+                reached = window + 1;
+            if(window == phase_windows/2)
+                half_changes = control.changes;
+
+            if(options->verbose)
+                printf("  %6.1f s  snr %4.1f  MCS%i power %3i  loss %5.1f%%  reported %5.1f%%\n", now_us/1e6,
+                       air.config.snr_db, control.rate_index, control.power,
+                       window_sent > 0 ? 100.0*worst/window_sent : 0.0,
+                       control.last_loss >= 0 ? 100*control.last_loss : -1.0);
+        }
+
+        int settled = 0;
+        for(int index = 1; index < RATE_CONTROL_RATES; index++)
+            if(rate_windows[index] > rate_windows[settled])
+                settled = index;
+
+        const double settled_loss = second_half_sent > 0 ? (double)second_half_lost/second_half_sent : 1;
+        printf("%5.1f dB   MCS%i     MCS%i %9i %9.2f%% %10u %8u %8i\n", air.config.snr_db, best, settled, reached, 100*settled_loss, over, control.changes - half_changes, control.power);
+
+        if(settled < best - 1 || settled > best) {
+            printf("FAIL: %.1f dB settles at MCS%i, best is MCS%i\n", air.config.snr_db, settled, best);
+            ok = false;
+        }
+        const int settle_windows = (abs(start - best) + 1)*SIM_STEP_WINDOWS + SIM_HOLD_WINDOWS;
+        if(reached < 0 || reached > settle_windows) {
+            printf("FAIL: %.1f dB takes %i windows to get within a step of MCS%i, more than %i\n",
+                   air.config.snr_db, reached, best, settle_windows);
+            ok = false;
+        }
+        if(settled_loss > SIM_SETTLED_LOSS_MAX) {
+            printf("FAIL: %.1f dB loses %.1f%% once settled\n", air.config.snr_db, 100*settled_loss);
+            ok = false;
+        }
+    }
+
+    sim_air_free(&air);
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .snr_db = {20, 12, 26},
+        .phases = 3,
+        .seconds = 60,
+        .receivers = 3,
+        .pps = 1000,
+        .size = 200,
+        .loss = 0,
+        .seed = 1,
+        .verbose = false,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        const bool value = arg + 1 < argc;
+        if(strcmp(argv[arg], "--snr") == 0 && value) {
+            options.phases = 0;
+            while(arg + 1 < argc && argv[arg + 1][0] != '-' && options.phases < SIM_PHASES_MAX)
+                options.snr_db[options.phases++] = atof(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--seconds") == 0 && value)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--receivers") == 0 && value)
+            options.receivers = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--pps") == 0 && value)
+            options.pps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--size") == 0 && value)
+            options.size = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--loss") == 0 && value)
+            options.loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && value)
+            options.seed = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--verbose") == 0)
+            options.verbose = true;
+        else {
+            fprintf(stderr, "Usage: %s [--snr DB ...] [--seconds N] [--receivers N] [--pps N] [--size N]"
+                    " [--loss P] [--seed N] [--verbose]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const uint16_t max_size = ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t);
+    if(options.phases == 0 || options.receivers < 1 || options.receivers >= SIM_AIR_MAX_NODES
+        || options.pps == 0 || options.pps > 1000000 || options.seconds == 0 || options.size == 0
+        || options.size > max_size || options.seed == 0) {
+        fprintf(stderr, "Need 1 to %u receivers, a size up to %u and a non-zero seed\n", SIM_AIR_MAX_NODES - 1,
+                max_size);
+        return 2;
+    }
+
+    const bool ok = run(&options);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,427 @@
+//! Recording format tests
+//!
+//! Writes a recording of several universes with recording.c, as the
+//! recorder does, then reads it back and plays it, and checks:
+//!
+//! * every frame reads back in order, with its time, universe, sequence and
+//!   data, whether it was recorded whole or as a delta
+//! * record boundaries: a recording cut short at any point reads back
+//!   exactly the frames whose records were written in full, then stops,
+//!   and one cut at a record boundary and followed by erased flash ends
+//!   cleanly
+//! * seeking, with the index and by scanning a recording that has none,
+//!   lands on a sync point from which the frames match
+//! * timing reconstruction: played against a stepped clock, each frame is
+//!   output at its recorded time from the first, scaled by the speed, and a
+//!   frame that isn't taken is offered again
+//!
+//! With --out, the recording is also written to a file, for recording_tool.
+//! Its times start at 1000 s, as if the recorder had been up that long.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/recording_test [--seconds N] [--out FILE]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "recording.h"
+#include "bench_util.h"
+
+//! Universes recorded
+#define TEST_UNIVERSES              8
+
+//! Frames per second of each universe
+#define TEST_FPS                    44
+
+//! Time between sync points
+#define TEST_SYNC_INTERVAL_US       250000
+
+//! Erased flash after the recording, in the padding checks
+#define TEST_ERASED_LENGTH          4096
+
+typedef struct {
+    int64_t time_us;
+    uint16_t universe;
+    uint8_t sequence;
+    uint16_t length;
+    uint64_t end;                       //!< Offset of the end of the frame's record
+    uint8_t data[RECORDING_MAX_FRAME];
+} test_frame_t;
+
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t reserved;
+} test_buffer_t;
+
+typedef struct {
+    int64_t now_us;
+    int64_t start_us;
+    uint32_t offered;
+    uint32_t count;
+    uint32_t first;                     //!< Expected frame played first
+    float speed;
+    bool ok;
+    bool timing_ok;
+} test_play_t;
+
+static test_frame_t *frames;
+static uint32_t frame_count;
+
+static bool buffer_write(void *context, const uint8_t *data, size_t length)
+{
+    test_buffer_t *buffer = context;
+    if(buffer->length + length > buffer->reserved) {
+        const size_t reserved = (buffer->length + length)*2;
+        uint8_t *grown = realloc(buffer->data, reserved);
+        if(grown == NULL)
+            return false;
+        buffer->data = grown;
+        buffer->reserved = reserved;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+//! \brief Check a frame read back against the one written
+static bool frame_matches(const recording_frame_t *frame, const test_frame_t *expected)
+{
+    return frame->time_us == expected->time_us && frame->universe == expected->universe
+        && frame->sequence == expected->sequence && frame->length == expected->length
+        && memcmp(frame->data, expected->data, expected->length) == 0;
+}
+
+//! \brief Record frames of every universe, with small changes, whole changes and changes of length
+static bool write_recording(test_buffer_t *buffer, uint32_t seconds, recording_writer_stats_t *stats)
+{
+    recording_writer_t writer;
+    if(!recording_writer_init(&writer, TEST_UNIVERSES, TEST_SYNC_INTERVAL_US, buffer_write, buffer))
+        return false;
+
+    static uint8_t current[TEST_UNIVERSES][RECORDING_MAX_FRAME];
+    uint16_t lengths[TEST_UNIVERSES];
+    uint8_t sequences[TEST_UNIVERSES] = { 0 };
+    for(uint16_t universe = 0; universe < TEST_UNIVERSES; universe++) {
+        lengths[universe] = universe == 0 ? 24 : RECORDING_MAX_FRAME;
+        for(uint16_t slot = 0; slot < RECORDING_MAX_FRAME; slot++)
+            current[universe][slot] = random_next();
+    }
+
+    // Start part way into the clock, so that times are not relative to zero
+    const int64_t start_us = 1000000007;
+    const uint32_t rounds = seconds*TEST_FPS;
+    frames = malloc((size_t)rounds*TEST_UNIVERSES*sizeof(test_frame_t));
+    if(frames == NULL)
+        return false;
+
+    frame_count = 0;
+    for(uint32_t round = 0; round < rounds; round++) {
+        for(uint16_t universe = 0; universe < TEST_UNIVERSES; universe++) {
+            uint8_t *data = current[universe];
+            const uint32_t choice = random_next()%16;
+            if(choice == 0) {
+                for(uint16_t slot = 0; slot < RECORDING_MAX_FRAME; slot++)
+                    data[slot] = random_next();
+            }
+            else if(choice == 1 && universe > 0) {
+                lengths[universe] = 1 + random_next()%RECORDING_MAX_FRAME;
+            }
+            else {
+                // A few slots, runs of them, and the erased flash value that ends a recording
+                const int changes = random_next()%8;
+                for(int change = 0; change < changes; change++) {
+                    const uint16_t slot = random_next()%lengths[universe];
+                    data[slot] = change == 0 ? 0xFF : random_next();
+                    if(slot + 1 < lengths[universe])
+                        data[slot + 1]++;
+                }
+            }
+
+            // Universes spread over the frame, with some jitter
+            const int64_t time_us = start_us + (int64_t)round*1000000/TEST_FPS
+                + universe*1000 + random_next()%500;
+            test_frame_t *frame = &frames[frame_count];
+            frame->time_us = time_us;
+            frame->universe = universe;
+            frame->sequence = sequences[universe]++;
+            frame->length = lengths[universe];
+            memcpy(frame->data, data, frame->length);
+
+            if(!recording_writer_frame(&writer, time_us, universe, frame->sequence, data, frame->length)) {
+                recording_writer_free(&writer);
+                return false;
+            }
+            frame->end = writer.offset;
+            frame_count++;
+        }
+    }
+
+    const bool finished = recording_writer_finish(&writer);
+    *stats = writer.stats;
+    recording_writer_free(&writer);
+    return finished;
+}
+
+//! \brief Read a recording through
+//!
+//! \param data Recording
+//! \param length Its length
+//! \param read Set to the number of frames read, which all matched
+//! \return What recording_reader_next() last returned, or -2 if the recording couldn't be opened or a
+//!         frame didn't match
+static int read_recording(const uint8_t *data, size_t length, uint32_t *read)
+{
+    *read = 0;
+    recording_reader_t reader;
+    if(!recording_reader_init(&reader, data, length))
+        return -2;
+
+    recording_frame_t frame;
+    int ret;
+    while((ret = recording_reader_next(&reader, &frame)) > 0) {
+        if(*read >= frame_count || !frame_matches(&frame, &frames[*read])) {
+            ret = -2;
+            break;
+        }
+        (*read)++;
+    }
+
+    recording_reader_free(&reader);
+    return ret;
+}
+
+//! \brief Check a recording cut short at an offset
+//!
+//! \param erased Follow it with erased flash
+static bool check_cut(const test_buffer_t *buffer, size_t cut, bool erased, uint8_t *copy)
+{
+    memcpy(copy, buffer->data, cut);
+    if(erased)
+        memset(copy + cut, RECORDING_TAG_ERASED, TEST_ERASED_LENGTH);
+
+    // Only the frames whose records were written in full can be read
+    uint32_t whole = 0;
+    while(whole < frame_count && frames[whole].end <= cut)
+        whole++;
+
+    uint32_t read;
+    const int ret = read_recording(copy, cut + (erased ? TEST_ERASED_LENGTH : 0), &read);
+    return ret >= -1 && read == whole && (!erased || ret == 0);
+}
+
+static void check_cuts(const test_buffer_t *buffer)
+{
+    uint8_t *copy = malloc(buffer->length + TEST_ERASED_LENGTH);
+    if(copy == NULL) {
+        check(false, "memory for the cut recordings");
+        return;
+    }
+
+    // Around every record boundary, and at a spread of offsets in between
+    bool boundaries = true;
+    bool erased = true;
+    for(uint32_t index = 0; index < frame_count; index++) {
+        const size_t end = frames[index].end;
+        boundaries &= check_cut(buffer, end - 1, false, copy);
+        boundaries &= check_cut(buffer, end, false, copy);
+        if(end + 1 <= buffer->length)
+            boundaries &= check_cut(buffer, end + 1, false, copy);
+        erased &= check_cut(buffer, end, true, copy);
+    }
+    check(boundaries, "cut at a record boundary");
+    check(erased, "cut at a record boundary, then erased flash");
+
+    bool anywhere = true;
+    for(size_t cut = sizeof(recording_header_t); cut <= buffer->length; cut += 1 + random_next()%97)
+        anywhere &= check_cut(buffer, cut, false, copy);
+    check(anywhere, "cut anywhere");
+
+    uint32_t read;
+    memcpy(copy, buffer->data, sizeof(recording_header_t) - 1);
+    check(read_recording(copy, sizeof(recording_header_t) - 1, &read) == -2, "cut inside the header");
+
+    free(copy);
+}
+
+//! \brief Seek, and check that the frames read match from the sync point on
+static bool check_seek(const uint8_t *data, size_t length, int64_t time_us)
+{
+    recording_reader_t reader;
+    if(!recording_reader_init(&reader, data, length))
+        return false;
+
+    bool ok = recording_reader_seek(&reader, time_us);
+
+    // The sync point is at or before the time, and no earlier than an interval before it
+    recording_frame_t frame;
+    ok = ok && recording_reader_next(&reader, &frame) > 0 && frame.time_us <= time_us
+        && frame.time_us > time_us - TEST_SYNC_INTERVAL_US - 1000000/TEST_FPS;
+
+    uint32_t index = 0;
+    while(ok && index < frame_count && !frame_matches(&frame, &frames[index]))
+        index++;
+    for(uint32_t count = 0; ok && count < 4*TEST_UNIVERSES && index + count + 1 < frame_count; count++)
+        ok = recording_reader_next(&reader, &frame) > 0 && frame_matches(&frame, &frames[index + count + 1]);
+
+    recording_reader_free(&reader);
+    return ok && index < frame_count;
+}
+
+//! \brief Take a frame, except every seventh one the first time it is offered
+static bool play_output(void *context, const recording_frame_t *frame)
+{
+    test_play_t *play = context;
+    if(++play->offered % 7 == 0)
+        return false;
+
+    if(play->first + play->count >= frame_count || !frame_matches(frame, &frames[play->first + play->count])) {
+        play->ok = false;
+        return true;
+    }
+    const test_frame_t *expected = &frames[play->first + play->count];
+
+    // Played at the time since the first frame, scaled by the speed
+    const int64_t elapsed_us = expected->time_us - frames[play->first].time_us;
+    const int64_t due_us = play->speed > 0 ? (int64_t)(elapsed_us/play->speed) : 0;
+    play->timing_ok &= play->now_us - play->start_us == due_us;
+    play->count++;
+    return true;
+}
+
+//! \brief Play a recording against a clock that steps to each time the player asks for
+static void check_play(const test_buffer_t *buffer, float speed, int64_t seek_us, const char *what)
+{
+    recording_reader_t reader;
+    if(!recording_reader_init(&reader, buffer->data, buffer->length)) {
+        check(false, what);
+        return;
+    }
+
+    test_play_t play = {
+        .now_us = 5000000,
+        .start_us = 5000000,
+        .speed = speed,
+        .ok = true,
+        .timing_ok = true,
+    };
+    if(seek_us > 0) {
+        recording_frame_t frame;
+        play.ok = recording_reader_seek(&reader, seek_us) && recording_reader_next(&reader, &frame) > 0;
+        while(play.ok && play.first < frame_count && !frame_matches(&frame, &frames[play.first]))
+            play.first++;
+        recording_reader_seek(&reader, seek_us);
+    }
+
+    recording_player_t player;
+    recording_player_init(&player, &reader, speed);
+    uint32_t polls = 0;
+    while(play.ok && polls++ < 4*frame_count) {
+        const int64_t next_us = recording_player_poll(&player, play.now_us, play_output, &play);
+        if(next_us == INT64_MAX)
+            break;
+        if(next_us < play.now_us)
+            play.ok = false;
+        play.now_us = next_us;
+    }
+
+    check(play.ok && !player.corrupt && player.ended && play.first + play.count == frame_count
+          && player.frames == play.count, what);
+    check(play.timing_ok, "frames played at their recorded times");
+    recording_reader_free(&reader);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t seconds = 3;
+    const char *out_path = NULL;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--out") == 0 && arg + 1 < argc)
+            out_path = argv[++arg];
+        else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--out FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(seconds == 0) {
+        fprintf(stderr, "Usage: %s [--seconds N] [--out FILE]\n", argv[0]);
+        return 2;
+    }
+
+    test_buffer_t buffer = { 0 };
+    recording_writer_stats_t stats;
+    if(!write_recording(&buffer, seconds, &stats)) {
+        fprintf(stderr, "Could not write the recording\n");
+        return 1;
+    }
+    printf("%u frames, %llu as deltas, %zu bytes, %.3f of the frame data\n", frame_count,
+           (unsigned long long)stats.deltas, buffer.length, (double)buffer.length/stats.frame_bytes);
+    check(stats.frames == frame_count && stats.dropped == 0 && stats.bytes == buffer.length, "writer stats");
+    check(stats.deltas > 0 && stats.deltas < stats.frames, "both full and delta frames recorded");
+
+    uint32_t read;
+    check(read_recording(buffer.data, buffer.length, &read) == 0 && read == frame_count, "read back");
+
+    recording_reader_t reader;
+    check(recording_reader_init(&reader, buffer.data, buffer.length) && reader.index != NULL
+          && reader.index_count >= seconds*1000000/TEST_SYNC_INTERVAL_US, "index found");
+    recording_reader_free(&reader);
+
+    // The whole recording, followed by erased flash, still has its index
+    uint8_t *padded = malloc(buffer.length + TEST_ERASED_LENGTH);
+    if(padded == NULL)
+        return 1;
+    memcpy(padded, buffer.data, buffer.length);
+    memset(padded + buffer.length, RECORDING_TAG_ERASED, TEST_ERASED_LENGTH);
+    check(recording_reader_init(&reader, padded, buffer.length + TEST_ERASED_LENGTH) && reader.index != NULL,
+          "index found before erased flash");
+    recording_reader_free(&reader);
+    check(read_recording(padded, buffer.length + TEST_ERASED_LENGTH, &read) == 0 && read == frame_count,
+          "read back before erased flash");
+    free(padded);
+
+    check_cuts(&buffer);
+
+    // Seek with the index, and by scanning a recording cut short before it
+    const size_t no_index = frames[frame_count - 1].end;
+    bool indexed = true;
+    bool scanned = true;
+    for(int step = 1; step < 20; step++) {
+        const int64_t time_us = frames[0].time_us + (int64_t)seconds*1000000*step/20;
+        indexed &= check_seek(buffer.data, buffer.length, time_us);
+        scanned &= check_seek(buffer.data, no_index, time_us);
+    }
+    check(indexed, "seek with the index");
+    check(scanned, "seek without the index");
+    check(recording_reader_init(&reader, buffer.data, buffer.length)
+          && !recording_reader_seek(&reader, frames[0].time_us - 1), "seek before the start");
+    recording_reader_free(&reader);
+
+    check_play(&buffer, 1, 0, "played through at speed 1");
+    check_play(&buffer, 2, 0, "played through at speed 2");
+    check_play(&buffer, 0, 0, "played through as fast as possible");
+    check_play(&buffer, 1, frames[frame_count/2].time_us, "played from a sync point");
+
+    if(out_path != NULL) {
+        FILE *file = fopen(out_path, "wb");
+        const bool written = file != NULL && fwrite(buffer.data, 1, buffer.length, file) == buffer.length;
+        if(file == NULL || fclose(file) != 0 || !written) {
+            fprintf(stderr, "Could not write %s\n", out_path);
+            return 1;
+        }
+    }
+
+    free(buffer.data);
+    free(frames);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,454 @@
+//! Multi-hop relay simulation
+//!
+//! Lays nodes out on the simulated medium in a chain or a grid, where each
+//! node is only in range of its neighbours, and has node 0 send a stream of
+//! packets with a relay header. The other nodes run the transponder's
+//! receive side of relaying: the CRC and length check, duplicate
+//! suppression, and relaying with jitter and the rate limit. Every node is
+//! a relay unless --no-relay is given.
+//!
+//! For each node, this reports its distance in hops from the sender, the
+//! fraction of packets it received, and how late they were, then sums that
+//! up for each hop count, with the latency each hop adds. Each run is made
+//! with relaying off as well, to compare against.
+//!
+//! With relaying on, it fails if a hop the TTL reaches gets less than the
+//! loss of that many links in a row allows, by a small margin, or if a hop
+//! the TTL doesn't reach gets anything. relay_test checks relay.c on its own.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/relay_sim [--topology chain|grid] [--nodes N] [--loss P] [--ttl N]
+//!                           [--jitter US] [--rate N] [--pps N] [--size N] [--seconds N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "framing.h"
+#include "relay.h"
+#include "sim_air.h"
+
+//! Packets a node can have waiting to be relayed, as in the transponder
+#define SIM_RELAY_QUEUE_SIZE        16
+
+//! Packets relayed back to back before the rate limit applies, as in the transponder
+#define SIM_RELAY_BURST             8
+
+//! Node that sends the stream
+#define SIM_ORIGIN                  0
+
+//! Delivery allowed below that of a chain of lossy links, for collisions and the rate limit
+#define SIM_DELIVERY_MARGIN         0.03
+
+typedef enum {
+    TOPOLOGY_CHAIN,                     //!< Each node hears the one before it and the one after it
+    TOPOLOGY_GRID,                      //!< Nodes in a square grid, each hears the ones beside, above and below it
+} topology_t;
+
+typedef struct {
+    topology_t topology;
+    uint8_t nodes;
+    float loss;                         //!< Loss of each link
+    uint8_t ttl;
+    uint32_t jitter_us;
+    uint32_t rate;                      //!< Relay rate limit, packets per second
+    uint32_t pps;                       //!< Packets sent per second
+    uint16_t size;                      //!< Payload length
+    uint32_t seconds;
+    bool relay;                         //!< Nodes relay
+} sim_options_t;
+
+//! A packet waiting to be relayed
+typedef struct {
+    int64_t due_us;
+    uint16_t length;
+    uint8_t data[ESP_NOW_MAX_DATA_LEN];
+} sim_pending_t;
+
+typedef struct {
+    relay_t relay;
+    sim_pending_t queue[SIM_RELAY_QUEUE_SIZE];
+    uint16_t queue_head;
+    uint16_t queue_count;
+    uint32_t queue_full;                //!< Packets not relayed because the queue was full
+    uint32_t received;                  //!< Packets received, after duplicate suppression
+    int64_t *arrival_us;                //!< First arrival time of each packet, or -1
+    uint8_t hops;                       //!< Hops from the origin, 0 if unreachable
+} sim_node_t;
+
+static sim_air_t air;
+static sim_node_t nodes[SIM_AIR_MAX_NODES];
+static int64_t *sent_us;                //!< Time each packet was sent
+static uint32_t packet_count;
+
+//! \brief Packet received by a node: check it, suppress duplicates, and queue it for relaying
+static void node_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    sim_node_t *node = context;
+
+    if(framing_check(data, length) != FRAMING_OK)
+        return;
+
+    const espnow_transponder_relay_header_t *header = framing_relay_header(data);
+    if(header == NULL)
+        return;
+
+    int64_t due_us;
+    const relay_action_t action = relay_receive(&node->relay, header, air.now_us, &due_us);
+    if(action == RELAY_DUPLICATE)
+        return;
+
+    // The payload starts with the packet number
+    const uint8_t *payload = data + sizeof(espnow_transponder_packet_t) + sizeof(espnow_transponder_relay_header_t);
+    uint32_t index;
+    memcpy(&index, payload, sizeof(index));
+    if(index < packet_count && node->arrival_us[index] < 0) {
+        node->arrival_us[index] = air.now_us;
+        node->received++;
+    }
+
+    if(action != RELAY_FORWARD)
+        return;
+
+    if(node->queue_count == SIM_RELAY_QUEUE_SIZE) {
+        node->queue_full++;
+        return;
+    }
+
+    sim_pending_t *pending = &node->queue[(node->queue_head + node->queue_count++) % SIM_RELAY_QUEUE_SIZE];
+    pending->due_us = due_us;
+    pending->length = length;
+    memcpy(pending->data, data, length);
+    relay_prepare(pending->data);
+}
+
+//! \brief Find each node's distance in hops from the origin
+static void measure_hops(uint8_t node_count)
+{
+    uint8_t queue[SIM_AIR_MAX_NODES];
+    uint8_t head = 0;
+    uint8_t tail = 0;
+    bool visited[SIM_AIR_MAX_NODES] = { false };
+
+    visited[SIM_ORIGIN] = true;
+    nodes[SIM_ORIGIN].hops = 0;
+    queue[tail++] = SIM_ORIGIN;
+
+    while(head < tail) {
+        const uint8_t from = queue[head++];
+        for(uint8_t to = 0; to < node_count; to++) {
+            if(visited[to] || air.link_loss[from][to] >= 1)
+                continue;
+
+            visited[to] = true;
+            nodes[to].hops = nodes[from].hops + 1;
+            queue[tail++] = to;
+        }
+    }
+}
+
+//! \brief Put every node out of range of every other, except for the neighbours in the topology
+static void lay_out(const sim_options_t *options)
+{
+    uint8_t width = options->nodes;
+    if(options->topology == TOPOLOGY_GRID)
+        for(width = 1; width*width < options->nodes; width++)
+            ;
+
+    for(uint8_t a = 0; a < options->nodes; a++) {
+        for(uint8_t b = a + 1; b < options->nodes; b++) {
+            const int dx = abs(a % width - b % width);
+            const int dy = abs(a/width - b/width);
+            sim_air_set_link(&air, a, b, dx + dy == 1 ? options->loss : 1);
+        }
+    }
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+typedef struct {
+    uint64_t expected;
+    uint64_t received;
+    double latency_sum_us;
+    uint64_t latency_count;
+} hop_result_t;
+
+//! \brief Run the simulation, and print the results
+//!
+//! \param options Simulation settings
+//! \param hop_delivery Set to the delivery ratio at each hop count that has nodes
+//! \return True if successful
+static bool run(const sim_options_t *options, double *hop_delivery)
+{
+    const sim_air_config_t air_config = {
+        .node_count = options->nodes,
+        .phy_rate = WIFI_PHY_RATE_MCS2_LGI,
+        .latency_us = 100,
+        .jitter_us = 20,
+        .queue_size = 4096,
+        .contention = true,
+        .seed = 12345,
+    };
+    if(!sim_air_init(&air, &air_config))
+        return false;
+
+    lay_out(options);
+    measure_hops(options->nodes);
+
+    packet_count = options->pps*options->seconds;
+    sent_us = calloc(packet_count, sizeof(int64_t));
+    if(sent_us == NULL)
+        return false;
+
+    for(uint8_t index = 0; index < options->nodes; index++) {
+        sim_node_t *node = &nodes[index];
+        const relay_config_t relay_config = {
+            .origin = index,
+            .forward = options->relay && index != SIM_ORIGIN,
+            .jitter_us = options->jitter_us,
+            .rate = options->rate,
+            .burst = SIM_RELAY_BURST,
+            .seed = 1 + index*7919,
+        };
+        relay_init(&node->relay, &relay_config);
+        node->queue_head = 0;
+        node->queue_count = 0;
+        node->queue_full = 0;
+        node->received = 0;
+        node->arrival_us = malloc(sizeof(int64_t)*packet_count);
+        if(node->arrival_us == NULL)
+            return false;
+        for(uint32_t packet = 0; packet < packet_count; packet++)
+            node->arrival_us[packet] = -1;
+
+        sim_air_attach(&air, index, node_recv, NULL, node);
+    }
+
+    uint8_t payload[ESP_NOW_MAX_DATA_LEN] = { 0 };
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    const int64_t interval_us = 1000000/options->pps;
+    uint32_t next_packet = 0;
+    uint64_t rejected = 0;
+
+    while(true) {
+        // Next thing to happen: the origin's next packet, a relayed packet
+        // falling due, or an event on the medium
+        int64_t next_us = next_packet < packet_count ? next_packet*interval_us : INT64_MAX;
+        for(uint8_t index = 0; index < options->nodes; index++)
+            if(nodes[index].queue_count > 0 && nodes[index].queue[nodes[index].queue_head].due_us < next_us)
+                next_us = nodes[index].queue[nodes[index].queue_head].due_us;
+
+        const int64_t event_us = sim_air_next_event(&air);
+        if(event_us >= 0 && event_us < next_us)
+            next_us = event_us;
+        if(next_us == INT64_MAX)
+            break;
+
+        sim_air_run_until(&air, next_us);
+
+        if(next_packet < packet_count && next_packet*interval_us <= air.now_us) {
+            const espnow_transponder_relay_header_t header = {
+                .origin = SIM_ORIGIN,
+                .sequence = next_packet,
+                .ttl = options->ttl,
+            };
+            memcpy(payload, &next_packet, sizeof(next_packet));
+            const espnow_transponder_iovec_t part = { payload, options->size };
+
+            const int length = framing_build(packet, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t)
+                                             - sizeof(header), &part, 1, false,
+                                             ESPNOW_TRANSPONDER_CLASS_REALTIME, &header, NULL, NULL);
+            sent_us[next_packet++] = air.now_us;
+            if(length < 0 || !sim_air_send(&air, SIM_ORIGIN, packet, length))
+                rejected++;
+        }
+
+        for(uint8_t index = 0; index < options->nodes; index++) {
+            sim_node_t *node = &nodes[index];
+            while(node->queue_count > 0 && node->queue[node->queue_head].due_us <= air.now_us) {
+                const sim_pending_t *pending = &node->queue[node->queue_head];
+                if(!sim_air_send(&air, index, pending->data, pending->length))
+                    rejected++;
+
+                node->queue_head = (node->queue_head + 1) % SIM_RELAY_QUEUE_SIZE;
+                node->queue_count--;
+            }
+        }
+    }
+
+    printf("%s, %u nodes, link loss %.2f, ttl %u, jitter %u us, rate limit %u/s, %u packets/s of %u bytes, relaying %s\n",
+           options->topology == TOPOLOGY_GRID ? "grid" : "chain", options->nodes, options->loss, options->ttl,
+           options->jitter_us, options->rate, options->pps, options->size, options->relay ? "on" : "off");
+    printf("%5s %5s %9s %10s %10s %9s %9s %8s %8s %6s %9s\n", "node", "hops", "delivery", "mean_us", "p99_us",
+           "relayed", "dupes", "expired", "limited", "full", "airtime");
+
+    uint8_t max_hops = 0;
+    for(uint8_t index = 0; index < options->nodes; index++)
+        if(nodes[index].hops > max_hops)
+            max_hops = nodes[index].hops;
+
+    hop_result_t hops[SIM_AIR_MAX_NODES] = { 0 };
+    int64_t *latencies_us = malloc(sizeof(int64_t)*packet_count);
+    if(latencies_us == NULL)
+        return false;
+
+    for(uint8_t index = 0; index < options->nodes; index++) {
+        sim_node_t *node = &nodes[index];
+        uint64_t count = 0;
+        double sum_us = 0;
+        for(uint32_t packet = 0; packet < packet_count; packet++) {
+            if(node->arrival_us[packet] < 0)
+                continue;
+
+            latencies_us[count] = node->arrival_us[packet] - sent_us[packet];
+            sum_us += latencies_us[count++];
+        }
+        qsort(latencies_us, count, sizeof(int64_t), compare_int64);
+
+        const relay_t *relay = &node->relay;
+        printf("%5u %5u %9.4f %10.0f %10lld %9u %9u %8u %8u %6u %8.1f%%\n", index, node->hops,
+               index == SIM_ORIGIN ? 1.0 : (double)node->received/packet_count, count ? sum_us/count : 0,
+               count ? (long long)latencies_us[count*99/100] : 0LL, relay->forwarded, relay->duplicates,
+               relay->expired, relay->limited, node->queue_full,
+               100.0*air.nodes[index].stats.airtime_us/(options->seconds*1e6));
+
+        if(index != SIM_ORIGIN && node->hops > 0) {
+            hops[node->hops].expected += packet_count;
+            hops[node->hops].received += node->received;
+            hops[node->hops].latency_sum_us += sum_us;
+            hops[node->hops].latency_count += count;
+        }
+    }
+
+    printf("%5s %6s %9s %10s %12s\n", "hops", "nodes", "delivery", "mean_us", "added_us");
+    double previous_us = 0;
+    for(uint8_t hop = 1; hop <= max_hops; hop++) {
+        const hop_result_t *result = &hops[hop];
+        const double delivery = result->expected ? (double)result->received/result->expected : 0;
+        const double mean_us = result->latency_count ? result->latency_sum_us/result->latency_count : 0;
+        printf("%5u %6llu %9.4f %10.0f %12.0f\n", hop, (unsigned long long)(result->expected/packet_count),
+               delivery, mean_us, result->latency_count ? mean_us - previous_us : 0);
+        hop_delivery[hop] = delivery;
+        if(result->latency_count)
+            previous_us = mean_us;
+    }
+    printf("sends rejected by the medium: %llu, collisions:", (unsigned long long)rejected);
+    uint64_t collisions = 0;
+    for(uint8_t index = 0; index < options->nodes; index++)
+        collisions += air.nodes[index].stats.tx_collisions;
+    printf(" %llu\n\n", (unsigned long long)collisions);
+
+    free(latencies_us);
+    for(uint8_t index = 0; index < options->nodes; index++) {
+        free(nodes[index].arrival_us);
+        nodes[index].arrival_us = NULL;
+    }
+    free(sent_us);
+    sim_air_free(&air);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .topology = TOPOLOGY_CHAIN,
+        .nodes = 6,
+        .loss = 0.02,
+        .ttl = 8,
+        .jitter_us = 2000,
+        .rate = 500,
+        .pps = 100,
+        .size = 200,
+        .seconds = 10,
+        .relay = true,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        const bool value = arg + 1 < argc;
+        if(strcmp(argv[arg], "--topology") == 0 && value) {
+            const char *topology = argv[++arg];
+            options.topology = strcmp(topology, "grid") == 0 ? TOPOLOGY_GRID : TOPOLOGY_CHAIN;
+        }
+        else if(strcmp(argv[arg], "--nodes") == 0 && value)
+            options.nodes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--loss") == 0 && value)
+            options.loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--ttl") == 0 && value)
+            options.ttl = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--jitter") == 0 && value)
+            options.jitter_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--rate") == 0 && value)
+            options.rate = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--pps") == 0 && value)
+            options.pps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--size") == 0 && value)
+            options.size = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && value)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--no-relay") == 0)
+            options.relay = false;
+        else {
+            fprintf(stderr, "Usage: %s [--topology chain|grid] [--nodes N] [--loss P] [--ttl N] [--jitter US]"
+                    " [--rate N] [--pps N] [--size N] [--seconds N] [--no-relay]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const uint16_t max_size = ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t)
+        - sizeof(espnow_transponder_relay_header_t);
+    if(options.nodes < 2 || options.nodes > SIM_AIR_MAX_NODES || options.pps == 0 || options.seconds == 0
+        || options.size < sizeof(uint32_t) || options.size > max_size) {
+        fprintf(stderr, "Need 2 to %u nodes, and a size from %zu to %u\n", SIM_AIR_MAX_NODES, sizeof(uint32_t),
+                max_size);
+        return 2;
+    }
+
+    // Hop counts that no node is at stay negative
+    double relayed[SIM_AIR_MAX_NODES];
+    double unrelayed[SIM_AIR_MAX_NODES];
+    for(uint8_t hop = 0; hop < SIM_AIR_MAX_NODES; hop++)
+        relayed[hop] = unrelayed[hop] = -1;
+
+    if(!run(&options, relayed))
+        return 1;
+
+    if(!options.relay)
+        return 0;
+
+    sim_options_t direct = options;
+    direct.relay = false;
+    if(!run(&direct, unrelayed))
+        return 1;
+
+    bool pass = true;
+    printf("%5s %12s %12s\n", "hops", "relayed", "direct");
+    for(uint8_t hop = 1; hop < SIM_AIR_MAX_NODES && relayed[hop] >= 0; hop++) {
+        printf("%5u %12.4f %12.4f\n", hop, relayed[hop], unrelayed[hop]);
+
+        // The origin's packets go out with ttl hops left, so they reach ttl + 1 hops
+        const bool reached = hop <= options.ttl + 1;
+        const double expected = pow(1 - options.loss, hop) - SIM_DELIVERY_MARGIN;
+        if(reached && relayed[hop] < expected) {
+            printf("FAIL: %u hops received %.4f, expected at least %.4f\n", hop, relayed[hop], expected);
+            pass = false;
+        }
+        if(!reached && relayed[hop] > 0) {
+            printf("FAIL: %u hops is past the TTL, and received %.4f\n", hop, relayed[hop]);
+            pass = false;
+        }
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,241 @@
+//! Relay tests
+//!
+//! Checks relay.c, which decides what a node does with each relayed packet
+//! it hears:
+//!
+//! * duplicate suppression: a packet is taken once, its copies are dropped,
+//!   and recent packets are still remembered after many others
+//! * the node's own packets, relayed back to it, are dropped
+//! * a packet with no hops left is received but not relayed, and a node that
+//!   doesn't relay receives everything new
+//! * relay_prepare() takes a hop off the TTL, and leaves a valid packet
+//! * the GCRA rate limit: a full burst goes out back to back, then one
+//!   packet per interval, an idle bucket refills to the burst and no more,
+//!   and over a long run no more than the rate and the burst are relayed
+//! * random arrivals with jitter: copies are due in order, no earlier than
+//!   they arrive, and no later than their jitter or the copy before them
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/relay_test [--packets N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "relay.h"
+#include "framing.h"
+#include "bench_util.h"
+
+//! Origin id of the node under test
+#define TEST_ORIGIN                 0x1234
+
+//! Origin id of the node that sent the packets
+#define TEST_SENDER                 0x0042
+
+//! Rate limit used by the rate tests, packets per second
+#define TEST_RATE                   1000
+
+//! Burst used by the rate tests
+#define TEST_BURST                  4
+
+//! Jitter used by the ordering test
+#define TEST_JITTER_US              2000
+
+//! \brief Set up a relay that forwards, with no jitter and no rate limit unless given
+static void relay_start(relay_t *relay, uint32_t jitter_us, uint32_t rate, uint16_t burst)
+{
+    const relay_config_t config = {
+        .origin = TEST_ORIGIN,
+        .forward = true,
+        .jitter_us = jitter_us,
+        .rate = rate,
+        .burst = burst,
+        .seed = 1,
+    };
+    relay_init(relay, &config);
+}
+
+//! \brief Pass a packet from the sender to the relay
+static relay_action_t receive(relay_t *relay, uint16_t sequence, uint8_t ttl, int64_t now_us, int64_t *due_us)
+{
+    const espnow_transponder_relay_header_t header = {
+        .origin = TEST_SENDER,
+        .sequence = sequence,
+        .ttl = ttl,
+    };
+    return relay_receive(relay, &header, now_us, due_us);
+}
+
+static void test_duplicates()
+{
+    relay_t relay;
+    int64_t due_us;
+    relay_start(&relay, 0, 0, 0);
+
+    check(receive(&relay, 7, 2, 0, &due_us) == RELAY_FORWARD, "new packet forwarded");
+    check(due_us == 0, "no jitter, due at once");
+    check(receive(&relay, 7, 2, 10, &due_us) == RELAY_DUPLICATE, "copy dropped");
+    check(receive(&relay, 7, 1, 20, &due_us) == RELAY_DUPLICATE, "relayed copy dropped");
+    check(receive(&relay, 8, 2, 30, &due_us) == RELAY_FORWARD, "next sequence forwarded");
+
+    const espnow_transponder_relay_header_t other = { .origin = TEST_SENDER + 1, .sequence = 7, .ttl = 2 };
+    check(relay_receive(&relay, &other, 40, &due_us) == RELAY_FORWARD, "same sequence from another origin");
+    check(relay.duplicates == 2 && relay.forwarded == 3, "duplicate and forward counts");
+
+    // Many packets later, the most recent ones are still remembered
+    for(uint32_t sequence = 100; sequence < 1100; sequence++)
+        receive(&relay, sequence, 2, sequence, &due_us);
+    bool remembered = true;
+    for(uint32_t sequence = 1100 - RELAY_SEEN_WAYS; sequence < 1100; sequence++)
+        remembered &= receive(&relay, sequence, 2, 2000, &due_us) == RELAY_DUPLICATE;
+    check(remembered, "recent packets remembered");
+
+    // Sequence numbers wrap, and the old packet has long been forgotten
+    check(receive(&relay, 7, 2, 3000, &due_us) == RELAY_FORWARD, "old sequence forgotten");
+}
+
+static void test_own_origin()
+{
+    relay_t relay;
+    int64_t due_us;
+    relay_start(&relay, 0, 0, 0);
+
+    const espnow_transponder_relay_header_t own = { .origin = TEST_ORIGIN, .sequence = 1, .ttl = 3 };
+    check(relay_receive(&relay, &own, 0, &due_us) == RELAY_DUPLICATE, "own packet dropped");
+    check(relay_receive(&relay, &own, 10, &due_us) == RELAY_DUPLICATE, "own packet dropped again");
+    check(relay.forwarded == 0, "own packet not forwarded");
+
+    check(relay_origin(0xFFFF) != RELAY_ORIGIN_INVALID && relay_origin(0xFFFF0000) != RELAY_ORIGIN_INVALID,
+          "origin is never invalid");
+}
+
+static void test_ttl()
+{
+    relay_t relay;
+    int64_t due_us;
+    relay_start(&relay, 0, 0, 0);
+
+    check(receive(&relay, 1, 0, 0, &due_us) == RELAY_EXPIRED, "no hops left, expired");
+    check(receive(&relay, 1, 0, 10, &due_us) == RELAY_DUPLICATE, "expired packet remembered");
+    check(relay.expired == 1 && relay.forwarded == 0, "expired count");
+
+    // A node that doesn't relay receives new packets whatever their TTL
+    const relay_config_t config = { .origin = TEST_ORIGIN, .forward = false, .seed = 1 };
+    relay_init(&relay, &config);
+    check(receive(&relay, 1, 3, 0, &due_us) == RELAY_DELIVER, "not relaying, delivered");
+    check(receive(&relay, 2, 0, 0, &due_us) == RELAY_DELIVER, "not relaying, no hops left delivered");
+    check(receive(&relay, 1, 3, 10, &due_us) == RELAY_DUPLICATE, "not relaying, copy dropped");
+
+    // The relayed copy has one hop less, and still checks out
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    const uint8_t payload[] = { 1, 2, 3, 4, 5 };
+    const espnow_transponder_iovec_t part = { payload, sizeof(payload) };
+    const espnow_transponder_relay_header_t header = { .origin = TEST_SENDER, .sequence = 9, .ttl = 2 };
+    const int length = framing_build(packet, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t)
+                                     - sizeof(header), &part, 1, false, ESPNOW_TRANSPONDER_CLASS_REALTIME,
+                                     &header, NULL, NULL);
+    relay_prepare(packet);
+    const espnow_transponder_relay_header_t *prepared = framing_relay_header(packet);
+    check(length > 0 && framing_check(packet, length) == FRAMING_OK, "prepared packet checks out");
+    check(prepared != NULL && prepared->ttl == 1 && prepared->origin == TEST_SENDER && prepared->sequence == 9,
+          "prepared packet has one hop less");
+}
+
+static void test_rate()
+{
+    relay_t relay;
+    int64_t due_us;
+    const int64_t interval_us = 1000000/TEST_RATE;
+    relay_start(&relay, 0, TEST_RATE, TEST_BURST);
+
+    // A full burst at once, then nothing until a token comes back
+    uint16_t sequence = 0;
+    int forwarded = 0;
+    for(int packet = 0; packet < TEST_BURST*2; packet++)
+        forwarded += receive(&relay, sequence++, 1, 0, &due_us) == RELAY_FORWARD;
+    check(forwarded == TEST_BURST, "burst forwarded back to back");
+    check(relay.limited == TEST_BURST, "rest of the burst limited");
+
+    check(receive(&relay, sequence++, 1, interval_us - 1, &due_us) == RELAY_LIMITED, "limited before the interval");
+    check(receive(&relay, sequence++, 1, interval_us, &due_us) == RELAY_FORWARD, "token back after the interval");
+    check(receive(&relay, sequence++, 1, interval_us, &due_us) == RELAY_LIMITED, "only one token back");
+
+    // An idle bucket fills up to the burst, and no further
+    const int64_t idle_us = 1000*interval_us;
+    forwarded = 0;
+    for(int packet = 0; packet < TEST_BURST*2; packet++)
+        forwarded += receive(&relay, sequence++, 1, idle_us, &due_us) == RELAY_FORWARD;
+    check(forwarded == TEST_BURST, "idle bucket refills to the burst");
+
+    // Twice the rate for a second: the rate and the burst get through
+    relay_start(&relay, 0, TEST_RATE, TEST_BURST);
+    forwarded = 0;
+    for(int64_t now_us = 0; now_us < 1000000; now_us += interval_us/2)
+        forwarded += receive(&relay, sequence++, 1, now_us, &due_us) == RELAY_FORWARD;
+    check(forwarded >= TEST_RATE && forwarded <= TEST_RATE + TEST_BURST, "rate limited over a second");
+
+    // Without a limit, everything is forwarded
+    relay_start(&relay, 0, 0, 0);
+    forwarded = 0;
+    for(int packet = 0; packet < 100; packet++)
+        forwarded += receive(&relay, sequence++, 1, 0, &due_us) == RELAY_FORWARD;
+    check(forwarded == 100, "no rate limit");
+}
+
+static void test_order(uint32_t packets)
+{
+    relay_t relay;
+    relay_start(&relay, TEST_JITTER_US, 0, 0);
+
+    int64_t now_us = 0;
+    int64_t last_due_us = 0;
+    bool in_order = true;
+    bool in_window = true;
+    bool jittered = false;
+    for(uint32_t packet = 0; packet < packets; packet++) {
+        // Arrivals from back to back to a few jitters apart
+        now_us += random_next()%(3*TEST_JITTER_US);
+
+        int64_t due_us;
+        if(receive(&relay, packet, 1, now_us, &due_us) != RELAY_FORWARD) {
+            check(false, "ordering packet forwarded");
+            break;
+        }
+
+        const int64_t latest_us = now_us + TEST_JITTER_US > last_due_us ? now_us + TEST_JITTER_US : last_due_us;
+        in_order &= due_us >= last_due_us;
+        in_window &= due_us >= now_us && due_us <= latest_us;
+        jittered |= due_us > now_us && due_us > last_due_us;
+        last_due_us = due_us;
+    }
+    check(in_order, "copies due in order");
+    check(in_window, "copies due within their jitter");
+    check(jittered, "copies jittered");
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t packets = 100000;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--packets") == 0 && arg + 1 < argc)
+            packets = strtoul(argv[++arg], NULL, 0);
+        else {
+            fprintf(stderr, "Usage: %s [--packets N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    test_duplicates();
+    test_own_origin();
+    test_ttl();
+    test_rate();
+    test_order(packets);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
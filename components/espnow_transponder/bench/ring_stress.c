@@ -0,0 +1,277 @@
+//! Event ring stress test
+//!
+//! Runs the event ring between a producer thread, standing in for the WiFi
+//! task's callbacks, and a consumer thread, standing in for the transponder
+//! task, with both overflow policies. Every event carries its sequence
+//! number and check words derived from it, and the consumer checks that
+//! each event it takes is whole, and that events come out in order with
+//! none repeated.
+//!
+//! Two cases are run for each policy:
+//!
+//! * free: the producer pushes bursts of events as fast as it can, and the
+//!   consumer takes them as fast as it can. The rate the consumer takes
+//!   events at is the most the ring can sustain.
+//! * stalled: the consumer sleeps after every few events, as a slow
+//!   rx_callback would make it, so the ring is full most of the time and
+//!   the producer is dropping events. With the drop oldest policy this is
+//!   where the producer and the consumer race for the tail.
+//!
+//! For each case this reports the events pushed and taken per second, the
+//! events dropped, and how long the producer took for a push: the median
+//! and the worst. The producer never waits for the consumer, so a push
+//! takes as long with the consumer stalled as without; the worst case is
+//! the producer being preempted. It fails if an event is torn, out of
+//! order or repeated, or if pushed events aren't all either taken or
+//! dropped.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/ring_stress [--seconds N] [--capacity N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#include "event_ring.h"
+
+//! Check words in each event, so that a torn copy is likely to be seen
+#define STRESS_CHECK_WORDS          7
+
+//! Events the producer pushes between yields
+#define STRESS_BURST                16
+
+//! In the stalled case, the consumer sleeps after this many events
+#define STRESS_STALL_EVENTS         8
+
+//! In the stalled case, the consumer sleeps for this long
+#define STRESS_STALL_US             1000
+
+//! Push times kept for the median
+#define STRESS_SAMPLES              (1 << 20)
+
+typedef struct {
+    uint32_t sequence;
+    uint32_t check[STRESS_CHECK_WORDS];
+} stress_event_t;
+
+typedef enum {
+    CASE_FREE,
+    CASE_STALLED,
+    CASE_COUNT,
+} stress_case_t;
+
+static const char *case_names[CASE_COUNT] = { "free", "stalled" };
+static const char *policy_names[] = {
+    [ESPNOW_TRANSPONDER_DROP_OLDEST] = "drop_oldest",
+    [ESPNOW_TRANSPONDER_DROP_NEWEST] = "drop_newest",
+};
+
+typedef struct {
+    uint64_t pushed;
+    uint64_t taken;
+    uint64_t dropped;                   //!< Events the producer was handed back
+    uint64_t torn;
+    uint64_t out_of_order;              //!< Events that weren't newer than the one before
+    double seconds;
+    double push_median_ns;
+    double push_worst_ns;
+} result_t;
+
+static event_ring_t ring;
+static stress_case_t stress_case;
+static double run_seconds;
+static atomic_bool producer_done;
+static result_t result;
+static uint32_t *push_samples;
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+static void make_event(stress_event_t *event, uint32_t sequence)
+{
+    event->sequence = sequence;
+    for(int word = 0; word < STRESS_CHECK_WORDS; word++)
+        event->check[word] = (sequence + word)*2654435761u;
+}
+
+static bool check_event(const stress_event_t *event)
+{
+    for(int word = 0; word < STRESS_CHECK_WORDS; word++) {
+        if(event->check[word] != (event->sequence + word)*2654435761u)
+            return false;
+    }
+    return true;
+}
+
+static void *producer_task(void *arg)
+{
+    const int64_t end_ns = time_ns() + (int64_t)(run_seconds*1e9);
+    uint32_t sequence = 0;
+    int64_t worst_ns = 0;
+
+    while(time_ns() < end_ns) {
+        for(int burst = 0; burst < STRESS_BURST; burst++) {
+            stress_event_t event;
+            stress_event_t dropped;
+            make_event(&event, sequence);
+
+            const int64_t start_ns = time_ns();
+            const event_ring_result_t pushed = event_ring_push(&ring, &event, &dropped);
+            const int64_t elapsed_ns = time_ns() - start_ns;
+
+            if(pushed != EVENT_RING_PUSHED) {
+                if(!check_event(&dropped))
+                    result.torn++;
+                result.dropped++;
+            }
+
+            push_samples[sequence % STRESS_SAMPLES] = elapsed_ns;
+            if(elapsed_ns > worst_ns)
+                worst_ns = elapsed_ns;
+            sequence++;
+        }
+
+        sched_yield();
+    }
+
+    result.pushed = sequence;
+    result.push_worst_ns = worst_ns;
+    atomic_store(&producer_done, true);
+    return NULL;
+}
+
+static void *consumer_task(void *arg)
+{
+    int64_t last_sequence = -1;
+    uint32_t since_stall = 0;
+
+    while(true) {
+        stress_event_t event;
+        if(!event_ring_pop(&ring, &event)) {
+            if(atomic_load(&producer_done) && event_ring_depth(&ring) == 0)
+                break;
+            sched_yield();
+            continue;
+        }
+
+        if(!check_event(&event))
+            result.torn++;
+        else if((int64_t)event.sequence <= last_sequence)
+            result.out_of_order++;
+        else
+            last_sequence = event.sequence;
+        result.taken++;
+
+        if(stress_case == CASE_STALLED && ++since_stall == STRESS_STALL_EVENTS) {
+            since_stall = 0;
+            const struct timespec stall = { 0, STRESS_STALL_US*1000 };
+            nanosleep(&stall, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    const uint32_t left = *(const uint32_t *)a;
+    const uint32_t right = *(const uint32_t *)b;
+    return left < right ? -1 : left > right;
+}
+
+static bool run(espnow_transponder_overflow_policy_t policy, uint32_t capacity)
+{
+    if(event_ring_init(&ring, sizeof(stress_event_t), capacity, policy) != ESP_OK)
+        return false;
+
+    memset(&result, 0, sizeof(result));
+    atomic_store(&producer_done, false);
+
+    pthread_t producer;
+    pthread_t consumer;
+    const int64_t start_ns = time_ns();
+    if(pthread_create(&consumer, NULL, consumer_task, NULL) != 0
+        || pthread_create(&producer, NULL, producer_task, NULL) != 0)
+        return false;
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    result.seconds = (time_ns() - start_ns)/1e9;
+
+    const uint64_t samples = result.pushed < STRESS_SAMPLES ? result.pushed : STRESS_SAMPLES;
+    qsort(push_samples, samples, sizeof(uint32_t), compare_uint32);
+    result.push_median_ns = samples > 0 ? push_samples[samples/2] : 0;
+
+    free(ring.storage);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    run_seconds = 2;
+    uint32_t capacity = 32;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            run_seconds = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--capacity") == 0 && arg + 1 < argc)
+            capacity = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--capacity N]\n", argv[0]);
+            return 2;
+        }
+    }
+    if(run_seconds <= 0 || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        fprintf(stderr, "The capacity must be a power of two\n");
+        return 2;
+    }
+
+    push_samples = malloc(STRESS_SAMPLES*sizeof(uint32_t));
+    if(push_samples == NULL)
+        return 1;
+
+    bool pass = true;
+    printf("%-12s %-8s %12s %12s %10s %10s %10s\n", "policy", "case", "pushed/s", "taken/s", "dropped",
+           "push ns", "worst ns");
+
+    const espnow_transponder_overflow_policy_t policies[] = { ESPNOW_TRANSPONDER_DROP_NEWEST, ESPNOW_TRANSPONDER_DROP_OLDEST };
+    for(size_t policy = 0; policy < sizeof(policies)/sizeof(policies[0]); policy++) {
+        for(stress_case = 0; stress_case < CASE_COUNT; stress_case++) {
+            if(!run(policies[policy], capacity)) {
+                fprintf(stderr, "Could not run the threads\n");
+                return 1;
+            }
+
+            printf("%-12s %-8s %12.0f %12.0f %10llu %10.0f %10.0f\n", policy_names[policies[policy]],
+                   case_names[stress_case], result.pushed/result.seconds, result.taken/result.seconds,
+                   (unsigned long long)result.dropped, result.push_median_ns, result.push_worst_ns);
+
+            if(result.torn > 0 || result.out_of_order > 0) {
+                printf("FAIL: %llu events torn, %llu out of order\n", (unsigned long long)result.torn,
+                       (unsigned long long)result.out_of_order);
+                pass = false;
+            }
+            if(result.taken + result.dropped != result.pushed) {
+                printf("FAIL: %llu events pushed, but %llu taken and %llu dropped\n",
+                       (unsigned long long)result.pushed, (unsigned long long)result.taken,
+                       (unsigned long long)result.dropped);
+                pass = false;
+            }
+        }
+    }
+
+    free(push_samples);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
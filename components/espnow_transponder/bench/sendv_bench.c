@@ -0,0 +1,381 @@
+//! Scatter-gather send benchmark
+//!
+//! Measures what it costs the sender to hand a frame of full universes to
+//! the transponder, as ARTDMX fragments, three to a 512 slot universe:
+//!
+//! * staged: each fragment is assembled in a stack buffer, header, data
+//!   and timestamp trailer, and sent with espnow_transponder_send(), as
+//!   artdmx did before espnow_transponder_sendv()
+//! * sendv: each fragment is described as three parts, the header, a slice
+//!   of the universe data and the shared trailer, and the fragments are
+//!   sent with espnow_transponder_send_batch() 32 at a time, as artdmx does
+//!   now
+//! * artdmx_send_frame: the same, through artdmx itself
+//!
+//! The transponder is the real one, without pacing, so that every packet is
+//! built and handed to the transport in the call. The transport only counts
+//! the packets; in a separate check pass it also hashes every packet, and
+//! the staged and sendv packets must be identical, CRC included. Sends are
+//! completed between frames, as the radio would complete them later, so
+//! the time per frame, the median of the frames, is the sender's own. The
+//! paths take turns sending each frame.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/sendv_bench [--frames N] [--universes N ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+#include "espnow_transponder.h"
+#include "espnow_transponder_transport.h"
+#include "artdmx.h"
+#include "bench_util.h"
+
+//! Most universe counts to run
+#define BENCH_RUNS_MAX              8
+
+//! Fragments of a 512 slot universe
+#define BENCH_FRAGMENTS             3
+
+//! Fragments handed to the transponder at a time, as artdmx does
+#define BENCH_BATCH_SIZE            32
+
+typedef struct {
+    uint32_t frames;
+    uint16_t universes[BENCH_RUNS_MAX];
+    int runs;
+} bench_options_t;
+
+typedef enum {
+    BENCH_STAGED,
+    BENCH_SENDV,
+    BENCH_ARTDMX,
+    BENCH_PATHS,
+} bench_path_t;
+
+static const char *path_names[BENCH_PATHS] = {
+    [BENCH_STAGED] = "staged",
+    [BENCH_SENDV] = "sendv",
+    [BENCH_ARTDMX] = "artdmx_send_frame",
+};
+
+//! Completion callback of the transponder
+static espnow_transponder_transport_send_cb_t send_callback;
+
+//! Packets and bytes handed to the transport
+static uint64_t sent_packets;
+static uint64_t sent_bytes;
+
+//! Sends not completed yet
+static uint32_t pending_completions;
+
+//! If true, hash every packet handed to the transport
+static bool hashing;
+static uint64_t sent_hash;
+
+//! Universe data of a frame, and its timestamp trailer
+static uint8_t *frame_data;
+static artdmx_timestamp_t frame_trailer;
+
+static esp_err_t counting_init(const espnow_transponder_config_t *config)
+{
+    return ESP_OK;
+}
+
+static esp_err_t counting_register_callbacks(espnow_transponder_transport_recv_cb_t recv_cb,
+                                             espnow_transponder_transport_send_cb_t send_cb)
+{
+    send_callback = send_cb;
+    return ESP_OK;
+}
+
+static esp_err_t counting_send(const uint8_t *data, uint16_t length)
+{
+    sent_packets++;
+    sent_bytes += length;
+
+    // FNV-1a of each packet, folded in order
+    if(hashing) {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for(uint16_t index = 0; index < length; index++)
+            hash = (hash ^ data[index])*0x100000001B3ull;
+        sent_hash = sent_hash*31 + hash;
+    }
+
+    pending_completions++;
+    return ESP_OK;
+}
+
+//! \brief Complete the sends, as the radio would once they are on the air
+static void complete_sends()
+{
+    static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+    for(; pending_completions > 0; pending_completions--) {
+        send_callback(broadcast_mac, true);
+        if(pending_completions%16 == 0)
+            sched_yield();
+    }
+}
+
+//! Transport that counts the packets, and completes them when asked
+static const espnow_transponder_transport_t counting_transport = {
+    .name = "counting",
+    .init = counting_init,
+    .register_callbacks = counting_register_callbacks,
+    .send = counting_send,
+    .set_phy = NULL,
+};
+
+//! \brief Get the header of a fragment
+static artdmx_packet_t fragment_header(uint16_t universe, uint8_t sequence, uint8_t fragment, uint16_t *offset,
+                                       uint16_t *length)
+{
+    const uint16_t fragment_length = (ARTDMX_UNIVERSE_SIZE + BENCH_FRAGMENTS - 1)/BENCH_FRAGMENTS;
+    *offset = fragment*fragment_length;
+    *length = ARTDMX_UNIVERSE_SIZE - *offset < fragment_length ? ARTDMX_UNIVERSE_SIZE - *offset : fragment_length;
+
+    return (artdmx_packet_t){
+        .universe = universe,
+        .sequence = sequence,
+        .type = ARTDMX_TYPE_DATA | ARTDMX_FLAG_TIMESTAMP,
+        .fragment = fragment,
+        .fragment_count = BENCH_FRAGMENTS,
+        .offset = *offset,
+    };
+}
+
+//! \brief Send a frame the way artdmx did before sendv: each fragment assembled, then sent
+static void send_staged(uint16_t universes, uint8_t sequence)
+{
+    for(uint16_t universe = 0; universe < universes; universe++) {
+        const uint8_t *data = frame_data + universe*ARTDMX_UNIVERSE_SIZE;
+
+        for(uint8_t fragment = 0; fragment < BENCH_FRAGMENTS; fragment++) {
+            uint16_t offset;
+            uint16_t length;
+            const artdmx_packet_t header = fragment_header(universe, sequence, fragment, &offset, &length);
+
+            uint8_t packet[sizeof(artdmx_packet_t) + ARTDMX_UNIVERSE_SIZE/BENCH_FRAGMENTS + 1
+                           + sizeof(artdmx_timestamp_t)];
+            memcpy(packet, &header, sizeof(header));
+            memcpy(packet + sizeof(header), data + offset, length);
+            memcpy(packet + sizeof(header) + length, &frame_trailer, sizeof(frame_trailer));
+
+            espnow_transponder_send(packet, sizeof(header) + length + sizeof(frame_trailer));
+        }
+    }
+}
+
+//! \brief Send a frame the way artdmx does now: fragments as parts, in batches
+static void send_parts(uint16_t universes, uint8_t sequence)
+{
+    static uint8_t headers[BENCH_BATCH_SIZE][sizeof(artdmx_packet_t)];
+    static espnow_transponder_iovec_t parts[BENCH_BATCH_SIZE][3];
+    static espnow_transponder_message_t messages[BENCH_BATCH_SIZE];
+    uint16_t count = 0;
+
+    for(uint16_t universe = 0; universe < universes; universe++) {
+        const uint8_t *data = frame_data + universe*ARTDMX_UNIVERSE_SIZE;
+
+        for(uint8_t fragment = 0; fragment < BENCH_FRAGMENTS; fragment++) {
+            uint16_t offset;
+            uint16_t length;
+            const artdmx_packet_t header = fragment_header(universe, sequence, fragment, &offset, &length);
+
+            memcpy(headers[count], &header, sizeof(header));
+            parts[count][0] = (espnow_transponder_iovec_t){ .data = headers[count], .length = sizeof(header) };
+            parts[count][1] = (espnow_transponder_iovec_t){ .data = data + offset, .length = length };
+            parts[count][2] = (espnow_transponder_iovec_t){ .data = &frame_trailer, .length = sizeof(frame_trailer) };
+            messages[count] = (espnow_transponder_message_t){
+                .parts = parts[count],
+                .part_count = 3,
+                .traffic_class = ESPNOW_TRANSPONDER_CLASS_REALTIME,
+            };
+
+            if(++count == BENCH_BATCH_SIZE) {
+                espnow_transponder_send_batch(messages, count);
+                count = 0;
+            }
+        }
+    }
+
+    if(count > 0)
+        espnow_transponder_send_batch(messages, count);
+}
+
+//! \brief Send a frame on one of the paths
+static void send_frame(bench_path_t path, uint16_t universes, uint8_t sequence)
+{
+    switch(path) {
+    case BENCH_STAGED:
+        send_staged(universes, sequence);
+        break;
+    case BENCH_SENDV:
+        send_parts(universes, sequence);
+        break;
+    default:
+        artdmx_send_frame(0, universes, sequence, frame_data, ARTDMX_UNIVERSE_SIZE);
+        break;
+    }
+}
+
+//! \brief Fill the universes with data that changes every frame
+static void fill_frame(uint16_t universes, uint32_t frame)
+{
+    for(uint32_t slot = 0; slot < (uint32_t)universes*ARTDMX_UNIVERSE_SIZE; slot++)
+        frame_data[slot] = (slot*7 + frame*13) & 0xFF;
+    frame_trailer.sent_us = frame*22727;
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+//! \brief Time the frames of every path
+//!
+//! The paths take turns frame by frame, so that a change in the machine's
+//! speed affects them all alike.
+//!
+//! \param median_ns Set to the median time per frame of each path, in nanoseconds
+//! \param packets Set to the packets sent on each path
+//! \param bytes Set to the bytes sent on each path
+static void run_paths(const bench_options_t *options, uint16_t universes, int64_t *median_ns,
+                      uint64_t *packets, uint64_t *bytes)
+{
+    int64_t *times[BENCH_PATHS];
+    for(int path = 0; path < BENCH_PATHS; path++) {
+        times[path] = malloc(sizeof(int64_t)*options->frames);
+        packets[path] = 0;
+        bytes[path] = 0;
+    }
+
+    for(uint32_t frame = 0; frame < options->frames; frame++) {
+        fill_frame(universes, frame);
+
+        for(int path = 0; path < BENCH_PATHS; path++) {
+            sent_packets = 0;
+            sent_bytes = 0;
+
+            const int64_t start_ns = time_ns();
+            send_frame(path, universes, frame);
+            times[path][frame] = time_ns() - start_ns;
+
+            packets[path] += sent_packets;
+            bytes[path] += sent_bytes;
+            complete_sends();
+        }
+    }
+
+    for(int path = 0; path < BENCH_PATHS; path++) {
+        qsort(times[path], options->frames, sizeof(int64_t), compare_int64);
+        median_ns[path] = times[path][options->frames/2];
+        free(times[path]);
+    }
+}
+
+//! \brief Send a few frames on a path with hashing on
+//!
+//! \return Hash of the packets
+static uint64_t hash_path(bench_path_t path, uint16_t universes)
+{
+    hashing = true;
+    sent_hash = 0;
+    for(uint32_t frame = 0; frame < 4; frame++) {
+        fill_frame(universes, frame);
+        send_frame(path, universes, frame);
+        complete_sends();
+    }
+    hashing = false;
+
+    return sent_hash;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options_t options = {
+        .frames = 2000,
+        .universes = {20, 32, 64},
+        .runs = 3,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc)
+            options.frames = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc) {
+            options.runs = 0;
+            while(arg + 1 < argc && argv[arg + 1][0] != '-' && options.runs < BENCH_RUNS_MAX)
+                options.universes[options.runs++] = atoi(argv[++arg]);
+        }
+        else
+            options.frames = 0, arg = argc;
+    }
+
+    uint16_t universes_max = 0;
+    for(int run = 0; run < options.runs; run++)
+        if(options.universes[run] > universes_max)
+            universes_max = options.universes[run];
+
+    if(options.frames == 0 || options.runs == 0 || universes_max == 0 || universes_max > 255) {
+        fprintf(stderr, "Usage: %s [--frames N] [--universes N ...]\n", argv[0]);
+        return 2;
+    }
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.transport = &counting_transport;
+    transponder_config.trace_records = 0;
+    if(espnow_transponder_init(&transponder_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the transponder\n");
+        return 1;
+    }
+
+    // Full frames every time, with the frame's timestamp
+    const artdmx_sender_config_t sender_config = {
+        .universe_count = 0,
+        .keyframe_interval = 0,
+        .timestamps = true,
+    };
+    frame_data = malloc((size_t)universes_max*ARTDMX_UNIVERSE_SIZE);
+    if(artdmx_sender_init(&sender_config) != ESP_OK || frame_data == NULL) {
+        fprintf(stderr, "Could not start the sender\n");
+        return 1;
+    }
+
+    printf("%u frames of 512 slot universes, %u fragments each, median time per frame\n",
+           options.frames, BENCH_FRAGMENTS);
+    printf("%-10s %12s %12s %18s %12s\n", "universes", path_names[BENCH_STAGED], path_names[BENCH_SENDV],
+           path_names[BENCH_ARTDMX], "saved");
+
+    for(int run = 0; run < options.runs; run++) {
+        const uint16_t universes = options.universes[run];
+
+        int64_t median_ns[BENCH_PATHS];
+        uint64_t packets[BENCH_PATHS];
+        uint64_t bytes[BENCH_PATHS];
+        run_paths(&options, universes, median_ns, packets, bytes);
+
+        printf("%-10u %9.1f us %9.1f us %15.1f us %10.1f%%\n", universes, median_ns[BENCH_STAGED]/1e3,
+               median_ns[BENCH_SENDV]/1e3, median_ns[BENCH_ARTDMX]/1e3,
+               100.0*(median_ns[BENCH_STAGED] - median_ns[BENCH_SENDV])/median_ns[BENCH_STAGED]);
+
+        const uint64_t expected = (uint64_t)options.frames*universes*BENCH_FRAGMENTS;
+        check(packets[BENCH_STAGED] == expected && packets[BENCH_SENDV] == expected
+              && packets[BENCH_ARTDMX] == expected, "every fragment is sent on every path");
+        check(bytes[BENCH_STAGED] == bytes[BENCH_SENDV] && bytes[BENCH_SENDV] == bytes[BENCH_ARTDMX],
+              "the same bytes go on the air on every path");
+        check(hash_path(BENCH_STAGED, universes) == hash_path(BENCH_SENDV, universes),
+              "staged and sendv packets are identical");
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
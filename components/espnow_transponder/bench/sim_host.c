@@ -0,0 +1,88 @@
+#include <time.h>
+#include <pthread.h>
+
+#include "esp_timer.h"
+#include "transport_sim.h"
+
+#include "sim_host.h"
+
+static sim_air_t air;
+
+//! Guards the medium
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+//! Signalled when the medium may have an earlier event than the driver is waiting for
+static pthread_cond_t changed;
+
+static pthread_t driver_thread;
+
+//! \brief Keep the medium running in real time
+static void *driver(void *arg)
+{
+    pthread_mutex_lock(&lock);
+    while(true) {
+        const int64_t now_us = esp_timer_get_time();
+        sim_air_run_until(&air, now_us);
+
+        const int64_t next_us = sim_air_next_event(&air);
+        if(next_us < 0) {
+            pthread_cond_wait(&changed, &lock);
+            continue;
+        }
+
+        // esp_timer_get_time() counts from an arbitrary start, so wait relative to now
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        const int64_t ns = deadline.tv_nsec + (next_us - now_us)*1000;
+        deadline.tv_sec += ns/1000000000;
+        deadline.tv_nsec = ns % 1000000000;
+        pthread_cond_timedwait(&changed, &lock, &deadline);
+    }
+    return NULL;
+}
+
+static void transport_lock(void *context)
+{
+    sim_host_lock();
+}
+
+static void transport_unlock(void *context)
+{
+    sim_host_unlock();
+}
+
+bool sim_host_start(const sim_air_config_t *config, uint8_t node)
+{
+    if(!sim_air_init(&air, config))
+        return false;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changed, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // Simulation time follows the transponder's clock
+    sim_air_run_until(&air, esp_timer_get_time());
+
+    transport_sim_bind(&air, node);
+    transport_sim_set_lock(transport_lock, transport_unlock, NULL);
+
+    return pthread_create(&driver_thread, NULL, driver, NULL) == 0;
+}
+
+sim_air_t *sim_host_lock()
+{
+    pthread_mutex_lock(&lock);
+
+    const int64_t now_us = esp_timer_get_time();
+    if(now_us > air.now_us)
+        sim_air_run_until(&air, now_us);
+    return &air;
+}
+
+void sim_host_unlock()
+{
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+//! Runs the transponder on the host, attached to a simulated medium
+//!
+//! The transponder's tasks and timers are threads (see stubs/host_rtos.c),
+//! so the medium is driven in real time: a thread of its own runs it up to
+//! esp_timer_get_time() whenever an event is due, and the transport runs it
+//! up to the current time before every send, so that packets go on the air
+//! when they are sent. A mutex serializes all of it, and is held while the
+//! node callbacks run.
+//!
+//! This is plain C, and is not built into the firmware.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "sim_air.h"
+
+//! \brief Create the medium and start driving it
+//!
+//! This binds espnow_transponder_transport_sim to a node of the medium, so
+//! it has to be called before espnow_transponder_init().
+//!
+//! \param config Medium parameters
+//! \param node Node number of the transponder
+//! \return True if successful
+bool sim_host_start(const sim_air_config_t *config, uint8_t node);
+
+//! \brief Take the lock, and run the medium up to the current time
+//!
+//! Hold the lock while calling into the medium from outside of the node
+//! callbacks, for example to send from another node or to read statistics.
+//!
+//! \return Medium
+sim_air_t *sim_host_lock();
+
+//! \brief Release the lock taken with sim_host_lock()
+void sim_host_unlock();
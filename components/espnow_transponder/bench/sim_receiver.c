@@ -0,0 +1,230 @@
+//! Receiver role on the simulated medium
+//!
+//! Runs the receiver role of the example, with the real transponder, on the
+//! host. The packets come from a file written by sim_sender --out, normally
+//! a pipe, and are sent as they are read by node 0 of a simulated medium,
+//! with the loss, burst loss, latency and jitter given. The transponder is
+//! node 1, subscribed to the universes, and passes what it receives to the
+//! ARTDMX receiver, which records every frame in telemetry.
+//!
+//!     build/bench/sim_sender --seconds 5 --out - | build/bench/sim_receiver --in - --loss 0.05
+//!
+//! Once the input ends, it reports the packets read and lost on the way,
+//! the packets the transponder received and FEC rebuilt or couldn't, and,
+//! over all universes, the frames received, lost and reordered, the frame
+//! loss after FEC and the worst 99th percentile jitter. It fails if no
+//! frames arrived, or if the frame loss after FEC is above --max-loss.
+//! Latency isn't reported, as the sender's clock isn't this one.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/sim_receiver --in FILE [--universes N] [--loss P] [--burst P N] [--latency US]
+//!                              [--jitter US] [--seed N] [--max-loss P]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_timer.h"
+
+#include "espnow_transponder.h"
+#include "transport_sim.h"
+#include "artdmx.h"
+#include "telemetry.h"
+#include "sim_host.h"
+
+#define SIM_SENDER                  0
+#define SIM_RECEIVER                1
+
+//! Time allowed for the last packets to be received, after the input ends
+#define SIM_DRAIN_US                200000
+
+typedef struct {
+    const char *in;
+    uint16_t universes;
+    float loss;
+    float burst_enter;                  //!< Probability of a burst starting, per packet
+    uint32_t burst_length;              //!< Average packets lost in a burst
+    uint32_t latency_us;
+    uint32_t jitter_us;
+    uint32_t seed;
+    double max_loss;                    //!< Highest frame loss after FEC that passes
+} sim_options_t;
+
+static telemetry_t telemetry;
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+static void receive_frame(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .in = NULL,
+        .universes = 20,
+        .loss = 0,
+        .burst_enter = 0,
+        .burst_length = 1,
+        .latency_us = 100,
+        .jitter_us = 0,
+        .seed = 1,
+        .max_loss = 0.01,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--in") == 0 && arg + 1 < argc)
+            options.in = argv[++arg];
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--loss") == 0 && arg + 1 < argc)
+            options.loss = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--burst") == 0 && arg + 2 < argc) {
+            options.burst_enter = atof(argv[++arg]);
+            options.burst_length = atoi(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--latency") == 0 && arg + 1 < argc)
+            options.latency_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--jitter") == 0 && arg + 1 < argc)
+            options.jitter_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && arg + 1 < argc)
+            options.seed = strtoul(argv[++arg], NULL, 0);
+        else if(strcmp(argv[arg], "--max-loss") == 0 && arg + 1 < argc)
+            options.max_loss = atof(argv[++arg]);
+        else
+            options.in = NULL, arg = argc;
+    }
+
+    if(options.in == NULL || options.universes == 0 || options.burst_length == 0 || options.seed == 0) {
+        fprintf(stderr, "Usage: %s --in FILE [--universes N] [--loss P] [--burst P N] [--latency US]\n"
+                        "       [--jitter US] [--seed N] [--max-loss P]\n", argv[0]);
+        return 2;
+    }
+
+    FILE *in = strcmp(options.in, "-") == 0 ? stdin : fopen(options.in, "rb");
+    if(in == NULL) {
+        perror(options.in);
+        return 1;
+    }
+
+    if(!telemetry_init(&telemetry, options.universes))
+        return 1;
+
+    const artdmx_receiver_config_t artdmx_config = {
+        .universe_count = options.universes,
+        .partial_policy = ARTDMX_PARTIAL_HOLD,
+        .callback = receive_frame,
+        .telemetry = &telemetry,
+    };
+    artdmx_receiver_init(&artdmx_config);
+
+    const sim_air_config_t air_config = {
+        .node_count = 2,
+        .phy_rate = espnow_transponder_config_default.phy_rate,
+        .loss = options.loss,
+        .burst_loss = 1,
+        .burst_enter = options.burst_enter,
+        .burst_exit = 1.0f/options.burst_length,
+        .latency_us = options.latency_us,
+        .jitter_us = options.jitter_us,
+        .queue_size = 1024,
+        .seed = options.seed,
+    };
+    if(!sim_host_start(&air_config, SIM_RECEIVER)) {
+        fprintf(stderr, "Could not start the simulated medium\n");
+        return 1;
+    }
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.transport = &espnow_transponder_transport_sim;
+    if(espnow_transponder_init(&transponder_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the transponder\n");
+        return 1;
+    }
+    espnow_transponder_register_callback(artdmx_receive);
+
+    for(int universe = 0; universe < options.universes; universe++)
+        espnow_transponder_subscribe(universe);
+    espnow_transponder_subscribe(ARTDMX_SYNC_UNIVERSE);
+
+    uint64_t packets = 0;
+    uint64_t rejected = 0;
+    uint8_t header[2];
+    uint8_t packet[SIM_AIR_MAX_PACKET];
+    while(fread(header, 1, sizeof(header), in) == sizeof(header)) {
+        const uint16_t length = header[0] | header[1] << 8;
+        if(length > sizeof(packet) || fread(packet, 1, length, in) != length) {
+            fprintf(stderr, "Truncated input\n");
+            return 1;
+        }
+
+        sim_air_t *air = sim_host_lock();
+        if(!sim_air_send(air, SIM_SENDER, packet, length))
+            rejected++;
+        sim_host_unlock();
+        packets++;
+    }
+    sleep_until_us(time_us() + SIM_DRAIN_US);
+
+    sim_air_t *air = sim_host_lock();
+    const sim_air_node_stats_t receiver = air->nodes[SIM_RECEIVER].stats;
+    sim_host_unlock();
+
+    espnow_transponder_stats_t stats;
+    espnow_transponder_get_statistics(&stats);
+
+    uint64_t frames = 0;
+    uint64_t lost = 0;
+    uint64_t reordered = 0;
+    uint32_t jitter_p99_us = 0;
+    for(int universe = 0; universe < options.universes; universe++) {
+        telemetry_report_t report;
+        if(!telemetry_report(&telemetry, universe, &report))
+            continue;
+        frames += report.frames;
+        lost += report.lost;
+        reordered += report.reordered;
+        if(report.jitter_us.p99 > jitter_p99_us)
+            jitter_p99_us = report.jitter_us.p99;
+    }
+
+    const double frame_loss = frames + lost > 0 ? (double)lost/(frames + lost) : 1;
+    const bool pass = frames > 0 && frame_loss <= options.max_loss;
+
+    printf("%-22s %llu, %llu rejected\n", "packets read", (unsigned long long)packets,
+           (unsigned long long)rejected);
+    printf("%-22s %llu (%.2f%%)\n", "lost on the air", (unsigned long long)receiver.rx_lost,
+           packets > 0 ? 100.0*receiver.rx_lost/packets : 0);
+    printf("%-22s %llu\n", "received", (unsigned long long)stats.rx_count);
+    printf("%-22s %llu\n", "fec recovered", (unsigned long long)stats.rx_fec_recovered);
+    printf("%-22s %llu\n", "fec unrecoverable", (unsigned long long)stats.rx_fec_unrecoverable);
+    printf("%-22s %llu\n", "universe frames", (unsigned long long)frames);
+    printf("%-22s %llu\n", "frames lost", (unsigned long long)lost);
+    printf("%-22s %llu\n", "frames reordered", (unsigned long long)reordered);
+    printf("%-22s %.3f%%, at most %.3f%%\n", "loss after fec", 100*frame_loss, 100*options.max_loss);
+    printf("%-22s %uus\n", "jitter p99", jitter_p99_us);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
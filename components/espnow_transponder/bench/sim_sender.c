@@ -0,0 +1,262 @@
+//! Sender role on the simulated medium
+//!
+//! Runs the sender role of the example, with the real transponder, on the
+//! host: a pattern is rendered into every universe at the frame rate and
+//! sent with artdmx_send_frame(), with compression, pacing, FEC and frame
+//! commits as in the example. The transponder is node 0 of a simulated medium, driven in
+//! real time by sim_host.c, and node 1 listens to what it puts on the air.
+//! Rate control is off, as nothing answers with loss reports.
+//!
+//! It reports the frames sent and the frame rate the pacer measured, the
+//! packets and payload bytes handed to the medium each second, the share of
+//! the airtime they used, and the parity packets and send failures. It
+//! fails if a frame couldn't be sent, the transponder dropped or failed to
+//! send a packet, a packet didn't reach the listener, or a packet of a
+//! class other than realtime, such as a frame commit, carried FEC.
+//!
+//! With --out, every packet the listener receives is written out, as a
+//! 16-bit little-endian length followed by the packet, as it arrives.
+//! sim_receiver reads that, so the two can be piped together to run a
+//! sender and a receiver, each with a transponder of its own:
+//!
+//!     build/bench/sim_sender --seconds 5 --out - | build/bench/sim_receiver --in - --loss 0.05
+//!
+//! The report then goes to stderr.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/sim_sender [--seconds N] [--universes N] [--fps N] [--fec K M] [--rate N] [--out FILE]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "esp_wifi_internal.h"
+
+#include "espnow_transponder.h"
+#include "packet.h"
+#include "transport_sim.h"
+#include "artdmx.h"
+#include "pattern.h"
+#include "sim_host.h"
+
+#define SIM_SENDER                  0
+#define SIM_LISTENER                1
+
+//! Time allowed for the last frame to go out, after it is sent
+#define SIM_DRAIN_US                200000
+
+//! Presentation delay of the frame commits, as in the example
+#define SIM_SYNC_DELAY_US           50000
+
+typedef struct {
+    uint32_t seconds;
+    uint16_t universes;
+    uint16_t fps;
+    uint8_t fec_k;
+    uint8_t fec_m;
+    uint8_t phy_rate;
+    const char *out;
+} sim_options_t;
+
+//! Packets written out, or NULL
+static FILE *out = NULL;
+
+//! Packets the listener received, guarded by the sim_host lock
+static uint64_t listener_packets = 0;
+
+//! Of those, packets outside the realtime class that carried FEC
+static uint64_t listener_fec_other = 0;
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+static void listener_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    listener_packets++;
+
+    // Parity is sent in the realtime class, so only realtime packets may be in a group
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(length >= sizeof(espnow_transponder_packet_t) && (packet->flags & ESPNOW_TRANSPONDER_FLAG_FEC)
+        && ESPNOW_TRANSPONDER_PACKET_CLASS(packet->flags) != ESPNOW_TRANSPONDER_CLASS_REALTIME)
+        listener_fec_other++;
+
+    if(out == NULL)
+        return;
+
+    const uint8_t header[2] = { length & 0xFF, length >> 8 };
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(data, 1, length, out);
+    fflush(out);
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .seconds = 5,
+        .universes = 20,
+        .fps = 44,
+        .fec_k = 10,
+        .fec_m = 2,
+        .phy_rate = espnow_transponder_config_default.phy_rate,
+        .out = NULL,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && arg + 1 < argc)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fps") == 0 && arg + 1 < argc)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fec") == 0 && arg + 2 < argc) {
+            options.fec_k = atoi(argv[++arg]);
+            options.fec_m = atoi(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--rate") == 0 && arg + 1 < argc)
+            options.phy_rate = strtol(argv[++arg], NULL, 0);
+        else if(strcmp(argv[arg], "--out") == 0 && arg + 1 < argc)
+            options.out = argv[++arg];
+        else {
+            fprintf(stderr, "Usage: %s [--seconds N] [--universes N] [--fps N] [--fec K M] [--rate N] [--out FILE]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    if(options.universes == 0 || options.fps == 0) {
+        fprintf(stderr, "--universes and --fps must be non-zero\n");
+        return 2;
+    }
+
+    FILE *report = stdout;
+    if(options.out != NULL) {
+        if(strcmp(options.out, "-") == 0) {
+            out = stdout;
+            report = stderr;
+        }
+        else if((out = fopen(options.out, "wb")) == NULL) {
+            perror(options.out);
+            return 1;
+        }
+    }
+
+    const sim_air_config_t air_config = {
+        .node_count = 2,
+        .phy_rate = options.phy_rate,
+        .queue_size = 1024,
+        .seed = 1,
+    };
+    if(!sim_host_start(&air_config, SIM_SENDER)) {
+        fprintf(stderr, "Could not start the simulated medium\n");
+        return 1;
+    }
+    sim_air_t *air = sim_host_lock();
+    sim_air_attach(air, SIM_LISTENER, listener_recv, NULL, NULL);
+    sim_host_unlock();
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.transport = &espnow_transponder_transport_sim;
+    transponder_config.phy_rate = options.phy_rate;
+    transponder_config.compression = true;
+    transponder_config.tx_framerate = options.fps;
+    transponder_config.fec_k = options.fec_k;
+    transponder_config.fec_m = options.fec_m;
+    if(espnow_transponder_init(&transponder_config) != ESP_OK) {
+        fprintf(stderr, "Could not start the transponder\n");
+        return 1;
+    }
+
+    const artdmx_sender_config_t artdmx_config = {
+        .universe_count = options.universes,
+        .keyframe_interval = options.fps,
+        .timestamps = true,
+        .sync_delay_us = SIM_SYNC_DELAY_US,
+    };
+    artdmx_sender_init(&artdmx_config);
+
+    // Red sine wave running along the strip, as in the example
+    const pattern_t pattern = {
+        .effect = PATTERN_FADE,
+        .color = { 60, 0, 0 },
+        .brightness = 255,
+        .speed = PATTERN_CYCLE/32,
+        .scale = PATTERN_CYCLE/628,
+    };
+    pattern_init();
+
+    uint8_t *buffer = malloc(ARTDMX_UNIVERSE_SIZE*options.universes);
+    if(buffer == NULL)
+        return 1;
+
+    const uint32_t frames = options.seconds*options.fps;
+    const int64_t period_us = 1000000/options.fps;
+    uint32_t send_errors = 0;
+    espnow_transponder_scheduler_status_t status = { 0 };
+
+    const int64_t start_us = time_us();
+    for(uint32_t frame = 0; frame < frames; frame++) {
+        pattern_render(&pattern, frame, buffer, options.universes, ARTDMX_UNIVERSE_SIZE);
+        if(artdmx_send_frame(0, options.universes, frame, buffer, ARTDMX_UNIVERSE_SIZE) != ESP_OK)
+            send_errors++;
+        espnow_transponder_frame_end();
+
+        // The pacer's frame rate estimate is read while frames are still coming
+        if(frame == frames - 1)
+            espnow_transponder_get_scheduler_status(&status);
+
+        sleep_until_us(start_us + (frame + 1)*period_us);
+    }
+    const double seconds = (time_us() - start_us)/1e6;
+    sleep_until_us(time_us() + SIM_DRAIN_US);
+
+    espnow_transponder_stats_t stats;
+    espnow_transponder_get_statistics(&stats);
+
+    air = sim_host_lock();
+    const sim_air_node_stats_t sender = air->nodes[SIM_SENDER].stats;
+    const uint64_t received = listener_packets;
+    const uint64_t fec_other = listener_fec_other;
+    sim_host_unlock();
+
+    if(out != NULL)
+        fflush(out);
+
+    const bool delivered = received == sender.tx_packets && sender.tx_packets == stats.tx_count;
+    const bool pass = send_errors == 0 && stats.tx_send_fail == 0 && stats.tx_queue_full == 0 && delivered
+        && fec_other == 0;
+
+    fprintf(report, "%-22s %u x %u universes, %u failed\n", "frames", frames, options.universes, send_errors);
+    fprintf(report, "%-22s %.1f\n", "pacer fps", status.fps);
+    fprintf(report, "%-22s %.0f\n", "packets/s", sender.tx_packets/seconds);
+    fprintf(report, "%-22s %.1f\n", "payload kB/s", stats.tx_bytes/seconds/1e3);
+    fprintf(report, "%-22s %.1f%%\n", "airtime", 100.0*sender.airtime_us/(seconds*1e6));
+    fprintf(report, "%-22s %llu\n", "fec parity", (unsigned long long)stats.tx_fec_parity);
+    fprintf(report, "%-22s %llu\n", "fec outside realtime", (unsigned long long)fec_other);
+    fprintf(report, "%-22s %llu\n", "send fail", (unsigned long long)stats.tx_send_fail);
+    fprintf(report, "%-22s %llu\n", "queue full", (unsigned long long)stats.tx_queue_full);
+    fprintf(report, "%-22s %llu of %llu\n", "delivered", (unsigned long long)received,
+            (unsigned long long)stats.tx_count);
+    fprintf(report, "%s\n", pass ? "PASS" : "FAIL");
+
+    return pass ? 0 : 1;
+}
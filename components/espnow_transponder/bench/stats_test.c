@@ -0,0 +1,329 @@
+//! Statistics block tests
+//!
+//! Checks stats.c, the sequence locked statistics blocks:
+//!
+//! * on one thread: reading a block, stats_sum(), stats_rates() and the
+//!   binary export, which is decoded again and compared
+//! * with several writer threads, each owning its own block as the
+//!   transponder's contexts do, and a checking reader: every update changes
+//!   every counter of the block, and the counters are set so that any
+//!   snapshot mixing two updates is inconsistent. The values cross the
+//!   32-bit boundary on every update, so a 64-bit counter read in two
+//!   halves would show too. Each snapshot the reader gets must be
+//!   consistent, and no block's update count may go backwards. Once the
+//!   writers stop, every block must read back its final count.
+//!
+//! A writer gives up the CPU in the middle of some updates, so that the
+//! reader runs while a block is half written, even with a single core, and
+//! between some others, so that it also finds blocks it can read. The
+//! reader counts the reads that gave up, which is allowed, but never takes
+//! a snapshot from them; like the transponder, it lets the writer run and
+//! tries again.
+//!
+//! On a single core the reader can only see a block change under it if it
+//! is preempted in the middle of a copy. That happens most with one writer,
+//! where the reader runs the longest between yields, so the test is also
+//! run that way.
+//!
+//! It then times an update and a read on one thread.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/stats_test [--seconds N] [--writers N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "stats.h"
+#include "bench_util.h"
+
+#define STATS_COUNTERS (sizeof(espnow_transponder_stats_t)/sizeof(uint64_t))
+
+//! Most writer threads
+#define TEST_WRITERS_MAX            16
+
+//! A writer gives up the CPU halfway through one update in this many, and
+//! between two updates in as many
+#define TEST_YIELD_INTERVAL         64
+
+//! Counter values of a block after n updates are TEST_START + n*TEST_STEP*(field + 1),
+//! which starts just below 2^32 and moves the upper half on nearly every update
+#define TEST_START                  0xFFFFFF00ull
+#define TEST_STEP                   0x40000001ull
+
+typedef struct {
+    double seconds;
+    int writers;
+} test_options_t;
+
+static stats_block_t blocks[TEST_WRITERS_MAX];
+
+//! Updates made to each block, only written by its writer
+static uint64_t writer_updates[TEST_WRITERS_MAX];
+
+//! Set to stop the writers
+static atomic_bool writers_stop;
+
+//! \brief Get the value of a counter after some number of updates
+static uint64_t counter_value(uint64_t updates, int field)
+{
+    return TEST_START + updates*TEST_STEP*(field + 1);
+}
+
+//! \brief Check that a snapshot is all from one update, and get the update count
+//!
+//! \return true if the snapshot is consistent
+static bool snapshot_consistent(const espnow_transponder_stats_t *counters, uint64_t *updates)
+{
+    const uint64_t *fields = (const uint64_t *)counters;
+    if(fields[0] < TEST_START || (fields[0] - TEST_START)%TEST_STEP != 0)
+        return false;
+
+    *updates = (fields[0] - TEST_START)/TEST_STEP;
+    for(int field = 1; field < STATS_COUNTERS; field++)
+        if(fields[field] != counter_value(*updates, field))
+            return false;
+
+    return true;
+}
+
+//! \brief Set every counter of a block for some number of updates
+static void block_fill(stats_block_t *block, uint64_t updates)
+{
+    uint64_t *fields = (uint64_t *)&block->counters;
+    for(int field = 0; field < STATS_COUNTERS; field++)
+        fields[field] = counter_value(updates, field);
+}
+
+static void test_single_thread()
+{
+    stats_block_t block = {0};
+    espnow_transponder_stats_t counters;
+    check(stats_block_read(&block, &counters) && counters.rx_count == 0, "read an empty block");
+
+    STATS_ADD(&block, rx_count, 3);
+    STATS_ADD(&block, rx_count, 4);
+    STATS_SET(&block, tx_count, 1ull << 40);
+    check(stats_block_read(&block, &counters) && counters.rx_count == 7 && counters.tx_count == 1ull << 40,
+          "read after STATS_ADD and STATS_SET");
+    check(atomic_load(&block.sequence) == 6, "every update leaves the sequence even");
+
+    // A reader gives up on a block that is being updated
+    stats_write_begin(&block);
+    check(!stats_block_read(&block, &counters), "read gives up during an update");
+    stats_write_end(&block);
+
+    espnow_transponder_stats_t total = {0};
+    stats_sum(&total, &counters);
+    stats_sum(&total, &counters);
+    check(total.rx_count == 14 && total.tx_count == 2ull << 40, "sum");
+
+    espnow_transponder_stats_t previous = {0};
+    espnow_transponder_stats_t current = {0};
+    espnow_transponder_stats_t rates;
+    current.rx_count = 1000;
+    current.tx_count = 1;
+    previous.rx_bytes = 5;
+    current.rx_bytes = 5;
+    stats_rates(&rates, &current, &previous, 500000);
+    check(rates.rx_count == 2000 && rates.tx_count == 2 && rates.rx_bytes == 0, "rates over half a second");
+    stats_rates(&rates, &current, &previous, 3000000);
+    check(rates.rx_count == 333 && rates.tx_count == 0, "rates round to the nearest count");
+    stats_rates(&rates, &current, &previous, 0);
+    check(rates.rx_count == 0, "an empty window has no rate");
+
+    espnow_transponder_snapshot_t snapshot = {.time_us = 123456789};
+    uint64_t *totals = (uint64_t *)&snapshot.totals;
+    uint64_t *per_second = (uint64_t *)&snapshot.per_second;
+    for(int field = 0; field < STATS_COUNTERS; field++) {
+        totals[field] = counter_value(field, field);
+        per_second[field] = field*field;
+    }
+    totals[1] = UINT64_MAX;
+
+    uint8_t buffer[ESPNOW_TRANSPONDER_EXPORT_MAX_LENGTH];
+    const int length = stats_export(&snapshot, buffer, sizeof(buffer));
+    check(length > 4 && buffer[0] == STATS_EXPORT_MAGIC_0 && buffer[1] == STATS_EXPORT_MAGIC_1
+          && buffer[2] == STATS_EXPORT_VERSION && buffer[3] == STATS_COUNTERS, "export header");
+
+    // Decode the varints: the time, then the totals, then the rates
+    uint64_t values[1 + 2*STATS_COUNTERS];
+    int count = 0;
+    int position = 4;
+    while(position < length && count < sizeof(values)/sizeof(values[0])) {
+        uint64_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = buffer[position++];
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while((byte & 0x80) && position < length);
+        values[count++] = value;
+    }
+
+    bool decoded = count == 1 + 2*STATS_COUNTERS && position == length && values[0] == snapshot.time_us;
+    for(int field = 0; field < STATS_COUNTERS && decoded; field++)
+        decoded = values[1 + field] == totals[field] && values[1 + STATS_COUNTERS + field] == per_second[field];
+    check(decoded, "export decodes to the snapshot");
+    check(stats_export(&snapshot, buffer, length - 1) == -1, "export into a short buffer fails");
+    check(stats_export(&snapshot, buffer, 3) == -1, "export into a buffer without room for the header fails");
+}
+
+static void *writer(void *context)
+{
+    const int index = (int)(intptr_t)context;
+    stats_block_t *block = &blocks[index];
+
+    uint64_t updates = 0;
+    while(!atomic_load_explicit(&writers_stop, memory_order_relaxed)) {
+        updates++;
+
+        stats_write_begin(block);
+        uint64_t *fields = (uint64_t *)&block->counters;
+        for(int field = 0; field < STATS_COUNTERS; field++) {
+            fields[field] = counter_value(updates, field);
+            if(updates%TEST_YIELD_INTERVAL == 0 && field == STATS_COUNTERS/2)
+                sched_yield();
+        }
+        stats_write_end(block);
+
+        // And between updates in as many, so that the reader also finds blocks it can read
+        if(updates%TEST_YIELD_INTERVAL == TEST_YIELD_INTERVAL/2)
+            sched_yield();
+    }
+
+    writer_updates[index] = updates;
+    return NULL;
+}
+
+static void test_writers(const test_options_t *options)
+{
+    for(int index = 0; index < options->writers; index++) {
+        atomic_store(&blocks[index].sequence, 0);
+        block_fill(&blocks[index], 0);
+    }
+
+    atomic_store(&writers_stop, false);
+    pthread_t threads[TEST_WRITERS_MAX];
+    for(int index = 0; index < options->writers; index++)
+        pthread_create(&threads[index], NULL, writer, (void *)(intptr_t)index);
+
+    uint64_t last[TEST_WRITERS_MAX] = {0};
+    uint64_t reads = 0;
+    uint64_t gave_up = 0;
+    uint32_t inconsistent = 0;
+    uint32_t backwards = 0;
+    uint32_t moved = 0;
+
+    const int64_t end_ns = time_ns() + (int64_t)(options->seconds*1e9);
+    while(time_ns() < end_ns) {
+        for(int index = 0; index < options->writers; index++) {
+            espnow_transponder_stats_t counters;
+            reads++;
+            // Like stats_read() in the transponder, let a preempted writer finish
+            while(!stats_block_read(&blocks[index], &counters)) {
+                gave_up++;
+                sched_yield();
+            }
+
+            uint64_t updates;
+            if(!snapshot_consistent(&counters, &updates)) {
+                inconsistent++;
+                continue;
+            }
+
+            backwards += updates < last[index];
+            moved += updates > last[index];
+            last[index] = updates;
+        }
+    }
+
+    atomic_store(&writers_stop, true);
+    for(int index = 0; index < options->writers; index++)
+        pthread_join(threads[index], NULL);
+
+    // With the writers stopped, every read succeeds, and the totals add up
+    bool final = true;
+    uint64_t total_updates = 0;
+    espnow_transponder_stats_t total = {0};
+    for(int index = 0; index < options->writers; index++) {
+        espnow_transponder_stats_t counters;
+        uint64_t updates;
+        final &= stats_block_read(&blocks[index], &counters) && snapshot_consistent(&counters, &updates)
+            && updates == writer_updates[index];
+        stats_sum(&total, &counters);
+        total_updates += writer_updates[index];
+    }
+    const uint64_t *total_fields = (const uint64_t *)&total;
+    const uint64_t expected = options->writers*TEST_START + total_updates*TEST_STEP*STATS_COUNTERS;
+
+    printf("%-22s %d writers, %llu updates, %llu reads, %llu gave up\n", "writer test", options->writers,
+           (unsigned long long)total_updates, (unsigned long long)reads, (unsigned long long)gave_up);
+    check(inconsistent == 0, "no inconsistent snapshots");
+    check(backwards == 0, "update counts never go backwards");
+    check(final, "every block reads back its final count");
+    check(total_fields[STATS_COUNTERS - 1] == expected, "blocks sum to the total");
+    check(moved > (uint32_t)options->writers, "the reader saw updates while the writers were running");
+}
+
+static void run_timing()
+{
+    stats_block_t block = {0};
+    const uint32_t rounds = 10000000;
+
+    int64_t start_ns = time_ns();
+    for(uint32_t round = 0; round < rounds; round++)
+        STATS_ADD(&block, rx_count, 1);
+    const double add_ns = (double)(time_ns() - start_ns)/rounds;
+
+    uint64_t checksum = 0;
+    start_ns = time_ns();
+    for(uint32_t round = 0; round < rounds/10; round++) {
+        espnow_transponder_stats_t counters;
+        stats_block_read(&block, &counters);
+        checksum += counters.rx_count;
+    }
+    const double read_ns = (double)(time_ns() - start_ns)/(rounds/10);
+
+    printf("%-22s %.1f ns\n", "STATS_ADD", add_ns);
+    printf("%-22s %.0f ns per %zu byte block (checksum %llu)\n", "stats_block_read", read_ns,
+           sizeof(espnow_transponder_stats_t), (unsigned long long)checksum);
+}
+
+int main(int argc, char **argv)
+{
+    test_options_t options = {
+        .seconds = 2,
+        .writers = 4,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--seconds") == 0 && arg + 1 < argc)
+            options.seconds = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--writers") == 0 && arg + 1 < argc)
+            options.writers = atoi(argv[++arg]);
+        else
+            options.writers = 0, arg = argc;
+    }
+
+    if(options.seconds <= 0 || options.writers < 1 || options.writers > TEST_WRITERS_MAX) {
+        fprintf(stderr, "Usage: %s [--seconds N] [--writers 1-%d]\n", argv[0], TEST_WRITERS_MAX);
+        return 2;
+    }
+
+    test_single_thread();
+    test_writers(&options);
+    run_timing();
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,6 @@
+#pragma once
+
+//! Host stand-in for the ESP-IDF header, see host_rtos.c
+
+//! \brief Get the CPU clock, which xthal_get_ccount() counts at
+int esp_clk_cpu_freq(void);
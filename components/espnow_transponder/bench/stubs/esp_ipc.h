@@ -0,0 +1,12 @@
+#pragma once
+
+//! Host stand-in for the ESP-IDF header. The host has a single core, so the
+//! function is called in place, see host_rtos.c.
+
+#include <stdint.h>
+
+#include "esp_err.h"
+
+typedef void (*esp_ipc_func_t)(void *arg);
+
+esp_err_t esp_ipc_call_blocking(uint32_t cpu_id, esp_ipc_func_t func, void *arg);
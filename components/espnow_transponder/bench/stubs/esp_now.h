@@ -0,0 +1,6 @@
+#pragma once
+
+//! Host stand-in for the ESP-IDF header, with just what the benchmark's sources use
+
+#define ESP_NOW_ETH_ALEN            6
+#define ESP_NOW_MAX_DATA_LEN        250
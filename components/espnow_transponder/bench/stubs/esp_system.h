@@ -0,0 +1,10 @@
+#pragma once
+
+//! Host stand-in for the ESP-IDF header, see host_rtos.c
+
+#include <stdint.h>
+
+uint32_t esp_random(void);
+
+#define MAC2STR(a) (a)[0], (a)[1], (a)[2], (a)[3], (a)[4], (a)[5]
+#define MACSTR "%02x:%02x:%02x:%02x:%02x:%02x"
@@ -0,0 +1,20 @@
+#pragma once
+
+//! Host stand-in for the ESP-IDF header, with just what the benchmark's sources use
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+typedef enum {
+    WIFI_MODE_NULL,
+    WIFI_MODE_STA,
+    WIFI_MODE_AP,
+    WIFI_MODE_APSTA,
+} wifi_mode_t;
+
+typedef enum {
+    WIFI_PHY_RATE_24M = 0x09,
+    WIFI_PHY_RATE_MCS2_LGI = 0x12,
+} wifi_phy_rate_t;
@@ -0,0 +1,56 @@
+#pragma once
+
+//! Host stand-in for the FreeRTOS header. Critical sections are spinlocks,
+//! as they are on a multi-core ESP32, so that code that uses them can be
+//! tested from several threads. The rest of the API that is stood in for is
+//! implemented in host_rtos.c.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdFALSE                     0
+#define pdTRUE                      1
+#define pdFAIL                      pdFALSE
+#define pdPASS                      pdTRUE
+
+#define portMAX_DELAY               ((TickType_t)0xFFFFFFFF)
+
+//! Ticks are a millisecond on the host
+#define configTICK_RATE_HZ          1000
+#define portTICK_PERIOD_MS          (1000/configTICK_RATE_HZ)
+
+//! Threads aren't pinned, so the host counts as a single core
+#define portNUM_PROCESSORS          1
+
+static inline BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+typedef struct {
+    volatile bool locked;
+} portMUX_TYPE;
+
+static inline void vPortCPUInitializeMutex(portMUX_TYPE *mux)
+{
+    __atomic_clear(&mux->locked, __ATOMIC_RELAXED);
+}
+
+static inline void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    while(__atomic_test_and_set(&mux->locked, __ATOMIC_ACQUIRE))
+        ;
+}
+
+static inline void vPortExitCritical(portMUX_TYPE *mux)
+{
+    __atomic_clear(&mux->locked, __ATOMIC_RELEASE);
+}
+
+#define portENTER_CRITICAL(mux)     vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux)      vPortExitCritical(mux)
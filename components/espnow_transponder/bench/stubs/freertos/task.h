@@ -0,0 +1,18 @@
+#pragma once
+
+//! Host stand-in for the FreeRTOS header. Tasks are threads, see host_rtos.c.
+//! Priorities and stack sizes are ignored.
+
+#include "FreeRTOS.h"
+
+typedef struct host_task *TaskHandle_t;
+
+typedef void (*TaskFunction_t)(void *parameter);
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameter,
+                       UBaseType_t priority, TaskHandle_t *created_task);
+void vTaskDelete(TaskHandle_t task);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount(void);
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
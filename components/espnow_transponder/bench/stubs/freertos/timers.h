@@ -0,0 +1,8 @@
+#pragma once
+
+//! Host stand-in for the FreeRTOS header. Nothing in the host builds uses
+//! FreeRTOS software timers, but like the real header it brings in the
+//! task API.
+
+#include "FreeRTOS.h"
+#include "task.h"
@@ -0,0 +1,456 @@
+//! Host implementation of the FreeRTOS and ESP-IDF calls in the stand-in
+//! headers
+//!
+//! Tasks are threads, and mutexes are pthread mutexes. A task's notification
+//! value is a counter guarded by a mutex and condition variable of its own.
+//! Threads that weren't created with xTaskCreate(), such as the main
+//! thread, get a task the first time they need one. Queues are rings of
+//! items, with a mutex and condition variables of their own.
+//!
+//! The clock is CLOCK_MONOTONIC, counted from the first call. Each timer
+//! has a thread that sleeps until the timer is due and then runs its
+//! callback, which stands in for the esp_timer task. The CPU cycle count
+//! is the same clock, at a nominal 240 MHz.
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "esp_timer.h"
+#include "esp_ipc.h"
+#include "esp_clk.h"
+#include "esp_system.h"
+#include "xtensa/hal.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
+
+//! Nominal CPU clock, that the cycle count runs at
+#define HOST_CPU_FREQ               240000000
+
+struct host_task {
+    pthread_t thread;
+    TaskFunction_t function;
+    void *parameter;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notification;
+};
+
+struct host_mutex {
+    pthread_mutex_t mutex;
+};
+
+struct host_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    uint32_t length;                    //!< Items the queue can hold
+    uint32_t item_size;
+    uint32_t head;                      //!< Oldest item
+    uint32_t count;
+    uint8_t *items;
+};
+
+struct esp_timer {
+    esp_timer_cb_t callback;
+    void *arg;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    int64_t due_us;                     //!< Time the callback is next due, or INT64_MAX if stopped
+    uint64_t period_us;                 //!< Period, or 0 for a one-shot timer
+};
+
+static __thread struct host_task *current_task = NULL;
+
+static struct timespec start_time;
+static pthread_once_t start_once = PTHREAD_ONCE_INIT;
+
+static void clock_start()
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+}
+
+int64_t esp_timer_get_time(void)
+{
+    pthread_once(&start_once, clock_start);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)(now.tv_sec - start_time.tv_sec)*1000000 + (now.tv_nsec - start_time.tv_nsec)/1000;
+}
+
+//! \brief Get the absolute CLOCK_MONOTONIC time that esp_timer_get_time() reads a time at
+static struct timespec host_deadline(int64_t time_us)
+{
+    pthread_once(&start_once, clock_start);
+
+    const int64_t ns = start_time.tv_nsec + (time_us % 1000000)*1000;
+    struct timespec deadline = {
+        .tv_sec = start_time.tv_sec + time_us/1000000 + ns/1000000000,
+        .tv_nsec = ns % 1000000000,
+    };
+    return deadline;
+}
+
+//! \brief Wait on a condition variable that uses CLOCK_MONOTONIC, until a time or forever
+static void host_wait(pthread_cond_t *cond, pthread_mutex_t *lock, int64_t until_us)
+{
+    if(until_us == INT64_MAX) {
+        pthread_cond_wait(cond, lock);
+        return;
+    }
+
+    const struct timespec deadline = host_deadline(until_us);
+    pthread_cond_timedwait(cond, lock, &deadline);
+}
+
+//! \brief Get the time a wait of some ticks ends, or INT64_MAX to wait forever
+static int64_t host_wait_until(TickType_t ticks_to_wait)
+{
+    return ticks_to_wait == portMAX_DELAY ? INT64_MAX
+        : esp_timer_get_time() + (int64_t)ticks_to_wait*portTICK_PERIOD_MS*1000;
+}
+
+uint32_t xthal_get_ccount(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*HOST_CPU_FREQ + (uint64_t)now.tv_nsec*(HOST_CPU_FREQ/1000000)/1000;
+}
+
+int esp_clk_cpu_freq(void)
+{
+    return HOST_CPU_FREQ;
+}
+
+uint32_t esp_random(void)
+{
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    static uint32_t state = 0;
+
+    pthread_mutex_lock(&lock);
+    if(state == 0)
+        state = (uint32_t)esp_timer_get_time() | 1;
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    const uint32_t value = state;
+    pthread_mutex_unlock(&lock);
+
+    return value;
+}
+
+esp_err_t esp_ipc_call_blocking(uint32_t cpu_id, esp_ipc_func_t func, void *arg)
+{
+    if(cpu_id >= portNUM_PROCESSORS)
+        return ESP_ERR_INVALID_ARG;
+
+    func(arg);
+    return ESP_OK;
+}
+
+static void host_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static struct host_task *host_task_new()
+{
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    if(task == NULL) {
+        fprintf(stderr, "Could not allocate a task\n");
+        abort();
+    }
+
+    pthread_mutex_init(&task->lock, NULL);
+    host_cond_init(&task->notified);
+    return task;
+}
+
+//! \brief Get the task of the calling thread, creating one if needed
+static struct host_task *host_current_task()
+{
+    if(current_task == NULL) {
+        current_task = host_task_new();
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+static void *host_task_start(void *arg)
+{
+    current_task = arg;
+    current_task->function(current_task->parameter);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameter,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    struct host_task *task = host_task_new();
+    task->function = function;
+    task->parameter = parameter;
+
+    // The task may run before pthread_create() returns, and look itself up
+    if(created_task != NULL)
+        *created_task = task;
+
+    if(pthread_create(&task->thread, NULL, host_task_start, task) != 0) {
+        free(task);
+        return pdFAIL;
+    }
+
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    // Tasks only ever delete themselves here. The task is kept, as other
+    // tasks may still hold its handle.
+    if(task == NULL || task == current_task)
+        pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    const struct timespec delay = {
+        .tv_sec = ticks*portTICK_PERIOD_MS/1000,
+        .tv_nsec = (long)(ticks*portTICK_PERIOD_MS % 1000)*1000000,
+    };
+    nanosleep(&delay, NULL);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    return esp_timer_get_time()/1000/portTICK_PERIOD_MS;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    pthread_mutex_lock(&task->lock);
+    task->notification++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task *task = host_current_task();
+    const int64_t until_us = host_wait_until(ticks_to_wait);
+
+    pthread_mutex_lock(&task->lock);
+    while(task->notification == 0 && esp_timer_get_time() < until_us)
+        host_wait(&task->notified, &task->lock, until_us);
+
+    const uint32_t value = task->notification;
+    if(value > 0)
+        task->notification = clear_on_exit ? 0 : value - 1;
+    pthread_mutex_unlock(&task->lock);
+
+    return value;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    struct host_mutex *semaphore = malloc(sizeof(struct host_mutex));
+    if(semaphore != NULL)
+        pthread_mutex_init(&semaphore->mutex, NULL);
+    return semaphore;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    if(ticks_to_wait == portMAX_DELAY)
+        return pthread_mutex_lock(&semaphore->mutex) == 0 ? pdTRUE : pdFALSE;
+
+    const struct timespec deadline = host_deadline(esp_timer_get_time() + (int64_t)ticks_to_wait*portTICK_PERIOD_MS*1000);
+    while(true) {
+        if(pthread_mutex_trylock(&semaphore->mutex) == 0)
+            return pdTRUE;
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+            return pdFALSE;
+        vTaskDelay(1);
+    }
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    return pthread_mutex_unlock(&semaphore->mutex) == 0 ? pdTRUE : pdFALSE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size)
+{
+    struct host_queue *queue = calloc(1, sizeof(struct host_queue));
+    if(queue == NULL)
+        return NULL;
+
+    queue->items = malloc((size_t)length*item_size);
+    if(queue->items == NULL) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->length = length;
+    queue->item_size = item_size;
+    pthread_mutex_init(&queue->lock, NULL);
+    host_cond_init(&queue->not_empty);
+    host_cond_init(&queue->not_full);
+    return queue;
+}
+
+void vQueueDelete(QueueHandle_t queue)
+{
+    free(queue->items);
+    free(queue);
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait)
+{
+    const int64_t until_us = host_wait_until(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == queue->length && ticks_to_wait > 0 && esp_timer_get_time() < until_us)
+        host_wait(&queue->not_full, &queue->lock, until_us);
+
+    const bool sent = queue->count < queue->length;
+    if(sent) {
+        memcpy(queue->items + (size_t)(queue->head + queue->count) % queue->length*queue->item_size, item,
+               queue->item_size);
+        queue->count++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return sent ? pdTRUE : pdFALSE;
+}
+
+//! \brief Take or peek at the oldest item of a queue
+static BaseType_t host_queue_take(QueueHandle_t queue, void *item, TickType_t ticks_to_wait, bool remove)
+{
+    const int64_t until_us = host_wait_until(ticks_to_wait);
+
+    pthread_mutex_lock(&queue->lock);
+    while(queue->count == 0 && ticks_to_wait > 0 && esp_timer_get_time() < until_us)
+        host_wait(&queue->not_empty, &queue->lock, until_us);
+
+    const bool taken = queue->count > 0;
+    if(taken) {
+        memcpy(item, queue->items + (size_t)queue->head*queue->item_size, queue->item_size);
+        if(remove) {
+            queue->head = (queue->head + 1) % queue->length;
+            queue->count--;
+            pthread_cond_signal(&queue->not_full);
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return taken ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+    return host_queue_take(queue, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void *item, TickType_t ticks_to_wait)
+{
+    return host_queue_take(queue, item, ticks_to_wait, false);
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue)
+{
+    pthread_mutex_lock(&queue->lock);
+    const UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+static void *host_timer_thread(void *arg)
+{
+    struct esp_timer *timer = arg;
+
+    pthread_mutex_lock(&timer->lock);
+    while(true) {
+        if(timer->due_us == INT64_MAX || esp_timer_get_time() < timer->due_us) {
+            host_wait(&timer->changed, &timer->lock, timer->due_us);
+            continue;
+        }
+
+        timer->due_us = timer->period_us > 0 ? timer->due_us + timer->period_us : INT64_MAX;
+
+        // Run the callback unlocked, so that it can restart the timer
+        pthread_mutex_unlock(&timer->lock);
+        timer->callback(timer->arg);
+        pthread_mutex_lock(&timer->lock);
+    }
+
+    return NULL;
+}
+
+esp_err_t esp_timer_create(const esp_timer_create_args_t *create_args, esp_timer_handle_t *out_handle)
+{
+    struct esp_timer *timer = calloc(1, sizeof(struct esp_timer));
+    if(timer == NULL)
+        return ESP_ERR_NO_MEM;
+
+    timer->callback = create_args->callback;
+    timer->arg = create_args->arg;
+    timer->due_us = INT64_MAX;
+    pthread_mutex_init(&timer->lock, NULL);
+    host_cond_init(&timer->changed);
+
+    if(pthread_create(&timer->thread, NULL, host_timer_thread, timer) != 0) {
+        free(timer);
+        return ESP_ERR_NO_MEM;
+    }
+    pthread_detach(timer->thread);
+
+    *out_handle = timer;
+    return ESP_OK;
+}
+
+//! \brief Set when a timer is next due
+static esp_err_t host_timer_set(esp_timer_handle_t timer, int64_t due_us, uint64_t period_us)
+{
+    pthread_mutex_lock(&timer->lock);
+    timer->due_us = due_us;
+    timer->period_us = period_us;
+    pthread_cond_signal(&timer->changed);
+    pthread_mutex_unlock(&timer->lock);
+    return ESP_OK;
+}
+
+esp_err_t esp_timer_start_once(esp_timer_handle_t timer, uint64_t timeout_us)
+{
+    return host_timer_set(timer, esp_timer_get_time() + timeout_us, 0);
+}
+
+esp_err_t esp_timer_start_periodic(esp_timer_handle_t timer, uint64_t period)
+{
+    return host_timer_set(timer, esp_timer_get_time() + period, period);
+}
+
+esp_err_t esp_timer_stop(esp_timer_handle_t timer)
+{
+    return host_timer_set(timer, INT64_MAX, 0);
+}
+
+esp_err_t esp_timer_delete(esp_timer_handle_t timer)
+{
+    // The thread is left to sleep, as the callback may be running
+    return esp_timer_stop(timer);
+}
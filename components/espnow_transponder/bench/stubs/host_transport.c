@@ -0,0 +1,34 @@
+//! Host stand-in for the ESP-NOW transport
+//!
+//! transport_espnow.c needs the WiFi driver, so on the host there is no
+//! ESP-NOW transport. This fills in for it, so that the transponder links,
+//! but every host program has to give espnow_transponder_config_t::transport,
+//! normally espnow_transponder_transport_sim.
+
+#include <stddef.h>
+
+#include "espnow_transponder_transport.h"
+
+static esp_err_t host_transport_init(const espnow_transponder_config_t *config)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static esp_err_t host_transport_register_callbacks(espnow_transponder_transport_recv_cb_t recv_cb,
+                                                   espnow_transponder_transport_send_cb_t send_cb)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+static esp_err_t host_transport_send(const uint8_t *data, uint16_t length)
+{
+    return ESP_ERR_NOT_SUPPORTED;
+}
+
+const espnow_transponder_transport_t espnow_transponder_transport_espnow = {
+    .name = "espnow (not on the host)",
+    .init = host_transport_init,
+    .register_callbacks = host_transport_register_callbacks,
+    .send = host_transport_send,
+    .set_phy = NULL,
+};
@@ -0,0 +1,11 @@
+#pragma once
+
+//! Host stand-in for the lwIP header: the BSD socket calls it provides are
+//! the host's own
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
@@ -0,0 +1,8 @@
+#pragma once
+
+//! Host stand-in for the Xtensa HAL header. The cycle count is the
+//! monotonic clock, scaled to esp_clk_cpu_freq(), see host_rtos.c.
+
+#include <stdint.h>
+
+uint32_t xthal_get_ccount(void);
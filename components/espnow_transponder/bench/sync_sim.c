@@ -0,0 +1,424 @@
+//! Synchronized frame presentation simulation
+//!
+//! Has one sender send artdmx frames to a number of receivers over the
+//! simulated medium, with every node on a clock of its own that runs up to
+//! --ppm fast or slow, and measures how closely the receivers present each
+//! frame. The sender sends every universe of a frame as one packet, then
+//! commits the frame with a sync packet, as artdmx_send_frame() does with
+//! sync_delay_us set.
+//!
+//! Every case is run twice. Free receivers present each universe as soon
+//! as it arrives, as artdmx receivers do without sync. Synchronized ones
+//! hold them in a frame_sync_t and present each frame when it is due, as the
+//! artdmx sync task does.
+//!
+//! The spread of a frame is the time between the first and the last
+//! presentation of any of its universes, at any receiver, in simulation
+//! time. For each delivery jitter and loss, this reports the mean spread
+//! of the frames sent after a warm up, both ways, and for synchronized
+//! receivers, the frames presented at their commit time, after a timeout,
+//! and skipped, summed over the receivers.
+//!
+//! It fails if the synchronized spread isn't below the free one, or is
+//! more than SIM_SPREAD_MAX_US plus a quarter of the jitter, if any frame
+//! is skipped, or if a frame with universes at a receiver isn't presented
+//! there.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/sync_sim [--jitter US ...] [--loss P ...] [--receivers N] [--universes N] [--size N]
+//!                          [--fps N] [--delay US] [--ppm N] [--seconds N] [--seed N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "artdmx.h"
+#include "frame_sync.h"
+#include "sim_air.h"
+
+//! Frames held at once, as in artdmx
+#define SIM_SYNC_DEPTH              4
+
+//! Time a frame is held without a commit, as in artdmx
+#define SIM_SYNC_TIMEOUT_US         100000
+
+//! PHY rate every node sends at: WIFI_PHY_RATE_MCS4_LGI
+#define SIM_PHY_RATE                0x14
+
+//! Time before frames are counted, for the clock estimates to settle
+#define SIM_WARMUP_US               5000000
+
+//! Largest synchronized spread, on top of a quarter of the jitter
+#define SIM_SPREAD_MAX_US           100
+
+#define SIM_SENDER                  0
+
+//! Most jitter and loss values
+#define SIM_CASES_MAX               4
+
+typedef struct {
+    uint32_t jitter_us[SIM_CASES_MAX];
+    int jitters;
+    float loss[SIM_CASES_MAX];
+    int losses;
+    uint8_t receivers;
+    uint8_t universes;
+    uint16_t size;                      //!< Length of each universe
+    uint32_t fps;
+    uint32_t delay_us;                  //!< Time from sending a frame to presenting it, on the sender's clock
+    float ppm;                          //!< Largest clock rate error of a node
+    uint32_t seconds;
+    uint32_t seed;
+} sim_options_t;
+
+//! Presentations of a frame
+typedef struct {
+    uint32_t frame;                     //!< Frame number, which the sequence number is the low bits of
+    int64_t first_us;                   //!< First presentation of any universe at any receiver
+    int64_t last_us;                    //!< Last one
+    uint32_t presented;                 //!< Universes presented, at all receivers
+} sim_frame_t;
+
+typedef struct {
+    uint8_t node;
+    bool sync;
+    frame_sync_t frame_sync;
+    int64_t next_us;                    //!< Simulation time a held frame is due, or INT64_MAX
+    uint32_t received[256];             //!< Frame number of the last universe received for each sequence number
+    uint32_t presented[256];            //!< Frame number of the last universe presented for each sequence number
+    uint32_t missed;                    //!< Frames with universes received, but none presented
+} sim_receiver_t;
+
+typedef struct {
+    double spread_us;                   //!< Mean spread of the frames sent after the warm up
+    uint32_t frames;                    //!< Frames the spread is taken over
+    frame_sync_stats_t stats;           //!< Summed over the receivers
+    uint32_t missed;                    //!< Frames received somewhere but not presented there
+} sim_result_t;
+
+static sim_air_t air;
+static sim_receiver_t receivers[SIM_AIR_MAX_NODES];
+static sim_frame_t frames[256];          //!< By sequence number
+static uint32_t frame_number;            //!< Number of the next frame to send
+static double spread_sum_us;
+static uint32_t spread_frames;
+static uint32_t rng;
+
+static uint32_t random_next()
+{
+    // xorshift32
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+//! \brief Random clock rate error, up to the given one either way
+static float random_ppm(float ppm)
+{
+    return ppm*(2.0f*(random_next() % 10001)/10000 - 1);
+}
+
+//! \brief Frame number for a sequence number, of a frame that was sent recently
+static uint32_t frame_of(uint8_t sequence)
+{
+    return frames[sequence].frame;
+}
+
+//! \brief Count a frame's spread, once no more of it can be presented
+static void frame_done(sim_frame_t *frame)
+{
+    if(frame->presented > 0 && frame->first_us >= SIM_WARMUP_US) {
+        spread_sum_us += frame->last_us - frame->first_us;
+        spread_frames++;
+    }
+}
+
+//! \brief A universe is presented, by either kind of receiver
+static void present(void *context, uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    sim_receiver_t *receiver = context;
+    sim_frame_t *frame = &frames[sequence];
+    if(frame->presented == 0 || air.now_us < frame->first_us)
+        frame->first_us = air.now_us;
+    if(frame->presented == 0 || air.now_us > frame->last_us)
+        frame->last_us = air.now_us;
+    frame->presented++;
+    receiver->presented[sequence] = frame->frame;
+}
+
+//! \brief Packet received by a receiver
+static void receiver_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    sim_receiver_t *receiver = context;
+    const int64_t local_us = sim_air_node_time(&air, receiver->node, air.now_us);
+
+    if(length == sizeof(artdmx_sync_packet_t) && (data[3] & ARTDMX_TYPE_MASK) == ARTDMX_TYPE_SYNC) {
+        artdmx_sync_packet_t packet;
+        memcpy(&packet, data, sizeof(packet));
+        if(receiver->sync)
+            frame_sync_commit(&receiver->frame_sync, packet.sequence, packet.sent_us, packet.present_us, local_us);
+    }
+    else if(length >= sizeof(artdmx_packet_t)) {
+        const artdmx_packet_t *packet = (const artdmx_packet_t *)data;
+        receiver->received[packet->sequence] = frame_of(packet->sequence);
+        if(receiver->sync)
+            frame_sync_add(&receiver->frame_sync, packet->universe, packet->sequence, packet->data,
+                           length - sizeof(artdmx_packet_t), local_us);
+        else
+            present(receiver, packet->universe, packet->sequence, packet->data, length - sizeof(artdmx_packet_t));
+    }
+    else {
+        return;
+    }
+
+    // As the sync task, which new universes and commits wake
+    if(receiver->sync)
+        receiver->next_us = air.now_us;
+}
+
+//! \brief Present a synchronized receiver's frames that are due, and find when the next one is
+static void receiver_poll(sim_receiver_t *receiver)
+{
+    const int64_t local_us = sim_air_node_time(&air, receiver->node, air.now_us);
+    const int64_t next_us = frame_sync_poll(&receiver->frame_sync, local_us);
+    receiver->next_us = next_us == INT64_MAX ? INT64_MAX : sim_air_sim_time(&air, receiver->node, next_us);
+}
+
+//! \brief Send a frame, then its commit
+static void send_frame(const sim_options_t *options)
+{
+    const uint8_t sequence = frame_number;
+    frame_done(&frames[sequence]);
+    frames[sequence] = (sim_frame_t){ .frame = frame_number };
+
+    uint8_t packet[SIM_AIR_MAX_PACKET];
+    memset(packet, 0, sizeof(packet));
+    artdmx_packet_t *header = (artdmx_packet_t *)packet;
+    for(uint8_t universe = 0; universe < options->universes; universe++) {
+        header->universe = universe;
+        header->sequence = sequence;
+        header->type = ARTDMX_TYPE_DATA;
+        header->fragment_count = 1;
+        memset(header->data, sequence, options->size);
+        sim_air_send(&air, SIM_SENDER, packet, sizeof(artdmx_packet_t) + options->size);
+    }
+
+    // As artdmx_send_sync()
+    const uint32_t now_us = sim_air_node_time(&air, SIM_SENDER, air.now_us);
+    const artdmx_sync_packet_t sync = {
+        .universe = ARTDMX_SYNC_UNIVERSE,
+        .sequence = sequence,
+        .type = ARTDMX_TYPE_SYNC,
+        .sent_us = now_us,
+        .present_us = now_us + options->delay_us,
+    };
+    sim_air_send(&air, SIM_SENDER, (const uint8_t *)&sync, sizeof(sync));
+
+    frame_number++;
+}
+
+static bool run_mode(const sim_options_t *options, uint32_t jitter_us, float loss, bool sync, sim_result_t *result)
+{
+    memset(result, 0, sizeof(*result));
+
+    const sim_air_config_t air_config = {
+        .node_count = options->receivers + 1,
+        .phy_rate = SIM_PHY_RATE,
+        .loss = loss,
+        .burst_loss = 1,
+        .burst_exit = 1,
+        .latency_us = 100,
+        .jitter_us = jitter_us,
+        .queue_size = 8192,
+        .seed = options->seed,
+    };
+    if(!sim_air_init(&air, &air_config)) {
+        fprintf(stderr, "Could not create the medium\n");
+        return false;
+    }
+
+    // Both modes get the same clocks
+    rng = options->seed;
+    sim_air_set_clock(&air, SIM_SENDER, random_ppm(options->ppm), random_next() % 1000000000);
+
+    for(uint8_t node = 1; node <= options->receivers; node++) {
+        sim_receiver_t *receiver = &receivers[node];
+        memset(receiver, 0, sizeof(*receiver));
+        receiver->node = node;
+        receiver->sync = sync;
+        receiver->next_us = INT64_MAX;
+        memset(receiver->received, 0xFF, sizeof(receiver->received));
+        memset(receiver->presented, 0xFF, sizeof(receiver->presented));
+        if(sync && !frame_sync_init(&receiver->frame_sync, options->universes, SIM_SYNC_DEPTH, SIM_SYNC_TIMEOUT_US,
+                                    present, receiver)) {
+            fprintf(stderr, "Could not set up frame sync\n");
+            return false;
+        }
+
+        sim_air_set_clock(&air, node, random_ppm(options->ppm), random_next() % 1000000000);
+        sim_air_attach(&air, node, receiver_recv, NULL, receiver);
+    }
+
+    memset(frames, 0, sizeof(frames));
+    frame_number = 0;
+    spread_sum_us = 0;
+    spread_frames = 0;
+
+    // Frames go out on the sender's clock
+    const int64_t end_us = (int64_t)options->seconds*1000000;
+    const int64_t frame_interval_us = 1000000/options->fps;
+    int64_t next_frame_us = sim_air_node_time(&air, SIM_SENDER, 0) + frame_interval_us;
+
+    for(;;) {
+        int64_t next_us = sim_air_sim_time(&air, SIM_SENDER, next_frame_us);
+        for(uint8_t node = 1; node <= options->receivers; node++)
+            if(receivers[node].next_us < next_us)
+                next_us = receivers[node].next_us;
+        if(next_us >= end_us)
+            break;
+
+        sim_air_run_until(&air, next_us);
+
+        if(sim_air_node_time(&air, SIM_SENDER, air.now_us) >= next_frame_us) {
+            // Frames a sequence number wrap ago can't be presented any more
+            sim_frame_t *old = &frames[(uint8_t)frame_number];
+            for(uint8_t node = 1; node <= options->receivers; node++)
+                if(receivers[node].received[(uint8_t)frame_number] == old->frame
+                    && receivers[node].presented[(uint8_t)frame_number] != old->frame && frame_number >= 256)
+                    result->missed++;
+
+            send_frame(options);
+            next_frame_us += frame_interval_us;
+        }
+
+        for(uint8_t node = 1; node <= options->receivers; node++)
+            if(receivers[node].next_us <= air.now_us)
+                receiver_poll(&receivers[node]);
+    }
+
+    // Frames still in flight at the end aren't counted
+    result->spread_us = spread_frames > 0 ? spread_sum_us/spread_frames : 0;
+    result->frames = spread_frames;
+
+    for(uint8_t node = 1; node <= options->receivers; node++) {
+        if(!sync)
+            continue;
+
+        const frame_sync_stats_t *stats = &receivers[node].frame_sync.stats;
+        result->stats.committed += stats->committed;
+        result->stats.timed_out += stats->timed_out;
+        result->stats.late_commits += stats->late_commits;
+        result->stats.skipped += stats->skipped;
+        result->stats.overruns += stats->overruns;
+        result->stats.stale += stats->stale;
+        frame_sync_free(&receivers[node].frame_sync);
+    }
+
+    sim_air_free(&air);
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .jitter_us = {300, 3000},
+        .jitters = 2,
+        .loss = {0, 0.02f},
+        .losses = 2,
+        .receivers = 8,
+        .universes = 8,
+        .size = 200,
+        .fps = 44,
+        .delay_us = 50000,
+        .ppm = 40,
+        .seconds = 30,
+        .seed = 1,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        const bool value = arg + 1 < argc;
+        if(strcmp(argv[arg], "--jitter") == 0 && value) {
+            options.jitters = 0;
+            while(arg + 1 < argc && argv[arg + 1][0] != '-' && options.jitters < SIM_CASES_MAX)
+                options.jitter_us[options.jitters++] = atoi(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--loss") == 0 && value) {
+            options.losses = 0;
+            while(arg + 1 < argc && argv[arg + 1][0] != '-' && options.losses < SIM_CASES_MAX)
+                options.loss[options.losses++] = atof(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--receivers") == 0 && value)
+            options.receivers = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--universes") == 0 && value)
+            options.universes = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--size") == 0 && value)
+            options.size = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--fps") == 0 && value)
+            options.fps = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--delay") == 0 && value)
+            options.delay_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--ppm") == 0 && value)
+            options.ppm = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && value)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && value)
+            options.seed = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--jitter US ...] [--loss P ...] [--receivers N] [--universes N] [--size N]"
+                    " [--fps N] [--delay US] [--ppm N] [--seconds N] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const uint16_t max_size = SIM_AIR_MAX_PACKET - sizeof(artdmx_packet_t);
+    if(options.jitters == 0 || options.losses == 0 || options.receivers < 1
+        || options.receivers >= SIM_AIR_MAX_NODES || options.universes == 0 || options.size == 0
+        || options.size > max_size || options.fps == 0 || options.fps > 1000 || options.seed == 0
+        || options.seconds*1000000ull <= SIM_WARMUP_US) {
+        fprintf(stderr, "Need 1 to %u receivers, a size up to %u, more than %u s and a non-zero seed\n",
+                SIM_AIR_MAX_NODES - 1, max_size, SIM_WARMUP_US/1000000);
+        return 2;
+    }
+
+    printf("%u receivers, %u x %u B universes at %u fps, %u us delay, clocks within %.0f ppm, %u s\n",
+           options.receivers, options.universes, options.size, options.fps, options.delay_us, options.ppm,
+           options.seconds);
+    printf("%-8s %6s %12s %12s %10s %10s %8s\n", "jitter", "loss", "free spread", "sync spread", "committed",
+           "timed out", "skipped");
+
+    bool pass = true;
+    for(int jitter = 0; jitter < options.jitters; jitter++) {
+        for(int loss = 0; loss < options.losses; loss++) {
+            const uint32_t jitter_us = options.jitter_us[jitter];
+            sim_result_t free_result;
+            sim_result_t sync_result;
+            if(!run_mode(&options, jitter_us, options.loss[loss], false, &free_result)
+                || !run_mode(&options, jitter_us, options.loss[loss], true, &sync_result))
+                return 1;
+
+            printf("%5u us %5.1f%% %9.0f us %9.0f us %10u %10u %8u\n", jitter_us, 100*options.loss[loss],
+                   free_result.spread_us, sync_result.spread_us, sync_result.stats.committed,
+                   sync_result.stats.timed_out, sync_result.stats.skipped);
+
+            const double spread_max_us = SIM_SPREAD_MAX_US + jitter_us/4.0;
+            if(sync_result.spread_us >= free_result.spread_us || sync_result.spread_us > spread_max_us) {
+                printf("FAIL: spread of %.0f us synchronized, %.0f us free, more than %.0f us\n",
+                       sync_result.spread_us, free_result.spread_us, spread_max_us);
+                pass = false;
+            }
+            if(sync_result.stats.skipped > 0 || sync_result.missed > 0) {
+                printf("FAIL: %u frames skipped, %u received and not presented\n", sync_result.stats.skipped,
+                       sync_result.missed);
+                pass = false;
+            }
+        }
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,500 @@
+//! TDMA collision simulation
+//!
+//! Has a number of senders share the simulated medium, with channel access
+//! and collisions modelled, and every node on a clock of its own that runs
+//! up to --ppm fast or slow. Each sender sends a burst of packets every
+//! frame, on its own clock, and one more node receives and counts them.
+//!
+//! Every run is made twice. Free senders send each burst as soon as it is
+//! made, so bursts from different senders overlap and collide now and then.
+//! In TDMA mode one more node is the master, and runs tdma.c as the
+//! transponder does: it sends a beacon at the start of every frame, and
+//! takes slot requests. The senders follow the beacons with a tdma_sender_t,
+//! ask for a slot, keep it with requests from within the slot, and hold
+//! their packets until tdma_sender_delay() lets them go. Beacons and slot
+//! requests are control packets on the same medium, so they collide and are
+//! lost like any other.
+//!
+//! For each number of senders, this reports the fraction of packets the
+//! receiver got in each mode, counting only those made after a warm up, and
+//! the collisions. For TDMA it adds the senders that ended up with a slot,
+//! and the largest difference between a sender's estimate of the rate of
+//! the master's clock, and the real one.
+//!
+//! It fails if a TDMA run delivers less than SIM_TDMA_DELIVERED_MIN or less
+//! than the free run, leaves a sender without a slot, or gets a clock rate
+//! more than SIM_SKEW_ERROR_MAX off.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/tdma_sim [--senders N ...] [--burst N] [--size N] [--frame US] [--guard US]
+//!                          [--ppm N] [--seconds N] [--seed N]
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "framing.h"
+#include "sim_air.h"
+#include "tdma.h"
+
+//! Length of the beacon slot, as in the transponder
+#define SIM_BEACON_US               1000
+
+//! Slot requests the master can hold until its next beacon, as in the transponder
+#define SIM_REQUEST_QUEUE_SIZE      16
+
+//! PHY rate every node sends at: WIFI_PHY_RATE_MCS4_LGI
+#define SIM_PHY_RATE                0x14
+
+//! Frames a sender can fall behind by before it drops packets
+#define SIM_BACKLOG_FRAMES          2
+
+//! Most packets in a burst
+#define SIM_BURST_MAX               32
+
+//! Packets a sender can have waiting
+#define SIM_BACKLOG_MAX             (SIM_BACKLOG_FRAMES*SIM_BURST_MAX)
+
+//! Time before packets are counted, for the senders to get their slots
+#define SIM_WARMUP_US               2000000
+
+//! Time after the last burst for its packets to arrive
+#define SIM_DRAIN_US                100000
+
+//! Lowest fraction of packets a TDMA run must deliver
+#define SIM_TDMA_DELIVERED_MIN      0.9995
+
+//! Largest error in a sender's estimate of the rate of the master's clock, in
+//! ppm. The first rate measurement is thrown off while the estimate is still
+//! catching up with the delayed beacons, and the smoothing takes a few tens
+//! of seconds to work that out, so shorter runs are further off.
+#define SIM_SKEW_ERROR_MAX          2.0
+
+#define SIM_MASTER                  0
+#define SIM_RECEIVER                1
+#define SIM_FIRST_SENDER            2
+
+//! Most sender counts to run
+#define SIM_RUNS_MAX                8
+
+typedef struct {
+    uint8_t senders[SIM_RUNS_MAX];
+    int runs;
+    uint8_t burst;                      //!< Packets a sender sends each frame
+    uint16_t size;                      //!< Payload length
+    uint32_t frame_us;                  //!< Frame period, of both the senders and the TDMA schedule
+    uint16_t guard_us;
+    float ppm;                          //!< Largest clock rate error of a node
+    uint32_t seconds;
+    uint32_t seed;
+} sim_options_t;
+
+//! Start of every data packet
+typedef struct {
+    uint8_t node;                       //!< Sending node
+    int64_t made_us;                    //!< Simulation time the packet was made
+} __attribute__((packed)) sim_data_t;
+
+typedef struct {
+    uint8_t node;
+    float ppm;                          //!< How fast the node's clock runs
+    tdma_sender_t tdma;
+    int64_t next_frame_us;              //!< Node clock at the next burst
+    int64_t wake_us;                    //!< Simulation time to try to send again, or INT64_MAX
+    int64_t made_us[SIM_BACKLOG_MAX];   //!< Simulation time each waiting packet was made, oldest first
+    uint32_t pending_head;              //!< Oldest waiting packet
+    uint32_t pending;                   //!< Packets waiting to be sent
+    uint32_t in_flight;                 //!< Packets handed to the medium that haven't gone out yet
+    uint64_t made;                      //!< Packets made after the warm up
+    uint64_t received;                  //!< Of those, packets the receiver got
+    uint64_t dropped;                   //!< Packets dropped for falling behind
+} sim_sender_t;
+
+typedef struct {
+    double delivered;                   //!< Fraction of the packets made after the warm up that arrived
+    uint64_t collisions;                //!< Transmissions that collided, by any node
+    uint64_t dropped;                   //!< Packets senders dropped for falling behind
+    int slots;                          //!< Senders with a slot at the end
+    double skew_error_ppm;              //!< Largest error in a sender's clock rate estimate
+} sim_result_t;
+
+static sim_air_t air;
+static sim_sender_t senders[SIM_AIR_MAX_NODES];
+static uint8_t sender_count;
+static bool tdma;
+static tdma_master_t master;
+static uint32_t requests[SIM_REQUEST_QUEUE_SIZE];  //!< Slot requests for the master's next beacon
+static int request_count;
+static float master_ppm;
+static uint32_t rng;
+
+static uint32_t random_next()
+{
+    // xorshift32
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    return rng;
+}
+
+//! \brief Random clock rate error, up to the given one either way
+static float random_ppm(float ppm)
+{
+    return ppm*(2.0f*(random_next() % 10001)/10000 - 1);
+}
+
+//! \brief Send a control message from a node
+static void send_control(uint8_t node, const void *message, uint8_t length)
+{
+    uint8_t packet[SIM_AIR_MAX_PACKET];
+    memcpy(((espnow_transponder_packet_t *)packet)->data, message, length);
+    sim_air_send(&air, node, packet, framing_seal(packet, ESPNOW_TRANSPONDER_FLAG_CONTROL, length));
+}
+
+//! \brief Send a slot request from a sender
+static void send_slot_request(sim_sender_t *sender)
+{
+    const tdma_slot_request_t request = {
+        .type = CONTROL_SLOT_REQUEST,
+        .id = sender->tdma.id,
+    };
+    send_control(sender->node, &request, sizeof(request));
+    sender->in_flight++;
+}
+
+//! \brief Packet received by the master: queue slot requests for the next beacon
+static void master_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(framing_check(data, length) != FRAMING_OK || !(packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL)
+        || packet->data_length != sizeof(tdma_slot_request_t) || packet->data[0] != CONTROL_SLOT_REQUEST)
+        return;
+
+    tdma_slot_request_t request;
+    memcpy(&request, packet->data, sizeof(request));
+    if(request_count < SIM_REQUEST_QUEUE_SIZE)
+        requests[request_count++] = request.id;
+}
+
+//! \brief Packet received by the receiver: count data
+static void receiver_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(framing_check(data, length) != FRAMING_OK || (packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL)
+        || packet->data_length < sizeof(sim_data_t))
+        return;
+
+    sim_data_t header;
+    memcpy(&header, packet->data, sizeof(header));
+    if(header.node >= SIM_FIRST_SENDER && header.node < SIM_FIRST_SENDER + sender_count
+        && header.made_us >= SIM_WARMUP_US)
+        senders[header.node].received++;
+}
+
+//! \brief Packet received by a sender: follow the beacons
+static void sender_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    sim_sender_t *sender = context;
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    if(!tdma || framing_check(data, length) != FRAMING_OK || !(packet->flags & ESPNOW_TRANSPONDER_FLAG_CONTROL)
+        || packet->data_length < TDMA_BEACON_LENGTH(0) || packet->data_length > sizeof(tdma_beacon_t)
+        || packet->data[0] != CONTROL_BEACON)
+        return;
+
+    tdma_beacon_t beacon;
+    memcpy(&beacon, packet->data, packet->data_length);
+    const int64_t local_us = sim_air_node_time(&air, sender->node, air.now_us);
+    if(tdma_sender_beacon(&sender->tdma, &beacon, packet->data_length, local_us))
+        send_slot_request(sender);
+}
+
+//! \brief A sender's transmission is done, so it may be able to send more
+static void sender_sent(void *context)
+{
+    sim_sender_t *sender = context;
+    if(sender->in_flight > 0)
+        sender->in_flight--;
+    if(sender->pending > 0)
+        sender->wake_us = air.now_us;
+}
+
+//! \brief Send as many of a sender's waiting packets as it may now
+static void sender_pump(sim_sender_t *sender, const sim_options_t *options, int data_length)
+{
+    const uint32_t airtime_us = tdma_airtime_us(SIM_PHY_RATE, data_length);
+    sender->wake_us = INT64_MAX;
+
+    while(sender->pending > 0) {
+        // The rest go when a transmission finishes
+        if(sender->in_flight >= SIM_AIR_NODE_QUEUE - 1)
+            return;
+
+        const int64_t local_us = sim_air_node_time(&air, sender->node, air.now_us);
+        if(tdma) {
+            // As tx_delay() does, counting the packets still queued
+            const int64_t delay_us = tdma_sender_delay(&sender->tdma, local_us,
+                                                       (sender->in_flight + 1)*airtime_us);
+            if(delay_us > 0) {
+                sender->wake_us = sim_air_sim_time(&air, sender->node, local_us + delay_us);
+                return;
+            }
+
+            if(delay_us == 0 && tdma_sender_take_refresh(&sender->tdma))
+                send_slot_request(sender);
+        }
+
+        uint8_t packet[SIM_AIR_MAX_PACKET];
+        memset(packet, 0x55, sizeof(packet));
+        const sim_data_t header = {
+            .node = sender->node,
+            .made_us = sender->made_us[sender->pending_head],
+        };
+        memcpy(((espnow_transponder_packet_t *)packet)->data, &header, sizeof(header));
+        framing_seal(packet, 0, options->size);
+
+        if(sim_air_send(&air, sender->node, packet, data_length))
+            sender->in_flight++;
+        sender->pending_head = (sender->pending_head + 1) % SIM_BACKLOG_MAX;
+        sender->pending--;
+    }
+}
+
+static sim_result_t run_mode(const sim_options_t *options, uint8_t count, bool tdma_mode)
+{
+    sim_result_t result = {0};
+
+    const sim_air_config_t air_config = {
+        .node_count = SIM_FIRST_SENDER + count,
+        .phy_rate = SIM_PHY_RATE,
+        .burst_loss = 1,
+        .burst_exit = 1,
+        .latency_us = 100,
+        .jitter_us = 50,
+        .queue_size = 8192,
+        .contention = true,
+        .seed = options->seed,
+    };
+    if(!sim_air_init(&air, &air_config)) {
+        fprintf(stderr, "Could not create the medium\n");
+        result.delivered = -1;
+        return result;
+    }
+
+    // Both modes get the same clocks and burst timing
+    rng = options->seed;
+    tdma = tdma_mode;
+    sender_count = count;
+    request_count = 0;
+    master_ppm = random_ppm(options->ppm);
+    sim_air_set_clock(&air, SIM_MASTER, master_ppm, random_next() % 1000000000);
+    sim_air_attach(&air, SIM_MASTER, master_recv, NULL, NULL);
+    sim_air_attach(&air, SIM_RECEIVER, receiver_recv, NULL, NULL);
+    tdma_master_init(&master, options->frame_us, SIM_BEACON_US, options->guard_us);
+
+    for(uint8_t index = 0; index < count; index++) {
+        const uint8_t node = SIM_FIRST_SENDER + index;
+        sim_sender_t *sender = &senders[node];
+        memset(sender, 0, sizeof(*sender));
+        sender->node = node;
+        sender->ppm = random_ppm(options->ppm);
+        sender->wake_us = INT64_MAX;
+        tdma_sender_init(&sender->tdma, 0x1000 + random_next() % 0x10000*0x10 + node);
+
+        const int64_t offset_us = random_next() % 1000000000;
+        sim_air_set_clock(&air, node, sender->ppm, offset_us);
+        sender->next_frame_us = offset_us + random_next() % options->frame_us;
+        sim_air_attach(&air, node, sender_recv, sender_sent, sender);
+    }
+
+    uint8_t data_packet[SIM_AIR_MAX_PACKET];
+    const int data_length = framing_seal(data_packet, 0, options->size);
+
+    const int64_t end_us = (int64_t)options->seconds*1000000;
+    int64_t next_beacon_us = sim_air_node_time(&air, SIM_MASTER, 0) + options->frame_us;
+
+    for(;;) {
+        // Next thing to happen, in simulation time
+        int64_t next_us = end_us + SIM_DRAIN_US;
+        if(tdma_mode && sim_air_sim_time(&air, SIM_MASTER, next_beacon_us) < next_us)
+            next_us = sim_air_sim_time(&air, SIM_MASTER, next_beacon_us);
+        for(uint8_t node = SIM_FIRST_SENDER; node < SIM_FIRST_SENDER + count; node++) {
+            const int64_t frame_us = sim_air_sim_time(&air, node, senders[node].next_frame_us);
+            if(frame_us < end_us && frame_us < next_us)
+                next_us = frame_us;
+            if(senders[node].wake_us < next_us)
+                next_us = senders[node].wake_us;
+        }
+
+        if(next_us >= end_us + SIM_DRAIN_US)
+            break;
+        sim_air_run_until(&air, next_us);
+
+        // As tdma_beacon_timer_cb() does
+        if(tdma_mode && sim_air_node_time(&air, SIM_MASTER, air.now_us) >= next_beacon_us) {
+            for(int request = 0; request < request_count; request++)
+                tdma_master_request(&master, requests[request]);
+            request_count = 0;
+
+            tdma_beacon_t beacon;
+            const uint32_t now_us = sim_air_node_time(&air, SIM_MASTER, air.now_us);
+            send_control(SIM_MASTER, &beacon, tdma_master_beacon(&master, now_us, now_us, &beacon));
+            next_beacon_us += options->frame_us;
+        }
+
+        for(uint8_t node = SIM_FIRST_SENDER; node < SIM_FIRST_SENDER + count; node++) {
+            sim_sender_t *sender = &senders[node];
+            const int64_t local_us = sim_air_node_time(&air, node, air.now_us);
+
+            if(air.now_us < end_us && local_us >= sender->next_frame_us) {
+                if(air.now_us >= SIM_WARMUP_US)
+                    sender->made += options->burst;
+
+                // The oldest are dropped to make room
+                for(uint8_t packet = 0; packet < options->burst; packet++) {
+                    if(sender->pending == SIM_BACKLOG_FRAMES*options->burst) {
+                        sender->pending_head = (sender->pending_head + 1) % SIM_BACKLOG_MAX;
+                        sender->pending--;
+                        sender->dropped++;
+                    }
+                    sender->made_us[(sender->pending_head + sender->pending++) % SIM_BACKLOG_MAX] = air.now_us;
+                }
+
+                sender->next_frame_us += options->frame_us;
+                sender->wake_us = air.now_us;
+            }
+
+            if(sender->wake_us <= air.now_us)
+                sender_pump(sender, options, data_length);
+        }
+    }
+    sim_air_run_until(&air, end_us + SIM_DRAIN_US);
+
+    uint64_t made = 0;
+    uint64_t received = 0;
+    for(uint8_t node = 0; node < SIM_FIRST_SENDER + count; node++)
+        result.collisions += air.nodes[node].stats.tx_collisions;
+
+    for(uint8_t node = SIM_FIRST_SENDER; node < SIM_FIRST_SENDER + count; node++) {
+        sim_sender_t *sender = &senders[node];
+        made += sender->made;
+        received += sender->received;
+        result.dropped += sender->dropped;
+
+        if(!tdma_mode)
+            continue;
+
+        tdma_schedule_t schedule;
+        clock_sync_t clock;
+        clock_sync_init(&clock);
+        if(tdma_sender_schedule(&sender->tdma, sim_air_node_time(&air, node, air.now_us), &schedule, &clock))
+            result.slots++;
+
+        // Master clock ticks per tick of the sender's, minus one
+        const double skew = (1 + master_ppm*1e-6)/(1 + sender->ppm*1e-6) - 1;
+        const double error_ppm = fabs(clock.skew - skew)*1e6;
+        if(error_ppm > result.skew_error_ppm)
+            result.skew_error_ppm = error_ppm;
+    }
+
+    result.delivered = made > 0 ? (double)received/made : 0;
+    sim_air_free(&air);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    sim_options_t options = {
+        .senders = {4, 8, 12},
+        .runs = 3,
+        .burst = 8,
+        .size = 200,
+        .frame_us = 25000,
+        .guard_us = 300,
+        .ppm = 20,
+        .seconds = 60,
+        .seed = 1,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        const bool value = arg + 1 < argc;
+        if(strcmp(argv[arg], "--senders") == 0 && value) {
+            options.runs = 0;
+            while(arg + 1 < argc && argv[arg + 1][0] != '-' && options.runs < SIM_RUNS_MAX)
+                options.senders[options.runs++] = atoi(argv[++arg]);
+        }
+        else if(strcmp(argv[arg], "--burst") == 0 && value)
+            options.burst = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--size") == 0 && value)
+            options.size = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--frame") == 0 && value)
+            options.frame_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--guard") == 0 && value)
+            options.guard_us = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--ppm") == 0 && value)
+            options.ppm = atof(argv[++arg]);
+        else if(strcmp(argv[arg], "--seconds") == 0 && value)
+            options.seconds = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--seed") == 0 && value)
+            options.seed = atoi(argv[++arg]);
+        else {
+            fprintf(stderr, "Usage: %s [--senders N ...] [--burst N] [--size N] [--frame US] [--guard US]"
+                    " [--ppm N] [--seconds N] [--seed N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const uint16_t max_size = ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t);
+    bool valid = options.runs > 0 && options.burst > 0 && options.burst <= SIM_BURST_MAX && options.size >= sizeof(sim_data_t)
+        && options.size <= max_size && options.frame_us > SIM_BEACON_US && options.seed != 0
+        && options.seconds*1000000ull > SIM_WARMUP_US;
+    for(int run = 0; run < options.runs; run++)
+        valid = valid && options.senders[run] > 0 && options.senders[run] <= SIM_AIR_MAX_NODES - SIM_FIRST_SENDER;
+    if(!valid) {
+        fprintf(stderr, "Need 1 to %u senders, up to %u packets a burst, a size from %u to %u, a frame over %u us, more than %u s"
+                " and a non-zero seed\n", SIM_AIR_MAX_NODES - SIM_FIRST_SENDER, SIM_BURST_MAX, (unsigned)sizeof(sim_data_t),
+                max_size, SIM_BEACON_US, SIM_WARMUP_US/1000000);
+        return 2;
+    }
+
+    printf("%u x %u B every %u us at MCS%u, guard %u us, clocks within %.0f ppm, %u s\n", options.burst,
+           options.size, options.frame_us, SIM_PHY_RATE - 0x10, options.guard_us, options.ppm, options.seconds);
+    printf("%-8s %14s %11s %14s %11s %8s %8s %12s\n", "senders", "free delivered", "collisions", "TDMA delivered",
+           "collisions", "dropped", "slots", "skew error");
+
+    bool pass = true;
+    for(int run = 0; run < options.runs; run++) {
+        const uint8_t count = options.senders[run];
+        const sim_result_t free_result = run_mode(&options, count, false);
+        const sim_result_t tdma_result = run_mode(&options, count, true);
+        if(free_result.delivered < 0 || tdma_result.delivered < 0)
+            return 1;
+
+        printf("%-8u %14.4f %11llu %14.4f %11llu %8llu %5i/%-2u %8.2f ppm\n", count, free_result.delivered,
+               (unsigned long long)free_result.collisions, tdma_result.delivered,
+               (unsigned long long)tdma_result.collisions, (unsigned long long)tdma_result.dropped,
+               tdma_result.slots, count, tdma_result.skew_error_ppm);
+
+        if(tdma_result.delivered < SIM_TDMA_DELIVERED_MIN || tdma_result.delivered < free_result.delivered) {
+            printf("FAIL: %u senders deliver %.4f with TDMA, %.4f free\n", count, tdma_result.delivered,
+                   free_result.delivered);
+            pass = false;
+        }
+        if(tdma_result.slots != count) {
+            printf("FAIL: %i of %u senders have a slot\n", tdma_result.slots, count);
+            pass = false;
+        }
+        if(tdma_result.skew_error_ppm > SIM_SKEW_ERROR_MAX) {
+            printf("FAIL: %u senders get the master's clock rate %.2f ppm wrong\n", count,
+                   tdma_result.skew_error_ppm);
+            pass = false;
+        }
+    }
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,392 @@
+//! Telemetry tests and benchmark
+//!
+//! Checks telemetry.c, the receiver's latency, jitter and loss telemetry:
+//!
+//! * the histogram buckets: every value up to 2^16, and random larger ones,
+//!   is reported within 25% above its true value, exactly below 8, and as
+//!   the maximum from TELEMETRY_HISTOGRAM_LIMIT up
+//! * percentiles of random distributions against the exact percentiles of
+//!   the same values, and that reading a histogram clears it
+//! * sequence accounting: gaps, late frames, duplicates, wrapping and a
+//!   restarted sender, then random streams with drops, swapped pairs and
+//!   repeated frames against the counts they were built with
+//! * latency with a clock offset, jitter and inter-arrival times
+//! * a thread recording while another reports: no value is lost or
+//!   reported twice
+//!
+//! It then times telemetry_record() for a timestamped frame.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/telemetry_test [--frames N]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "telemetry.h"
+#include "bench_util.h"
+
+//! Values in each random distribution
+#define TEST_VALUES                 20000
+
+//! Frames in each random sequence stream
+#define TEST_STREAM_FRAMES          5000
+
+//! Set once the recording thread is done
+static atomic_bool recorder_done;
+
+//! \brief Random number in [0, 1)
+static double random_unit()
+{
+    return (random_next() >> 8)/16777216.0;
+}
+
+//! \brief Check that a reported value is at or above the true one, and within 25%
+static bool within_bucket(uint32_t reported, uint32_t value)
+{
+    return reported >= value && reported - value <= value/4;
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void test_buckets()
+{
+    static telemetry_histogram_t histogram;
+    telemetry_summary_t summary;
+    bool ok = true;
+    bool exact = true;
+
+    // With a larger value also recorded, the median is the top of the
+    // value's bucket, rather than the largest value seen. Past 2^16, the
+    // values are spread out, a few thousand apart.
+    uint32_t step = 1;
+    for(uint32_t value = 0; value < TELEMETRY_HISTOGRAM_LIMIT; value += step) {
+        if(value >= 65536)
+            step = 1 + random_next()%4096;
+
+        telemetry_histogram_add(&histogram, value);
+        telemetry_histogram_add(&histogram, TELEMETRY_HISTOGRAM_LIMIT*2);
+        telemetry_histogram_drain(&histogram, &summary);
+
+        ok &= summary.count == 2 && within_bucket(summary.p50, value) && summary.max == TELEMETRY_HISTOGRAM_LIMIT*2;
+        if(value < 8)
+            exact &= summary.p50 == value;
+    }
+    check(ok, "every value reported within 25% above it");
+    check(exact, "values below 8 reported exactly");
+
+    // The last bucket below the limit isn't the one past it
+    telemetry_histogram_add(&histogram, TELEMETRY_HISTOGRAM_LIMIT - 1);
+    telemetry_histogram_add(&histogram, TELEMETRY_HISTOGRAM_LIMIT*2);
+    telemetry_histogram_drain(&histogram, &summary);
+    check(summary.p50 == TELEMETRY_HISTOGRAM_LIMIT - 1, "largest value below the limit");
+
+    // The last bucket reports the largest value seen
+    telemetry_histogram_add(&histogram, TELEMETRY_HISTOGRAM_LIMIT + 5);
+    telemetry_histogram_add(&histogram, 0xFFFFFFFF);
+    telemetry_histogram_drain(&histogram, &summary);
+    check(summary.p50 == 0xFFFFFFFF && summary.max == 0xFFFFFFFF, "values past the limit report the maximum");
+
+    telemetry_histogram_drain(&histogram, &summary);
+    check(summary.count == 0 && summary.p50 == 0 && summary.p999 == 0 && summary.max == 0, "empty histogram");
+}
+
+//! \brief Check a histogram's percentiles against the exact ones of the same values
+static void check_percentiles(uint32_t *values, uint32_t count, const char *what)
+{
+    static telemetry_histogram_t histogram;
+    for(uint32_t index = 0; index < count; index++)
+        telemetry_histogram_add(&histogram, values[index]);
+
+    telemetry_summary_t summary;
+    telemetry_histogram_drain(&histogram, &summary);
+
+    // Nearest rank percentiles
+    qsort(values, count, sizeof(uint32_t), compare_uint32);
+    const uint32_t p50 = values[(count*500 + 999)/1000 - 1];
+    const uint32_t p99 = values[(count*990 + 999)/1000 - 1];
+    const uint32_t p999 = values[(count*999 + 999)/1000 - 1];
+    const uint32_t max = values[count - 1];
+
+    char message[80];
+    snprintf(message, sizeof(message), "%s percentiles", what);
+    check(summary.count == count && summary.max == max
+          && within_bucket(summary.p50, p50) && within_bucket(summary.p99, p99) && within_bucket(summary.p999, p999)
+          && summary.p999 <= max, message);
+
+    telemetry_histogram_drain(&histogram, &summary);
+    snprintf(message, sizeof(message), "%s cleared once read", what);
+    check(summary.count == 0, message);
+}
+
+static void test_percentiles()
+{
+    static uint32_t values[TEST_VALUES];
+
+    for(int index = 0; index < TEST_VALUES; index++)
+        values[index] = random_next()%100000;
+    check_percentiles(values, TEST_VALUES, "uniform");
+
+    // Frame intervals with a long tail
+    for(int index = 0; index < TEST_VALUES; index++) {
+        const double u = random_unit();
+        values[index] = 22727 + (uint32_t)(u < 0.999 ? 200*u : 500000*u);
+    }
+    check_percentiles(values, TEST_VALUES, "long tail");
+
+    // Two clusters, with the median between them
+    for(int index = 0; index < TEST_VALUES; index++)
+        values[index] = (index%2 ? 900 : 30000) + random_next()%50;
+    check_percentiles(values, TEST_VALUES, "bimodal");
+
+    for(int index = 0; index < 5; index++)
+        values[index] = 3 + index;
+    check_percentiles(values, 5, "few values");
+}
+
+//! \brief Record a list of sequence numbers, a frame period apart, and report
+static void record_sequences(telemetry_t *telemetry, const uint8_t *sequences, int count, telemetry_report_t *report)
+{
+    telemetry_init(telemetry, 1);
+    for(int index = 0; index < count; index++)
+        telemetry_record(telemetry, 0, sequences[index], false, 0, (int64_t)index*22727);
+    telemetry_report(telemetry, 0, report);
+    telemetry_free(telemetry);
+}
+
+static void test_sequences()
+{
+    telemetry_t telemetry;
+    telemetry_report_t report;
+
+    const uint8_t in_order[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    record_sequences(&telemetry, in_order, sizeof(in_order), &report);
+    check(report.frames == 10 && report.lost == 0 && report.reordered == 0 && report.duplicates == 0
+          && report.gap.count == 0 && report.interarrival_us.count == 9, "in order");
+
+    // A gap of three is three lost frames, not one
+    const uint8_t gap[] = { 0, 1, 2, 6, 7 };
+    record_sequences(&telemetry, gap, sizeof(gap), &report);
+    check(report.lost == 3 && report.gap.count == 1 && report.gap.p50 == 3 && report.gap.max == 3, "gap of three");
+
+    const uint8_t gaps[] = { 0, 2, 3, 10, 11, 13 };
+    record_sequences(&telemetry, gaps, sizeof(gaps), &report);
+    check(report.lost == 1 + 6 + 1 && report.gap.count == 3 && report.gap.max == 6, "several gaps");
+
+    // A late frame is taken back off the losses
+    const uint8_t late[] = { 0, 1, 3, 2, 4 };
+    record_sequences(&telemetry, late, sizeof(late), &report);
+    check(report.lost == 0 && report.reordered == 1 && report.frames == 5, "late frame");
+
+    const uint8_t late_in_gap[] = { 0, 4, 2, 5 };
+    record_sequences(&telemetry, late_in_gap, sizeof(late_in_gap), &report);
+    check(report.lost == 2 && report.reordered == 1, "late frame in a longer gap");
+
+    const uint8_t duplicate[] = { 0, 1, 1, 2 };
+    record_sequences(&telemetry, duplicate, sizeof(duplicate), &report);
+    check(report.duplicates == 1 && report.lost == 0 && report.reordered == 0, "duplicate");
+
+    const uint8_t wrap[] = { 253, 254, 255, 0, 1, 2 };
+    record_sequences(&telemetry, wrap, sizeof(wrap), &report);
+    check(report.lost == 0 && report.reordered == 0, "wrap");
+
+    const uint8_t gap_across_wrap[] = { 253, 254, 2, 3 };
+    record_sequences(&telemetry, gap_across_wrap, sizeof(gap_across_wrap), &report);
+    check(report.lost == 3 && report.gap.p50 == 3, "gap across the wrap");
+
+    // Far behind is a restarted sender, not a late frame
+    const uint8_t restart[] = { 100, 101, 102, 10, 11, 12 };
+    record_sequences(&telemetry, restart, sizeof(restart), &report);
+    check(report.lost == 0 && report.reordered == 0 && report.frames == 6, "restarted sender");
+}
+
+static void test_random_streams()
+{
+    static uint8_t sequences[TEST_STREAM_FRAMES*2];
+    bool ok = true;
+
+    for(int stream = 0; stream < 50; stream++) {
+        const double drop = 0.1*random_unit();
+        const double swap = 0.05*random_unit();
+        const double repeat = 0.02*random_unit();
+
+        uint32_t lost = 0;
+        uint32_t swapped = 0;
+        uint32_t repeated = 0;
+        int count = 0;
+        const uint8_t first = random_next();
+
+        for(int frame = 0; frame < TEST_STREAM_FRAMES; frame++) {
+            const uint8_t sequence = first + frame;
+
+            // The first and last frames always arrive, in order, so every loss is seen
+            const bool edge = frame == 0 || frame >= TEST_STREAM_FRAMES - 2;
+            if(!edge && random_unit() < drop) {
+                lost++;
+                continue;
+            }
+
+            // The next frame arrives first
+            if(!edge && random_unit() < swap) {
+                sequences[count++] = sequence + 1;
+                sequences[count++] = sequence;
+                swapped++;
+                frame++;
+                continue;
+            }
+
+            sequences[count++] = sequence;
+            if(random_unit() < repeat) {
+                sequences[count++] = sequence;
+                repeated++;
+            }
+        }
+
+        telemetry_t telemetry;
+        telemetry_report_t report;
+        record_sequences(&telemetry, sequences, count, &report);
+
+        ok &= report.frames == count && report.lost == lost && report.reordered == swapped
+            && report.duplicates == repeated;
+    }
+
+    check(ok, "random streams: lost, reordered and duplicates counted exactly");
+}
+
+static void test_timing()
+{
+    telemetry_t telemetry;
+    telemetry_report_t report;
+
+    // Constant transit time: latency as given, no jitter
+    telemetry_init(&telemetry, 1);
+    for(int frame = 0; frame < 100; frame++)
+        telemetry_record(&telemetry, 0, frame, true, 1000000 + frame*22727, 1000000 + frame*22727 + 500);
+    telemetry_report(&telemetry, 0, &report);
+    check(report.latency_us.count == 100 && within_bucket(report.latency_us.p50, 500) && report.latency_us.max == 500,
+          "latency");
+    check(report.jitter_us.count == 99 && report.jitter_us.max == 0, "no jitter at a constant transit time");
+    check(within_bucket(report.interarrival_us.p50, 22727) && report.interarrival_us.max == 22727, "interarrival");
+
+    // Transit time alternating between 100 and 300us, after the 500us above
+    for(int frame = 100; frame < 200; frame++)
+        telemetry_record(&telemetry, 0, frame, true, frame*22727, frame*22727 + (frame%2 ? 300 : 100));
+    telemetry_report(&telemetry, 0, &report);
+    check(report.jitter_us.count == 100 && report.jitter_us.max == 400 && within_bucket(report.jitter_us.p50, 200),
+          "jitter of an alternating transit time");
+
+    // The sender's clock is 2ms ahead of this one
+    telemetry_set_clock_offset(&telemetry, 2000);
+    for(int frame = 200; frame < 210; frame++)
+        telemetry_record(&telemetry, 0, frame, true, frame*22727 + 2000 + 100, frame*22727 + 900);
+    telemetry_report(&telemetry, 0, &report);
+    check(report.latency_us.count == 10 && report.latency_us.max == 800, "latency with a clock offset");
+
+    // Frames without a timestamp have no latency or jitter
+    for(int frame = 210; frame < 220; frame++)
+        telemetry_record(&telemetry, 0, frame, false, 0, frame*22727);
+    telemetry_report(&telemetry, 0, &report);
+    check(report.latency_us.count == 0 && report.jitter_us.count == 0 && report.interarrival_us.count == 10,
+          "untimestamped frames");
+
+    check(!telemetry_report(&telemetry, 1, &report), "universe out of range");
+    telemetry_free(&telemetry);
+}
+
+static void *recorder(void *context)
+{
+    telemetry_t *telemetry = context;
+    const uint32_t frames = 2000000;
+
+    for(uint32_t frame = 0; frame < frames; frame++)
+        telemetry_record(telemetry, 0, frame, true, frame*1000, frame*1000 + frame%4096);
+
+    atomic_store(&recorder_done, true);
+    return NULL;
+}
+
+static void test_concurrent_report()
+{
+    telemetry_t telemetry;
+    telemetry_init(&telemetry, 1);
+
+    atomic_store(&recorder_done, false);
+    pthread_t thread;
+    pthread_create(&thread, NULL, recorder, &telemetry);
+
+    uint64_t latencies = 0;
+    uint64_t interarrivals = 0;
+    uint32_t reports = 0;
+    telemetry_report_t report;
+    bool done = false;
+    while(!done) {
+        done = atomic_load(&recorder_done);
+        telemetry_report(&telemetry, 0, &report);
+        latencies += report.latency_us.count;
+        interarrivals += report.interarrival_us.count;
+        reports++;
+    }
+    pthread_join(thread, NULL);
+
+    printf("%-22s %u frames in %u reports\n", "concurrent report", report.frames, reports);
+    check(latencies == report.frames && interarrivals == report.frames - 1,
+          "every value reported once while recording");
+    check(report.lost == 0 && report.reordered == 0, "no loss counted while reporting");
+
+    telemetry_free(&telemetry);
+}
+
+static void run_bench(uint32_t frames)
+{
+    telemetry_t telemetry;
+    telemetry_init(&telemetry, 1);
+
+    const int64_t start_ns = time_ns();
+    for(uint32_t frame = 0; frame < frames; frame++)
+        telemetry_record(&telemetry, 0, frame, true, frame*22727, frame*22727 + 300 + (frame & 0xFF));
+    const double record_ns = (double)(time_ns() - start_ns)/frames;
+
+    telemetry_report_t report;
+    telemetry_report(&telemetry, 0, &report);
+    printf("%-22s %.1f ns per timestamped frame (%u frames)\n", "record", record_ns, report.frames);
+
+    telemetry_free(&telemetry);
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t frames = 10000000;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--frames") == 0 && arg + 1 < argc)
+            frames = strtoul(argv[++arg], NULL, 10);
+        else {
+            fprintf(stderr, "Usage: %s [--frames N]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    test_buckets();
+    test_percentiles();
+    test_sequences();
+    test_random_streams();
+    test_timing();
+    test_concurrent_report();
+
+    if(frames > 0)
+        run_bench(frames);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,406 @@
+//! Pipeline trace tests and per-event cost
+//!
+//! Checks trace.c, the lock-free trace ring:
+//!
+//! * on one thread: the init checks, a disabled trace, the ring wrapping
+//!   and dumping its newest records oldest first, a dump into a short
+//!   buffer, and freezing after a trigger: only the first trigger counts,
+//!   exactly post_trigger more records are kept, nothing is recorded after
+//!   that, and the dump ends at the last kept record. Rearming starts over.
+//! * with several recording threads and a trigger from the main thread:
+//!   the frozen dump must not change once the recorders stop, every record
+//!   in it must be complete, each thread's records must be in the order it
+//!   made them, and no more than post_trigger records may follow the
+//!   trigger.
+//!
+//! It then times a record on one thread, on a disabled and on a frozen
+//! trace, and with every thread recording at once.
+//!
+//! With --dump FILE, it also writes a frozen trace of a simulated receive
+//! and transmit pipeline, for tools/trace_decode.py.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/trace_test [--threads N] [--records N] [--dump FILE]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "trace.h"
+#include "bench_util.h"
+
+//! Ring size of the tests
+#define TEST_RECORDS                1024
+
+//! Records kept after a trigger in the tests
+#define TEST_POST_TRIGGER           256
+
+//! Most recording threads
+#define TEST_THREADS_MAX            16
+
+//! Record values of the threaded test are the thread in the top byte and a count below it
+#define TEST_THREAD_SHIFT           24
+
+typedef struct {
+    int threads;
+    uint32_t records;                   //!< Records per thread and per timing loop
+    const char *dump;                   //!< File to write a simulated pipeline trace to, or NULL
+} test_options_t;
+
+static trace_t trace;
+
+//! Dump buffer, big enough for every test ring
+static uint8_t dump_buffer[sizeof(trace_dump_header_t) + TEST_RECORDS*sizeof(trace_record_t)];
+
+//! Set to start the threads all at once
+static atomic_bool threads_go;
+
+//! Records made by each thread, including those refused once frozen
+static uint32_t thread_records[TEST_THREADS_MAX];
+
+//! \brief Dump the trace, and get the header and the records
+//!
+//! \return Number of records, or -1 if the dump failed
+static int dump(trace_dump_header_t *header, const trace_record_t **records)
+{
+    const int length = trace_dump(&trace, dump_buffer, sizeof(dump_buffer));
+    if(length < (int)sizeof(*header))
+        return -1;
+
+    memcpy(header, dump_buffer, sizeof(*header));
+    *records = (const trace_record_t *)(dump_buffer + sizeof(*header));
+    if(header->magic != TRACE_DUMP_MAGIC || header->version != TRACE_DUMP_VERSION
+        || header->record_size != sizeof(trace_record_t)
+        || length != sizeof(*header) + header->record_count*sizeof(trace_record_t))
+        return -1;
+
+    return header->record_count;
+}
+
+//! \brief Record a test event, with its number as the value and the time
+static void record_number(uint8_t event, uint32_t number)
+{
+    trace_record(&trace, event, 0, number, number & 0xFFFF, TRACE_KEY_NONE, 0, 0, number);
+}
+
+//! \brief Check that records hold consecutive numbers
+static bool records_consecutive(const trace_record_t *records, int count, uint32_t first)
+{
+    for(int index = 0; index < count; index++)
+        if(records[index].value != first + index || records[index].time != first + index)
+            return false;
+
+    return true;
+}
+
+static void test_single_thread()
+{
+    trace_dump_header_t header;
+    const trace_record_t *records;
+
+    check(!trace_init(&trace, 1000, 10, 1), "a ring size that isn't a power of two is refused");
+    check(!trace_init(&trace, 64, 64, 1), "keeping the whole ring after a trigger is refused");
+
+    check(trace_init(&trace, 0, 0, 1), "init disabled");
+    record_number(TRACE_RX_CALLBACK, 1);
+    check(!trace_trigger(&trace, 1), "a disabled trace can't be triggered");
+    check(trace_dump(&trace, dump_buffer, sizeof(dump_buffer)) == -1, "a disabled trace has no dump");
+
+    check(trace_init(&trace, TEST_RECORDS, TEST_POST_TRIGGER, 240), "init");
+    check(dump(&header, &records) == 0 && !header.triggered && header.ticks_per_us == 240, "empty dump");
+    check(trace_dump(&trace, dump_buffer, sizeof(header) - 1) == -1, "dump without room for the header fails");
+
+    // Three times around the ring keeps the newest ring full, oldest first
+    for(uint32_t number = 0; number < 3*TEST_RECORDS; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+    check(dump(&header, &records) == TEST_RECORDS && records_consecutive(records, TEST_RECORDS, 2*TEST_RECORDS),
+          "a wrapped ring dumps its newest records in order");
+
+    const int short_length = trace_dump(&trace, dump_buffer, sizeof(header) + 10*sizeof(trace_record_t) + 5);
+    memcpy(&header, dump_buffer, sizeof(header));
+    check(short_length == sizeof(header) + 10*sizeof(trace_record_t) && header.record_count == 10
+          && records_consecutive((const trace_record_t *)(dump_buffer + sizeof(header)), 10, 3*TEST_RECORDS - 10),
+          "a short buffer gets the newest records");
+
+    trace_rearm(&trace);
+    check(dump(&header, &records) == 0, "rearming empties the ring");
+
+    // Trigger part way into the ring: the records before it and post_trigger after it are kept
+    const uint32_t before = 100;
+    for(uint32_t number = 0; number < before; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+    check(trace_trigger(&trace, TRACE_DROP_BAD_CRC), "the first trigger counts");
+    check(!trace_trigger(&trace, TRACE_DROP_BAD_LENGTH), "a second trigger doesn't");
+
+    uint32_t number = before;
+    for(; number < before + TEST_POST_TRIGGER; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+    check(!trace_frozen(&trace), "still recording after post_trigger records");
+    record_number(TRACE_RX_CALLBACK, number++);
+    check(trace_frozen(&trace), "frozen on the record after that");
+    for(; number < 4*TEST_RECORDS; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+
+    check(dump(&header, &records) == before + TEST_POST_TRIGGER && header.triggered
+          && header.trigger_reason == TRACE_DROP_BAD_CRC
+          && records_consecutive(records, before + TEST_POST_TRIGGER, 0),
+          "frozen dump holds the records before the trigger and post_trigger after it");
+
+    // A trigger long after the ring wrapped keeps the last ring full, ending post_trigger after it
+    trace_rearm(&trace);
+    check(dump(&header, &records) == 0 && !header.triggered && !trace_frozen(&trace), "rearm");
+    for(number = 0; number < 5*TEST_RECORDS; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+    check(trace_trigger(&trace, 42), "trigger after rearming");
+    for(; number < 7*TEST_RECORDS; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+    check(dump(&header, &records) == TEST_RECORDS && header.trigger_reason == 42
+          && records_consecutive(records, TEST_RECORDS, 5*TEST_RECORDS + TEST_POST_TRIGGER - TEST_RECORDS),
+          "frozen dump of a wrapped ring ends post_trigger after the trigger");
+
+    free(trace.records);
+}
+
+static void *recorder(void *context)
+{
+    const uint32_t thread = (uint32_t)(intptr_t)context;
+    while(!atomic_load(&threads_go))
+        sched_yield();
+
+    uint32_t count = 0;
+    while(!trace_frozen(&trace)) {
+        trace_record(&trace, TRACE_TX_SEND, thread, count, thread, TRACE_KEY_NONE, 0, 0,
+                     (thread << TEST_THREAD_SHIFT) | count);
+        count++;
+        if(count%64 == 0)
+            sched_yield();
+    }
+
+    thread_records[thread] = count;
+    return NULL;
+}
+
+static void test_threads(const test_options_t *options)
+{
+    if(!trace_init(&trace, TEST_RECORDS, TEST_POST_TRIGGER, 1)) {
+        check(false, "init");
+        return;
+    }
+
+    atomic_store(&threads_go, false);
+    pthread_t threads[TEST_THREADS_MAX];
+    for(int thread = 0; thread < options->threads; thread++)
+        pthread_create(&threads[thread], NULL, recorder, (void *)(intptr_t)thread);
+
+    // Let the recorders fill the ring a few times over, then trigger and
+    // mark the trigger as the transponder does
+    atomic_store(&threads_go, true);
+    while(atomic_load_explicit(&trace.head, memory_order_relaxed) < 4*TEST_RECORDS)
+        sched_yield();
+    check(trace_trigger(&trace, TRACE_DROP_QUEUE_OVERFLOW), "trigger");
+    trace_record(&trace, TRACE_TRIGGER, TEST_THREADS_MAX, 0, 0, TRACE_KEY_NONE, 0, 0, TRACE_DROP_QUEUE_OVERFLOW);
+
+    for(int thread = 0; thread < options->threads; thread++)
+        pthread_join(threads[thread], NULL);
+
+    trace_dump_header_t header;
+    const trace_record_t *records;
+    const int count = dump(&header, &records);
+    uint8_t first[sizeof(dump_buffer)];
+    memcpy(first, dump_buffer, sizeof(dump_buffer));
+
+    // Nothing gets in once frozen
+    record_number(TRACE_RX_CALLBACK, 1);
+    check(trace_dump(&trace, dump_buffer, sizeof(dump_buffer)) > 0
+          && memcmp(first, dump_buffer, sizeof(dump_buffer)) == 0, "a frozen trace doesn't change");
+
+    uint32_t last[TEST_THREADS_MAX];
+    bool seen[TEST_THREADS_MAX] = {false};
+    int trigger_index = -1;
+    uint32_t incomplete = 0;
+    uint32_t out_of_order = 0;
+    for(int index = 0; index < count; index++) {
+        const trace_record_t *record = &records[index];
+        if(record->event == TRACE_TRIGGER && record->core == TEST_THREADS_MAX) {
+            trigger_index = index;
+            continue;
+        }
+
+        const uint32_t thread = record->value >> TEST_THREAD_SHIFT;
+        const uint32_t number = record->value & ((1 << TEST_THREAD_SHIFT) - 1);
+        if(record->event != TRACE_TX_SEND || thread >= options->threads || record->core != thread
+            || record->id != thread || record->time != number) {
+            incomplete++;
+            continue;
+        }
+
+        out_of_order += seen[thread] && number <= last[thread];
+        seen[thread] = true;
+        last[thread] = number;
+    }
+
+    uint64_t recorded = 0;
+    for(int thread = 0; thread < options->threads; thread++)
+        recorded += thread_records[thread];
+
+    printf("%-26s %d threads, %llu records, %d dumped, %d after the trigger\n", "threaded freeze test",
+           options->threads, (unsigned long long)recorded, count,
+           trigger_index >= 0 ? count - 1 - trigger_index : -1);
+    check(count == TEST_RECORDS && header.triggered && header.trigger_reason == TRACE_DROP_QUEUE_OVERFLOW,
+          "frozen dump is a full ring");
+    check(trigger_index >= 0, "the trigger record is kept");
+    check(count - 1 - trigger_index <= TEST_POST_TRIGGER, "no more than post_trigger records follow the trigger");
+    check(incomplete == 0, "every record is complete");
+    check(out_of_order == 0, "each thread's records are in order");
+
+    free(trace.records);
+}
+
+//! \brief Time a record, in nanoseconds
+static double time_records(uint32_t records)
+{
+    const int64_t start_ns = time_ns();
+    for(uint32_t number = 0; number < records; number++)
+        record_number(TRACE_RX_CALLBACK, number);
+
+    return (double)(time_ns() - start_ns)/records;
+}
+
+static void *timed_recorder(void *context)
+{
+    const test_options_t *options = context;
+    while(!atomic_load(&threads_go))
+        sched_yield();
+
+    time_records(options->records);
+    return NULL;
+}
+
+static void run_timing(const test_options_t *options)
+{
+    check(trace_init(&trace, 0, 0, 1), "init disabled");
+    const double disabled_ns = time_records(options->records);
+
+    if(!trace_init(&trace, 4096, 1024, 1)) {
+        check(false, "init");
+        return;
+    }
+
+    // Warm the ring up first
+    time_records(4096);
+    const double record_ns = time_records(options->records);
+
+    trace_trigger(&trace, 1);
+    time_records(2048);
+    const double frozen_ns = time_records(options->records);
+
+    // All threads at once; on a single core this is the same as one after another
+    trace_rearm(&trace);
+    atomic_store(&threads_go, false);
+    pthread_t threads[TEST_THREADS_MAX];
+    for(int thread = 0; thread < options->threads; thread++)
+        pthread_create(&threads[thread], NULL, timed_recorder, (void *)options);
+    const int64_t start_ns = time_ns();
+    atomic_store(&threads_go, true);
+    for(int thread = 0; thread < options->threads; thread++)
+        pthread_join(threads[thread], NULL);
+    const double shared_ns = (double)(time_ns() - start_ns)/((uint64_t)options->records*options->threads);
+
+    printf("%-26s %.1f ns per event\n", "record", record_ns);
+    printf("%-26s %.1f ns per event\n", "record, disabled", disabled_ns);
+    printf("%-26s %.1f ns per event\n", "record, frozen", frozen_ns);
+    printf("%-26s %.1f ns per event, %d threads\n", "record, shared", shared_ns, options->threads);
+
+    free(trace.records);
+}
+
+//! \brief Write a frozen trace of a simulated pipeline, for the decoder
+//!
+//! Packets go through every receive and transmit stage with made up delays,
+//! a bad CRC freezes the trace part way, and the ring wraps before that.
+static void write_dump(const char *path)
+{
+    if(!trace_init(&trace, TEST_RECORDS, TEST_POST_TRIGGER, 1)) {
+        check(false, "init");
+        return;
+    }
+
+    uint32_t time = -500*1000;          // Wraps part way through the records that are kept
+    for(uint16_t id = 1; id < 1000 && !trace_frozen(&trace); id++) {
+        const uint8_t payload[3] = {id & 3, 0, id & 0xFF};
+        const uint16_t key = payload[0] | (payload[1] << 8);
+        if(id%2) {
+            trace_record(&trace, TRACE_RX_CALLBACK, 0, time, id, key, payload[2], 0, 250);
+            trace_record(&trace, TRACE_RX_QUEUED, 0, time + 4, id, key, payload[2], id%5, 0);
+            trace_record(&trace, TRACE_RX_DEQUEUED, 1, time + 40 + id%50, id, key, payload[2], id%5, 0);
+            trace_record(&trace, TRACE_RX_DISPATCH, 1, time + 60 + id%50, id, key, payload[2], 0, 0);
+            trace_record(&trace, TRACE_RX_DONE, 1, time + 75 + id%50, id, key, payload[2], 0, 0);
+        }
+        else {
+            trace_record(&trace, TRACE_TX_SEND, 1, time, id, key, payload[2], 0, 250);
+            trace_record(&trace, TRACE_TX_QUEUED, 1, time + 10, id, key, payload[2], id%7, 0);
+            trace_record(&trace, TRACE_TX_DEQUEUED, 1, time + 300, id, key, payload[2], id%7, 0);
+            trace_record(&trace, TRACE_TX_TRANSPORT, 1, time + 310, id, key, payload[2], 0, 0);
+            trace_record(&trace, TRACE_TX_TRANSPORT_DONE, 1, time + 330, id, key, payload[2], 0, 0);
+            trace_record(&trace, TRACE_TX_COMPLETE, 0, time + 800, id, key, payload[2], 0, 1);
+        }
+
+        if(id == 600) {
+            trace_record(&trace, TRACE_RX_DROP, 0, time + 5, id, TRACE_KEY_NONE, 0, 0, TRACE_DROP_BAD_CRC);
+            if(trace_trigger(&trace, TRACE_DROP_BAD_CRC))
+                trace_record(&trace, TRACE_TRIGGER, 0, time + 5, id, TRACE_KEY_NONE, 0, 0, TRACE_DROP_BAD_CRC);
+        }
+
+        time += 1000;
+    }
+
+    const int length = trace_dump(&trace, dump_buffer, sizeof(dump_buffer));
+    FILE *file = fopen(path, "wb");
+    check(length > 0 && file != NULL && fwrite(dump_buffer, length, 1, file) == 1, "write the dump");
+    if(file != NULL)
+        fclose(file);
+
+    free(trace.records);
+}
+
+int main(int argc, char **argv)
+{
+    test_options_t options = {
+        .threads = 4,
+        .records = 10000000,
+        .dump = NULL,
+    };
+
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--threads") == 0 && arg + 1 < argc)
+            options.threads = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--records") == 0 && arg + 1 < argc)
+            options.records = atoi(argv[++arg]);
+        else if(strcmp(argv[arg], "--dump") == 0 && arg + 1 < argc)
+            options.dump = argv[++arg];
+        else
+            options.threads = 0, arg = argc;
+    }
+
+    if(options.threads < 1 || options.threads > TEST_THREADS_MAX || options.records == 0) {
+        fprintf(stderr, "Usage: %s [--threads 1-%d] [--records N] [--dump FILE]\n", argv[0], TEST_THREADS_MAX);
+        return 2;
+    }
+
+    test_single_thread();
+    test_threads(&options);
+    run_timing(&options);
+    if(options.dump != NULL)
+        write_dump(options.dump);
+
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
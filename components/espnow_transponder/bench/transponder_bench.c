@@ -0,0 +1,604 @@
+//! Host benchmark for the transponder's packet path
+//!
+//! Runs the protocol code of the transponder and the receiver example on
+//! the host, with the ESP-IDF calls stubbed out, and measures each stage
+//! for a range of universe counts and packet sizes:
+//!
+//! - crc: CRC of a whole packet
+//! - encode: framing a universe fragment, including the compression attempt
+//! - check: CRC and length check of a received packet
+//! - compress: payload_compress() of a fragment's payload, on its own
+//! - decompress: payload_decompress() of the compressed payload
+//! - dispatch: the receive path from the WiFi callback to the frame
+//!   callback: check, copy into a pool buffer, queue on the event ring, pop,
+//!   decompress, filter, then reassemble the universe and record it in the
+//!   frame store and telemetry, as the example's receiver does
+//! - end_to_end: encode followed by dispatch
+//!
+//! Each universe is 512 slots, sent as fragments that fill packets of the
+//! given size, with a moving pattern on one channel of three. For each
+//! configuration the packets for several frames are built up front, then
+//! run through the stage repeatedly; the median of several runs is
+//! reported. Allocations are counted by wrapping malloc() and friends at
+//! link time, so only the transponder's own calls are counted.
+//!
+//! Each stage's throughput is also given in MB/s of payload, before
+//! compression, and each configuration's compression ratio is the
+//! compressed length of its payloads over their length. The ratio counts
+//! every payload compressed, while the packet bytes only count the
+//! compressed payloads that framing_build() kept, as it sends a payload
+//! uncompressed if compression doesn't make it shorter.
+//!
+//! It fails if a payload doesn't survive compression, if the last frame of
+//! a configuration doesn't come out of the receive path as it went in, or
+//! if any stage allocates memory.
+//!
+//! This is plain C, and is not built into the firmware. It is a standalone
+//! CMake project, for Linux:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/transponder_bench [--packets N] [--csv FILE] [--json FILE]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "framing.h"
+#include "crc16.h"
+#include "buffer_pool.h"
+#include "event_ring.h"
+#include "payload_codec.h"
+#include "telemetry.h"
+#include "frame_store.h"
+
+#define BENCH_UNIVERSE_SIZE         512
+#define BENCH_FRAMES                8       //!< Frames of packets built for each configuration
+#define BENCH_RUNS                  5       //!< Runs of each stage, the median is reported
+#define BENCH_FRAGMENT_HEADER       4       //!< Key, sequence and fragment number
+
+// Same sizes as the transponder uses
+#define BENCH_QUEUE_SIZE            32
+#define BENCH_POOL_SIZE             (BENCH_QUEUE_SIZE + 4)
+#define BENCH_DECODE_POOL_SIZE      4
+
+#define BENCH_MAX_UNIVERSES         64
+static const uint16_t universe_counts[] = { 1, 4, 16, BENCH_MAX_UNIVERSES };
+static const uint16_t packet_sizes[] = { 16, 64, 128, 250 };
+
+typedef enum {
+    STAGE_CRC,
+    STAGE_ENCODE,
+    STAGE_CHECK,
+    STAGE_COMPRESS,
+    STAGE_DECOMPRESS,
+    STAGE_DISPATCH,
+    STAGE_END_TO_END,
+    STAGE_COUNT,
+} stage_t;
+
+static const char *stage_names[STAGE_COUNT] = { "crc", "encode", "check", "compress", "decompress", "dispatch",
+                                                 "end_to_end" };
+
+typedef struct {
+    stage_t stage;
+    uint16_t universes;
+    uint16_t packet_size;
+    uint64_t packets;                   //!< Packets per run
+    double packets_per_s;
+    double ns_per_packet;
+    double mb_per_s;                    //!< Payload throughput, in MB of uncompressed payload a second
+    double allocs_per_packet;
+    double packet_bytes;                //!< Average length of the built packets, after compression
+    double compression_ratio;           //!< Compressed payload length over payload length
+} result_t;
+
+//! Mirrors the transponder's receive event
+typedef struct {
+    int id;
+    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
+    espnow_transponder_buffer_t *buffer;
+} bench_event_t;
+
+//! Allocation counter, see the malloc() wrappers
+static uint64_t allocations = 0;
+static bool count_allocations = false;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void __real_free(void *pointer);
+
+void *__wrap_malloc(size_t size)
+{
+    allocations += count_allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations += count_allocations;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    allocations += count_allocations;
+    return __real_realloc(pointer, size);
+}
+
+void __wrap_free(void *pointer)
+{
+    __real_free(pointer);
+}
+
+// Receive side state, as in the transponder and the example
+static buffer_pool_t rx_pool;
+static buffer_pool_t decode_pool;
+static event_ring_t event_ring;
+static uint32_t filter_keys[ESPNOW_TRANSPONDER_MAX_KEYS/32];
+static telemetry_t telemetry;
+static frame_store_t frame_store;
+static uint8_t *reassembly;             //!< Universe being reassembled, for each universe
+static int64_t now_us;                  //!< Simulated time, advanced per packet
+static uint64_t frames_received;
+
+// Packets of the current configuration
+static uint16_t universes;
+static uint16_t fragment_size;          //!< Slots per fragment
+static uint16_t fragment_count;         //!< Fragments per universe
+static uint8_t *universe_data;          //!< Slots of every universe, for each frame
+static uint8_t *packets;                //!< Built packets, ESP_NOW_MAX_DATA_LEN apart
+static uint16_t *packet_lengths;
+static uint32_t packet_count;
+static uint8_t *payloads;               //!< Payload of each packet, before compression, ESP_NOW_MAX_DATA_LEN apart
+static uint16_t *payload_lengths;
+static uint8_t *compressed;             //!< Compressed payload of each packet, ESPNOW_TRANSPONDER_MAX_DATA_LENGTH apart
+static uint16_t *compressed_lengths;
+static double payload_bytes;            //!< Average payload length, before compression
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief Fill in the slots of every universe for every frame
+static void generate_frames()
+{
+    for(uint32_t frame = 0; frame < BENCH_FRAMES; frame++) {
+        for(uint16_t universe = 0; universe < universes; universe++) {
+            uint8_t *slots = universe_data + ((size_t)frame*universes + universe)*BENCH_UNIVERSE_SIZE;
+            for(int slot = 0; slot < BENCH_UNIVERSE_SIZE; slot++) {
+                const uint8_t phase = slot/3 + frame*4 + universe*16;
+                slots[slot] = slot % 3 == 0 ? (phase < 128 ? phase : 255 - phase)/2 : 0;
+            }
+        }
+    }
+}
+
+//! \brief Get the payload of one fragment, as artdmx_send() would send it
+//!
+//! \param index Packet number, in frame, universe and fragment order
+//! \param header Buffer for the fragment header
+//! \param parts The header and the fragment's slots are returned here
+static void fragment_parts(uint32_t index, uint8_t header[BENCH_FRAGMENT_HEADER], espnow_transponder_iovec_t parts[2])
+{
+    const uint32_t fragment = index % fragment_count;
+    const uint32_t universe = (index/fragment_count) % universes;
+    const uint32_t frame = index/fragment_count/universes;
+
+    const uint16_t offset = fragment*fragment_size;
+    const uint16_t length = offset + fragment_size <= BENCH_UNIVERSE_SIZE ? fragment_size : BENCH_UNIVERSE_SIZE - offset;
+    header[0] = universe & 0xFF;
+    header[1] = universe >> 8;
+    header[2] = frame;
+    header[3] = fragment;
+    parts[0] = (espnow_transponder_iovec_t){ header, BENCH_FRAGMENT_HEADER };
+    parts[1] = (espnow_transponder_iovec_t){ universe_data + ((size_t)frame*universes + universe)*BENCH_UNIVERSE_SIZE + offset, length };
+}
+
+//! \brief Build the packet of one fragment
+//!
+//! \param packet Buffer to build the packet in
+//! \param index Packet number, in frame, universe and fragment order
+//! \return Packet length
+static int encode(uint8_t *packet, uint32_t index)
+{
+    uint8_t header[BENCH_FRAGMENT_HEADER];
+    espnow_transponder_iovec_t parts[2];
+    fragment_parts(index, header, parts);
+
+    return framing_build(packet, ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t), parts, 2, true,
+                         ESPNOW_TRANSPONDER_CLASS_REALTIME, NULL, NULL, NULL);
+}
+
+//! \brief Take a received fragment, as the example's receiver does with a universe
+static void receive_fragment(const uint8_t *payload, uint16_t length)
+{
+    const uint16_t universe = payload[0] | payload[1] << 8;
+    const uint8_t sequence = payload[2];
+    const uint16_t offset = payload[3]*fragment_size;
+    if(universe >= universes || offset + length - BENCH_FRAGMENT_HEADER > BENCH_UNIVERSE_SIZE)
+        return;
+
+    uint8_t *slots = reassembly + (size_t)universe*BENCH_UNIVERSE_SIZE;
+    memcpy(slots + offset, payload + BENCH_FRAGMENT_HEADER, length - BENCH_FRAGMENT_HEADER);
+
+    if(payload[3] == fragment_count - 1) {
+        telemetry_record(&telemetry, universe, sequence, false, 0, now_us);
+        frame_store_publish(&frame_store, universe, sequence, slots, BENCH_UNIVERSE_SIZE, now_us);
+        frames_received++;
+    }
+}
+
+//! \brief Run a received packet through the receive path
+static void dispatch(const uint8_t *packet, uint16_t packet_length)
+{
+    now_us += 10;
+
+    // WiFi callback
+    if(framing_check(packet, packet_length) != FRAMING_OK)
+        return;
+
+    espnow_transponder_buffer_t *buffer = buffer_pool_alloc(&rx_pool);
+    if(buffer == NULL)
+        return;
+
+    const espnow_transponder_packet_t *header = (const espnow_transponder_packet_t *)packet;
+    memcpy(buffer->data, packet, packet_length);
+    buffer->offset = sizeof(espnow_transponder_packet_t);
+    buffer->length = header->data_length;
+
+    bench_event_t event = { .buffer = buffer };
+    bench_event_t dropped;
+    if(event_ring_push(&event_ring, &event, &dropped) != EVENT_RING_PUSHED)
+        espnow_transponder_buffer_release(dropped.buffer);
+
+    // Transponder task
+    if(!event_ring_pop(&event_ring, &event))
+        return;
+
+    buffer = event.buffer;
+    if(header->flags & ESPNOW_TRANSPONDER_FLAG_COMPRESSED) {
+        espnow_transponder_buffer_t *decoded = buffer_pool_alloc(&decode_pool);
+        const int length = framing_decompress(espnow_transponder_buffer_data(buffer), buffer->length,
+                                              decoded->data, decode_pool.slot_size);
+        espnow_transponder_buffer_release(buffer);
+        buffer = decoded;
+        if(length < 0) {
+            espnow_transponder_buffer_release(buffer);
+            return;
+        }
+        buffer->length = length;
+    }
+
+    const uint8_t *payload = espnow_transponder_buffer_data(buffer);
+    const uint16_t key = payload[0] | payload[1] << 8;
+    if(filter_keys[key/32] & (1u << (key%32)))
+        receive_fragment(payload, buffer->length);
+
+    espnow_transponder_buffer_release(buffer);
+}
+
+//! \brief Run a stage over every packet once
+//!
+//! \return Checksum, so that nothing can be optimized away
+static uint32_t run_stage(stage_t stage)
+{
+    uint32_t checksum = 0;
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    uint8_t payload[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+
+    for(uint32_t index = 0; index < packet_count; index++) {
+        const uint8_t *built = packets + (size_t)index*ESP_NOW_MAX_DATA_LEN;
+        const uint16_t length = packet_lengths[index];
+
+        switch(stage) {
+        case STAGE_CRC:
+            checksum += crc16_update(CRC16_INIT, built, length);
+            break;
+
+        case STAGE_ENCODE:
+            checksum += encode(packet, index);
+            break;
+
+        case STAGE_CHECK:
+            checksum += framing_check(built, length);
+            break;
+
+        case STAGE_COMPRESS:
+            checksum += payload_compress(payloads + (size_t)index*ESP_NOW_MAX_DATA_LEN, payload_lengths[index],
+                                         payload, sizeof(payload));
+            break;
+
+        case STAGE_DECOMPRESS:
+            checksum += payload_decompress(compressed + (size_t)index*ESPNOW_TRANSPONDER_MAX_DATA_LENGTH,
+                                           compressed_lengths[index], payload, sizeof(payload));
+            break;
+
+        case STAGE_DISPATCH:
+            dispatch(built, length);
+            break;
+
+        case STAGE_END_TO_END: {
+            const int packet_length = encode(packet, index);
+            dispatch(packet, packet_length);
+            break;
+        }
+
+        default:
+            break;
+        }
+    }
+
+    return checksum + frames_received;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    const double x = *(const double *)a;
+    const double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+//! \brief Measure one stage of the current configuration
+static void measure(stage_t stage, uint64_t min_packets, uint32_t *checksum, result_t *result)
+{
+    const uint32_t repeats = (min_packets + packet_count - 1)/packet_count;
+
+    // Warm up the caches and branch predictors
+    *checksum += run_stage(stage);
+
+    double ns_per_packet[BENCH_RUNS];
+    uint64_t run_allocations = 0;
+    for(int run = 0; run < BENCH_RUNS; run++) {
+        allocations = 0;
+        count_allocations = true;
+        const int64_t start_ns = time_ns();
+        for(uint32_t repeat = 0; repeat < repeats; repeat++)
+            *checksum += run_stage(stage);
+        const int64_t elapsed_ns = time_ns() - start_ns;
+        count_allocations = false;
+
+        ns_per_packet[run] = (double)elapsed_ns/repeats/packet_count;
+        run_allocations += allocations;
+    }
+    qsort(ns_per_packet, BENCH_RUNS, sizeof(double), compare_double);
+
+    result->stage = stage;
+    result->packets = (uint64_t)repeats*packet_count;
+    result->ns_per_packet = ns_per_packet[BENCH_RUNS/2];
+    result->packets_per_s = 1e9/result->ns_per_packet;
+    result->mb_per_s = result->packets_per_s*payload_bytes/1e6;
+    result->allocs_per_packet = (double)run_allocations/BENCH_RUNS/result->packets;
+}
+
+//! \brief Compress the payload of every packet on its own, and check that it decompresses
+//!
+//! \return Compression ratio
+static double compress_payloads()
+{
+    uint64_t total_length = 0;
+    uint64_t total_compressed = 0;
+    for(uint32_t index = 0; index < packet_count; index++) {
+        uint8_t header[BENCH_FRAGMENT_HEADER];
+        espnow_transponder_iovec_t parts[2];
+        fragment_parts(index, header, parts);
+
+        uint8_t *payload = payloads + (size_t)index*ESP_NOW_MAX_DATA_LEN;
+        memcpy(payload, parts[0].data, parts[0].length);
+        memcpy(payload + parts[0].length, parts[1].data, parts[1].length);
+        payload_lengths[index] = parts[0].length + parts[1].length;
+
+        const int length = payload_compress(payload, payload_lengths[index],
+                                            compressed + (size_t)index*ESPNOW_TRANSPONDER_MAX_DATA_LENGTH,
+                                            ESPNOW_TRANSPONDER_MAX_DATA_LENGTH);
+        uint8_t decompressed[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+        if(length < 0
+            || payload_decompress(compressed + (size_t)index*ESPNOW_TRANSPONDER_MAX_DATA_LENGTH, length,
+                                  decompressed, sizeof(decompressed)) != payload_lengths[index]
+            || memcmp(decompressed, payload, payload_lengths[index]) != 0) {
+            fprintf(stderr, "Payload %u doesn't survive compression\n", index);
+            exit(1);
+        }
+
+        compressed_lengths[index] = length;
+        total_length += payload_lengths[index];
+        total_compressed += length;
+    }
+
+    payload_bytes = (double)total_length/packet_count;
+    return (double)total_compressed/total_length;
+}
+
+//! \brief Set up a configuration, and build its packets
+//!
+//! \return Average packet length
+static double configure(uint16_t universe_count, uint16_t packet_size)
+{
+    universes = universe_count;
+    fragment_size = packet_size - sizeof(espnow_transponder_packet_t) - BENCH_FRAGMENT_HEADER;
+    fragment_count = (BENCH_UNIVERSE_SIZE + fragment_size - 1)/fragment_size;
+    packet_count = BENCH_FRAMES*universes*fragment_count;
+
+    universe_data = malloc((size_t)BENCH_FRAMES*universes*BENCH_UNIVERSE_SIZE);
+    packets = malloc((size_t)packet_count*ESP_NOW_MAX_DATA_LEN);
+    packet_lengths = malloc(packet_count*sizeof(uint16_t));
+    reassembly = malloc((size_t)universes*BENCH_UNIVERSE_SIZE);
+    payloads = malloc((size_t)packet_count*ESP_NOW_MAX_DATA_LEN);
+    payload_lengths = malloc(packet_count*sizeof(uint16_t));
+    compressed = malloc((size_t)packet_count*ESPNOW_TRANSPONDER_MAX_DATA_LENGTH);
+    compressed_lengths = malloc(packet_count*sizeof(uint16_t));
+    if(universe_data == NULL || packets == NULL || packet_lengths == NULL || reassembly == NULL
+        || payloads == NULL || payload_lengths == NULL || compressed == NULL || compressed_lengths == NULL) {
+        fprintf(stderr, "Could not allocate memory for %u universes\n", universes);
+        exit(1);
+    }
+
+    memset(filter_keys, 0, sizeof(filter_keys));
+    for(uint16_t universe = 0; universe < universes; universe++)
+        filter_keys[universe/32] |= 1u << (universe%32);
+
+    generate_frames();
+
+    uint64_t total_length = 0;
+    for(uint32_t index = 0; index < packet_count; index++) {
+        packet_lengths[index] = encode(packets + (size_t)index*ESP_NOW_MAX_DATA_LEN, index);
+        total_length += packet_lengths[index];
+    }
+
+    // Check that the packets make it through the receive path intact
+    run_stage(STAGE_DISPATCH);
+    const uint8_t *last_frame = universe_data + (size_t)(BENCH_FRAMES - 1)*universes*BENCH_UNIVERSE_SIZE;
+    if(memcmp(reassembly, last_frame, (size_t)universes*BENCH_UNIVERSE_SIZE) != 0) {
+        fprintf(stderr, "Received data doesn't match for %u universes, %u byte packets\n", universes, packet_size);
+        exit(1);
+    }
+
+    return (double)total_length/packet_count;
+}
+
+//! \brief Free a configuration
+static void unconfigure()
+{
+    free(universe_data);
+    free(packets);
+    free(packet_lengths);
+    free(reassembly);
+    free(payloads);
+    free(payload_lengths);
+    free(compressed);
+    free(compressed_lengths);
+}
+
+static void write_csv(FILE *file, const result_t *results, size_t result_count)
+{
+    fprintf(file, "stage,universes,packet_size,packets,packets_per_s,ns_per_packet,mb_per_s,allocs_per_packet,"
+            "packet_bytes,compression_ratio\n");
+    for(size_t index = 0; index < result_count; index++) {
+        const result_t *result = &results[index];
+        fprintf(file, "%s,%u,%u,%llu,%.0f,%.2f,%.2f,%.4f,%.1f,%.3f\n", stage_names[result->stage],
+                result->universes, result->packet_size, (unsigned long long)result->packets, result->packets_per_s,
+                result->ns_per_packet, result->mb_per_s, result->allocs_per_packet, result->packet_bytes,
+                result->compression_ratio);
+    }
+}
+
+static void write_json(FILE *file, const result_t *results, size_t result_count)
+{
+    fprintf(file, "{\n  \"benchmark\": \"transponder\",\n  \"universe_size\": %i,\n  \"results\": [\n",
+            BENCH_UNIVERSE_SIZE);
+    for(size_t index = 0; index < result_count; index++) {
+        const result_t *result = &results[index];
+        fprintf(file, "    {\"stage\": \"%s\", \"universes\": %u, \"packet_size\": %u, \"packets\": %llu, "
+                "\"packets_per_s\": %.0f, \"ns_per_packet\": %.2f, \"mb_per_s\": %.2f, "
+                "\"allocs_per_packet\": %.4f, \"packet_bytes\": %.1f, \"compression_ratio\": %.3f}%s\n",
+                stage_names[result->stage], result->universes, result->packet_size,
+                (unsigned long long)result->packets, result->packets_per_s, result->ns_per_packet,
+                result->mb_per_s, result->allocs_per_packet, result->packet_bytes, result->compression_ratio,
+                index + 1 < result_count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+//! \brief Write the results to a file, with the given writer
+static int write_results(const char *path, void (*writer)(FILE *, const result_t *, size_t),
+                         const result_t *results, size_t result_count)
+{
+    FILE *file = fopen(path, "w");
+    if(file == NULL) {
+        fprintf(stderr, "Could not open %s\n", path);
+        return 1;
+    }
+
+    writer(file, results, result_count);
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t min_packets = 200000;
+    const char *csv_path = NULL;
+    const char *json_path = NULL;
+    for(int arg = 1; arg < argc; arg++) {
+        if(strcmp(argv[arg], "--packets") == 0 && arg + 1 < argc)
+            min_packets = strtoull(argv[++arg], NULL, 10);
+        else if(strcmp(argv[arg], "--csv") == 0 && arg + 1 < argc)
+            csv_path = argv[++arg];
+        else if(strcmp(argv[arg], "--json") == 0 && arg + 1 < argc)
+            json_path = argv[++arg];
+        else {
+            fprintf(stderr, "Usage: %s [--packets N] [--csv FILE] [--json FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if(buffer_pool_init(&rx_pool, ESP_NOW_MAX_DATA_LEN, BENCH_POOL_SIZE) != ESP_OK
+        || buffer_pool_init(&decode_pool, ESPNOW_TRANSPONDER_MAX_DATA_LENGTH, BENCH_DECODE_POOL_SIZE) != ESP_OK
+        || event_ring_init(&event_ring, sizeof(bench_event_t), BENCH_QUEUE_SIZE, ESPNOW_TRANSPONDER_DROP_OLDEST) != ESP_OK
+        || !telemetry_init(&telemetry, BENCH_MAX_UNIVERSES)
+        || frame_store_init(&frame_store, BENCH_MAX_UNIVERSES) != ESP_OK) {
+        fprintf(stderr, "Could not allocate memory for the receive path\n");
+        return 1;
+    }
+
+    const size_t config_count = sizeof(universe_counts)/sizeof(universe_counts[0])
+        * sizeof(packet_sizes)/sizeof(packet_sizes[0]);
+    result_t *results = calloc(config_count*STAGE_COUNT, sizeof(result_t));
+    if(results == NULL)
+        return 1;
+
+    printf("%-10s %9s %6s %12s %10s %8s %12s %8s %6s\n", "stage", "universes", "size", "packets/s", "ns/packet",
+           "MB/s", "allocs/pkt", "bytes", "ratio");
+
+    size_t result_count = 0;
+    uint32_t checksum = 0;
+    for(size_t universe_index = 0; universe_index < sizeof(universe_counts)/sizeof(universe_counts[0]); universe_index++) {
+        for(size_t size_index = 0; size_index < sizeof(packet_sizes)/sizeof(packet_sizes[0]); size_index++) {
+            const double packet_bytes = configure(universe_counts[universe_index], packet_sizes[size_index]);
+            const double compression_ratio = compress_payloads();
+
+            for(stage_t stage = 0; stage < STAGE_COUNT; stage++) {
+                result_t *result = &results[result_count++];
+                measure(stage, min_packets, &checksum, result);
+                result->universes = universe_counts[universe_index];
+                result->packet_size = packet_sizes[size_index];
+                result->packet_bytes = packet_bytes;
+                result->compression_ratio = compression_ratio;
+
+                printf("%-10s %9u %6u %12.0f %10.2f %8.1f %12.4f %8.1f %6.3f\n", stage_names[stage],
+                       result->universes, result->packet_size, result->packets_per_s, result->ns_per_packet,
+                       result->mb_per_s, result->allocs_per_packet, result->packet_bytes, result->compression_ratio);
+            }
+
+            unconfigure();
+        }
+    }
+    printf("checksum %08x, %llu universe frames received\n", checksum, (unsigned long long)frames_received);
+
+    // The packet path runs from fixed pools, and must not touch the heap
+    bool pass = true;
+    for(size_t index = 0; index < result_count; index++) {
+        const result_t *result = &results[index];
+        if(result->allocs_per_packet > 0) {
+            printf("FAIL: %s allocates, %u universes, %u byte packets\n", stage_names[result->stage],
+                   result->universes, result->packet_size);
+            pass = false;
+        }
+    }
+
+    int ret = 0;
+    if(csv_path != NULL)
+        ret |= write_results(csv_path, write_csv, results, result_count);
+    if(json_path != NULL)
+        ret |= write_results(json_path, write_json, results, result_count);
+
+    free(results);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? ret : 1;
+}
@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "esp_log.h"
+
+#include "buffer_pool.h"
+
+static const char *TAG = "espnow_pool";
+
+esp_err_t buffer_pool_init(buffer_pool_t *pool, uint16_t slot_size, uint16_t slot_count) {
+    // Keep each slot header word aligned
+    const uint16_t slot_stride = (sizeof(espnow_transponder_buffer_t) + slot_size + 3) & ~3;
+
+    pool->slots = calloc(slot_count, slot_stride);
+    pool->free = calloc(slot_count, sizeof(espnow_transponder_buffer_t *));
+
+    if(pool->slots == NULL || pool->free == NULL) {
+        ESP_LOGE(TAG, "Could not allocate %i slots", slot_count);
+        free(pool->slots);
+        free(pool->free);
+        pool->slots = NULL;
+        pool->free = NULL;
+        return ESP_ERR_NO_MEM;
+    }
+
+    vPortCPUInitializeMutex(&pool->lock);
+
+    for(int i = 0; i < slot_count; i++) {
+        espnow_transponder_buffer_t *buffer = (espnow_transponder_buffer_t *)(pool->slots + i*slot_stride);
+        buffer->pool = pool;
+        pool->free[i] = buffer;
+    }
+
+    pool->slot_size = slot_size;
+    pool->slot_stride = slot_stride;
+    pool->slot_count = slot_count;
+    pool->free_count = slot_count;
+    pool->free_min = slot_count;
+
+    return ESP_OK;
+}
+
+espnow_transponder_buffer_t *buffer_pool_alloc(buffer_pool_t *pool) {
+    espnow_transponder_buffer_t *buffer = NULL;
+
+    portENTER_CRITICAL(&pool->lock);
+    if(pool->free_count > 0) {
+        buffer = pool->free[--pool->free_count];
+        buffer->refcount = 1;
+
+        if(pool->free_count < pool->free_min)
+            pool->free_min = pool->free_count;
+    }
+    portEXIT_CRITICAL(&pool->lock);
+
+    if(buffer != NULL) {
+        buffer->offset = 0;
+        buffer->length = 0;
+    }
+
+    return buffer;
+}
+
+uint16_t buffer_pool_free_count(buffer_pool_t *pool) {
+    return pool->free_count;
+}
+
+void espnow_transponder_buffer_retain(espnow_transponder_buffer_t *buffer) {
+    buffer_pool_t *pool = buffer->pool;
+
+    portENTER_CRITICAL(&pool->lock);
+    assert(buffer->refcount > 0);
+    buffer->refcount++;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+void espnow_transponder_buffer_release(espnow_transponder_buffer_t *buffer) {
+    buffer_pool_t *pool = buffer->pool;
+
+    portENTER_CRITICAL(&pool->lock);
+    assert(buffer->refcount > 0);
+    if(--buffer->refcount == 0)
+        pool->free[pool->free_count++] = buffer;
+    portEXIT_CRITICAL(&pool->lock);
+}
+
+const uint8_t *espnow_transponder_buffer_data(const espnow_transponder_buffer_t *buffer) {
+    return buffer->data + buffer->offset;
+}
+
+uint16_t espnow_transponder_buffer_length(const espnow_transponder_buffer_t *buffer) {
+    return buffer->length;
+}
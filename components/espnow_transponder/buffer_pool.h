@@ -0,0 +1,58 @@
+#pragma once
+
+//! Fixed-size packet buffer pool
+//!
+//! Replaces per-packet malloc()/free() on the radio path. All slots are
+//! handed to the pool once at startup, and then recycled through a free list.
+//! Slots are reference counted, so that a receiver can hold on to a packet
+//! after its callback returns without copying it again.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+
+#include "espnow_transponder.h"
+
+struct espnow_transponder_buffer {
+    struct buffer_pool *pool;           //!< Pool that this slot belongs to
+    uint16_t refcount;                  //!< Number of outstanding references
+    uint16_t offset;                    //!< Start of the user payload in data[]
+    uint16_t length;                    //!< Length of the user payload
+    uint16_t trace_id;                  //!< Identifies the packet in the pipeline trace
+    uint32_t queued_us;                 //!< Time the packet was queued, for the class latency. Wraps.
+    uint8_t data[];                     //!< Slot storage, slot_size bytes
+};
+
+typedef struct buffer_pool {
+    uint8_t *slots;                     //!< Slot storage, slot_count entries of slot_stride bytes
+    espnow_transponder_buffer_t **free; //!< Stack of free slots
+    uint16_t slot_size;                 //!< Size of the data area in each slot
+    uint16_t slot_stride;               //!< Distance between slots in the storage
+    uint16_t slot_count;                //!< Total number of slots
+    uint16_t free_count;                //!< Number of slots on the free stack
+    uint16_t free_min;                  //!< Low water mark of free_count
+    portMUX_TYPE lock;                  //!< Protects free stack and refcounts
+} buffer_pool_t;
+
+//! \brief Allocate the slot storage for a pool
+//!
+//! This should be called once at startup, as it is the only place the pool
+//! touches the heap.
+//!
+//! \param pool Pool to initialize
+//! \param slot_size Size of the data area in each slot
+//! \param slot_count Number of slots to allocate
+//! \return ESP_OK if successful, ESP_ERR_NO_MEM if the slots could not be allocated
+esp_err_t buffer_pool_init(buffer_pool_t *pool, uint16_t slot_size, uint16_t slot_count);
+
+//! \brief Take a free slot from the pool
+//!
+//! The returned slot has a reference count of 1. This is safe to call from
+//! the WiFi task.
+//!
+//! \param pool Pool to allocate from
+//! \return Slot, or NULL if the pool is exhausted
+espnow_transponder_buffer_t *buffer_pool_alloc(buffer_pool_t *pool);
+
+//! \brief Get the number of free slots in a pool
+uint16_t buffer_pool_free_count(buffer_pool_t *pool);
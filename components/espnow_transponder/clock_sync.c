@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "clock_sync.h"
+
+// A sample further than this from the estimate resets it
+#define CLOCK_SYNC_RESET_US         5000
+
+// The estimate moves by the error divided by this, for a sample that shows
+// the remote clock ahead of the estimate, and for one that shows it behind
+#define CLOCK_SYNC_DIVISOR_AHEAD    2
+#define CLOCK_SYNC_DIVISOR_BEHIND   16
+
+// The rate is measured over at least this long
+#define CLOCK_SYNC_BASELINE_US      2000000
+
+// Weight of a new rate measurement
+#define CLOCK_SYNC_SKEW_SMOOTHING   0.25f
+
+// Largest believable rate difference; crystals are specified to 20 ppm or so
+#define CLOCK_SYNC_MAX_SKEW         0.0005f
+
+void clock_sync_init(clock_sync_t *sync)
+{
+    memset(sync, 0, sizeof(*sync));
+}
+
+//! \brief Start over from a single sample
+static void clock_sync_reset(clock_sync_t *sync, int64_t local_us, int64_t remote_us)
+{
+    sync->valid = true;
+    sync->local_us = local_us;
+    sync->remote_us = remote_us;
+    sync->anchor_local_us = local_us;
+    sync->anchor_remote_us = remote_us;
+    sync->skew = 0;
+    sync->error_us = 0;
+    sync->samples = 1;
+}
+
+void clock_sync_sample(clock_sync_t *sync, int64_t local_us, uint32_t remote_us)
+{
+    if(!sync->valid) {
+        clock_sync_reset(sync, local_us, remote_us);
+        return;
+    }
+
+    const int64_t estimate_us = clock_sync_remote(sync, local_us);
+    const int64_t sample_us = clock_sync_unwrap(sync, local_us, remote_us);
+    const int64_t error_us = sample_us - estimate_us;
+
+    if(error_us > CLOCK_SYNC_RESET_US || error_us < -CLOCK_SYNC_RESET_US) {
+        sync->resets++;
+        clock_sync_reset(sync, local_us, sample_us);
+        return;
+    }
+
+    sync->error_us = error_us;
+    sync->remote_us = estimate_us
+        + error_us/(error_us > 0 ? CLOCK_SYNC_DIVISOR_AHEAD : CLOCK_SYNC_DIVISOR_BEHIND);
+    sync->local_us = local_us;
+    sync->samples++;
+
+    // Measure the rate between the anchor and the current estimate, which
+    // has had most of the delay jitter filtered out already
+    const int64_t baseline_us = local_us - sync->anchor_local_us;
+    if(baseline_us >= CLOCK_SYNC_BASELINE_US) {
+        float skew = (float)((sync->remote_us - sync->anchor_remote_us) - baseline_us)/baseline_us;
+        if(skew > CLOCK_SYNC_MAX_SKEW)
+            skew = CLOCK_SYNC_MAX_SKEW;
+        else if(skew < -CLOCK_SYNC_MAX_SKEW)
+            skew = -CLOCK_SYNC_MAX_SKEW;
+
+        sync->skew += CLOCK_SYNC_SKEW_SMOOTHING*(skew - sync->skew);
+        sync->anchor_local_us = local_us;
+        sync->anchor_remote_us = sync->remote_us;
+    }
+}
+
+int64_t clock_sync_remote(const clock_sync_t *sync, int64_t local_us)
+{
+    const int64_t elapsed_us = local_us - sync->local_us;
+    return sync->remote_us + elapsed_us + (int64_t)(elapsed_us*sync->skew);
+}
+
+int64_t clock_sync_local(const clock_sync_t *sync, int64_t remote_us)
+{
+    const int64_t elapsed_us = remote_us - sync->remote_us;
+    return sync->local_us + elapsed_us - (int64_t)(elapsed_us*sync->skew);
+}
+
+int64_t clock_sync_unwrap(const clock_sync_t *sync, int64_t local_us, uint32_t remote_us)
+{
+    const int64_t estimate_us = clock_sync_remote(sync, local_us);
+    return estimate_us + (int32_t)(remote_us - (uint32_t)estimate_us);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+//! Control messages exchanged between transponders
+//!
+//! Control messages travel in packets with ESPNOW_TRANSPONDER_FLAG_CONTROL
+//! set, and are handled by the transponder itself rather than passed to the
+//! receive callback. The first byte of every message is its type; the
+//! message layouts are defined by the modules that use them.
+
+//! Control message types
+typedef enum {
+    CONTROL_SENDER_REPORT = 1,          //!< control_sender_report_t, see rate_control.h
+    CONTROL_LOSS_REPORT = 2,            //!< control_loss_report_t, see rate_control.h
+    CONTROL_BEACON = 3,                 //!< tdma_beacon_t, see tdma.h
+    CONTROL_SLOT_REQUEST = 4,           //!< tdma_slot_request_t, see tdma.h
+} control_type_t;
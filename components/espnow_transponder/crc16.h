@@ -0,0 +1,39 @@
+#pragma once
+
+//! Table driven CRC16
+//!
+//! Bit compatible with the ESP32 ROM crc16_le() (reflected polynomial
+//! 0x1021, with the CRC inverted on entry and exit), but usable on any
+//! platform. Because of the inversions, CRCs can be chained:
+//! crc16_update(crc16_update(crc, a), b) is the CRC of a followed by b. This
+//! allows a packet to be checked piece by piece, for instance to treat its
+//! CRC field as zero without modifying the packet.
+
+#include <stdint.h>
+
+//! Initial CRC value. This matches crc16_le(UINT16_MAX, ...).
+#define CRC16_INIT  UINT16_MAX
+
+//! \brief Add data to a CRC
+//!
+//! \param crc CRC of the preceding data, or CRC16_INIT
+//! \param data Data to add
+//! \param length Length of the data
+//! \return Updated CRC
+uint16_t crc16_update(uint16_t crc, const uint8_t *data, uint32_t length);
+
+//! \brief Add zero bytes to a CRC
+//!
+//! \param crc CRC of the preceding data, or CRC16_INIT
+//! \param length Number of zero bytes to add
+//! \return Updated CRC
+uint16_t crc16_update_zeros(uint16_t crc, uint32_t length);
+
+//! \brief Copy data, adding it to a CRC in the same pass
+//!
+//! \param crc CRC of the preceding data, or CRC16_INIT
+//! \param dest Destination buffer
+//! \param src Data to copy and add
+//! \param length Length of the data
+//! \return Updated CRC
+uint16_t crc16_update_copy(uint16_t crc, uint8_t *dest, const uint8_t *src, uint32_t length);
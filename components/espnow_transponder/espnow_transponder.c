@@ -1,17 +1,32 @@
 #include <string.h>
+#include <stddef.h>
+#include <stdatomic.h>
 #include <assert.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
-#include "nvs_flash.h"
-#include "esp_event_loop.h"
-#include "esp_wifi.h"
+#include "freertos/queue.h"
+#include "esp_timer.h"
 #include "esp_log.h"
 #include "esp_now.h"
-#include "rom/crc.h"
+#include "esp_ipc.h"
+#include "esp_clk.h"
+#include "esp_system.h"
+#include "xtensa/hal.h"
 
 #include "espnow_transponder.h"
-
-#include "esp_wifi_internal.h"
+#include "espnow_transponder_transport.h"
+#include "packet.h"
+#include "buffer_pool.h"
+#include "event_ring.h"
+#include "tx_pacer.h"
+#include "framing.h"
+#include "fec.h"
+#include "stats.h"
+#include "trace.h"
+#include "rate_control.h"
+#include "tdma.h"
+#include "relay.h"
+#include "traffic_class.h"
 
 static const char *TAG = "espnow";
 
@@ -22,147 +37,647 @@ static const char *TAG = "espnow";
         return ret; \
     }
 
-TaskHandle_t * espnow_transponder_task_hdl = NULL;
-
-static espnow_transponder_stats_t espnow_transponder_stats;
-
-//! Broadcast address
-static const uint8_t broadcast_mac[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+static TaskHandle_t espnow_transponder_task_hdl = NULL;
+static TaskHandle_t espnow_transponder_tx_task_hdl = NULL;
+static TaskHandle_t espnow_transponder_relay_task_hdl = NULL;
+
+// Statistics, in one block for each context that updates them
+static stats_block_t wifi_stats;        //!< WiFi task, from the transport callbacks
+static stats_block_t task_stats;        //!< Transponder task
+static stats_block_t sender_stats;      //!< Task that calls espnow_transponder_send()
+static stats_block_t tx_task_stats;     //!< Transmit scheduler task
+static stats_block_t tdma_stats;        //!< TDMA beacon timer
+static stats_block_t relay_stats;       //!< Relay task
+
+// Rates over the last complete window, written by the rate timer
+static stats_block_t rate_stats;
+static espnow_transponder_stats_t rate_window_start;
+static int64_t rate_window_start_us;
+static esp_timer_handle_t rate_timer = NULL;
+
+// Pipeline trace. Time stamps are CPU cycles, offset on each core so that
+// they line up with esp_timer.
+static trace_t trace;
+static uint32_t trace_cycle_offset[portNUM_PROCESSORS];
+static atomic_uint trace_next_id;
+static bool trace_freeze_on_error = false;
 
 const espnow_transponder_config_t espnow_transponder_config_default = {
     .mode = WIFI_MODE_STA,
     .power = 90,
     .channel = 1,
     .phy_rate = WIFI_PHY_RATE_MCS2_LGI,
+    .overflow_policy = ESPNOW_TRANSPONDER_DROP_OLDEST,
+    .compression = false,
+    .tx_framerate = 0,
+    .tx_max_in_flight = 4,
+    .fec_k = 0,
+    .fec_m = 0,
+    .transport = NULL,
+    .trace_records = 512,
+    .trace_freeze_on_error = true,
+    .rate_control = false,
+    .rate_control_loss_budget = 0.02,
+    .loss_reports = true,
+    .tdma = ESPNOW_TRANSPONDER_TDMA_OFF,
+    .tdma_frame_us = 0,
+    .tdma_guard_us = 300,
+    .relay_ttl = 0,
+    .relay = false,
+    .relay_jitter_us = 2000,
+    .relay_rate = 500,
+    .class_weights = {
+        [ESPNOW_TRANSPONDER_CLASS_REALTIME] = 4,
+        [ESPNOW_TRANSPONDER_CLASS_BULK] = 1,
+    },
+};
+
+// Maximum size of the ESP-NOW event queue of each traffic class. Up to this
+// many messages can be stored on reception. It's recommended to make the
+// callback function process data fast enough that these queues can be small.
+// Must be powers of two. The control queue also carries the transponder's own
+// control events.
+#define ESPNOW_QUEUE_SIZE           32
+#define ESPNOW_BULK_QUEUE_SIZE      16
+#define ESPNOW_SYNC_QUEUE_SIZE      8
+#define ESPNOW_CONTROL_QUEUE_SIZE   8
+
+// Receive buffer slots of each class beyond its queue size, for slots that are
+// held by a borrow callback. Each class has a pool of its own, so that a flood
+// of one class can't leave another without buffers.
+#define ESPNOW_RX_POOL_SPARE        4
+
+// Records written to measure the cost of tracing, at startup
+#define ESPNOW_TRACE_MEASURE_RECORDS 64
+
+// Number of buffer slots for decompressed packets. These are only held while
+// the packet is being dispatched, or by a borrow callback.
+#define ESPNOW_DECODE_POOL_SIZE     4
+
+// Number of packets of each class that can wait in the transmit queues when
+// pacing. Each one holds a transmit buffer slot, from a pool for its class.
+#define ESPNOW_TX_QUEUE_SIZE        64
+#define ESPNOW_TX_BULK_QUEUE_SIZE   16
+#define ESPNOW_TX_SYNC_QUEUE_SIZE   8
+#define ESPNOW_TX_CONTROL_QUEUE_SIZE 8
+
+// Rate control window. A sender report goes out at the end of each one.
+#define ESPNOW_CONTROL_INTERVAL_US  500000
+
+// Rate control tuning: loss under a quarter of the budget for 4 windows in a
+// row probes a faster rate or lower power, a failed probe is held off for
+// 4 windows at first and up to 2 minutes, a report has to cover 20 packets
+// to count, and 2 windows without any reports count as total loss. Power
+// moves in 1 dBm steps, over a 6 dB range.
+#define ESPNOW_CONTROL_GOOD_WINDOWS 4
+#define ESPNOW_CONTROL_HOLD_WINDOWS 4
+#define ESPNOW_CONTROL_HOLD_MAX     240
+#define ESPNOW_CONTROL_MIN_PACKETS  20
+#define ESPNOW_CONTROL_SILENT_WINDOWS 2
+#define ESPNOW_CONTROL_POWER_STEP   4
+#define ESPNOW_CONTROL_POWER_RANGE  24
+
+// Length of the TDMA beacon slot at the start of each frame. It has to fit
+// the beacon, and the slot requests that follow it.
+#define ESPNOW_TDMA_BEACON_US       1000
+
+// Slot requests that can wait for the next beacon. Must be a power of two.
+#define ESPNOW_TDMA_REQUEST_QUEUE_SIZE 16
+
+// Number of packets that can wait to be relayed. Each one holds a relay
+// buffer slot.
+#define ESPNOW_RELAY_QUEUE_SIZE     16
+
+// Packets a relay can send back to back, before the rate limit applies
+#define ESPNOW_RELAY_BURST          8
+
+// Stack size of the transponder, transmit and relay tasks. The transponder
+// and transmit tasks build control messages on the stack, the transponder task
+// adds up the statistics blocks on top of that, and all three go through the
+// same send path.
+#define ESPNOW_TASK_STACK_SIZE      3072
+
+static const uint16_t rx_queue_sizes[ESPNOW_TRANSPONDER_CLASS_COUNT] = {
+    [ESPNOW_TRANSPONDER_CLASS_REALTIME] = ESPNOW_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_BULK] = ESPNOW_BULK_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_SYNC] = ESPNOW_SYNC_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_CONTROL] = ESPNOW_CONTROL_QUEUE_SIZE,
 };
 
-// Maximum size of the ESP-NOW event queue. Up to this many messages can be
-// stored on reception. It's recommended to make the callback function process
-// data fast enough that this queue can be small.
-#define ESPNOW_QUEUE_SIZE           30
+static const uint16_t tx_queue_sizes[ESPNOW_TRANSPONDER_CLASS_COUNT] = {
+    [ESPNOW_TRANSPONDER_CLASS_REALTIME] = ESPNOW_TX_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_BULK] = ESPNOW_TX_BULK_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_SYNC] = ESPNOW_TX_SYNC_QUEUE_SIZE,
+    [ESPNOW_TRANSPONDER_CLASS_CONTROL] = ESPNOW_TX_CONTROL_QUEUE_SIZE,
+};
 
 typedef enum {
-    ESPNOW_TRANSPONDER_SEND_CB,
     ESPNOW_TRANSPONDER_RECV_CB,
+    ESPNOW_TRANSPONDER_LOSS_REPORT_CB,      //!< Loss report received, for the rate controller
+    ESPNOW_TRANSPONDER_SEND_LOSS_REPORT,    //!< Loss report to send, in reply to a sender report
+    ESPNOW_TRANSPONDER_SEND_SLOT_REQUEST,   //!< TDMA slot request to send, after a beacon
     ESPNOW_TRANSPONDER_STOP_TASK,
 } espnow_transponder_event_id_t;
 
 typedef struct {
     uint8_t mac_addr[ESP_NOW_ETH_ALEN];
-    esp_now_send_status_t status;
-} espnow_transponder_event_send_cb_t;
-
-typedef struct {
-    uint8_t mac_addr[ESP_NOW_ETH_ALEN];
-    uint8_t *data;
-    int data_len;
+    espnow_transponder_buffer_t *buffer;    //!< Received packet, owns one reference
+    uint16_t fec_filtered;                  //!< For parity packets, data packets of the group that were filtered out
 } espnow_transponder_event_recv_cb_t;
 
 typedef union {
-    espnow_transponder_event_send_cb_t send_cb;
     espnow_transponder_event_recv_cb_t recv_cb;
+    control_loss_report_t loss_report;
 } espnow_transponder_event_info_t;
 
-// When ESPNOW sending or receiving callback function is called, post event to ESPNOW task.
+// When the ESPNOW receiving callback function is called, post event to ESPNOW task.
 typedef struct {
     espnow_transponder_event_id_t id;       //!< Callback event type
     espnow_transponder_event_info_t info;   //!< Callback event data
 } espnow_transponder_event_t;
 
-//! Packet format for espnow_transponder packets
+//! Internal queues for handling espnow rx and tx callbacks, one for each traffic class
+static event_ring_t espnow_transponder_queues[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+//! Picks the next queue for the transponder task to serve
+static traffic_class_scheduler_t rx_scheduler;
+
+//! Pools of receive buffers for each traffic class, filled from the WiFi task
+static buffer_pool_t rx_pools[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+//! Pool of buffers for decompressed packets, filled from the transponder task
+static buffer_pool_t decode_pool;
+
+//! If true, try to compress outgoing packets
+static bool compression_enabled = false;
+
+//! If true, packets are queued, and paced out by the transmit scheduler
+static bool pacing_enabled = false;
+
+//! Queues of packets waiting to be paced out, one for each traffic class. A
+//! NULL entry in the realtime queue marks the end of a frame.
+static xQueueHandle tx_queues[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+//! Pools of buffers for packets in each transmit queue
+static buffer_pool_t tx_pools[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+//! Picks the next queue for the transmit scheduler to serve
+static traffic_class_scheduler_t tx_scheduler;
+
+//! Transmit pacing state
+static tx_pacer_t tx_pacer;
+
+//! Set if a frame end marker didn't fit in the realtime transmit queue. The
+//! pacer is told of the frame end once the queue has drained.
+static atomic_bool tx_frame_end_pending = false;
+
+//! Puts packets on the air
+static const espnow_transponder_transport_t *transport = NULL;
+
+//! If true, protect outgoing packets with forward error correction
+static bool fec_enabled = false;
+
+//! Parity generator for outgoing packets
+static fec_encoder_t fec_encoder;
+
+//! Reconstructs lost packets from received parity
+static fec_decoder_t fec_decoder;
+
+//! Subscribed keys, one bit per key
+static atomic_uint filter_keys[ESPNOW_TRANSPONDER_MAX_KEYS/32];
+
+//! If true, only packets with a subscribed key are received
+static atomic_bool filter_enabled = false;
+
+//! FEC data packets dropped by the receive filter, for the most recent
+//! groups, only used by the WiFi task
+static struct {
+    uint8_t group;                      //!< Group sequence number
+    uint16_t dropped;                   //!< Bitmask of the dropped data packet indexes
+} filter_fec_groups[FEC_DECODER_GROUPS];
+
+//! If true, answer sender reports with loss reports
+static bool loss_reports_enabled = false;
+
+//! Packets received from rate controlled senders, only used by the WiFi task
+static loss_monitor_t loss_monitor;
+
+//! If true, adapt the PHY rate and power to the reported loss
+static bool rate_control_enabled = false;
+
+// Rate controller state, only used by the transponder task
+static rate_control_t rate_control;
+static uint32_t control_session;            //!< Identifies this sender's reports
+static uint32_t control_packets;            //!< Packet count in the last sender report
+static int64_t control_next_us;             //!< End of the current control window
+static espnow_transponder_stats_t control_window_start;
+static espnow_transponder_stats_t control_totals;   //!< Scratch for control_poll(), kept off the task stack
+
+//! Rate controller status, for espnow_transponder_get_rate_control_status()
+static espnow_transponder_rate_control_status_t rate_control_status;
+
+//! TDMA role, ESPNOW_TRANSPONDER_TDMA_OFF if not in use
+static espnow_transponder_tdma_role_t tdma_role = ESPNOW_TRANSPONDER_TDMA_OFF;
+
+// TDMA master state, only used by the beacon timer
+static tdma_master_t tdma_master;
+static esp_timer_handle_t tdma_beacon_timer = NULL;
+
+//! Ids of senders that asked the master for a slot, from the WiFi task to the beacon timer
+static event_ring_t tdma_requests;
+
+//! This node's view of the TDMA schedule. Beacons are fed in by the WiFi
+//! task, or by the beacon timer on the master.
+static tdma_sender_t tdma_sender;
+
+//! Wakes the transmit scheduler when its TDMA slot starts, which a tick is too coarse for
+static esp_timer_handle_t tx_wake_timer = NULL;
+
+//! Duplicate suppression, and the decision to relay, only used by the WiFi task
+static relay_t relay;
+
+//! If non-zero, outgoing packets get a relay header with this TTL
+static uint8_t relay_ttl = 0;
+
+//! Sequence number for the relay header of the next outgoing packet
+static atomic_uint relay_sequence;
+
+//! A packet waiting to be relayed
 typedef struct {
-    uint16_t crc;                       //!< 16-bit CRC, calculated with crc16_le()
-    uint8_t data_length;                //!< Length of the data payload TODO: If ESP-NOW length is reliable, drop this
-    uint8_t data[];                     //!< First element of the data payload
-} __attribute__((packed)) espnow_transponder_packet_t;
+    espnow_transponder_buffer_t *buffer;    //!< Packet to relay, owns one reference
+    int64_t due_us;                         //!< Time it should be sent
+} relay_entry_t;
 
-//! Internal queue for handling espnow rx and tx callbacks
-static xQueueHandle espnow_transponder_queue = NULL;
+//! Queue of packets waiting to be relayed, in the order they are due
+static xQueueHandle relay_queue = NULL;
+
+//! Pool of buffers for packets in the relay queue
+static buffer_pool_t relay_pool;
+
+//! Wakes the relay task when the next packet is due
+static esp_timer_handle_t relay_wake_timer = NULL;
 
 //! Pointer to the user function that is called when a packet is successfully received
 static espnow_transponder_rx_callback_t rx_callback = NULL;
 
+//! Pointer to the user function that borrows received packet buffers
+static espnow_transponder_borrow_callback_t borrow_callback = NULL;
+
+//! User functions that are called for received packets of each traffic class
+static espnow_transponder_rx_callback_t class_callbacks[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+//! \brief Record a pipeline trace event
+//!
+//! \param event Event, a trace_event_t
+//! \param id Packet id
+//! \param payload Packet payload, or NULL if it can't be seen
+//! \param length Length of the payload
+//! \param queue_depth Queue depth, where relevant
+//! \param value Event specific value
+static inline void trace_event(uint8_t event, uint16_t id, const uint8_t *payload, uint16_t length,
+                               uint8_t queue_depth, uint32_t value)
+{
+    const int core = xPortGetCoreID();
+    const bool visible = payload != NULL && length >= 3;
+
+    trace_record(&trace, event, core, xthal_get_ccount() + trace_cycle_offset[core], id,
+                 visible ? (payload[0] | (payload[1] << 8)) : TRACE_KEY_NONE, visible ? payload[2] : 0,
+                 queue_depth, value);
+}
+
+//! \brief Record a packet dropped for an error, and freeze the trace if configured
+//!
+//! \param event TRACE_RX_DROP or TRACE_TX_DROP
+//! \param id Packet id
+//! \param reason Why it was dropped, a trace_drop_t
+static void trace_error(uint8_t event, uint16_t id, uint32_t reason)
+{
+    trace_event(event, id, NULL, 0, 0, reason);
+
+    if(trace_freeze_on_error && trace_trigger(&trace, reason))
+        trace_event(TRACE_TRIGGER, id, NULL, 0, 0, reason);
+}
+
+//! \brief Get an id for a packet entering the pipeline
+static inline uint16_t trace_new_id()
+{
+    return atomic_fetch_add_explicit(&trace_next_id, 1, memory_order_relaxed);
+}
+
 //! \brief Check if a buffer contains a valid espnow_transponder_packet_t
 //!
 //! \param data Pointer to the data packet
 //! \param data_len Length of the data packet
+//! \param trace_id Packet id, for the trace
 //! \return True if the packet passed CRC + data length checks
-static bool packet_check(uint8_t *packet, uint16_t packet_length)
+static bool packet_check(const uint8_t *packet, uint16_t packet_length, uint16_t trace_id)
 {
-    // Check the the packet can fit the header
-    if (packet_length < sizeof(espnow_transponder_packet_t)) {
+    switch(framing_check(packet, packet_length)) {
+    case FRAMING_OK:
+        return true;
+
+    case FRAMING_SHORT:
         ESP_LOGE(TAG, "Receive ESPNOW data too short, len:%i, minimum:%i", packet_length, sizeof(espnow_transponder_packet_t));
-        espnow_transponder_stats.rx_short_packet++;
+        STATS_ADD(&wifi_stats, rx_short_packet, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_SHORT);
+        return false;
+
+    case FRAMING_BAD_CRC:
+        ESP_LOGE(TAG, "Failed CRC check, len:%i", packet_length);
+        STATS_ADD(&wifi_stats, rx_bad_crc, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_BAD_CRC);
+        return false;
+
+    case FRAMING_BAD_LENGTH:
+        ESP_LOGE(TAG, "Invalid length, expected:%i got:%i",
+                 sizeof(espnow_transponder_packet_t) + ((const espnow_transponder_packet_t *)packet)->data_length,
+                 packet_length);
+        STATS_ADD(&wifi_stats, rx_bad_len, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_BAD_LENGTH);
         return false;
     }
 
-    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+    return false;
+}
 
-    // Check the CRC
-    const uint16_t crc = header->crc;
-    header->crc = 0;    // TODO: Feed this into the CRC so we don't have to overwrite it
-    const uint16_t crc_cal = crc16_le(UINT16_MAX, packet, packet_length);
-    if(crc_cal != crc) {
-        ESP_LOGE(TAG, "Failed CRC check, expected:%04x got:%04x", crc, crc_cal);
+//! \brief Check a payload against the subscribed keys
+//!
+//! \param payload Packet payload
+//! \param length Length of the payload
+//! \return True if the packet should be received
+static inline bool filter_accept(const uint8_t *payload, uint16_t length)
+{
+    if(!atomic_load_explicit(&filter_enabled, memory_order_relaxed))
+        return true;
+
+    if(length < sizeof(uint16_t))
+        return false;
 
-        espnow_transponder_stats.rx_bad_crc++;
+    const uint16_t key = payload[0] | (payload[1] << 8);
+    if(key >= ESPNOW_TRANSPONDER_MAX_KEYS)
         return false;
+
+    return atomic_load_explicit(&filter_keys[key/32], memory_order_relaxed) & (1u << (key%32));
+}
+
+//! \brief Drop a packet that nobody subscribed to, before it is checked or copied
+//!
+//! Called from the WiFi task. The key starts the payload, after the FEC
+//! header if there is one, and is never compressed. Parity packets are
+//! always received, and carry the data packets of their group that were
+//! dropped to the FEC decoder. Relayed packets are forwarded whether they
+//! are wanted here or not, so they are filtered after receive_relay(), and
+//! their key follows the relay header.
+//!
+//! \param data Packet, not yet checked, unless it is relayed
+//! \param len Length of the packet, more than the transponder header, and the relay header if there is one
+//! \param trace_id Trace id of the packet
+//! \param fec_filtered For parity packets, set to the data packets of the group that were dropped
+//! \return false if the packet was dropped
+static bool receive_filter(const uint8_t *data, int len, uint16_t trace_id, uint16_t *fec_filtered)
+{
+    const uint8_t flags = data[offsetof(espnow_transponder_packet_t, flags)];
+    const uint16_t header_length = sizeof(espnow_transponder_packet_t)
+        + ((flags & ESPNOW_TRANSPONDER_FLAG_RELAY) ? sizeof(espnow_transponder_relay_header_t) : 0);
+
+    const uint8_t *payload = data + header_length;
+    uint16_t payload_length = len - header_length;
+
+    const fec_header_t *fec_header = NULL;
+    if(flags & ESPNOW_TRANSPONDER_FLAG_FEC) {
+        // Short packets are dropped by the length check later on
+        if(payload_length < sizeof(fec_header_t))
+            return true;
+
+        fec_header = (const fec_header_t *)payload;
+        payload += sizeof(fec_header_t);
+        payload_length -= sizeof(fec_header_t);
+
+        if(fec_header->index >= fec_header->k) {
+            const int slot = fec_header->group % FEC_DECODER_GROUPS;
+            *fec_filtered = filter_fec_groups[slot].group == fec_header->group ? filter_fec_groups[slot].dropped : 0;
+            return true;
+        }
     }
 
-    const uint16_t expected_length = sizeof(espnow_transponder_packet_t) + header->data_length;
-    if(expected_length != packet_length) {
-        ESP_LOGE(TAG, "Invalid length, expected:%i got:%i", expected_length, packet_length);
+    if(filter_accept(payload, payload_length))
+        return true;
 
-        espnow_transponder_stats.rx_bad_len++;
-        return false;
+    if(fec_header != NULL && fec_header->index < FEC_MAX_K) {
+        const int slot = fec_header->group % FEC_DECODER_GROUPS;
+        if(filter_fec_groups[slot].group != fec_header->group) {
+            filter_fec_groups[slot].group = fec_header->group;
+            filter_fec_groups[slot].dropped = 0;
+        }
+        filter_fec_groups[slot].dropped |= 1u << fec_header->index;
     }
 
-    return true;
+    STATS_ADD(&wifi_stats, rx_filtered, 1);
+    trace_event(TRACE_RX_DROP, trace_id, (flags & ESPNOW_TRANSPONDER_FLAG_COMPRESSED) ? NULL : payload,
+                payload_length, 0, TRACE_DROP_FILTERED);
+    return false;
 }
 
-static esp_err_t example_event_handler(void *ctx, system_event_t *event)
+//! \brief Queue an event for the transponder task, without blocking
+//!
+//! If the queue is full, an event is dropped according to the overflow
+//! policy, and any receive buffer it held is released.
+//!
+//! \param evt Event to queue
+//! \param traffic_class Class of the queue to add it to
+static void post_event(const espnow_transponder_event_t *evt, espnow_transponder_class_t traffic_class)
 {
-    switch(event->event_id) {
-    case SYSTEM_EVENT_STA_START:
-        ESP_LOGI(TAG, "WiFi started");
-        break;
-    default:
-        break;
+    espnow_transponder_event_t dropped;
+
+    if(event_ring_push(&espnow_transponder_queues[traffic_class], evt, &dropped) != EVENT_RING_PUSHED) {
+        uint16_t trace_id = 0;
+        if(dropped.id == ESPNOW_TRANSPONDER_RECV_CB) {
+            trace_id = dropped.info.recv_cb.buffer->trace_id;
+            espnow_transponder_buffer_release(dropped.info.recv_cb.buffer);
+            STATS_ADD(&wifi_stats, rx_class_dropped[traffic_class], 1);
+        }
+
+        STATS_ADD(&wifi_stats, rx_queue_overflow, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_QUEUE_OVERFLOW);
     }
-    return ESP_OK;
+
+    xTaskNotifyGive(espnow_transponder_task_hdl);
 }
 
-//! \brief ESP-NOW transmit callback function
+//! \brief Transport send completion callback
 //!
-//! ESPNOW sending or receiving callback function is called in WiFi task.
-//! Users should not do lengthy operations from this task. Instead, post
-//! necessary data to a queue and handle it from a lower priority task.
+//! The transport callbacks are called from the WiFi task.
+//! Users should not do lengthy operations from this task. Completions are
+//! only counted, and passed straight to the pacer. They aren't posted to the
+//! task, so that a sender's own completions can't push received packets out
+//! of the receive queues.
 //!
 //! \param mac_addr MAC address that the packet was sent to
-//! \param status transmit status
-static void espnow_transponder_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+//! \param success True if the packet was sent
+static void espnow_transponder_send_cb(const uint8_t *mac_addr, bool success)
 {
     if (mac_addr == NULL) {
         ESP_LOGE(TAG, "Send cb arg error");
         return;
     }
 
-    espnow_transponder_event_t evt = {
-            .id = ESPNOW_TRANSPONDER_SEND_CB,
-            .info.send_cb.status = status,
+    trace_event(TRACE_TX_COMPLETE, 0, NULL, 0, 0, success);
+
+    if(!success)
+        STATS_ADD(&wifi_stats, tx_cb_fail, 1);
+
+    // Let the transmit scheduler send the next packet
+    if(pacing_enabled) {
+        tx_pacer_completed(&tx_pacer);
+        xTaskNotifyGive(espnow_transponder_tx_task_hdl);
+    }
+
+    STATS_ADD(&wifi_stats, tx_count, 1);
+}
+
+//! \brief Handle a control message, from the WiFi task
+//!
+//! Sender reports are answered here, because the packet counts they are
+//! checked against are kept by this task. Loss reports are passed on to the
+//! rate controller. TDMA beacons are handled here too, so that they are
+//! timestamped as soon as they arrive.
+//!
+//! \param mac_addr MAC address of the device that sent the packet
+//! \param data Pointer to the packet data
+//! \param len Length of the packet data
+//! \param trace_id Packet id, for the trace
+static void receive_control(const uint8_t *mac_addr, const uint8_t *data, int len, uint16_t trace_id)
+{
+    if(!packet_check(data, len, trace_id))
+        return;
+
+    STATS_ADD(&wifi_stats, rx_control, 1);
+
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    espnow_transponder_event_t evt;
+
+    if(packet->data_length == sizeof(control_sender_report_t) && packet->data[0] == CONTROL_SENDER_REPORT) {
+        control_sender_report_t report;
+        memcpy(&report, packet->data, sizeof(report));
+
+        if(!loss_reports_enabled
+            || !loss_monitor_sender_report(&loss_monitor, mac_addr, &report, &evt.info.loss_report))
+            return;
+
+        evt.id = ESPNOW_TRANSPONDER_SEND_LOSS_REPORT;
+    }
+    else if(packet->data_length == sizeof(control_loss_report_t) && packet->data[0] == CONTROL_LOSS_REPORT) {
+        if(!rate_control_enabled)
+            return;
+
+        evt.id = ESPNOW_TRANSPONDER_LOSS_REPORT_CB;
+        memcpy(&evt.info.loss_report, packet->data, sizeof(evt.info.loss_report));
+    }
+    else if(packet->data_length >= TDMA_BEACON_LENGTH(0) && packet->data[0] == CONTROL_BEACON) {
+        if(tdma_role != ESPNOW_TRANSPONDER_TDMA_SENDER
+            || !tdma_sender_beacon(&tdma_sender, (const tdma_beacon_t *)packet->data, packet->data_length,
+                                   esp_timer_get_time()))
+            return;
+
+        evt.id = ESPNOW_TRANSPONDER_SEND_SLOT_REQUEST;
+    }
+    else if(packet->data_length == sizeof(tdma_slot_request_t) && packet->data[0] == CONTROL_SLOT_REQUEST) {
+        if(tdma_role != ESPNOW_TRANSPONDER_TDMA_MASTER)
+            return;
+
+        // Handled with the next beacon
+        tdma_slot_request_t request;
+        uint32_t dropped;
+        memcpy(&request, packet->data, sizeof(request));
+        event_ring_push(&tdma_requests, &request.id, &dropped);
+        return;
+    }
+    else {
+        return;
+    }
+
+    post_event(&evt, ESPNOW_TRANSPONDER_CLASS_CONTROL);
+}
+
+//! \brief Queue a copy of a received packet to be relayed
+//!
+//! \param data Pointer to the packet
+//! \param len Length of the packet
+//! \param due_us Time the copy should be sent
+//! \param trace_id Packet id, for the trace
+static void relay_forward(const uint8_t *data, int len, int64_t due_us, uint16_t trace_id)
+{
+    espnow_transponder_buffer_t *buffer = buffer_pool_alloc(&relay_pool);
+    if(buffer == NULL) {
+        STATS_ADD(&wifi_stats, tx_relay_dropped, 1);
+        trace_error(TRACE_TX_DROP, trace_id, TRACE_DROP_QUEUE_FULL);
+        return;
+    }
+
+    memcpy(buffer->data, data, len);
+    relay_prepare(buffer->data);
+    buffer->length = len;
+    buffer->trace_id = trace_id;
+
+    const relay_entry_t entry = {
+        .buffer = buffer,
+        .due_us = due_us,
     };
-    memcpy(evt.info.send_cb.mac_addr, mac_addr, sizeof(evt.info.send_cb.mac_addr));
+    if(xQueueSend(relay_queue, &entry, 0) != pdTRUE) {
+        STATS_ADD(&wifi_stats, tx_relay_dropped, 1);
+        trace_error(TRACE_TX_DROP, trace_id, TRACE_DROP_QUEUE_FULL);
+        espnow_transponder_buffer_release(buffer);
+        return;
+    }
 
-    if (xQueueSend(espnow_transponder_queue, &evt, portMAX_DELAY) != pdTRUE) {
-        ESP_LOGW(TAG, "Send to queue fail");
+    trace_event(TRACE_TX_QUEUED, trace_id, NULL, 0, uxQueueMessagesWaiting(relay_queue), 0);
+}
+
+//! \brief Drop copies of a packet that was already received, and relay new ones on
+//!
+//! \param data Pointer to a packet that passed packet_check(), with a relay header
+//! \param len Length of the packet
+//! \param trace_id Packet id, for the trace
+//! \return True if the packet should be received
+static bool receive_relay(const uint8_t *data, int len, uint16_t trace_id)
+{
+    const espnow_transponder_relay_header_t *header = framing_relay_header(data);
+    if(header == NULL) {
+        STATS_ADD(&wifi_stats, rx_bad_len, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_BAD_LENGTH);
+        return false;
+    }
+
+    int64_t due_us;
+    switch(relay_receive(&relay, header, esp_timer_get_time(), &due_us)) {
+    case RELAY_DELIVER:
+        break;
+
+    case RELAY_FORWARD:
+        relay_forward(data, len, due_us, trace_id);
+        break;
+
+    case RELAY_DUPLICATE:
+        STATS_ADD(&wifi_stats, rx_relay_duplicate, 1);
+        trace_event(TRACE_RX_DROP, trace_id, NULL, 0, 0, TRACE_DROP_DUPLICATE);
+        return false;
+
+    case RELAY_EXPIRED:
+        STATS_ADD(&wifi_stats, rx_relay_expired, 1);
+        break;
+
+    case RELAY_LIMITED:
+        STATS_ADD(&wifi_stats, tx_relay_dropped, 1);
+        trace_event(TRACE_TX_DROP, trace_id, NULL, 0, 0, TRACE_DROP_RELAY_LIMITED);
+        break;
     }
 
-    espnow_transponder_stats.tx_count++;
+    return true;
 }
 
-//! \brief ESP-NOW receive callback function
+//! \brief Transport receive callback
 //!
-//! ESPNOW sending or receiving callback function is called in WiFi task.
+//! The transport callbacks are called from the WiFi task.
 //! Users should not do lengthy operations from this task. Instead, post
 //! necessary data to a queue and handle it from a lower priority task.
 //!
@@ -175,217 +690,1326 @@ static void espnow_transponder_recv_cb(const uint8_t *mac_addr, const uint8_t *d
         ESP_LOGE(TAG, "Receive cb arg error");
         return;
     }
-    
-    if(!packet_check(data, len)) {
-        ESP_LOGE(TAG, "Packet check failed");
+
+    // Only plain packets are traced with their key and sequence
+    const uint8_t flags = len > sizeof(espnow_transponder_packet_t)
+        ? data[offsetof(espnow_transponder_packet_t, flags)] : 0;
+    const bool plain = len > sizeof(espnow_transponder_packet_t) && (flags & ~ESPNOW_TRANSPONDER_FLAG_CLASS_MASK) == 0;
+    const uint8_t *payload = plain ? data + sizeof(espnow_transponder_packet_t) : NULL;
+    const uint16_t payload_length = plain ? len - sizeof(espnow_transponder_packet_t) : 0;
+
+    const uint16_t trace_id = trace_new_id();
+    trace_event(TRACE_RX_CALLBACK, trace_id, payload, payload_length, 0, len);
+
+    if(flags & ESPNOW_TRANSPONDER_FLAG_CONTROL) {
+        receive_control(mac_addr, data, len, trace_id);
         return;
     }
 
-    espnow_transponder_event_t evt = {
-        .id = ESPNOW_TRANSPONDER_RECV_CB,
-        .info.recv_cb.data_len = len,
-    };
-    memcpy(evt.info.recv_cb.mac_addr, mac_addr, sizeof(evt.info.recv_cb.mac_addr));
+    // Everything that made it this far counts as received, for loss reports
+    if(loss_reports_enabled)
+        loss_monitor_packet(&loss_monitor, mac_addr);
 
-    evt.info.recv_cb.data = malloc(len);
-    if (evt.info.recv_cb.data == NULL) {
-        ESP_LOGE(TAG, "Malloc receive data fail");
+    // Drop packets that nobody subscribed to before spending any time on them
+    const bool relayed = flags & ESPNOW_TRANSPONDER_FLAG_RELAY;
+    uint16_t fec_filtered = 0;
+    if(!relayed && len > sizeof(espnow_transponder_packet_t) && !receive_filter(data, len, trace_id, &fec_filtered))
+        return;
 
-        espnow_transponder_stats.rx_malloc_fail++;
+    if(!packet_check(data, len, trace_id)) {
+        ESP_LOGE(TAG, "Packet check failed");
         return;
     }
-    memcpy(evt.info.recv_cb.data, data, len);
 
-    if (xQueueSend(espnow_transponder_queue, &evt, portMAX_DELAY) != pdTRUE) {
-        ESP_LOGW(TAG, "Send to queue fail");
-        free(evt.info.recv_cb.data);
+    // Copies of a relayed packet are dropped before they are copied. Other
+    // relayed packets are forwarded before they are filtered, so that nodes
+    // further on still get what isn't wanted here.
+    if(relayed) {
+        if(!receive_relay(data, len, trace_id))
+            return;
+        if(len > sizeof(espnow_transponder_packet_t) + sizeof(espnow_transponder_relay_header_t)
+            && !receive_filter(data, len, trace_id, &fec_filtered))
+            return;
     }
 
-    espnow_transponder_stats.rx_count++;
-}
+    const espnow_transponder_class_t traffic_class = ESPNOW_TRANSPONDER_PACKET_CLASS(flags);
+    espnow_transponder_buffer_t *buffer = buffer_pool_alloc(&rx_pools[traffic_class]);
+    if (buffer == NULL) {
+        ESP_LOGE(TAG, "Receive pool empty");
 
-//! \brief TX/RX callback handler task
-static void espnow_transponder_task(void *pvParameter)
-{
-    espnow_transponder_event_t evt;
+        stats_write_begin(&wifi_stats);
+        wifi_stats.counters.rx_no_buffer++;
+        wifi_stats.counters.rx_class_dropped[traffic_class]++;
+        stats_write_end(&wifi_stats);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_NO_BUFFER);
+        return;
+    }
 
-    while (xQueueReceive(espnow_transponder_queue, &evt, portMAX_DELAY) == pdTRUE) {
-        switch (evt.id) {
-            case ESPNOW_TRANSPONDER_SEND_CB:
-            {
-                espnow_transponder_event_send_cb_t *send_cb = &evt.info.send_cb;
-                ESP_LOGD(TAG, "Sent data to "MACSTR", status1: %d", MAC2STR(send_cb->mac_addr), send_cb->status);
-                break;
-            }
-            case ESPNOW_TRANSPONDER_RECV_CB:
-            {
-                espnow_transponder_event_recv_cb_t *recv_cb = &evt.info.recv_cb;
+    // The WiFi driver reuses its buffer after this callback returns, so this
+    // is the only copy made of the packet.
+    const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)data;
+    memcpy(buffer->data, data, len);
+    buffer->offset = sizeof(espnow_transponder_packet_t);
+    buffer->length = packet->data_length;
+    buffer->trace_id = trace_id;
+    buffer->queued_us = esp_timer_get_time();
+
+    // receive_relay() checked that the header fits
+    if(packet->flags & ESPNOW_TRANSPONDER_FLAG_RELAY) {
+        buffer->offset += sizeof(espnow_transponder_relay_header_t);
+        buffer->length -= sizeof(espnow_transponder_relay_header_t);
+    }
 
-                if(rx_callback != NULL) {
-                    espnow_transponder_packet_t *packet = (espnow_transponder_packet_t *)recv_cb->data;
-                    rx_callback(packet->data, packet->data_length);
-                }
+    if(packet->flags & ESPNOW_TRANSPONDER_FLAG_FEC) {
+        if(buffer->length < sizeof(fec_header_t)) {
+            STATS_ADD(&wifi_stats, rx_bad_len, 1);
+            trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_BAD_LENGTH);
+            espnow_transponder_buffer_release(buffer);
+            return;
+        }
 
-                free(recv_cb->data);
-                break;
-            }
-//            case ESPNOW_TRANSPONDER_STOP_TASK:
-//                goto stop_task;
-//                break;
-            default:
-                ESP_LOGE(TAG, "Callback type error: %d", evt.id);
-                break;
+        const fec_header_t *fec_header = (const fec_header_t *)(buffer->data + buffer->offset);
+        buffer->offset += sizeof(fec_header_t);
+        buffer->length -= sizeof(fec_header_t);
+
+        // Data units are stored with their flags and length, parity units are stored whole
+        if(buffer->length > (fec_header->index < fec_header->k ? FEC_MAX_PAYLOAD : FEC_UNIT_SIZE)) {
+            STATS_ADD(&wifi_stats, rx_bad_len, 1);
+            trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_BAD_LENGTH);
+            espnow_transponder_buffer_release(buffer);
+            return;
         }
     }
 
-//stop_task:
-    espnow_transponder_task_hdl = NULL;
-    vTaskDelete(NULL);
+    espnow_transponder_event_t evt = {
+        .id = ESPNOW_TRANSPONDER_RECV_CB,
+        .info.recv_cb.buffer = buffer,
+        .info.recv_cb.fec_filtered = fec_filtered,
+    };
+    memcpy(evt.info.recv_cb.mac_addr, mac_addr, sizeof(evt.info.recv_cb.mac_addr));
+
+    post_event(&evt, traffic_class);
+    trace_event(TRACE_RX_QUEUED, trace_id, NULL, 0, event_ring_depth(&espnow_transponder_queues[traffic_class]), 0);
+
+    stats_write_begin(&wifi_stats);
+    wifi_stats.counters.rx_count++;
+    wifi_stats.counters.rx_bytes += len;
+    stats_write_end(&wifi_stats);
 }
 
-//! \brief Initialize WiFi for use with ESP-NOW
-static esp_err_t wifi_init(const espnow_transponder_config_t *config)
+//! \brief Decompress a received packet, if needed
+//!
+//! \param buffer Received packet. The reference is consumed.
+//! \param flags Transponder flags of the packet
+//! \return Buffer holding the packet payload, or NULL if it couldn't be decoded
+static espnow_transponder_buffer_t *decode_packet(espnow_transponder_buffer_t *buffer, uint8_t flags)
 {
-    tcpip_adapter_init();
-
-    esp_err_t ret;
+    if(!(flags & ESPNOW_TRANSPONDER_FLAG_COMPRESSED))
+        return buffer;
+
+    espnow_transponder_buffer_t *decoded = buffer_pool_alloc(&decode_pool);
+    if(decoded == NULL) {
+        STATS_ADD(&task_stats, rx_no_buffer, 1);
+        trace_error(TRACE_RX_DROP, buffer->trace_id, TRACE_DROP_NO_BUFFER);
+        espnow_transponder_buffer_release(buffer);
+        return NULL;
+    }
 
-    // Don't fail if the event loop was already registered, it's not needed for this component.
-    ret = esp_event_loop_init(example_event_handler, NULL);
-    if(ret != ESP_OK) {
-        ESP_LOGW(TAG, "Error running esp_event_loop_init, err:%s", esp_err_to_name(ret));
+    const int length = framing_decompress(espnow_transponder_buffer_data(buffer), buffer->length,
+                                          decoded->data, decode_pool.slot_size);
+    decoded->trace_id = buffer->trace_id;
+    espnow_transponder_buffer_release(buffer);
+
+    if(length < 0) {
+        ESP_LOGE(TAG, "Decompress failed");
+        STATS_ADD(&task_stats, rx_decompress_fail, 1);
+        trace_error(TRACE_RX_DROP, decoded->trace_id, TRACE_DROP_DECOMPRESS);
+        espnow_transponder_buffer_release(decoded);
+        return NULL;
     }
 
-    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    decoded->length = length;
+    return decoded;
+}
 
-    // From: https://hackaday.io/project/161896-linux-espnow/log/161046-implementation
-    // Disable AMPDU to allow the bit rate to be changed
-    cfg.ampdu_tx_enable = 0;
+//! \brief Decode a packet payload, and pass it to the user callback
+//!
+//! \param buffer Packet payload. The reference is consumed.
+//! \param flags Transponder flags of the packet
+static void dispatch_packet(espnow_transponder_buffer_t *buffer, uint8_t flags)
+{
+    buffer = decode_packet(buffer, flags);
+    if(buffer == NULL)
+        return;
 
-    ESPNOW_ERROR_CHECK(esp_wifi_init(&cfg), "esp_wifi_init");
-    ESPNOW_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM), "esp_wifi_set_storage");
-    ESPNOW_ERROR_CHECK(esp_wifi_set_mode(config->mode), "esp_wifi_set_mode");
+    const uint8_t *payload = espnow_transponder_buffer_data(buffer);
 
-    ESPNOW_ERROR_CHECK(esp_wifi_start(), "esp_wifi_start");
+    if(!filter_accept(payload, buffer->length)) {
+        STATS_ADD(&task_stats, rx_filtered, 1);
+        trace_event(TRACE_RX_DROP, buffer->trace_id, payload, buffer->length, 0, TRACE_DROP_FILTERED);
+        espnow_transponder_buffer_release(buffer);
+        return;
+    }
 
-    ESPNOW_ERROR_CHECK(esp_wifi_set_max_tx_power(config->power), "esp_wifi_set_max_tx_power");
+    trace_event(TRACE_RX_DISPATCH, buffer->trace_id, payload, buffer->length, 0, buffer->length);
 
-    // In order to simplify example, channel is set after WiFi started.
-    // This is not necessary in real application if the two devices have
-    // been already on the same channel.
-    // Note: With IDF 3.3.1, WiFi needs to be in promiscuous mode for the channel setting to work (?)
-    ESPNOW_ERROR_CHECK(esp_wifi_set_promiscuous(true), "esp_wifi_set_promiscuous");
-    ESPNOW_ERROR_CHECK(esp_wifi_set_channel(config->channel, WIFI_SECOND_CHAN_NONE), "esp_wifi_set_channel");
+    const espnow_transponder_rx_callback_t class_callback = class_callbacks[ESPNOW_TRANSPONDER_PACKET_CLASS(flags)];
+    if(class_callback != NULL)
+        class_callback(espnow_transponder_buffer_data(buffer), espnow_transponder_buffer_length(buffer));
+    else if(borrow_callback != NULL)
+        borrow_callback(buffer);
+    else if(rx_callback != NULL)
+        rx_callback(espnow_transponder_buffer_data(buffer), espnow_transponder_buffer_length(buffer));
 
-    // From: https://www.esp32.com/viewtopic.php?t=9965
-    // Change the wifi modulation mode
-    // See 'esp_wifi_types.h' for a list of available data rates
-    const esp_interface_t interface = config->mode == WIFI_MODE_STA? ESP_IF_WIFI_STA : ESP_IF_WIFI_AP;
-    ESPNOW_ERROR_CHECK(esp_wifi_internal_set_fix_rate(interface, true, config->phy_rate), "esp_wifi_internal_set_fix_rate");
+    trace_event(TRACE_RX_DONE, buffer->trace_id, NULL, 0, 0, 0);
 
-    return ESP_OK;
+    espnow_transponder_buffer_release(buffer);
 }
 
-//! \brief Initialize the ESP-NOW interface
-static esp_err_t espnow_init(const espnow_transponder_config_t *config)
+//! \brief Handle a packet that was rebuilt by the FEC decoder
+static void fec_recovered(uint8_t flags, const uint8_t *payload, uint16_t length)
 {
-    espnow_transponder_queue = xQueueCreate(ESPNOW_QUEUE_SIZE, sizeof(espnow_transponder_event_t));
-    if (espnow_transponder_queue == NULL) {
-        ESP_LOGE(TAG, "Create queue fail");
-        return ESP_FAIL;
+    const uint16_t trace_id = trace_new_id();
+    trace_event(TRACE_RX_RECOVERED, trace_id, (flags & ~ESPNOW_TRANSPONDER_FLAG_CLASS_MASK) == 0 ? payload : NULL,
+                length, 0, length);
+
+    espnow_transponder_buffer_t *buffer = buffer_pool_alloc(&decode_pool);
+    if(buffer == NULL) {
+        STATS_ADD(&task_stats, rx_no_buffer, 1);
+        trace_error(TRACE_RX_DROP, trace_id, TRACE_DROP_NO_BUFFER);
+        return;
     }
 
-    esp_err_t ret;
+    memcpy(buffer->data, payload, length);
+    buffer->length = length;
+    buffer->trace_id = trace_id;
 
-    // Initialize ESPNOW and register sending and receiving callback function.
-    ESPNOW_ERROR_CHECK(esp_now_init(), "esp_now_init");
+    dispatch_packet(buffer, flags);
+}
 
-    ESPNOW_ERROR_CHECK(esp_now_register_send_cb(espnow_transponder_send_cb), "esp_now_register_send_cb");
-    ESPNOW_ERROR_CHECK(esp_now_register_recv_cb(espnow_transponder_recv_cb), "esp_now_register_recv_cb");
+//! \brief Hand a finished packet to the transport
+//!
+//! \param packet Packet to send
+//! \param packet_length Length of the packet
+//! \param stats Statistics block of the calling task
+//! \param trace_id Packet id, for the trace
+static esp_err_t send_packet(const uint8_t *packet, uint8_t packet_length, stats_block_t *stats, uint16_t trace_id)
+{
+    trace_event(TRACE_TX_TRANSPORT, trace_id, NULL, 0, 0, packet_length);
+    const esp_err_t ret = transport->send(packet, packet_length);
+    trace_event(TRACE_TX_TRANSPORT_DONE, trace_id, NULL, 0, 0, ret);
 
-    const esp_interface_t interface = config->mode == WIFI_MODE_STA? ESP_IF_WIFI_STA : ESP_IF_WIFI_AP;
+    if(ret != ESP_OK) {
+        STATS_ADD(stats, tx_send_fail, 1);
+        trace_error(TRACE_TX_DROP, trace_id, TRACE_DROP_SEND_FAIL);
+    }
+    else
+        STATS_ADD(stats, tx_bytes, packet_length);
 
-    // Add broadcast peer information to peer list.
-    esp_now_peer_info_t peer = {
-        .channel = config->channel,
-        .ifidx = interface,
-        .encrypt = false,
-    };
-    memcpy(peer.peer_addr, broadcast_mac, sizeof(peer.peer_addr));
+    return ret;
+}
 
-    ESPNOW_ERROR_CHECK(esp_now_add_peer(&peer), "esp_now_add_peer");
+//! \brief Copy a statistics block
+//!
+//! \param block Block to read
+//! \param counters Set to the counters
+//! \param wait If false, give up rather than wait for an update to finish
+//! \return False if it gave up
+static bool stats_read(const stats_block_t *block, espnow_transponder_stats_t *counters, bool wait)
+{
+    // The writer might have been preempted halfway through an update, so
+    // give it a chance to finish
+    while(!stats_block_read(block, counters)) {
+        if(!wait)
+            return false;
 
-    // TODO: error check
-    if(xTaskCreate(espnow_transponder_task, "espnow_task", 2048, NULL, 4, espnow_transponder_task_hdl) != pdPASS) {
-        ESP_LOGE(TAG, "Create task fail");
-        return ESP_FAIL;
+        vTaskDelay(1);
     }
 
-    return ESP_OK;
+    return true;
 }
 
-int espnow_transponder_max_packet_size() {
-    return ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t);
-}
+//! \brief Add up the statistics blocks
+//!
+//! \param stats Set to the totals
+//! \param wait If false, give up rather than wait for an update to finish
+//! \return False if it gave up
+static bool stats_total(espnow_transponder_stats_t *stats, bool wait)
+{
+    const stats_block_t *blocks[] = {&wifi_stats, &task_stats, &sender_stats, &tx_task_stats, &tdma_stats,
+                                     &relay_stats};
 
-void espnow_transponder_register_callback(espnow_transponder_rx_callback_t callback) {
-    rx_callback = callback;
-}
+    memset(stats, 0, sizeof(*stats));
 
-void espnow_transponder_unregister_callback() {
-    rx_callback = NULL;
+    for(int index = 0; index < sizeof(blocks)/sizeof(blocks[0]); index++) {
+        espnow_transponder_stats_t counters;
+        if(!stats_read(blocks[index], &counters, wait))
+            return false;
+
+        stats_sum(stats, &counters);
+    }
+
+    return true;
 }
 
-esp_err_t espnow_transponder_send(const uint8_t *data, uint8_t data_length) {
-    // Encapsulate the data into a packet with the following structure:
-    // packet[0-1]: 16-bit CRC
-    // packet[2]: data length
-    // packet[3-n]: data
+//! \brief Send a control message
+//!
+//! Control messages skip the transmit queue. When pacing, their completions
+//! let the scheduler send a packet a little early, which at a few messages
+//! a second doesn't matter.
+//!
+//! \param message Control message
+//! \param length Length of the message
+//! \param stats Statistics block of the calling task
+static void send_control(const void *message, uint8_t length, stats_block_t *stats)
+{
+    uint8_t packet[ESP_NOW_MAX_DATA_LEN];
+    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
 
-    const uint8_t packet_length = sizeof(espnow_transponder_packet_t) + data_length;
+    memcpy(header->data, message, length);
+    const int packet_length = framing_seal(packet, ESPNOW_TRANSPONDER_FLAG_CONTROL
+                                           | ESPNOW_TRANSPONDER_FLAG_CLASS(ESPNOW_TRANSPONDER_CLASS_CONTROL), length);
 
-    // Check that the total length is under ESP_NOW_MAX_DATA_LEN
-    if(packet_length > ESP_NOW_MAX_DATA_LEN) {
-        ESP_LOGE(TAG, "Packet too big, can't transmit size:%i max:%i", packet_length, ESP_NOW_MAX_DATA_LEN);
-        return ESP_FAIL;
+    const uint16_t trace_id = trace_new_id();
+    trace_event(TRACE_TX_SEND, trace_id, NULL, 0, 0, length);
+
+    if(send_packet(packet, packet_length, stats, trace_id) == ESP_OK) {
+        stats_write_begin(stats);
+        stats->counters.tx_control++;
+        stats->counters.tx_class_packets[ESPNOW_TRANSPONDER_CLASS_CONTROL]++;
+        stats_write_end(stats);
     }
+}
 
-    uint8_t packet[packet_length];
+//! \brief Set up rate control and loss reports
+static void control_init(const espnow_transponder_config_t *config)
+{
+    loss_monitor_init(&loss_monitor);
+    loss_reports_enabled = config->loss_reports;
+
+    rate_control_status.enabled = false;
+    rate_control_status.phy_rate = config->phy_rate;
+    rate_control_status.power = config->power;
+    rate_control_status.loss = -1;
+
+    rate_control_enabled = config->rate_control && transport->set_phy != NULL;
+    if(config->rate_control && !rate_control_enabled)
+        ESP_LOGW(TAG, "Transport %s can't change the PHY rate, rate control disabled", transport->name);
+    if(!rate_control_enabled)
+        return;
 
-    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
-    header->crc = 0;
-    header->data_length = data_length;
-    memcpy(header->data, data, data_length);
+    const rate_control_config_t control_config = {
+        .loss_budget = config->rate_control_loss_budget,
+        .loss_low = config->rate_control_loss_budget/4,
+        .good_windows = ESPNOW_CONTROL_GOOD_WINDOWS,
+        .hold_windows = ESPNOW_CONTROL_HOLD_WINDOWS,
+        .hold_windows_max = ESPNOW_CONTROL_HOLD_MAX,
+        .min_packets = ESPNOW_CONTROL_MIN_PACKETS,
+        .silent_windows = ESPNOW_CONTROL_SILENT_WINDOWS,
+        .power_min = config->power - ESPNOW_CONTROL_POWER_RANGE,
+        .power_max = config->power,
+        .power_step = ESPNOW_CONTROL_POWER_STEP,
+    };
+    rate_control_init(&rate_control, &control_config, config->phy_rate, config->power);
 
-    header->crc = crc16_le(UINT16_MAX, packet, packet_length);
+    if(rate_control_phy_rate(&rate_control) != config->phy_rate)
+        ESP_LOGW(TAG, "PHY rate %i is not on the rate control ladder, starting at %i",
+                 config->phy_rate, rate_control_phy_rate(&rate_control));
 
-    ESP_LOGD(TAG, "header_len:%i data_lenth:%i packet_length%i", sizeof(espnow_transponder_packet_t),data_length, packet_length);
+    control_session = esp_random();
+    control_next_us = esp_timer_get_time() + ESPNOW_CONTROL_INTERVAL_US;
 
-    // TODO: Add length, CRC header
-    return esp_now_send(broadcast_mac, packet, packet_length);
+    rate_control_status.enabled = true;
+    rate_control_status.phy_rate = rate_control_phy_rate(&rate_control);
 }
 
-esp_err_t espnow_transponder_init(const espnow_transponder_config_t *config) {
-    if(config == NULL)
-        return ESP_FAIL;
+//! \brief Get how long the transponder task may sleep before the next control window ends
+static TickType_t control_wait_ticks()
+{
+    if(!rate_control_enabled)
+        return portMAX_DELAY;
 
-    // Initialize NVS 
-    // Note: It's safe to call this multiple times.
-    esp_err_t ret = nvs_flash_init();
-    if(ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
-        ESP_ERROR_CHECK( nvs_flash_erase() );
-        ret = nvs_flash_init();
-    }
-    if(ret != ESP_OK)
-        return ret;
+    const int64_t wait_us = control_next_us - esp_timer_get_time();
+    return wait_us > 0 ? wait_us/1000/portTICK_PERIOD_MS + 1 : 0;
+}
 
-    ESPNOW_ERROR_CHECK(wifi_init(config), "wifi_init");
-    ESPNOW_ERROR_CHECK(espnow_init(config), "espnow_init");
+//! \brief End the control window if it is due: adjust the rate, and send a sender report
+static void control_poll()
+{
+    const int64_t now_us = esp_timer_get_time();
+    if(now_us < control_next_us)
+        return;
 
-    return ESP_OK;
-}
+    control_next_us += ESPNOW_CONTROL_INTERVAL_US;
+    if(control_next_us <= now_us)
+        control_next_us = now_us + ESPNOW_CONTROL_INTERVAL_US;
 
-//! \brief Stop the ESP-NOW transponder
+    if(!stats_total(&control_totals, true))
+        return;
+
+    // The sender's own failures count as loss too
+    const uint64_t failures = (control_totals.tx_send_fail - control_window_start.tx_send_fail)
+        + (control_totals.tx_cb_fail - control_window_start.tx_cb_fail);
+    rate_control_send_result(&rate_control, control_totals.tx_count - control_window_start.tx_count
+                             + control_totals.tx_send_fail - control_window_start.tx_send_fail, failures);
+    control_window_start = control_totals;
+
+    if(rate_control_update(&rate_control)) {
+        const wifi_phy_rate_t phy_rate = rate_control_phy_rate(&rate_control);
+        if(transport->set_phy(phy_rate, rate_control.power) == ESP_OK)
+            ESP_LOGI(TAG, "Rate control: phy_rate:%i power:%i loss:%i/1000",
+                     phy_rate, rate_control.power, (int)(rate_control.last_loss*1000));
+    }
+
+    rate_control_status.phy_rate = rate_control_phy_rate(&rate_control);
+    rate_control_status.power = rate_control.power;
+    rate_control_status.loss = rate_control.last_loss;
+    rate_control_status.changes = rate_control.changes;
+
+    // Send completions are counted, which includes control messages. A
+    // control message can be sent but not yet complete, so never let the
+    // count go backwards.
+    const uint32_t packets = control_totals.tx_count - control_totals.tx_control;
+    if((int32_t)(packets - control_packets) > 0)
+        control_packets = packets;
+
+    const control_sender_report_t report = {
+        .type = CONTROL_SENDER_REPORT,
+        .session = control_session,
+        .packets = control_packets,
+    };
+    send_control(&report, sizeof(report), &task_stats);
+}
+
+//! \brief Ask the TDMA master for a slot, or to keep this node's slot
+//!
+//! \param stats Statistics block of the calling task
+static void tdma_send_slot_request(stats_block_t *stats)
+{
+    const tdma_slot_request_t request = {
+        .type = CONTROL_SLOT_REQUEST,
+        .id = tdma_sender.id,
+    };
+    send_control(&request, sizeof(request), stats);
+}
+
+//! \brief Get the traffic classes with events waiting for the transponder task, one bit per class
+static uint32_t rx_ready()
+{
+    uint32_t ready = 0;
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++)
+        if(event_ring_depth(&espnow_transponder_queues[traffic_class]) > 0)
+            ready |= 1u << traffic_class;
+
+    return ready;
+}
+
+//! \brief TX/RX callback handler task
+//!
+//! Events are taken from the queue of each traffic class in the order that
+//! the class scheduler picks, so that urgent packets don't wait behind a
+//! backlog of DMX.
+static void espnow_transponder_task(void *pvParameter)
+{
+    espnow_transponder_event_t evt;
+
+    while (true) {
+        if(rate_control_enabled)
+            control_poll();
+
+        // Sleep until the WiFi task posts something, or the control window ends
+        const uint32_t ready = rx_ready();
+        const int traffic_class = traffic_class_select(&rx_scheduler, ready);
+        if(traffic_class < 0 || !event_ring_pop(&espnow_transponder_queues[traffic_class], &evt)) {
+            ulTaskNotifyTake(pdTRUE, control_wait_ticks());
+            continue;
+        }
+
+        traffic_class_served(&rx_scheduler, traffic_class, ready);
+
+        switch (evt.id) {
+            case ESPNOW_TRANSPONDER_RECV_CB:
+            {
+                espnow_transponder_event_recv_cb_t *recv_cb = &evt.info.recv_cb;
+                espnow_transponder_buffer_t *buffer = recv_cb->buffer;
+                const espnow_transponder_packet_t *packet = (const espnow_transponder_packet_t *)buffer->data;
+                const uint8_t flags = packet->flags & ~(ESPNOW_TRANSPONDER_FLAG_FEC | ESPNOW_TRANSPONDER_FLAG_RELAY);
+
+                trace_event(TRACE_RX_DEQUEUED, buffer->trace_id, NULL, 0,
+                            event_ring_depth(&espnow_transponder_queues[traffic_class]), 0);
+
+                stats_write_begin(&task_stats);
+                task_stats.counters.rx_class_packets[traffic_class]++;
+                task_stats.counters.rx_class_latency_us[traffic_class] += (uint32_t)esp_timer_get_time() - buffer->queued_us;
+                stats_write_end(&task_stats);
+
+                // Parity packets, and data packets that were already rebuilt,
+                // are consumed by the decoder.
+                if(packet->flags & ESPNOW_TRANSPONDER_FLAG_FEC) {
+                    const uint32_t unrecoverable = fec_decoder.unrecoverable;
+                    // The FEC header comes just before the payload
+                    const fec_header_t *fec_header = (const fec_header_t *)
+                        (espnow_transponder_buffer_data(buffer) - sizeof(fec_header_t));
+                    if(recv_cb->fec_filtered != 0)
+                        fec_decoder_filter(&fec_decoder, fec_header, recv_cb->fec_filtered);
+                    const bool dispatch = fec_decoder_add(&fec_decoder, fec_header, flags,
+                                                          espnow_transponder_buffer_data(buffer), buffer->length,
+                                                          fec_recovered);
+
+                    // The decoder keeps its own counts
+                    stats_write_begin(&task_stats);
+                    task_stats.counters.rx_fec_recovered = fec_decoder.recovered;
+                    task_stats.counters.rx_fec_unrecoverable = fec_decoder.unrecoverable;
+                    stats_write_end(&task_stats);
+
+                    if(fec_decoder.unrecoverable != unrecoverable)
+                        trace_error(TRACE_RX_DROP, buffer->trace_id, TRACE_DROP_FEC_UNRECOVERABLE);
+
+                    if(!dispatch) {
+                        espnow_transponder_buffer_release(buffer);
+                        break;
+                    }
+                }
+
+                dispatch_packet(buffer, flags);
+                break;
+            }
+            case ESPNOW_TRANSPONDER_LOSS_REPORT_CB:
+            {
+                const control_loss_report_t *report = &evt.info.loss_report;
+                if(report->session == control_session)
+                    rate_control_loss_report(&rate_control, report->expected, report->received);
+                break;
+            }
+            case ESPNOW_TRANSPONDER_SEND_LOSS_REPORT:
+                send_control(&evt.info.loss_report, sizeof(evt.info.loss_report), &task_stats);
+                break;
+            case ESPNOW_TRANSPONDER_SEND_SLOT_REQUEST:
+                tdma_send_slot_request(&task_stats);
+                break;
+//            case ESPNOW_TRANSPONDER_STOP_TASK:
+//                goto stop_task;
+//                break;
+            default:
+                ESP_LOGE(TAG, "Callback type error: %d", evt.id);
+                break;
+        }
+    }
+
+//stop_task:
+    espnow_transponder_task_hdl = NULL;
+    vTaskDelete(NULL);
+}
+
+//! \brief Check if packets of a class are spread over the frame, rather than sent as soon as they can be
+static inline bool tx_class_paced(espnow_transponder_class_t traffic_class)
+{
+    return traffic_class == ESPNOW_TRANSPONDER_CLASS_REALTIME || traffic_class == ESPNOW_TRANSPONDER_CLASS_BULK;
+}
+
+//! \brief Get the number of packets waiting to be paced out, including frame end markers
+static uint32_t tx_backlog()
+{
+    return uxQueueMessagesWaiting(tx_queues[ESPNOW_TRANSPONDER_CLASS_REALTIME])
+        + uxQueueMessagesWaiting(tx_queues[ESPNOW_TRANSPONDER_CLASS_BULK]);
+}
+
+//! \brief Get the traffic classes with packets waiting in the transmit queues, one bit per class
+static uint32_t tx_ready()
+{
+    uint32_t ready = 0;
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++)
+        if(uxQueueMessagesWaiting(tx_queues[traffic_class]) > 0)
+            ready |= 1u << traffic_class;
+
+    return ready;
+}
+
+//! \brief Determine how long the transmit scheduler has to wait before sending a packet
+//!
+//! \param traffic_class Class of the packet
+//! \param length Length of the packet
+//! \return 0 if the packet can be sent now, otherwise the time to wait, in microseconds
+static int64_t tx_delay(espnow_transponder_class_t traffic_class, uint16_t length)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    if(tdma_role != ESPNOW_TRANSPONDER_TDMA_OFF) {
+        // Packets still in flight go on the air ahead of this one
+        const uint32_t airtime_us = (atomic_load(&tx_pacer.in_flight) + 1)
+            *tdma_airtime_us(rate_control_status.phy_rate, length);
+        const int64_t slot_delay_us = tdma_sender_delay(&tdma_sender, now_us, airtime_us);
+
+        // Within the slot, packets go out back to back
+        if(slot_delay_us == 0)
+            return tx_pacer_flow_delay(&tx_pacer, now_us);
+        if(slot_delay_us > 0)
+            return slot_delay_us;
+    }
+
+    if(!tx_class_paced(traffic_class))
+        return tx_pacer_flow_delay(&tx_pacer, now_us);
+
+    return tx_pacer_delay(&tx_pacer, now_us, tx_backlog());
+}
+
+//! \brief Wait until a delay is over, or a send completion or new packet arrives
+static void tx_wait(int64_t delay_us)
+{
+    // A TDMA slot can be shorter than a tick, so its start is timed more
+    // precisely. The tick timeout is only a backstop.
+    if(tx_wake_timer != NULL) {
+        esp_timer_stop(tx_wake_timer);
+        esp_timer_start_once(tx_wake_timer, delay_us);
+    }
+
+    ulTaskNotifyTake(pdTRUE, delay_us/1000/portTICK_PERIOD_MS + 1);
+}
+
+//! \brief TDMA wake timer callback, lets the transmit scheduler send in its slot
+static void tx_wake_timer_cb(void *arg)
+{
+    xTaskNotifyGive(espnow_transponder_tx_task_hdl);
+}
+
+//! \brief Transmit scheduler task
+//!
+//! Takes packets from the transmit queues, in the order that the class
+//! scheduler picks, and sends them when the pacer allows it. Send
+//! completions wake the task early, so that it doesn't wait longer than
+//! needed when limited by the number of packets in flight, and so do new
+//! packets, so that an urgent one doesn't wait for a paced one to go out.
+//!
+//! With TDMA, packets are held back until this node's slot instead, and
+//! sent back to back once it starts.
+static void espnow_transponder_tx_task(void *pvParameter)
+{
+    espnow_transponder_buffer_t *buffer;
+
+    while (true) {
+        if(uxQueueMessagesWaiting(tx_queues[ESPNOW_TRANSPONDER_CLASS_REALTIME]) == 0
+            && atomic_exchange(&tx_frame_end_pending, false))
+            tx_pacer_frame_end(&tx_pacer, esp_timer_get_time());
+
+        const uint32_t ready = tx_ready();
+        const int traffic_class = traffic_class_select(&tx_scheduler, ready);
+        if(traffic_class < 0) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        // Only this task takes packets off the queues, so the one peeked at
+        // is the one received
+        const xQueueHandle queue = tx_queues[traffic_class];
+        xQueuePeek(queue, &buffer, 0);
+        if(buffer == NULL) {
+            xQueueReceive(queue, &buffer, 0);
+            tx_pacer_frame_end(&tx_pacer, esp_timer_get_time());
+            continue;
+        }
+
+        // Pick again after waiting, in case something more urgent arrived
+        const int64_t delay_us = tx_delay(traffic_class, buffer->length);
+        if(delay_us > 0) {
+            tx_wait(delay_us);
+            continue;
+        }
+
+        xQueueReceive(queue, &buffer, 0);
+        traffic_class_served(&tx_scheduler, traffic_class, ready);
+        trace_event(TRACE_TX_DEQUEUED, buffer->trace_id, NULL, 0, uxQueueMessagesWaiting(queue), 0);
+
+        // The request to keep the slot goes out in the slot, where it can't
+        // collide. Its airtime comes out of the guard time.
+        if(tdma_role == ESPNOW_TRANSPONDER_TDMA_SENDER && tdma_sender_take_refresh(&tdma_sender))
+            tdma_send_slot_request(&tx_task_stats);
+
+        if(send_packet(buffer->data, buffer->length, &tx_task_stats, buffer->trace_id) == ESP_OK) {
+            const int64_t now_us = esp_timer_get_time();
+            if(tx_class_paced(traffic_class))
+                tx_pacer_sent(&tx_pacer, now_us);
+            else
+                tx_pacer_sent_unpaced(&tx_pacer, now_us);
+
+            stats_write_begin(&tx_task_stats);
+            tx_task_stats.counters.tx_class_packets[traffic_class]++;
+            tx_task_stats.counters.tx_class_latency_us[traffic_class] += (uint32_t)now_us - buffer->queued_us;
+            stats_write_end(&tx_task_stats);
+        }
+
+        espnow_transponder_buffer_release(buffer);
+    }
+
+    espnow_transponder_tx_task_hdl = NULL;
+    vTaskDelete(NULL);
+}
+
+//! \brief Start the transmit scheduler
+static esp_err_t tx_scheduler_init(const espnow_transponder_config_t *config)
+{
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++) {
+        if(buffer_pool_init(&tx_pools[traffic_class], ESP_NOW_MAX_DATA_LEN, tx_queue_sizes[traffic_class]) != ESP_OK) {
+            ESP_LOGE(TAG, "Create transmit pool fail");
+            return ESP_FAIL;
+        }
+
+        // The realtime queue has one extra entry for each frame end marker that might be queued
+        const uint16_t length = tx_queue_sizes[traffic_class]
+            * (traffic_class == ESPNOW_TRANSPONDER_CLASS_REALTIME ? 2 : 1);
+        tx_queues[traffic_class] = xQueueCreate(length, sizeof(espnow_transponder_buffer_t *));
+        if (tx_queues[traffic_class] == NULL) {
+            ESP_LOGE(TAG, "Create transmit queue fail");
+            return ESP_FAIL;
+        }
+    }
+
+    tx_pacer_init(&tx_pacer, config->tx_framerate, config->tx_max_in_flight);
+    traffic_class_init(&tx_scheduler, config->class_weights);
+    pacing_enabled = true;
+
+    if(xTaskCreate(espnow_transponder_tx_task, "espnow_tx_task", ESPNOW_TASK_STACK_SIZE, NULL, 5, &espnow_transponder_tx_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create transmit task fail");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+//! \brief Relay wake timer callback, lets the relay task send the next packet when it is due
+static void relay_wake_timer_cb(void *arg)
+{
+    xTaskNotifyGive(espnow_transponder_relay_task_hdl);
+}
+
+//! \brief Relay task
+//!
+//! Sends the packets queued by the WiFi task, each once its jitter has
+//! passed. Packets are queued in the order they are due.
+static void espnow_transponder_relay_task(void *pvParameter)
+{
+    relay_entry_t entry;
+
+    while (xQueueReceive(relay_queue, &entry, portMAX_DELAY) == pdTRUE) {
+        espnow_transponder_buffer_t *buffer = entry.buffer;
+
+        trace_event(TRACE_TX_DEQUEUED, buffer->trace_id, NULL, 0, uxQueueMessagesWaiting(relay_queue), 0);
+
+        // The jitter is shorter than a tick, so the wait is timed precisely
+        int64_t delay_us;
+        while((delay_us = entry.due_us - esp_timer_get_time()) > 0) {
+            esp_timer_stop(relay_wake_timer);
+            esp_timer_start_once(relay_wake_timer, delay_us);
+            ulTaskNotifyTake(pdTRUE, delay_us/1000/portTICK_PERIOD_MS + 1);
+        }
+
+        if(send_packet(buffer->data, buffer->length, &relay_stats, buffer->trace_id) == ESP_OK)
+            STATS_ADD(&relay_stats, tx_relayed, 1);
+
+        espnow_transponder_buffer_release(buffer);
+    }
+
+    espnow_transponder_relay_task_hdl = NULL;
+    vTaskDelete(NULL);
+}
+
+//! \brief Set up duplicate suppression, the relay header of outgoing packets, and relaying
+static esp_err_t relay_setup(const espnow_transponder_config_t *config)
+{
+    const relay_config_t relay_config = {
+        .origin = relay_origin(esp_random()),
+        .forward = config->relay,
+        .jitter_us = config->relay_jitter_us,
+        .rate = config->relay_rate,
+        .burst = ESPNOW_RELAY_BURST,
+        .seed = esp_random() | 1,
+    };
+    relay_init(&relay, &relay_config);
+
+    relay_ttl = config->relay_ttl;
+    atomic_store(&relay_sequence, esp_random());
+
+    if(!config->relay)
+        return ESP_OK;
+
+    if(buffer_pool_init(&relay_pool, ESP_NOW_MAX_DATA_LEN, ESPNOW_RELAY_QUEUE_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "Create relay pool fail");
+        return ESP_FAIL;
+    }
+
+    relay_queue = xQueueCreate(ESPNOW_RELAY_QUEUE_SIZE, sizeof(relay_entry_t));
+    if (relay_queue == NULL) {
+        ESP_LOGE(TAG, "Create relay queue fail");
+        return ESP_FAIL;
+    }
+
+    const esp_timer_create_args_t wake_timer_args = {
+        .callback = relay_wake_timer_cb,
+        .name = "espnow_relay_wake",
+    };
+    if(esp_timer_create(&wake_timer_args, &relay_wake_timer) != ESP_OK) {
+        ESP_LOGE(TAG, "Create relay wake timer fail");
+        return ESP_FAIL;
+    }
+
+    if(xTaskCreate(espnow_transponder_relay_task, "espnow_relay_task", ESPNOW_TASK_STACK_SIZE, NULL, 5, &espnow_transponder_relay_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create relay task fail");
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Relay: origin:%04x jitter:%uus rate:%u/s", relay_config.origin, config->relay_jitter_us,
+             config->relay_rate);
+
+    return ESP_OK;
+}
+
+//! \brief TDMA beacon timer callback, starts a frame on the master
+static void tdma_beacon_timer_cb(void *arg)
+{
+    uint32_t id;
+    while(event_ring_pop(&tdma_requests, &id))
+        if(!tdma_master_request(&tdma_master, id))
+            ESP_LOGD(TAG, "TDMA: no free slot for %08x", id);
+
+    // The master sends in a slot of its own, if it sends at all
+    if(pacing_enabled)
+        tdma_master_request(&tdma_master, tdma_sender.id);
+
+    const int64_t now_us = esp_timer_get_time();
+    tdma_beacon_t beacon;
+    const uint16_t length = tdma_master_beacon(&tdma_master, now_us, now_us, &beacon);
+    send_control(&beacon, length, &tdma_stats);
+
+    // The master follows its own schedule, on its own clock
+    tdma_sender_beacon(&tdma_sender, &beacon, length, now_us);
+}
+
+//! \brief Set up the TDMA schedule
+//!
+//! The beacon timer is created here, but only started once the transport is up.
+static esp_err_t tdma_init(const espnow_transponder_config_t *config)
+{
+    tdma_role = ESPNOW_TRANSPONDER_TDMA_OFF;
+    if(config->tdma == ESPNOW_TRANSPONDER_TDMA_OFF)
+        return ESP_OK;
+
+    const uint32_t frame_us = config->tdma_frame_us > 0 ? config->tdma_frame_us
+        : config->tx_framerate > 0 ? 1000000/config->tx_framerate : 0;
+
+    if(config->tdma == ESPNOW_TRANSPONDER_TDMA_SENDER && !pacing_enabled) {
+        ESP_LOGW(TAG, "TDMA senders need tx_framerate to hold packets for their slot, TDMA disabled");
+        return ESP_OK;
+    }
+    if(config->tdma == ESPNOW_TRANSPONDER_TDMA_MASTER && frame_us <= ESPNOW_TDMA_BEACON_US) {
+        ESP_LOGW(TAG, "TDMA frame of %uus is too short, set tdma_frame_us or tx_framerate. TDMA disabled", frame_us);
+        return ESP_OK;
+    }
+
+    uint32_t id;
+    while((id = esp_random()) == 0)
+        ;
+    tdma_sender_init(&tdma_sender, id);
+
+    if(pacing_enabled) {
+        const esp_timer_create_args_t wake_timer_args = {
+            .callback = tx_wake_timer_cb,
+            .name = "espnow_tx_wake",
+        };
+        if(esp_timer_create(&wake_timer_args, &tx_wake_timer) != ESP_OK) {
+            ESP_LOGE(TAG, "Create transmit wake timer fail");
+            return ESP_FAIL;
+        }
+    }
+
+    if(config->tdma == ESPNOW_TRANSPONDER_TDMA_MASTER) {
+        tdma_master_init(&tdma_master, frame_us, ESPNOW_TDMA_BEACON_US, config->tdma_guard_us);
+
+        if(event_ring_init(&tdma_requests, sizeof(uint32_t), ESPNOW_TDMA_REQUEST_QUEUE_SIZE,
+                           ESPNOW_TRANSPONDER_DROP_NEWEST) != ESP_OK) {
+            ESP_LOGE(TAG, "Create slot request queue fail");
+            return ESP_FAIL;
+        }
+
+        const esp_timer_create_args_t beacon_timer_args = {
+            .callback = tdma_beacon_timer_cb,
+            .name = "espnow_beacon",
+        };
+        if(esp_timer_create(&beacon_timer_args, &tdma_beacon_timer) != ESP_OK) {
+            ESP_LOGE(TAG, "Create beacon timer fail");
+            return ESP_FAIL;
+        }
+    }
+
+    tdma_role = config->tdma;
+    ESP_LOGI(TAG, "TDMA %s, id:%08x", tdma_role == ESPNOW_TRANSPONDER_TDMA_MASTER ? "master" : "sender", id);
+
+    return ESP_OK;
+}
+
+//! \brief Rate timer callback, computes the rates over the window that just ended
+static void rate_timer_cb(void *arg)
+{
+    const int64_t now_us = esp_timer_get_time();
+
+    // Don't hold up the other timers; this window will just run long
+    espnow_transponder_stats_t totals;
+    if(!stats_total(&totals, false))
+        return;
+
+    stats_write_begin(&rate_stats);
+    stats_rates(&rate_stats.counters, &totals, &rate_window_start, now_us - rate_window_start_us);
+    stats_write_end(&rate_stats);
+
+    rate_window_start = totals;
+    rate_window_start_us = now_us;
+}
+
+//! \brief Line a core's cycle counter up with esp_timer, which all cores share
+static void trace_calibrate_core(void *arg)
+{
+    const uint32_t cycles = xthal_get_ccount();
+    const int64_t now_us = esp_timer_get_time();
+
+    trace_cycle_offset[xPortGetCoreID()] = (uint32_t)now_us*trace.ticks_per_us - cycles;
+}
+
+//! \brief Set up the pipeline trace, and measure what recording costs
+static esp_err_t trace_setup(const espnow_transponder_config_t *config)
+{
+    if(!trace_init(&trace, config->trace_records, config->trace_records/4, esp_clk_cpu_freq()/1000000)) {
+        ESP_LOGE(TAG, "Create trace fail");
+        return ESP_FAIL;
+    }
+
+    if(config->trace_records == 0)
+        return ESP_OK;
+
+    trace_freeze_on_error = config->trace_freeze_on_error;
+
+    for(int core = 0; core < portNUM_PROCESSORS; core++) {
+        if(core == xPortGetCoreID())
+            trace_calibrate_core(NULL);
+        else
+            esp_ipc_call_blocking(core, trace_calibrate_core, NULL);
+    }
+
+    const uint32_t start = xthal_get_ccount();
+    for(int record = 0; record < ESPNOW_TRACE_MEASURE_RECORDS; record++)
+        trace_event(0, 0, NULL, 0, 0, 0);
+    const uint32_t cycles = (xthal_get_ccount() - start)/ESPNOW_TRACE_MEASURE_RECORDS;
+
+    // Throw the measurement away
+    trace_rearm(&trace);
+
+    ESP_LOGI(TAG, "Trace: %i records, %u cycles (%u ns) per record",
+             config->trace_records, cycles, cycles*1000/trace.ticks_per_us);
+
+    return ESP_OK;
+}
+
+//! \brief Initialize the transponder and its transport
+static esp_err_t espnow_init(const espnow_transponder_config_t *config)
+{
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++) {
+        if(buffer_pool_init(&rx_pools[traffic_class], ESP_NOW_MAX_DATA_LEN,
+                            rx_queue_sizes[traffic_class] + ESPNOW_RX_POOL_SPARE) != ESP_OK) {
+            ESP_LOGE(TAG, "Create receive pool fail");
+            return ESP_FAIL;
+        }
+    }
+
+    if(buffer_pool_init(&decode_pool, ESPNOW_TRANSPONDER_MAX_DATA_LENGTH, ESPNOW_DECODE_POOL_SIZE) != ESP_OK) {
+        ESP_LOGE(TAG, "Create receive pool fail");
+        return ESP_FAIL;
+    }
+
+    if(trace_setup(config) != ESP_OK)
+        return ESP_FAIL;
+
+    compression_enabled = config->compression;
+
+    fec_init();
+    fec_decoder_init(&fec_decoder);
+    fec_enabled = config->fec_k > 0 && config->fec_m > 0;
+    if(fec_enabled)
+        fec_encoder_init(&fec_encoder, config->fec_k, config->fec_m);
+
+    if(config->tx_framerate > 0 && tx_scheduler_init(config) != ESP_OK)
+        return ESP_FAIL;
+
+    const esp_timer_create_args_t rate_timer_args = {
+        .callback = rate_timer_cb,
+        .name = "espnow_rate",
+    };
+    rate_window_start_us = esp_timer_get_time();
+    if(esp_timer_create(&rate_timer_args, &rate_timer) != ESP_OK
+        || esp_timer_start_periodic(rate_timer, ESPNOW_TRANSPONDER_RATE_WINDOW_US) != ESP_OK) {
+        ESP_LOGE(TAG, "Create rate timer fail");
+        return ESP_FAIL;
+    }
+
+    for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++) {
+        if (event_ring_init(&espnow_transponder_queues[traffic_class], sizeof(espnow_transponder_event_t),
+                            rx_queue_sizes[traffic_class], config->overflow_policy) != ESP_OK) {
+            ESP_LOGE(TAG, "Create queue fail");
+            return ESP_FAIL;
+        }
+    }
+
+    traffic_class_init(&rx_scheduler, config->class_weights);
+
+    control_init(config);
+
+    if(tdma_init(config) != ESP_OK)
+        return ESP_FAIL;
+
+    if(relay_setup(config) != ESP_OK)
+        return ESP_FAIL;
+
+    // The task needs to exist before the callbacks are registered, so that
+    // they have something to notify.
+    if(xTaskCreate(espnow_transponder_task, "espnow_task", ESPNOW_TASK_STACK_SIZE, NULL, 4, &espnow_transponder_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create task fail");
+        return ESP_FAIL;
+    }
+
+    esp_err_t ret;
+
+    // Bring up the transport, then register sending and receiving callback functions.
+    ESPNOW_ERROR_CHECK(transport->init(config), transport->name);
+    ESPNOW_ERROR_CHECK(transport->register_callbacks(espnow_transponder_recv_cb, espnow_transponder_send_cb),
+                       "register_callbacks");
+
+    if(tdma_beacon_timer != NULL) {
+        ESPNOW_ERROR_CHECK(esp_timer_start_periodic(tdma_beacon_timer, tdma_master.frame_us), "tdma_beacon_timer");
+    }
+
+    return ESP_OK;
+}
+
+int espnow_transponder_max_packet_size() {
+    const int relay_length = relay_ttl > 0 ? sizeof(espnow_transponder_relay_header_t) : 0;
+
+    if(fec_enabled)
+        return FEC_MAX_PAYLOAD - relay_length;
+
+    return ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t) - relay_length;
+}
+
+int espnow_transponder_max_compressed_size() {
+    return compression_enabled ? ESPNOW_TRANSPONDER_MAX_DATA_LENGTH : espnow_transponder_max_packet_size();
+}
+
+esp_err_t espnow_transponder_subscribe(uint16_t key) {
+    if(key >= ESPNOW_TRANSPONDER_MAX_KEYS)
+        return ESP_ERR_INVALID_ARG;
+
+    atomic_fetch_or(&filter_keys[key/32], 1u << (key%32));
+    atomic_store(&filter_enabled, true);
+    return ESP_OK;
+}
+
+esp_err_t espnow_transponder_unsubscribe(uint16_t key) {
+    if(key >= ESPNOW_TRANSPONDER_MAX_KEYS)
+        return ESP_ERR_INVALID_ARG;
+
+    atomic_fetch_and(&filter_keys[key/32], ~(1u << (key%32)));
+    return ESP_OK;
+}
+
+void espnow_transponder_subscribe_all() {
+    atomic_store(&filter_enabled, false);
+
+    for(int word = 0; word < ESPNOW_TRANSPONDER_MAX_KEYS/32; word++)
+        atomic_store(&filter_keys[word], 0);
+}
+
+void espnow_transponder_register_callback(espnow_transponder_rx_callback_t callback) {
+    rx_callback = callback;
+}
+
+void espnow_transponder_unregister_callback() {
+    rx_callback = NULL;
+}
+
+void espnow_transponder_register_borrow_callback(espnow_transponder_borrow_callback_t callback) {
+    borrow_callback = callback;
+}
+
+void espnow_transponder_unregister_borrow_callback() {
+    borrow_callback = NULL;
+}
+
+esp_err_t espnow_transponder_register_class_callback(espnow_transponder_class_t traffic_class,
+                                                     espnow_transponder_rx_callback_t callback) {
+    if((unsigned int)traffic_class >= ESPNOW_TRANSPONDER_CLASS_COUNT)
+        return ESP_ERR_INVALID_ARG;
+
+    class_callbacks[traffic_class] = callback;
+    return ESP_OK;
+}
+
+//! \brief Fill in the relay header for an outgoing packet
+//!
+//! \param header Header to fill in
+//! \return The header, or NULL if outgoing packets aren't relayed
+static const espnow_transponder_relay_header_t *relay_header_next(espnow_transponder_relay_header_t *header)
+{
+    if(relay_ttl == 0)
+        return NULL;
+
+    header->origin = relay.config.origin;
+    header->sequence = atomic_fetch_add_explicit(&relay_sequence, 1, memory_order_relaxed);
+    header->ttl = relay_ttl;
+    return header;
+}
+
+//! \brief Encapsulate data into a transponder packet, see framing_build()
+//!
+//! \param packet Buffer to build the packet in, at least ESP_NOW_MAX_DATA_LEN bytes
+//! \param parts Parts of the data, in order
+//! \param part_count Number of parts
+//! \param traffic_class Traffic class of the packet
+//! \param group_full Set to true if this packet completed a FEC group
+//! \return Packet length, or -1 if the data did not fit
+static int build_packet(uint8_t *packet, const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                        espnow_transponder_class_t traffic_class, bool *group_full)
+{
+    // Only realtime packets are protected. Parity goes out in the realtime
+    // class, so packets of another class in a group would have their
+    // parity scheduled ahead of or behind them, and share their loss.
+    const bool fec = fec_enabled && traffic_class == ESPNOW_TRANSPONDER_CLASS_REALTIME;
+
+    const int max_data_length = espnow_transponder_max_packet_size();
+    espnow_transponder_relay_header_t relay_header;
+    const int packet_length = framing_build(packet, max_data_length, parts, part_count, compression_enabled,
+                                            traffic_class, relay_header_next(&relay_header),
+                                            fec ? &fec_encoder : NULL, group_full);
+
+    if(packet_length < 0) {
+        if(compression_enabled)
+            ESP_LOGD(TAG, "Packet did not compress enough, size:%u max:%i", framing_parts_length(parts, part_count), max_data_length);
+        else
+            ESP_LOGE(TAG, "Packet too big, can't transmit size:%u max:%i", framing_parts_length(parts, part_count), max_data_length);
+    }
+
+    return packet_length;
+}
+
+//! \brief Build a parity packet for the current FEC group
+//!
+//! \param packet Buffer to build the packet in, at least ESP_NOW_MAX_DATA_LEN bytes
+//! \param parity Parity packet index
+//! \return Packet length
+static int build_parity_packet(uint8_t *packet, uint8_t parity)
+{
+    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+    uint8_t flags = ESPNOW_TRANSPONDER_FLAG_FEC;
+    uint8_t *fec_header = header->data;
+
+    // Parity is relayed along with the data it protects
+    espnow_transponder_relay_header_t relay_header;
+    if(relay_header_next(&relay_header) != NULL) {
+        memcpy(fec_header, &relay_header, sizeof(relay_header));
+        fec_header += sizeof(relay_header);
+        flags |= ESPNOW_TRANSPONDER_FLAG_RELAY;
+    }
+
+    const uint16_t unit_length = fec_encoder_parity(&fec_encoder, parity, (fec_header_t *)fec_header,
+                                                    fec_header + sizeof(fec_header_t));
+
+    return framing_seal(packet, flags, fec_header - header->data + sizeof(fec_header_t) + unit_length);
+}
+
+//! \brief Get a buffer to build an outgoing packet in
+//!
+//! When pacing, this is a slot from the transmit pool, otherwise it is the
+//! caller's stack buffer.
+//!
+//! \param stack_packet Caller's buffer, ESP_NOW_MAX_DATA_LEN bytes
+//! \param buffer Set to the transmit slot, or NULL if not pacing
+//! \param traffic_class Traffic class of the packet
+//! \param trace_id Packet id, for the trace
+//! \return Where to build the packet, or NULL if the transmit queue is full
+static uint8_t *tx_begin(uint8_t *stack_packet, espnow_transponder_buffer_t **buffer,
+                         espnow_transponder_class_t traffic_class, uint16_t trace_id)
+{
+    *buffer = NULL;
+    if(!pacing_enabled)
+        return stack_packet;
+
+    *buffer = buffer_pool_alloc(&tx_pools[traffic_class]);
+    if(*buffer == NULL) {
+        stats_write_begin(&sender_stats);
+        sender_stats.counters.tx_queue_full++;
+        sender_stats.counters.tx_class_dropped[traffic_class]++;
+        stats_write_end(&sender_stats);
+        trace_error(TRACE_TX_DROP, trace_id, TRACE_DROP_QUEUE_FULL);
+        return NULL;
+    }
+
+    (*buffer)->trace_id = trace_id;
+    return (*buffer)->data;
+}
+
+//! \brief Send a packet built with tx_begin(), or add it to the transmit queue of its class
+static esp_err_t tx_commit(uint8_t *packet, espnow_transponder_buffer_t *buffer, int packet_length,
+                           espnow_transponder_class_t traffic_class, uint16_t trace_id)
+{
+    if(packet_length < 0) {
+        if(buffer != NULL)
+            espnow_transponder_buffer_release(buffer);
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    if(buffer == NULL) {
+        const esp_err_t ret = send_packet(packet, packet_length, &sender_stats, trace_id);
+        if(ret == ESP_OK)
+            STATS_ADD(&sender_stats, tx_class_packets[traffic_class], 1);
+        return ret;
+    }
+
+    buffer->length = packet_length;
+    buffer->queued_us = esp_timer_get_time();
+    if(xQueueSend(tx_queues[traffic_class], &buffer, 0) != pdTRUE) {
+        stats_write_begin(&sender_stats);
+        sender_stats.counters.tx_queue_full++;
+        sender_stats.counters.tx_class_dropped[traffic_class]++;
+        stats_write_end(&sender_stats);
+        trace_error(TRACE_TX_DROP, trace_id, TRACE_DROP_QUEUE_FULL);
+        espnow_transponder_buffer_release(buffer);
+        return ESP_ERR_NO_MEM;
+    }
+
+    trace_event(TRACE_TX_QUEUED, trace_id, NULL, 0, uxQueueMessagesWaiting(tx_queues[traffic_class]), 0);
+    xTaskNotifyGive(espnow_transponder_tx_task_hdl);
+    return ESP_OK;
+}
+
+//! \brief Send the parity packets for the current FEC group, and start the next one
+static void fec_flush()
+{
+    uint8_t stack_packet[ESP_NOW_MAX_DATA_LEN];
+    espnow_transponder_buffer_t *buffer;
+
+    for(uint8_t parity = 0; parity < fec_encoder_parity_count(&fec_encoder); parity++) {
+        const uint16_t trace_id = trace_new_id();
+        trace_event(TRACE_TX_SEND, trace_id, NULL, 0, 0, 0);
+
+        uint8_t *packet = tx_begin(stack_packet, &buffer, ESPNOW_TRANSPONDER_CLASS_REALTIME, trace_id);
+        if(packet == NULL)
+            break;
+
+        if(tx_commit(packet, buffer, build_parity_packet(packet, parity), ESPNOW_TRANSPONDER_CLASS_REALTIME,
+                     trace_id) == ESP_OK)
+            STATS_ADD(&sender_stats, tx_fec_parity, 1);
+    }
+
+    fec_encoder_next_group(&fec_encoder);
+}
+
+//! \brief Send one packet, see espnow_transponder_sendv_class()
+static esp_err_t sendv(const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                       espnow_transponder_class_t traffic_class, uint16_t trace_id)
+{
+    uint8_t stack_packet[ESP_NOW_MAX_DATA_LEN];
+    espnow_transponder_buffer_t *buffer;
+
+    if((unsigned int)traffic_class >= ESPNOW_TRANSPONDER_CLASS_COUNT)
+        return ESP_ERR_INVALID_ARG;
+
+    // The key and sequence are at the start of the first part
+    trace_event(TRACE_TX_SEND, trace_id, part_count > 0 ? parts[0].data : NULL, part_count > 0 ? parts[0].length : 0,
+                0, framing_parts_length(parts, part_count));
+
+    uint8_t *packet = tx_begin(stack_packet, &buffer, traffic_class, trace_id);
+    if(packet == NULL)
+        return ESP_ERR_NO_MEM;
+
+    bool group_full = false;
+    const esp_err_t ret = tx_commit(packet, buffer, build_packet(packet, parts, part_count, traffic_class, &group_full),
+                                    traffic_class, trace_id);
+
+    if(group_full)
+        fec_flush();
+
+    return ret;
+}
+
+esp_err_t espnow_transponder_send(const uint8_t *data, uint16_t data_length) {
+    const espnow_transponder_iovec_t part = {
+        .data = data,
+        .length = data_length,
+    };
+
+    return sendv(&part, 1, ESPNOW_TRANSPONDER_CLASS_REALTIME, trace_new_id());
+}
+
+esp_err_t espnow_transponder_sendv(const espnow_transponder_iovec_t *parts, uint8_t part_count) {
+    return sendv(parts, part_count, ESPNOW_TRANSPONDER_CLASS_REALTIME, trace_new_id());
+}
+
+esp_err_t espnow_transponder_sendv_class(const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                                         espnow_transponder_class_t traffic_class) {
+    return sendv(parts, part_count, traffic_class, trace_new_id());
+}
+
+esp_err_t espnow_transponder_send_batch(espnow_transponder_message_t *messages, uint16_t message_count) {
+    esp_err_t ret = ESP_OK;
+
+    uint16_t trace_id = atomic_fetch_add_explicit(&trace_next_id, message_count, memory_order_relaxed);
+
+    for(uint16_t message = 0; message < message_count; message++) {
+        messages[message].result = sendv(messages[message].parts, messages[message].part_count,
+                                         messages[message].traffic_class, trace_id++);
+        if(messages[message].result != ESP_OK)
+            ret = messages[message].result;
+    }
+
+    return ret;
+}
+
+void espnow_transponder_frame_end() {
+    trace_event(TRACE_TX_FRAME_END, 0, NULL, 0, 0, 0);
+
+    // Don't hold the end of a frame back waiting for a full FEC group
+    if(fec_enabled)
+        fec_flush();
+
+    if(!pacing_enabled)
+        return;
+
+    // The queue has room for a marker after every packet, so this only
+    // fails after a run of frames with no packets in them
+    const espnow_transponder_buffer_t *marker = NULL;
+    if(xQueueSend(tx_queues[ESPNOW_TRANSPONDER_CLASS_REALTIME], &marker, 0) != pdTRUE) {
+        STATS_ADD(&sender_stats, tx_frame_end_late, 1);
+        atomic_store(&tx_frame_end_pending, true);
+    }
+    xTaskNotifyGive(espnow_transponder_tx_task_hdl);
+}
+
+void espnow_transponder_get_scheduler_status(espnow_transponder_scheduler_status_t *status) {
+    status->fps = tx_pacer.fps;
+    status->queue_depth = 0;
+    if(pacing_enabled)
+        for(int traffic_class = 0; traffic_class < ESPNOW_TRANSPONDER_CLASS_COUNT; traffic_class++)
+            status->queue_depth += uxQueueMessagesWaiting(tx_queues[traffic_class]);
+    status->in_flight = atomic_load(&tx_pacer.in_flight);
+}
+
+esp_err_t espnow_transponder_init(const espnow_transponder_config_t *config) {
+    if(config == NULL)
+        return ESP_FAIL;
+
+    transport = config->transport != NULL ? config->transport : &espnow_transponder_transport_espnow;
+
+    esp_err_t ret;
+    ESPNOW_ERROR_CHECK(espnow_init(config), "espnow_init");
+
+    return ESP_OK;
+}
+
+//! \brief Stop the ESP-NOW transponder
 //!
 //! Note: Need to test, correctly handle queue deletion
 //esp_err_t espnow_transponder_stop() {
@@ -395,21 +2019,80 @@ esp_err_t espnow_transponder_init(const espnow_transponder_config_t *config) {
 //    esp_now_unregister_send_cb();
 //    esp_now_del_peer(broadcast_mac);
 //
-//    if(espnow_transponder_queue == NULL)
+//    if(espnow_transponder_task_hdl == NULL)
 //        return ESP_FAIL;
 //
 //    espnow_transponder_event_t evt = {
 //        .id = ESPNOW_TRANSPONDER_STOP_TASK,
 //    };
 //
-//    if (xQueueSend(espnow_transponder_queue, &evt, portMAX_DELAY) != pdTRUE)
-//        return ESP_FAIL;
+//    post_event(&evt);
 //
 //    return ESP_OK;
 //}
 
+void espnow_transponder_get_rate_control_status(espnow_transponder_rate_control_status_t *status) {
+    *status = rate_control_status;
+}
+
+void espnow_transponder_get_tdma_status(espnow_transponder_tdma_status_t *status) {
+    memset(status, 0, sizeof(*status));
+    status->role = tdma_role;
+    status->slot = -1;
+    if(tdma_role == ESPNOW_TRANSPONDER_TDMA_OFF)
+        return;
+
+    tdma_schedule_t schedule = { .slot = -1 };
+    clock_sync_t clock;
+    clock_sync_init(&clock);
+    status->synchronized = tdma_sender_schedule(&tdma_sender, esp_timer_get_time(), &schedule, &clock);
+    status->slot = schedule.slot;
+    status->slot_count = schedule.slot_count;
+    status->slot_us = schedule.slot_us;
+    status->frame_us = schedule.frame_us;
+    status->clock_error_us = clock.error_us;
+    status->clock_skew = clock.skew;
+    status->beacons = tdma_sender.beacons;
+    status->clock_resets = clock.resets;
+}
+
 void espnow_transponder_get_statistics(espnow_transponder_stats_t *stats) {
+    stats_total(stats, true);
+}
+
+void espnow_transponder_get_snapshot(espnow_transponder_snapshot_t *snapshot) {
+    snapshot->time_us = esp_timer_get_time();
+    espnow_transponder_get_statistics(&snapshot->totals);
+    stats_read(&rate_stats, &snapshot->per_second, true);
+}
+
+int espnow_transponder_export_statistics(uint8_t *buffer, size_t length) {
+    espnow_transponder_snapshot_t snapshot;
+    espnow_transponder_get_snapshot(&snapshot);
+
+    return stats_export(&snapshot, buffer, length);
+}
+
+void espnow_transponder_trace_trigger(uint32_t reason) {
+    if(trace_trigger(&trace, reason))
+        trace_event(TRACE_TRIGGER, 0, NULL, 0, 0, reason);
+}
+
+bool espnow_transponder_trace_frozen() {
+    return trace_frozen(&trace);
+}
+
+size_t espnow_transponder_trace_dump_size() {
+    if(trace.records == NULL)
+        return 0;
+
+    return sizeof(trace_dump_header_t) + (trace.mask + 1)*sizeof(trace_record_t);
+}
+
+int espnow_transponder_trace_dump(uint8_t *buffer, size_t length) {
+    return trace_dump(&trace, buffer, length);
+}
 
-    // Note: There's no contention system here, so they might change during copy.
-    memcpy(stats, &espnow_transponder_stats, sizeof(espnow_transponder_stats_t));
+void espnow_transponder_trace_rearm() {
+    trace_rearm(&trace);
 }
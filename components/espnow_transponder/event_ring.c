@@ -0,0 +1,77 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "event_ring.h"
+
+static inline uint8_t *event_ring_slot(event_ring_t *ring, uint32_t position)
+{
+    return ring->storage + (position & ring->mask)*ring->element_size;
+}
+
+esp_err_t event_ring_init(event_ring_t *ring, uint32_t element_size, uint32_t capacity,
+                          espnow_transponder_overflow_policy_t policy) {
+    if(capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return ESP_ERR_INVALID_ARG;
+
+    ring->storage = malloc(element_size*capacity);
+    if(ring->storage == NULL)
+        return ESP_ERR_NO_MEM;
+
+    ring->element_size = element_size;
+    ring->mask = capacity - 1;
+    ring->policy = policy;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+
+    return ESP_OK;
+}
+
+event_ring_result_t event_ring_push(event_ring_t *ring, const void *element, void *dropped) {
+    event_ring_result_t result = EVENT_RING_PUSHED;
+
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if(head - tail > ring->mask) {
+        if(ring->policy == ESPNOW_TRANSPONDER_DROP_NEWEST) {
+            memcpy(dropped, element, ring->element_size);
+            return EVENT_RING_DROPPED_NEWEST;
+        }
+
+        // Claim the oldest element. If the consumer got there first, then
+        // there is now space and nothing needs to be dropped.
+        memcpy(dropped, event_ring_slot(ring, tail), ring->element_size);
+        if(atomic_compare_exchange_strong_explicit(&ring->tail, &tail, tail + 1,
+                memory_order_acq_rel, memory_order_acquire))
+            result = EVENT_RING_DROPPED_OLDEST;
+    }
+
+    memcpy(event_ring_slot(ring, head), element, ring->element_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    return result;
+}
+
+bool event_ring_pop(event_ring_t *ring, void *element) {
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    while(true) {
+        const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if(tail == head)
+            return false;
+
+        memcpy(element, event_ring_slot(ring, tail), ring->element_size);
+
+        // If the producer dropped this element while it was being copied,
+        // the copy may be torn; discard it and try the next one.
+        if(atomic_compare_exchange_strong_explicit(&ring->tail, &tail, tail + 1,
+                memory_order_acq_rel, memory_order_acquire))
+            return true;
+    }
+}
+
+uint32_t event_ring_depth(event_ring_t *ring) {
+    const uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    const uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    return head - tail;
+}
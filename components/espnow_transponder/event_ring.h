@@ -0,0 +1,63 @@
+#pragma once
+
+//! Lock-free single-producer, single-consumer event ring
+//!
+//! Used to pass events from the WiFi task (which runs both the send and
+//! receive callbacks, so is a single producer) to the transponder task. The
+//! producer never blocks: when the ring is full, either the new event or the
+//! oldest queued event is dropped, depending on the overflow policy. A
+//! dropped event is copied out to the producer so that any resources it owns
+//! can be released.
+//!
+//! To support dropping the oldest event, the producer may also advance the
+//! tail. Both sides claim an element with a compare-and-swap on the tail, so
+//! each element is consumed exactly once.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "espnow_transponder.h"
+
+typedef enum {
+    EVENT_RING_PUSHED,                  //!< Event was queued
+    EVENT_RING_DROPPED_NEWEST,          //!< Ring was full, the new event was dropped
+    EVENT_RING_DROPPED_OLDEST,          //!< Ring was full, the oldest event was dropped
+} event_ring_result_t;
+
+typedef struct {
+    uint8_t *storage;                   //!< Element storage, capacity*element_size bytes
+    uint32_t element_size;              //!< Size of one element, in bytes
+    uint32_t mask;                      //!< capacity - 1
+    espnow_transponder_overflow_policy_t policy;
+    atomic_uint head;                   //!< Next position to write, owned by the producer
+    atomic_uint tail;                   //!< Next position to read
+} event_ring_t;
+
+//! \brief Initialize an event ring
+//!
+//! \param ring Ring to initialize
+//! \param element_size Size of one element, in bytes
+//! \param capacity Number of elements, must be a power of two
+//! \param policy What to drop when the ring is full
+//! \return ESP_OK if successful
+esp_err_t event_ring_init(event_ring_t *ring, uint32_t element_size, uint32_t capacity,
+                          espnow_transponder_overflow_policy_t policy);
+
+//! \brief Add an element to the ring (producer side)
+//!
+//! \param ring Ring to add to
+//! \param element Element to copy into the ring
+//! \param dropped If an element was dropped, it is copied here
+//! \return Whether the element was queued, and what was dropped if not
+event_ring_result_t event_ring_push(event_ring_t *ring, const void *element, void *dropped);
+
+//! \brief Take an element from the ring (consumer side)
+//!
+//! \param ring Ring to read from
+//! \param element Location to copy the element to
+//! \return true if an element was read, false if the ring was empty
+bool event_ring_pop(event_ring_t *ring, void *element);
+
+//! \brief Get the number of elements currently in the ring
+uint32_t event_ring_depth(event_ring_t *ring);
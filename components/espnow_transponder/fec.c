@@ -0,0 +1,351 @@
+#include <string.h>
+
+#include "fec.h"
+
+// GF(256) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+#define GF_POLYNOMIAL   0x11D
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+
+//! Encoding matrix: coefficient of data unit i in parity unit j
+static uint8_t fec_coefficients[FEC_MAX_M][FEC_MAX_K];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if(a == 0 || b == 0)
+        return 0;
+    return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static inline uint8_t gf_inv(uint8_t a)
+{
+    return gf_exp[255 - gf_log[a]];
+}
+
+//! \brief dest += c*src, over GF(256)
+static void gf_mul_add_region(uint8_t *dest, const uint8_t *src, uint8_t c, uint16_t length)
+{
+    if(c == 0)
+        return;
+
+    if(c == 1) {
+        for(uint16_t i = 0; i < length; i++)
+            dest[i] ^= src[i];
+        return;
+    }
+
+    const uint8_t log_c = gf_log[c];
+    for(uint16_t i = 0; i < length; i++)
+        if(src[i] != 0)
+            dest[i] ^= gf_exp[gf_log[src[i]] + log_c];
+}
+
+void fec_init() {
+    uint16_t x = 1;
+    for(int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if(x & 0x100)
+            x ^= GF_POLYNOMIAL;
+    }
+    for(int i = 255; i < 512; i++)
+        gf_exp[i] = gf_exp[i - 255];
+
+    // Cauchy matrix 1/(x_j + y_i), with x_j = j and y_i = FEC_MAX_M + i.
+    // Each column is scaled so that the first row is all ones; scaling a
+    // column keeps every square submatrix invertible.
+    for(int j = 0; j < FEC_MAX_M; j++) {
+        for(int i = 0; i < FEC_MAX_K; i++) {
+            const uint8_t y = FEC_MAX_M + i;
+            fec_coefficients[j][i] = gf_mul(gf_inv(j ^ y), y);
+        }
+    }
+}
+
+void fec_encoder_init(fec_encoder_t *encoder, uint8_t k, uint8_t m) {
+    encoder->k = k > FEC_MAX_K ? FEC_MAX_K : k;
+    encoder->m = m > FEC_MAX_M ? FEC_MAX_M : m;
+    encoder->group = 0;
+    encoder->count = 0;
+    encoder->unit_length = 0;
+}
+
+bool fec_encoder_add(fec_encoder_t *encoder, uint8_t flags, const uint8_t *payload, uint16_t length,
+                     fec_header_t *header) {
+    uint8_t *unit = encoder->units[encoder->count];
+    unit[0] = flags;
+    unit[1] = length;
+    memcpy(unit + FEC_UNIT_HEADER, payload, length);
+
+    encoder->lengths[encoder->count] = FEC_UNIT_HEADER + length;
+    if(encoder->lengths[encoder->count] > encoder->unit_length)
+        encoder->unit_length = encoder->lengths[encoder->count];
+
+    header->group = encoder->group;
+    header->index = encoder->count;
+    header->k = encoder->k;
+    header->m = encoder->m;
+
+    encoder->count++;
+    return encoder->count == encoder->k;
+}
+
+uint8_t fec_encoder_parity_count(const fec_encoder_t *encoder) {
+    return encoder->count > 0 ? encoder->m : 0;
+}
+
+uint16_t fec_encoder_parity(const fec_encoder_t *encoder, uint8_t parity, fec_header_t *header, uint8_t *out) {
+    memset(out, 0, encoder->unit_length);
+
+    // Units are implicitly zero padded to the longest unit
+    for(int i = 0; i < encoder->count; i++)
+        gf_mul_add_region(out, encoder->units[i], fec_coefficients[parity][i], encoder->lengths[i]);
+
+    header->group = encoder->group;
+    header->index = encoder->count + parity;
+    header->k = encoder->count;
+    header->m = encoder->m;
+
+    return encoder->unit_length;
+}
+
+void fec_encoder_next_group(fec_encoder_t *encoder) {
+    encoder->group++;
+    encoder->count = 0;
+    encoder->unit_length = 0;
+}
+
+void fec_decoder_init(fec_decoder_t *decoder) {
+    memset(decoder, 0, sizeof(fec_decoder_t));
+}
+
+//! \brief Count the data units that have not been received or rebuilt
+static int group_missing(const fec_group_t *group)
+{
+    int missing = 0;
+    for(int i = 0; i < group->k; i++)
+        if(!((group->present | group->filtered) & (1u << i)))
+            missing++;
+    return missing;
+}
+
+//! \brief Find the slot for a group, starting a new one if needed
+//!
+//! \return Group slot, or NULL if the group is older than all tracked groups
+static fec_group_t *decoder_group(fec_decoder_t *decoder, const fec_header_t *header)
+{
+    fec_group_t *oldest = NULL;
+
+    for(int i = 0; i < FEC_DECODER_GROUPS; i++) {
+        fec_group_t *group = &decoder->groups[i];
+        if(!group->active) {
+            oldest = group;
+            break;
+        }
+        if(group->group == header->group)
+            return group;
+        if(oldest == NULL || (int8_t)(group->group - oldest->group) < 0)
+            oldest = group;
+    }
+
+    if(oldest->active) {
+        // Don't let a late packet push out a newer group
+        if((int8_t)(header->group - oldest->group) < 0)
+            return NULL;
+
+        if(!oldest->complete && oldest->size_known)
+            decoder->unrecoverable += group_missing(oldest);
+    }
+
+    oldest->active = true;
+    oldest->complete = false;
+    oldest->size_known = false;
+    oldest->group = header->group;
+    oldest->k = header->k;
+    oldest->m = header->m;
+    oldest->present = 0;
+    oldest->filtered = 0;
+
+    return oldest;
+}
+
+//! \brief Invert a square matrix over GF(256), in place
+//!
+//! \return false if the matrix is singular
+static bool gf_invert_matrix(uint8_t matrix[FEC_MAX_M][FEC_MAX_M], uint8_t inverse[FEC_MAX_M][FEC_MAX_M], int n)
+{
+    if(n > FEC_MAX_M)
+        return false;
+
+    for(int row = 0; row < n; row++)
+        for(int col = 0; col < n; col++)
+            inverse[row][col] = (row == col);
+
+    for(int col = 0; col < n; col++) {
+        int pivot = col;
+        while(pivot < n && matrix[pivot][col] == 0)
+            pivot++;
+        if(pivot == n)
+            return false;
+
+        if(pivot != col) {
+            for(int i = 0; i < n; i++) {
+                uint8_t t = matrix[col][i]; matrix[col][i] = matrix[pivot][i]; matrix[pivot][i] = t;
+                t = inverse[col][i]; inverse[col][i] = inverse[pivot][i]; inverse[pivot][i] = t;
+            }
+        }
+
+        const uint8_t scale = gf_inv(matrix[col][col]);
+        for(int i = 0; i < n; i++) {
+            matrix[col][i] = gf_mul(matrix[col][i], scale);
+            inverse[col][i] = gf_mul(inverse[col][i], scale);
+        }
+
+        for(int row = 0; row < n; row++) {
+            const uint8_t factor = matrix[row][col];
+            if(row == col || factor == 0)
+                continue;
+            for(int i = 0; i < n; i++) {
+                matrix[row][i] ^= gf_mul(factor, matrix[col][i]);
+                inverse[row][i] ^= gf_mul(factor, inverse[col][i]);
+            }
+        }
+    }
+
+    return true;
+}
+
+//! \brief Rebuild missing data units from the parity units, if possible
+static void group_recover(fec_decoder_t *decoder, fec_group_t *group, fec_recovered_callback_t callback)
+{
+    int missing[FEC_MAX_M];
+    int parity[FEC_MAX_M];
+    int missing_count = 0;
+    int parity_count = 0;
+
+    // Nothing to do once only filtered units are missing
+    if(group_missing(group) == 0) {
+        group->complete = true;
+        return;
+    }
+
+    for(int i = 0; i < group->k; i++) {
+        if(group->present & (1u << i))
+            continue;
+        if(missing_count == FEC_MAX_M)
+            return;
+        missing[missing_count++] = i;
+    }
+
+    for(int j = 0; j < group->m && parity_count < missing_count; j++)
+        if(group->present & (1u << (group->k + j)))
+            parity[parity_count++] = j;
+
+    if(parity_count < missing_count)
+        return;
+
+    const uint16_t unit_length = group->lengths[group->k + parity[0]];
+
+    // Remove the contribution of the data units that are present from the
+    // parity units, leaving only the missing ones.
+    for(int p = 0; p < parity_count; p++) {
+        uint8_t *syndrome = group->units[group->k + parity[p]];
+        for(int i = 0; i < group->k; i++)
+            if(group->present & (1u << i))
+                gf_mul_add_region(syndrome, group->units[i], fec_coefficients[parity[p]][i], group->lengths[i]);
+    }
+
+    uint8_t matrix[FEC_MAX_M][FEC_MAX_M];
+    uint8_t inverse[FEC_MAX_M][FEC_MAX_M];
+    for(int p = 0; p < missing_count; p++)
+        for(int e = 0; e < missing_count; e++)
+            matrix[p][e] = fec_coefficients[parity[p]][missing[e]];
+
+    // The parity units now hold syndromes, so there is no second attempt
+    group->complete = true;
+
+    if(!gf_invert_matrix(matrix, inverse, missing_count))
+        return;
+
+    for(int e = 0; e < missing_count; e++) {
+        uint8_t *unit = group->units[missing[e]];
+        memset(unit, 0, unit_length);
+        for(int p = 0; p < missing_count; p++)
+            gf_mul_add_region(unit, group->units[group->k + parity[p]], inverse[e][p], unit_length);
+
+        group->present |= (1u << missing[e]);
+        group->lengths[missing[e]] = unit_length;
+
+        if((group->filtered & (1u << missing[e])) || FEC_UNIT_HEADER + unit[1] > unit_length)
+            continue;
+
+        decoder->recovered++;
+        callback(unit[0], unit + FEC_UNIT_HEADER, unit[1]);
+    }
+}
+
+void fec_decoder_filter(fec_decoder_t *decoder, const fec_header_t *header, uint16_t filtered) {
+    if(header->k == 0 || header->k > FEC_MAX_K || header->m > FEC_MAX_M)
+        return;
+
+    fec_group_t *group = decoder_group(decoder, header);
+    if(group == NULL)
+        return;
+
+    group->filtered |= filtered & ((1u << FEC_MAX_K) - 1);
+}
+
+bool fec_decoder_add(fec_decoder_t *decoder, const fec_header_t *header, uint8_t flags,
+                     const uint8_t *body, uint16_t length, fec_recovered_callback_t callback) {
+    const bool is_parity = header->index >= header->k;
+
+    if(header->k == 0 || header->k > FEC_MAX_K || header->m > FEC_MAX_M
+        || header->index >= header->k + header->m)
+        return !is_parity;
+
+    // A data unit has to leave room for its flags and length
+    if(!is_parity && length > FEC_MAX_PAYLOAD)
+        return false;
+
+    fec_group_t *group = decoder_group(decoder, header);
+    if(group == NULL)
+        return true;
+
+    // Parity packets carry the real size of a group that was cut short
+    if(is_parity) {
+        if(header->k > group->k || header->m != group->m || length > FEC_UNIT_SIZE)
+            return false;
+        group->k = header->k;
+        group->size_known = true;
+    }
+    else if(header->index >= group->k) {
+        return true;
+    }
+
+    const uint16_t bit = (1u << header->index);
+    if(group->present & bit)
+        return false;
+
+    if(group->complete)
+        return true;
+
+    uint8_t *unit = group->units[header->index];
+    if(is_parity) {
+        memcpy(unit, body, length);
+        group->lengths[header->index] = length;
+    }
+    else {
+        unit[0] = flags;
+        unit[1] = length;
+        memcpy(unit + FEC_UNIT_HEADER, body, length);
+        group->lengths[header->index] = FEC_UNIT_HEADER + length;
+    }
+    group->present |= bit;
+
+    if(group->size_known)
+        group_recover(decoder, group, callback);
+
+    return !is_parity;
+}
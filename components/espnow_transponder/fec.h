@@ -0,0 +1,161 @@
+#pragma once
+
+//! Forward error correction across groups of packets
+//!
+//! Every group of up to k data packets is followed by m parity packets. A
+//! group can be cut short (at the end of a frame), in which case data
+//! packets still carry the nominal k, and the parity packets carry the
+//! actual number.
+//! A receiver that gets any k of the k+m packets in a group can rebuild the
+//! missing data packets. The code is systematic (data packets are sent
+//! unchanged, so they can be used as soon as they arrive) and is a
+//! Reed-Solomon erasure code over GF(256), using a Cauchy matrix scaled so
+//! that the first parity packet is the XOR of the data packets.
+//!
+//! Parity is computed over 'units', each of which is a data packet's
+//! transponder flags, payload length and payload, zero padded to the length
+//! of the longest unit in the group. A rebuilt unit therefore carries
+//! everything needed to process it like a received packet.
+//!
+//! This contains no RTOS calls, and is driven by the transponder.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_now.h"
+
+#include "packet.h"
+
+//! Maximum data packets per group
+#define FEC_MAX_K               10
+
+//! Maximum parity packets per group
+#define FEC_MAX_M               4
+
+//! Size of the flags and length that start each unit
+#define FEC_UNIT_HEADER         2
+
+//! Number of groups the decoder tracks at once
+#define FEC_DECODER_GROUPS      2
+
+//! FEC header, added after the transponder header when FEC is in use
+typedef struct {
+    uint8_t group;                      //!< Group sequence number
+    uint8_t index;                      //!< [0,k) for data packets, [k,k+m) for parity packets
+    uint8_t k;                          //!< Data packets in this group
+    uint8_t m;                          //!< Parity packets in this group
+} __attribute__((packed)) fec_header_t;
+
+//! Largest payload that can be protected. Parity packets carry a full unit,
+//! so they set the limit.
+#define FEC_MAX_PAYLOAD         (ESP_NOW_MAX_DATA_LEN - sizeof(espnow_transponder_packet_t) - sizeof(fec_header_t) - FEC_UNIT_HEADER)
+
+//! Size of a unit buffer
+#define FEC_UNIT_SIZE           (FEC_UNIT_HEADER + FEC_MAX_PAYLOAD)
+
+typedef struct {
+    uint8_t k;                          //!< Data packets per group
+    uint8_t m;                          //!< Parity packets per group
+    uint8_t group;                      //!< Current group sequence number
+    uint8_t count;                      //!< Data packets in the current group so far
+    uint16_t unit_length;               //!< Longest unit in the current group
+    uint16_t lengths[FEC_MAX_K];        //!< Length of each unit
+    uint8_t units[FEC_MAX_K][FEC_UNIT_SIZE];
+} fec_encoder_t;
+
+typedef struct {
+    bool active;                        //!< True if this slot holds a group
+    bool complete;                      //!< True once all data units are present
+    bool size_known;                    //!< True once a parity packet has confirmed k
+    uint8_t group;                      //!< Group sequence number
+    uint8_t k;                          //!< Data packets in the group
+    uint8_t m;                          //!< Parity packets in the group
+    uint16_t present;                   //!< Bitmask of units received or rebuilt
+    uint16_t filtered;                  //!< Bitmask of data units the receiver chose not to receive
+    uint16_t lengths[FEC_MAX_K + FEC_MAX_M];    //!< Length of each unit
+    uint8_t units[FEC_MAX_K + FEC_MAX_M][FEC_UNIT_SIZE];
+} fec_group_t;
+
+typedef struct {
+    fec_group_t groups[FEC_DECODER_GROUPS];
+    uint32_t recovered;                 //!< Data packets rebuilt from parity
+    uint32_t unrecoverable;             //!< Data packets missing from groups that were abandoned. Only
+                                        //!< counted for groups where a parity packet arrived, since
+                                        //!< otherwise the group size is unknown. Filtered packets
+                                        //!< aren't counted.
+} fec_decoder_t;
+
+//! Called for each data packet that the decoder rebuilds
+//!
+//! \param flags Transponder flags of the packet
+//! \param payload Packet payload
+//! \param length Length of the payload
+typedef void (*fec_recovered_callback_t)(uint8_t flags, const uint8_t *payload, uint16_t length);
+
+//! \brief Build the GF(256) tables. Must be called before anything else.
+void fec_init();
+
+//! \brief Initialize an encoder
+//!
+//! \param encoder Encoder to initialize
+//! \param k Data packets per group, up to FEC_MAX_K
+//! \param m Parity packets per group, up to FEC_MAX_M
+void fec_encoder_init(fec_encoder_t *encoder, uint8_t k, uint8_t m);
+
+//! \brief Add a data packet to the current group
+//!
+//! \param encoder Encoder
+//! \param flags Transponder flags of the packet
+//! \param payload Packet payload
+//! \param length Length of the payload, up to FEC_MAX_PAYLOAD
+//! \param header Filled in with the FEC header for the data packet
+//! \return true if the group is now full, and parity should be sent
+bool fec_encoder_add(fec_encoder_t *encoder, uint8_t flags, const uint8_t *payload, uint16_t length,
+                     fec_header_t *header);
+
+//! \brief Get the number of parity packets to send for the current group
+//!
+//! This is zero if the group is empty.
+uint8_t fec_encoder_parity_count(const fec_encoder_t *encoder);
+
+//! \brief Compute a parity packet for the current group
+//!
+//! \param encoder Encoder
+//! \param parity Parity packet index, [0, fec_encoder_parity_count())
+//! \param header Filled in with the FEC header for the parity packet
+//! \param out Buffer for the parity unit, at least FEC_UNIT_SIZE bytes
+//! \return Length of the parity unit
+uint16_t fec_encoder_parity(const fec_encoder_t *encoder, uint8_t parity, fec_header_t *header, uint8_t *out);
+
+//! \brief Start the next group
+void fec_encoder_next_group(fec_encoder_t *encoder);
+
+//! \brief Initialize a decoder
+void fec_decoder_init(fec_decoder_t *decoder);
+
+//! \brief Mark data packets of a group as filtered out by the receiver
+//!
+//! Filtered packets are never rebuilt on their own account, and aren't
+//! counted as unrecoverable. They are still missing as far as the parity
+//! is concerned, so wanted packets can only be rebuilt while the lost and
+//! filtered packets together are no more than the parity packets received.
+//!
+//! \param decoder Decoder
+//! \param header FEC header of any packet in the group
+//! \param filtered Bitmask of the filtered data packet indexes
+void fec_decoder_filter(fec_decoder_t *decoder, const fec_header_t *header, uint16_t filtered);
+
+//! \brief Add a received packet to the decoder
+//!
+//! For data packets, flags/body/length are the packet's transponder flags
+//! and payload. For parity packets, body is the parity unit.
+//!
+//! \param decoder Decoder
+//! \param header FEC header of the packet
+//! \param flags Transponder flags of the packet
+//! \param body Packet body following the FEC header
+//! \param length Length of the body
+//! \param callback Called for each data packet rebuilt as a result
+//! \return false if this is a data packet that was already rebuilt, and should not be used again, or
+//!         one longer than FEC_MAX_PAYLOAD, which can't be protected and should be dropped
+bool fec_decoder_add(fec_decoder_t *decoder, const fec_header_t *header, uint8_t flags,
+                     const uint8_t *body, uint16_t length, fec_recovered_callback_t callback);
@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "framing.h"
+#include "crc16.h"
+#include "payload_codec.h"
+
+uint32_t framing_parts_length(const espnow_transponder_iovec_t *parts, uint8_t part_count)
+{
+    uint32_t length = 0;
+    for(uint8_t part = 0; part < part_count; part++)
+        length += parts[part].length;
+
+    return length;
+}
+
+//! \brief Copy a packet's parts into one buffer, adding them to a CRC in the same pass
+//!
+//! \param crc CRC of the preceding data, or CRC16_INIT
+//! \param dest Buffer to copy to
+//! \param parts Parts to copy
+//! \param part_count Number of parts
+//! \return Updated CRC
+static uint16_t parts_copy(uint16_t crc, uint8_t *dest, const espnow_transponder_iovec_t *parts, uint8_t part_count)
+{
+    for(uint8_t part = 0; part < part_count; part++) {
+        crc = crc16_update_copy(crc, dest, parts[part].data, parts[part].length);
+        dest += parts[part].length;
+    }
+
+    return crc;
+}
+
+int framing_build(uint8_t *packet, int max_data_length, const espnow_transponder_iovec_t *parts,
+                  uint8_t part_count, bool compress, espnow_transponder_class_t traffic_class,
+                  const espnow_transponder_relay_header_t *relay, fec_encoder_t *fec_encoder, bool *group_full)
+{
+    // Encapsulate the data into a packet with the following structure:
+    // packet[0-1]: 16-bit CRC
+    // packet[2]: flags
+    // packet[3]: data length
+    // packet[4-8]: relay header, if ESPNOW_TRANSPONDER_FLAG_RELAY is set
+    // then the FEC header (4 bytes), if ESPNOW_TRANSPONDER_FLAG_FEC is set
+    // then the data, compressed after its key if ESPNOW_TRANSPONDER_FLAG_COMPRESSED is set
+
+    const uint32_t data_length = framing_parts_length(parts, part_count);
+
+    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+    header->flags = ESPNOW_TRANSPONDER_FLAG_CLASS(traffic_class);
+
+    uint8_t *fec_header = header->data;
+    if(relay != NULL)
+        fec_header += sizeof(espnow_transponder_relay_header_t);
+
+    uint8_t *payload = fec_header;
+    if(fec_encoder != NULL)
+        payload += sizeof(fec_header_t);
+
+    int payload_length = -1;
+
+    // Only use the compressed version if it's actually smaller. The codec
+    // needs the data in one piece.
+    if(compress && data_length >= FRAMING_COMPRESS_MIN_LENGTH && data_length <= ESPNOW_TRANSPONDER_MAX_DATA_LENGTH) {
+        uint8_t gathered[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+        const uint8_t *data = parts[0].data;
+        if(part_count > 1) {
+            parts_copy(CRC16_INIT, gathered, parts, part_count);
+            data = gathered;
+        }
+
+        // The key stays readable for the receive filter
+        memcpy(payload, data, ESPNOW_TRANSPONDER_KEY_LENGTH);
+        payload_length = payload_compress(data + ESPNOW_TRANSPONDER_KEY_LENGTH, data_length - ESPNOW_TRANSPONDER_KEY_LENGTH,
+                                          payload + ESPNOW_TRANSPONDER_KEY_LENGTH,
+                                          max_data_length - ESPNOW_TRANSPONDER_KEY_LENGTH);
+        if(payload_length >= 0)
+            payload_length += ESPNOW_TRANSPONDER_KEY_LENGTH;
+        if(payload_length >= 0 && payload_length < data_length)
+            header->flags |= ESPNOW_TRANSPONDER_FLAG_COMPRESSED;
+        else
+            payload_length = -1;
+    }
+
+    // Check that the total length is under ESP_NOW_MAX_DATA_LEN
+    if(payload_length < 0 && data_length > max_data_length)
+        return -1;
+
+    if(fec_encoder != NULL) {
+        // The FEC encoder keeps its own copy of the payload. It only sees
+        // the flags that describe the payload, and the class, so that a
+        // rebuilt packet is dispatched as the original would have been.
+        // The relay header isn't part of it.
+        if(payload_length < 0) {
+            parts_copy(CRC16_INIT, payload, parts, part_count);
+            payload_length = data_length;
+        }
+
+        *group_full = fec_encoder_add(fec_encoder, header->flags, payload, payload_length,
+                                      (fec_header_t *)fec_header);
+        header->flags |= ESPNOW_TRANSPONDER_FLAG_FEC;
+    }
+
+    if(relay != NULL) {
+        memcpy(header->data, relay, sizeof(*relay));
+        header->flags |= ESPNOW_TRANSPONDER_FLAG_RELAY;
+    }
+
+    // CRC the headers as they're filled in, with the CRC field itself as zeros
+    const uint8_t header_length = payload - header->data;
+    uint16_t crc = crc16_update_zeros(CRC16_INIT, sizeof(header->crc));
+
+    if(payload_length < 0) {
+        // Uncompressed data is copied and CRCed in one pass
+        header->data_length = header_length + data_length;
+        crc = crc16_update(crc, &header->flags, sizeof(header->flags) + sizeof(header->data_length) + header_length);
+        crc = parts_copy(crc, payload, parts, part_count);
+    }
+    else {
+        header->data_length = header_length + payload_length;
+        crc = crc16_update(crc, &header->flags, sizeof(header->flags) + sizeof(header->data_length) + header->data_length);
+    }
+
+    header->crc = crc;
+
+    return sizeof(espnow_transponder_packet_t) + header->data_length;
+}
+
+int framing_seal(uint8_t *packet, uint8_t flags, uint8_t data_length)
+{
+    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+
+    header->flags = flags;
+    header->data_length = data_length;
+    header->crc = crc16_update(crc16_update_zeros(CRC16_INIT, sizeof(header->crc)),
+                               &header->flags, sizeof(header->flags) + sizeof(header->data_length) + data_length);
+
+    return sizeof(espnow_transponder_packet_t) + data_length;
+}
+
+int framing_decompress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max)
+{
+    if(in_length < ESPNOW_TRANSPONDER_KEY_LENGTH || out_max < ESPNOW_TRANSPONDER_KEY_LENGTH)
+        return -1;
+
+    memcpy(out, in, ESPNOW_TRANSPONDER_KEY_LENGTH);
+    const int length = payload_decompress(in + ESPNOW_TRANSPONDER_KEY_LENGTH, in_length - ESPNOW_TRANSPONDER_KEY_LENGTH,
+                                          out + ESPNOW_TRANSPONDER_KEY_LENGTH, out_max - ESPNOW_TRANSPONDER_KEY_LENGTH);
+    if(length < 0)
+        return -1;
+
+    return ESPNOW_TRANSPONDER_KEY_LENGTH + length;
+}
+
+framing_result_t framing_check(const uint8_t *packet, uint16_t packet_length)
+{
+    // Check the the packet can fit the header
+    if(packet_length < sizeof(espnow_transponder_packet_t))
+        return FRAMING_SHORT;
+
+    const espnow_transponder_packet_t *header = (const espnow_transponder_packet_t *)packet;
+
+    // Check the CRC. The CRC field is fed in as zeros, so that the packet
+    // (which belongs to the WiFi driver) doesn't need to be modified.
+    uint16_t crc = crc16_update_zeros(CRC16_INIT, sizeof(header->crc));
+    crc = crc16_update(crc, packet + sizeof(header->crc), packet_length - sizeof(header->crc));
+    if(crc != header->crc)
+        return FRAMING_BAD_CRC;
+
+    if(sizeof(espnow_transponder_packet_t) + header->data_length != packet_length)
+        return FRAMING_BAD_LENGTH;
+
+    return FRAMING_OK;
+}
+
+const espnow_transponder_relay_header_t *framing_relay_header(const uint8_t *packet)
+{
+    const espnow_transponder_packet_t *header = (const espnow_transponder_packet_t *)packet;
+    if(!(header->flags & ESPNOW_TRANSPONDER_FLAG_RELAY)
+        || header->data_length < sizeof(espnow_transponder_relay_header_t))
+        return NULL;
+
+    return (const espnow_transponder_relay_header_t *)header->data;
+}
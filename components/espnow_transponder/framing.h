@@ -0,0 +1,83 @@
+#pragma once
+
+//! Building and checking transponder packets
+//!
+//! A packet is an espnow_transponder_packet_t header, then the relay header
+//! if the packet may be relayed, then the FEC header if the packet is part
+//! of an FEC group, then the payload, compressed if that makes it smaller. The CRC covers the whole packet, with the CRC
+//! field itself as zeros. The key at the start of the payload is never
+//! compressed, so that it can be read from any data packet.
+//!
+//! This contains no RTOS calls, and is driven by the transponder.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "espnow_transponder.h"
+#include "packet.h"
+#include "fec.h"
+
+//! Payloads shorter than this are never worth compressing
+#define FRAMING_COMPRESS_MIN_LENGTH 16
+
+typedef enum {
+    FRAMING_OK,                         //!< Packet is intact
+    FRAMING_SHORT,                      //!< Packet is too short to hold the header
+    FRAMING_BAD_CRC,                    //!< CRC doesn't match
+    FRAMING_BAD_LENGTH,                 //!< Length in the header doesn't match the packet
+} framing_result_t;
+
+//! \brief Get the total length of a packet's parts
+uint32_t framing_parts_length(const espnow_transponder_iovec_t *parts, uint8_t part_count);
+
+//! \brief Encapsulate data into a transponder packet
+//!
+//! The data is gathered from its parts straight into the packet, and CRCed
+//! on the way.
+//!
+//! \param packet Buffer to build the packet in, at least ESP_NOW_MAX_DATA_LEN bytes
+//! \param max_data_length Largest payload that fits in a packet, not counting the headers
+//! \param parts Parts of the data, in order
+//! \param part_count Number of parts
+//! \param compress Compress the payload, if that makes it smaller
+//! \param traffic_class Traffic class, stored in the flags
+//! \param relay Relay header to add, or NULL if the packet is not to be relayed
+//! \param fec_encoder FEC encoder to add the packet to, or NULL if FEC is disabled
+//! \param group_full Set to true if this packet completed an FEC group
+//! \return Packet length, or -1 if the data did not fit
+int framing_build(uint8_t *packet, int max_data_length, const espnow_transponder_iovec_t *parts,
+                  uint8_t part_count, bool compress, espnow_transponder_class_t traffic_class,
+                  const espnow_transponder_relay_header_t *relay, fec_encoder_t *fec_encoder, bool *group_full);
+
+//! \brief Build a packet from a payload that is already in place
+//!
+//! Used for packets that are not compressed or FEC encoded, such as parity
+//! and control packets.
+//!
+//! \param packet Packet, with the payload already in its data
+//! \param flags Transponder flags of the packet
+//! \param data_length Length of the payload
+//! \return Packet length
+int framing_seal(uint8_t *packet, uint8_t flags, uint8_t data_length);
+
+//! \brief Decompress the payload of a packet with ESPNOW_TRANSPONDER_FLAG_COMPRESSED set
+//!
+//! \param in Compressed payload, starting with its key
+//! \param in_length Length of the compressed payload
+//! \param out Buffer to write the payload to
+//! \param out_max Size of the output buffer
+//! \return Payload length, or -1 if the payload was malformed or too big for the output buffer
+int framing_decompress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max);
+
+//! \brief Check if a buffer contains a valid espnow_transponder_packet_t
+//!
+//! \param packet Pointer to the packet
+//! \param packet_length Length of the packet
+//! \return FRAMING_OK if the packet passed the CRC and length checks
+framing_result_t framing_check(const uint8_t *packet, uint16_t packet_length);
+
+//! \brief Find the relay header of a packet that passed framing_check()
+//!
+//! \param packet Pointer to the packet
+//! \return Relay header, or NULL if the packet has none or is too short to hold one
+const espnow_transponder_relay_header_t *framing_relay_header(const uint8_t *packet);
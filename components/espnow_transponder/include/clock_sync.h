@@ -0,0 +1,71 @@
+#pragma once
+
+//! Estimate of a remote clock, from the timestamps it sends
+//!
+//! A node that sends beacons puts its clock, in microseconds, in each one.
+//! A receiver stamps every beacon with its own clock when it arrives, and
+//! feeds the pair in here. From those it keeps an estimate of the remote
+//! clock that can be read at any local time, including between beacons.
+//!
+//! Beacons are delayed by a varying amount on the way: the sender's queue,
+//! channel access and the receiving WiFi task. A delay can only make a
+//! beacon look late, never early, so samples that say the remote clock is
+//! further ahead than thought are taken more seriously than ones that say
+//! it is behind. The rate difference between the clocks is measured over a
+//! longer baseline, where the delay jitter matters less, and is used to
+//! carry the estimate forward. A sample that is far off, for example from a
+//! remote node that restarted, resets the estimate.
+//!
+//! The remote timestamps are 32 bits, and wrap about every 71 minutes.
+//!
+//! TDMA senders use this to follow the master, and artdmx receivers to
+//! follow the sender's frame commits.
+//!
+//! This contains no RTOS calls.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct {
+    bool valid;                         //!< True once a sample has been taken
+    int64_t local_us;                   //!< Local time of the last sample
+    int64_t remote_us;                  //!< Estimated remote time at local_us
+    int64_t anchor_local_us;            //!< Start of the baseline the rate is measured over
+    int64_t anchor_remote_us;
+    float skew;                         //!< Remote clock rate relative to the local one, minus one
+    int32_t error_us;                   //!< How far the last sample was from the estimate
+    uint32_t samples;                   //!< Samples since the last reset
+    uint32_t resets;                    //!< Times a sample was too far off to be believed
+} clock_sync_t;
+
+//! \brief Initialize a clock estimate, with nothing known
+void clock_sync_init(clock_sync_t *sync);
+
+//! \brief Add a timestamp from the remote clock
+//!
+//! \param sync Clock estimate
+//! \param local_us Local time the timestamp arrived
+//! \param remote_us Remote timestamp
+void clock_sync_sample(clock_sync_t *sync, int64_t local_us, uint32_t remote_us);
+
+//! \brief Get the remote time at a local time
+//!
+//! \param sync Clock estimate, which must be valid
+//! \param local_us Local time
+//! \return Estimated remote time. The low 32 bits line up with the remote timestamps.
+int64_t clock_sync_remote(const clock_sync_t *sync, int64_t local_us);
+
+//! \brief Get the local time at a remote time
+//!
+//! \param sync Clock estimate, which must be valid
+//! \param remote_us Remote time, as returned by clock_sync_remote() or clock_sync_unwrap()
+//! \return Estimated local time
+int64_t clock_sync_local(const clock_sync_t *sync, int64_t remote_us);
+
+//! \brief Extend a 32 bit remote timestamp to the one closest to the estimate
+//!
+//! \param sync Clock estimate, which must be valid
+//! \param local_us Local time near the timestamp
+//! \param remote_us Remote timestamp, within 35 minutes of local_us
+//! \return Remote time, comparable with clock_sync_remote()
+int64_t clock_sync_unwrap(const clock_sync_t *sync, int64_t local_us, uint32_t remote_us);
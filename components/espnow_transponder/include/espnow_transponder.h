@@ -14,12 +14,50 @@
 //! needed, a possible implementation would be to assign the same MAC address
 //! to all devices, to make 'fake' broadcasts.
 
+#include <stddef.h>
 
 // Note: This is private header from the esp-idf, that is included for wifi_phy_rate_t.
 //       It might break across minor or major IDF versions. Consider wrapping wifi_phy_rate_t
 //       if this bothers you.
 #include <esp_wifi_internal.h>
 
+//! Maximum payload length that can be passed to espnow_transponder_send()
+//! when compression is enabled. Payloads longer than
+//! espnow_transponder_max_packet_size() are only sent if they compress
+//! enough to fit in a single ESP-NOW packet.
+#define ESPNOW_TRANSPONDER_MAX_DATA_LENGTH 544
+
+//! What to drop when the receive queue is full
+typedef enum {
+    ESPNOW_TRANSPONDER_DROP_OLDEST,     //!< Drop the oldest queued packet, keeping the newest data
+    ESPNOW_TRANSPONDER_DROP_NEWEST,     //!< Drop the packet that just arrived
+} espnow_transponder_overflow_policy_t;
+
+//! Traffic class of a packet
+//!
+//! The class is carried in the packet header. Senders and receivers keep a
+//! queue for each class, so that a small, urgent message doesn't wait
+//! behind a backlog of DMX. Classes with a weight of 0 (see class_weights)
+//! are always served first, in the order control, sync, realtime, bulk. The
+//! others share what is left in proportion to their weights.
+typedef enum {
+    ESPNOW_TRANSPONDER_CLASS_REALTIME,  //!< Live data, such as DMX frames. The default.
+    ESPNOW_TRANSPONDER_CLASS_BULK,      //!< Data that can wait, such as configuration transfers
+    ESPNOW_TRANSPONDER_CLASS_SYNC,      //!< Timing messages, such as frame commits
+    ESPNOW_TRANSPONDER_CLASS_CONTROL,   //!< Small, urgent application messages
+    ESPNOW_TRANSPONDER_CLASS_COUNT,
+} espnow_transponder_class_t;
+
+//! Role in a time-division schedule, for several senders sharing a channel
+typedef enum {
+    ESPNOW_TRANSPONDER_TDMA_OFF,        //!< Send whenever packets are ready
+    ESPNOW_TRANSPONDER_TDMA_MASTER,     //!< Broadcast the beacons that define the schedule, and take a slot if sending
+    ESPNOW_TRANSPONDER_TDMA_SENDER,     //!< Ask the master for a slot, and only send in it
+} espnow_transponder_tdma_role_t;
+
+//! Packet transport, see espnow_transponder_transport.h
+typedef struct espnow_transponder_transport espnow_transponder_transport_t;
+
 //! ESP-NOW configuration settings
 //!
 //! There are some general rate categories to choose from:
@@ -37,18 +75,115 @@ typedef struct {
     int8_t power;                   //!< TX power, range is [40-82] -> [10dBm-20.5dBm]
     uint8_t channel;                //!< WiFi channel [1-13] (recommend: 1,6,11)
     wifi_phy_rate_t phy_rate;       //!< PHY rate (defined in esp_wifi_types.h)
+    espnow_transponder_overflow_policy_t overflow_policy; //!< Receive queue overflow behavior
+    bool compression;               //!< Compress payloads when it makes them smaller
+    uint16_t tx_framerate;          //!< If non-zero, pace queued packets evenly over frames at this rate
+    uint16_t tx_max_in_flight;      //!< When pacing, maximum packets sent without a send completion
+    uint8_t fec_k;                  //!< If non-zero, send fec_m parity packets after every fec_k realtime packets (max 10)
+    uint8_t fec_m;                  //!< Parity packets per FEC group (max 4)
+    const espnow_transponder_transport_t *transport; //!< Packet transport, or NULL for ESP-NOW
+    uint16_t trace_records;         //!< Pipeline trace ring size, a power of two, or 0 to disable tracing
+    bool trace_freeze_on_error;     //!< Freeze the trace when a packet is dropped for an error
+    bool rate_control;              //!< Adapt phy_rate and power to the loss that receivers report.
+                                    //!< phy_rate is the starting rate, and power the highest power used.
+    float rate_control_loss_budget; //!< Highest acceptable packet loss with rate_control, as a fraction
+    bool loss_reports;              //!< Answer rate controlled senders with loss reports
+    espnow_transponder_tdma_role_t tdma; //!< Time-division schedule role. Senders need tx_framerate.
+    uint32_t tdma_frame_us;         //!< TDMA frame period set by the master, or 0 for one frame per tx_framerate frame
+    uint16_t tdma_guard_us;         //!< Time kept free at the end of each TDMA slot, for clock error
+    uint8_t relay_ttl;              //!< If non-zero, packets sent by this node may be relayed this many times
+    bool relay;                     //!< Relay packets from other nodes that still have hops left
+    uint16_t relay_jitter_us;       //!< Maximum random delay before relaying a packet
+    uint16_t relay_rate;            //!< Most packets relayed per second, or 0 for no limit
+    uint8_t class_weights[ESPNOW_TRANSPONDER_CLASS_COUNT]; //!< Share of each traffic class, or 0 for strict priority
 } espnow_transponder_config_t;
 
+//! Trace trigger reasons from this up are free for the application to use
+#define ESPNOW_TRANSPONDER_TRACE_USER 0x100
+
 //! Transponder staticstics
+//!
+//! Every field is a uint64_t counter. The binary export lists them in this
+//! order, so new counters go at the end. The per-class counters are indexed
+//! by espnow_transponder_class_t; the average time a class spent queued is
+//! its latency total over its packet count.
 typedef struct {
     uint64_t rx_count;
     uint64_t rx_short_packet;
     uint64_t rx_bad_crc;
     uint64_t rx_bad_len;
-    uint64_t rx_malloc_fail;
+    uint64_t rx_no_buffer;              //!< Packets dropped because the receive pool was empty
+    uint64_t rx_queue_overflow;         //!< Events dropped because the event queue was full
+    uint64_t rx_decompress_fail;        //!< Compressed packets that could not be decompressed
+    uint64_t rx_fec_recovered;          //!< Lost packets rebuilt from FEC parity
+    uint64_t rx_fec_unrecoverable;      //!< Lost packets that FEC parity could not rebuild
+    uint64_t rx_filtered;               //!< Packets dropped because their key isn't subscribed
     uint64_t tx_count;
+    uint64_t tx_send_fail;              //!< Packets that the transport refused
+    uint64_t tx_cb_fail;                //!< Send completions that reported a failure
+    uint64_t tx_queue_full;             //!< Packets dropped because the transmit queue was full
+    uint64_t tx_fec_parity;             //!< FEC parity packets sent
+    uint64_t rx_bytes;                  //!< Bytes received in packets that passed the checks
+    uint64_t tx_bytes;                  //!< Bytes handed to the transport
+    uint64_t rx_control;                //!< Control messages received, for rate control
+    uint64_t tx_control;                //!< Control messages sent, for rate control and TDMA
+    uint64_t tx_relayed;                //!< Packets relayed for other nodes
+    uint64_t rx_relay_duplicate;        //!< Packets dropped as copies of one already received
+    uint64_t rx_relay_expired;          //!< Packets not relayed on, as they had no hops left
+    uint64_t tx_relay_dropped;          //!< Packets not relayed, for the rate limit or a full relay queue
+    uint64_t rx_class_packets[ESPNOW_TRANSPONDER_CLASS_COUNT];    //!< Packets taken off each receive queue
+    uint64_t rx_class_dropped[ESPNOW_TRANSPONDER_CLASS_COUNT];    //!< Packets of each class dropped for a full queue or pool
+    uint64_t rx_class_latency_us[ESPNOW_TRANSPONDER_CLASS_COUNT]; //!< Total time packets of each class spent queued
+    uint64_t tx_class_packets[ESPNOW_TRANSPONDER_CLASS_COUNT];    //!< Packets of each class handed to the transport
+    uint64_t tx_class_dropped[ESPNOW_TRANSPONDER_CLASS_COUNT];    //!< Packets of each class dropped for a full queue or pool
+    uint64_t tx_class_latency_us[ESPNOW_TRANSPONDER_CLASS_COUNT]; //!< Total time packets of each class spent queued
+    uint64_t tx_frame_end_late;         //!< Frame ends that didn't fit in the transmit queue, and reached the pacer late
 } espnow_transponder_stats_t;
 
+//! Statistics rates are computed over windows of this length
+#define ESPNOW_TRANSPONDER_RATE_WINDOW_US 1000000
+
+//! Consistent statistics snapshot
+typedef struct {
+    int64_t time_us;                    //!< Time the snapshot was taken
+    espnow_transponder_stats_t totals;  //!< Counts since initialization
+    espnow_transponder_stats_t per_second; //!< Counts per second, over the last complete window
+} espnow_transponder_snapshot_t;
+
+//! Longest possible statistics export, in bytes
+#define ESPNOW_TRANSPONDER_EXPORT_MAX_LENGTH \
+    (4 + 10 + 2*10*(sizeof(espnow_transponder_stats_t)/sizeof(uint64_t)))
+
+//! Transmit scheduler status
+typedef struct {
+    float fps;                          //!< Smoothed rate at which frames are being sent
+    uint32_t queue_depth;               //!< Packets waiting to be sent
+    uint32_t in_flight;                 //!< Packets sent, but not yet completed
+} espnow_transponder_scheduler_status_t;
+
+//! Rate control status
+typedef struct {
+    bool enabled;                       //!< True if rate control is on
+    wifi_phy_rate_t phy_rate;           //!< Current PHY rate
+    int8_t power;                       //!< Current TX power
+    float loss;                         //!< Worst loss over the last control window, or -1 if nothing was measured
+    uint32_t changes;                   //!< Rate and power changes so far
+} espnow_transponder_rate_control_status_t;
+
+//! TDMA status
+typedef struct {
+    espnow_transponder_tdma_role_t role; //!< Role, ESPNOW_TRANSPONDER_TDMA_OFF if TDMA couldn't be enabled
+    bool synchronized;                  //!< True if this node has a slot, and is hearing beacons
+    int8_t slot;                        //!< Slot of this node, or -1 if it has none
+    uint8_t slot_count;                 //!< Sender slots in the frame
+    uint16_t slot_us;                   //!< Length of each sender slot
+    uint32_t frame_us;                  //!< Frame period
+    int32_t clock_error_us;             //!< How far the last beacon was from the master clock estimate
+    float clock_skew;                   //!< Master clock rate relative to this one, minus one
+    uint32_t beacons;                   //!< Beacons received, or sent by the master
+    uint32_t clock_resets;              //!< Times the master clock estimate was thrown away
+} espnow_transponder_tdma_status_t;
+
 //! Default transponder configuration
 extern const espnow_transponder_config_t espnow_transponder_config_default;
 
@@ -60,16 +195,123 @@ esp_err_t espnow_transponder_init(const espnow_transponder_config_t *config);
 
 //! \brief Broadcast a data packet
 //!
+//! If compression is enabled and the packet compresses, it is sent
+//! compressed. Receivers always accept compressed packets.
+//!
+//! If tx_framerate is set, the packet is added to the transmit queue and
+//! sent later by the transmit scheduler, which spreads the packets of each
+//! frame evenly over the frame period.
+//!
+//! If tdma is set to ESPNOW_TRANSPONDER_TDMA_SENDER, the scheduler also
+//! holds packets back until this node's TDMA slot, once the master has
+//! assigned it one. Until then, it sends as usual.
+//!
+//! If fec_k is set, every fec_k realtime packets are followed by fec_m
+//! parity packets, and receivers can rebuild up to fec_m lost packets of
+//! each group. Packets of the other classes are sent without FEC. Receivers
+//! always accept FEC packets. FEC state is shared, so only one task should
+//! send realtime packets when it is enabled.
+//!
+//! If relay_ttl is set, the packet carries a relay header, and nodes with
+//! relay set rebroadcast it, up to relay_ttl times over, so that it reaches
+//! receivers out of range of this node. Every receiver drops the copies of
+//! a packet after the first one it gets. Relayed packets go out as soon as
+//! their jitter allows, outside of the transmit scheduler and TDMA slots.
+//!
+//! The packet is sent in the realtime class, see
+//! espnow_transponder_sendv_class().
+//!
 //! \param data Pointer to the data packet
 //! \param data_len Length of the data packet
-//! \return ESP_OK if the packet was successfully queued
-esp_err_t espnow_transponder_send(const uint8_t *data, uint8_t data_length);
+//! \return ESP_OK if the packet was successfully queued, ESP_ERR_INVALID_SIZE
+//!         if it didn't fit in an ESP-NOW packet, ESP_ERR_NO_MEM if the
+//!         transmit queue was full
+esp_err_t espnow_transponder_send(const uint8_t *data, uint16_t data_length);
+
+//! One part of a packet, for espnow_transponder_sendv()
+typedef struct {
+    const void *data;                   //!< Pointer to the part
+    uint16_t length;                    //!< Length of the part
+} espnow_transponder_iovec_t;
+
+//! One packet of a batch, for espnow_transponder_send_batch()
+typedef struct {
+    const espnow_transponder_iovec_t *parts; //!< Parts of the packet, in order
+    uint8_t part_count;                 //!< Number of parts
+    espnow_transponder_class_t traffic_class; //!< Traffic class to send the packet in
+    esp_err_t result;                   //!< Set to the result of sending the packet
+} espnow_transponder_message_t;
+
+//! \brief Broadcast a data packet made up of several parts
+//!
+//! This is the same as sending the parts concatenated with
+//! espnow_transponder_send(), but the parts are copied straight into the
+//! transmit slot, so the caller doesn't have to assemble the packet first.
+//! A header, a slice of a larger buffer and a trailer can be sent without
+//! copying any of them.
+//!
+//! \param parts Parts of the packet, in order
+//! \param part_count Number of parts
+//! \return See espnow_transponder_send()
+esp_err_t espnow_transponder_sendv(const espnow_transponder_iovec_t *parts, uint8_t part_count);
+
+//! \brief Broadcast a data packet in a traffic class
+//!
+//! When pacing, each class waits in a queue of its own, and the transmit
+//! scheduler picks the next packet by class. With the default weights,
+//! control and sync packets skip ahead of queued realtime and bulk packets.
+//! They aren't spread over the frame either, but still keep to the
+//! in-flight limit and the TDMA slot. Without
+//! pacing, packets are sent straight away whatever their class, and the
+//! class only matters to the receivers.
+//!
+//! \param parts Parts of the packet, in order
+//! \param part_count Number of parts
+//! \param traffic_class Class to send the packet in
+//! \return See espnow_transponder_send(), or ESP_ERR_INVALID_ARG if the class is invalid
+esp_err_t espnow_transponder_sendv_class(const espnow_transponder_iovec_t *parts, uint8_t part_count,
+                                         espnow_transponder_class_t traffic_class);
+
+//! \brief Broadcast several data packets
+//!
+//! Sends each message as espnow_transponder_sendv() would, in order. This is
+//! meant for submitting all packets of a frame at once. A failed packet
+//! doesn't stop the rest from being sent.
+//!
+//! \param messages Packets to send. The result of each is stored in it.
+//! \param message_count Number of packets
+//! \return ESP_OK if every packet was sent, otherwise the error of the last one that failed
+esp_err_t espnow_transponder_send_batch(espnow_transponder_message_t *messages, uint16_t message_count);
+
+//! \brief Mark the end of a frame
+//!
+//! When pacing, call this after sending all packets for a frame. The
+//! scheduler uses it to work out how many packets make up a frame, and to
+//! measure the achieved frame rate. With FEC enabled, this also sends the
+//! parity for a partially filled group, so that receivers can rebuild lost
+//! packets without waiting for the next frame.
+void espnow_transponder_frame_end();
+
+//! \brief Get the status of the transmit scheduler
+//!
+//! \param status Pointer to copy the status to
+void espnow_transponder_get_scheduler_status(espnow_transponder_scheduler_status_t *status);
+
+//! \brief Get the status of the PHY rate controller
+//!
+//! \param status Pointer to copy the status to
+void espnow_transponder_get_rate_control_status(espnow_transponder_rate_control_status_t *status);
+
+//! \brief Get the status of the TDMA schedule
+//!
+//! \param status Pointer to copy the status to
+void espnow_transponder_get_tdma_status(espnow_transponder_tdma_status_t *status);
 
 //! Receive callback function prototype
 //!
 //! \param data Received packet data pointer
 //! \param data_length Length of the data packet
-typedef void (*espnow_transponder_rx_callback_t)(const uint8_t *data, uint8_t data_length);
+typedef void (*espnow_transponder_rx_callback_t)(const uint8_t *data, uint16_t data_length);
 
 //! \brief Register a callback for received data packets
 //!
@@ -79,12 +321,160 @@ void espnow_transponder_register_callback(espnow_transponder_rx_callback_t callb
 //! \brief Unregister the received data callback function
 void espnow_transponder_unregister_callback();
 
+//! \brief Register a callback for received data packets of one traffic class
+//!
+//! Received packets wait in a queue for their class, and the queues are
+//! served by class as for sending, see espnow_transponder_sendv_class().
+//! Packets of a class with a callback of its own are passed to it, and the
+//! rest to the borrow callback or the callback registered by
+//! espnow_transponder_register_callback().
+//!
+//! \param traffic_class Class to receive
+//! \param callback Callback function, or NULL to unregister it
+//! \return ESP_OK, or ESP_ERR_INVALID_ARG if the class is invalid
+esp_err_t espnow_transponder_register_class_callback(espnow_transponder_class_t traffic_class,
+                                                     espnow_transponder_rx_callback_t callback);
+
+//! Handle to a received packet buffer
+//!
+//! Received packets are stored in fixed-size slots from a pool that is
+//! allocated once at startup. A borrow callback is handed the slot itself,
+//! and may keep it past the end of the callback by calling
+//! espnow_transponder_buffer_retain(). Each retain must be matched by a call
+//! to espnow_transponder_buffer_release(), after which the slot is returned
+//! to the pool. Holding slots for a long time will starve the receiver.
+typedef struct espnow_transponder_buffer espnow_transponder_buffer_t;
+
+//! Borrow callback function prototype
+//!
+//! \param buffer Received packet buffer, valid until the callback returns
+//!               unless it is retained
+typedef void (*espnow_transponder_borrow_callback_t)(espnow_transponder_buffer_t *buffer);
+
+//! \brief Register a callback that borrows received packet buffers
+//!
+//! This is called instead of the callback registered by
+//! espnow_transponder_register_callback(), if both are set.
+//!
+//! \param callback Callback function
+void espnow_transponder_register_borrow_callback(espnow_transponder_borrow_callback_t callback);
+
+//! \brief Unregister the borrow callback function
+void espnow_transponder_unregister_borrow_callback();
+
+//! \brief Get a pointer to the payload of a received packet buffer
+const uint8_t *espnow_transponder_buffer_data(const espnow_transponder_buffer_t *buffer);
+
+//! \brief Get the length of the payload of a received packet buffer
+uint16_t espnow_transponder_buffer_length(const espnow_transponder_buffer_t *buffer);
+
+//! \brief Take an additional reference to a received packet buffer
+void espnow_transponder_buffer_retain(espnow_transponder_buffer_t *buffer);
+
+//! \brief Release a reference to a received packet buffer
+//!
+//! The buffer is returned to the pool when the last reference is released.
+void espnow_transponder_buffer_release(espnow_transponder_buffer_t *buffer);
+
+//! Number of keys that can be subscribed to, keys are [0, ESPNOW_TRANSPONDER_MAX_KEYS)
+#define ESPNOW_TRANSPONDER_MAX_KEYS 512
+
+//! \brief Only receive packets with a subscribed key
+//!
+//! The key is the first two bytes of the payload, read little endian. For
+//! ARTDMX packets, that is the universe number. Until the first
+//! subscription, every packet is received.
+//!
+//! Unsubscribed packets are dropped in the WiFi task, before they are
+//! checked or copied. The key is never compressed, so this includes
+//! compressed and FEC protected packets. Dropped FEC packets can't help to
+//! rebuild the others in their group, so a node that subscribes to a few
+//! keys gets less out of FEC. Relayed packets are forwarded whether they
+//! are wanted or not, so they are filtered once they are decoded instead.
+//!
+//! \param key Key to subscribe to
+//! \return ESP_OK, or ESP_ERR_INVALID_ARG if the key is too large
+esp_err_t espnow_transponder_subscribe(uint16_t key);
+
+//! \brief Stop receiving packets with a key
+//!
+//! \param key Key to unsubscribe from
+//! \return ESP_OK, or ESP_ERR_INVALID_ARG if the key is too large
+esp_err_t espnow_transponder_unsubscribe(uint16_t key);
+
+//! \brief Receive every packet again, and clear the subscriptions
+void espnow_transponder_subscribe_all();
+
 //! \brief Get the maximum data size that can be transmitted with espnow_transponder
 //!
 //! \return Maximum data size, in bytes.
 int espnow_transponder_max_packet_size();
 
+//! \brief Get the maximum data size that might be transmitted if it compresses
+//!
+//! \return ESPNOW_TRANSPONDER_MAX_DATA_LENGTH if compression is enabled,
+//!         otherwise the same as espnow_transponder_max_packet_size()
+int espnow_transponder_max_compressed_size();
+
 //! \brief Get transmission statistics for the espnow transponder
 //!
+//! The counters are consistent with each other, and never torn. Updating
+//! them never blocks; this may have to wait briefly if it races an update.
+//!
 //! \param stats Pointer to copy staticss to
 void espnow_transponder_get_statistics(espnow_transponder_stats_t *stats);
+
+//! \brief Get the statistics, with their rates
+//!
+//! \param snapshot Pointer to copy the snapshot to
+void espnow_transponder_get_snapshot(espnow_transponder_snapshot_t *snapshot);
+
+//! \brief Get a snapshot of the statistics in a compact binary format
+//!
+//! This is meant to be sent to a monitoring host, which can then poll many
+//! nodes cheaply. The format is:
+//!
+//! * 'T', 'S': format identifier
+//! * Format version, currently 1
+//! * N: number of counters
+//! * Snapshot time in microseconds
+//! * N counter totals, in espnow_transponder_stats_t order
+//! * N counter rates, in counts per second
+//!
+//! Everything after the first four bytes is an unsigned LEB128 varint, so
+//! idle counters take one byte each. A decoder should ignore counters past
+//! the ones it knows, and treat missing ones as zero.
+//!
+//! \param buffer Buffer to write to, ESPNOW_TRANSPONDER_EXPORT_MAX_LENGTH is always enough
+//! \param length Size of the buffer
+//! \return Length of the export, or -1 if the buffer is too small
+int espnow_transponder_export_statistics(uint8_t *buffer, size_t length);
+
+//! \brief Freeze the pipeline trace
+//!
+//! The trace keeps recording for a quarter of its size after the trigger,
+//! and then stops until espnow_transponder_trace_rearm() is called. Only
+//! the first trigger counts. The transponder triggers it itself on errors
+//! if trace_freeze_on_error is set; an application can trigger it on
+//! anomalies it sees, such as a large sequence gap.
+//!
+//! \param reason ESPNOW_TRANSPONDER_TRACE_USER or above, stored in the dump
+void espnow_transponder_trace_trigger(uint32_t reason);
+
+//! \brief Check if the pipeline trace was frozen by a trigger
+//!
+//! \return True if the trace has stopped recording, and is ready to dump
+bool espnow_transponder_trace_frozen();
+
+//! \brief Get the size of a buffer that can hold a full trace dump
+size_t espnow_transponder_trace_dump_size();
+
+//! \brief Copy the pipeline trace out, for tools/trace_decode.py
+//!
+//! \param buffer Buffer to write to
+//! \param length Size of the buffer
+//! \return Length of the dump, or -1 if tracing is disabled
+int espnow_transponder_trace_dump(uint8_t *buffer, size_t length);
+
+//! \brief Clear the pipeline trace, and start recording again
+void espnow_transponder_trace_rearm();
@@ -0,0 +1,68 @@
+#pragma once
+
+//! Packet transport for the ESP-NOW transponder
+//!
+//! The transponder builds, checks and queues packets, and hands them to a
+//! transport to put on the air. The default transport broadcasts them with
+//! ESP-NOW. Another transport can be given in
+//! espnow_transponder_config_t::transport, for example a simulated medium
+//! to load test protocol changes without hardware.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "espnow_transponder.h"
+
+//! \brief Called by the transport when a packet arrives
+//!
+//! This may be called from a driver task, so it must not block.
+//!
+//! \param mac_addr Address of the sender
+//! \param data Pointer to the packet. Only valid during the call.
+//! \param length Length of the packet
+typedef void (*espnow_transponder_transport_recv_cb_t)(const uint8_t *mac_addr, const uint8_t *data, int length);
+
+//! \brief Called by the transport when a send has completed
+//!
+//! This may be called from a driver task, so it must not block.
+//!
+//! \param mac_addr Address the packet was sent to
+//! \param success True if the packet was put on the air
+typedef void (*espnow_transponder_transport_send_cb_t)(const uint8_t *mac_addr, bool success);
+
+struct espnow_transponder_transport {
+    const char *name;               //!< Name for log messages
+
+    //! \brief Bring up the transport
+    //!
+    //! \param config Transponder configuration
+    //! \return ESP_OK if successful
+    esp_err_t (*init)(const espnow_transponder_config_t *config);
+
+    //! \brief Set the callbacks for received packets and send completions
+    //!
+    //! \return ESP_OK if successful
+    esp_err_t (*register_callbacks)(espnow_transponder_transport_recv_cb_t recv_cb,
+                                    espnow_transponder_transport_send_cb_t send_cb);
+
+    //! \brief Broadcast a packet
+    //!
+    //! Every successful call must be followed by a send completion.
+    //!
+    //! \param data Pointer to the packet. Only needs to be valid during the call.
+    //! \param length Length of the packet, at most ESP_NOW_MAX_DATA_LEN
+    //! \return ESP_OK if the packet was accepted for sending
+    esp_err_t (*send)(const uint8_t *data, uint16_t length);
+
+    //! \brief Change the PHY rate and TX power, or NULL if the transport can't
+    //!
+    //! Used by rate control. Only called from the transponder task.
+    //!
+    //! \param phy_rate PHY rate
+    //! \param power TX power, in the units of espnow_transponder_config_t::power
+    //! \return ESP_OK if successful
+    esp_err_t (*set_phy)(wifi_phy_rate_t phy_rate, int8_t power);
+};
+
+//! ESP-NOW broadcast transport, used when no transport is configured
+extern const espnow_transponder_transport_t espnow_transponder_transport_espnow;
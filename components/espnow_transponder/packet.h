@@ -0,0 +1,43 @@
+#pragma once
+
+//! Wire format for espnow_transponder packets
+
+#include <stdint.h>
+
+//! Packet flags
+#define ESPNOW_TRANSPONDER_FLAG_COMPRESSED  0x01    //!< Payload after the key is compressed with payload_compress()
+#define ESPNOW_TRANSPONDER_FLAG_FEC         0x02    //!< Payload starts with a fec_header_t
+#define ESPNOW_TRANSPONDER_FLAG_CONTROL     0x04    //!< Payload is a control message for the transponder, see control.h
+#define ESPNOW_TRANSPONDER_FLAG_RELAY       0x08    //!< Payload starts with an espnow_transponder_relay_header_t
+#define ESPNOW_TRANSPONDER_FLAG_CLASS_MASK  0x30    //!< Traffic class, an espnow_transponder_class_t
+
+//! Position of the traffic class in the flags
+#define ESPNOW_TRANSPONDER_FLAG_CLASS_SHIFT 4
+
+//! Flags for a traffic class
+#define ESPNOW_TRANSPONDER_FLAG_CLASS(traffic_class) \
+    (((traffic_class) << ESPNOW_TRANSPONDER_FLAG_CLASS_SHIFT) & ESPNOW_TRANSPONDER_FLAG_CLASS_MASK)
+
+//! Traffic class of a packet, from its flags
+#define ESPNOW_TRANSPONDER_PACKET_CLASS(flags) \
+    (((flags) & ESPNOW_TRANSPONDER_FLAG_CLASS_MASK) >> ESPNOW_TRANSPONDER_FLAG_CLASS_SHIFT)
+
+//! Size of the key that starts each payload. The key is never compressed,
+//! so that receivers can filter on it before decoding the packet.
+#define ESPNOW_TRANSPONDER_KEY_LENGTH       2
+
+//! Packet format for espnow_transponder packets
+typedef struct {
+    uint16_t crc;                       //!< 16-bit CRC of the packet with this field set to zero, see crc16.h
+    uint8_t flags;                      //!< Packet flags (ESPNOW_TRANSPONDER_FLAG_x)
+    uint8_t data_length;                //!< Length of the data payload TODO: If ESP-NOW length is reliable, drop this
+    uint8_t data[];                     //!< First element of the data payload
+} __attribute__((packed)) espnow_transponder_packet_t;
+
+//! Relay header, added after the transponder header (and before the FEC
+//! header) when packets may be relayed. See relay.h.
+typedef struct {
+    uint16_t origin;                    //!< Node that first sent the packet
+    uint16_t sequence;                  //!< Packet sequence number of that node
+    uint8_t ttl;                        //!< Times the packet may still be relayed
+} __attribute__((packed)) espnow_transponder_relay_header_t;
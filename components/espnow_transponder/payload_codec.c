@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "payload_codec.h"
+#include "espnow_transponder.h"
+
+// Number of interleaved byte planes (R, G, B)
+#define PLANES          3
+
+#define LITERAL_MAX     128
+#define REPEAT_MIN      3
+#define REPEAT_MAX      (0xFF - 126)
+
+int payload_compress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max) {
+    if(in_length > ESPNOW_TRANSPONDER_MAX_DATA_LENGTH || out_max < PAYLOAD_CODEC_HEADER)
+        return -1;
+
+    // Split into planes, and take the difference between neighbors
+    uint8_t planes[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+    uint16_t count = 0;
+    for(int plane = 0; plane < PLANES; plane++) {
+        uint8_t previous = 0;
+        for(uint16_t i = plane; i < in_length; i += PLANES) {
+            planes[count++] = in[i] - previous;
+            previous = in[i];
+        }
+    }
+
+    out[0] = in_length & 0xFF;
+    out[1] = in_length >> 8;
+    uint16_t out_length = PAYLOAD_CODEC_HEADER;
+
+    uint16_t i = 0;
+    uint16_t literal_start = 0;
+
+    while(i <= count) {
+        uint16_t run = 1;
+        if(i < count)
+            while(i + run < count && run < REPEAT_MAX && planes[i + run] == planes[i])
+                run++;
+
+        // Flush pending literals at the end of the data, before a repeat, or
+        // when the literal is as long as it can get.
+        const uint16_t literal_length = i - literal_start;
+        if(literal_length > 0 && (i == count || run >= REPEAT_MIN || literal_length == LITERAL_MAX)) {
+            if(out_length + 1 + literal_length > out_max)
+                return -1;
+            out[out_length++] = literal_length - 1;
+            memcpy(out + out_length, planes + literal_start, literal_length);
+            out_length += literal_length;
+            literal_start = i;
+        }
+
+        if(i == count)
+            break;
+
+        if(run >= REPEAT_MIN) {
+            if(out_length + 2 > out_max)
+                return -1;
+            out[out_length++] = run + 126;
+            out[out_length++] = planes[i];
+            i += run;
+            literal_start = i;
+        }
+        else {
+            i++;
+        }
+    }
+
+    return out_length;
+}
+
+int payload_decompress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max) {
+    if(in_length < PAYLOAD_CODEC_HEADER)
+        return -1;
+
+    const uint16_t out_length = in[0] | (in[1] << 8);
+    if(out_length > out_max || out_length > ESPNOW_TRANSPONDER_MAX_DATA_LENGTH)
+        return -1;
+
+    uint8_t planes[ESPNOW_TRANSPONDER_MAX_DATA_LENGTH];
+    uint16_t count = 0;
+    uint16_t position = PAYLOAD_CODEC_HEADER;
+
+    while(position < in_length) {
+        const uint8_t control = in[position++];
+
+        if(control < 0x80) {
+            const uint16_t length = control + 1;
+            if(position + length > in_length || count + length > out_length)
+                return -1;
+            memcpy(planes + count, in + position, length);
+            position += length;
+            count += length;
+        }
+        else {
+            const uint16_t length = control - 126;
+            if(position + 1 > in_length || count + length > out_length)
+                return -1;
+            memset(planes + count, in[position++], length);
+            count += length;
+        }
+    }
+
+    if(count != out_length)
+        return -1;
+
+    // Undo the differences, and interleave the planes again
+    count = 0;
+    for(int plane = 0; plane < PLANES; plane++) {
+        uint8_t previous = 0;
+        for(uint16_t i = plane; i < out_length; i += PLANES) {
+            previous += planes[count++];
+            out[i] = previous;
+        }
+    }
+
+    return out_length;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+//! Lightweight compression for transponder payloads
+//!
+//! DMX data for RGB pixels tends to have each color channel change slowly
+//! from one pixel to the next, and often has whole channels at a constant
+//! value. The codec splits the payload into three byte planes (every third
+//! byte), replaces each byte with its difference from the previous byte in
+//! the same plane, and then run-length codes the result.
+//!
+//! Compressed format:
+//!   out[0-1]: uncompressed length (little endian)
+//!   out[2-n]: run-length coded plane differences, as a series of:
+//!     0x00-0x7F: literal, followed by (control + 1) bytes
+//!     0x80-0xFF: repeat, followed by a single byte to repeat (control - 126) times
+
+#include <stdint.h>
+
+//! Size of the header at the start of a compressed payload
+#define PAYLOAD_CODEC_HEADER    2
+
+//! \brief Compress a payload
+//!
+//! \param in Payload to compress
+//! \param in_length Length of the payload
+//! \param out Buffer to write the compressed payload to
+//! \param out_max Size of the output buffer
+//! \return Compressed length, or -1 if it did not fit in the output buffer
+int payload_compress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max);
+
+//! \brief Decompress a payload
+//!
+//! \param in Compressed payload
+//! \param in_length Length of the compressed payload
+//! \param out Buffer to write the payload to
+//! \param out_max Size of the output buffer
+//! \return Uncompressed length, or -1 if the input was malformed or too big for the output buffer
+int payload_decompress(const uint8_t *in, uint16_t in_length, uint8_t *out, uint16_t out_max);
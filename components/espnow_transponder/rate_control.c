@@ -0,0 +1,230 @@
+#include <string.h>
+
+#include "rate_control.h"
+
+// 802.11n MCS0 to MCS7 with the long guard interval, WIFI_PHY_RATE_MCSx_LGI
+const uint8_t rate_control_rates[RATE_CONTROL_RATES] = {
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+};
+
+void loss_monitor_init(loss_monitor_t *monitor)
+{
+    memset(monitor, 0, sizeof(*monitor));
+}
+
+bool loss_monitor_sender_report(loss_monitor_t *monitor, const uint8_t *mac_addr,
+                                const control_sender_report_t *report, control_loss_report_t *reply)
+{
+    monitor->reports++;
+
+    // Find the sender, or take over the slot that was used least recently
+    loss_monitor_sender_t *sender = NULL;
+    loss_monitor_sender_t *oldest = &monitor->senders[0];
+    for(int index = 0; index < LOSS_MONITOR_SENDERS; index++) {
+        loss_monitor_sender_t *slot = &monitor->senders[index];
+        if(slot->active && memcmp(slot->mac_addr, mac_addr, sizeof(slot->mac_addr)) == 0) {
+            sender = slot;
+            break;
+        }
+
+        if(!slot->active || (oldest->active && slot->last_used < oldest->last_used))
+            oldest = slot;
+    }
+
+    const bool known = sender != NULL && sender->session == report->session;
+    if(sender == NULL) {
+        sender = oldest;
+        memcpy(sender->mac_addr, mac_addr, sizeof(sender->mac_addr));
+    }
+
+    const uint32_t expected = report->packets - sender->packets;
+    const uint32_t received = sender->received;
+
+    sender->active = true;
+    sender->session = report->session;
+    sender->packets = report->packets;
+    sender->received = 0;
+    sender->last_used = monitor->reports;
+
+    // A new sender, or one that restarted, only starts the count
+    if(!known)
+        return false;
+
+    // Packets that were in flight around the report can land on either side
+    // of it; don't report more than were sent
+    reply->type = CONTROL_LOSS_REPORT;
+    reply->session = report->session;
+    reply->expected = expected > UINT16_MAX ? UINT16_MAX : expected;
+    reply->received = received > reply->expected ? reply->expected : received;
+
+    return true;
+}
+
+void rate_control_init(rate_control_t *control, const rate_control_config_t *config, uint8_t phy_rate,
+                       int8_t power)
+{
+    memset(control, 0, sizeof(*control));
+    control->config = *config;
+    control->power = power;
+    control->last_loss = -1;
+
+    for(int index = 0; index < RATE_CONTROL_RATES; index++) {
+        control->rate_backoff[index] = config->hold_windows;
+        if(rate_control_rates[index] == phy_rate)
+            control->rate_index = index;
+    }
+    control->power_backoff = config->hold_windows;
+}
+
+//! \brief Add a loss measurement to the current window, keeping the worst
+static void window_add(rate_control_t *control, uint32_t expected, uint32_t lost)
+{
+    if(expected < control->config.min_packets)
+        return;
+
+    const float loss = (float)lost/expected;
+    if(!control->window_valid || loss > control->window_loss)
+        control->window_loss = loss;
+    control->window_valid = true;
+}
+
+void rate_control_loss_report(rate_control_t *control, uint32_t expected, uint32_t received)
+{
+    control->window_reported = true;
+    control->heard = true;
+    window_add(control, expected, received < expected ? expected - received : 0);
+}
+
+void rate_control_send_result(rate_control_t *control, uint32_t attempts, uint32_t failures)
+{
+    window_add(control, attempts, failures < attempts ? failures : attempts);
+}
+
+//! \brief Hold a probe off, for longer each time it fails
+static void hold_off(uint8_t *hold, uint8_t *backoff, uint8_t hold_max)
+{
+    *hold = *backoff;
+    *backoff = *backoff > hold_max/2 ? hold_max : *backoff*2;
+}
+
+//! \brief Give up some throughput or power to get the loss back under the budget
+static void step_down(rate_control_t *control)
+{
+    const rate_control_config_t *config = &control->config;
+
+    // A failed probe is undone, and won't be tried again for a while
+    if(control->probe == RATE_CONTROL_PROBE_RATE) {
+        hold_off(&control->rate_hold[control->rate_index], &control->rate_backoff[control->rate_index],
+                 config->hold_windows_max);
+        control->rate_index--;
+    }
+    else if(control->probe == RATE_CONTROL_PROBE_POWER) {
+        hold_off(&control->power_hold, &control->power_backoff, config->hold_windows_max);
+        control->power += config->power_step;
+    }
+    // Otherwise conditions got worse; more power keeps the rate
+    else if(control->power < config->power_max) {
+        control->power = control->power + config->power_step > config->power_max
+            ? config->power_max : control->power + config->power_step;
+    }
+    else if(control->rate_index > 0) {
+        control->rate_index--;
+    }
+    else {
+        return;
+    }
+
+    control->changes++;
+}
+
+//! \brief Try the next faster rate, or failing that a lower power
+static void step_up(rate_control_t *control)
+{
+    const rate_control_config_t *config = &control->config;
+
+    // Faster rates are tried at full power; power is only saved while the
+    // next rate is held off
+    if(control->rate_index + 1 < RATE_CONTROL_RATES && control->rate_hold[control->rate_index + 1] == 0) {
+        control->rate_index++;
+        control->power = config->power_max;
+        control->probe = RATE_CONTROL_PROBE_RATE;
+    }
+    else if(control->power - config->power_step >= config->power_min && control->power_hold == 0) {
+        control->power -= config->power_step;
+        control->probe = RATE_CONTROL_PROBE_POWER;
+    }
+    else {
+        return;
+    }
+
+    control->good = 0;
+    control->probe_windows = control->config.good_windows;
+    control->changes++;
+}
+
+bool rate_control_update(rate_control_t *control)
+{
+    const rate_control_config_t *config = &control->config;
+    const uint32_t changes = control->changes;
+
+    for(int index = 0; index < RATE_CONTROL_RATES; index++)
+        if(control->rate_hold[index] > 0)
+            control->rate_hold[index]--;
+    if(control->power_hold > 0)
+        control->power_hold--;
+
+    // Packets went out, but the reports that should have come back didn't
+    if(control->window_valid && !control->window_reported && control->heard) {
+        if(++control->silent >= config->silent_windows)
+            control->window_loss = 1;
+    }
+    else {
+        control->silent = 0;
+    }
+
+    control->last_loss = control->window_valid ? control->window_loss : -1;
+
+    const bool settling = control->settling;
+    const bool valid = control->window_valid;
+    control->settling = false;
+    control->window_valid = false;
+    control->window_reported = false;
+
+    // Nothing was sent or reported, so there's nothing to go on. A probe
+    // stays in place until it can be judged.
+    if(settling || !valid)
+        return false;
+
+    if(control->window_loss > config->loss_budget) {
+        control->good = 0;
+        step_down(control);
+        control->probe = RATE_CONTROL_PROBE_NONE;
+    }
+    else {
+        // A probe that held up is the new normal, and can be retried
+        // quickly if it fails later on
+        if(control->probe != RATE_CONTROL_PROBE_NONE && --control->probe_windows == 0) {
+            if(control->probe == RATE_CONTROL_PROBE_RATE)
+                control->rate_backoff[control->rate_index] = config->hold_windows;
+            else
+                control->power_backoff = config->hold_windows;
+            control->probe = RATE_CONTROL_PROBE_NONE;
+        }
+
+        if(control->window_loss < config->loss_low) {
+            if(++control->good >= config->good_windows && control->probe == RATE_CONTROL_PROBE_NONE)
+                step_up(control);
+        }
+        else {
+            control->good = 0;
+        }
+    }
+
+    control->settling = control->changes != changes;
+    return control->settling;
+}
+
+uint8_t rate_control_phy_rate(const rate_control_t *control)
+{
+    return rate_control_rates[control->rate_index];
+}
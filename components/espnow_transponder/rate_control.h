@@ -0,0 +1,180 @@
+#pragma once
+
+//! Closed loop PHY rate and TX power control
+//!
+//! Faster PHY rates use less airtime per packet, so more universes fit on a
+//! channel, but they need a cleaner signal. A sender with rate control
+//! enabled periodically broadcasts a sender report, which carries the number
+//! of packets it has sent. Receivers count the packets they got from that
+//! sender in between, and answer with a loss report.
+//!
+//! The sender feeds the loss reports, and its own send failures, into a
+//! rate_control_t once per control window. It treats the worst receiver's
+//! loss as the loss of the window. Loss over the budget first raises the TX
+//! power, and then steps the rate down. Several windows in a row well under
+//! the budget probe the next faster rate at full power, or failing that, a
+//! lower power. A probe that goes over the budget is undone, and the same
+//! probe is then held off for twice as long as the last time, so that a
+//! marginal setting is retried less and less often. A probe is on trial for
+//! as many windows as it took to start it.
+//!
+//! When the signal is bad enough, the sender reports don't get through
+//! either. Once receivers have answered, windows in which packets were sent
+//! but no loss report came back count as total loss.
+//!
+//! Loss reports answer the sender report sent at the end of a window, so
+//! they arrive during the next one. After every change, one window is
+//! skipped, so that a setting is only judged on packets that were sent
+//! with it.
+//!
+//! This contains no RTOS calls, and is driven by the transponder.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "control.h"
+
+//! Senders a loss monitor can follow at once
+#define LOSS_MONITOR_SENDERS    4
+
+//! Number of steps on the rate ladder
+#define RATE_CONTROL_RATES      8
+
+//! Broadcast by a rate controlled sender once per control window
+typedef struct {
+    uint8_t type;                       //!< CONTROL_SENDER_REPORT
+    uint32_t session;                   //!< Random id of the sender, new on every start
+    uint32_t packets;                   //!< Packets sent so far, not counting control messages. Wraps.
+} __attribute__((packed)) control_sender_report_t;
+
+//! Broadcast by a receiver in reply to a sender report
+typedef struct {
+    uint8_t type;                       //!< CONTROL_LOSS_REPORT
+    uint32_t session;                   //!< Session of the sender this is for
+    uint16_t expected;                  //!< Packets the sender sent since the last report this receiver got
+    uint16_t received;                  //!< How many of those were received
+} __attribute__((packed)) control_loss_report_t;
+
+//! Receive counts for one sender
+typedef struct {
+    bool active;                        //!< True if this slot follows a sender
+    uint8_t mac_addr[6];                //!< Address of the sender
+    uint32_t session;                   //!< Session of the last sender report
+    uint32_t packets;                   //!< Packet count from the last sender report
+    uint32_t received;                  //!< Packets received since the last sender report
+    uint32_t last_used;                 //!< Report number when this slot was last used
+} loss_monitor_sender_t;
+
+//! Receiver side, counts packets from the senders that ask for loss reports
+typedef struct {
+    loss_monitor_sender_t senders[LOSS_MONITOR_SENDERS];
+    uint32_t reports;                   //!< Sender reports seen
+} loss_monitor_t;
+
+typedef struct {
+    float loss_budget;                  //!< Highest acceptable loss, as a fraction
+    float loss_low;                     //!< Loss under which a window counts as good, normally well under the budget
+    uint8_t good_windows;               //!< Good windows in a row needed to probe a faster rate or lower power
+    uint8_t hold_windows;               //!< Initial hold-off after a failed probe, doubled on every failure
+    uint8_t hold_windows_max;           //!< Longest hold-off
+    uint16_t min_packets;               //!< Packets a report needs to cover to be trusted
+    uint8_t silent_windows;             //!< Windows in a row without a loss report that count as total loss
+    int8_t power_min;                   //!< Lowest TX power
+    int8_t power_max;                   //!< Highest TX power
+    int8_t power_step;                  //!< TX power change per step
+} rate_control_config_t;
+
+//! What the last probe changed
+typedef enum {
+    RATE_CONTROL_PROBE_NONE,
+    RATE_CONTROL_PROBE_RATE,            //!< Stepped up to a faster rate
+    RATE_CONTROL_PROBE_POWER,           //!< Stepped down to a lower power
+} rate_control_probe_t;
+
+//! Sender side controller
+typedef struct {
+    rate_control_config_t config;
+    uint8_t rate_index;                 //!< Current rate, [0, RATE_CONTROL_RATES), slowest first
+    int8_t power;                       //!< Current TX power
+    uint8_t good;                       //!< Good windows in a row
+    rate_control_probe_t probe;         //!< Probe being evaluated
+    uint8_t probe_windows;              //!< Windows left until the probe is accepted
+    bool settling;                      //!< True if the current window still measures the previous settings
+    uint8_t rate_hold[RATE_CONTROL_RATES];  //!< Windows until the rate can be probed again
+    uint8_t rate_backoff[RATE_CONTROL_RATES]; //!< Hold-off to use after the next failed probe of the rate
+    uint8_t power_hold;                 //!< Windows until a lower power can be probed again
+    uint8_t power_backoff;              //!< Hold-off to use after the next failed power probe
+    float window_loss;                  //!< Worst loss seen in the current window
+    bool window_valid;                  //!< True if anything was measured in the current window
+    bool window_reported;               //!< True if a loss report arrived in the current window
+    bool heard;                         //!< True once any receiver has sent a loss report
+    uint8_t silent;                     //!< Windows in a row with packets sent but no loss report
+    float last_loss;                    //!< Loss of the last completed window, or -1 if nothing was measured
+    uint32_t changes;                   //!< Rate or power changes so far
+} rate_control_t;
+
+//! Rate ladder, in wifi_phy_rate_t values, slowest first
+extern const uint8_t rate_control_rates[RATE_CONTROL_RATES];
+
+//! \brief Initialize a loss monitor
+void loss_monitor_init(loss_monitor_t *monitor);
+
+//! \brief Count a received packet
+//!
+//! Packets from senders that haven't sent a sender report aren't counted.
+//!
+//! \param monitor Loss monitor
+//! \param mac_addr Address of the sender
+static inline void loss_monitor_packet(loss_monitor_t *monitor, const uint8_t *mac_addr)
+{
+    for(int index = 0; index < LOSS_MONITOR_SENDERS; index++) {
+        loss_monitor_sender_t *sender = &monitor->senders[index];
+        if(sender->active && memcmp(sender->mac_addr, mac_addr, sizeof(sender->mac_addr)) == 0) {
+            sender->received++;
+            return;
+        }
+    }
+}
+
+//! \brief Handle a sender report, and build the loss report to answer it with
+//!
+//! \param monitor Loss monitor
+//! \param mac_addr Address of the sender
+//! \param report Sender report
+//! \param reply Set to the loss report
+//! \return True if there is a reply to send. The first report from a sender only starts the count.
+bool loss_monitor_sender_report(loss_monitor_t *monitor, const uint8_t *mac_addr,
+                                const control_sender_report_t *report, control_loss_report_t *reply);
+
+//! \brief Initialize a rate controller
+//!
+//! \param control Controller
+//! \param config Controller settings
+//! \param phy_rate Starting rate. If it isn't on the ladder, the slowest rate is used.
+//! \param power Starting TX power
+void rate_control_init(rate_control_t *control, const rate_control_config_t *config, uint8_t phy_rate,
+                       int8_t power);
+
+//! \brief Add a loss report to the current window
+//!
+//! \param control Controller
+//! \param expected Packets the receiver should have got
+//! \param received Packets it did get
+void rate_control_loss_report(rate_control_t *control, uint32_t expected, uint32_t received);
+
+//! \brief Add the sender's own failures to the current window
+//!
+//! \param control Controller
+//! \param attempts Packets sent in the window
+//! \param failures Packets that the transport refused, or that failed to send
+void rate_control_send_result(rate_control_t *control, uint32_t attempts, uint32_t failures);
+
+//! \brief End the current window, and decide on the settings for the next one
+//!
+//! \param control Controller
+//! \return True if the rate or power changed
+bool rate_control_update(rate_control_t *control);
+
+//! \brief Get the current rate, as a wifi_phy_rate_t value
+uint8_t rate_control_phy_rate(const rate_control_t *control);
@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "relay.h"
+#include "framing.h"
+
+// Log2 of RELAY_SEEN_SETS
+#define RELAY_SEEN_SET_BITS         6
+
+_Static_assert((1 << RELAY_SEEN_SET_BITS) == RELAY_SEEN_SETS, "RELAY_SEEN_SET_BITS doesn't match RELAY_SEEN_SETS");
+
+//! \brief xorshift32 random number generator
+static uint32_t relay_random(relay_t *relay)
+{
+    uint32_t x = relay->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    relay->rng = x;
+    return x;
+}
+
+void relay_init(relay_t *relay, const relay_config_t *config)
+{
+    relay->config = *config;
+    memset(relay->seen, 0xFF, sizeof(relay->seen));
+    memset(relay->seen_next, 0, sizeof(relay->seen_next));
+    relay->interval_us = config->rate > 0 ? 1000000/config->rate : 0;
+    relay->full_us = 0;
+    relay->last_due_us = 0;
+    relay->rng = config->seed != 0 ? config->seed : 1;
+    relay->forwarded = 0;
+    relay->duplicates = 0;
+    relay->expired = 0;
+    relay->limited = 0;
+}
+
+uint16_t relay_origin(uint32_t value)
+{
+    const uint16_t origin = value ^ (value >> 16);
+    return origin != RELAY_ORIGIN_INVALID ? origin : 0;
+}
+
+//! \brief Remember a packet as seen
+//!
+//! \return False if it had already been seen
+static bool relay_seen_insert(relay_t *relay, uint32_t key)
+{
+    // Fibonacci hashing, so that consecutive sequence numbers spread over the sets
+    const uint32_t set = (key*2654435761u) >> (32 - RELAY_SEEN_SET_BITS);
+    uint32_t *ways = relay->seen[set];
+
+    for(int way = 0; way < RELAY_SEEN_WAYS; way++)
+        if(ways[way] == key)
+            return false;
+
+    ways[relay->seen_next[set]] = key;
+    relay->seen_next[set] = (relay->seen_next[set] + 1)%RELAY_SEEN_WAYS;
+    return true;
+}
+
+//! \brief Take a token from the rate limiter
+//!
+//! \return False if the rate limit was hit
+static bool relay_take_token(relay_t *relay, int64_t now_us)
+{
+    if(relay->interval_us == 0)
+        return true;
+
+    const int64_t full_us = relay->full_us > now_us ? relay->full_us : now_us;
+    const uint16_t burst = relay->config.burst > 0 ? relay->config.burst : 1;
+    if(full_us - now_us > (burst - 1)*relay->interval_us)
+        return false;
+
+    relay->full_us = full_us + relay->interval_us;
+    return true;
+}
+
+relay_action_t relay_receive(relay_t *relay, const espnow_transponder_relay_header_t *header, int64_t now_us,
+                             int64_t *due_us)
+{
+    // Copies of this node's own packets, relayed back to it
+    if(header->origin == relay->config.origin) {
+        relay->duplicates++;
+        return RELAY_DUPLICATE;
+    }
+
+    if(!relay_seen_insert(relay, ((uint32_t)header->origin << 16) | header->sequence)) {
+        relay->duplicates++;
+        return RELAY_DUPLICATE;
+    }
+
+    if(!relay->config.forward)
+        return RELAY_DELIVER;
+
+    if(header->ttl == 0) {
+        relay->expired++;
+        return RELAY_EXPIRED;
+    }
+
+    if(!relay_take_token(relay, now_us)) {
+        relay->limited++;
+        return RELAY_LIMITED;
+    }
+
+    // Keep the copies in order, so that they can be sent from a queue
+    int64_t due = now_us;
+    if(relay->config.jitter_us > 0)
+        due += relay_random(relay)%(relay->config.jitter_us + 1);
+    if(due < relay->last_due_us)
+        due = relay->last_due_us;
+    relay->last_due_us = due;
+
+    *due_us = due;
+    relay->forwarded++;
+    return RELAY_FORWARD;
+}
+
+void relay_prepare(uint8_t *packet)
+{
+    espnow_transponder_packet_t *header = (espnow_transponder_packet_t *)packet;
+    espnow_transponder_relay_header_t *relay_header = (espnow_transponder_relay_header_t *)header->data;
+
+    relay_header->ttl--;
+    framing_seal(packet, header->flags, header->data_length);
+}
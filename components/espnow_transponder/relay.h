@@ -0,0 +1,108 @@
+#pragma once
+
+//! Multi-hop relaying, with duplicate suppression
+//!
+//! A node that sends with a relay TTL puts a relay header in each data
+//! packet: an origin id picked at startup, a sequence number that goes up
+//! by one for every packet it sends, and the number of times the packet may
+//! still be relayed. Relays rebroadcast each packet they hear once, with
+//! the TTL one lower, so that it reaches nodes that can't hear the origin.
+//!
+//! Every receiver remembers the (origin, sequence) of the packets it has
+//! seen recently, so that the copies heard from the origin and from each
+//! relay in range are only received once, and packets don't loop. The
+//! cache is set associative and fixed in size; it only has to cover the
+//! time it takes a packet to spread over every hop, which is a few
+//! milliseconds per hop, not the time it takes a sequence number to wrap.
+//! Packets don't carry their universe in a place that can be seen before
+//! decoding, and the fragments of a universe share its sequence number, so
+//! the packet sequence is what identifies them.
+//!
+//! Rebroadcasts are delayed by a random jitter, so that relays that hear
+//! the same packet don't all send at once, and limited to a rate, so that a
+//! relay can't flood the channel. The rate limit is a token bucket, kept as
+//! the time the bucket will next be full (GCRA).
+//!
+//! This contains no RTOS calls; the caller supplies the time, and sends the
+//! relayed packets. It is only used from one context, the WiFi task.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "packet.h"
+
+//! Number of sets in the cache of recently seen packets, a power of two
+#define RELAY_SEEN_SETS             64
+
+//! Packets remembered in each set
+#define RELAY_SEEN_WAYS             4
+
+//! Marks an unused cache entry. No origin id is ever 0xFFFF.
+#define RELAY_SEEN_EMPTY            0xFFFFFFFF
+
+//! Origin id that is never used
+#define RELAY_ORIGIN_INVALID        0xFFFF
+
+//! What to do with a received packet
+typedef enum {
+    RELAY_DELIVER,                      //!< New packet, receive it
+    RELAY_FORWARD,                      //!< New packet, receive it and relay it
+    RELAY_DUPLICATE,                    //!< Already seen, or sent by this node. Drop it.
+    RELAY_EXPIRED,                      //!< New packet, receive it. It would be relayed, but has no hops left.
+    RELAY_LIMITED,                      //!< New packet, receive it. It would be relayed, but the rate limit was hit.
+} relay_action_t;
+
+typedef struct {
+    uint16_t origin;                    //!< Origin id of this node, not RELAY_ORIGIN_INVALID
+    bool forward;                       //!< Relay packets from other nodes
+    uint32_t jitter_us;                 //!< Maximum random delay before relaying a packet
+    uint32_t rate;                      //!< Most packets relayed per second, or 0 for no limit
+    uint16_t burst;                     //!< Packets that can be relayed back to back under the rate limit
+    uint32_t seed;                      //!< Random number seed, must be non-zero
+} relay_config_t;
+
+typedef struct {
+    relay_config_t config;
+    uint32_t seen[RELAY_SEEN_SETS][RELAY_SEEN_WAYS]; //!< Recently seen packets, as origin << 16 | sequence
+    uint8_t seen_next[RELAY_SEEN_SETS]; //!< Way to replace next in each set
+    int64_t interval_us;                //!< Time between relayed packets at the rate limit
+    int64_t full_us;                    //!< Time the token bucket is full again
+    int64_t last_due_us;                //!< Time the last relayed packet was due
+    uint32_t rng;
+    uint32_t forwarded;                 //!< Packets relayed
+    uint32_t duplicates;                //!< Packets dropped as already seen
+    uint32_t expired;                   //!< Packets not relayed for lack of hops
+    uint32_t limited;                   //!< Packets not relayed for the rate limit
+} relay_t;
+
+//! \brief Initialize the relay state
+//!
+//! \param relay Relay to initialize
+//! \param config Relay settings
+void relay_init(relay_t *relay, const relay_config_t *config);
+
+//! \brief Derive an origin id from a number, such as a random one
+//!
+//! \param value Any number
+//! \return Origin id, never RELAY_ORIGIN_INVALID
+uint16_t relay_origin(uint32_t value);
+
+//! \brief Decide what to do with a received packet
+//!
+//! The packet is remembered as seen, unless it is a duplicate.
+//!
+//! \param relay Relay
+//! \param header Relay header of the packet
+//! \param now_us Current time, in microseconds
+//! \param due_us For RELAY_FORWARD, set to when the relayed copy should be sent. Copies are due in
+//!               the order they were forwarded.
+//! \return What to do with the packet
+relay_action_t relay_receive(relay_t *relay, const espnow_transponder_relay_header_t *header, int64_t now_us,
+                             int64_t *due_us);
+
+//! \brief Turn a received packet into the copy to relay
+//!
+//! This takes a hop off the TTL, and updates the CRC to match.
+//!
+//! \param packet Packet that relay_receive() returned RELAY_FORWARD for, updated in place
+void relay_prepare(uint8_t *packet);
@@ -0,0 +1,509 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "sim_air.h"
+
+// Bytes added to every ESP-NOW payload on the air: 802.11 header (24),
+// action frame category, OUI and random value (8), vendor specific
+// element header (7) and FCS (4).
+#define SIM_AIR_FRAME_OVERHEAD      43
+
+// Channel access, using 802.11g short slot timings
+#define SIM_AIR_SLOT_US             9
+#define SIM_AIR_DIFS_US             28
+#define SIM_AIR_CW_MIN              16
+
+// Average time to get access to the medium, DIFS plus half of the minimum
+// contention window
+#define SIM_AIR_ACCESS_US           (SIM_AIR_DIFS_US + ((SIM_AIR_CW_MIN - 1)*SIM_AIR_SLOT_US)/2)
+
+// Backoff end time of a node whose backoff is frozen
+#define SIM_AIR_FROZEN              INT64_MAX
+
+// Steepness of the packet error curve around a rate's required SNR, per dB
+#define SIM_AIR_SNR_SLOPE           1.5f
+
+typedef enum {
+    SIM_AIR_EVENT_TX_END,
+    SIM_AIR_EVENT_DELIVER,
+    SIM_AIR_EVENT_ACCESS,           //!< A node's backoff may have run out, with contention
+} sim_air_event_type_t;
+
+typedef struct {
+    uint32_t kbps;                  //!< Data rate
+    uint16_t preamble_us;           //!< PLCP preamble and header
+    int8_t snr_db;                  //!< SNR at which half of the packets are lost
+} sim_air_rate_t;
+
+//! \brief Look up the timing of a wifi_phy_rate_t value
+static sim_air_rate_t rate_lookup(uint8_t phy_rate)
+{
+    // 802.11b long preamble, then short preamble
+    static const uint32_t dsss_kbps[] = { 1000, 2000, 5500, 11000, 0, 2000, 5500, 11000 };
+    static const int8_t dsss_snr[] = { 0, 3, 6, 9, 0, 3, 6, 9 };
+    // 802.11g, in wifi_phy_rate_t order: 48, 24, 12, 6, 54, 36, 18, 9
+    static const uint32_t ofdm_kbps[] = { 48000, 24000, 12000, 6000, 54000, 36000, 18000, 9000 };
+    static const int8_t ofdm_snr[] = { 20, 12, 7, 4, 21, 16, 9, 5 };
+    // 802.11n, 20MHz channel, long guard interval then short
+    static const uint32_t mcs_kbps[] = {
+        6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000,
+        7200, 14400, 21700, 28900, 43300, 57800, 65000, 72200,
+    };
+    static const int8_t mcs_snr[] = { 4, 7, 9, 12, 16, 20, 21, 23 };
+
+    if(phy_rate < 0x08 && dsss_kbps[phy_rate] != 0)
+        return (sim_air_rate_t){ dsss_kbps[phy_rate], phy_rate < 0x04 ? 192 : 96, dsss_snr[phy_rate] };
+    if(phy_rate >= 0x08 && phy_rate < 0x10)
+        return (sim_air_rate_t){ ofdm_kbps[phy_rate - 0x08], 20, ofdm_snr[phy_rate - 0x08] };
+    if(phy_rate >= 0x10 && phy_rate < 0x20)
+        return (sim_air_rate_t){ mcs_kbps[phy_rate - 0x10], 36, mcs_snr[(phy_rate - 0x10) % 8] };
+    if(phy_rate == 0x29)
+        return (sim_air_rate_t){ 250, 192, -4 };
+    if(phy_rate == 0x2A)
+        return (sim_air_rate_t){ 500, 192, -2 };
+
+    // Unknown rate, assume the slowest
+    return (sim_air_rate_t){ 1000, 192, 0 };
+}
+
+//! \brief xorshift32 random number generator
+static uint32_t random_next(sim_air_t *air)
+{
+    uint32_t x = air->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    air->rng = x;
+    return x;
+}
+
+//! \brief Random number in [0,1)
+static float random_float(sim_air_t *air)
+{
+    return (random_next(air) >> 8) / 16777216.0f;
+}
+
+static bool event_before(const sim_air_event_t *a, const sim_air_event_t *b)
+{
+    if(a->time_us != b->time_us)
+        return a->time_us < b->time_us;
+
+    return (int32_t)(a->order - b->order) < 0;
+}
+
+static void event_swap(sim_air_event_t *a, sim_air_event_t *b)
+{
+    sim_air_event_t temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+//! \brief Add an event to the heap. The caller checks for space.
+static sim_air_event_t *event_push(sim_air_t *air, int64_t time_us, sim_air_event_type_t type)
+{
+    uint32_t index = air->event_count++;
+    sim_air_event_t *event = &air->events[index];
+    event->time_us = time_us;
+    event->order = air->event_order++;
+    event->type = type;
+
+    while(index > 0) {
+        const uint32_t parent = (index - 1)/2;
+        if(!event_before(&air->events[index], &air->events[parent]))
+            break;
+
+        event_swap(&air->events[index], &air->events[parent]);
+        index = parent;
+    }
+
+    return &air->events[index];
+}
+
+//! \brief Remove the earliest event from the heap
+static void event_pop(sim_air_t *air, sim_air_event_t *event)
+{
+    *event = air->events[0];
+    air->events[0] = air->events[--air->event_count];
+
+    uint32_t index = 0;
+    while(true) {
+        const uint32_t left = index*2 + 1;
+        const uint32_t right = left + 1;
+        uint32_t smallest = index;
+
+        if(left < air->event_count && event_before(&air->events[left], &air->events[smallest]))
+            smallest = left;
+        if(right < air->event_count && event_before(&air->events[right], &air->events[smallest]))
+            smallest = right;
+        if(smallest == index)
+            break;
+
+        event_swap(&air->events[index], &air->events[smallest]);
+        index = smallest;
+    }
+}
+
+bool sim_air_init(sim_air_t *air, const sim_air_config_t *config)
+{
+    if(config->node_count == 0 || config->node_count > SIM_AIR_MAX_NODES
+        || config->queue_size < config->node_count + (config->contention ? 2 : 0) || config->seed == 0)
+        return false;
+
+    memset(air, 0, sizeof(*air));
+    air->config = *config;
+    air->rng = config->seed;
+    air->idle_start_us = -SIM_AIR_DIFS_US;
+
+    if(config->contention) {
+        air->packets = malloc(sizeof(sim_air_packet_t)*SIM_AIR_NODE_QUEUE*config->node_count);
+        if(air->packets == NULL)
+            return false;
+    }
+
+    for(uint8_t node = 0; node < config->node_count; node++) {
+        air->nodes[node].phy_rate = config->phy_rate;
+        air->nodes[node].power = SIM_AIR_REFERENCE_POWER;
+        air->nodes[node].clock_rate = 1.0;
+        if(config->contention)
+            air->nodes[node].queue = &air->packets[node*SIM_AIR_NODE_QUEUE];
+    }
+
+    air->events = malloc(sizeof(sim_air_event_t)*config->queue_size);
+    return air->events != NULL;
+}
+
+void sim_air_free(sim_air_t *air)
+{
+    free(air->events);
+    free(air->packets);
+    air->events = NULL;
+    air->packets = NULL;
+    air->event_count = 0;
+}
+
+void sim_air_attach(sim_air_t *air, uint8_t node, sim_air_recv_cb_t recv_cb, sim_air_send_cb_t send_cb,
+                    void *context)
+{
+    air->nodes[node].recv_cb = recv_cb;
+    air->nodes[node].send_cb = send_cb;
+    air->nodes[node].context = context;
+}
+
+void sim_air_set_phy(sim_air_t *air, uint8_t node, uint8_t phy_rate, int8_t power)
+{
+    air->nodes[node].phy_rate = phy_rate;
+    air->nodes[node].power = power;
+}
+
+void sim_air_set_link(sim_air_t *air, uint8_t a, uint8_t b, float loss)
+{
+    air->link_loss[a][b] = loss;
+    air->link_loss[b][a] = loss;
+}
+
+void sim_air_set_clock(sim_air_t *air, uint8_t node, float ppm, int64_t offset_us)
+{
+    air->nodes[node].clock_rate = 1.0 + ppm*1e-6;
+    air->nodes[node].clock_offset_us = offset_us;
+}
+
+int64_t sim_air_node_time(const sim_air_t *air, uint8_t node, int64_t time_us)
+{
+    const sim_air_node_t *clock = &air->nodes[node];
+    return clock->clock_offset_us + (int64_t)floor(time_us*clock->clock_rate);
+}
+
+int64_t sim_air_sim_time(const sim_air_t *air, uint8_t node, int64_t node_us)
+{
+    const sim_air_node_t *clock = &air->nodes[node];
+    return (int64_t)ceil((node_us - clock->clock_offset_us)/clock->clock_rate);
+}
+
+//! \brief Time a packet from a node is on the air, without channel access
+static int64_t frame_airtime(const sim_air_t *air, uint8_t node, uint16_t length)
+{
+    const sim_air_rate_t rate = rate_lookup(air->nodes[node].phy_rate);
+    const uint64_t bits = (uint64_t)(SIM_AIR_FRAME_OVERHEAD + length)*8;
+
+    return rate.preamble_us + (bits*1000 + rate.kbps - 1)/rate.kbps;
+}
+
+int64_t sim_air_airtime(const sim_air_t *air, uint8_t node, uint16_t length)
+{
+    return SIM_AIR_ACCESS_US + frame_airtime(air, node, length);
+}
+
+//! \brief A node has a packet to send, start its backoff
+static void access_request(sim_air_t *air, uint8_t node)
+{
+    sim_air_node_t *sender = &air->nodes[node];
+    sender->contending = true;
+
+    // A node that finds the medium idle for DIFS sends right away. Otherwise
+    // it picks a backoff, which only counts down while the medium is idle.
+    if(air->transmitting == 0 && air->now_us >= air->idle_start_us + SIM_AIR_DIFS_US) {
+        sender->backoff = 0;
+        sender->access_us = air->now_us;
+    }
+    else {
+        sender->backoff = random_next(air) % SIM_AIR_CW_MIN;
+        sender->access_us = air->transmitting > 0 ? SIM_AIR_FROZEN
+            : air->idle_start_us + SIM_AIR_DIFS_US + sender->backoff*SIM_AIR_SLOT_US;
+    }
+
+    sim_air_event_t *event = event_push(air, sender->access_us == SIM_AIR_FROZEN ? air->now_us : sender->access_us,
+                                        SIM_AIR_EVENT_ACCESS);
+    event->source = node;
+}
+
+//! \brief Put the oldest packet in a node's queue on the air
+static void transmission_start(sim_air_t *air, uint8_t node)
+{
+    sim_air_node_t *sender = &air->nodes[node];
+    const sim_air_packet_t *packet = &sender->queue[sender->queue_head];
+    const int64_t airtime_us = frame_airtime(air, node, packet->length);
+
+    sim_air_event_t *event = event_push(air, air->now_us + airtime_us, SIM_AIR_EVENT_TX_END);
+    event->source = node;
+    event->phy_rate = sender->phy_rate;
+    event->power = sender->power;
+    event->length = packet->length;
+    memcpy(event->data, packet->data, packet->length);
+
+    sender->queue_head = (sender->queue_head + 1) % SIM_AIR_NODE_QUEUE;
+    sender->queue_count--;
+    sender->contending = false;
+    sender->transmitting = true;
+    sender->stats.airtime_us += airtime_us;
+
+    // Whatever is already on the air started too recently to be noticed
+    sender->collided = air->transmitting > 0;
+    for(uint8_t other = 0; other < air->config.node_count; other++)
+        if(air->nodes[other].transmitting && other != node)
+            air->nodes[other].collided = true;
+
+    if(air->transmitting++ == 0)
+        air->busy_start_us = air->now_us;
+    if(air->now_us + airtime_us > air->medium_free_us)
+        air->medium_free_us = air->now_us + airtime_us;
+
+    // Nodes further than a slot from the end of their backoff notice the
+    // transmission, and freeze the slots they have left
+    for(uint8_t other = 0; other < air->config.node_count; other++) {
+        sim_air_node_t *waiting = &air->nodes[other];
+        if(!waiting->contending || waiting->access_us == SIM_AIR_FROZEN
+            || waiting->access_us < air->busy_start_us + SIM_AIR_SLOT_US)
+            continue;
+
+        const int64_t countdown_us = waiting->access_us - waiting->backoff*SIM_AIR_SLOT_US;
+        const int64_t from_us = air->busy_start_us > countdown_us ? air->busy_start_us : countdown_us;
+        waiting->backoff = (waiting->access_us - from_us + SIM_AIR_SLOT_US - 1)/SIM_AIR_SLOT_US;
+        waiting->access_us = SIM_AIR_FROZEN;
+    }
+}
+
+//! \brief Start the transmissions of the nodes whose backoff ran out
+//!
+//! Nodes whose backoffs end within a slot of each other can't hear each
+//! other, so all of them go on the air. The event can also be stale, in
+//! which case nothing happens.
+static void access(sim_air_t *air)
+{
+    for(uint8_t node = 0; node < air->config.node_count; node++) {
+        const sim_air_node_t *sender = &air->nodes[node];
+        if(sender->contending && sender->access_us != SIM_AIR_FROZEN
+            && sender->access_us < air->now_us + SIM_AIR_SLOT_US)
+            transmission_start(air, node);
+    }
+}
+
+//! \brief A transmission ended, with contention: resume the frozen backoffs once the medium is idle
+static void access_transmission_end(sim_air_t *air, uint8_t node)
+{
+    sim_air_node_t *sender = &air->nodes[node];
+    sender->transmitting = false;
+
+    // One event was reserved for the next access after every transmission
+    int64_t next_us = SIM_AIR_FROZEN;
+    if(--air->transmitting == 0) {
+        air->idle_start_us = air->now_us;
+
+        for(uint8_t other = 0; other < air->config.node_count; other++) {
+            sim_air_node_t *waiting = &air->nodes[other];
+            if(!waiting->contending || waiting->access_us != SIM_AIR_FROZEN)
+                continue;
+
+            waiting->access_us = air->now_us + SIM_AIR_DIFS_US + waiting->backoff*SIM_AIR_SLOT_US;
+            if(waiting->access_us < next_us)
+                next_us = waiting->access_us;
+        }
+    }
+
+    if(next_us != SIM_AIR_FROZEN)
+        event_push(air, next_us, SIM_AIR_EVENT_ACCESS);
+    else
+        air->event_reserved--;
+
+    if(sender->queue_count > 0)
+        access_request(air, node);
+}
+
+bool sim_air_send(sim_air_t *air, uint8_t node, const uint8_t *data, uint16_t length)
+{
+    if(node >= air->config.node_count || length > SIM_AIR_MAX_PACKET)
+        return false;
+
+    sim_air_node_t *sender = &air->nodes[node];
+
+    // Reserve room for the transmission end, and a delivery to every other
+    // node. With contention, also for the node's access, and for the
+    // accesses of the others after the transmission.
+    const uint32_t events = air->config.node_count + (air->config.contention ? 2 : 0);
+    if(air->event_reserved + events > air->config.queue_size
+        || (air->config.contention && sender->queue_count == SIM_AIR_NODE_QUEUE)) {
+        sender->stats.tx_rejected++;
+        return false;
+    }
+
+    if(air->config.contention) {
+        sim_air_packet_t *packet = &sender->queue[(sender->queue_head + sender->queue_count) % SIM_AIR_NODE_QUEUE];
+        packet->length = length;
+        memcpy(packet->data, data, length);
+        sender->queue_count++;
+        air->event_reserved += events;
+        sender->stats.tx_packets++;
+
+        if(!sender->contending && !sender->transmitting)
+            access_request(air, node);
+        return true;
+    }
+
+    const int64_t start_us = air->medium_free_us > air->now_us ? air->medium_free_us : air->now_us;
+    const int64_t airtime_us = sim_air_airtime(air, node, length);
+    air->medium_free_us = start_us + airtime_us;
+    air->event_reserved += air->config.node_count;
+
+    sim_air_event_t *event = event_push(air, air->medium_free_us, SIM_AIR_EVENT_TX_END);
+    event->source = node;
+    event->phy_rate = sender->phy_rate;
+    event->power = sender->power;
+    event->length = length;
+    memcpy(event->data, data, length);
+
+    sender->stats.tx_packets++;
+    sender->stats.airtime_us += airtime_us;
+    return true;
+}
+
+int64_t sim_air_next_event(const sim_air_t *air)
+{
+    return air->event_count > 0 ? air->events[0].time_us : -1;
+}
+
+float sim_air_signal_loss(const sim_air_t *air, uint8_t phy_rate, int8_t power)
+{
+    if(air->config.snr_db == 0)
+        return 0;
+
+    const float snr_db = air->config.snr_db + (power - SIM_AIR_REFERENCE_POWER)/4.0f;
+    const float margin_db = snr_db - rate_lookup(phy_rate).snr_db;
+
+    return 1/(1 + expf(SIM_AIR_SNR_SLOPE*margin_db));
+}
+
+//! \brief Decide if a packet to a node is lost, and update its loss model
+static bool packet_lost(sim_air_t *air, sim_air_node_t *receiver, const sim_air_event_t *event)
+{
+    if(receiver->burst) {
+        if(random_float(air) < air->config.burst_exit)
+            receiver->burst = false;
+    }
+    else if(random_float(air) < air->config.burst_enter) {
+        receiver->burst = true;
+    }
+
+    const float loss = receiver->burst ? air->config.burst_loss : air->config.loss;
+    if(random_float(air) < loss)
+        return true;
+
+    return air->config.snr_db != 0 && random_float(air) < sim_air_signal_loss(air, event->phy_rate, event->power);
+}
+
+//! \brief The packet has left the sender, schedule its arrival at the other nodes
+static void transmission_end(sim_air_t *air, const sim_air_event_t *event)
+{
+    sim_air_node_t *sender = &air->nodes[event->source];
+    const bool collided = air->config.contention && sender->collided;
+    if(collided)
+        sender->stats.tx_collisions++;
+
+    for(uint8_t node = 0; node < air->config.node_count; node++) {
+        if(node == event->source)
+            continue;
+
+        // Out of range, the packet never reaches the node
+        const float link_loss = air->link_loss[event->source][node];
+        if(link_loss >= 1) {
+            air->event_reserved--;
+            continue;
+        }
+
+        sim_air_node_t *receiver = &air->nodes[node];
+        if(collided || packet_lost(air, receiver, event) || (link_loss > 0 && random_float(air) < link_loss)) {
+            receiver->stats.rx_lost++;
+            air->event_reserved--;
+            continue;
+        }
+
+        int64_t arrival_us = air->now_us + air->config.latency_us;
+        if(air->config.jitter_us > 0)
+            arrival_us += random_next(air) % air->config.jitter_us;
+
+        sim_air_event_t *delivery = event_push(air, arrival_us, SIM_AIR_EVENT_DELIVER);
+        delivery->source = event->source;
+        delivery->destination = node;
+        delivery->length = event->length;
+        memcpy(delivery->data, event->data, event->length);
+    }
+
+    if(air->config.contention)
+        access_transmission_end(air, event->source);
+
+    if(sender->send_cb != NULL)
+        sender->send_cb(sender->context);
+}
+
+uint32_t sim_air_run_until(sim_air_t *air, int64_t until_us)
+{
+    uint32_t processed = 0;
+    sim_air_event_t event;
+
+    while(air->event_count > 0 && air->events[0].time_us <= until_us) {
+        // Take a copy, as the callbacks can add events
+        event_pop(air, &event);
+        air->event_reserved--;
+        air->now_us = event.time_us;
+        processed++;
+
+        if(event.type == SIM_AIR_EVENT_TX_END) {
+            transmission_end(air, &event);
+            continue;
+        }
+
+        if(event.type == SIM_AIR_EVENT_ACCESS) {
+            access(air);
+            continue;
+        }
+
+        sim_air_node_t *receiver = &air->nodes[event.destination];
+        receiver->stats.rx_packets++;
+        if(receiver->recv_cb != NULL)
+            receiver->recv_cb(receiver->context, event.source, event.data, event.length);
+    }
+
+    if(until_us > air->now_us)
+        air->now_us = until_us;
+
+    return processed;
+}
@@ -0,0 +1,254 @@
+#pragma once
+
+//! Simulated broadcast medium
+//!
+//! Models a number of nodes sharing one WiFi channel, so that the
+//! transponder can be load tested without a bench of ESP32s. Transmissions
+//! are serialized on the medium and take airtime according to the PHY rate.
+//! Each one is delivered to every other node after a latency plus random
+//! jitter, unless it is lost. Loss uses a two state (Gilbert-Elliott) model
+//! for each receiving node, so both random and burst loss can be simulated.
+//! If a link SNR is set, faster PHY rates and lower TX power also lose more
+//! packets, so that rate control can be exercised.
+//!
+//! By default the medium is shared perfectly: transmissions queue up one
+//! after another, with the average channel access time added to each. With
+//! contention enabled, every node has its own transmit queue and gets the
+//! channel like an 802.11 station: it waits for the medium to be idle for
+//! DIFS and a random backoff, which is frozen while another node transmits.
+//! Nodes that start within the same slot time don't see each other, and
+//! their transmissions collide and are lost at every receiver, as broadcasts
+//! aren't acknowledged or retried.
+//!
+//! Links between nodes can be given a loss of their own, on top of the
+//! rest, or be out of range, to lay the nodes out in a topology. This only
+//! affects which nodes a packet reaches; every node still hears every other
+//! for channel access, so hidden nodes aren't modelled.
+//!
+//! Every node can also have a clock of its own, which runs fast or slow and
+//! starts at an offset, for testing code that follows another node's clock.
+//!
+//! The simulation is discrete-event, and doesn't use the system clock. Time
+//! only moves forward in sim_air_run_until(), so a run is reproducible for a
+//! given seed. It is not thread safe; callers that send from several threads
+//! need to hold a lock around every call.
+//!
+//! This is plain C, and is not built into the firmware.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! Maximum number of nodes on the medium
+#define SIM_AIR_MAX_NODES           16
+
+//! Maximum packet length, matches ESP_NOW_MAX_DATA_LEN
+#define SIM_AIR_MAX_PACKET          250
+
+//! TX power that sim_air_config_t::snr_db is given for, in 0.25 dBm units (20 dBm)
+#define SIM_AIR_REFERENCE_POWER     80
+
+//! Length of each node's transmit queue, with contention
+#define SIM_AIR_NODE_QUEUE          32
+
+//! \brief Called when a node receives a packet
+//!
+//! \param context Context pointer given to sim_air_attach()
+//! \param source Node that sent the packet
+//! \param data Pointer to the packet. Only valid during the call.
+//! \param length Length of the packet
+typedef void (*sim_air_recv_cb_t)(void *context, uint8_t source, const uint8_t *data, uint16_t length);
+
+//! \brief Called when a node's transmission has finished
+//!
+//! \param context Context pointer given to sim_air_attach()
+typedef void (*sim_air_send_cb_t)(void *context);
+
+typedef struct {
+    uint8_t node_count;             //!< Number of nodes, up to SIM_AIR_MAX_NODES
+    uint8_t phy_rate;               //!< Initial PHY rate of every node, using the wifi_phy_rate_t values
+    float snr_db;                   //!< Link SNR at SIM_AIR_REFERENCE_POWER, or 0 for loss that doesn't depend on the rate
+    float loss;                     //!< Probability of losing a packet, normally
+    float burst_loss;               //!< Probability of losing a packet, during a burst
+    float burst_enter;              //!< Probability of a burst starting, per packet
+    float burst_exit;               //!< Probability of a burst ending, per packet
+    uint32_t latency_us;            //!< Delay from the end of a transmission to reception
+    uint32_t jitter_us;             //!< Maximum random extra delay. Can reorder packets.
+    uint32_t queue_size;            //!< Maximum pending events (transmissions and deliveries)
+    bool contention;                //!< Model channel access and collisions, rather than a perfectly shared medium
+    uint32_t seed;                  //!< Random number seed, must be non-zero
+} sim_air_config_t;
+
+typedef struct {
+    uint64_t tx_packets;            //!< Packets sent
+    uint64_t tx_rejected;           //!< Sends refused because the event queue or transmit queue was full
+    uint64_t tx_collisions;         //!< Transmissions that overlapped another one, and were lost
+    uint64_t rx_packets;            //!< Packets received
+    uint64_t rx_lost;               //!< Packets lost on the way to this node
+    int64_t airtime_us;             //!< Total airtime used by this node's transmissions
+} sim_air_node_stats_t;
+
+typedef struct {
+    int64_t time_us;                //!< Time the event happens
+    uint32_t order;                 //!< Keeps events at the same time in the order they were added
+    uint8_t type;                   //!< Transmission end or delivery
+    uint8_t source;                 //!< Node that sent the packet
+    uint8_t destination;            //!< Receiving node, for deliveries
+    uint8_t phy_rate;               //!< PHY rate the packet was sent at
+    int8_t power;                   //!< TX power the packet was sent at
+    uint16_t length;                //!< Packet length
+    uint8_t data[SIM_AIR_MAX_PACKET];
+} sim_air_event_t;
+
+//! Packet waiting in a node's transmit queue
+typedef struct {
+    uint16_t length;
+    uint8_t data[SIM_AIR_MAX_PACKET];
+} sim_air_packet_t;
+
+typedef struct {
+    sim_air_recv_cb_t recv_cb;
+    sim_air_send_cb_t send_cb;
+    void *context;
+    bool burst;                     //!< Loss model state for packets to this node
+    uint8_t phy_rate;               //!< PHY rate this node sends at
+    int8_t power;                   //!< TX power this node sends at
+    sim_air_packet_t *queue;        //!< Transmit queue, with contention
+    uint16_t queue_head;            //!< Oldest packet in the queue
+    uint16_t queue_count;           //!< Packets in the queue, not counting one being transmitted
+    bool contending;                //!< Waiting for the channel, to send the oldest queued packet
+    bool transmitting;              //!< A transmission from this node is on the air
+    bool collided;                  //!< The current transmission overlapped another
+    uint16_t backoff;               //!< Backoff slots left
+    int64_t access_us;              //!< When the backoff runs out, or INT64_MAX while it is frozen
+    double clock_rate;              //!< Node clock ticks per simulation microsecond
+    int64_t clock_offset_us;        //!< Node clock at simulation time 0
+    sim_air_node_stats_t stats;
+} sim_air_node_t;
+
+typedef struct {
+    sim_air_config_t config;
+    sim_air_node_t nodes[SIM_AIR_MAX_NODES];
+    sim_air_event_t *events;        //!< Pending events, as a binary min-heap
+    uint32_t event_count;
+    uint32_t event_reserved;        //!< Events pending, plus deliveries still to be scheduled
+    uint32_t event_order;
+    int64_t now_us;                 //!< Current simulation time
+    int64_t medium_free_us;         //!< Time the current transmission ends
+    uint8_t transmitting;           //!< Transmissions on the air, with contention
+    int64_t busy_start_us;          //!< Start of the first of them
+    int64_t idle_start_us;          //!< Time the medium last became idle
+    sim_air_packet_t *packets;      //!< Storage for the transmit queues
+    float link_loss[SIM_AIR_MAX_NODES][SIM_AIR_MAX_NODES]; //!< Extra loss from each node to each other, 1 if out of range
+    uint32_t rng;
+} sim_air_t;
+
+//! \brief Initialize a simulated medium
+//!
+//! \param air Medium to initialize
+//! \param config Medium parameters
+//! \return True if successful
+bool sim_air_init(sim_air_t *air, const sim_air_config_t *config);
+
+//! \brief Free the memory used by a medium
+void sim_air_free(sim_air_t *air);
+
+//! \brief Set the callbacks for a node
+//!
+//! \param air Medium
+//! \param node Node number
+//! \param recv_cb Called when the node receives a packet, or NULL
+//! \param send_cb Called when a transmission from the node ends, or NULL
+//! \param context Passed to the callbacks
+void sim_air_attach(sim_air_t *air, uint8_t node, sim_air_recv_cb_t recv_cb, sim_air_send_cb_t send_cb,
+                    void *context);
+
+//! \brief Broadcast a packet from a node
+//!
+//! Without contention, the transmission starts at the current time, or when
+//! the medium becomes free. With it, the packet joins the node's transmit
+//! queue. This can be called from the callbacks.
+//!
+//! \param air Medium
+//! \param node Sending node
+//! \param data Pointer to the packet
+//! \param length Length of the packet, up to SIM_AIR_MAX_PACKET
+//! \return True if the packet was accepted
+bool sim_air_send(sim_air_t *air, uint8_t node, const uint8_t *data, uint16_t length);
+
+//! \brief Change the PHY rate and TX power a node sends at
+//!
+//! \param air Medium
+//! \param node Node number
+//! \param phy_rate PHY rate, using the wifi_phy_rate_t values
+//! \param power TX power, in 0.25 dBm units
+void sim_air_set_phy(sim_air_t *air, uint8_t node, uint8_t phy_rate, int8_t power);
+
+//! \brief Set the loss of the link between two nodes
+//!
+//! Links start with no loss of their own. Packets between nodes that are
+//! out of range aren't counted as lost.
+//!
+//! \param air Medium
+//! \param a One node
+//! \param b The other node
+//! \param loss Probability of losing a packet on the link, in both directions, or 1 if out of range
+void sim_air_set_link(sim_air_t *air, uint8_t a, uint8_t b, float loss);
+
+//! \brief Give a node a clock of its own
+//!
+//! Nodes start with a clock that matches the simulation time.
+//!
+//! \param air Medium
+//! \param node Node number
+//! \param ppm How fast the clock runs, in parts per million
+//! \param offset_us Clock at simulation time 0
+void sim_air_set_clock(sim_air_t *air, uint8_t node, float ppm, int64_t offset_us);
+
+//! \brief Read a node's clock
+//!
+//! \param air Medium
+//! \param node Node number
+//! \param time_us Simulation time
+//! \return Node clock at that time
+int64_t sim_air_node_time(const sim_air_t *air, uint8_t node, int64_t time_us);
+
+//! \brief Find when a node's clock reads a time
+//!
+//! \param air Medium
+//! \param node Node number
+//! \param node_us Node clock
+//! \return Simulation time, rounded up
+int64_t sim_air_sim_time(const sim_air_t *air, uint8_t node, int64_t node_us);
+
+//! \brief Time it takes a node to send a packet, including channel access
+//!
+//! \param air Medium
+//! \param node Sending node
+//! \param length Packet length
+//! \return Airtime, in microseconds
+int64_t sim_air_airtime(const sim_air_t *air, uint8_t node, uint16_t length);
+
+//! \brief Chance that a packet from a node is lost for a weak signal
+//!
+//! This comes on top of the configured random and burst loss.
+//!
+//! \param air Medium
+//! \param phy_rate PHY rate the packet is sent at
+//! \param power TX power it is sent at
+//! \return Loss probability, 0 if no link SNR is configured
+float sim_air_signal_loss(const sim_air_t *air, uint8_t phy_rate, int8_t power);
+
+//! \brief Get the time of the next pending event
+//!
+//! \return Event time, or -1 if nothing is pending
+int64_t sim_air_next_event(const sim_air_t *air);
+
+//! \brief Run the simulation up to a time
+//!
+//! Processes every event up to and including until_us, calling the node
+//! callbacks, then sets the current time to until_us.
+//!
+//! \param air Medium
+//! \param until_us Time to run to
+//! \return Number of events processed
+uint32_t sim_air_run_until(sim_air_t *air, int64_t until_us);
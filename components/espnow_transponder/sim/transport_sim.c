@@ -0,0 +1,107 @@
+#include <stddef.h>
+
+#include "transport_sim.h"
+
+//! Medium the transponder is attached to
+static sim_air_t *sim_air = NULL;
+
+//! Node number of the transponder
+static uint8_t sim_node = 0;
+
+static espnow_transponder_transport_recv_cb_t recv_callback = NULL;
+static espnow_transponder_transport_send_cb_t send_callback = NULL;
+
+//! Lock held around calls into the medium, if set
+static transport_sim_lock_t lock_function = NULL;
+static transport_sim_lock_t unlock_function = NULL;
+static void *lock_context = NULL;
+
+//! Broadcast address, reported as the destination of every send
+static const uint8_t broadcast_mac[6] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+void transport_sim_bind(sim_air_t *air, uint8_t node)
+{
+    sim_air = air;
+    sim_node = node;
+}
+
+void transport_sim_set_lock(transport_sim_lock_t lock, transport_sim_lock_t unlock, void *context)
+{
+    lock_function = lock;
+    unlock_function = unlock;
+    lock_context = context;
+}
+
+static void transport_sim_lock()
+{
+    if(lock_function != NULL)
+        lock_function(lock_context);
+}
+
+static void transport_sim_unlock()
+{
+    if(unlock_function != NULL)
+        unlock_function(lock_context);
+}
+
+static void transport_sim_recv(void *context, uint8_t source, const uint8_t *data, uint16_t length)
+{
+    // Locally administered address, with the node number in the last byte
+    const uint8_t mac_addr[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, source };
+
+    if(recv_callback != NULL)
+        recv_callback(mac_addr, data, length);
+}
+
+static void transport_sim_sent(void *context)
+{
+    if(send_callback != NULL)
+        send_callback(broadcast_mac, true);
+}
+
+static esp_err_t transport_sim_init(const espnow_transponder_config_t *config)
+{
+    if(sim_air == NULL || sim_node >= sim_air->config.node_count)
+        return ESP_ERR_INVALID_STATE;
+
+    transport_sim_lock();
+    sim_air_attach(sim_air, sim_node, transport_sim_recv, transport_sim_sent, NULL);
+    transport_sim_unlock();
+    return ESP_OK;
+}
+
+static esp_err_t transport_sim_register_callbacks(espnow_transponder_transport_recv_cb_t recv_cb,
+                                                  espnow_transponder_transport_send_cb_t send_cb)
+{
+    recv_callback = recv_cb;
+    send_callback = send_cb;
+    return ESP_OK;
+}
+
+static esp_err_t transport_sim_send(const uint8_t *data, uint16_t length)
+{
+    if(length > SIM_AIR_MAX_PACKET)
+        return ESP_ERR_INVALID_SIZE;
+
+    transport_sim_lock();
+    const bool sent = sim_air_send(sim_air, sim_node, data, length);
+    transport_sim_unlock();
+
+    return sent ? ESP_OK : ESP_ERR_NO_MEM;
+}
+
+static esp_err_t transport_sim_set_phy(wifi_phy_rate_t phy_rate, int8_t power)
+{
+    transport_sim_lock();
+    sim_air_set_phy(sim_air, sim_node, phy_rate, power);
+    transport_sim_unlock();
+    return ESP_OK;
+}
+
+const espnow_transponder_transport_t espnow_transponder_transport_sim = {
+    .name = "sim",
+    .init = transport_sim_init,
+    .register_callbacks = transport_sim_register_callbacks,
+    .send = transport_sim_send,
+    .set_phy = transport_sim_set_phy,
+};
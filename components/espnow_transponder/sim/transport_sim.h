@@ -0,0 +1,40 @@
+#pragma once
+
+//! Transponder transport backed by a simulated medium
+//!
+//! Lets the transponder run on a host, with its packets going through a
+//! sim_air_t node instead of ESP-NOW. The host is responsible for driving
+//! the medium with sim_air_run_until(). If the transponder tasks run in
+//! other threads, it also has to hold a lock around that, and give the same
+//! lock to transport_sim_set_lock() so that sends take it too.
+
+#include "espnow_transponder_transport.h"
+#include "sim_air.h"
+
+//! \brief Select the medium and node used by espnow_transponder_transport_sim
+//!
+//! Call this before espnow_transponder_init().
+//!
+//! \param air Simulated medium
+//! \param node Node number of this transponder
+void transport_sim_bind(sim_air_t *air, uint8_t node);
+
+//! \brief Lock function prototype, see transport_sim_set_lock()
+//!
+//! \param context Context pointer given to transport_sim_set_lock()
+typedef void (*transport_sim_lock_t)(void *context);
+
+//! \brief Serialize the transport's calls into the medium with the host's
+//!
+//! The transport calls lock before, and unlock after, each call it makes
+//! into the medium from the transponder tasks. The node callbacks are
+//! called with the host's lock held, and never send, so the lock doesn't
+//! need to be recursive.
+//!
+//! \param lock Called before using the medium, or NULL for no locking
+//! \param unlock Called after using the medium
+//! \param context Passed to lock and unlock
+void transport_sim_set_lock(transport_sim_lock_t lock, transport_sim_lock_t unlock, void *context);
+
+//! Simulated medium transport
+extern const espnow_transponder_transport_t espnow_transponder_transport_sim;
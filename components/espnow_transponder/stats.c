@@ -0,0 +1,89 @@
+#include <string.h>
+
+#include "stats.h"
+
+// Attempts a reader makes before it gives up
+#define STATS_READ_ATTEMPTS 8
+
+#define STATS_COUNTERS (sizeof(espnow_transponder_stats_t)/sizeof(uint64_t))
+
+_Static_assert(sizeof(espnow_transponder_stats_t) % sizeof(uint64_t) == 0,
+               "espnow_transponder_stats_t must only hold uint64_t counters");
+
+bool stats_block_read(const stats_block_t *block, espnow_transponder_stats_t *counters) {
+    for(int attempt = 0; attempt < STATS_READ_ATTEMPTS; attempt++) {
+        const unsigned int before = atomic_load_explicit(&block->sequence, memory_order_acquire);
+        if(before & 1)
+            continue;
+
+        memcpy(counters, &block->counters, sizeof(*counters));
+
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&block->sequence, memory_order_relaxed) == before)
+            return true;
+    }
+
+    return false;
+}
+
+void stats_sum(espnow_transponder_stats_t *total, const espnow_transponder_stats_t *counters) {
+    uint64_t *total_fields = (uint64_t *)total;
+    const uint64_t *fields = (const uint64_t *)counters;
+
+    for(int field = 0; field < STATS_COUNTERS; field++)
+        total_fields[field] += fields[field];
+}
+
+void stats_rates(espnow_transponder_stats_t *rates, const espnow_transponder_stats_t *current,
+                 const espnow_transponder_stats_t *previous, int64_t elapsed_us) {
+    uint64_t *rate_fields = (uint64_t *)rates;
+    const uint64_t *current_fields = (const uint64_t *)current;
+    const uint64_t *previous_fields = (const uint64_t *)previous;
+
+    for(int field = 0; field < STATS_COUNTERS; field++) {
+        const uint64_t count = current_fields[field] - previous_fields[field];
+        rate_fields[field] = elapsed_us > 0 ? (count*1000000 + elapsed_us/2)/elapsed_us : 0;
+    }
+}
+
+//! \brief Append an unsigned LEB128 varint
+//!
+//! \return Position after the varint, or NULL if it didn't fit
+static uint8_t *put_varint(uint8_t *position, const uint8_t *end, uint64_t value)
+{
+    do {
+        if(position >= end)
+            return NULL;
+
+        *position = value & 0x7F;
+        value >>= 7;
+        if(value != 0)
+            *position |= 0x80;
+        position++;
+    } while(value != 0);
+
+    return position;
+}
+
+int stats_export(const espnow_transponder_snapshot_t *snapshot, uint8_t *buffer, size_t length) {
+    if(length < 4)
+        return -1;
+
+    const uint8_t *end = buffer + length;
+    buffer[0] = STATS_EXPORT_MAGIC_0;
+    buffer[1] = STATS_EXPORT_MAGIC_1;
+    buffer[2] = STATS_EXPORT_VERSION;
+    buffer[3] = STATS_COUNTERS;
+
+    uint8_t *position = put_varint(buffer + 4, end, snapshot->time_us > 0 ? snapshot->time_us : 0);
+
+    const uint64_t *totals = (const uint64_t *)&snapshot->totals;
+    for(int field = 0; field < STATS_COUNTERS && position != NULL; field++)
+        position = put_varint(position, end, totals[field]);
+
+    const uint64_t *rates = (const uint64_t *)&snapshot->per_second;
+    for(int field = 0; field < STATS_COUNTERS && position != NULL; field++)
+        position = put_varint(position, end, rates[field]);
+
+    return position != NULL ? position - buffer : -1;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+//! Transponder statistics with consistent, lock-free snapshots
+//!
+//! The counters are updated from several contexts at once: the WiFi task,
+//! the transponder task, the transmit scheduler and the task that sends.
+//! Each context writes only to its own block, so writers never contend, and
+//! every block is guarded by a sequence lock. The writer makes the sequence
+//! odd while it updates the block, and even again afterwards. A reader
+//! copies the block, and tries again if the sequence was odd or changed
+//! during the copy. On a 32-bit core a 64-bit counter takes two stores, so
+//! without this a reader could see half of an update.
+//!
+//! Writers never wait. A reader can keep failing if the writer was
+//! preempted in the middle of an update, so stats_block_read() gives up
+//! after a few attempts and lets the caller decide how to wait.
+//!
+//! This contains no RTOS calls.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#include "espnow_transponder.h"
+
+//! Export format identifier, the first two bytes of an export
+#define STATS_EXPORT_MAGIC_0 'T'
+#define STATS_EXPORT_MAGIC_1 'S'
+
+//! Export format version
+#define STATS_EXPORT_VERSION 1
+
+//! Counters written by one context
+typedef struct {
+    atomic_uint sequence;               //!< Odd while the counters are being updated
+    espnow_transponder_stats_t counters;
+} stats_block_t;
+
+//! \brief Start updating a block
+//!
+//! Only the context that owns the block may call this.
+static inline void stats_write_begin(stats_block_t *block)
+{
+    const unsigned int sequence = atomic_load_explicit(&block->sequence, memory_order_relaxed);
+    atomic_store_explicit(&block->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+//! \brief Finish updating a block
+static inline void stats_write_end(stats_block_t *block)
+{
+    const unsigned int sequence = atomic_load_explicit(&block->sequence, memory_order_relaxed);
+    atomic_store_explicit(&block->sequence, sequence + 1, memory_order_release);
+}
+
+//! Add to a counter in a block
+#define STATS_ADD(block, field, amount) \
+    do { \
+        stats_write_begin(block); \
+        (block)->counters.field += (amount); \
+        stats_write_end(block); \
+    } while(0)
+
+//! Set a counter in a block, for counters kept elsewhere
+#define STATS_SET(block, field, value) \
+    do { \
+        stats_write_begin(block); \
+        (block)->counters.field = (value); \
+        stats_write_end(block); \
+    } while(0)
+
+//! \brief Copy the counters of a block
+//!
+//! \param block Block to read
+//! \param counters Set to the counters, if successful
+//! \return False if every attempt raced with an update
+bool stats_block_read(const stats_block_t *block, espnow_transponder_stats_t *counters);
+
+//! \brief Add one set of counters to another
+void stats_sum(espnow_transponder_stats_t *total, const espnow_transponder_stats_t *counters);
+
+//! \brief Compute the rate of every counter
+//!
+//! \param rates Set to the counts per second
+//! \param current Counters at the end of the window
+//! \param previous Counters at the start of the window
+//! \param elapsed_us Length of the window, in microseconds
+void stats_rates(espnow_transponder_stats_t *rates, const espnow_transponder_stats_t *current,
+                 const espnow_transponder_stats_t *previous, int64_t elapsed_us);
+
+//! \brief Encode a snapshot in the binary export format
+//!
+//! \param snapshot Snapshot to encode
+//! \param buffer Buffer to write to
+//! \param length Size of the buffer
+//! \return Length of the export, or -1 if the buffer is too small
+int stats_export(const espnow_transponder_snapshot_t *snapshot, uint8_t *buffer, size_t length);
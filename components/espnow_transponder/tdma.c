@@ -0,0 +1,239 @@
+#include <string.h>
+
+#include "tdma.h"
+
+// A sender without a slot asks after one in this many beacons, at random
+#define TDMA_REQUEST_BEACONS        4
+
+// A sender with a slot asks to keep it on every this many beacons
+#define TDMA_REFRESH_BEACONS        16
+
+// The master frees a slot after this many beacons without a request for it
+#define TDMA_EXPIRE_BEACONS         (4*TDMA_REFRESH_BEACONS)
+
+// A sender that misses this many beacons in a row sends freely again
+#define TDMA_LOST_BEACONS           8
+
+// Attempts to read the schedule while a beacon is being handled
+#define TDMA_READ_ATTEMPTS          4
+
+// Bytes added to every ESP-NOW payload on the air: 802.11 header, action
+// frame and vendor specific element headers, and FCS
+#define TDMA_FRAME_OVERHEAD         43
+
+// Average time to get access to the medium, DIFS plus half of the minimum
+// contention window
+#define TDMA_ACCESS_US              (28 + (15*9)/2)
+
+void tdma_master_init(tdma_master_t *master, uint32_t frame_us, uint16_t beacon_us, uint16_t guard_us)
+{
+    memset(master, 0, sizeof(*master));
+    master->frame_us = frame_us;
+    master->beacon_us = beacon_us;
+    master->guard_us = guard_us;
+}
+
+bool tdma_master_request(tdma_master_t *master, uint32_t id)
+{
+    if(id == 0)
+        return false;
+
+    int free_slot = -1;
+    for(int slot = 0; slot < TDMA_MAX_SLOTS; slot++) {
+        if(master->slots[slot] == id) {
+            master->idle[slot] = 0;
+            return true;
+        }
+
+        if(master->slots[slot] == 0 && free_slot < 0)
+            free_slot = slot;
+    }
+
+    if(free_slot < 0)
+        return false;
+
+    master->slots[free_slot] = id;
+    master->idle[free_slot] = 0;
+    if(free_slot >= master->slot_count)
+        master->slot_count = free_slot + 1;
+
+    return true;
+}
+
+uint16_t tdma_master_beacon(tdma_master_t *master, uint32_t now_us, uint32_t frame_start_us, tdma_beacon_t *beacon)
+{
+    // Free the slots of senders that went away. The slots of the others stay
+    // where they are, so only the slot length changes for them.
+    uint8_t slot_count = 0;
+    for(int slot = 0; slot < master->slot_count; slot++) {
+        if(master->slots[slot] != 0 && ++master->idle[slot] > TDMA_EXPIRE_BEACONS)
+            master->slots[slot] = 0;
+
+        if(master->slots[slot] != 0)
+            slot_count = slot + 1;
+    }
+    master->slot_count = slot_count;
+
+    uint32_t slot_us = master->frame_us > master->beacon_us ? master->frame_us - master->beacon_us : 0;
+    if(slot_count > 0)
+        slot_us /= slot_count;
+
+    beacon->type = CONTROL_BEACON;
+    beacon->sequence = master->sequence++;
+    beacon->time_us = now_us;
+    beacon->frame_start_us = frame_start_us;
+    beacon->frame_us = master->frame_us;
+    beacon->beacon_us = master->beacon_us;
+    beacon->slot_us = slot_us > UINT16_MAX ? UINT16_MAX : slot_us;
+    beacon->guard_us = master->guard_us;
+    beacon->slot_count = slot_count;
+    memcpy(beacon->slots, master->slots, slot_count*sizeof(master->slots[0]));
+
+    return TDMA_BEACON_LENGTH(slot_count);
+}
+
+void tdma_sender_init(tdma_sender_t *sender, uint32_t id)
+{
+    memset(sender, 0, sizeof(*sender));
+    sender->id = id;
+    sender->random = id;
+    atomic_init(&sender->refresh, false);
+    clock_sync_init(&sender->clock);
+    sender->schedule.slot = -1;
+}
+
+bool tdma_sender_beacon(tdma_sender_t *sender, const tdma_beacon_t *beacon, uint16_t length, int64_t local_us)
+{
+    if(length < TDMA_BEACON_LENGTH(0) || beacon->slot_count > TDMA_MAX_SLOTS
+        || length < TDMA_BEACON_LENGTH(beacon->slot_count) || beacon->frame_us == 0)
+        return false;
+
+    int8_t slot = -1;
+    for(int index = 0; index < beacon->slot_count; index++)
+        if(beacon->slots[index] == sender->id)
+            slot = index;
+
+    const unsigned int sequence = atomic_load_explicit(&sender->sequence, memory_order_relaxed);
+    atomic_store_explicit(&sender->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    clock_sync_sample(&sender->clock, local_us, beacon->time_us);
+    sender->schedule.frame_start_us = clock_sync_unwrap(&sender->clock, local_us, beacon->frame_start_us);
+    sender->schedule.frame_us = beacon->frame_us;
+    sender->schedule.beacon_us = beacon->beacon_us;
+    sender->schedule.slot_us = beacon->slot_us;
+    sender->schedule.guard_us = beacon->guard_us;
+    sender->schedule.slot_count = beacon->slot_count;
+    sender->schedule.slot = slot;
+    sender->last_beacon_us = local_us;
+    sender->beacons++;
+
+    atomic_store_explicit(&sender->sequence, sequence + 2, memory_order_release);
+
+    // Refreshes go out in the slot, so they can't collide; stagger them
+    // anyway, so that the master doesn't get all of them in one frame
+    if(slot >= 0) {
+        if((uint8_t)(beacon->sequence + sender->id) % TDMA_REFRESH_BEACONS == 0)
+            atomic_store_explicit(&sender->refresh, true, memory_order_relaxed);
+        return false;
+    }
+
+    // xorshift32
+    uint32_t x = sender->random;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sender->random = x;
+
+    return x % TDMA_REQUEST_BEACONS == 0;
+}
+
+bool tdma_sender_take_refresh(tdma_sender_t *sender)
+{
+    return atomic_load_explicit(&sender->refresh, memory_order_relaxed)
+        && atomic_exchange_explicit(&sender->refresh, false, memory_order_relaxed);
+}
+
+bool tdma_sender_schedule(tdma_sender_t *sender, int64_t local_us, tdma_schedule_t *schedule, clock_sync_t *clock)
+{
+    for(int attempt = 0; attempt < TDMA_READ_ATTEMPTS; attempt++) {
+        const unsigned int before = atomic_load_explicit(&sender->sequence, memory_order_acquire);
+        if(before & 1)
+            continue;
+
+        *schedule = sender->schedule;
+        if(clock != NULL)
+            *clock = sender->clock;
+        const bool valid = sender->clock.valid;
+        const int64_t last_beacon_us = sender->last_beacon_us;
+
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&sender->sequence, memory_order_relaxed) != before)
+            continue;
+
+        return valid && schedule->slot >= 0
+            && local_us - last_beacon_us <= (int64_t)TDMA_LOST_BEACONS*schedule->frame_us;
+    }
+
+    // A beacon is being handled; the caller can just try again later
+    schedule->slot = -1;
+    return false;
+}
+
+int64_t tdma_sender_delay(tdma_sender_t *sender, int64_t local_us, uint32_t airtime_us)
+{
+    tdma_schedule_t schedule;
+    clock_sync_t clock;
+    if(!tdma_sender_schedule(sender, local_us, &schedule, &clock))
+        return -1;
+
+    const int64_t master_us = clock_sync_remote(&clock, local_us);
+    int64_t phase_us = (master_us - schedule.frame_start_us) % schedule.frame_us;
+    if(phase_us < 0)
+        phase_us += schedule.frame_us;
+
+    // A packet may start as long as it is done by the guard time. One that
+    // is too long for the slot still goes out, at the start of it.
+    const int64_t start_us = schedule.beacon_us + (int64_t)schedule.slot*schedule.slot_us;
+    int64_t last_us = start_us + schedule.slot_us - schedule.guard_us - airtime_us;
+    if(last_us < start_us)
+        last_us = start_us;
+
+    if(phase_us >= start_us && phase_us <= last_us)
+        return 0;
+
+    int64_t wait_us = start_us - phase_us;
+    if(wait_us <= 0)
+        wait_us += schedule.frame_us;
+
+    return clock_sync_local(&clock, master_us + wait_us) - local_us;
+}
+
+uint32_t tdma_airtime_us(uint8_t phy_rate, uint16_t length)
+{
+    // Data rates in kbit/s, in wifi_phy_rate_t order
+    static const uint32_t dsss_kbps[] = { 1000, 2000, 5500, 11000, 0, 2000, 5500, 11000 };
+    static const uint32_t ofdm_kbps[] = { 48000, 24000, 12000, 6000, 54000, 36000, 18000, 9000 };
+    static const uint32_t mcs_kbps[] = {
+        6500, 13000, 19500, 26000, 39000, 52000, 58500, 65000,
+        7200, 14400, 21700, 28900, 43300, 57800, 65000, 72200,
+    };
+
+    uint32_t kbps = 1000;
+    uint32_t preamble_us = 192;
+    if(phy_rate < 0x08 && dsss_kbps[phy_rate] != 0) {
+        kbps = dsss_kbps[phy_rate];
+        preamble_us = phy_rate < 0x04 ? 192 : 96;
+    }
+    else if(phy_rate >= 0x08 && phy_rate < 0x10) {
+        kbps = ofdm_kbps[phy_rate - 0x08];
+        preamble_us = 20;
+    }
+    else if(phy_rate >= 0x10 && phy_rate < 0x20) {
+        kbps = mcs_kbps[phy_rate - 0x10];
+        preamble_us = 36;
+    }
+
+    const uint32_t bits = (TDMA_FRAME_OVERHEAD + length)*8;
+    return TDMA_ACCESS_US + preamble_us + (bits*1000 + kbps - 1)/kbps;
+}
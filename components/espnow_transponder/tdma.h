@@ -0,0 +1,171 @@
+#pragma once
+
+//! Time-division schedule for several senders sharing one channel
+//!
+//! Uncoordinated broadcast senders collide, and without acknowledgements a
+//! collision loses the packet at every receiver. The more senders share a
+//! channel, the more of their bursts overlap, so loss climbs much faster
+//! than the load.
+//!
+//! In TDMA mode one node is the master. At the start of every TDMA frame it
+//! broadcasts a beacon, which carries its clock and the slot table: the
+//! frame starts with a beacon slot, followed by one equal slot for each
+//! sender. Senders follow the master's clock with a clock_sync_t, and only
+//! start a packet if it will be finished a guard time before the end of
+//! their slot. Until a sender has a slot, or if it stops hearing beacons,
+//! it sends freely.
+//!
+//! A sender without a slot asks the master for one with a slot request,
+//! sent right after a beacon. As every sender hears the beacon at the same
+//! time, each only asks after a random one in TDMA_REQUEST_BEACONS, so that
+//! their requests don't keep colliding. A sender with a slot repeats the
+//! request now and then to keep it, from within its slot, together with its
+//! data; the master frees the slots of senders that stop asking, so a
+//! sender that has nothing to send gives its slot up.
+//!
+//! This contains no RTOS calls; the caller supplies the time.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "control.h"
+#include "clock_sync.h"
+
+//! Most sender slots in a frame
+#define TDMA_MAX_SLOTS              16
+
+//! Broadcast by the master at the start of every frame
+typedef struct {
+    uint8_t type;                       //!< CONTROL_BEACON
+    uint8_t sequence;                   //!< Beacon number, wraps
+    uint32_t time_us;                   //!< Master clock when the beacon was sent
+    uint32_t frame_start_us;            //!< Master clock at the start of this frame
+    uint32_t frame_us;                  //!< Frame period
+    uint16_t beacon_us;                 //!< Length of the beacon slot, at the start of the frame
+    uint16_t slot_us;                   //!< Length of each sender slot
+    uint16_t guard_us;                  //!< Time at the end of each slot in which nothing may be on the air
+    uint8_t slot_count;                 //!< Number of sender slots
+    uint32_t slots[TDMA_MAX_SLOTS];     //!< Id of the sender in each slot, 0 if free. Only slot_count are sent.
+} __attribute__((packed)) tdma_beacon_t;
+
+//! Length of a beacon with a number of slots
+#define TDMA_BEACON_LENGTH(slot_count) (offsetof(tdma_beacon_t, slots) + (slot_count)*sizeof(uint32_t))
+
+//! Sent by a sender to get a slot, or to keep the one it has
+typedef struct {
+    uint8_t type;                       //!< CONTROL_SLOT_REQUEST
+    uint32_t id;                        //!< Id of the sender
+} __attribute__((packed)) tdma_slot_request_t;
+
+//! Master side, keeps the slot table
+typedef struct {
+    uint32_t frame_us;                  //!< Frame period
+    uint16_t beacon_us;                 //!< Length of the beacon slot
+    uint16_t guard_us;                  //!< Guard time at the end of each slot
+    uint8_t sequence;                   //!< Number of the next beacon
+    uint8_t slot_count;                 //!< Slots in use, up to the last one assigned
+    uint32_t slots[TDMA_MAX_SLOTS];     //!< Id of the sender in each slot, 0 if free
+    uint8_t idle[TDMA_MAX_SLOTS];       //!< Beacons since each slot's sender last asked for it
+} tdma_master_t;
+
+//! Slot schedule, as a sender sees it
+typedef struct {
+    int64_t frame_start_us;             //!< Start of a frame, in master time
+    uint32_t frame_us;                  //!< Frame period
+    uint16_t beacon_us;                 //!< Length of the beacon slot
+    uint16_t slot_us;                   //!< Length of each sender slot
+    uint16_t guard_us;                  //!< Guard time at the end of each slot
+    uint8_t slot_count;                 //!< Number of sender slots
+    int8_t slot;                        //!< Slot of this sender, or -1 if it has none
+} tdma_schedule_t;
+
+//! Sender side, follows the master's clock and schedule
+//!
+//! One context feeds in the beacons, and any other can read the schedule;
+//! the shared state is guarded by a sequence lock, like the statistics.
+typedef struct {
+    uint32_t id;                        //!< Id of this sender, not 0
+    uint32_t random;                    //!< Random number state, for spreading requests
+    atomic_bool refresh;                //!< True if the slot should be asked for again
+    atomic_uint sequence;               //!< Odd while the state below is being updated
+    clock_sync_t clock;                 //!< Estimate of the master's clock
+    tdma_schedule_t schedule;
+    int64_t last_beacon_us;             //!< Local time of the last beacon
+    uint32_t beacons;                   //!< Beacons received
+} tdma_sender_t;
+
+//! \brief Initialize a master
+//!
+//! \param master Master to initialize
+//! \param frame_us Frame period
+//! \param beacon_us Length of the beacon slot
+//! \param guard_us Guard time at the end of each slot
+void tdma_master_init(tdma_master_t *master, uint32_t frame_us, uint16_t beacon_us, uint16_t guard_us);
+
+//! \brief Handle a slot request
+//!
+//! \param master Master
+//! \param id Id of the sender
+//! \return False if every slot is taken
+bool tdma_master_request(tdma_master_t *master, uint32_t id);
+
+//! \brief Build the beacon for a new frame
+//!
+//! Slots that weren't asked for in a while are freed first.
+//!
+//! \param master Master
+//! \param now_us Master clock
+//! \param frame_start_us Master clock at the start of the frame
+//! \param beacon Set to the beacon
+//! \return Length of the beacon
+uint16_t tdma_master_beacon(tdma_master_t *master, uint32_t now_us, uint32_t frame_start_us, tdma_beacon_t *beacon);
+
+//! \brief Initialize a sender
+//!
+//! \param sender Sender to initialize
+//! \param id Id of the sender, unique on the channel and not 0
+void tdma_sender_init(tdma_sender_t *sender, uint32_t id);
+
+//! \brief Handle a beacon
+//!
+//! \param sender Sender
+//! \param beacon Received beacon
+//! \param length Length of the beacon
+//! \param local_us Local time the beacon arrived
+//! \return True if the sender has no slot, and should send a slot request now
+bool tdma_sender_beacon(tdma_sender_t *sender, const tdma_beacon_t *beacon, uint16_t length, int64_t local_us);
+
+//! \brief Check if a slot request should be sent along with the next packet, to keep the slot
+//!
+//! This clears the request, so call it just before sending in the slot.
+//!
+//! \param sender Sender
+//! \return True if a slot request should be sent
+bool tdma_sender_take_refresh(tdma_sender_t *sender);
+
+//! \brief Get a copy of the schedule and clock estimate
+//!
+//! \param sender Sender
+//! \param local_us Local time
+//! \param schedule Set to the schedule
+//! \param clock Set to the clock estimate, if not NULL
+//! \return True if the sender has a slot and is hearing beacons
+bool tdma_sender_schedule(tdma_sender_t *sender, int64_t local_us, tdma_schedule_t *schedule, clock_sync_t *clock);
+
+//! \brief Determine how long to wait before a packet may be sent
+//!
+//! \param sender Sender
+//! \param local_us Local time
+//! \param airtime_us Time the packet, and any sent before it that are still queued, will take on the air
+//! \return 0 if it can be sent now, the time to wait until the sender's next slot starts, or -1 if the
+//!         sender isn't synchronized and may send at any time
+int64_t tdma_sender_delay(tdma_sender_t *sender, int64_t local_us, uint32_t airtime_us);
+
+//! \brief Estimate the time a packet takes on the air, including channel access
+//!
+//! \param phy_rate PHY rate, using the wifi_phy_rate_t values
+//! \param length Length of the ESP-NOW payload
+//! \return Airtime, in microseconds
+uint32_t tdma_airtime_us(uint8_t phy_rate, uint16_t length);
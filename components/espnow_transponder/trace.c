@@ -0,0 +1,92 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "trace.h"
+
+bool trace_init(trace_t *trace, uint32_t record_count, uint32_t post_trigger, uint32_t ticks_per_us) {
+    memset(trace, 0, sizeof(*trace));
+    trace->ticks_per_us = ticks_per_us;
+
+    if(record_count == 0)
+        return true;
+
+    if((record_count & (record_count - 1)) != 0 || post_trigger >= record_count)
+        return false;
+
+    trace->records = calloc(record_count, sizeof(trace_record_t));
+    if(trace->records == NULL)
+        return false;
+
+    trace->mask = record_count - 1;
+    trace->post_trigger = post_trigger;
+
+    return true;
+}
+
+bool trace_trigger(trace_t *trace, uint32_t reason) {
+    if(trace->records == NULL)
+        return false;
+
+    // Only the first trigger sets the stopping point. Recording only looks
+    // at the stopping point once 'triggered' is set.
+    bool expected = false;
+    if(!atomic_compare_exchange_strong_explicit(&trace->claimed, &expected, true,
+                                                memory_order_relaxed, memory_order_relaxed))
+        return false;
+
+    atomic_store_explicit(&trace->stop, atomic_load_explicit(&trace->head, memory_order_relaxed) + trace->post_trigger,
+                          memory_order_relaxed);
+    atomic_store_explicit(&trace->trigger_reason, reason, memory_order_relaxed);
+    atomic_store_explicit(&trace->triggered, true, memory_order_release);
+
+    return true;
+}
+
+bool trace_frozen(trace_t *trace) {
+    return atomic_load_explicit(&trace->frozen, memory_order_relaxed);
+}
+
+void trace_rearm(trace_t *trace) {
+    atomic_store_explicit(&trace->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&trace->triggered, false, memory_order_relaxed);
+    atomic_store_explicit(&trace->frozen, false, memory_order_relaxed);
+    atomic_store_explicit(&trace->claimed, false, memory_order_release);
+}
+
+int trace_dump(trace_t *trace, uint8_t *buffer, size_t length) {
+    if(trace->records == NULL || length < sizeof(trace_dump_header_t))
+        return -1;
+
+    const bool triggered = atomic_load_explicit(&trace->triggered, memory_order_acquire);
+    uint32_t end = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    if(triggered) {
+        const uint32_t stop = atomic_load_explicit(&trace->stop, memory_order_relaxed);
+        if((int32_t)(end - stop) > 0)
+            end = stop;
+    }
+
+    uint32_t count = trace->mask + 1;
+    if(end < count)
+        count = end;
+    if(count > (length - sizeof(trace_dump_header_t))/sizeof(trace_record_t))
+        count = (length - sizeof(trace_dump_header_t))/sizeof(trace_record_t);
+
+    const trace_dump_header_t header = {
+        .magic = TRACE_DUMP_MAGIC,
+        .version = TRACE_DUMP_VERSION,
+        .record_size = sizeof(trace_record_t),
+        .triggered = triggered,
+        .ticks_per_us = trace->ticks_per_us,
+        .record_count = count,
+        .trigger_reason = atomic_load_explicit(&trace->trigger_reason, memory_order_relaxed),
+    };
+    memcpy(buffer, &header, sizeof(header));
+
+    uint8_t *position = buffer + sizeof(header);
+    for(uint32_t index = end - count; index != end; index++) {
+        memcpy(position, &trace->records[index & trace->mask], sizeof(trace_record_t));
+        position += sizeof(trace_record_t);
+    }
+
+    return position - buffer;
+}
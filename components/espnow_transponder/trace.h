@@ -0,0 +1,184 @@
+#pragma once
+
+//! Hot path trace recorder
+//!
+//! Keeps the most recent events of the transmit and receive pipelines in a
+//! ring of fixed size binary records, so that a glitch can be broken down
+//! into where the time went afterwards. Recording is always on, and costs
+//! one atomic add plus a 16 byte store. Any task or callback can record.
+//!
+//! The ring can be frozen by a trigger, for example a CRC failure. A
+//! configurable number of records is still written after the trigger, so
+//! that the dump shows what happened both before and after it. Recording
+//! then stops until the ring is rearmed.
+//!
+//! A dump is a trace_dump_header_t followed by the records, oldest first,
+//! all little-endian. tools/trace_decode.py turns it into per-stage latency
+//! statistics and a Chrome trace (for Perfetto or chrome://tracing).
+//!
+//! This contains no RTOS calls; the caller supplies the time stamp.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+//! Dump format identifier
+#define TRACE_DUMP_MAGIC 0x43525445     // "ETRC"
+
+//! Dump format version
+#define TRACE_DUMP_VERSION 1
+
+//! Record key and sequence when a packet's payload can't be seen
+#define TRACE_KEY_NONE 0xFFFF
+
+//! Trace events. Each packet gets an id when it enters the pipeline, which
+//! ties its records together.
+typedef enum {
+    TRACE_RX_CALLBACK = 1,              //!< Transport receive callback entered, value is the packet length
+    TRACE_RX_QUEUED = 2,                //!< Packet posted to the transponder task
+    TRACE_RX_DEQUEUED = 3,              //!< Transponder task picked the packet up
+    TRACE_RX_DISPATCH = 4,              //!< User callback called
+    TRACE_RX_DONE = 5,                  //!< User callback returned
+    TRACE_RX_DROP = 6,                  //!< Packet dropped, value is a trace_drop_t
+    TRACE_RX_RECOVERED = 7,             //!< Packet rebuilt by FEC
+
+    TRACE_TX_SEND = 16,                 //!< espnow_transponder_send() called, value is the data length
+    TRACE_TX_QUEUED = 17,               //!< Packet added to the transmit queue
+    TRACE_TX_DEQUEUED = 18,             //!< Transmit scheduler picked the packet up
+    TRACE_TX_TRANSPORT = 19,            //!< Packet handed to the transport
+    TRACE_TX_TRANSPORT_DONE = 20,       //!< Transport send returned, value is the esp_err_t
+    TRACE_TX_COMPLETE = 21,             //!< Send completion, value is 1 for success. Has no packet id.
+    TRACE_TX_DROP = 22,                 //!< Packet dropped, value is a trace_drop_t
+    TRACE_TX_FRAME_END = 23,            //!< espnow_transponder_frame_end() called
+
+    TRACE_TRIGGER = 32,                 //!< Trigger that froze the trace, value is the reason
+} trace_event_t;
+
+//! Drop reasons, also used as trigger reasons
+typedef enum {
+    TRACE_DROP_FILTERED = 1,
+    TRACE_DROP_SHORT = 2,
+    TRACE_DROP_BAD_CRC = 3,
+    TRACE_DROP_BAD_LENGTH = 4,
+    TRACE_DROP_NO_BUFFER = 5,
+    TRACE_DROP_QUEUE_OVERFLOW = 6,
+    TRACE_DROP_DECOMPRESS = 7,
+    TRACE_DROP_FEC_UNRECOVERABLE = 8,
+    TRACE_DROP_QUEUE_FULL = 9,
+    TRACE_DROP_SEND_FAIL = 10,
+    TRACE_DROP_DUPLICATE = 11,
+    TRACE_DROP_RELAY_LIMITED = 12,
+} trace_drop_t;
+
+//! One trace record
+typedef struct {
+    uint32_t time;                      //!< Time stamp, in trace_dump_header_t.ticks_per_us units. Wraps.
+    uint8_t event;                      //!< trace_event_t
+    uint8_t core;                       //!< CPU core that recorded it
+    uint8_t sequence;                   //!< Third payload byte, the ARTDMX sequence number
+    uint8_t queue_depth;                //!< Depth of the queue the packet went through, where relevant
+    uint16_t key;                       //!< Payload key, the ARTDMX universe, or TRACE_KEY_NONE
+    uint16_t id;                        //!< Packet id
+    uint32_t value;                     //!< Event specific value
+} trace_record_t;
+
+//! Dump header
+typedef struct {
+    uint32_t magic;                     //!< TRACE_DUMP_MAGIC
+    uint8_t version;                    //!< TRACE_DUMP_VERSION
+    uint8_t record_size;                //!< sizeof(trace_record_t)
+    uint8_t triggered;                  //!< 1 if a trigger froze the trace
+    uint8_t reserved;
+    uint32_t ticks_per_us;              //!< Time stamp ticks per microsecond
+    uint32_t record_count;              //!< Records following the header
+    uint32_t trigger_reason;            //!< Reason passed to trace_trigger()
+} __attribute__((packed)) trace_dump_header_t;
+
+typedef struct {
+    trace_record_t *records;            //!< Ring storage, or NULL if tracing is disabled
+    uint32_t mask;                      //!< Ring size - 1
+    uint32_t post_trigger;              //!< Records kept after a trigger
+    uint32_t ticks_per_us;              //!< Time stamp ticks per microsecond
+    atomic_uint head;                   //!< Records reserved so far
+    atomic_uint stop;                   //!< Recording stops at this record, once triggered
+    atomic_uint trigger_reason;
+    atomic_bool claimed;                //!< Set by the first trigger
+    atomic_bool triggered;              //!< Set once 'stop' is valid
+    atomic_bool frozen;                 //!< True once the record at 'stop' was reached
+} trace_t;
+
+//! \brief Initialize a trace ring
+//!
+//! \param trace Trace to initialize
+//! \param record_count Ring size, a power of two, or 0 to disable tracing
+//! \param post_trigger Records to keep after a trigger, less than record_count
+//! \param ticks_per_us Time stamp ticks per microsecond, for the decoder
+//! \return True if successful
+bool trace_init(trace_t *trace, uint32_t record_count, uint32_t post_trigger, uint32_t ticks_per_us);
+
+//! \brief Add a record
+//!
+//! Safe to call from any task, and from several at once.
+//!
+//! \param trace Trace ring
+//! \param event Event, a trace_event_t
+//! \param core CPU core the caller runs on
+//! \param time Time stamp
+//! \param id Packet id
+//! \param key Payload key, or TRACE_KEY_NONE
+//! \param sequence Payload sequence number
+//! \param queue_depth Queue depth
+//! \param value Event specific value
+static inline void trace_record(trace_t *trace, uint8_t event, uint8_t core, uint32_t time, uint16_t id,
+                                uint16_t key, uint8_t sequence, uint8_t queue_depth, uint32_t value)
+{
+    if(trace->records == NULL || atomic_load_explicit(&trace->frozen, memory_order_relaxed))
+        return;
+
+    const uint32_t index = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+
+    if(atomic_load_explicit(&trace->triggered, memory_order_acquire)
+        && (int32_t)(index - atomic_load_explicit(&trace->stop, memory_order_relaxed)) >= 0) {
+        atomic_store_explicit(&trace->frozen, true, memory_order_relaxed);
+        return;
+    }
+
+    trace_record_t *record = &trace->records[index & trace->mask];
+    record->time = time;
+    record->event = event;
+    record->core = core;
+    record->sequence = sequence;
+    record->queue_depth = queue_depth;
+    record->key = key;
+    record->id = id;
+    record->value = value;
+}
+
+//! \brief Freeze the trace, after post_trigger more records
+//!
+//! Only the first trigger counts, until the trace is rearmed.
+//!
+//! \param trace Trace ring
+//! \param reason Reason, stored in the dump header
+//! \return True if this call triggered the trace
+bool trace_trigger(trace_t *trace, uint32_t reason);
+
+//! \brief Check if the trace has stopped recording
+bool trace_frozen(trace_t *trace);
+
+//! \brief Clear the trace, and start recording again
+//!
+//! Records that are being written while this runs may survive.
+void trace_rearm(trace_t *trace);
+
+//! \brief Copy the trace out
+//!
+//! This can be called while recording, but the newest records may then be
+//! incomplete. Dump a frozen trace for a consistent view.
+//!
+//! \param trace Trace ring
+//! \param buffer Buffer to write to
+//! \param length Size of the buffer. If too small, only the newest records are dumped.
+//! \return Length of the dump, or -1 if tracing is disabled or the header doesn't fit
+int trace_dump(trace_t *trace, uint8_t *buffer, size_t length);
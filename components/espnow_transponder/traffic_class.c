@@ -0,0 +1,59 @@
+#include <string.h>
+
+#include "traffic_class.h"
+
+// Pass added for a class of weight 1. Larger weights add proportionally less.
+#define TRAFFIC_CLASS_STRIDE        0x10000
+
+const espnow_transponder_class_t traffic_class_priority[ESPNOW_TRANSPONDER_CLASS_COUNT] = {
+    ESPNOW_TRANSPONDER_CLASS_CONTROL,
+    ESPNOW_TRANSPONDER_CLASS_SYNC,
+    ESPNOW_TRANSPONDER_CLASS_REALTIME,
+    ESPNOW_TRANSPONDER_CLASS_BULK,
+};
+
+void traffic_class_init(traffic_class_scheduler_t *scheduler, const uint8_t weights[ESPNOW_TRANSPONDER_CLASS_COUNT])
+{
+    memcpy(scheduler->weights, weights, sizeof(scheduler->weights));
+    memset(scheduler->pass, 0, sizeof(scheduler->pass));
+}
+
+int traffic_class_select(const traffic_class_scheduler_t *scheduler, uint32_t ready)
+{
+    int selected = -1;
+
+    for(int index = 0; index < ESPNOW_TRANSPONDER_CLASS_COUNT; index++) {
+        const espnow_transponder_class_t traffic_class = traffic_class_priority[index];
+        if(!(ready & (1u << traffic_class)))
+            continue;
+
+        if(scheduler->weights[traffic_class] == 0)
+            return traffic_class;
+
+        // Ties go to the higher priority class. Passes wrap, so compare the difference.
+        if(selected < 0 || (int32_t)(scheduler->pass[traffic_class] - scheduler->pass[selected]) < 0)
+            selected = traffic_class;
+    }
+
+    return selected;
+}
+
+void traffic_class_served(traffic_class_scheduler_t *scheduler, espnow_transponder_class_t traffic_class,
+                          uint32_t ready)
+{
+    const uint8_t weight = scheduler->weights[traffic_class];
+    if(weight == 0)
+        return;
+
+    const uint32_t pass = scheduler->pass[traffic_class];
+    scheduler->pass[traffic_class] += TRAFFIC_CLASS_STRIDE/weight;
+
+    // Classes that had nothing waiting catch up, rather than bank their share
+    for(int other = 0; other < ESPNOW_TRANSPONDER_CLASS_COUNT; other++) {
+        if(other == traffic_class || scheduler->weights[other] == 0 || (ready & (1u << other)))
+            continue;
+
+        if((int32_t)(scheduler->pass[other] - pass) < 0)
+            scheduler->pass[other] = pass;
+    }
+}
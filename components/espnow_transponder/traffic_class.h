@@ -0,0 +1,51 @@
+#pragma once
+
+//! Scheduling between traffic classes
+//!
+//! The transmit and receive paths keep a queue for each traffic class, and
+//! this decides which queue to serve next. Classes with a weight of 0 are
+//! strict priority: whenever one of them has something waiting, the first
+//! of them in priority order (control, sync, realtime, bulk) is served.
+//! What's left is shared between the weighted classes in proportion to
+//! their weights, using stride scheduling: each class has a pass, which
+//! goes up by a stride inversely proportional to its weight every time it
+//! is served, and the waiting class with the lowest pass goes next. A class
+//! that had nothing waiting doesn't save up its share for later.
+//!
+//! This contains no RTOS calls. Each scheduler is only used by one task.
+
+#include <stdint.h>
+
+#include "espnow_transponder.h"
+
+//! Classes in the order they are served in, highest priority first
+extern const espnow_transponder_class_t traffic_class_priority[ESPNOW_TRANSPONDER_CLASS_COUNT];
+
+typedef struct {
+    uint8_t weights[ESPNOW_TRANSPONDER_CLASS_COUNT]; //!< Share of each class, or 0 for strict priority
+    uint32_t pass[ESPNOW_TRANSPONDER_CLASS_COUNT];   //!< Virtual time of each weighted class
+} traffic_class_scheduler_t;
+
+//! \brief Initialize a scheduler
+//!
+//! \param scheduler Scheduler to initialize
+//! \param weights Share of each class, or 0 for strict priority
+void traffic_class_init(traffic_class_scheduler_t *scheduler, const uint8_t weights[ESPNOW_TRANSPONDER_CLASS_COUNT]);
+
+//! \brief Pick the class to serve next
+//!
+//! This doesn't change the scheduler, so the caller can decide not to serve
+//! the class after all, for example because it has to wait for the pacer.
+//!
+//! \param scheduler Scheduler
+//! \param ready Classes with something waiting, one bit per class
+//! \return Class to serve, or -1 if none are ready
+int traffic_class_select(const traffic_class_scheduler_t *scheduler, uint32_t ready);
+
+//! \brief Record that a class was served
+//!
+//! \param scheduler Scheduler
+//! \param traffic_class Class that was served
+//! \param ready Classes that had something waiting, as given to traffic_class_select()
+void traffic_class_served(traffic_class_scheduler_t *scheduler, espnow_transponder_class_t traffic_class,
+                          uint32_t ready);
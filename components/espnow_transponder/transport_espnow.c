@@ -0,0 +1,155 @@
+#include <string.h>
+#include "nvs_flash.h"
+#include "esp_event_loop.h"
+#include "esp_wifi.h"
+#include "esp_log.h"
+#include "esp_now.h"
+
+#include "espnow_transponder_transport.h"
+
+#include "esp_wifi_internal.h"
+
+static const char *TAG = "espnow";
+
+#define ESPNOW_ERROR_CHECK(function, message) \
+    ret = (function); \
+    if(ret!= ESP_OK) {  \
+        ESP_LOGE(TAG, "Error running:%s, err:%s", message, esp_err_to_name(ret)); \
+        return ret; \
+    }
+
+//! Broadcast address
+static const uint8_t broadcast_mac[ESP_NOW_ETH_ALEN] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+
+//! Transponder send completion handler
+static espnow_transponder_transport_send_cb_t send_callback = NULL;
+
+//! Interface the fixed rate is set on
+static esp_interface_t wifi_interface = ESP_IF_WIFI_STA;
+
+static esp_err_t example_event_handler(void *ctx, system_event_t *event)
+{
+    switch(event->event_id) {
+    case SYSTEM_EVENT_STA_START:
+        ESP_LOGI(TAG, "WiFi started");
+        break;
+    default:
+        break;
+    }
+    return ESP_OK;
+}
+
+//! \brief Initialize WiFi for use with ESP-NOW
+static esp_err_t wifi_init(const espnow_transponder_config_t *config)
+{
+    tcpip_adapter_init();
+
+    esp_err_t ret;
+
+    // Don't fail if the event loop was already registered, it's not needed for this component.
+    ret = esp_event_loop_init(example_event_handler, NULL);
+    if(ret != ESP_OK) {
+        ESP_LOGW(TAG, "Error running esp_event_loop_init, err:%s", esp_err_to_name(ret));
+    }
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+
+    // From: https://hackaday.io/project/161896-linux-espnow/log/161046-implementation
+    // Disable AMPDU to allow the bit rate to be changed
+    cfg.ampdu_tx_enable = 0;
+
+    ESPNOW_ERROR_CHECK(esp_wifi_init(&cfg), "esp_wifi_init");
+    ESPNOW_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM), "esp_wifi_set_storage");
+    ESPNOW_ERROR_CHECK(esp_wifi_set_mode(config->mode), "esp_wifi_set_mode");
+
+    ESPNOW_ERROR_CHECK(esp_wifi_start(), "esp_wifi_start");
+
+    ESPNOW_ERROR_CHECK(esp_wifi_set_max_tx_power(config->power), "esp_wifi_set_max_tx_power");
+
+    // In order to simplify example, channel is set after WiFi started.
+    // This is not necessary in real application if the two devices have
+    // been already on the same channel.
+    // Note: With IDF 3.3.1, WiFi needs to be in promiscuous mode for the channel setting to work (?)
+    ESPNOW_ERROR_CHECK(esp_wifi_set_promiscuous(true), "esp_wifi_set_promiscuous");
+    ESPNOW_ERROR_CHECK(esp_wifi_set_channel(config->channel, WIFI_SECOND_CHAN_NONE), "esp_wifi_set_channel");
+
+    // From: https://www.esp32.com/viewtopic.php?t=9965
+    // Change the wifi modulation mode
+    // See 'esp_wifi_types.h' for a list of available data rates
+    wifi_interface = config->mode == WIFI_MODE_STA? ESP_IF_WIFI_STA : ESP_IF_WIFI_AP;
+    ESPNOW_ERROR_CHECK(esp_wifi_internal_set_fix_rate(wifi_interface, true, config->phy_rate), "esp_wifi_internal_set_fix_rate");
+
+    return ESP_OK;
+}
+
+static esp_err_t transport_espnow_init(const espnow_transponder_config_t *config)
+{
+    // Initialize NVS
+    // Note: It's safe to call this multiple times.
+    esp_err_t ret = nvs_flash_init();
+    if(ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK( nvs_flash_erase() );
+        ret = nvs_flash_init();
+    }
+    if(ret != ESP_OK)
+        return ret;
+
+    ESPNOW_ERROR_CHECK(wifi_init(config), "wifi_init");
+    ESPNOW_ERROR_CHECK(esp_now_init(), "esp_now_init");
+
+    const esp_interface_t interface = config->mode == WIFI_MODE_STA? ESP_IF_WIFI_STA : ESP_IF_WIFI_AP;
+
+    // Add broadcast peer information to peer list.
+    esp_now_peer_info_t peer = {
+        .channel = config->channel,
+        .ifidx = interface,
+        .encrypt = false,
+    };
+    memcpy(peer.peer_addr, broadcast_mac, sizeof(peer.peer_addr));
+
+    ESPNOW_ERROR_CHECK(esp_now_add_peer(&peer), "esp_now_add_peer");
+
+    return ESP_OK;
+}
+
+//! \brief ESP-NOW transmit callback, called from the WiFi task
+static void transport_espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status)
+{
+    send_callback(mac_addr, status == ESP_NOW_SEND_SUCCESS);
+}
+
+static esp_err_t transport_espnow_register_callbacks(espnow_transponder_transport_recv_cb_t recv_cb,
+                                                     espnow_transponder_transport_send_cb_t send_cb)
+{
+    esp_err_t ret;
+
+    send_callback = send_cb;
+
+    ESPNOW_ERROR_CHECK(esp_now_register_send_cb(transport_espnow_send_cb), "esp_now_register_send_cb");
+    ESPNOW_ERROR_CHECK(esp_now_register_recv_cb(recv_cb), "esp_now_register_recv_cb");
+
+    return ESP_OK;
+}
+
+static esp_err_t transport_espnow_send(const uint8_t *data, uint16_t length)
+{
+    return esp_now_send(broadcast_mac, data, length);
+}
+
+static esp_err_t transport_espnow_set_phy(wifi_phy_rate_t phy_rate, int8_t power)
+{
+    esp_err_t ret;
+
+    ESPNOW_ERROR_CHECK(esp_wifi_internal_set_fix_rate(wifi_interface, true, phy_rate), "esp_wifi_internal_set_fix_rate");
+    ESPNOW_ERROR_CHECK(esp_wifi_set_max_tx_power(power), "esp_wifi_set_max_tx_power");
+
+    return ESP_OK;
+}
+
+const espnow_transponder_transport_t espnow_transponder_transport_espnow = {
+    .name = "espnow",
+    .init = transport_espnow_init,
+    .register_callbacks = transport_espnow_register_callbacks,
+    .send = transport_espnow_send,
+    .set_phy = transport_espnow_set_phy,
+};
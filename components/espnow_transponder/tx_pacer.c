@@ -0,0 +1,83 @@
+#include "tx_pacer.h"
+
+// Spread a frame's packets over this fraction of the frame period, so that
+// a frame is finished before the next one arrives.
+#define TX_PACER_DUTY_PERCENT       90
+
+// If no completions arrive for this long, assume they were lost
+#define TX_PACER_IN_FLIGHT_TIMEOUT_US   100000
+
+// Weight of the newest sample in the smoothed frame rate
+#define TX_PACER_FPS_SMOOTHING      0.1f
+
+void tx_pacer_init(tx_pacer_t *pacer, uint16_t framerate, uint16_t max_in_flight) {
+    pacer->frame_period_us = 1000000/framerate;
+    pacer->max_in_flight = max_in_flight;
+    atomic_init(&pacer->in_flight, 0);
+    pacer->packets_per_frame = 0;
+    pacer->packets_this_frame = 0;
+    pacer->next_send_us = 0;
+    pacer->last_send_us = 0;
+    pacer->last_frame_end_us = 0;
+    pacer->fps = 0;
+    pacer->in_flight_timeouts = 0;
+}
+
+int64_t tx_pacer_flow_delay(tx_pacer_t *pacer, int64_t now_us) {
+    if(atomic_load(&pacer->in_flight) >= pacer->max_in_flight) {
+        if(now_us - pacer->last_send_us < TX_PACER_IN_FLIGHT_TIMEOUT_US)
+            return pacer->last_send_us + TX_PACER_IN_FLIGHT_TIMEOUT_US - now_us;
+
+        atomic_store(&pacer->in_flight, 0);
+        pacer->in_flight_timeouts++;
+    }
+
+    return 0;
+}
+
+int64_t tx_pacer_delay(tx_pacer_t *pacer, int64_t now_us, uint32_t backlog) {
+    const int64_t flow_delay_us = tx_pacer_flow_delay(pacer, now_us);
+    if(flow_delay_us > 0)
+        return flow_delay_us;
+
+    // If more than a frame is waiting, pacing would only make it later
+    if(backlog > pacer->packets_per_frame)
+        return 0;
+
+    return pacer->next_send_us > now_us ? pacer->next_send_us - now_us : 0;
+}
+
+void tx_pacer_sent(tx_pacer_t *pacer, int64_t now_us) {
+    atomic_fetch_add(&pacer->in_flight, 1);
+    pacer->packets_this_frame++;
+    pacer->last_send_us = now_us;
+
+    // Until the first frame is finished, the frame size is unknown
+    if(pacer->packets_per_frame > 0) {
+        const uint32_t interval_us = pacer->frame_period_us*TX_PACER_DUTY_PERCENT/100/pacer->packets_per_frame;
+        pacer->next_send_us = now_us + interval_us;
+    }
+}
+
+void tx_pacer_sent_unpaced(tx_pacer_t *pacer, int64_t now_us) {
+    atomic_fetch_add(&pacer->in_flight, 1);
+    pacer->last_send_us = now_us;
+}
+
+void tx_pacer_completed(tx_pacer_t *pacer) {
+    unsigned int in_flight = atomic_load(&pacer->in_flight);
+    while(in_flight > 0
+        && !atomic_compare_exchange_weak(&pacer->in_flight, &in_flight, in_flight - 1))
+        ;
+}
+
+void tx_pacer_frame_end(tx_pacer_t *pacer, int64_t now_us) {
+    pacer->packets_per_frame = pacer->packets_this_frame;
+    pacer->packets_this_frame = 0;
+
+    if(pacer->last_frame_end_us != 0 && now_us > pacer->last_frame_end_us) {
+        const float fps = 1000000.0f/(now_us - pacer->last_frame_end_us);
+        pacer->fps += TX_PACER_FPS_SMOOTHING*(fps - pacer->fps);
+    }
+    pacer->last_frame_end_us = now_us;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+//! Transmit pacing and flow control
+//!
+//! Decides when the next queued packet may be handed to the radio. Packets
+//! are spread evenly over the frame period, based on how many packets the
+//! previous frame contained, and the number of packets that have been sent
+//! but not yet reported complete by the send callback is capped.
+//!
+//! This contains no RTOS calls; the caller supplies the time, so the same
+//! logic can be driven by a simulated radio.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+typedef struct {
+    uint32_t frame_period_us;           //!< Target time between frames
+    uint16_t max_in_flight;             //!< Maximum packets awaiting a send completion
+    atomic_uint in_flight;              //!< Packets awaiting a send completion
+    uint16_t packets_per_frame;         //!< Packets in the previous frame
+    uint16_t packets_this_frame;        //!< Packets sent so far in the current frame
+    int64_t next_send_us;               //!< Earliest time the next packet may be sent
+    int64_t last_send_us;               //!< Last time a packet was sent
+    int64_t last_frame_end_us;          //!< Time the previous frame finished sending
+    float fps;                          //!< Smoothed achieved frame rate
+    uint32_t in_flight_timeouts;        //!< Times the in-flight count was reset for lack of completions
+} tx_pacer_t;
+
+//! \brief Initialize a pacer
+//!
+//! \param pacer Pacer to initialize
+//! \param framerate Target frame rate, in frames per second
+//! \param max_in_flight Maximum packets awaiting a send completion
+void tx_pacer_init(tx_pacer_t *pacer, uint16_t framerate, uint16_t max_in_flight);
+
+//! \brief Determine how long to wait before sending the next packet
+//!
+//! \param pacer Pacer
+//! \param now_us Current time, in microseconds
+//! \param backlog Number of packets waiting to be sent
+//! \return 0 if the packet can be sent now, otherwise the time to wait, in microseconds
+int64_t tx_pacer_delay(tx_pacer_t *pacer, int64_t now_us, uint32_t backlog);
+
+//! \brief Determine how long to wait before sending, only applying the in-flight cap
+//!
+//! For when something else decides when packets go out, such as a TDMA slot.
+//!
+//! \param pacer Pacer
+//! \param now_us Current time, in microseconds
+//! \return 0 if the packet can be sent now, otherwise the time to wait, in microseconds
+int64_t tx_pacer_flow_delay(tx_pacer_t *pacer, int64_t now_us);
+
+//! \brief Record that a packet was handed to the radio
+void tx_pacer_sent(tx_pacer_t *pacer, int64_t now_us);
+
+//! \brief Record that a packet that isn't part of a frame was handed to the radio
+//!
+//! It counts towards the in-flight cap, but doesn't hold back the next
+//! packet of the frame, or count towards the frame size.
+void tx_pacer_sent_unpaced(tx_pacer_t *pacer, int64_t now_us);
+
+//! \brief Record a send completion
+//!
+//! This is safe to call from the WiFi task.
+void tx_pacer_completed(tx_pacer_t *pacer);
+
+//! \brief Record that the last packet of a frame was handed to the radio
+void tx_pacer_frame_end(tx_pacer_t *pacer, int64_t now_us);
@@ -0,0 +1,196 @@
+//! Host benchmark for the pattern generator
+//!
+//! Renders each effect into 20 universes for a number of frames, and
+//! reports the time per pixel, along with the per-pixel double sin() that
+//! the example used to generate its output with. The last column is how
+//! many pixels one core could render at 44 frames/s, if rendering were all
+//! it did; scale it by how much slower the target is than the host.
+//!
+//! The fade effect is set up to stand in for the sin() generator, and its
+//! output is compared with it, pixel for pixel, over every frame rendered.
+//! It fails if any pixel is more than BENCH_SIN_MAX_ERROR levels from the
+//! sin() output, which spans 60, or more than BENCH_PHASE_MAX_ERROR from
+//! the exact sine of the phase the engine steps through. The first bound
+//! covers the speed and scale being whole phase steps: the scale is 0.3
+//! steps short of 1/100 radian, which adds up to about a tenth of a radian
+//! at the end of the strip. The second covers the lookup tables and the
+//! fixed point arithmetic on their own.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/pattern_bench [frames]
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include "pattern.h"
+
+#define BENCH_UNIVERSES             20
+#define BENCH_UNIVERSE_SIZE         512
+#define BENCH_FRAMERATE             44
+
+//! Most a fade pixel can differ from the sin() generator's
+#define BENCH_SIN_MAX_ERROR         5
+
+//! Most a fade pixel can differ from the exact sine of its phase
+#define BENCH_PHASE_MAX_ERROR       1
+
+//! Levels the sin() generator spans
+#define BENCH_SIN_LEVELS            60
+
+//! \brief Get a monotonic time, in nanoseconds
+static int64_t time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000000 + now.tv_nsec;
+}
+
+//! \brief The generator the example used before the pattern engine, for comparison
+static void render_sin(uint32_t frame, uint8_t *buffer)
+{
+    const float phase = frame*.2f;
+    for(int led = 0; led < (BENCH_UNIVERSE_SIZE*BENCH_UNIVERSES)/3; led++) {
+        buffer[led*3+0] = (int)(30*(sin(phase+led/100.0)+1));
+        buffer[led*3+1] = 0;
+        buffer[led*3+2] = 0;
+    }
+}
+
+//! \brief Compare a frame of the fade effect with the sin() generator
+//!
+//! The generator runs its pixels across universes, so it is computed per
+//! pixel here rather than compared with its buffer.
+//!
+//! \param fade Fade effect standing in for the generator
+//! \param frame Frame number
+//! \param buffer Frame rendered by the fade effect
+//! \param sin_error Raised to the largest difference from the generator
+//! \param phase_error Raised to the largest difference from the exact sine of the pixel's phase
+//! \return False if a slot that should be dark isn't
+static bool compare_sin(const pattern_t *fade, uint32_t frame, const uint8_t *buffer, int *sin_error,
+                        int *phase_error)
+{
+    const float phase = frame*.2f;
+    const int pixels = BENCH_UNIVERSE_SIZE/PATTERN_PIXEL_SIZE;
+    bool dark = true;
+    for(int universe = 0; universe < BENCH_UNIVERSES; universe++) {
+        const uint8_t *out = buffer + universe*BENCH_UNIVERSE_SIZE;
+        for(int pixel = 0; pixel < pixels; pixel++, out += PATTERN_PIXEL_SIZE) {
+            const int led = universe*pixels + pixel;
+            const int expected = (int)(BENCH_SIN_LEVELS/2*(sin(phase+led/100.0)+1));
+            const uint16_t fixed_phase = frame*fade->speed + led*fade->scale;
+            const int exact = (int)(BENCH_SIN_LEVELS/2*(sin(fixed_phase*2*M_PI/PATTERN_CYCLE)+1));
+
+            if(abs(out[0] - expected) > *sin_error)
+                *sin_error = abs(out[0] - expected);
+            if(abs(out[0] - exact) > *phase_error)
+                *phase_error = abs(out[0] - exact);
+            dark &= out[1] == 0 && out[2] == 0;
+        }
+
+        for(int slot = pixels*PATTERN_PIXEL_SIZE; slot < BENCH_UNIVERSE_SIZE; slot++)
+            dark &= buffer[universe*BENCH_UNIVERSE_SIZE + slot] == 0;
+    }
+
+    return dark;
+}
+
+//! \brief Print one line of results
+static void report(const char *name, int64_t elapsed_ns, uint32_t frames, uint32_t pixels, uint32_t checksum)
+{
+    const double ns_per_pixel = (double)elapsed_ns/frames/pixels;
+    printf("%-8s %8.2f ns/pixel %10.0f pixels at %i frames/s  (checksum %08x)\n",
+           name, ns_per_pixel, 1e9/BENCH_FRAMERATE/ns_per_pixel, BENCH_FRAMERATE, checksum);
+}
+
+//! \brief Fold a frame into a checksum, so that the rendering can't be optimized away
+static uint32_t checksum_add(uint32_t checksum, const uint8_t *buffer, size_t length)
+{
+    for(size_t index = 0; index < length; index += 61)
+        checksum = checksum*31 + buffer[index];
+
+    return checksum;
+}
+
+int main(int argc, char **argv)
+{
+    const uint32_t frames = argc > 1 ? atoi(argv[1]) : 2000;
+    if(argc > 2 || frames == 0) {
+        fprintf(stderr, "Usage: %s [frames]\n", argv[0]);
+        return 2;
+    }
+    const size_t length = BENCH_UNIVERSE_SIZE*BENCH_UNIVERSES;
+
+    uint8_t *buffer = malloc(length);
+    if(buffer == NULL)
+        return 1;
+
+    pattern_init();
+
+    const struct {
+        const char *name;
+        pattern_t pattern;
+    } effects[] = {
+        // First, and compared with sin(): 0.2 radians a frame, 1/100 radian a pixel, 60 levels of red
+        { "fade",    { .effect = PATTERN_FADE, .color = { 60, 0, 0 }, .brightness = 255, .speed = 2086, .scale = 104 } },
+        { "chase",   { .effect = PATTERN_CHASE, .color = { 255, 128, 0 }, .brightness = 255, .gamma = true,
+                       .speed = 512, .scale = 16, .width = 4 } },
+        { "rainbow", { .effect = PATTERN_RAINBOW, .brightness = 192, .gamma = true, .speed = 700, .scale = 400 } },
+        { "noise",   { .effect = PATTERN_NOISE, .color = { 0, 96, 255 }, .brightness = 255, .gamma = true,
+                       .speed = 1500, .scale = 3000 } },
+    };
+
+    // Every pixel the old generator writes, including those straddling universes
+    const uint32_t sin_pixels = length/PATTERN_PIXEL_SIZE;
+    uint32_t checksum = 0;
+    int64_t start_ns = time_ns();
+    for(uint32_t frame = 0; frame < frames; frame++) {
+        render_sin(frame, buffer);
+        checksum = checksum_add(checksum, buffer, length);
+    }
+    report("sin()", time_ns() - start_ns, frames, sin_pixels, checksum);
+
+    const uint32_t pixels = BENCH_UNIVERSES*(BENCH_UNIVERSE_SIZE/PATTERN_PIXEL_SIZE);
+    for(size_t effect = 0; effect < sizeof(effects)/sizeof(effects[0]); effect++) {
+        checksum = 0;
+        start_ns = time_ns();
+        for(uint32_t frame = 0; frame < frames; frame++) {
+            pattern_render(&effects[effect].pattern, frame, buffer, BENCH_UNIVERSES, BENCH_UNIVERSE_SIZE);
+            checksum = checksum_add(checksum, buffer, length);
+        }
+        report(effects[effect].name, time_ns() - start_ns, frames, pixels, checksum);
+    }
+
+    // Outside the timed loops, so that the comparison isn't timed
+    int sin_error = 0;
+    int phase_error = 0;
+    bool dark = true;
+    for(uint32_t frame = 0; frame < frames; frame++) {
+        pattern_render(&effects[0].pattern, frame, buffer, BENCH_UNIVERSES, BENCH_UNIVERSE_SIZE);
+        dark &= compare_sin(&effects[0].pattern, frame, buffer, &sin_error, &phase_error);
+    }
+    printf("fade against sin(): at most %i of %i levels off, %i from the exact sine of the phase\n", sin_error,
+           BENCH_SIN_LEVELS, phase_error);
+
+    bool pass = true;
+    if(sin_error > BENCH_SIN_MAX_ERROR || phase_error > BENCH_PHASE_MAX_ERROR) {
+        printf("FAIL: fade is more than %i levels from sin(), or %i from the exact sine\n", BENCH_SIN_MAX_ERROR,
+               BENCH_PHASE_MAX_ERROR);
+        pass = false;
+    }
+    if(!dark) {
+        printf("FAIL: fade lit green, blue or the slots left over\n");
+        pass = false;
+    }
+
+    free(buffer);
+    printf("%s\n", pass ? "PASS" : "FAIL");
+    return pass ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+//! Pixel pattern generator
+//!
+//! Renders animated effects straight into DMX universe buffers, for senders
+//! that make their own output. The ESP32 has no double precision FPU, so
+//! everything is fixed point: phases are 16 bit fractions of a cycle, and
+//! sine, easing and gamma come from lookup tables built by pattern_init().
+//!
+//! Pixels are RGB, three slots each, and don't straddle universes, the way
+//! pixel drivers map them: a 512 slot universe holds 170 pixels, and the
+//! slots left over are zeroed. The pattern runs on from one universe to the
+//! next, as if they were a single strip.
+//!
+//! This contains no RTOS calls.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+//! Bytes per pixel
+#define PATTERN_PIXEL_SIZE          3
+
+//! Phase of a full cycle, for pattern_t::speed and pattern_t::scale
+#define PATTERN_CYCLE               65536
+
+typedef enum {
+    PATTERN_FADE,                       //!< Color, with a sine wave of brightness running along the strip.
+                                        //!< With a scale of 0, the whole strip fades together.
+    PATTERN_CHASE,                      //!< Blocks of color moving along the strip
+    PATTERN_RAINBOW,                    //!< Hues cycling along the strip
+    PATTERN_NOISE,                      //!< Color, with smooth random brightness that changes over time
+} pattern_effect_t;
+
+//! Effect parameters
+//!
+//! Fade, rainbow and noise are laid out along a phase, which advances by
+//! scale from one pixel to the next, and by speed from one frame to the
+//! next. For fade and rainbow a cycle of the phase is one wave; for noise it
+//! is the distance between random values.
+typedef struct {
+    pattern_effect_t effect;
+    uint8_t color[3];                   //!< Color, for fade, chase and noise
+    uint8_t brightness;                 //!< Overall brightness, 255 for full
+    bool gamma;                         //!< Gamma correct the output, for LEDs
+    uint16_t speed;                     //!< Phase per frame, or 1/256 pixels per frame for chase
+    uint16_t scale;                     //!< Phase per pixel, or pixels from the start of one block to the next for chase
+    uint16_t width;                     //!< Chase only, length of each block in pixels
+} pattern_t;
+
+//! \brief Build the lookup tables
+//!
+//! Call this once, before rendering. It uses floating point, and can take a
+//! moment.
+void pattern_init();
+
+//! \brief Render a frame of a pattern
+//!
+//! \param pattern Effect and its parameters
+//! \param frame Frame number, which the effect is animated by
+//! \param buffer Universe buffers, one after the other
+//! \param universe_count Number of universes to render
+//! \param universe_size Size of each universe buffer, up to 512
+void pattern_render(const pattern_t *pattern, uint32_t frame, uint8_t *buffer, uint16_t universe_count,
+                    uint16_t universe_size);
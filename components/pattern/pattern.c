@@ -0,0 +1,198 @@
+#include <string.h>
+#include <math.h>
+
+#include "pattern.h"
+
+#define PATTERN_GAMMA               2.2
+
+// Each kernel is inlined into a loop of its own, with the effect a
+// constant, so that the compiler drops the other effects' code from it
+#define PATTERN_INLINE              static inline __attribute__((always_inline))
+
+static uint8_t sine_lut[256];           //!< Sine over a cycle, scaled to [0, 255]
+static uint8_t ease_lut[256];           //!< Smoothstep over [0, 1], scaled to [0, 255]
+static uint8_t gamma_lut[256];          //!< Gamma correction
+static uint8_t linear_lut[256];         //!< No correction
+
+//! Per-frame constants of the effect being rendered
+typedef struct {
+    const uint8_t *curve;               //!< Output correction, gamma_lut or linear_lut
+    uint8_t color[3];                   //!< Color, with the brightness applied
+    uint8_t lit[3];                     //!< Chase, output of a lit pixel
+    uint8_t brightness;
+    uint16_t step;                      //!< Phase per pixel
+    uint16_t period;                    //!< Chase, pixels from one block to the next
+    uint16_t width;                     //!< Chase, pixels in a block
+    uint32_t time;                      //!< Noise, phase on the time axis
+} render_t;
+
+//! State carried from one pixel to the next
+typedef struct {
+    uint16_t phase;                     //!< Fade and rainbow, phase of this pixel
+    uint16_t position;                  //!< Chase, position of this pixel in the period
+    uint32_t noise_x;                   //!< Noise, phase of this pixel on the strip axis
+    uint32_t noise_cell;                //!< Noise, cell that noise_left and noise_right belong to
+    uint8_t noise_left;                 //!< Noise, value at the start of the cell
+    uint8_t noise_right;                //!< Noise, value at the end of the cell
+} render_state_t;
+
+void pattern_init()
+{
+    for(int index = 0; index < 256; index++) {
+        const float x = index/255.0f;
+        sine_lut[index] = (uint8_t)lroundf(127.5f + 127.5f*sinf(index*2*(float)M_PI/256));
+        ease_lut[index] = (uint8_t)lroundf(255*x*x*(3 - 2*x));
+        gamma_lut[index] = (uint8_t)lroundf(255*powf(x, PATTERN_GAMMA));
+        linear_lut[index] = index;
+    }
+}
+
+//! \brief Scale a value by a fraction of 256ths, so that 255 keeps it as it is
+PATTERN_INLINE uint8_t scale8(uint8_t value, uint8_t scale)
+{
+    return ((uint16_t)value*(scale + 1)) >> 8;
+}
+
+//! \brief Interpolate between two values, by a fraction of 256ths
+PATTERN_INLINE uint8_t lerp8(uint8_t a, uint8_t b, uint8_t fraction)
+{
+    return a + ((((int)b - a)*fraction) >> 8);
+}
+
+//! \brief Sine of a phase, scaled to [0, 255], interpolated from the table
+PATTERN_INLINE uint8_t sine16(uint16_t phase)
+{
+    const uint8_t index = phase >> 8;
+    return lerp8(sine_lut[index], sine_lut[(uint8_t)(index + 1)], phase & 0xFF);
+}
+
+//! \brief Random value for a point of the noise lattice
+PATTERN_INLINE uint8_t noise_hash(uint32_t x, uint32_t t)
+{
+    uint32_t hash = x*0x9E3779B1u ^ t*0x85EBCA77u;
+    hash ^= hash >> 15;
+    hash *= 0x2C1B3C6Du;
+    hash ^= hash >> 12;
+    return hash >> 24;
+}
+
+//! \brief Noise value at the start of a cell of the strip axis, at the current time
+PATTERN_INLINE uint8_t noise_column(const render_t *render, uint32_t cell)
+{
+    const uint32_t time_cell = render->time >> 16;
+    return lerp8(noise_hash(cell, time_cell), noise_hash(cell, time_cell + 1),
+                 ease_lut[(render->time >> 8) & 0xFF]);
+}
+
+//! \brief Render one pixel of an effect, and move the state on to the next
+PATTERN_INLINE void render_pixel(const pattern_effect_t effect, const render_t *render, render_state_t *state,
+                                 uint8_t *out)
+{
+    switch(effect) {
+    case PATTERN_FADE: {
+        const uint8_t level = sine16(state->phase);
+        state->phase += render->step;
+
+        for(int channel = 0; channel < 3; channel++)
+            out[channel] = render->curve[scale8(level, render->color[channel])];
+        break;
+    }
+
+    case PATTERN_CHASE: {
+        const bool lit = state->position < render->width;
+        if(++state->position == render->period)
+            state->position = 0;
+
+        for(int channel = 0; channel < 3; channel++)
+            out[channel] = lit ? render->lit[channel] : 0;
+        break;
+    }
+
+    case PATTERN_RAINBOW: {
+        const uint16_t hue = state->phase;
+        state->phase += render->step;
+
+        out[0] = render->curve[scale8(sine16(hue), render->brightness)];
+        out[1] = render->curve[scale8(sine16(hue + PATTERN_CYCLE/3), render->brightness)];
+        out[2] = render->curve[scale8(sine16(hue + 2*PATTERN_CYCLE/3), render->brightness)];
+        break;
+    }
+
+    case PATTERN_NOISE: {
+        // The lattice values only change when the pixel moves into a new cell
+        const uint32_t cell = state->noise_x >> 16;
+        if(cell != state->noise_cell) {
+            state->noise_left = cell == state->noise_cell + 1 ? state->noise_right : noise_column(render, cell);
+            state->noise_right = noise_column(render, cell + 1);
+            state->noise_cell = cell;
+        }
+
+        const uint8_t level = lerp8(state->noise_left, state->noise_right, ease_lut[(state->noise_x >> 8) & 0xFF]);
+        state->noise_x += render->step;
+
+        for(int channel = 0; channel < 3; channel++)
+            out[channel] = render->curve[scale8(level, render->color[channel])];
+        break;
+    }
+    }
+}
+
+//! \brief Render every universe with one effect
+PATTERN_INLINE void render_universes(const pattern_effect_t effect, const render_t *render, render_state_t *state,
+                                     uint8_t *buffer, uint16_t universe_count, uint16_t universe_size)
+{
+    const uint16_t pixel_count = universe_size/PATTERN_PIXEL_SIZE;
+
+    for(uint16_t universe = 0; universe < universe_count; universe++) {
+        uint8_t *out = buffer + universe*universe_size;
+        for(uint16_t pixel = 0; pixel < pixel_count; pixel++, out += PATTERN_PIXEL_SIZE)
+            render_pixel(effect, render, state, out);
+
+        memset(out, 0, universe_size - pixel_count*PATTERN_PIXEL_SIZE);
+    }
+}
+
+void pattern_render(const pattern_t *pattern, uint32_t frame, uint8_t *buffer, uint16_t universe_count,
+                    uint16_t universe_size)
+{
+    render_t render = {
+        .curve = pattern->gamma ? gamma_lut : linear_lut,
+        .brightness = pattern->brightness,
+        .step = pattern->scale,
+        .period = pattern->scale > 0 ? pattern->scale : 1,
+        .width = pattern->width,
+        .time = frame*pattern->speed,
+    };
+    for(int channel = 0; channel < 3; channel++) {
+        render.color[channel] = scale8(pattern->color[channel], pattern->brightness);
+        render.lit[channel] = render.curve[render.color[channel]];
+    }
+
+    render_state_t state = {
+        .phase = frame*pattern->speed,
+    };
+
+    if(pattern->effect == PATTERN_NOISE) {
+        state.noise_left = noise_column(&render, 0);
+        state.noise_right = noise_column(&render, 1);
+    }
+
+    // Chase blocks move by speed/256 pixels each frame
+    const uint16_t offset = ((uint64_t)frame*pattern->speed >> 8) % render.period;
+    state.position = (render.period - offset) % render.period;
+
+    switch(pattern->effect) {
+    case PATTERN_FADE:
+        render_universes(PATTERN_FADE, &render, &state, buffer, universe_count, universe_size);
+        break;
+    case PATTERN_CHASE:
+        render_universes(PATTERN_CHASE, &render, &state, buffer, universe_count, universe_size);
+        break;
+    case PATTERN_RAINBOW:
+        render_universes(PATTERN_RAINBOW, &render, &state, buffer, universe_count, universe_size);
+        break;
+    case PATTERN_NOISE:
+        render_universes(PATTERN_NOISE, &render, &state, buffer, universe_count, universe_size);
+        break;
+    }
+}
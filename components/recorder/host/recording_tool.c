@@ -0,0 +1,226 @@
+//! Host tool for recordings
+//!
+//! Reads a recording made by the recorder, for example one read off a
+//! device with:
+//!
+//!     esptool.py read_flash <partition offset> <partition size> recording.bin
+//!
+//! and summarizes it, dumps its frames as CSV, or plays it back against the
+//! host clock to show how closely its timing can be reproduced. The file is
+//! mapped rather than read in, so recordings of any length can be used.
+//!
+//! This is plain C, and is not built into the firmware. It is built along
+//! with transponder_bench, and recording_test checks the format it reads:
+//!
+//!     cmake -S components/espnow_transponder/bench -B build/bench
+//!     cmake --build build/bench
+//!     build/bench/recording_tool info recording.bin
+//!     build/bench/recording_tool dump recording.bin [start seconds] > frames.csv
+//!     build/bench/recording_tool replay recording.bin [speed]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "recording.h"
+
+//! \brief Get a monotonic time, in microseconds
+static int64_t time_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+//! \brief Sleep until a monotonic time, in microseconds
+static void sleep_until_us(int64_t until_us)
+{
+    const struct timespec until = {
+        .tv_sec = until_us/1000000,
+        .tv_nsec = (until_us%1000000)*1000,
+    };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL);
+}
+
+static int compare_int64(const void *a, const void *b)
+{
+    const int64_t x = *(const int64_t *)a;
+    const int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+//! \brief Print a summary of the recording
+static int info(recording_reader_t *reader, size_t file_length)
+{
+    uint64_t frames = 0;
+    uint64_t frame_bytes = 0;
+    int64_t first_us = 0;
+    int64_t last_us = 0;
+    uint32_t universes = 0;
+    uint64_t *universe_frames = calloc(reader->universe_count, sizeof(uint64_t));
+    if(universe_frames == NULL)
+        return 1;
+
+    recording_frame_t frame;
+    int ret;
+    while((ret = recording_reader_next(reader, &frame)) > 0) {
+        if(frames == 0)
+            first_us = frame.time_us;
+        last_us = frame.time_us;
+        frames++;
+        frame_bytes += frame.length;
+        if(universe_frames[frame.universe]++ == 0)
+            universes++;
+    }
+
+    const double duration = (last_us - first_us)/1e6;
+    printf("universes:    %u recorded of %u\n", universes, reader->universe_count);
+    printf("duration:     %.3f s\n", duration);
+    printf("frames:       %llu (%.1f/s)\n", (unsigned long long)frames, duration > 0 ? frames/duration : 0);
+    printf("size:         %zu bytes of %zu, %.3f of the frame data\n", reader->length, file_length,
+           frame_bytes ? (double)reader->length/frame_bytes : 0);
+    printf("sync points:  %u indexed, every %u us\n", reader->index_count, reader->sync_interval_us);
+    if(ret < 0)
+        printf("ends early, at a record that couldn't be read\n");
+    else if(reader->index == NULL)
+        printf("has no index, the recording was cut short\n");
+
+    free(universe_frames);
+    return 0;
+}
+
+//! \brief Print every frame as CSV, one line per frame
+static int dump(recording_reader_t *reader, double start)
+{
+    const int64_t start_us = (int64_t)(start*1e6);
+    if(start_us > 0 && !recording_reader_seek(reader, start_us)) {
+        fprintf(stderr, "Could not seek to %.3f s\n", start);
+        return 1;
+    }
+
+    printf("time_us,universe,sequence,length,data\n");
+
+    recording_frame_t frame;
+    int ret;
+    while((ret = recording_reader_next(reader, &frame)) > 0) {
+        // Seeking goes to the sync point before the start
+        if(frame.time_us < start_us)
+            continue;
+
+        printf("%lld,%u,%u,%u,", (long long)frame.time_us, frame.universe, frame.sequence, frame.length);
+        for(int index = 0; index < frame.length; index++)
+            printf("%02x", frame.data[index]);
+        printf("\n");
+    }
+
+    return ret < 0 ? 1 : 0;
+}
+
+typedef struct {
+    const recording_player_t *player;
+    int64_t *lateness_us;               //!< How late each frame was played
+    uint64_t count;
+    uint64_t reserved;
+} replay_context_t;
+
+//! \brief Note how late a frame was played
+static bool replay_output(void *context, const recording_frame_t *frame)
+{
+    replay_context_t *replay = context;
+    if(replay->count == replay->reserved) {
+        const uint64_t reserved = replay->reserved ? replay->reserved*2 : 4096;
+        int64_t *lateness_us = realloc(replay->lateness_us, reserved*sizeof(int64_t));
+        if(lateness_us == NULL)
+            return true;
+        replay->lateness_us = lateness_us;
+        replay->reserved = reserved;
+    }
+
+    const recording_player_t *player = replay->player;
+    const int64_t due_us = player->speed > 0
+        ? player->start_local_us + (int64_t)((frame->time_us - player->start_time_us)/player->speed)
+        : player->start_local_us;
+    replay->lateness_us[replay->count++] = time_us() - due_us;
+    return true;
+}
+
+//! \brief Play the recording against the host clock, and report how late frames were
+static int replay(recording_reader_t *reader, float speed)
+{
+    recording_player_t player;
+    recording_player_init(&player, reader, speed);
+
+    replay_context_t context = { .player = &player };
+    const int64_t start_us = time_us();
+    while(true) {
+        const int64_t next_us = recording_player_poll(&player, time_us(), replay_output, &context);
+        if(next_us == INT64_MAX)
+            break;
+
+        sleep_until_us(next_us);
+    }
+    const double elapsed = (time_us() - start_us)/1e6;
+
+    printf("frames:       %llu in %.3f s (%.0f/s)\n", (unsigned long long)context.count, elapsed,
+           elapsed > 0 ? context.count/elapsed : 0);
+    if(speed > 0 && context.count > 0) {
+        qsort(context.lateness_us, context.count, sizeof(int64_t), compare_int64);
+        printf("lateness:     p50 %lld us, p99 %lld us, max %lld us\n", (long long)context.lateness_us[context.count/2],
+               (long long)context.lateness_us[context.count*99/100], (long long)context.lateness_us[context.count - 1]);
+    }
+    if(player.corrupt)
+        printf("stopped early, at a record that couldn't be read\n");
+
+    free(context.lateness_us);
+    return player.corrupt ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 3) {
+        fprintf(stderr, "Usage: %s info|dump|replay FILE [start seconds|speed]\n", argv[0]);
+        return 2;
+    }
+
+    const int fd = open(argv[2], O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Could not open %s\n", argv[2]);
+        return 1;
+    }
+
+    const uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        fprintf(stderr, "Could not map %s\n", argv[2]);
+        return 1;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+
+    recording_reader_t reader;
+    if(!recording_reader_init(&reader, data, st.st_size)) {
+        fprintf(stderr, "%s is not a recording\n", argv[2]);
+        return 1;
+    }
+
+    int ret;
+    if(strcmp(argv[1], "info") == 0)
+        ret = info(&reader, st.st_size);
+    else if(strcmp(argv[1], "dump") == 0)
+        ret = dump(&reader, argc > 3 ? atof(argv[3]) : 0);
+    else if(strcmp(argv[1], "replay") == 0)
+        ret = replay(&reader, argc > 3 ? atof(argv[3]) : 1);
+    else {
+        fprintf(stderr, "Unknown command %s\n", argv[1]);
+        ret = 2;
+    }
+
+    recording_reader_free(&reader);
+    munmap((void *)data, st.st_size);
+    return ret;
+}
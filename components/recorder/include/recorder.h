@@ -0,0 +1,94 @@
+#pragma once
+
+//! Universe stream recorder and replayer
+//!
+//! Records the frames a receiver gets, or a gateway forwards, into a flash
+//! partition, in the format described in recording.h, and plays recordings
+//! back out over ARTDMX with their original timing. This makes field
+//! problems reproducible, and lets receivers be load tested with real
+//! shows rather than test patterns.
+//!
+//! The partition needs an entry in the partition table, for example:
+//!
+//!     recording, data, 0x40, , 3M
+//!
+//! It is erased when recording starts, which takes a few seconds. Frames
+//! are encoded where they are recorded, and written to flash a sector at a
+//! time by a task of its own, so recording doesn't block the caller. If
+//! the flash falls behind, or the partition is full, frames are dropped and
+//! counted.
+//!
+//! Replay maps the partition into memory, so it is limited to what can be
+//! mapped, a few megabytes. To get a recording off the device, read the
+//! partition out with esptool.py read_flash; the erased space after it is
+//! ignored.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <esp_err.h>
+
+#include "recording.h"
+
+//! Time between sync points
+#define RECORDER_SYNC_INTERVAL_US   1000000
+
+typedef struct {
+    recording_writer_stats_t writer;    //!< Frames recorded
+    uint64_t flash_bytes;               //!< Bytes written to flash
+    bool full;                          //!< True once the partition filled up
+} recorder_stats_t;
+
+typedef struct {
+    uint64_t frames;                    //!< Frames sent
+    uint64_t retries;                   //!< Times a frame had to wait for room in the transmit queue
+    uint64_t sync_fail;                 //!< Frames that couldn't be committed
+    uint32_t loops;                     //!< Times the recording was started over
+    bool playing;                       //!< True while the recording is being played
+    bool corrupt;                       //!< True if playback stopped at a record that couldn't be read
+} recorder_replay_stats_t;
+
+//! \brief Start recording
+//!
+//! \param partition_label Label of the partition to record into
+//! \param universe_count Universes [0, universe_count) are recorded
+//! \return ESP_OK if successful, ESP_ERR_NOT_FOUND if there is no such partition
+esp_err_t recorder_start(const char *partition_label, uint16_t universe_count);
+
+//! \brief Record a frame
+//!
+//! This has the same arguments as artdmx_frame_callback_t, so it can be
+//! called from the receiver's frame callback. It does nothing unless
+//! recording.
+//!
+//! \param universe Universe
+//! \param sequence Sequence number of the frame
+//! \param data Frame data
+//! \param data_length Length of the frame data
+void recorder_frame(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length);
+
+//! \brief Stop recording, and write the index
+//!
+//! This waits for everything to be written to flash.
+//!
+//! \return ESP_OK if the recording was completed
+esp_err_t recorder_stop();
+
+//! \brief Get the recorder statistics
+void recorder_get_statistics(recorder_stats_t *stats);
+
+//! \brief Play a recording back out over ARTDMX
+//!
+//! The ARTDMX sender has to be initialized first. Frames are sent with
+//! artdmx_send(), with their recorded sequence numbers, and each frame is
+//! ended, and committed if sync_delay_us is set, as soon as the first
+//! universe of the next one is read.
+//!
+//! \param partition_label Label of the partition holding the recording
+//! \param speed Playback speed, 1 for the original timing, or 0 for as fast as the transponder takes them
+//! \param loop Start over at the end of the recording
+//! \param sync_delay_us Delay to commit each frame with, as artdmx_send_sync() takes, or 0 not to
+//! \return ESP_OK if playback started
+esp_err_t recorder_replay_start(const char *partition_label, float speed, bool loop, uint32_t sync_delay_us);
+
+//! \brief Get the replay statistics
+void recorder_replay_get_statistics(recorder_replay_stats_t *stats);
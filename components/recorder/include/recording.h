@@ -0,0 +1,226 @@
+#pragma once
+
+//! Recording format for DMX universe streams
+//!
+//! A recording is a header, followed by a stream of records, then an index
+//! and a trailer. Each frame record holds the time since the previous
+//! record, the universe, its sequence number, and the data, either whole or
+//! as runs of the slots that changed since the universe's previous frame.
+//! Numbers are little endian, and times and lengths are LEB128 varints.
+//!
+//! Every sync_interval_us the writer starts a sync point: a sync record
+//! with the absolute time, after which every universe is recorded whole
+//! the first time it appears. Decoding can start at any sync point, so the
+//! index only needs to list them. Recordings that were cut short, and have
+//! no index, can still be read, and sought through by scanning.
+//!
+//! The reader works on a recording in memory, which can be a mapped file
+//! or flash partition, so that a long recording is read in as it is played
+//! rather than loaded up front. Anything after the trailer that reads as
+//! erased flash (0xFF) is ignored.
+//!
+//! This contains no RTOS calls; the caller supplies the time, and writes
+//! the recording out.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RECORDING_MAGIC             0x43455245  //!< "EREC"
+#define RECORDING_INDEX_MAGIC       0x58495245  //!< "ERIX"
+#define RECORDING_VERSION           1
+
+//! Largest universe that can be recorded
+#define RECORDING_MAX_FRAME         512
+
+//! Largest encoded record
+#define RECORDING_MAX_RECORD        (RECORDING_MAX_FRAME + 24)
+
+//! Record types, the first byte of each record
+typedef enum {
+    RECORDING_TAG_FULL = 1,             //!< Frame, with the data whole
+    RECORDING_TAG_DELTA = 2,            //!< Frame, with runs of changed data
+    RECORDING_TAG_SYNC = 3,             //!< Sync point, with the absolute time
+    RECORDING_TAG_END = 4,              //!< End of the records
+    RECORDING_TAG_ERASED = 0xFF,        //!< Erased flash, the recording was cut short
+} recording_tag_t;
+
+//! Start of a recording
+typedef struct {
+    uint32_t magic;                     //!< RECORDING_MAGIC
+    uint16_t version;                   //!< RECORDING_VERSION
+    uint16_t universe_count;            //!< Universes are [0, universe_count)
+    uint32_t sync_interval_us;          //!< Time between sync points
+    uint32_t reserved;
+} __attribute__((packed)) recording_header_t;
+
+//! Index entry, for each sync point
+typedef struct {
+    int64_t time_us;                    //!< Time of the sync point
+    uint64_t offset;                    //!< Offset of the sync record
+} __attribute__((packed)) recording_index_entry_t;
+
+//! End of a recording, after the index
+typedef struct {
+    uint64_t index_offset;              //!< Offset of the index
+    uint32_t index_count;               //!< Entries in the index
+    uint32_t magic;                     //!< RECORDING_INDEX_MAGIC
+} __attribute__((packed)) recording_trailer_t;
+
+//! A frame of one universe
+typedef struct {
+    int64_t time_us;                    //!< Time the frame was recorded
+    uint16_t universe;
+    uint8_t sequence;
+    uint16_t length;
+    const uint8_t *data;                //!< Frame data
+} recording_frame_t;
+
+//! \brief Called to write out part of a recording
+//!
+//! \param context Context pointer given to recording_writer_init()
+//! \param data Data to append to the recording
+//! \param length Length of the data
+//! \return True if all of it was written. If not, none of it should have been.
+typedef bool (*recording_write_cb_t)(void *context, const uint8_t *data, size_t length);
+
+typedef struct {
+    uint64_t frames;                    //!< Frames recorded
+    uint64_t deltas;                    //!< Frames recorded as deltas
+    uint64_t dropped;                   //!< Frames that couldn't be written
+    uint64_t bytes;                     //!< Bytes written
+    uint64_t frame_bytes;               //!< Bytes of frame data recorded, before compression
+} recording_writer_stats_t;
+
+typedef struct {
+    recording_write_cb_t write;
+    void *context;
+    uint16_t universe_count;
+    uint32_t sync_interval_us;
+    uint8_t *frames;                    //!< Last recorded frame of each universe
+    uint16_t *lengths;                  //!< Length of each of them, 0 if none since the sync point
+    bool synced;                        //!< True once a sync point has been written
+    int64_t time_us;                    //!< Time of the last record
+    int64_t sync_us;                    //!< Time of the last sync point
+    uint64_t offset;                    //!< Bytes written so far
+    recording_index_entry_t *index;     //!< Sync points written so far
+    uint32_t index_count;
+    uint32_t index_reserved;
+    recording_writer_stats_t stats;
+    uint8_t record[RECORDING_MAX_RECORD]; //!< Record being encoded
+} recording_writer_t;
+
+typedef struct {
+    const uint8_t *data;                //!< Recording
+    size_t length;                      //!< Length of the recording, up to the end of the records
+    uint16_t universe_count;
+    uint32_t sync_interval_us;
+    const uint8_t *index;               //!< Index, or NULL if the recording has none
+    uint32_t index_count;
+    size_t position;                    //!< Offset of the next record
+    int64_t time_us;                    //!< Time of the last record
+    bool synced;                        //!< True once a sync point has been read
+    uint8_t *frames;                    //!< Current frame of each universe
+    uint16_t *lengths;                  //!< Length of each of them, 0 if none since the sync point
+} recording_reader_t;
+
+//! \brief Called by the player for each frame, when it is due
+//!
+//! \param context Context pointer given to recording_player_poll()
+//! \param frame Frame, only valid during the call
+//! \return True if the frame was sent, false to be called with it again later
+typedef bool (*recording_output_cb_t)(void *context, const recording_frame_t *frame);
+
+typedef struct {
+    recording_reader_t *reader;
+    float speed;                        //!< Playback speed, or 0 to play as fast as frames are taken
+    bool started;
+    bool ended;                         //!< True once the end of the recording was reached
+    bool corrupt;                       //!< True if it ended early, at a record that couldn't be read
+    int64_t start_local_us;             //!< Local time playback started
+    int64_t start_time_us;              //!< Recording time playback started at
+    bool pending;                       //!< True if frame was read, but not yet taken
+    recording_frame_t frame;
+    uint64_t frames;                    //!< Frames played
+} recording_player_t;
+
+//! \brief Start a recording
+//!
+//! This writes the header.
+//!
+//! \param writer Writer to initialize
+//! \param universe_count Universes [0, universe_count) can be recorded
+//! \param sync_interval_us Time between sync points. Shorter makes seeking faster, and the recording larger.
+//! \param write Called to write the recording out, in order
+//! \param context Passed to write
+//! \return True if successful
+bool recording_writer_init(recording_writer_t *writer, uint16_t universe_count, uint32_t sync_interval_us,
+                           recording_write_cb_t write, void *context);
+
+//! \brief Record a frame
+//!
+//! \param writer Writer
+//! \param time_us Time of the frame, which should not go backwards
+//! \param universe Universe
+//! \param sequence Sequence number of the frame
+//! \param data Frame data
+//! \param length Length of the frame data, up to RECORDING_MAX_FRAME
+//! \return True if it was written
+bool recording_writer_frame(recording_writer_t *writer, int64_t time_us, uint16_t universe, uint8_t sequence,
+                            const uint8_t *data, uint16_t length);
+
+//! \brief End a recording, writing the index and trailer
+//!
+//! \return True if successful
+bool recording_writer_finish(recording_writer_t *writer);
+
+//! \brief Free the memory used by a writer
+void recording_writer_free(recording_writer_t *writer);
+
+//! \brief Open a recording
+//!
+//! \param reader Reader to initialize
+//! \param data Recording, which has to stay valid while it is read
+//! \param length Length of the recording, including any erased flash after it
+//! \return True if it is a recording that can be read
+bool recording_reader_init(recording_reader_t *reader, const uint8_t *data, size_t length);
+
+//! \brief Free the memory used by a reader
+void recording_reader_free(recording_reader_t *reader);
+
+//! \brief Read the next frame
+//!
+//! \param reader Reader
+//! \param frame Set to the frame. The data is valid until the next frame of the same universe is read.
+//! \return 1 if a frame was read, 0 at the end of the recording, or -1 if a record couldn't be read
+int recording_reader_next(recording_reader_t *reader, recording_frame_t *frame);
+
+//! \brief Move back to the start of the recording
+void recording_reader_rewind(recording_reader_t *reader);
+
+//! \brief Move to the last sync point at or before a time
+//!
+//! Recordings without an index are scanned from the start.
+//!
+//! \param reader Reader
+//! \param time_us Time to seek to
+//! \return True if successful, false if the recording starts after the time
+bool recording_reader_seek(recording_reader_t *reader, int64_t time_us);
+
+//! \brief Set up playback from a reader's current position
+//!
+//! \param player Player to initialize
+//! \param reader Reader to play from
+//! \param speed Playback speed, 1 for the original timing, or 0 for as fast as possible
+void recording_player_init(recording_player_t *player, recording_reader_t *reader, float speed);
+
+//! \brief Pass on every frame that is due
+//!
+//! \param player Player
+//! \param now_us Local time
+//! \param output Called for each frame
+//! \param context Passed to output
+//! \return Local time the next frame is due, INT64_MAX at the end of the recording, or now_us if
+//!         output didn't take a frame, and it should be offered again shortly
+int64_t recording_player_poll(recording_player_t *player, int64_t now_us, recording_output_cb_t output,
+                              void *context);
@@ -0,0 +1,358 @@
+#include <string.h>
+#include <stdlib.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_partition.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+#include "espnow_transponder.h"
+#include "artdmx.h"
+#include "recorder.h"
+
+static const char *TAG = "recorder";
+
+// Sector buffers between the recorder and the flash task. Each holds one
+// flash sector, so enough of them cover a sector erase and write.
+#define RECORDER_BUFFERS            4
+
+static const esp_partition_t *partition = NULL;
+static SemaphoreHandle_t recorder_lock = NULL;  //!< Guards everything below but the flash task's state
+static TaskHandle_t flash_task_hdl = NULL;
+static volatile bool recording = false;
+static recording_writer_t writer;
+static recorder_stats_t recorder_stats;
+
+static uint8_t *buffers[RECORDER_BUFFERS];
+static xQueueHandle free_queue = NULL;      //!< Indexes of empty buffers
+static xQueueHandle full_queue = NULL;      //!< Indexes of buffers to be written to flash, in order
+static int fill_index = -1;                 //!< Buffer being filled, or -1
+static size_t fill_length = 0;              //!< Bytes in it
+static size_t reserved_bytes = 0;           //!< Bytes handed to the buffers since recording started
+static bool blocking = false;               //!< Wait for buffers rather than dropping, when finishing
+
+static size_t flash_offset = 0;             //!< Where the flash task writes the next sector
+
+static bool replaying = false;
+static spi_flash_mmap_handle_t replay_mapping;
+static recording_reader_t replay_reader;
+static recording_player_t replay_player;
+static float replay_speed;
+static bool replay_loop;
+static uint32_t replay_sync_delay_us;
+static bool replay_frame_open = false;      //!< True if universes were sent since the last frame ended
+static uint8_t replay_sequence;             //!< Sequence number of the frame being sent
+static recorder_replay_stats_t replay_stats;
+
+//! \brief Writes full buffers to flash
+static void flash_task(void *pvParameter)
+{
+    while(true) {
+        int index;
+        if(xQueueReceive(full_queue, &index, portMAX_DELAY) != pdTRUE)
+            continue;
+
+        const esp_err_t ret = esp_partition_write(partition, flash_offset, buffers[index], SPI_FLASH_SEC_SIZE);
+        if(ret != ESP_OK)
+            ESP_LOGE(TAG, "Write at offset %u fail, err:%i", flash_offset, ret);
+        flash_offset += SPI_FLASH_SEC_SIZE;
+
+        xSemaphoreTake(recorder_lock, portMAX_DELAY);
+        recorder_stats.flash_bytes += SPI_FLASH_SEC_SIZE;
+        xSemaphoreGive(recorder_lock);
+
+        xQueueSend(free_queue, &index, portMAX_DELAY);
+    }
+}
+
+//! \brief Copy part of the recording into the sector buffers
+//!
+//! Records are either taken whole, or not at all, so that a dropped frame
+//! doesn't leave half a record in the recording.
+static bool flash_sink(void *context, const uint8_t *data, size_t length)
+{
+    if(reserved_bytes + length > partition->size) {
+        recorder_stats.full = true;
+        return false;
+    }
+
+    const size_t filled = fill_index >= 0 ? fill_length : 0;
+    const UBaseType_t needed = (filled + length + SPI_FLASH_SEC_SIZE - 1)/SPI_FLASH_SEC_SIZE - (fill_index >= 0 ? 1 : 0);
+    if(!blocking && uxQueueMessagesWaiting(free_queue) < needed)
+        return false;
+
+    reserved_bytes += length;
+    while(length > 0) {
+        if(fill_index < 0) {
+            xQueueReceive(free_queue, &fill_index, portMAX_DELAY);
+            fill_length = 0;
+        }
+
+        const size_t count = length < SPI_FLASH_SEC_SIZE - fill_length ? length : SPI_FLASH_SEC_SIZE - fill_length;
+        memcpy(buffers[fill_index] + fill_length, data, count);
+        fill_length += count;
+        data += count;
+        length -= count;
+
+        if(fill_length == SPI_FLASH_SEC_SIZE) {
+            xQueueSend(full_queue, &fill_index, portMAX_DELAY);
+            fill_index = -1;
+        }
+    }
+
+    return true;
+}
+
+//! \brief Set up the buffers and flash task, the first time recording starts
+static esp_err_t recorder_init()
+{
+    recorder_lock = xSemaphoreCreateMutex();
+    free_queue = xQueueCreate(RECORDER_BUFFERS, sizeof(int));
+    full_queue = xQueueCreate(RECORDER_BUFFERS, sizeof(int));
+    if(recorder_lock == NULL || free_queue == NULL || full_queue == NULL) {
+        ESP_LOGE(TAG, "Create queues fail");
+        return ESP_FAIL;
+    }
+
+    for(int index = 0; index < RECORDER_BUFFERS; index++) {
+        buffers[index] = malloc(SPI_FLASH_SEC_SIZE);
+        if(buffers[index] == NULL) {
+            ESP_LOGE(TAG, "Could not allocate memory for buffers");
+            return ESP_ERR_NO_MEM;
+        }
+        xQueueSend(free_queue, &index, 0);
+    }
+
+    // Below the transponder tasks, so that flash writes don't hold up sending
+    if(xTaskCreate(flash_task, "recorder_flash", 2048, NULL, 3, &flash_task_hdl) != pdPASS) {
+        ESP_LOGE(TAG, "Create task fail");
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t recorder_start(const char *partition_label, uint16_t universe_count)
+{
+    if(recording)
+        return ESP_ERR_INVALID_STATE;
+
+    if(flash_task_hdl == NULL) {
+        const esp_err_t ret = recorder_init();
+        if(ret != ESP_OK)
+            return ret;
+    }
+
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if(partition == NULL) {
+        ESP_LOGE(TAG, "No partition '%s'", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Erasing everything up front means the trailer is the last thing
+    // before erased flash, where the reader looks for it
+    const int64_t erase_start_us = esp_timer_get_time();
+    esp_err_t ret = esp_partition_erase_range(partition, 0, partition->size);
+    if(ret != ESP_OK) {
+        ESP_LOGE(TAG, "Erase fail, err:%i", ret);
+        return ret;
+    }
+    ESP_LOGI(TAG, "Erased %u bytes in %lli ms", partition->size, (esp_timer_get_time() - erase_start_us)/1000);
+
+    xSemaphoreTake(recorder_lock, portMAX_DELAY);
+    memset(&recorder_stats, 0, sizeof(recorder_stats));
+    flash_offset = 0;
+    reserved_bytes = 0;
+    fill_index = -1;
+
+    if(recording_writer_init(&writer, universe_count, RECORDER_SYNC_INTERVAL_US, flash_sink, NULL)) {
+        recording = true;
+        ret = ESP_OK;
+    }
+    else {
+        ESP_LOGE(TAG, "Could not start recording");
+        ret = ESP_ERR_NO_MEM;
+    }
+    xSemaphoreGive(recorder_lock);
+
+    return ret;
+}
+
+void recorder_frame(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length)
+{
+    if(!recording)
+        return;
+
+    xSemaphoreTake(recorder_lock, portMAX_DELAY);
+    if(recording)
+        recording_writer_frame(&writer, esp_timer_get_time(), universe, sequence, data, data_length);
+    xSemaphoreGive(recorder_lock);
+}
+
+esp_err_t recorder_stop()
+{
+    if(!recording)
+        return ESP_ERR_INVALID_STATE;
+
+    xSemaphoreTake(recorder_lock, portMAX_DELAY);
+    recording = false;
+
+    // The index has to be written even if the flash is behind
+    blocking = true;
+    const bool finished = recording_writer_finish(&writer);
+    if(fill_index >= 0) {
+        memset(buffers[fill_index] + fill_length, 0xFF, SPI_FLASH_SEC_SIZE - fill_length);
+        xQueueSend(full_queue, &fill_index, portMAX_DELAY);
+        fill_index = -1;
+    }
+    blocking = false;
+
+    recorder_stats.writer = writer.stats;
+    recording_writer_free(&writer);
+    xSemaphoreGive(recorder_lock);
+
+    while(uxQueueMessagesWaiting(free_queue) < RECORDER_BUFFERS)
+        vTaskDelay(1);
+
+    if(!finished) {
+        ESP_LOGE(TAG, "Partition full, recording has no index");
+        return ESP_ERR_NO_MEM;
+    }
+
+    return ESP_OK;
+}
+
+void recorder_get_statistics(recorder_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if(recorder_lock == NULL)
+        return;
+
+    xSemaphoreTake(recorder_lock, portMAX_DELAY);
+    *stats = recorder_stats;
+    if(recording)
+        stats->writer = writer.stats;
+    xSemaphoreGive(recorder_lock);
+}
+
+//! \brief End the frame being sent
+static void replay_frame_end()
+{
+    if(replay_sync_delay_us > 0 && artdmx_send_sync(replay_sequence, replay_sync_delay_us) != ESP_OK)
+        replay_stats.sync_fail++;
+
+    espnow_transponder_frame_end();
+    replay_frame_open = false;
+}
+
+//! \brief Send a replayed frame
+static bool replay_output(void *context, const recording_frame_t *frame)
+{
+    if(replay_frame_open && frame->sequence != replay_sequence)
+        replay_frame_end();
+
+    // Retry once the transmit queue has room. Fragments that did go out
+    // are sent again, which receivers ignore.
+    if(artdmx_send(frame->universe, frame->sequence, frame->data, frame->length) == ESP_ERR_NO_MEM) {
+        replay_stats.retries++;
+        return false;
+    }
+
+    replay_sequence = frame->sequence;
+    replay_frame_open = true;
+    replay_stats.frames++;
+    return true;
+}
+
+//! \brief Plays the recording, to within a tick of its timing
+static void replay_task(void *pvParameter)
+{
+    while(true) {
+        const int64_t now_us = esp_timer_get_time();
+        const int64_t next_us = recording_player_poll(&replay_player, now_us, replay_output, NULL);
+
+        // The player reads a frame ahead, so a frame can be ended as soon
+        // as the next one turns up, rather than when it is due
+        if(replay_frame_open && (!replay_player.pending || replay_player.frame.sequence != replay_sequence))
+            replay_frame_end();
+
+        if(next_us == INT64_MAX) {
+            if(!replay_loop || replay_player.corrupt || replay_player.frames == 0)
+                break;
+
+            recording_reader_rewind(&replay_reader);
+            recording_player_init(&replay_player, &replay_reader, replay_speed);
+            replay_stats.loops++;
+            continue;
+        }
+
+        const TickType_t ticks = (next_us - now_us)/1000/portTICK_PERIOD_MS;
+        vTaskDelay(ticks > 0 ? ticks : 1);
+    }
+
+    replay_stats.corrupt = replay_player.corrupt;
+    ESP_LOGI(TAG, "Replay %s after %llu frames", replay_player.corrupt ? "stopped at a bad record" : "ended",
+             replay_stats.frames);
+
+    recording_reader_free(&replay_reader);
+    spi_flash_munmap(replay_mapping);
+    replay_stats.playing = false;
+    replaying = false;
+    vTaskDelete(NULL);
+}
+
+esp_err_t recorder_replay_start(const char *partition_label, float speed, bool loop, uint32_t sync_delay_us)
+{
+    if(replaying)
+        return ESP_ERR_INVALID_STATE;
+
+    const esp_partition_t *replay_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+                                                                        ESP_PARTITION_SUBTYPE_ANY, partition_label);
+    if(replay_partition == NULL) {
+        ESP_LOGE(TAG, "No partition '%s'", partition_label);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const void *data;
+    esp_err_t ret = esp_partition_mmap(replay_partition, 0, replay_partition->size, SPI_FLASH_MMAP_DATA,
+                                       &data, &replay_mapping);
+    if(ret != ESP_OK) {
+        ESP_LOGE(TAG, "Map partition fail, err:%i", ret);
+        return ret;
+    }
+
+    if(!recording_reader_init(&replay_reader, data, replay_partition->size)) {
+        ESP_LOGE(TAG, "No recording in partition '%s'", partition_label);
+        spi_flash_munmap(replay_mapping);
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(&replay_stats, 0, sizeof(replay_stats));
+    replay_speed = speed;
+    replay_loop = loop;
+    replay_sync_delay_us = sync_delay_us;
+    replay_frame_open = false;
+    recording_player_init(&replay_player, &replay_reader, speed);
+    replaying = true;
+    replay_stats.playing = true;
+
+    if(xTaskCreate(replay_task, "recorder_replay", 3072, NULL, 5, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Create task fail");
+        recording_reader_free(&replay_reader);
+        spi_flash_munmap(replay_mapping);
+        replaying = false;
+        replay_stats.playing = false;
+        return ESP_FAIL;
+    }
+
+    ESP_LOGI(TAG, "Replaying %u universes, %u sync points indexed", replay_reader.universe_count,
+             replay_reader.index_count);
+    return ESP_OK;
+}
+
+void recorder_replay_get_statistics(recorder_replay_stats_t *stats)
+{
+    memcpy(stats, &replay_stats, sizeof(recorder_replay_stats_t));
+}
@@ -0,0 +1,500 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "recording.h"
+
+// Index entries written at a time, to keep the writes small
+#define RECORDING_INDEX_CHUNK       32
+
+// Equal slots between changed ones that are cheaper to send as part of the
+// run than to skip with a run of their own
+#define RECORDING_RUN_MERGE         3
+
+//! Result of reading one record
+typedef enum {
+    RECORD_FRAME,
+    RECORD_SYNC,
+    RECORD_END,
+    RECORD_CORRUPT,
+} record_result_t;
+
+//! \brief Encode a varint
+//!
+//! \return Number of bytes written, up to 10
+static size_t varint_put(uint8_t *out, uint64_t value)
+{
+    size_t length = 0;
+    while(value >= 0x80) {
+        out[length++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    out[length++] = value;
+    return length;
+}
+
+//! \brief Decode a varint from the recording
+//!
+//! \return True if successful
+static bool varint_get(const recording_reader_t *reader, size_t *position, uint64_t *value)
+{
+    *value = 0;
+    for(int shift = 0; shift < 64 && *position < reader->length; shift += 7) {
+        const uint8_t byte = reader->data[(*position)++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if((byte & 0x80) == 0)
+            return true;
+    }
+
+    return false;
+}
+
+//! \brief Hand data to the write callback, and count it
+static bool writer_write(recording_writer_t *writer, const void *data, size_t length)
+{
+    if(!writer->write(writer->context, data, length))
+        return false;
+
+    writer->offset += length;
+    writer->stats.bytes += length;
+    return true;
+}
+
+bool recording_writer_init(recording_writer_t *writer, uint16_t universe_count, uint32_t sync_interval_us,
+                           recording_write_cb_t write, void *context)
+{
+    memset(writer, 0, sizeof(*writer));
+    writer->write = write;
+    writer->context = context;
+    writer->universe_count = universe_count;
+    writer->sync_interval_us = sync_interval_us;
+
+    writer->frames = malloc(universe_count*RECORDING_MAX_FRAME);
+    writer->lengths = calloc(universe_count, sizeof(uint16_t));
+    if(universe_count == 0 || writer->frames == NULL || writer->lengths == NULL) {
+        recording_writer_free(writer);
+        return false;
+    }
+
+    const recording_header_t header = {
+        .magic = RECORDING_MAGIC,
+        .version = RECORDING_VERSION,
+        .universe_count = universe_count,
+        .sync_interval_us = sync_interval_us,
+    };
+    if(!writer_write(writer, &header, sizeof(header))) {
+        recording_writer_free(writer);
+        return false;
+    }
+
+    return true;
+}
+
+void recording_writer_free(recording_writer_t *writer)
+{
+    free(writer->frames);
+    free(writer->lengths);
+    free(writer->index);
+    writer->frames = NULL;
+    writer->lengths = NULL;
+    writer->index = NULL;
+}
+
+//! \brief Start a sync point
+static bool writer_sync(recording_writer_t *writer, int64_t time_us)
+{
+    uint8_t record[1 + sizeof(int64_t)] = { RECORDING_TAG_SYNC };
+    memcpy(&record[1], &time_us, sizeof(time_us));
+
+    const uint64_t offset = writer->offset;
+    if(!writer_write(writer, record, sizeof(record)))
+        return false;
+
+    // Without room for the entry, the sync point just isn't indexed, and
+    // seeking to it starts from the one before
+    if(writer->index_count == writer->index_reserved) {
+        const uint32_t reserved = writer->index_reserved > 0 ? writer->index_reserved*2 : 64;
+        recording_index_entry_t *index = realloc(writer->index, reserved*sizeof(recording_index_entry_t));
+        if(index != NULL) {
+            writer->index = index;
+            writer->index_reserved = reserved;
+        }
+    }
+    if(writer->index_count < writer->index_reserved)
+        writer->index[writer->index_count++] = (recording_index_entry_t){ .time_us = time_us, .offset = offset };
+
+    writer->synced = true;
+    writer->sync_us = time_us;
+    writer->time_us = time_us;
+    memset(writer->lengths, 0, writer->universe_count*sizeof(uint16_t));
+    return true;
+}
+
+//! \brief Encode a frame as runs of the slots that changed
+//!
+//! Each run is the number of unchanged slots before it, the number of slots
+//! in it, then the slots. The runs cover the whole frame.
+//!
+//! \return Length of the runs, or 0 if they would take more than limit bytes
+static size_t delta_encode(uint8_t *out, size_t limit, const uint8_t *previous, const uint8_t *data, uint16_t length)
+{
+    size_t encoded = 0;
+    uint16_t position = 0;
+
+    while(position < length) {
+        const uint16_t gap_start = position;
+        while(position < length && data[position] == previous[position])
+            position++;
+
+        const uint16_t run_start = position;
+        while(position < length) {
+            if(data[position] != previous[position]) {
+                position++;
+                continue;
+            }
+
+            // Take short stretches of unchanged slots into the run
+            uint16_t end = position;
+            while(end < length && data[end] == previous[end] && end - position < RECORDING_RUN_MERGE)
+                end++;
+            if(end - position == RECORDING_RUN_MERGE || end == length)
+                break;
+            position = end;
+        }
+
+        const uint16_t run_length = position - run_start;
+        if(encoded + 2*3 + run_length > limit)
+            return 0;
+
+        encoded += varint_put(out + encoded, run_start - gap_start);
+        encoded += varint_put(out + encoded, run_length);
+        memcpy(out + encoded, data + run_start, run_length);
+        encoded += run_length;
+    }
+
+    return encoded;
+}
+
+bool recording_writer_frame(recording_writer_t *writer, int64_t time_us, uint16_t universe, uint8_t sequence,
+                            const uint8_t *data, uint16_t length)
+{
+    if(universe >= writer->universe_count || length == 0 || length > RECORDING_MAX_FRAME)
+        return false;
+
+    if(time_us < writer->time_us)
+        time_us = writer->time_us;
+
+    if(!writer->synced || time_us - writer->sync_us >= writer->sync_interval_us) {
+        if(!writer_sync(writer, time_us)) {
+            writer->stats.dropped++;
+            return false;
+        }
+    }
+
+    uint8_t *record = writer->record;
+    size_t record_length = 1;
+    record_length += varint_put(record + record_length, time_us - writer->time_us);
+    record_length += varint_put(record + record_length, universe);
+    record[record_length++] = sequence;
+    record_length += varint_put(record + record_length, length);
+
+    uint8_t *previous = &writer->frames[universe*RECORDING_MAX_FRAME];
+    size_t delta_length = 0;
+    if(writer->lengths[universe] == length)
+        delta_length = delta_encode(record + record_length, length - 1, previous, data, length);
+
+    if(delta_length > 0) {
+        record[0] = RECORDING_TAG_DELTA;
+        record_length += delta_length;
+    }
+    else {
+        record[0] = RECORDING_TAG_FULL;
+        memcpy(record + record_length, data, length);
+        record_length += length;
+    }
+
+    // The previous frame only moves on if this one was written, so that
+    // the next delta is against what is in the recording
+    if(!writer_write(writer, record, record_length)) {
+        writer->stats.dropped++;
+        return false;
+    }
+
+    memcpy(previous, data, length);
+    writer->lengths[universe] = length;
+    writer->time_us = time_us;
+    writer->stats.frames++;
+    writer->stats.frame_bytes += length;
+    if(delta_length > 0)
+        writer->stats.deltas++;
+
+    return true;
+}
+
+bool recording_writer_finish(recording_writer_t *writer)
+{
+    const uint8_t end = RECORDING_TAG_END;
+    if(!writer_write(writer, &end, sizeof(end)))
+        return false;
+
+    const recording_trailer_t trailer = {
+        .index_offset = writer->offset,
+        .index_count = writer->index_count,
+        .magic = RECORDING_INDEX_MAGIC,
+    };
+
+    for(uint32_t entry = 0; entry < writer->index_count; entry += RECORDING_INDEX_CHUNK) {
+        const uint32_t count = writer->index_count - entry < RECORDING_INDEX_CHUNK
+            ? writer->index_count - entry : RECORDING_INDEX_CHUNK;
+        if(!writer_write(writer, &writer->index[entry], count*sizeof(recording_index_entry_t)))
+            return false;
+    }
+
+    return writer_write(writer, &trailer, sizeof(trailer));
+}
+
+bool recording_reader_init(recording_reader_t *reader, const uint8_t *data, size_t length)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    recording_header_t header;
+    if(length < sizeof(header))
+        return false;
+
+    memcpy(&header, data, sizeof(header));
+    if(header.magic != RECORDING_MAGIC || header.version != RECORDING_VERSION || header.universe_count == 0)
+        return false;
+
+    reader->data = data;
+    reader->length = length;
+    reader->universe_count = header.universe_count;
+    reader->sync_interval_us = header.sync_interval_us;
+    reader->position = sizeof(header);
+
+    // Look for the trailer, past any erased flash
+    size_t end = length;
+    while(end > sizeof(header) && data[end - 1] == RECORDING_TAG_ERASED)
+        end--;
+
+    recording_trailer_t trailer;
+    if(end >= sizeof(header) + sizeof(trailer)) {
+        memcpy(&trailer, data + end - sizeof(trailer), sizeof(trailer));
+        if(trailer.magic == RECORDING_INDEX_MAGIC && trailer.index_offset >= sizeof(header)
+            && trailer.index_offset + (uint64_t)trailer.index_count*sizeof(recording_index_entry_t)
+                + sizeof(trailer) == end) {
+            reader->index = data + trailer.index_offset;
+            reader->index_count = trailer.index_count;
+            reader->length = trailer.index_offset;
+        }
+    }
+
+    reader->frames = malloc(reader->universe_count*RECORDING_MAX_FRAME);
+    reader->lengths = calloc(reader->universe_count, sizeof(uint16_t));
+    if(reader->frames == NULL || reader->lengths == NULL) {
+        recording_reader_free(reader);
+        return false;
+    }
+
+    return true;
+}
+
+void recording_reader_free(recording_reader_t *reader)
+{
+    free(reader->frames);
+    free(reader->lengths);
+    reader->frames = NULL;
+    reader->lengths = NULL;
+}
+
+//! \brief Decode the runs of a delta frame into the universe's current frame
+static bool delta_decode(recording_reader_t *reader, size_t *position, uint8_t *frame, uint16_t length)
+{
+    uint16_t offset = 0;
+    while(offset < length) {
+        uint64_t gap, run_length;
+        if(!varint_get(reader, position, &gap) || !varint_get(reader, position, &run_length)
+            || (gap == 0 && run_length == 0) || offset + gap + run_length > length
+            || *position + run_length > reader->length)
+            return false;
+
+        offset += gap;
+        memcpy(frame + offset, reader->data + *position, run_length);
+        offset += run_length;
+        *position += run_length;
+    }
+
+    return true;
+}
+
+//! \brief Read one record
+static record_result_t record_read(recording_reader_t *reader, recording_frame_t *frame)
+{
+    if(reader->position >= reader->length)
+        return RECORD_END;
+
+    size_t position = reader->position;
+    const uint8_t tag = reader->data[position++];
+
+    if(tag == RECORDING_TAG_END || tag == RECORDING_TAG_ERASED)
+        return RECORD_END;
+
+    if(tag == RECORDING_TAG_SYNC) {
+        if(position + sizeof(int64_t) > reader->length)
+            return RECORD_CORRUPT;
+
+        memcpy(&reader->time_us, reader->data + position, sizeof(int64_t));
+        memset(reader->lengths, 0, reader->universe_count*sizeof(uint16_t));
+        reader->synced = true;
+        reader->position = position + sizeof(int64_t);
+        return RECORD_SYNC;
+    }
+
+    if((tag != RECORDING_TAG_FULL && tag != RECORDING_TAG_DELTA) || !reader->synced)
+        return RECORD_CORRUPT;
+
+    uint64_t delta_us, universe, length;
+    if(!varint_get(reader, &position, &delta_us) || !varint_get(reader, &position, &universe)
+        || position >= reader->length)
+        return RECORD_CORRUPT;
+
+    const uint8_t sequence = reader->data[position++];
+    if(!varint_get(reader, &position, &length)
+        || universe >= reader->universe_count || length == 0 || length > RECORDING_MAX_FRAME)
+        return RECORD_CORRUPT;
+
+    uint8_t *data = &reader->frames[universe*RECORDING_MAX_FRAME];
+    if(tag == RECORDING_TAG_FULL) {
+        if(position + length > reader->length)
+            return RECORD_CORRUPT;
+
+        memcpy(data, reader->data + position, length);
+        position += length;
+    }
+    else if(reader->lengths[universe] != length || !delta_decode(reader, &position, data, length))
+        return RECORD_CORRUPT;
+
+    reader->lengths[universe] = length;
+    reader->time_us += delta_us;
+    reader->position = position;
+
+    frame->time_us = reader->time_us;
+    frame->universe = universe;
+    frame->sequence = sequence;
+    frame->length = length;
+    frame->data = data;
+    return RECORD_FRAME;
+}
+
+int recording_reader_next(recording_reader_t *reader, recording_frame_t *frame)
+{
+    while(true) {
+        switch(record_read(reader, frame)) {
+        case RECORD_FRAME:
+            return 1;
+        case RECORD_SYNC:
+            continue;
+        case RECORD_END:
+            return 0;
+        case RECORD_CORRUPT:
+            return -1;
+        }
+    }
+}
+
+void recording_reader_rewind(recording_reader_t *reader)
+{
+    reader->position = sizeof(recording_header_t);
+    reader->synced = false;
+}
+
+bool recording_reader_seek(recording_reader_t *reader, int64_t time_us)
+{
+    size_t offset = 0;
+
+    if(reader->index != NULL) {
+        // Last entry at or before the time
+        uint32_t low = 0, high = reader->index_count;
+        while(low < high) {
+            const uint32_t middle = (low + high)/2;
+            recording_index_entry_t entry;
+            memcpy(&entry, reader->index + middle*sizeof(entry), sizeof(entry));
+            if(entry.time_us <= time_us)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        if(low == 0)
+            return false;
+
+        recording_index_entry_t entry;
+        memcpy(&entry, reader->index + (low - 1)*sizeof(entry), sizeof(entry));
+        if(entry.offset < sizeof(recording_header_t) || entry.offset >= reader->length)
+            return false;
+        offset = entry.offset;
+    }
+    else {
+        // Without an index, read through the recording for the sync points
+        recording_reader_rewind(reader);
+
+        recording_frame_t frame;
+        size_t position = reader->position;
+        record_result_t result;
+        while((result = record_read(reader, &frame)) == RECORD_FRAME || result == RECORD_SYNC) {
+            if(result == RECORD_SYNC) {
+                if(reader->time_us > time_us)
+                    break;
+                offset = position;
+            }
+            position = reader->position;
+        }
+        if(offset == 0)
+            return false;
+    }
+
+    reader->position = offset;
+    reader->synced = false;
+    return true;
+}
+
+void recording_player_init(recording_player_t *player, recording_reader_t *reader, float speed)
+{
+    memset(player, 0, sizeof(*player));
+    player->reader = reader;
+    player->speed = speed;
+}
+
+int64_t recording_player_poll(recording_player_t *player, int64_t now_us, recording_output_cb_t output,
+                              void *context)
+{
+    while(!player->ended) {
+        if(!player->pending) {
+            const int result = recording_reader_next(player->reader, &player->frame);
+            if(result <= 0) {
+                player->ended = true;
+                player->corrupt = result < 0;
+                break;
+            }
+            player->pending = true;
+        }
+
+        if(!player->started) {
+            player->started = true;
+            player->start_local_us = now_us;
+            player->start_time_us = player->frame.time_us;
+        }
+
+        if(player->speed > 0) {
+            const int64_t due_us = player->start_local_us
+                + (int64_t)((player->frame.time_us - player->start_time_us)/player->speed);
+            if(due_us > now_us)
+                return due_us;
+        }
+
+        if(!output(context, &player->frame))
+            return now_us;
+
+        player->pending = false;
+        player->frames++;
+    }
+
+    return INT64_MAX;
+}
@@ -2,108 +2,154 @@
 //!
 //! To use, compile with 'ROLE_SENDER' defined and flash to one device, then
 //! compile with 'ROLE_SENDER' undefined and flash to one or more devices.
+//!
+//! To forward Art-Net from a lighting console instead of sending test
+//! patterns, compile with 'ROLE_GATEWAY' defined. The gateway joins the
+//! WiFi network set in the example configuration, which has to be on the
+//! same channel as the transponder.
+//!
+//! Receivers can record what they get into the 'recording' partition; to
+//! play a recording back out instead of test patterns, compile with
+//! 'ROLE_REPLAY' defined along with 'ROLE_SENDER'.
 
 #include <string.h>
+#include <stdio.h>
 #include <esp_log.h>
 #include <esp_err.h>
-#include <math.h>
+#include <esp_timer.h>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/timers.h>
+#include <esp_wifi.h>
 
 #include "espnow_transponder.h"
+#include "artdmx.h"
+#include "frame_store.h"
+#include "artnet_gateway.h"
+#include "pattern.h"
+#include "e131.h"
+#include "recorder.h"
 
 #define UNIVERSE_COUNT 20
 #define FRAMERATE 44
 
+// Send a full frame for each universe at least once a second
+#define KEYFRAME_INTERVAL FRAMERATE
+
+// Receivers present each frame this long after it was sent, all at once.
+// Comment out to present universes as they arrive.
+#define SYNC_DELAY_US 50000
+
 #define ROLE_SENDER
+//#define ROLE_GATEWAY
+//#define ROLE_REPLAY
+
+// Partition that receivers record into, and replay plays from
+#define RECORDING_PARTITION "recording"
+
+// Receivers record for this long after starting. Comment out to not record.
+//#define RECORD_SECONDS 60
 
-#if defined(ROLE_SENDER)
+// To share a channel between several senders, give one of them
+// TDMA_MASTER and the others TDMA_SENDER
+//#define TDMA_MASTER
+//#define TDMA_SENDER
+
+// To reach receivers out of range of the sender, let senders' packets be
+// relayed up to RELAY_HOPS times, and define RELAY on the receivers that
+// should relay them
+//#define RELAY_HOPS 2
+//#define RELAY
+
+// Resend unchanged Art-Net universes at least this often
+#define GATEWAY_REFRESH_US 1000000
+
+#if defined(ROLE_GATEWAY)
+static const char *TAG = "artnet_gw";
+#elif defined(ROLE_SENDER)
 static const char *TAG = "espnow_tx";
 #else
 static const char *TAG = "espnow_rx";
 #endif
 
-//! Data structure for an ARTDMX packet
+//! Latency, jitter and loss of the received universes
+telemetry_t telemetry;
+
+//! \brief Print the telemetry of every universe since the last call
 //!
-//! Note: Unfortunately ESP-NOW packets have a maximum length of 250, so they
-//!       can send a little less than half of a full DMX512 network. This
-//!       implementation just discards any data that doesn't fit. A more
-//!       complete implementation might add an offset field, and fragment the
-//!       Art-Net packet into several ESP-NOW packets.
-typedef struct {
-    uint16_t universe;                  //!< DMX universe for this data
-    uint8_t sequence;                   //!< Sequence number
-    uint8_t data[];                     //!< DMX data
-} __attribute__((packed)) artdmx_packet_t;
-
-typedef struct {
-    uint32_t count;
-    uint32_t oos;
-    uint8_t last_sequence;
-} universe_stats_t;
-
-universe_stats_t universe_stats[UNIVERSE_COUNT];
-
-void universe_stats_print() {
+//! Latency is only meaningful if the sender's clock is synchronized with
+//! this one; jitter and loss don't depend on it.
+void telemetry_print() {
     for(int universe = 0; universe < UNIVERSE_COUNT; universe++) {
-        const universe_stats_t *stat = &(universe_stats[universe]);
-        ESP_LOGI(TAG, "universe:%2i packets:%i oos:%i", universe, stat->count, stat->oos);
+        telemetry_report_t report;
+        if(!telemetry_report(&telemetry, universe, &report))
+            continue;
+
+        ESP_LOGI(TAG, "universe:%2i frames:%u lost:%u reordered:%u jitter p50/p99/p999:%u/%u/%uus latency p50/p99/p999:%u/%u/%uus",
+            universe, report.frames, report.lost, report.reordered,
+            report.jitter_us.p50, report.jitter_us.p99, report.jitter_us.p999,
+            report.latency_us.p50, report.latency_us.p99, report.latency_us.p999);
     }
 }
 
-void universe_stats_init() {
-    for(int universe = 0; universe < UNIVERSE_COUNT; universe++) {
-        universe_stats_t *stat = &(universe_stats[universe]);
-        stat->count = 0;
-        stat->oos = 0;
-        stat->last_sequence = 255;
-    }
+//! @brief Broadcast a frame of universes [0, UNIVERSE_COUNT)
+//!
+//! \param sequence Sequence number
+//! \param data Pointer to the data of every universe, one after another
+//! \param universe_size Length of each universe
+void send_artdmx_frame(uint8_t sequence, const uint8_t *data, uint16_t universe_size) {
+    esp_err_t ret = artdmx_send_frame(0, UNIVERSE_COUNT, sequence, data, universe_size);
+    if(ret != ESP_OK)
+        ESP_LOGE(TAG, "Send error, err=%s", esp_err_to_name(ret));
 }
 
-void universe_stats_record(uint16_t universe, uint8_t sequence) {
-    if(universe >= UNIVERSE_COUNT)
-        return;
+//! Newest received frame of each universe, for the output
+frame_store_t frame_store;
 
-    universe_stats_t *stat = &(universe_stats[universe]);
-    stat->count++;
-    if(sequence != ((stat->last_sequence + 1)%256))
-        stat->oos++;
+// Freeze the pipeline trace when this many frames of a universe go missing
+#define TRACE_TRIGGER_GAP 4
 
-    stat->last_sequence = sequence;
-}
+//! Last sequence number seen for each universe, to spot gaps
+static uint8_t last_sequence[UNIVERSE_COUNT];
 
-//! @brief Broadcast data to the specified universe
-//!
-//! \param universe Art-Net universe to send to
-//! \param sequence Sequence number
-//! \param data Pointer to the data
-//! \param data_len Length of the data
-void send_artdmx_packet(uint16_t universe, uint8_t sequence, const uint8_t *data, uint8_t data_length) {
-    // Wrap the data into a payload with this structure:
-    // payload[0-1]: universe
-    // payload[2]: sequence
-    // payload[3-n]: data
-    // The next higher layer will guarantee data length and CRC, so they are not needed here.
-
-    const int packet_len = data_length + sizeof(artdmx_packet_t);
-    uint8_t packet_buffer[packet_len];
-
-    artdmx_packet_t *header = (artdmx_packet_t *)packet_buffer;
-    header->universe = universe;
-    header->sequence = sequence;
-    memcpy(header->data, data, data_length);
-
-    //ESP_LOGI(TAG, "uni:%i, len:%i d[238]:%02x d[239]:%02x", universe, data_length, data[238], data[239]);
-
-    esp_err_t ret = espnow_transponder_send(packet_buffer, packet_len);
-    if(ret != ESP_OK)
-        ESP_LOGE(TAG, "Send error, err=%s", esp_err_to_name(ret));
+void receive_frame(uint16_t universe, uint8_t sequence, const uint8_t *data, uint16_t data_length) {
+    if(universe < UNIVERSE_COUNT) {
+        if((uint8_t)(sequence - last_sequence[universe] - 1) >= TRACE_TRIGGER_GAP
+            && (uint8_t)(sequence - last_sequence[universe]) < 128)
+            espnow_transponder_trace_trigger(ESPNOW_TRANSPONDER_TRACE_USER);
+        last_sequence[universe] = sequence;
+    }
+
+    frame_store_publish(&frame_store, universe, sequence, data, data_length, esp_timer_get_time());
+
+#if defined(RECORD_SECONDS)
+    recorder_frame(universe, sequence, data, data_length);
+#endif
 }
 
-void receive_packet(const uint8_t *data, uint8_t data_length) {
-    artdmx_packet_t *header = (artdmx_packet_t *)data;
-    universe_stats_record(header->universe, header->sequence);
+//! \brief Print the transmit scheduler status
+void sender_status_print() {
+    espnow_transponder_scheduler_status_t status;
+    espnow_transponder_snapshot_t snapshot;
+    espnow_transponder_get_scheduler_status(&status);
+    espnow_transponder_get_snapshot(&snapshot);
+
+    espnow_transponder_rate_control_status_t rate_status;
+    espnow_transponder_get_rate_control_status(&rate_status);
+
+    ESP_LOGI(TAG, "fps:%.1f queue:%i in_flight:%i tx:%llu/s %llu B/s send_fail:%llu cb_fail:%llu queue_full:%llu phy_rate:%i power:%i loss:%.3f",
+        status.fps, status.queue_depth, status.in_flight,
+        snapshot.per_second.tx_count, snapshot.per_second.tx_bytes,
+        snapshot.totals.tx_send_fail, snapshot.totals.tx_cb_fail, snapshot.totals.tx_queue_full,
+        rate_status.phy_rate, rate_status.power, rate_status.loss);
+
+    espnow_transponder_tdma_status_t tdma_status;
+    espnow_transponder_get_tdma_status(&tdma_status);
+    if(tdma_status.role != ESPNOW_TRANSPONDER_TDMA_OFF)
+        ESP_LOGI(TAG, "tdma synchronized:%i slot:%i/%i slot_us:%u frame_us:%u clock_error:%ius skew:%.1fppm beacons:%u resets:%u",
+            tdma_status.synchronized, tdma_status.slot, tdma_status.slot_count, tdma_status.slot_us,
+            tdma_status.frame_us, tdma_status.clock_error_us, tdma_status.clock_skew*1e6f,
+            tdma_status.beacons, tdma_status.clock_resets);
 }
 
 //! \brief Send test packets at a specified framerate
@@ -112,8 +158,45 @@ void transmitter_test() {
 
     ESP_LOGI(TAG, "Starting sender mode...");
 
-    // Red-to-blue fade
-    const uint8_t universe_size = 240;
+    const artdmx_sender_config_t artdmx_config = {
+        .universe_count = UNIVERSE_COUNT,
+        .keyframe_interval = KEYFRAME_INTERVAL,
+        .timestamps = true,
+#if defined(SYNC_DELAY_US)
+        .sync_delay_us = SYNC_DELAY_US,
+#endif
+    };
+    artdmx_sender_init(&artdmx_config);
+
+#if defined(ROLE_REPLAY)
+#if defined(SYNC_DELAY_US)
+    ESP_ERROR_CHECK(recorder_replay_start(RECORDING_PARTITION, 1, true, SYNC_DELAY_US));
+#else
+    ESP_ERROR_CHECK(recorder_replay_start(RECORDING_PARTITION, 1, true, 0));
+#endif
+    while(true) {
+        vTaskDelay(1000/portTICK_RATE_MS);
+
+        recorder_replay_stats_t replay_stats;
+        recorder_replay_get_statistics(&replay_stats);
+        ESP_LOGI(TAG, "replay frames:%llu retries:%llu sync_fail:%llu loops:%u playing:%i corrupt:%i",
+            replay_stats.frames, replay_stats.retries, replay_stats.sync_fail, replay_stats.loops,
+            replay_stats.playing, replay_stats.corrupt);
+        sender_status_print();
+    }
+#endif
+
+    // Red sine wave running along the strip
+    const pattern_t pattern = {
+        .effect = PATTERN_FADE,
+        .color = { 60, 0, 0 },
+        .brightness = 255,
+        .speed = PATTERN_CYCLE/32,
+        .scale = PATTERN_CYCLE/628,
+    };
+    pattern_init();
+
+    const uint16_t universe_size = ARTDMX_UNIVERSE_SIZE;
 
     uint8_t *buffer = malloc(universe_size*UNIVERSE_COUNT);
     if(buffer == NULL) {
@@ -122,44 +205,242 @@ void transmitter_test() {
     }
 
     uint8_t sequence = 0;
-    float phase = 0;
+    uint32_t frame = 0;
+    TickType_t last_wake_time = xTaskGetTickCount();
     while(true) {
-        for(int led = 0; led<(universe_size*UNIVERSE_COUNT)/3; led++) {
-            buffer[led*3+0] = (int)(30*(sin(phase+led/100.0)+1));
-            buffer[led*3+1] = 0;
-            buffer[led*3+2] = 0;
-        }
+        pattern_render(&pattern, frame, buffer, UNIVERSE_COUNT, universe_size);
+
+        send_artdmx_frame(sequence, buffer, universe_size);
 
-        for(int universe = 0; universe < UNIVERSE_COUNT; universe++)
-            send_artdmx_packet(universe, sequence, buffer+(universe*universe_size), universe_size);
+        espnow_transponder_frame_end();
 
-        phase += .2;
         sequence++;
 
-//        vTaskDelay(framedelay_ms/portTICK_RATE_MS);
+        if(++frame % FRAMERATE == 0)
+            sender_status_print();
+
+        // The transponder spreads the packets over the frame; this just
+        // keeps the generator from getting ahead of it.
+        vTaskDelayUntil(&last_wake_time, framedelay_ms/portTICK_RATE_MS);
     }
 }
 
+//! \brief Print a frozen pipeline trace as hex, for tools/trace_decode.py, and rearm it
+void trace_print() {
+    if(!espnow_transponder_trace_frozen())
+        return;
+
+    const size_t size = espnow_transponder_trace_dump_size();
+    uint8_t *dump = malloc(size);
+    if(dump == NULL) {
+        ESP_LOGE(TAG, "Could not allocate memory for trace dump");
+        return;
+    }
+
+    const int length = espnow_transponder_trace_dump(dump, size);
+    char line[2*32 + 1];
+    for(int offset = 0; offset < length; offset += 32) {
+        int count = 0;
+        for(int index = offset; index < length && index < offset + 32; index++)
+            count += sprintf(line + count, "%02x", dump[index]);
+        printf("trace:%s\n", line);
+    }
+
+    free(dump);
+    espnow_transponder_trace_rearm();
+}
+
 //! \brief Listen for packets, and report on their status periodically
+//!
+//! The output is simulated by picking up the newest frame of every universe
+//! at the frame rate, the way a pixel driver would.
 void receiver_test() {
     ESP_LOGI(TAG, "Starting receiver mode");
+
+#if defined(RECORD_SECONDS)
+    bool recording = recorder_start(RECORDING_PARTITION, UNIVERSE_COUNT) == ESP_OK;
+#endif
+
+    const uint32_t framedelay_ms = (1000/FRAMERATE);
+    uint32_t frame = 0;
+    uint32_t latency_max_us = 0;
+    TickType_t last_wake_time = xTaskGetTickCount();
+
+    while(true) {
+        vTaskDelayUntil(&last_wake_time, framedelay_ms/portTICK_RATE_MS);
+
+        const int64_t now_us = esp_timer_get_time();
+        for(int universe = 0; universe < UNIVERSE_COUNT; universe++) {
+            const frame_store_frame_t *output;
+            if(frame_store_read(&frame_store, universe, &output) && now_us - output->published_us > latency_max_us)
+                latency_max_us = now_us - output->published_us;
+        }
+
+        if(++frame % FRAMERATE != 0)
+            continue;
+
+        telemetry_print();
+        trace_print();
+
+#if defined(RECORD_SECONDS)
+        if(recording) {
+            if(frame >= RECORD_SECONDS*FRAMERATE) {
+                recorder_stop();
+                recording = false;
+            }
+
+            recorder_stats_t record_stats;
+            recorder_get_statistics(&record_stats);
+            ESP_LOGI(TAG, "record frames:%llu deltas:%llu dropped:%llu bytes:%llu/%llu flash:%llu full:%i",
+                record_stats.writer.frames, record_stats.writer.deltas, record_stats.writer.dropped,
+                record_stats.writer.bytes, record_stats.writer.frame_bytes, record_stats.flash_bytes,
+                record_stats.full);
+        }
+#endif
+
+#if defined(SYNC_DELAY_US)
+        frame_sync_report_t sync;
+        artdmx_receiver_get_sync_report(&sync);
+        ESP_LOGI(TAG, "sync committed:%u timed_out:%u late:%u skipped:%u lateness p50:%uus p99:%uus max:%uus clock_error:%ius skew:%.1fppm resets:%u",
+            sync.stats.committed, sync.stats.timed_out, sync.stats.late_commits, sync.stats.skipped,
+            sync.lateness_us.p50, sync.lateness_us.p99, sync.lateness_us.max, sync.clock_error_us,
+            sync.clock_skew*1e6f, sync.clock_resets);
+#endif
+
+        uint32_t superseded = 0;
+        for(int universe = 0; universe < UNIVERSE_COUNT; universe++) {
+            frame_store_stats_t store_stats;
+            frame_store_get_statistics(&frame_store, universe, &store_stats);
+            superseded += store_stats.superseded;
+        }
+
+        espnow_transponder_stats_t stats;
+        espnow_transponder_get_statistics(&stats);
+        ESP_LOGI(TAG, "fec recovered:%llu unrecoverable:%llu filtered:%llu superseded:%u output_latency_max:%uus",
+            stats.rx_fec_recovered, stats.rx_fec_unrecoverable, stats.rx_filtered, superseded, latency_max_us);
+#if defined(SYNC_DELAY_US)
+        // Commits have a receive queue of their own, so they shouldn't wait behind universes
+        const uint64_t sync_packets = stats.rx_class_packets[ESPNOW_TRANSPONDER_CLASS_SYNC];
+        ESP_LOGI(TAG, "sync class packets:%llu dropped:%llu queued_avg:%lluus", sync_packets,
+            stats.rx_class_dropped[ESPNOW_TRANSPONDER_CLASS_SYNC],
+            sync_packets > 0 ? stats.rx_class_latency_us[ESPNOW_TRANSPONDER_CLASS_SYNC]/sync_packets : 0);
+#endif
+#if defined(RELAY)
+        ESP_LOGI(TAG, "relay relayed:%llu duplicates:%llu expired:%llu dropped:%llu",
+            stats.tx_relayed, stats.rx_relay_duplicate, stats.rx_relay_expired, stats.tx_relay_dropped);
+#endif
+        latency_max_us = 0;
+    }
+}
+
+//! \brief Forward Art-Net universes [0, UNIVERSE_COUNT) and E1.31 universes
+//! [1, UNIVERSE_COUNT], and report on them periodically
+void gateway_test() {
+    ESP_LOGI(TAG, "Starting gateway mode");
+
+    const artdmx_sender_config_t artdmx_config = {
+        .universe_count = UNIVERSE_COUNT,
+        .keyframe_interval = KEYFRAME_INTERVAL,
+        .timestamps = true,
+    };
+    artdmx_sender_init(&artdmx_config);
+
+    artnet_gateway_route_t routes[UNIVERSE_COUNT];
+    for(int universe = 0; universe < UNIVERSE_COUNT; universe++) {
+        routes[universe].port_address = universe;
+        routes[universe].sacn_universe = universe + 1;
+        routes[universe].universe = universe;
+    }
+
+    const artnet_gateway_config_t gateway_config = {
+        .routes = routes,
+        .route_count = UNIVERSE_COUNT,
+        .refresh_us = GATEWAY_REFRESH_US,
+        .merge_mode = DMX_MERGE_HTP,
+        .artnet_priority = E131_DEFAULT_PRIORITY,
+        .sacn = true,
+    };
+    ESP_ERROR_CHECK(artnet_gateway_init(&gateway_config));
+
+    wifi_config_t wifi_config = {};
+    strncpy((char *)wifi_config.sta.ssid, CONFIG_GATEWAY_WIFI_SSID, sizeof(wifi_config.sta.ssid));
+    strncpy((char *)wifi_config.sta.password, CONFIG_GATEWAY_WIFI_PASSWORD, sizeof(wifi_config.sta.password));
+    ESP_ERROR_CHECK(esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_config));
+    ESP_ERROR_CHECK(esp_wifi_connect());
+
+    ESP_ERROR_CHECK(artnet_gateway_start());
+
     while(true) {
         vTaskDelay(1000/portTICK_RATE_MS);
-        universe_stats_print();
+
+        for(int route = 0; route < UNIVERSE_COUNT; route++) {
+            artnet_gateway_route_stats_t stats;
+            artnet_gateway_get_route_statistics(route, &stats);
+            ESP_LOGI(TAG, "universe:%2i sources:%i in:%.1f/s out:%.1f/s coalesced:%llu fail:%llu latency_max:%uus",
+                route, stats.sources, stats.ingest_rate, stats.egress_rate, stats.coalesced, stats.send_fail,
+                stats.latency_max_us);
+        }
+
+        sender_status_print();
     }
 }
 
 void app_main()
 {
-    universe_stats_init();
+    ESP_ERROR_CHECK(frame_store_init(&frame_store, UNIVERSE_COUNT));
+    if(!telemetry_init(&telemetry, UNIVERSE_COUNT))
+        ESP_LOGE(TAG, "Could not allocate memory for telemetry");
+
+    const artdmx_receiver_config_t artdmx_config = {
+        .universe_count = UNIVERSE_COUNT,
+        .partial_policy = ARTDMX_PARTIAL_HOLD,
+        .callback = receive_frame,
+        .telemetry = &telemetry,
+#if defined(SYNC_DELAY_US) && !defined(ROLE_SENDER) && !defined(ROLE_GATEWAY)
+        .sync = true,
+#endif
+    };
+    artdmx_receiver_init(&artdmx_config);
+
+    espnow_transponder_config_t transponder_config = espnow_transponder_config_default;
+    transponder_config.compression = true;
+#if defined(ROLE_SENDER) || defined(ROLE_GATEWAY)
+    transponder_config.tx_framerate = FRAMERATE;
+    transponder_config.fec_k = 10;
+    transponder_config.fec_m = 2;
+
+    // Loss reports count packets before FEC, which covers a little raw loss
+    transponder_config.rate_control = true;
+    transponder_config.rate_control_loss_budget = 0.05;
+
+#if defined(TDMA_MASTER)
+    transponder_config.tdma = ESPNOW_TRANSPONDER_TDMA_MASTER;
+#elif defined(TDMA_SENDER)
+    transponder_config.tdma = ESPNOW_TRANSPONDER_TDMA_SENDER;
+#endif
 
-    espnow_transponder_init(&espnow_transponder_config_default);
-    espnow_transponder_register_callback(receive_packet);
+#if defined(RELAY_HOPS)
+    transponder_config.relay_ttl = RELAY_HOPS;
+#endif
+#endif
+#if defined(RELAY)
+    transponder_config.relay = true;
+#endif
+    espnow_transponder_init(&transponder_config);
+    espnow_transponder_register_callback(artdmx_receive);
 
-#if defined(ROLE_SENDER)
+#if defined(ROLE_GATEWAY)
+    gateway_test();
+
+#elif defined(ROLE_SENDER)
     transmitter_test();
 
 #else
+    // Drop packets for universes that aren't reported on as early as possible
+    for(int universe = 0; universe < UNIVERSE_COUNT; universe++)
+        espnow_transponder_subscribe(universe);
+    espnow_transponder_subscribe(ARTDMX_SYNC_UNIVERSE);
+
     receiver_test();
 #endif
 }
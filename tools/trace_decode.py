@@ -0,0 +1,278 @@
+#!/usr/bin/env python3
+"""Decode an ESP-NOW transponder pipeline trace
+
+Reads a dump from espnow_transponder_trace_dump(), either as a raw binary
+file or as a log in which the example printed it as 'trace:' lines of hex,
+and prints how long packets spent in each stage of the transmit and receive
+pipelines. It can also write the trace as Chrome trace JSON, which Perfetto
+(ui.perfetto.dev) and chrome://tracing can open.
+
+    tools/trace_decode.py dump.bin
+    tools/trace_decode.py --chrome trace.json monitor.log
+"""
+
+import argparse
+import json
+import re
+import struct
+import sys
+
+DUMP_MAGIC = 0x43525445
+DUMP_VERSION = 1
+HEADER = struct.Struct('<IBBBBIII')
+RECORD = struct.Struct('<IBBBBHHI')
+KEY_NONE = 0xFFFF
+
+EVENTS = {
+    1: 'rx_callback',
+    2: 'rx_queued',
+    3: 'rx_dequeued',
+    4: 'rx_dispatch',
+    5: 'rx_done',
+    6: 'rx_drop',
+    7: 'rx_recovered',
+    16: 'tx_send',
+    17: 'tx_queued',
+    18: 'tx_dequeued',
+    19: 'tx_transport',
+    20: 'tx_transport_done',
+    21: 'tx_complete',
+    22: 'tx_drop',
+    23: 'tx_frame_end',
+    32: 'trigger',
+}
+
+DROP_REASONS = {
+    1: 'filtered',
+    2: 'short',
+    3: 'bad_crc',
+    4: 'bad_length',
+    5: 'no_buffer',
+    6: 'queue_overflow',
+    7: 'decompress',
+    8: 'fec_unrecoverable',
+    9: 'queue_full',
+    10: 'send_fail',
+    11: 'duplicate',
+    12: 'relay_limited',
+}
+
+# Stages of each pipeline, as (name, start event, end event)
+RX_STAGES = [
+    ('wifi callback', 'rx_callback', 'rx_queued'),
+    ('queue wait', 'rx_queued', 'rx_dequeued'),
+    ('decode', 'rx_dequeued', 'rx_dispatch'),
+    ('rx_callback', 'rx_dispatch', 'rx_done'),
+    ('total', 'rx_callback', 'rx_done'),
+]
+
+TX_STAGES = [
+    ('encode', 'tx_send', 'tx_queued'),
+    ('queue wait', 'tx_queued', 'tx_dequeued'),
+    ('pacing', 'tx_dequeued', 'tx_transport'),
+    ('esp_now_send', 'tx_transport', 'tx_transport_done'),
+    ('completion', 'tx_transport_done', 'tx_complete'),
+    ('total', 'tx_send', 'tx_complete'),
+]
+
+
+def read_dump(path):
+    """Read a dump, from a binary file or from hex 'trace:' log lines"""
+    with open(path, 'rb') as file:
+        data = file.read()
+
+    if len(data) >= 4 and struct.unpack_from('<I', data)[0] == DUMP_MAGIC:
+        return data
+
+    text = data.decode('utf-8', errors='replace')
+    hex_data = ''.join(re.findall(r'trace:\s*([0-9a-fA-F]+)', text))
+    if not hex_data:
+        sys.exit('%s: no trace dump found' % path)
+
+    return bytes.fromhex(hex_data)
+
+
+def parse_dump(data):
+    """Split a dump into its header and records, with unwrapped times in microseconds"""
+    magic, version, record_size, triggered, _, ticks_per_us, count, reason = HEADER.unpack_from(data)
+    if magic != DUMP_MAGIC or version != DUMP_VERSION or record_size != RECORD.size:
+        sys.exit('Not a version %i trace dump' % DUMP_VERSION)
+
+    header = {
+        'triggered': bool(triggered),
+        'ticks_per_us': ticks_per_us or 1,
+        'trigger_reason': reason,
+    }
+
+    records = []
+    ticks = None
+    last = 0
+    for index in range(count):
+        offset = HEADER.size + index*RECORD.size
+        if offset + RECORD.size > len(data):
+            break
+
+        time, event, core, sequence, depth, key, packet_id, value = RECORD.unpack_from(data, offset)
+
+        # Time stamps wrap; records are in order, give or take a few racing
+        # writers, so take the shortest step from the previous one
+        step = (time - last) & 0xFFFFFFFF
+        if step >= 0x80000000:
+            step -= 0x100000000
+        ticks = time if ticks is None else ticks + step
+        last = time
+
+        records.append({
+            'time_us': ticks/header['ticks_per_us'],
+            'event': EVENTS.get(event, 'event_%i' % event),
+            'core': core,
+            'sequence': sequence,
+            'queue_depth': depth,
+            'key': key,
+            'id': packet_id,
+            'value': value,
+        })
+
+    if records:
+        start = min(record['time_us'] for record in records)
+        for record in records:
+            record['time_us'] -= start
+
+    return header, records
+
+
+def group_packets(records):
+    """Collect the events of each packet, by packet id"""
+    packets = {}
+    completions = []
+
+    for record in records:
+        if record['event'] == 'tx_complete':
+            completions.append(record)
+            continue
+        if record['event'] in ('tx_frame_end', 'trigger'):
+            continue
+
+        packet = packets.setdefault((record['event'][:2], record['id']), {'events': {}})
+        packet['events'].setdefault(record['event'], record)
+        if record['key'] != KEY_NONE:
+            packet['key'] = record['key']
+            packet['sequence'] = record['sequence']
+
+    # Send completions carry no id; ESP-NOW completes packets in the order
+    # they were handed to it
+    sent = sorted((packet for (direction, _), packet in packets.items()
+                   if direction == 'tx' and 'tx_transport_done' in packet['events']
+                   and packet['events']['tx_transport_done']['value'] == 0),
+                  key=lambda packet: packet['events']['tx_transport_done']['time_us'])
+    for packet, completion in zip(sent, completions):
+        packet['events']['tx_complete'] = completion
+
+    return packets
+
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(fraction*len(values)))]
+
+
+def print_stages(title, direction, stages, packets):
+    print('%s pipeline (us)' % title)
+    print('  %-14s %7s %9s %9s %9s %9s' % ('stage', 'count', 'p50', 'p99', 'max', 'mean'))
+
+    for name, start, end in stages:
+        durations = sorted(packet['events'][end]['time_us'] - packet['events'][start]['time_us']
+                           for (packet_direction, _), packet in packets.items()
+                           if packet_direction == direction
+                           and start in packet['events'] and end in packet['events'])
+        if not durations:
+            continue
+
+        print('  %-14s %7i %9.1f %9.1f %9.1f %9.1f' % (
+            name, len(durations), percentile(durations, 0.5), percentile(durations, 0.99),
+            durations[-1], sum(durations)/len(durations)))
+
+
+def print_summary(header, records, packets):
+    print('%i records over %.1f ms' % (len(records), records[-1]['time_us']/1000 if records else 0))
+    if header['triggered']:
+        reason = header['trigger_reason']
+        print('Frozen by trigger: %s' % DROP_REASONS.get(reason, 'user %#x' % reason))
+
+    drops = {}
+    for record in records:
+        if record['event'] in ('rx_drop', 'tx_drop'):
+            name = '%s %s' % (record['event'][:2], DROP_REASONS.get(record['value'], record['value']))
+            drops[name] = drops.get(name, 0) + 1
+    for name, count in sorted(drops.items()):
+        print('  dropped, %s: %i' % (name, count))
+
+    print()
+    print_stages('Receive', 'rx', RX_STAGES, packets)
+    print()
+    print_stages('Transmit', 'tx', TX_STAGES, packets)
+
+
+def chrome_trace(header, records, packets):
+    """Build Chrome trace events: one track per stage, instant events for drops and triggers"""
+    events = []
+
+    for direction, stages, pid in (('rx', RX_STAGES, 1), ('tx', TX_STAGES, 2)):
+        events.append({'ph': 'M', 'name': 'process_name', 'pid': pid,
+                       'args': {'name': 'receive' if direction == 'rx' else 'transmit'}})
+
+        for tid, (name, start, end) in enumerate(stages):
+            if name == 'total':
+                continue
+
+            events.append({'ph': 'M', 'name': 'thread_name', 'pid': pid, 'tid': tid,
+                           'args': {'name': name}})
+
+            for (packet_direction, packet_id), packet in packets.items():
+                if packet_direction != direction or start not in packet['events'] or end not in packet['events']:
+                    continue
+
+                begin = packet['events'][start]
+                events.append({
+                    'ph': 'X',
+                    'name': 'key %s seq %s' % (packet.get('key', '-'), packet.get('sequence', '-')),
+                    'pid': pid,
+                    'tid': tid,
+                    'ts': begin['time_us'],
+                    'dur': packet['events'][end]['time_us'] - begin['time_us'],
+                    'args': {'id': packet_id, 'core': begin['core'], 'queue_depth': begin['queue_depth']},
+                })
+
+    for record in records:
+        if record['event'] in ('rx_drop', 'tx_drop', 'trigger'):
+            events.append({
+                'ph': 'i',
+                's': 'g',
+                'name': '%s %s' % (record['event'], DROP_REASONS.get(record['value'], record['value'])),
+                'ts': record['time_us'],
+                'pid': 1 if record['event'] == 'rx_drop' else 2,
+                'args': {'id': record['id'], 'key': record['key'], 'core': record['core']},
+            })
+        elif record['event'] == 'tx_frame_end':
+            events.append({'ph': 'i', 's': 'p', 'name': 'frame end', 'ts': record['time_us'], 'pid': 2})
+
+    return {'traceEvents': events, 'displayTimeUnit': 'ns'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode an ESP-NOW transponder pipeline trace')
+    parser.add_argument('dump', help='binary dump, or a log containing trace: lines')
+    parser.add_argument('--chrome', metavar='FILE', help='write Chrome trace / Perfetto JSON to FILE')
+    args = parser.parse_args()
+
+    header, records = parse_dump(read_dump(args.dump))
+    packets = group_packets(records)
+
+    print_summary(header, records, packets)
+
+    if args.chrome:
+        with open(args.chrome, 'w') as file:
+            json.dump(chrome_trace(header, records, packets), file)
+
+
+if __name__ == '__main__':
+    main()